@@ -27,7 +27,8 @@ LOCAL_SRC_FILES := \
 	src/nica/inifile.c \
 	src/nica/hashmap.c \
 	src/nica/b64enc.c \
-	src/common.c
+	src/common.c \
+	src/sampling.c
 
 LOCAL_C_INCLUDES := \
 	$(LOCAL_PATH) \
@@ -89,6 +90,8 @@ LOCAL_PROPRIETARY_MODULE := true
 LOCAL_SRC_FILES := \
 	src/probe.c \
 	src/telemdaemon.c \
+	src/staginglog.c \
+	src/ringbuf.c \
 	src/journal/journal.c
 
 LOCAL_C_INCLUDES := \
@@ -99,6 +102,7 @@ LOCAL_C_INCLUDES := \
 LOCAL_SHARED_LIBRARIES := \
 	$(CURL_LIBS) \
 	libcurl \
+	libz \
 	libtelem_shared \
 	libtelemetry \
 	libc \
@@ -127,7 +131,20 @@ LOCAL_SRC_FILES := \
 	src/journal/journal.c \
 	src/spool.c \
 	src/retention.c \
-	src/iorecord.c
+	src/iorecord.c \
+	src/staginglog.c \
+	src/ringbuf.c \
+	src/postmulti.c \
+	src/postbatch.c \
+	src/compress.c \
+	src/retrysched.c \
+	src/classlimit.c \
+	src/poststate.c \
+	src/spoolusage.c \
+	src/destination.c \
+	src/aggregate.c \
+	src/recordio.c \
+	src/stagepool.c
 
 LOCAL_C_INCLUDES := \
 	$(LOCAL_PATH) \
@@ -0,0 +1,334 @@
+/*
+ * This program is part of the Clear Linux Project
+ *
+ * Copyright 2019 Intel Corporation
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms and conditions of the GNU Lesser General Public License, as
+ * published by the Free Software Foundation; either version 2.1 of the License,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU Lesser General Public License for more
+ * details.
+ */
+
+#define _GNU_SOURCE
+#include <ctype.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "aggregate.h"
+#include "common.h"
+#include "log.h"
+#include "sampling.h"
+
+static void free_aggregate(void *p)
+{
+        struct aggregate *aggregate = p;
+
+        if (aggregate) {
+                free(aggregate->data);
+                free(aggregate);
+        }
+}
+
+/* Parses a prefix:seconds entry */
+static int add_window(NcHashmap *windows, char *entry)
+{
+        char *seconds;
+        char *end = NULL;
+        char *key;
+        long window;
+        size_t len;
+
+        while (isspace(*entry)) {
+                entry++;
+        }
+        len = strlen(entry);
+        while (len > 0 && isspace(entry[len - 1])) {
+                entry[--len] = '\0';
+        }
+        if (len == 0) {
+                return 0;
+        }
+
+        seconds = strchr(entry, ':');
+        if (!seconds || seconds == entry) {
+                return -EINVAL;
+        }
+        *seconds++ = '\0';
+        errno = 0;
+        window = strtol(seconds, &end, 10);
+        if (errno != 0 || end == seconds || *end != '\0' || window <= 0 ||
+            window > TM_AGGREGATE_MAX_WINDOW) {
+                return -EINVAL;
+        }
+
+        len = strlen(entry);
+        while (len > 1 && entry[len - 1] == '/') {
+                entry[--len] = '\0';
+        }
+        if (len > MAX_CLASS_LENGTH) {
+                return -EINVAL;
+        }
+        key = strdup(entry);
+        if (!key || !nc_hashmap_put(windows, key, NC_HASH_VALUE(window))) {
+                free(key);
+                return -ENOMEM;
+        }
+
+        return 1;
+}
+
+int aggregator_init(struct aggregator *agg, const char *spec)
+{
+        char *list;
+        char *entry;
+        char *saveptr = NULL;
+        int count = 0;
+
+        agg->windows = NULL;
+        agg->held = NULL;
+        if (!spec || spec[0] == '\0') {
+                return 0;
+        }
+
+        list = strdup(spec);
+        agg->windows = nc_hashmap_new_full(nc_string_hash, nc_string_compare, free, NULL);
+        agg->held = nc_hashmap_new_full(nc_string_hash, nc_string_compare, free,
+                                        free_aggregate);
+        if (!list || !agg->windows || !agg->held) {
+                free(list);
+                aggregator_free(agg);
+                return -ENOMEM;
+        }
+
+        for (entry = strtok_r(list, ",", &saveptr); entry;
+             entry = strtok_r(NULL, ",", &saveptr)) {
+                int ret = add_window(agg->windows, entry);
+
+                if (ret < 0) {
+                        free(list);
+                        aggregator_free(agg);
+                        return ret;
+                }
+                count += ret;
+        }
+        free(list);
+
+        if (count == 0) {
+                aggregator_free(agg);
+        }
+
+        return count;
+}
+
+/* FNV-1a of the payload */
+static uint64_t payload_digest(const char *body, size_t size)
+{
+        uint64_t hash = 14695981039346656037ULL;
+
+        for (size_t i = 0; i < size; i++) {
+                hash ^= (unsigned char)body[i];
+                hash *= 1099511628211ULL;
+        }
+
+        return hash;
+}
+
+/* Copies record data with the newlines parsing replaced */
+static char *copy_record_data(struct staged_record *record, const char *data,
+                              size_t size)
+{
+        char *copy = malloc(size + 1);
+
+        if (!copy) {
+                telem_log(LOG_ERR, "Unable to allocate memory, exiting\n");
+                exit(EXIT_FAILURE);
+        }
+        memcpy(copy, data, size);
+        copy[size] = '\0';
+        for (int i = 0; i < NUM_HEADERS; i++) {
+                copy[(size_t)(record->headers[i] - data) + strlen(record->headers[i])] = '\n';
+        }
+
+        return copy;
+}
+
+bool aggregator_add(struct aggregator *agg, struct staged_record *record,
+                    const char *data, size_t size, time_t staged_time)
+{
+        struct aggregate *aggregate;
+        const char *classification;
+        size_t len;
+        void *window;
+        char *key;
+
+        if (!agg->windows || record->cfg_file || record->streamed ||
+            record->occurrences > 0) {
+                return false;
+        }
+
+        classification = strchr(record->headers[TM_CLASSIFICATION], ':');
+        if (!classification) {
+                return false;
+        }
+        classification++;
+        while (*classification == ' ') {
+                classification++;
+        }
+        len = strcspn(classification, "\r\n");
+        window = class_prefix_get(agg->windows, classification, len);
+        if (!window) {
+                return false;
+        }
+
+        if (asprintf(&key, "%.*s %016" PRIx64, (int)len, classification,
+                     payload_digest(record->body, record->body_size)) == -1) {
+                telem_log(LOG_ERR, "Unable to allocate memory, exiting\n");
+                exit(EXIT_FAILURE);
+        }
+
+        aggregate = nc_hashmap_get(agg->held, key);
+        if (aggregate) {
+                /* A repeat, only counted */
+                aggregate->count++;
+                if (staged_time > aggregate->last) {
+                        aggregate->last = staged_time;
+                }
+                free(key);
+                return true;
+        }
+        if (nc_hashmap_size(agg->held) >= TM_AGGREGATE_MAX_HELD) {
+                free(key);
+                return false;
+        }
+
+        aggregate = calloc(1, sizeof(struct aggregate));
+        if (!aggregate) {
+                telem_log(LOG_ERR, "Unable to allocate memory, exiting\n");
+                exit(EXIT_FAILURE);
+        }
+        aggregate->data = copy_record_data(record, data, size);
+        aggregate->size = size;
+        aggregate->head = (size_t)(record->headers[0] - data);
+        aggregate->count = 1;
+        aggregate->first = aggregate->last = staged_time;
+        aggregate->due = time(NULL) + (time_t)NC_UNHASH_VALUE(window);
+        if (!nc_hashmap_put(agg->held, key, aggregate)) {
+                telem_log(LOG_ERR, "Unable to allocate memory, exiting\n");
+                exit(EXIT_FAILURE);
+        }
+
+        return true;
+}
+
+time_t aggregator_next_due(struct aggregator *agg)
+{
+        NcHashmapIter iter;
+        void *value;
+        time_t due = 0;
+
+        if (!agg->held) {
+                return 0;
+        }
+        nc_hashmap_iter_init(agg->held, &iter);
+        while (nc_hashmap_iter_next(&iter, NULL, &value)) {
+                struct aggregate *aggregate = value;
+
+                if (due == 0 || aggregate->due < due) {
+                        due = aggregate->due;
+                }
+        }
+
+        return due;
+}
+
+/* Processes a record held, with an AGG line if it stands for several */
+static void emit_aggregate(struct aggregate *aggregate, aggregate_fn fn, void *arg)
+{
+        char line[64];
+        char *data;
+        size_t len;
+
+        if (aggregate->count == 1) {
+                fn(aggregate->data, aggregate->size, aggregate->first, arg);
+                return;
+        }
+
+        len = (size_t)snprintf(line, sizeof(line), AGG_PREFIX "%d %lld %lld\n",
+                               aggregate->count, (long long)aggregate->first,
+                               (long long)aggregate->last);
+        data = malloc(aggregate->size + len + 1);
+        if (!data) {
+                telem_log(LOG_ERR, "Unable to allocate memory, exiting\n");
+                exit(EXIT_FAILURE);
+        }
+        memcpy(data, aggregate->data, aggregate->head);
+        memcpy(data + aggregate->head, line, len);
+        memcpy(data + aggregate->head + len, aggregate->data + aggregate->head,
+               aggregate->size - aggregate->head);
+        data[aggregate->size + len] = '\0';
+
+        fn(data, aggregate->size + len, aggregate->first, arg);
+        free(data);
+}
+
+int aggregator_flush(struct aggregator *agg, time_t now, bool all,
+                     aggregate_fn fn, void *arg)
+{
+        NcHashmapIter iter;
+        void *key, *value;
+        void **taken;
+        size_t count = 0;
+
+        if (!agg->held || nc_hashmap_size(agg->held) == 0) {
+                return 0;
+        }
+
+        /* Taken out of the map first, fn may add records to it */
+        taken = malloc((size_t)nc_hashmap_size(agg->held) * sizeof(void *));
+        if (!taken) {
+                telem_log(LOG_ERR, "Unable to allocate memory, exiting\n");
+                exit(EXIT_FAILURE);
+        }
+        nc_hashmap_iter_init(agg->held, &iter);
+        while (nc_hashmap_iter_next(&iter, &key, &value)) {
+                if (all || ((struct aggregate *)value)->due <= now) {
+                        taken[count++] = key;
+                }
+        }
+        for (size_t i = 0; i < count; i++) {
+                key = taken[i];
+                taken[i] = nc_hashmap_get(agg->held, key);
+                nc_hashmap_steal(agg->held, key);
+                free(key);
+        }
+        for (size_t i = 0; i < count; i++) {
+                emit_aggregate(taken[i], fn, arg);
+                free_aggregate(taken[i]);
+        }
+        free(taken);
+
+        return (int)count;
+}
+
+void aggregator_free(struct aggregator *agg)
+{
+        if (agg->windows) {
+                nc_hashmap_free(agg->windows);
+                agg->windows = NULL;
+        }
+        if (agg->held) {
+                nc_hashmap_free(agg->held);
+                agg->held = NULL;
+        }
+}
+
+/* vi: set ts=8 sw=8 sts=4 et tw=80 cino=(0: */
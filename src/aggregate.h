@@ -0,0 +1,133 @@
+/*
+ * This program is part of the Clear Linux Project
+ *
+ * Copyright 2019 Intel Corporation
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms and conditions of the GNU Lesser General Public License, as
+ * published by the Free Software Foundation; either version 2.1 of the License,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU Lesser General Public License for more
+ * details.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <time.h>
+
+#include "nica/hashmap.h"
+#include "iorecord.h"
+
+/*
+ * Aggregation of repeated records, from class_aggregation: a record of a
+ * classification with an aggregation window is held for that window, and
+ * the records staged meanwhile with the same classification and payload are
+ * only counted. Once the window is over the first record is processed as
+ * usual, with an AGG line giving how many records it stands for and when
+ * the first and last of them were staged. The server is sent these in the
+ * OCCURRENCES_HEADER and OCCURRENCE_TIMES_HEADER headers.
+ *
+ * Held records are only kept in memory, at most TM_AGGREGATE_MAX_HELD at
+ * once, they are processed when the daemon exits or reloads its
+ * configuration.
+ */
+#define OCCURRENCES_HEADER "X-Telemetry-Occurrences"
+#define OCCURRENCE_TIMES_HEADER "X-Telemetry-Occurrence-Times"
+#define TM_AGGREGATE_MAX_HELD 1024
+#define TM_AGGREGATE_MAX_WINDOW 3600
+
+/* A record held, with the repeats counted since */
+struct aggregate {
+        /* record data in the staged record layout */
+        char *data;
+        size_t size;
+        /* offset of the first header in data */
+        size_t head;
+        int count;
+        time_t first;
+        time_t last;
+        time_t due;
+};
+
+struct aggregator {
+        /* windows in seconds by classification prefix, NULL without any */
+        NcHashmap *windows;
+        /* held records by classification and payload digest */
+        NcHashmap *held;
+};
+
+/**
+ * Function processing a record once its aggregation window is over
+ *
+ * @param data The record in the staged record layout, null terminated and
+ *     released once the function returns
+ * @param size Size of data
+ * @param staged_time Time the first of the records it stands for was staged
+ * @param arg Argument passed to aggregator_flush()
+ */
+typedef void (*aggregate_fn)(char *data, size_t size, time_t staged_time, void *arg);
+
+/**
+ * Parses the aggregation windows of classifications, a comma separated list
+ * of prefix:seconds entries
+ *
+ * @param agg The aggregator
+ * @param spec The list, may be empty
+ *
+ * @return the number of windows, or -EINVAL if an entry is invalid, or
+ *     -ENOMEM
+ */
+int aggregator_init(struct aggregator *agg, const char *spec);
+
+/**
+ * Holds a record for its aggregation window, or counts it as a repeat of a
+ * record held. Records with their own configuration file, streamed
+ * payloads or an AGG line already are not aggregated.
+ *
+ * @param agg The aggregator
+ * @param record The record, parsed from data
+ * @param data The record data, copied if the record is held
+ * @param size Size of data up to the end of the payload
+ * @param staged_time Time the record was staged
+ *
+ * @return true if the record was taken, false if it is to be processed now
+ */
+bool aggregator_add(struct aggregator *agg, struct staged_record *record,
+                    const char *data, size_t size, time_t staged_time);
+
+/**
+ * Gets when the window of a record held is over first
+ *
+ * @param agg The aggregator
+ *
+ * @return the time, or 0 if no record is held
+ */
+time_t aggregator_next_due(struct aggregator *agg);
+
+/**
+ * Processes the records held of which the window is over
+ *
+ * @param agg The aggregator
+ * @param now Current time
+ * @param all true to process all of the records held
+ * @param fn Function processing each record
+ * @param arg Argument passed to fn
+ *
+ * @return the number of records processed
+ */
+int aggregator_flush(struct aggregator *agg, time_t now, bool all,
+                     aggregate_fn fn, void *arg);
+
+/**
+ * Releases the windows and the records held, which are lost
+ *
+ * @param agg The aggregator
+ */
+void aggregator_free(struct aggregator *agg);
+
+/* vi: set ts=8 sw=8 sts=4 et tw=80 cino=(0: */
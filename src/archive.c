@@ -0,0 +1,694 @@
+/*
+ * This program is part of the Clear Linux Project
+ *
+ * Copyright 2019 Intel Corporation
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms and conditions of the GNU Lesser General Public License, as
+ * published by the Free Software Foundation; either version 2.1 of the License,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU Lesser General Public License for more
+ * details.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <libgen.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <zlib.h>
+
+#include "archive.h"
+#include "compress.h"
+#include "staginglog.h"
+#include "log.h"
+
+/* A member being archived or imported */
+struct member {
+        struct archive_entry entry;
+        /* file the member is read from, NULL if data is already set */
+        char *path;
+        /* the member, then its compressed bytes when exporting */
+        char *data;
+        int error;
+};
+
+struct member_list {
+        struct member *members;
+        int count;
+        int alloc;
+};
+
+/* Members handed out to the threads of a round */
+struct round {
+        struct member *members;
+        int next;
+        int end;
+        /* archive read from when importing, -1 when exporting */
+        int fd;
+        pthread_mutex_t lock;
+};
+
+int archive_threads(void)
+{
+        long cores = sysconf(_SC_NPROCESSORS_ONLN);
+
+        if (cores < 1) {
+                return 1;
+        }
+
+        return cores > ARCHIVE_MAX_THREADS ? ARCHIVE_MAX_THREADS : (int)cores;
+}
+
+static int write_full(int fd, const char *data, size_t size)
+{
+        while (size > 0) {
+                ssize_t len = write(fd, data, size);
+
+                if (len < 0) {
+                        if (errno == EINTR) {
+                                continue;
+                        }
+                        return -errno;
+                }
+                data += len;
+                size -= (size_t)len;
+        }
+
+        return 0;
+}
+
+static int pread_full(int fd, void *buf, size_t size, off_t offset)
+{
+        char *p = buf;
+
+        while (size > 0) {
+                ssize_t len = pread(fd, p, size, offset);
+
+                if (len < 0) {
+                        if (errno == EINTR) {
+                                continue;
+                        }
+                        return -errno;
+                }
+                if (len == 0) {
+                        return -EIO;
+                }
+                p += len;
+                size -= (size_t)len;
+                offset += len;
+        }
+
+        return 0;
+}
+
+static int read_file(const char *path, char **data, size_t *size)
+{
+        struct stat sb;
+        int ret;
+        int fd;
+
+        *data = NULL;
+        *size = 0;
+        fd = open(path, O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+                return -errno;
+        }
+        if (fstat(fd, &sb) != 0) {
+                ret = -errno;
+                close(fd);
+                return ret;
+        }
+
+        *size = (size_t)sb.st_size;
+        *data = malloc(*size + 1);
+        if (!*data) {
+                close(fd);
+                return -ENOMEM;
+        }
+        ret = pread_full(fd, *data, *size, 0);
+        close(fd);
+        if (ret < 0) {
+                free(*data);
+                *data = NULL;
+        }
+
+        return ret;
+}
+
+static struct member *add_member(struct member_list *list, uint32_t type,
+                                 const char *name, int64_t mtime, size_t size)
+{
+        struct member *m;
+
+        if (strlen(name) >= ARCHIVE_NAME_MAX) {
+                return NULL;
+        }
+        if (list->count == list->alloc) {
+                int alloc = list->alloc ? list->alloc * 2 : 64;
+                struct member *members = realloc(list->members,
+                                                 (size_t)alloc * sizeof(*members));
+
+                if (!members) {
+                        telem_log(LOG_ERR, "Unable to allocate memory, exiting\n");
+                        exit(EXIT_FAILURE);
+                }
+                list->members = members;
+                list->alloc = alloc;
+        }
+
+        m = &list->members[list->count++];
+        memset(m, 0, sizeof(*m));
+        m->entry.type = type;
+        m->entry.mtime = mtime;
+        m->entry.size = size;
+        strcpy(m->entry.name, name);
+
+        return m;
+}
+
+static void free_members(struct member_list *list)
+{
+        for (int i = 0; i < list->count; i++) {
+                free(list->members[i].path);
+                free(list->members[i].data);
+        }
+        free(list->members);
+}
+
+static void add_file(struct member_list *list, uint32_t type, const char *path,
+                     const char *name)
+{
+        struct member *m;
+        struct stat sb;
+
+        if (lstat(path, &sb) != 0 || !S_ISREG(sb.st_mode)) {
+                return;
+        }
+        if (sb.st_size > ARCHIVE_MAX_MEMBER) {
+                telem_log(LOG_WARNING, "Not archiving %s, too large\n", path);
+                return;
+        }
+
+        m = add_member(list, type, name, (int64_t)sb.st_mtime, (size_t)sb.st_size);
+        if (m && !(m->path = strdup(path))) {
+                telem_log(LOG_ERR, "Unable to allocate memory, exiting\n");
+                exit(EXIT_FAILURE);
+        }
+}
+
+/* Adds the regular files of a directory, leaving out the hidden ones: the
+ * staging log and the copies kept for the destinations in the spool */
+static int add_directory(struct member_list *list, uint32_t type, const char *dir)
+{
+        struct dirent *entry;
+        DIR *d;
+
+        d = opendir(dir);
+        if (!d) {
+                return (errno == ENOENT) ? 0 : -errno;
+        }
+
+        while ((entry = readdir(d)) != NULL) {
+                char *path = NULL;
+
+                if (entry->d_name[0] == '.') {
+                        continue;
+                }
+                if (asprintf(&path, "%s/%s", dir, entry->d_name) < 0) {
+                        telem_log(LOG_ERR, "Unable to allocate memory, exiting\n");
+                        exit(EXIT_FAILURE);
+                }
+                add_file(list, type, path, entry->d_name);
+                free(path);
+        }
+        closedir(d);
+
+        return 0;
+}
+
+/* Adds a record of the staging log, see staging_log_record_fn */
+static void add_staged_record(char *data, size_t size, time_t timestamp, void *arg)
+{
+        struct member_list *list = arg;
+        char name[ARCHIVE_NAME_MAX];
+        struct member *m;
+
+        snprintf(name, sizeof(name), "%s%d", STAGING_LOG_SEGMENT_PREFIX, list->count);
+        m = add_member(list, ARCHIVE_RECORD, name, (int64_t)timestamp, size);
+        if (!(m->data = malloc(size + 1))) {
+                telem_log(LOG_ERR, "Unable to allocate memory, exiting\n");
+                exit(EXIT_FAILURE);
+        }
+        memcpy(m->data, data, size + 1);
+}
+
+static int collect_members(struct member_list *list,
+                           const struct archive_sources *sources)
+{
+        char *path = NULL;
+        int ret;
+
+        if (sources->spool_dir) {
+                if ((ret = add_directory(list, ARCHIVE_RECORD, sources->spool_dir)) < 0) {
+                        return ret;
+                }
+                if (asprintf(&path, "%s/%s", sources->spool_dir, STAGING_LOG_DIR) < 0) {
+                        return -ENOMEM;
+                }
+                ret = staging_log_read(path, add_staged_record, list);
+                free(path);
+                if (ret < 0) {
+                        return ret;
+                }
+        }
+
+        if (sources->journal_file) {
+                char *copy = strdup(sources->journal_file);
+
+                if (!copy || asprintf(&path, "%s.idx", sources->journal_file) < 0) {
+                        free(copy);
+                        return -ENOMEM;
+                }
+                add_file(list, ARCHIVE_JOURNAL, sources->journal_file, basename(copy));
+                free(copy);
+                copy = strdup(path);
+                if (!copy) {
+                        free(path);
+                        return -ENOMEM;
+                }
+                add_file(list, ARCHIVE_JOURNAL, path, basename(copy));
+                free(copy);
+                free(path);
+        }
+
+        if (sources->retention_dir) {
+                return add_directory(list, ARCHIVE_RETAINED, sources->retention_dir);
+        }
+
+        return 0;
+}
+
+static void deflate_member(struct member *m)
+{
+        char *out = NULL;
+        size_t out_size;
+
+        if (m->path) {
+                size_t size = 0;
+
+                if ((m->error = read_file(m->path, &m->data, &size)) < 0) {
+                        return;
+                }
+                /* The file may have changed since it was listed */
+                m->entry.size = size;
+        }
+
+        m->entry.crc = (uint32_t)crc32(0, (const Bytef *)m->data, (uInt)m->entry.size);
+        m->error = gzip_compress(m->data, (size_t)m->entry.size, &out, &out_size);
+        free(m->data);
+        m->data = out;
+        m->entry.stored = out_size;
+}
+
+static void inflate_member(int fd, struct member *m)
+{
+        char *stored = malloc((size_t)m->entry.stored + 1);
+
+        if (!stored) {
+                m->error = -ENOMEM;
+                return;
+        }
+
+        m->error = pread_full(fd, stored, (size_t)m->entry.stored, (off_t)m->entry.offset);
+        if (m->error == 0) {
+                m->error = gzip_decompress(stored, (size_t)m->entry.stored,
+                                           (size_t)m->entry.size, &m->data);
+        }
+        if (m->error == 0 &&
+            crc32(0, (const Bytef *)m->data, (uInt)m->entry.size) != m->entry.crc) {
+                m->error = -EIO;
+        }
+        free(stored);
+}
+
+static void *run_round(void *arg)
+{
+        struct round *round = arg;
+
+        while (true) {
+                int i;
+
+                pthread_mutex_lock(&round->lock);
+                i = round->next++;
+                pthread_mutex_unlock(&round->lock);
+                if (i >= round->end) {
+                        break;
+                }
+
+                if (round->fd < 0) {
+                        deflate_member(&round->members[i]);
+                } else {
+                        inflate_member(round->fd, &round->members[i]);
+                }
+        }
+
+        return NULL;
+}
+
+/* Takes members from start as long as they fit in a round, at least one */
+static int round_end(struct member *members, int start, int count)
+{
+        uint64_t bytes = members[start].entry.size;
+        int end = start + 1;
+
+        while (end < count && bytes + members[end].entry.size <= ARCHIVE_ROUND_SIZE) {
+                bytes += members[end].entry.size;
+                end++;
+        }
+
+        return end;
+}
+
+/* Compresses, or decompresses from fd, members start to end - 1, the
+ * calling thread taking its share */
+static void run_threads(struct member *members, int start, int end, int fd,
+                        int threads)
+{
+        struct round round = { members, start, end, fd, PTHREAD_MUTEX_INITIALIZER };
+        pthread_t ids[ARCHIVE_MAX_THREADS];
+        int started = 0;
+
+        if (threads > end - start) {
+                threads = end - start;
+        }
+        for (int i = 1; i < threads; i++) {
+                if (pthread_create(&ids[started], NULL, run_round, &round) != 0) {
+                        /* The threads started do the work */
+                        break;
+                }
+                started++;
+        }
+
+        run_round(&round);
+        for (int i = 0; i < started; i++) {
+                pthread_join(ids[i], NULL);
+        }
+        pthread_mutex_destroy(&round.lock);
+}
+
+int archive_export(const char *path, const struct archive_sources *sources,
+                   int threads)
+{
+        struct member_list list = { 0 };
+        struct archive_header header = { ARCHIVE_MAGIC, ARCHIVE_VERSION, 0, 0 };
+        struct archive_entry *entries = NULL;
+        uint64_t offset = sizeof(header);
+        char *tmp = NULL;
+        int fd = -1;
+        int ret;
+
+        if ((ret = collect_members(&list, sources)) < 0) {
+                goto out;
+        }
+
+        entries = calloc((size_t)list.count + 1, sizeof(*entries));
+        if (!entries || asprintf(&tmp, "%s.tmp", path) < 0) {
+                tmp = NULL;
+                ret = -ENOMEM;
+                goto out;
+        }
+        fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, S_IRUSR | S_IWUSR);
+        if (fd < 0) {
+                ret = -errno;
+                goto out;
+        }
+        /* Not pointing to an index until it is written */
+        if ((ret = write_full(fd, (const char *)&header, sizeof(header))) < 0) {
+                goto out_unlink;
+        }
+
+        for (int start = 0, end; start < list.count; start = end) {
+                end = round_end(list.members, start, list.count);
+                run_threads(list.members, start, end, -1, threads);
+
+                for (int i = start; i < end; i++) {
+                        struct member *m = &list.members[i];
+
+                        if (m->error == -ENOENT) {
+                                /* Sent and removed meanwhile */
+                                continue;
+                        } else if (m->error < 0) {
+                                ret = m->error;
+                                goto out_unlink;
+                        }
+                        ret = write_full(fd, m->data, (size_t)m->entry.stored);
+                        if (ret < 0) {
+                                goto out_unlink;
+                        }
+                        m->entry.offset = offset;
+                        offset += m->entry.stored;
+                        entries[header.count++] = m->entry;
+                        free(m->data);
+                        m->data = NULL;
+                }
+        }
+
+        ret = write_full(fd, (const char *)entries, header.count * sizeof(*entries));
+        if (ret < 0) {
+                goto out_unlink;
+        }
+        header.index_offset = offset;
+        if (pwrite(fd, &header, sizeof(header), 0) != sizeof(header) || fsync(fd) != 0) {
+                ret = -errno;
+                goto out_unlink;
+        }
+        if (close(fd) != 0 || rename(tmp, path) != 0) {
+                fd = -1;
+                ret = -errno;
+                goto out_unlink;
+        }
+        fd = -1;
+        ret = (int)header.count;
+        goto out;
+
+out_unlink:
+        unlink(tmp);
+out:
+        if (fd >= 0) {
+                close(fd);
+        }
+        free(tmp);
+        free(entries);
+        free_members(&list);
+        return ret;
+}
+
+int archive_read_index(int fd, struct archive_entry **entries)
+{
+        struct archive_header header;
+        struct stat sb;
+        uint64_t index_size;
+        int ret;
+
+        if (fstat(fd, &sb) != 0) {
+                return -errno;
+        }
+        if ((size_t)sb.st_size < sizeof(header) ||
+            pread_full(fd, &header, sizeof(header), 0) < 0 ||
+            memcmp(header.magic, ARCHIVE_MAGIC, sizeof(header.magic)) != 0 ||
+            header.version != ARCHIVE_VERSION) {
+                return -EINVAL;
+        }
+
+        /* The index ends the archive */
+        index_size = (uint64_t)header.count * sizeof(struct archive_entry);
+        if (header.index_offset < sizeof(header) ||
+            header.index_offset + index_size != (uint64_t)sb.st_size) {
+                return -EIO;
+        }
+
+        *entries = calloc((size_t)header.count + 1, sizeof(struct archive_entry));
+        if (!*entries) {
+                return -ENOMEM;
+        }
+        ret = pread_full(fd, *entries, (size_t)index_size, (off_t)header.index_offset);
+        if (ret < 0) {
+                goto error;
+        }
+
+        for (uint32_t i = 0; i < header.count; i++) {
+                struct archive_entry *e = &(*entries)[i];
+
+                if (e->type >= ARCHIVE_TYPES || e->offset < sizeof(header) ||
+                    e->stored > header.index_offset - e->offset ||
+                    e->size > ARCHIVE_MAX_MEMBER) {
+                        ret = -EIO;
+                        goto error;
+                }
+                e->name[ARCHIVE_NAME_MAX - 1] = '\0';
+        }
+
+        return (int)header.count;
+error:
+        free(*entries);
+        *entries = NULL;
+        return ret;
+}
+
+/* Writes a record in the import directory, then renames it into the spool
+ * where the file watcher of telempostd sees it */
+static int stage_record(const char *spool_dir, const char *import_dir,
+                        const struct stat *owner, const char *data, size_t size)
+{
+        char *tmp = NULL;
+        char *dest = NULL;
+        int fd = -1;
+        int ret;
+
+        do {
+                if (fd >= 0) {
+                        /* Name already used in the spool, pick another */
+                        close(fd);
+                        unlink(tmp);
+                }
+                free(tmp);
+                free(dest);
+                dest = NULL;
+
+                if (asprintf(&tmp, "%s/XXXXXX", import_dir) < 0) {
+                        tmp = NULL;
+                        ret = -ENOMEM;
+                        goto out;
+                }
+                fd = mkstemp(tmp);
+                if (fd < 0) {
+                        ret = -errno;
+                        goto out;
+                }
+                if (asprintf(&dest, "%s/%s", spool_dir, tmp + strlen(import_dir) + 1) < 0) {
+                        dest = NULL;
+                        ret = -ENOMEM;
+                        goto out_unlink;
+                }
+        } while (access(dest, F_OK) == 0);
+
+        if ((ret = write_full(fd, data, size)) < 0) {
+                goto out_unlink;
+        }
+        /* telempostd drops the records it does not own */
+        if (fchown(fd, owner->st_uid, owner->st_gid) != 0 ||
+            close(fd) != 0) {
+                fd = -1;
+                ret = -errno;
+                goto out_unlink;
+        }
+        fd = -1;
+        if (rename(tmp, dest) != 0) {
+                ret = -errno;
+                goto out_unlink;
+        }
+        ret = 0;
+        goto out;
+
+out_unlink:
+        unlink(tmp);
+out:
+        if (fd >= 0) {
+                close(fd);
+        }
+        free(dest);
+        free(tmp);
+        return ret;
+}
+
+int archive_import(const char *path, const char *spool_dir, int threads,
+                   int *kept)
+{
+        struct member_list list = { 0 };
+        struct archive_entry *entries = NULL;
+        struct stat owner;
+        char *import_dir = NULL;
+        int staged = 0;
+        int count;
+        int ret;
+        int fd;
+
+        if (stat(spool_dir, &owner) != 0) {
+                return -errno;
+        }
+
+        fd = open(path, O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+                return -errno;
+        }
+        if ((count = archive_read_index(fd, &entries)) < 0) {
+                ret = count;
+                goto out;
+        }
+
+        if (asprintf(&import_dir, "%s/%s", spool_dir, ARCHIVE_IMPORT_DIR) < 0) {
+                import_dir = NULL;
+                ret = -ENOMEM;
+                goto out;
+        }
+        if ((mkdir(import_dir, S_IRWXU) != 0 && errno != EEXIST) ||
+            chown(import_dir, owner.st_uid, owner.st_gid) != 0) {
+                ret = -errno;
+                goto out;
+        }
+
+        /* The relay journals and retains the records as it sends them */
+        *kept = 0;
+        for (int i = 0; i < count; i++) {
+                if (entries[i].type == ARCHIVE_RECORD) {
+                        struct member *m = add_member(&list, ARCHIVE_RECORD,
+                                                      entries[i].name, 0, 0);
+
+                        m->entry = entries[i];
+                } else {
+                        (*kept)++;
+                }
+        }
+
+        for (int start = 0, end; start < list.count; start = end) {
+                end = round_end(list.members, start, list.count);
+                run_threads(list.members, start, end, fd, threads);
+
+                for (int i = start; i < end; i++) {
+                        struct member *m = &list.members[i];
+
+                        if (m->error < 0) {
+                                ret = m->error;
+                                goto out;
+                        }
+                        ret = stage_record(spool_dir, import_dir, &owner, m->data,
+                                           (size_t)m->entry.size);
+                        if (ret < 0) {
+                                goto out;
+                        }
+                        free(m->data);
+                        m->data = NULL;
+                        staged++;
+                }
+        }
+        ret = staged;
+out:
+        close(fd);
+        free(import_dir);
+        free(entries);
+        free_members(&list);
+        return ret;
+}
+
+/* vi: set ts=8 sw=8 sts=4 et tw=80 cino=(0: */
@@ -0,0 +1,140 @@
+/*
+ * This program is part of the Clear Linux Project
+ *
+ * Copyright 2019 Intel Corporation
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms and conditions of the GNU Lesser General Public License, as
+ * published by the Free Software Foundation; either version 2.1 of the License,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU Lesser General Public License for more
+ * details.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ * Archive of the records a host could not send, written by telemctl export
+ * for hosts that are offline for longer than the record expiry and read by
+ * telemctl import on a connected relay:
+ *
+ * <struct archive_header>
+ * <members>      : each file or staging log record, gzip compressed
+ * <index>        : one struct archive_entry per member
+ *
+ * The index is written last and the header rewritten to point to it, so a
+ * truncated archive is detected. Members are compressed and decompressed in
+ * parallel, a round of up to ARCHIVE_ROUND_SIZE bytes at a time.
+ */
+
+#define ARCHIVE_MAGIC "TMARCHV\0"
+#define ARCHIVE_VERSION 1
+#define ARCHIVE_NAME_MAX 224
+/* Bytes of members read or decompressed in memory at once */
+#define ARCHIVE_ROUND_SIZE (64 * 1024 * 1024)
+/* Files larger than this are not archived */
+#define ARCHIVE_MAX_MEMBER (1024 * 1024 * 1024)
+#define ARCHIVE_MAX_THREADS 32
+/* Directory of the spool the records imported are written in first */
+#define ARCHIVE_IMPORT_DIR ".import"
+
+enum archive_member_type {
+        /* a record of the spool or of the staging log */
+        ARCHIVE_RECORD = 0,
+        /* a file of the record journal */
+        ARCHIVE_JOURNAL,
+        /* a file of the record retention directory */
+        ARCHIVE_RETAINED,
+        ARCHIVE_TYPES
+};
+
+struct archive_header {
+        char magic[8];
+        uint32_t version;
+        uint32_t count;
+        uint64_t index_offset;
+};
+
+struct archive_entry {
+        uint32_t type;
+        /* crc32 of the member before compression */
+        uint32_t crc;
+        uint64_t offset;
+        /* size of the member, and of the bytes stored for it */
+        uint64_t size;
+        uint64_t stored;
+        /* modification time of the file, or time the record was staged */
+        int64_t mtime;
+        char name[ARCHIVE_NAME_MAX];
+};
+
+/* What telemctl export archives */
+struct archive_sources {
+        const char *spool_dir;
+        const char *journal_file;
+        const char *retention_dir;
+};
+
+/**
+ * Gets the number of threads members are compressed with, one per core
+ *
+ * @return the number of threads, at least 1 and at most ARCHIVE_MAX_THREADS
+ */
+int archive_threads(void);
+
+/**
+ * Writes an archive of the records of the spool, including the staging log,
+ * the record journal with its index, and the retained record bodies. The
+ * files are copied, not removed. Files removed while the archive is written,
+ * such as records telempostd sent meanwhile, are left out.
+ *
+ * @param path Path of the archive, written to a temporary file first
+ * @param sources What to archive
+ * @param threads Number of threads the members are compressed with
+ *
+ * @return the number of members in the archive, or a negative errno-style
+ *     value
+ */
+int archive_export(const char *path, const struct archive_sources *sources,
+                   int threads);
+
+/**
+ * Reads the index of an archive
+ *
+ * @param fd The archive, open for reading
+ * @param entries Set to the members, to be freed by the caller
+ *
+ * @return the number of members, -EINVAL if fd is not an archive, -EIO if it
+ *     is truncated, or -ENOMEM
+ */
+int archive_read_index(int fd, struct archive_entry **entries);
+
+/**
+ * Stages the records of an archive in a spool directory, so that telempostd
+ * sends them as the records of local probes, in batches when batch_post is
+ * enabled. The record files are written in ARCHIVE_IMPORT_DIR first, owned
+ * by the owner of the spool directory, and renamed into it with the time of
+ * the import, so that they do not expire on the relay right away.
+ *
+ * The journal and the retained bodies of the archive are a copy of the
+ * history of the host it was written on, and are left in the archive: the
+ * relay adds the records to its own journal and retention directory as it
+ * sends them.
+ *
+ * @param path Path of the archive
+ * @param spool_dir Spool directory of the relay
+ * @param threads Number of threads the members are decompressed with
+ * @param kept Set to the number of journal and retained members not imported
+ *
+ * @return the number of records staged, or a negative errno-style value
+ */
+int archive_import(const char *path, const char *spool_dir, int threads,
+                   int *kept);
+
+/* vi: set ts=8 sw=8 sts=4 et tw=80 cino=(0: */
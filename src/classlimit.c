@@ -0,0 +1,180 @@
+/*
+ * This program is part of the Clear Linux Project
+ *
+ * Copyright 2018 Intel Corporation
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms and conditions of the GNU Lesser General Public License, as
+ * published by the Free Software Foundation; either version 2.1 of the License,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU Lesser General Public License for more
+ * details.
+ */
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <ctype.h>
+
+#include "classlimit.h"
+#include "common.h"
+#include "log.h"
+#include "sampling.h"
+
+/* Parses a positive number of records, up to INT_MAX */
+static bool parse_count(const char *str, long *count)
+{
+        char *end = NULL;
+
+        errno = 0;
+        *count = strtol(str, &end, 10);
+
+        return errno == 0 && end != str && *end == '\0' && *count > 0 &&
+               *count <= INT32_MAX;
+}
+
+/* Parses a prefix:records[:burst] entry into a new bucket */
+static int add_limit(NcHashmap *buckets, char *entry)
+{
+        struct class_bucket *bucket;
+        char *records;
+        char *burst;
+        char *key;
+        long rate = 0;
+        long size = 0;
+        size_t len;
+
+        while (isspace(*entry)) {
+                entry++;
+        }
+        len = strlen(entry);
+        while (len > 0 && isspace(entry[len - 1])) {
+                entry[--len] = '\0';
+        }
+        if (len == 0) {
+                return 0;
+        }
+
+        records = strchr(entry, ':');
+        if (!records || records == entry) {
+                return -EINVAL;
+        }
+        *records++ = '\0';
+        burst = strchr(records, ':');
+        if (burst) {
+                *burst++ = '\0';
+        }
+        if (!parse_count(records, &rate) || (burst && !parse_count(burst, &size))) {
+                return -EINVAL;
+        }
+
+        /* Prefixes are compared component by component */
+        len = strlen(entry);
+        while (len > 1 && entry[len - 1] == '/') {
+                entry[--len] = '\0';
+        }
+        if (len > MAX_CLASS_LENGTH) {
+                return -EINVAL;
+        }
+
+        bucket = nc_hashmap_get(buckets, entry);
+        if (!bucket) {
+                bucket = malloc(sizeof(struct class_bucket));
+                key = strdup(entry);
+                if (!bucket || !key || !nc_hashmap_put(buckets, key, bucket)) {
+                        free(bucket);
+                        free(key);
+                        return -ENOMEM;
+                }
+        }
+        bucket->rate = (double)rate / (60 * 1000);
+        bucket->burst = (double)(burst ? size : rate);
+        bucket->tokens = bucket->burst;
+        bucket->updated = 0;
+
+        return 1;
+}
+
+int class_limits_init(struct class_limits *limits, const char *spec)
+{
+        char *list;
+        char *entry;
+        char *saveptr = NULL;
+        int count = 0;
+
+        limits->buckets = NULL;
+        if (!spec || spec[0] == '\0') {
+                return 0;
+        }
+
+        list = strdup(spec);
+        limits->buckets = nc_hashmap_new_full(nc_string_hash, nc_string_compare,
+                                              free, free);
+        if (!list || !limits->buckets) {
+                free(list);
+                class_limits_free(limits);
+                return -ENOMEM;
+        }
+
+        for (entry = strtok_r(list, ",", &saveptr); entry;
+             entry = strtok_r(NULL, ",", &saveptr)) {
+                int ret = add_limit(limits->buckets, entry);
+
+                if (ret < 0) {
+                        free(list);
+                        class_limits_free(limits);
+                        return ret;
+                }
+                count += ret;
+        }
+        free(list);
+
+        if (count == 0) {
+                class_limits_free(limits);
+        }
+
+        return count;
+}
+
+bool class_limits_take(struct class_limits *limits, const char *classification,
+                       size_t len, int64_t now)
+{
+        struct class_bucket *bucket;
+
+        if (!limits->buckets) {
+                return true;
+        }
+
+        bucket = class_prefix_get(limits->buckets, classification, len);
+        if (!bucket) {
+                return true;
+        }
+
+        if (now > bucket->updated) {
+                bucket->tokens += (double)(now - bucket->updated) * bucket->rate;
+                if (bucket->tokens > bucket->burst) {
+                        bucket->tokens = bucket->burst;
+                }
+                bucket->updated = now;
+        }
+        if (bucket->tokens < 1.0) {
+                return false;
+        }
+        bucket->tokens -= 1.0;
+
+        return true;
+}
+
+void class_limits_free(struct class_limits *limits)
+{
+        if (limits->buckets) {
+                nc_hashmap_free(limits->buckets);
+                limits->buckets = NULL;
+        }
+}
+
+/* vi: set ts=8 sw=8 sts=4 et tw=80 cino=(0: */
@@ -0,0 +1,78 @@
+/*
+ * This program is part of the Clear Linux Project
+ *
+ * Copyright 2018 Intel Corporation
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms and conditions of the GNU Lesser General Public License, as
+ * published by the Free Software Foundation; either version 2.1 of the License,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU Lesser General Public License for more
+ * details.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "nica/hashmap.h"
+
+/*
+ * Rate limits of classifications, as token buckets. A record takes a token
+ * from the bucket of the longest prefix of its classification, compared
+ * component by component: org.clearlinux/journal applies to
+ * org.clearlinux/journal/error, but not to org.clearlinux/journalx/error.
+ * Buckets refill at their rate, and hold up to their burst.
+ */
+
+struct class_bucket {
+        double tokens;
+        /* tokens per millisecond, and most tokens held */
+        double rate;
+        double burst;
+        int64_t updated;
+};
+
+struct class_limits {
+        /* buckets by classification prefix, NULL without limits */
+        NcHashmap *buckets;
+};
+
+/**
+ * Parses the rate limits of classifications, a comma separated list of
+ * prefix:records[:burst] entries, with records per minute
+ *
+ * @param limits The limits
+ * @param spec The list, may be empty
+ *
+ * @return the number of limits, or -EINVAL if an entry is invalid, or
+ *     -ENOMEM
+ */
+int class_limits_init(struct class_limits *limits, const char *spec);
+
+/**
+ * Takes a token for a record, if its classification has a limit
+ *
+ * @param limits The limits
+ * @param classification Classification of the record
+ * @param len Length of classification
+ * @param now Current monotonic time in milliseconds
+ *
+ * @return false if the record goes over the limit of its classification
+ */
+bool class_limits_take(struct class_limits *limits, const char *classification,
+                       size_t len, int64_t now);
+
+/**
+ * Releases the limits
+ *
+ * @param limits The limits
+ */
+void class_limits_free(struct class_limits *limits);
+
+/* vi: set ts=8 sw=8 sts=4 et tw=80 cino=(0: */
@@ -19,7 +19,10 @@
 
 #pragma once
 
+#include <limits.h>
+#include <stdbool.h>
 #include <stdint.h>
+#include <sys/types.h>
 
 #define SMALL_LINE_BUF 80
 #define RECORD_SIZE_LEN  sizeof(uint32_t)
@@ -96,10 +99,11 @@ static const uint32_t RECORD_FORMAT_VERSION = 4;
 /* Spooling should not run more often than TM_SPOOL_RUN_MIN */
 #define TM_SPOOL_RUN_MIN (2 /*min*/ * 60 /*sec*/)
 
-/* Maximum records that can be sent in a single spool run loop*/
+/* Records sent in a single spool run loop at first, the limit then adapts */
 #define TM_SPOOL_MAX_SEND_RECORDS 50
 
-/* Maximum records that can be processed in a single spool run loop*/
+/* Maximum records processed in a single spool run loop sending
+ * TM_SPOOL_MAX_SEND_RECORDS, larger limits process as many more */
 #define TM_SPOOL_MAX_PROCESS_RECORDS 60
 
 /* Definitions for config file override */
@@ -107,6 +111,39 @@ static const uint32_t RECORD_FORMAT_VERSION = 4;
 #define CFG_PREFIX_LENGTH 4
 #define CFG_PREFIX_32BIT  0x3a474643
 
+/* Marks a binary payload, after the optional CFG field on the wire and as a
+ * line after the CFG line in staged records. The payload of a raw record is
+ * its exact bytes, without the newline ending text payloads. */
+#define RAW_PREFIX        "RAW:"
+#define RAW_PREFIX_LENGTH 4
+#define RAW_PREFIX_32BIT  0x3a574152
+
+/* Carries the time a probe sent a record, after the optional CFG and RAW
+ * fields on the wire, as a uint64_t of microseconds since the epoch. Only
+ * sent with record_tracing enabled. Staged records have a TRACE line
+ * instead, see recordtrace.h. */
+#define TRC_PREFIX        "TRC:"
+#define TRC_PREFIX_LENGTH 4
+#define TRC_PREFIX_32BIT  0x3a435254
+
+/* Marks a record standing for several identical records staged within an
+ * aggregation window, as a line after the TRACE line in staged records only:
+ * AGG:<occurrences> <first staged time> <last staged time> */
+#define AGG_PREFIX        "AGG:"
+#define AGG_PREFIX_LENGTH 4
+
+/* Largest record telemprobd receives in memory, with a CFG field of
+ * PATH_MAX and headers of at most 80 characters, see telemdaemon.c */
+#define MAX_RECORD_SIZE (2*sizeof(uint32_t) + CFG_PREFIX_LENGTH + PATH_MAX + \
+        MAX_PAYLOAD_LENGTH + NUM_HEADERS*80)
+
+/* With socket_transport=seqpacket, a record of up to TM_PACKET_SIZE bytes,
+ * its size field included, is sent as a single message. Larger records,
+ * with a binary payload, are sent as a first message of TM_PACKET_SIZE
+ * bytes, then messages of at most TM_PACKET_NEXT_SIZE bytes. */
+#define TM_PACKET_SIZE MAX_RECORD_SIZE
+#define TM_PACKET_NEXT_SIZE (TM_PACKET_SIZE - RECORD_SIZE_LEN)
+
 /* Very simple structure. Array of header strings and a payload. Calling
  * program is reponsible for passing in the payload as a simple string.
  */
@@ -115,6 +152,23 @@ struct telem_record {
         char *payload;
         size_t header_size;
         size_t payload_size;
+        /* allocated size of the headers rewritten by tm_reset_record(), 0
+         * when it is the size of the header */
+        size_t header_alloc[NUM_HEADERS];
+        size_t payload_alloc;
+        /* generation of the header cache the static headers come from */
+        unsigned header_generation;
+        /* payload set with tm_set_payload_binary() or tm_set_payload_fd() */
+        bool raw_payload;
+        /* file the payload_size bytes of the payload are read from at
+         * payload_offset when the record is sent, or -1 */
+        int payload_fd;
+        off_t payload_offset;
+};
+
+struct telem_session {
+        /* connection to the probe daemon, -1 after a write error */
+        int sfd;
 };
 
 const char *get_header_name(int ind);
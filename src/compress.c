@@ -0,0 +1,155 @@
+/*
+ * This program is part of the Clear Linux Project
+ *
+ * Copyright 2018 Intel Corporation
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms and conditions of the GNU Lesser General Public License, as
+ * published by the Free Software Foundation; either version 2.1 of the License,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU Lesser General Public License for more
+ * details.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <zlib.h>
+
+#include "compress.h"
+#include "iorecord.h"
+
+/* Adds 16 to the window bits for a gzip header and trailer */
+#define GZIP_WINDOW_BITS (15 + 16)
+
+int gzip_compress(const char *data, size_t size, char **out, size_t *out_size)
+{
+        z_stream stream;
+        size_t bound;
+        char *buf;
+        int ret;
+
+        memset(&stream, 0, sizeof(stream));
+        if (deflateInit2(&stream, Z_DEFAULT_COMPRESSION, Z_DEFLATED,
+                         GZIP_WINDOW_BITS, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+                return -ENOMEM;
+        }
+
+        bound = deflateBound(&stream, (uLong)size);
+        buf = malloc(bound + 1);
+        if (!buf) {
+                deflateEnd(&stream);
+                return -ENOMEM;
+        }
+
+        stream.next_in = (Bytef *)data;
+        stream.avail_in = (uInt)size;
+        stream.next_out = (Bytef *)buf;
+        stream.avail_out = (uInt)bound;
+
+        /* The output buffer fits the whole stream, one call is enough */
+        ret = deflate(&stream, Z_FINISH);
+        deflateEnd(&stream);
+        if (ret != Z_STREAM_END) {
+                free(buf);
+                return -EIO;
+        }
+
+        buf[stream.total_out] = '\0';
+        *out = buf;
+        *out_size = stream.total_out;
+
+        return 0;
+}
+
+int gzip_decompress(const char *data, size_t size, size_t out_size, char **out)
+{
+        z_stream stream;
+        char *buf;
+        int ret;
+
+        memset(&stream, 0, sizeof(stream));
+        if (inflateInit2(&stream, GZIP_WINDOW_BITS) != Z_OK) {
+                return -ENOMEM;
+        }
+
+        buf = malloc(out_size + 1);
+        if (!buf) {
+                inflateEnd(&stream);
+                return -ENOMEM;
+        }
+
+        stream.next_in = (Bytef *)data;
+        stream.avail_in = (uInt)size;
+        stream.next_out = (Bytef *)buf;
+        stream.avail_out = (uInt)out_size;
+
+        ret = inflate(&stream, Z_FINISH);
+        if (ret != Z_STREAM_END || stream.total_out != out_size) {
+                inflateEnd(&stream);
+                free(buf);
+                return -EIO;
+        }
+        inflateEnd(&stream);
+
+        buf[out_size] = '\0';
+        *out = buf;
+
+        return 0;
+}
+
+int compress_record(const char *data, size_t size, char **out, size_t *out_size)
+{
+        struct staged_record record = { 0 };
+        char *copy;
+        char *body = NULL;
+        size_t body_size;
+        size_t header_size;
+        int ret;
+
+        /* Parsing changes the data, work on a copy */
+        copy = malloc(size + 1);
+        if (!copy) {
+                return -ENOMEM;
+        }
+        memcpy(copy, data, size);
+        copy[size] = '\0';
+
+        if (!parse_record(copy, size, &record)) {
+                ret = -EINVAL;
+                goto out;
+        }
+        if (record.compressed) {
+                ret = -EALREADY;
+                goto out;
+        }
+        if (record.raw) {
+                ret = -EOPNOTSUPP;
+                goto out;
+        }
+        header_size = (size_t)(record.body - copy);
+
+        if ((ret = gzip_compress(record.body, record.body_size, &body, &body_size)) < 0) {
+                goto out;
+        }
+
+        *out = malloc(header_size + body_size + 1);
+        if (!*out) {
+                ret = -ENOMEM;
+                goto out;
+        }
+        /* The headers are unchanged, only the payload is compressed */
+        memcpy(*out, data, header_size);
+        memcpy(*out + header_size, body, body_size);
+        (*out)[header_size + body_size] = '\0';
+        *out_size = header_size + body_size;
+out:
+        free(body);
+        free(copy);
+        return ret;
+}
+
+/* vi: set ts=8 sw=8 sts=4 et tw=80 cino=(0: */
@@ -0,0 +1,67 @@
+/*
+ * This program is part of the Clear Linux Project
+ *
+ * Copyright 2018 Intel Corporation
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms and conditions of the GNU Lesser General Public License, as
+ * published by the Free Software Foundation; either version 2.1 of the License,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU Lesser General Public License for more
+ * details.
+ */
+
+#pragma once
+
+#include <stddef.h>
+
+#define GZIP_CONTENT_ENCODING "Content-Encoding: gzip"
+
+/**
+ * Compresses data in the gzip format
+ *
+ * @param data The data to compress
+ * @param size Size of data in bytes
+ * @param out Set to the compressed data, to be freed by the caller
+ * @param out_size Set to the size of the compressed data
+ *
+ * @return 0 on success, or a negative errno-style value
+ */
+int gzip_compress(const char *data, size_t size, char **out, size_t *out_size);
+
+/**
+ * Decompresses data in the gzip format, of which the size is known
+ *
+ * @param data The compressed data
+ * @param size Size of data in bytes
+ * @param out_size Size of the decompressed data
+ * @param out Set to the decompressed data, null terminated, to be freed by
+ *     the caller
+ *
+ * @return 0 on success, -EIO if data does not decompress to out_size bytes,
+ *     or -ENOMEM
+ */
+int gzip_decompress(const char *data, size_t size, size_t out_size, char **out);
+
+/**
+ * Builds a copy of a record in the staged record layout with its payload
+ * compressed. The record can then be sent as it is read, with the gzip
+ * content encoding.
+ *
+ * @param data The record, in the staged record layout
+ * @param size Size of data in bytes
+ * @param out Set to the compressed record, null terminated, to be freed by
+ *     the caller
+ * @param out_size Set to the size of the compressed record, not including
+ *     the null byte
+ *
+ * @return 0 on success, -EALREADY if the payload is already compressed,
+ *     -EOPNOTSUPP if the payload is binary, -EINVAL if the record cannot be
+ *     parsed, or -ENOMEM
+ */
+int compress_record(const char *data, size_t size, char **out, size_t *out_size);
+
+/* vi: set ts=8 sw=8 sts=4 et tw=80 cino=(0: */
@@ -14,15 +14,17 @@
  * details.
  */
 
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <errno.h>
 #include <limits.h>
 #include <dirent.h>
 #include <string.h>
-#include <ctype.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <pthread.h>
 #include <unistd.h>
 
 #include "configuration.h"
@@ -31,12 +33,54 @@
 #include "log.h"
 
 #include "nica/inifile.h"
+#include "nica/hashmap.h"
+
+/* Maximum number of configurations kept parsed by get_cached_config() */
+#define CONFIG_CACHE_MAX 16
+
+struct cached_config {
+        struct configuration config;
+        /* the file when it was parsed */
+        struct timespec mtime;
+        off_t size;
+};
+
+#define CONFIG_SNAPSHOT_MAGIC "TMCONFS\1"
+/* Snapshots hold a few short strings, anything larger is not one */
+#define CONFIG_SNAPSHOT_MAX_SIZE (1024 * 1024)
+
+/*
+ * Layout of a configuration snapshot, in the byte order of the host. The
+ * strings follow the header, NUL terminated, at the given offsets from the
+ * start of the snapshot.
+ */
+struct config_snapshot {
+        char magic[8];
+        uint32_t size;
+        /* hash of the key names and defaults the snapshot was written with */
+        uint32_t build;
+        /* the file the values were read from, none if source_offset is 0 */
+        uint64_t source_dev;
+        uint64_t source_ino;
+        int64_t source_size;
+        int64_t source_mtime_sec;
+        int64_t source_mtime_nsec;
+        uint32_t source_offset;
+        uint32_t str_offset[CONF_STR_MAX];
+        int64_t int_values[CONF_INT_MAX];
+        uint8_t bool_values[CONF_BOOL_MAX];
+};
 
 static char *config_file = NULL;
 static char *default_config_file = DATADIR "/defaults/telemetrics/telemetrics.conf";
 static char *etc_config_file = "/etc/telemetrics/telemetrics.conf";
 static NcHashmap *keyfile = NULL;
 static bool cmd_line_cfg = false;
+static NcHashmap *config_cache = NULL;
+static const char *snapshot_file = CONFIG_SNAPSHOT_FILE;
+/* config_file when the configuration in use was read, if there was one */
+static struct stat config_source;
+static bool config_source_valid = false;
 
 /* Conf strings, integers, and booleans expected in the conf file */
 static const char *config_key_str[] = { "server",
@@ -44,7 +88,14 @@ static const char *config_key_str[] = { "server",
                                         "spool_dir",
                                         "rate_limit_strategy",
                                         "cainfo",
-                                        "tidheader"};
+                                        "tidheader",
+                                        "class_rate_limits",
+                                        "journal_sync",
+                                        "heartbeat_payload",
+                                        "destinations",
+                                        "class_sample_rates",
+                                        "class_aggregation",
+                                        "socket_transport" };
 
 static const char *config_key_int[] = { "record_expiry",
                                         "spool_max_size",
@@ -52,24 +103,70 @@ static const char *config_key_int[] = { "record_expiry",
                                         "record_window_length",
                                         "byte_window_length",
                                         "record_burst_limit",
-                                        "byte_burst_limit" };
+                                        "byte_burst_limit",
+                                        "socket_write_timeout",
+                                        "staging_segment_size",
+                                        "ring_buffer_size",
+                                        "probe_worker_threads",
+                                        "max_inflight_posts",
+                                        "batch_post_max_records",
+                                        "batch_post_max_size",
+                                        "batch_post_max_time",
+                                        "spool_drain_min_records",
+                                        "spool_drain_max_records",
+                                        "journal_group_entries",
+                                        "journal_group_time",
+                                        "crash_dedup_window",
+                                        "heartbeat_interval",
+                                        "raw_payload_max_size",
+                                        "memory_budget",
+                                        "post_worker_threads" };
 
 static const char *config_key_bool[] = { "rate_limit_enabled",
                                          "daemon_recycling_enabled",
                                          "record_retention_enabled",
-                                         "record_server_delivery_enabled" };
+                                         "record_server_delivery_enabled",
+                                         "staging_log_enabled",
+                                         "ring_buffer_enabled",
+                                         "http_keepalive",
+                                         "http2_enabled",
+                                         "batch_post_enabled",
+                                         "compressed_uploads",
+                                         "compressed_spool",
+                                         "compressed_retention",
+                                         "record_tracing",
+                                         "record_trace_header",
+                                         "io_uring_enabled" };
 
 static const char *config_str_default[] = { DEFAULT_SERVER_ADDR,
                                             DEFAULT_SOCKET_PATH,
                                             DEFAULT_SPOOL_DIR,
                                             DEFAULT_RATE_LIMIT_STRATEGY,
                                             DEFAULT_CAINFO,
-                                            DEFAULT_TIDHEADER };
+                                            DEFAULT_TIDHEADER,
+                                            DEFAULT_CLASS_RATE_LIMITS,
+                                            DEFAULT_JOURNAL_SYNC,
+                                            DEFAULT_HEARTBEAT_PAYLOAD,
+                                            DEFAULT_DESTINATIONS,
+                                            DEFAULT_CLASS_SAMPLE_RATES,
+                                            DEFAULT_CLASS_AGGREGATION,
+                                            DEFAULT_SOCKET_TRANSPORT };
 
 static const bool config_bool_default[] = { DEFAULT_RATE_LIMIT_ENABLED,
                                             DEFAULT_DAEMON_RECYCLING_ENABLED,
                                             DEFAULT_RECORD_RETENTION_ENABLED,
-                                            DEFAULT_RECORD_SERVER_DELIVERY_ENABLED };
+                                            DEFAULT_RECORD_SERVER_DELIVERY_ENABLED,
+                                            DEFAULT_STAGING_LOG_ENABLED,
+                                            DEFAULT_RING_BUFFER_ENABLED,
+                                            DEFAULT_HTTP_KEEPALIVE,
+                                            DEFAULT_HTTP2_ENABLED,
+                                            DEFAULT_BATCH_POST_ENABLED,
+                                            DEFAULT_COMPRESSED_UPLOADS,
+                                            DEFAULT_COMPRESSED_SPOOL,
+                                            DEFAULT_COMPRESSED_RETENTION,
+                                            DEFAULT_RECORD_TRACING,
+                                            DEFAULT_RECORD_TRACE_HEADER,
+                                            DEFAULT_IO_URING_ENABLED };
 
 static const int config_int_default[] = { DEFAULT_RECORD_EXPIRY,
                                           DEFAULT_SPOOL_MAX_SIZE,
@@ -77,10 +174,47 @@ static const int config_int_default[] = { DEFAULT_RECORD_EXPIRY,
                                           DEFAULT_RECORD_WINDOW_LENGTH,
                                           DEFAULT_BYTE_WINDOW_LENGTH,
                                           DEFAULT_RECORD_BURST_LIMIT,
-                                          DEFAULT_BYTE_BURST_LIMIT };
-
-
-static struct configuration config = { { 0 }, { 0 }, { 0 }, false, NULL };
+                                          DEFAULT_BYTE_BURST_LIMIT,
+                                          DEFAULT_SOCKET_WRITE_TIMEOUT,
+                                          DEFAULT_STAGING_SEGMENT_SIZE,
+                                          DEFAULT_RING_BUFFER_SIZE,
+                                          DEFAULT_PROBE_WORKER_THREADS,
+                                          DEFAULT_MAX_INFLIGHT_POSTS,
+                                          DEFAULT_BATCH_POST_MAX_RECORDS,
+                                          DEFAULT_BATCH_POST_MAX_SIZE,
+                                          DEFAULT_BATCH_POST_MAX_TIME,
+                                          DEFAULT_SPOOL_DRAIN_MIN_RECORDS,
+                                          DEFAULT_SPOOL_DRAIN_MAX_RECORDS,
+                                          DEFAULT_JOURNAL_GROUP_ENTRIES,
+                                          DEFAULT_JOURNAL_GROUP_TIME,
+                                          DEFAULT_CRASH_DEDUP_WINDOW,
+                                          DEFAULT_HEARTBEAT_INTERVAL,
+                                          DEFAULT_RAW_PAYLOAD_MAX_SIZE,
+                                          DEFAULT_MEMORY_BUDGET,
+                                          DEFAULT_POST_WORKER_THREADS };
+
+
+/* The configuration read first, later ones are allocated by reload_config() */
+static struct configuration initial_config;
+static struct configuration *config = &initial_config;
+
+/* A configuration replaced by reload_config(), until it is freed */
+struct retired_config {
+        struct configuration *config;
+        /* config_generation once it was replaced */
+        uint64_t generation;
+        struct retired_config *next;
+};
+
+static struct retired_config *retired_configs = NULL;
+/* Incremented each time a configuration replaces another */
+static uint64_t config_generation = 1;
+
+/* Generation each reader thread last saw at a checkpoint, 0 for a free
+ * slot, CONFIG_READER_OFFLINE while it reads no value */
+#define CONFIG_READER_OFFLINE UINT64_MAX
+static uint64_t config_readers[CONFIG_READERS_MAX];
+static pthread_mutex_t config_readers_lock = PTHREAD_MUTEX_INITIALIZER;
 
 static int validate_config_file(const char *f)
 {
@@ -116,6 +250,18 @@ const char *get_cmd_line_config_file(void)
         return NULL;
 }
 
+int get_config_files(const char *files[CONFIG_FILES_MAX])
+{
+        if (cmd_line_cfg) {
+                files[0] = config_file;
+                return 1;
+        }
+        files[0] = etc_config_file;
+        files[1] = default_config_file;
+
+        return 2;
+}
+
 int set_config_file(const char *filename)
 {
         int ret;
@@ -217,58 +363,526 @@ bool read_config_from_file(char *config_file, struct configuration *config)
         return true;
 }
 
-static void initialize_config(void)
+static void initialize_config(void);
+static void free_config_values(struct configuration *c);
+
+/* FNV-1a, over the key names and default values */
+static uint32_t snapshot_hash(uint32_t hash, const void *data, size_t len)
 {
-        if (config.initialized) {
-                return;
+        const unsigned char *p = data;
+
+        for (size_t i = 0; i < len; i++) {
+                hash = (hash ^ p[i]) * 16777619U;
+        }
+
+        return hash;
+}
+
+static uint32_t snapshot_build(void)
+{
+        uint32_t hash = 2166136261U;
+        uint32_t size = (uint32_t)sizeof(struct config_snapshot);
+
+        hash = snapshot_hash(hash, &size, sizeof(size));
+        for (int i = 0; i < CONF_STR_MAX; i++) {
+                hash = snapshot_hash(hash, config_key_str[i], strlen(config_key_str[i]) + 1);
+                hash = snapshot_hash(hash, config_str_default[i], strlen(config_str_default[i]) + 1);
+        }
+        for (int i = 0; i < CONF_INT_MAX; i++) {
+                hash = snapshot_hash(hash, config_key_int[i], strlen(config_key_int[i]) + 1);
+                hash = snapshot_hash(hash, &config_int_default[i], sizeof(int));
         }
+        for (int i = 0; i < CONF_BOOL_MAX; i++) {
+                hash = snapshot_hash(hash, config_key_bool[i], strlen(config_key_bool[i]) + 1);
+                hash = snapshot_hash(hash, &config_bool_default[i], sizeof(bool));
+        }
+
+        return hash;
+}
+
+/* Returns the string at offset in the snapshot, or NULL if it is not one */
+static const char *snapshot_string(const char *map, size_t size, uint32_t offset)
+{
+        if (offset < sizeof(struct config_snapshot) || offset >= size ||
+            !memchr(map + offset, '\0', size - offset)) {
+                return NULL;
+        }
+
+        return map + offset;
+}
+
+void set_config_snapshot_file(const char *filename)
+{
+        snapshot_file = filename;
+}
+
+bool read_config_snapshot(const char *source, struct configuration *c)
+{
+        const struct config_snapshot *snap;
+        struct stat sbuf, source_sbuf;
+        const char *path;
+        char *map;
+        int fd;
+
+        if (!snapshot_file) {
+                return false;
+        }
+        if (source && stat(source, &source_sbuf) != 0) {
+                return false;
+        }
+
+        fd = open(snapshot_file, O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+                return false;
+        }
+        /* Only telemprobd may have written it */
+        if (fstat(fd, &sbuf) != 0 || !S_ISREG(sbuf.st_mode) ||
+            (sbuf.st_mode & (S_IWGRP | S_IWOTH)) ||
+            sbuf.st_size < (off_t)sizeof(struct config_snapshot) ||
+            sbuf.st_size > CONFIG_SNAPSHOT_MAX_SIZE) {
+                close(fd);
+                return false;
+        }
+        map = mmap(NULL, (size_t)sbuf.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if (map == MAP_FAILED) {
+                return false;
+        }
+        snap = (const struct config_snapshot *)map;
+
+        if (memcmp(snap->magic, CONFIG_SNAPSHOT_MAGIC, sizeof(snap->magic)) != 0 ||
+            snap->size != (uint64_t)sbuf.st_size || snap->build != snapshot_build()) {
+                goto stale;
+        }
+
+        /* Stale once the file the probe would read differs */
+        if (source) {
+                path = snapshot_string(map, snap->size, snap->source_offset);
+                if (!path || strcmp(path, source) != 0 ||
+                    snap->source_dev != (uint64_t)source_sbuf.st_dev ||
+                    snap->source_ino != (uint64_t)source_sbuf.st_ino ||
+                    snap->source_size != (int64_t)source_sbuf.st_size ||
+                    snap->source_mtime_sec != (int64_t)source_sbuf.st_mtim.tv_sec ||
+                    snap->source_mtime_nsec != (int64_t)source_sbuf.st_mtim.tv_nsec) {
+                        goto stale;
+                }
+        } else if (snap->source_offset != 0) {
+                goto stale;
+        }
+
+        for (int i = 0; i < CONF_STR_MAX; i++) {
+                if (!snapshot_string(map, snap->size, snap->str_offset[i])) {
+                        goto stale;
+                }
+        }
+        for (int i = 0; i < CONF_STR_MAX; i++) {
+                c->strValues[i] = map + snap->str_offset[i];
+        }
+        for (int i = 0; i < CONF_INT_MAX; i++) {
+                c->intValues[i] = snap->int_values[i];
+        }
+        for (int i = 0; i < CONF_BOOL_MAX; i++) {
+                c->boolValues[i] = snap->bool_values[i] != 0;
+        }
+        c->snapshot = map;
+        c->snapshot_size = snap->size;
+
+        return true;
+
+stale:
+        munmap(map, (size_t)sbuf.st_size);
+        return false;
+}
+
+int write_config_snapshot(void)
+{
+        struct config_snapshot *snap;
+        char *tmppath = NULL;
+        size_t size = sizeof(struct config_snapshot);
+        size_t offset;
+        ssize_t written;
+        char *buf;
+        int ret = 0;
+        int fd;
+
+        initialize_config();
+        if (!snapshot_file) {
+                return -EINVAL;
+        }
+
+        if (config_source_valid) {
+                size += strlen(config_file) + 1;
+        }
+        for (int i = 0; i < CONF_STR_MAX; i++) {
+                size += strlen(config->strValues[i]) + 1;
+        }
+        if (size > CONFIG_SNAPSHOT_MAX_SIZE) {
+                return -E2BIG;
+        }
+
+        buf = calloc(1, size);
+        if (!buf) {
+                return -ENOMEM;
+        }
+        snap = (struct config_snapshot *)buf;
+        memcpy(snap->magic, CONFIG_SNAPSHOT_MAGIC, sizeof(snap->magic));
+        snap->size = (uint32_t)size;
+        snap->build = snapshot_build();
+
+        offset = sizeof(struct config_snapshot);
+        if (config_source_valid) {
+                snap->source_dev = (uint64_t)config_source.st_dev;
+                snap->source_ino = (uint64_t)config_source.st_ino;
+                snap->source_size = (int64_t)config_source.st_size;
+                snap->source_mtime_sec = (int64_t)config_source.st_mtim.tv_sec;
+                snap->source_mtime_nsec = (int64_t)config_source.st_mtim.tv_nsec;
+                snap->source_offset = (uint32_t)offset;
+                strcpy(buf + offset, config_file);
+                offset += strlen(config_file) + 1;
+        }
+        for (int i = 0; i < CONF_STR_MAX; i++) {
+                snap->str_offset[i] = (uint32_t)offset;
+                strcpy(buf + offset, config->strValues[i]);
+                offset += strlen(config->strValues[i]) + 1;
+        }
+        for (int i = 0; i < CONF_INT_MAX; i++) {
+                snap->int_values[i] = config->intValues[i];
+        }
+        for (int i = 0; i < CONF_BOOL_MAX; i++) {
+                snap->bool_values[i] = config->boolValues[i];
+        }
+
+        /* Written aside and renamed, so that probes never map half of one */
+        if (asprintf(&tmppath, "%s.XXXXXX", snapshot_file) < 0) {
+                free(buf);
+                return -ENOMEM;
+        }
+        fd = mkostemp(tmppath, O_CLOEXEC);
+        if (fd < 0) {
+                ret = -errno;
+                goto out;
+        }
+        if (fchmod(fd, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH) != 0) {
+                ret = -errno;
+        }
+        for (offset = 0; ret == 0 && offset < size; offset += (size_t)written) {
+                written = write(fd, buf + offset, size - offset);
+                if (written < 0 && errno != EINTR) {
+                        ret = -errno;
+                } else if (written < 0) {
+                        written = 0;
+                }
+        }
+        if (close(fd) != 0 && ret == 0) {
+                ret = -errno;
+        }
+        if (ret == 0 && rename(tmppath, snapshot_file) != 0) {
+                ret = -errno;
+        }
+        if (ret < 0) {
+                unlink(tmppath);
+        }
+out:
+        free(tmppath);
+        free(buf);
+
+        return ret;
+}
+
+/*
+ * Reads the configuration into c, from the snapshot if use_snapshot and it
+ * is not stale. Returns false if the config file cannot be parsed.
+ */
+static bool load_config(struct configuration *c, bool use_snapshot)
+{
+        const char *file = cmd_line_cfg ? config_file : NULL;
+        struct stat source;
+        bool source_valid = false;
 
         /* No config file provided on command line */
-        if (!config_file) {
+        if (!file) {
                 if (access(etc_config_file, R_OK) == 0) {
-                        config_file = etc_config_file;
+                        file = etc_config_file;
                 } else {
                         if (access(default_config_file, R_OK) == 0) {
-                                config_file = default_config_file;
+                                file = default_config_file;
                         }
                 }
         }
 
-        if (config_file) {
-                if (!read_config_from_file(config_file, &config)) {
+        /* Before reading, so that changes made meanwhile leave the snapshot
+         * of this configuration stale */
+        if (file && stat(file, &source) == 0) {
+                source_valid = true;
+        }
+
+        if (use_snapshot && read_config_snapshot(file, c)) {
+                telem_debug("DEBUG: Configuration read from %s\n", snapshot_file);
+        } else if (file) {
+                if (!read_config_from_file((char *)file, c)) {
                         /* Error while parsing file  */
-                        exit(EXIT_FAILURE);
+                        return false;
                 }
         }
         else {
-                if (!set_default_config_values(&config)) {
-                        exit(EXIT_FAILURE);
+                if (!set_default_config_values(c)) {
+                        return false;
                 }
         }
 
-        config.initialized = true;
+        config_file = (char *)file;
+        config_source = source;
+        config_source_valid = source_valid;
+        c->initialized = true;
+
+        return true;
+}
+
+static void initialize_config(void)
+{
+        if (config->initialized) {
+                return;
+        }
+
+        if (!load_config(config, true)) {
+                exit(EXIT_FAILURE);
+        }
+}
+
+int config_reader_register(void)
+{
+        int reader = -ENOSPC;
+
+        pthread_mutex_lock(&config_readers_lock);
+        for (int i = 0; i < CONFIG_READERS_MAX; i++) {
+                if (config_readers[i] == 0) {
+                        config_readers[i] = CONFIG_READER_OFFLINE;
+                        reader = i;
+                        break;
+                }
+        }
+        pthread_mutex_unlock(&config_readers_lock);
+        if (reader >= 0) {
+                config_reader_checkpoint(reader);
+        }
+
+        return reader;
+}
+
+void config_reader_unregister(int reader)
+{
+        if (reader < 0) {
+                return;
+        }
+        pthread_mutex_lock(&config_readers_lock);
+        __atomic_store_n(&config_readers[reader], 0, __ATOMIC_SEQ_CST);
+        pthread_mutex_unlock(&config_readers_lock);
+}
+
+void config_reader_checkpoint(int reader)
+{
+        if (reader < 0) {
+                return;
+        }
+        __atomic_store_n(&config_readers[reader],
+                         __atomic_load_n(&config_generation, __ATOMIC_SEQ_CST),
+                         __ATOMIC_SEQ_CST);
+        /* Values are read after the generation is published */
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+void config_reader_offline(int reader)
+{
+        if (reader < 0) {
+                return;
+        }
+        __atomic_store_n(&config_readers[reader], CONFIG_READER_OFFLINE,
+                         __ATOMIC_SEQ_CST);
+}
+
+static void free_configuration_struct(struct configuration *c)
+{
+        free_config_values(c);
+        if (c != &initial_config) {
+                free(c);
+        }
 }
 
-void reload_config(void)
+/* Frees the replaced configurations every reader passed a checkpoint since */
+static void reclaim_configs(void)
 {
-        config.initialized = false;
+        struct retired_config **prev = &retired_configs;
+        struct retired_config *retired;
+        uint64_t seen = CONFIG_READER_OFFLINE;
+
+        pthread_mutex_lock(&config_readers_lock);
+        for (int i = 0; i < CONFIG_READERS_MAX; i++) {
+                uint64_t reader = __atomic_load_n(&config_readers[i], __ATOMIC_SEQ_CST);
 
-        if (!cmd_line_cfg) {
-                config_file = NULL;
+                if (reader != 0 && reader < seen) {
+                        seen = reader;
+                }
         }
+        pthread_mutex_unlock(&config_readers_lock);
+
+        while ((retired = *prev) != NULL) {
+                if (retired->generation <= seen) {
+                        *prev = retired->next;
+                        free_configuration_struct(retired->config);
+                        free(retired);
+                } else {
+                        prev = &retired->next;
+                }
+        }
+}
+
+/*
+ * The replaced configuration is freed by a later reload, once each reader
+ * registered with config_reader_register() has passed a checkpoint or gone
+ * offline since it was replaced. The thread reloading the configuration can
+ * use the values it got before until its next reload, other threads must
+ * register to read values while it may reload.
+ */
+bool reload_config(void)
+{
+        struct configuration *next;
+        struct retired_config *retired;
+
         initialize_config();
+        reclaim_configs();
+
+        next = calloc(1, sizeof(struct configuration));
+        retired = calloc(1, sizeof(struct retired_config));
+        if (!next || !retired) {
+                telem_log(LOG_ERR, "Unable to allocate memory, exiting\n");
+                exit(EXIT_FAILURE);
+        }
+
+        /* Always from the file, the snapshot is written from the result */
+        if (!load_config(next, false)) {
+                telem_log(LOG_ERR, "Unable to reload the configuration, keeping"
+                          " the one in use\n");
+                free_configuration_struct(next);
+                free(retired);
+                return false;
+        }
+
+        /* Readers see either configuration whole, and a reader seeing the
+         * new generation at a checkpoint sees the new configuration */
+        retired->config = config;
+        __atomic_store_n(&config, next, __ATOMIC_SEQ_CST);
+        retired->generation = __atomic_add_fetch(&config_generation, 1,
+                                                 __ATOMIC_SEQ_CST);
+        retired->next = retired_configs;
+        retired_configs = retired;
+
+        return true;
+}
+
+const struct configuration *get_config(void)
+{
+        initialize_config();
+        return config;
+}
+
+static void free_config_values(struct configuration *c)
+{
+        for (int i = 0; i < CONF_STR_MAX; i++) {
+                if (!c->snapshot) {
+                        free(c->strValues[i]);
+                }
+                c->strValues[i] = NULL;
+        }
+        if (c->snapshot) {
+                munmap(c->snapshot, c->snapshot_size);
+                c->snapshot = NULL;
+        }
+}
+
+static void free_cached_config(void *p)
+{
+        struct cached_config *entry = (struct cached_config *)p;
+
+        free_config_values(&entry->config);
+        free(entry);
+}
+
+const struct configuration *get_cached_config(const char *filename)
+{
+        struct cached_config *entry;
+        struct stat sbuf;
+        char *key;
+
+        if (filename[0] != '/' || stat(filename, &sbuf) != 0 ||
+            !S_ISREG(sbuf.st_mode)) {
+                return NULL;
+        }
+
+        if (config_cache) {
+                entry = nc_hashmap_get(config_cache, filename);
+                if (entry && entry->size == sbuf.st_size &&
+                    entry->mtime.tv_sec == sbuf.st_mtim.tv_sec &&
+                    entry->mtime.tv_nsec == sbuf.st_mtim.tv_nsec) {
+                        return &entry->config;
+                }
+                if (entry) {
+                        nc_hashmap_remove(config_cache, filename);
+                } else if (nc_hashmap_size(config_cache) >= CONFIG_CACHE_MAX) {
+                        /* Start over rather than track which file is the oldest */
+                        nc_hashmap_free(config_cache);
+                        config_cache = NULL;
+                }
+        }
+        if (!config_cache) {
+                config_cache = nc_hashmap_new_full(nc_string_hash, nc_string_compare,
+                                                   free, free_cached_config);
+                if (!config_cache) {
+                        return NULL;
+                }
+        }
+
+        entry = calloc(1, sizeof(struct cached_config));
+        if (!entry) {
+                return NULL;
+        }
+        if (!read_config_from_file((char *)filename, &entry->config)) {
+                free_cached_config(entry);
+                return NULL;
+        }
+        entry->config.initialized = true;
+        entry->mtime = sbuf.st_mtim;
+        entry->size = sbuf.st_size;
+
+        key = strdup(filename);
+        if (!key || !nc_hashmap_put(config_cache, key, entry)) {
+                free(key);
+                free_cached_config(entry);
+                return NULL;
+        }
+
+        return &entry->config;
 }
 
 __attribute__((destructor))
 void free_configuration(void)
 {
-        if (!config.initialized) {
+        if (config_cache) {
+                nc_hashmap_free(config_cache);
+                config_cache = NULL;
+        }
+
+        if (!config->initialized) {
                 return;
         }
 
-        for (int i = 0; i < CONF_STR_MAX; i++) {
-                free(config.strValues[i]);
+        while (retired_configs) {
+                struct retired_config *retired = retired_configs;
+
+                retired_configs = retired->next;
+                free_configuration_struct(retired->config);
+                free(retired);
         }
+        free_configuration_struct(config);
 
         if (cmd_line_cfg) {
                 free(config_file);
@@ -278,31 +892,179 @@ void free_configuration(void)
 const char *server_addr_config()
 {
         initialize_config();
-        return (const char *)config.strValues[CONF_SERVER_ADDR];
+        return (const char *)config->strValues[CONF_SERVER_ADDR];
 }
 
 const char *socket_path_config()
 {
         initialize_config();
-        return (const char *)config.strValues[CONF_SOCKET_PATH];
+        return (const char *)config->strValues[CONF_SOCKET_PATH];
+}
+
+const char *socket_transport_config()
+{
+        initialize_config();
+        const char *val = config->strValues[CONF_SOCKET_TRANSPORT];
+
+        if (strcasecmp(val, "seqpacket") == 0) {
+                return "seqpacket";
+        }
+
+        return DEFAULT_SOCKET_TRANSPORT;
 }
 
 const char *spool_dir_config()
 {
         initialize_config();
-        return (const char *)config.strValues[CONF_SPOOL_DIR];
+        return (const char *)config->strValues[CONF_SPOOL_DIR];
 }
 
 const char *get_cainfo_config()
 {
         initialize_config();
-        return (const char *)config.strValues[CONF_CAINFO];
+        return (const char *)config->strValues[CONF_CAINFO];
 }
 
 const char *get_tidheader_config()
 {
         initialize_config();
-        return (const char *)config.strValues[CONF_TIDHEADER];
+        return (const char *)config->strValues[CONF_TIDHEADER];
+}
+
+const char *class_rate_limits_config()
+{
+        initialize_config();
+        return (const char *)config->strValues[CONF_CLASS_RATE_LIMITS];
+}
+
+const char *journal_sync_config()
+{
+        initialize_config();
+        const char *val = config->strValues[CONF_JOURNAL_SYNC];
+
+        /* The value may be in a read-only snapshot, compare without
+         * lowercasing it */
+        if (strcasecmp(val, "none") == 0) {
+                return "none";
+        } else if (strcasecmp(val, "group") == 0) {
+                return "group";
+        } else if (strcasecmp(val, "entry") == 0) {
+                return "entry";
+        }
+
+        return DEFAULT_JOURNAL_SYNC;
+}
+
+int journal_group_entries_config(void)
+{
+        initialize_config();
+        int64_t val = config->intValues[CONF_JOURNAL_GROUP_ENTRIES];
+
+        if (val < 1) {
+                val = 1;
+        } else if (val > TM_JOURNAL_GROUP_MAX_ENTRIES) {
+                val = TM_JOURNAL_GROUP_MAX_ENTRIES;
+        }
+
+        return (int)val;
+}
+
+int journal_group_time_config(void)
+{
+        initialize_config();
+        int64_t val = config->intValues[CONF_JOURNAL_GROUP_TIME];
+
+        if (val < 0) {
+                val = 0;
+        } else if (val > TM_JOURNAL_GROUP_MAX_TIME) {
+                val = TM_JOURNAL_GROUP_MAX_TIME;
+        }
+
+        return (int)val;
+}
+
+int crash_dedup_window_config(void)
+{
+        initialize_config();
+        int64_t val = config->intValues[CONF_CRASH_DEDUP_WINDOW];
+
+        if (val < 0) {
+                val = 0;
+        } else if (val > TM_CRASH_DEDUP_MAX_WINDOW) {
+                val = TM_CRASH_DEDUP_MAX_WINDOW;
+        }
+
+        return (int)val;
+}
+
+int heartbeat_interval_config(void)
+{
+        initialize_config();
+        int64_t val = config->intValues[CONF_HEARTBEAT_INTERVAL];
+
+        if (val <= 0) {
+                val = 0;
+        } else if (val < TM_HEARTBEAT_MIN_INTERVAL) {
+                val = TM_HEARTBEAT_MIN_INTERVAL;
+        } else if (val > TM_HEARTBEAT_MAX_INTERVAL) {
+                val = TM_HEARTBEAT_MAX_INTERVAL;
+        }
+
+        return (int)val;
+}
+
+size_t raw_payload_max_size_config(void)
+{
+        initialize_config();
+        int64_t val = config->intValues[CONF_RAW_PAYLOAD_MAX_SIZE];
+
+        if (val < TM_RAW_PAYLOAD_MIN_SIZE) {
+                val = TM_RAW_PAYLOAD_MIN_SIZE;
+        } else if (val > TM_RAW_PAYLOAD_MAX_SIZE) {
+                val = TM_RAW_PAYLOAD_MAX_SIZE;
+        }
+
+        return (size_t)val * 1024;
+}
+
+size_t memory_budget_config(void)
+{
+        initialize_config();
+        int64_t val = config->intValues[CONF_MEMORY_BUDGET];
+
+        if (val <= 0) {
+                return 0;
+        } else if (val < TM_MEMORY_BUDGET_MIN_SIZE) {
+                val = TM_MEMORY_BUDGET_MIN_SIZE;
+        } else if (val > TM_MEMORY_BUDGET_MAX_SIZE) {
+                val = TM_MEMORY_BUDGET_MAX_SIZE;
+        }
+
+        return (size_t)val * 1024;
+}
+
+const char *heartbeat_payload_config(void)
+{
+        initialize_config();
+        return (const char *)config->strValues[CONF_HEARTBEAT_PAYLOAD];
+}
+
+const char *destinations_config(void)
+{
+        initialize_config();
+        return (const char *)config->strValues[CONF_DESTINATIONS];
+}
+
+const char *class_sample_rates_config(void)
+{
+        initialize_config();
+        return (const char *)config->strValues[CONF_CLASS_SAMPLE_RATES];
+}
+
+const char *class_aggregation_config(void)
+{
+        initialize_config();
+        return (const char *)config->strValues[CONF_CLASS_AGGREGATION];
 }
 
 int64_t record_expiry_config()
@@ -311,7 +1073,7 @@ int64_t record_expiry_config()
         int64_t val = 0;
         int64_t clamp = LONG_MAX / 60;
 
-        val = config.intValues[CONF_RECORD_EXPIRY];
+        val = config->intValues[CONF_RECORD_EXPIRY];
 
         /* This value is elsewhere converted to seconds (multiplied by 60)
          * for comparison to time-stamps. Therefore we need to clamp this
@@ -331,7 +1093,7 @@ int64_t spool_max_size_config()
         int64_t val = 0;
         int64_t clamp = LONG_MAX / 1024;
 
-        val = config.intValues[CONF_SPOOL_MAX_SIZE];
+        val = config->intValues[CONF_SPOOL_MAX_SIZE];
 
         /* This value is later converted to bytes for comparison purposes,
          * so we must clamp this to LONG_MAX/1024 to avoid overflow
@@ -349,7 +1111,7 @@ int spool_process_time_config()
         initialize_config();
         int64_t val = 0;
 
-        val = config.intValues[CONF_SPOOL_PROCESS_TIME];
+        val = config->intValues[CONF_SPOOL_PROCESS_TIME];
 
         if (val < TM_SPOOL_RUN_MIN) {
                 /* Spool loop should not run more frequently than 2 min */
@@ -366,7 +1128,7 @@ int spool_process_time_config()
 int64_t record_burst_limit_config()
 {
         initialize_config();
-        return config.intValues[CONF_RECORD_BURST_LIMIT];
+        return config->intValues[CONF_RECORD_BURST_LIMIT];
 }
 
 int record_window_length_config()
@@ -374,7 +1136,7 @@ int record_window_length_config()
         initialize_config();
         int64_t val = 0;
 
-        val =  config.intValues[CONF_RECORD_WINDOW_LENGTH];
+        val =  config->intValues[CONF_RECORD_WINDOW_LENGTH];
 
         //WINDOW LENGTH MUST BE INT BETWEEN (0-59)
         return (val < 0 || val >= TM_MAX_WINDOW_LENGTH) ? -1 : (int)val;
@@ -383,7 +1145,7 @@ int record_window_length_config()
 int64_t byte_burst_limit_config()
 {
         initialize_config();
-        return config.intValues[CONF_BYTE_BURST_LIMIT];
+        return config->intValues[CONF_BYTE_BURST_LIMIT];
 }
 
 int byte_window_length_config()
@@ -391,55 +1153,277 @@ int byte_window_length_config()
         initialize_config();
         int64_t val = 0;
 
-        val = config.intValues[CONF_BYTE_WINDOW_LENGTH];
+        val = config->intValues[CONF_BYTE_WINDOW_LENGTH];
 
         //WINDOW LENGTH MUST BE INT BETWEEN (0-59)
         return (val < 0 || val >= TM_MAX_WINDOW_LENGTH) ? -1 : (int)val;
 }
 
+int socket_write_timeout_config()
+{
+        initialize_config();
+        int64_t val = 0;
+
+        val = config->intValues[CONF_SOCKET_WRITE_TIMEOUT];
+
+        if (val > INT_MAX) {
+                val = INT_MAX;
+        }
+
+        return (val < 0) ? -1 : (int)val;
+}
+
 bool rate_limit_enabled_config()
 {
         initialize_config();
-        return config.boolValues[CONF_RATE_LIMIT_ENABLED];
+        return config->boolValues[CONF_RATE_LIMIT_ENABLED];
 }
 
 const char *rate_limit_strategy_config()
 {
         initialize_config();
-        char *val = NULL;
-        size_t k = 0;
-
-        val = config.strValues[CONF_RATE_LIMIT_STRATEGY];
-        k = strlen(val);
-
-        for (int i = 0; i < k; i++) {
-                val[i] = (char)tolower(val[i]);
-        }
+        const char *val = config->strValues[CONF_RATE_LIMIT_STRATEGY];
 
         /* default strategy is "spool". */
 
-        if ((strcmp(val, "spool") != 0) && (strcmp(val, "drop") != 0)) {
-                val = "spool";
+        if (strcasecmp(val, "drop") == 0) {
+                return "drop";
         }
 
-        return val;
+        return "spool";
 }
 
 bool daemon_recycling_enabled_config(void)
 {
         initialize_config();
-        return config.boolValues[CONF_DAEMON_RECYCLING_ENABLED];
+        return config->boolValues[CONF_DAEMON_RECYCLING_ENABLED];
 }
 
 bool record_retention_enabled_config(void)
 {
         initialize_config();
-        return config.boolValues[CONF_RECORD_RETENTION_ENABLED];
+        return config->boolValues[CONF_RECORD_RETENTION_ENABLED];
 }
 
 bool record_server_delivery_enabled_config(void)
 {
         initialize_config();
-        return config.boolValues[CONF_RECORD_SERVER_DELIVERY_ENABLED];
+        return config->boolValues[CONF_RECORD_SERVER_DELIVERY_ENABLED];
 }
+
+bool staging_log_enabled_config(void)
+{
+        initialize_config();
+        return config->boolValues[CONF_STAGING_LOG_ENABLED];
+}
+
+int64_t staging_segment_size_config(void)
+{
+        initialize_config();
+        int64_t val = 0;
+        int64_t clamp = LONG_MAX / 1024;
+
+        val = config->intValues[CONF_STAGING_SEGMENT_SIZE];
+
+        /* Converted to bytes later, clamp to avoid overflow */
+        if (val > clamp) {
+                val = clamp;
+        } else if (val < TM_STAGING_SEGMENT_MIN_SIZE) {
+                val = TM_STAGING_SEGMENT_MIN_SIZE;
+        }
+
+        return val;
+}
+
+int probe_worker_threads_config(void)
+{
+        initialize_config();
+        int64_t val = config->intValues[CONF_PROBE_WORKER_THREADS];
+
+        if (val < 0) {
+                val = 0;
+        } else if (val > TM_MAX_PROBE_WORKER_THREADS) {
+                val = TM_MAX_PROBE_WORKER_THREADS;
+        }
+
+        return (int)val;
+}
+
+int post_worker_threads_config(void)
+{
+        initialize_config();
+        int64_t val = config->intValues[CONF_POST_WORKER_THREADS];
+
+        if (val < 0) {
+                val = 0;
+        } else if (val > TM_MAX_POST_WORKER_THREADS) {
+                val = TM_MAX_POST_WORKER_THREADS;
+        }
+
+        return (int)val;
+}
+
+bool ring_buffer_enabled_config(void)
+{
+        initialize_config();
+        return config->boolValues[CONF_RING_BUFFER_ENABLED];
+}
+
+int64_t ring_buffer_size_config(void)
+{
+        initialize_config();
+        int64_t val = 0;
+        int64_t clamp = LONG_MAX / 1024;
+
+        val = config->intValues[CONF_RING_BUFFER_SIZE];
+
+        /* Converted to bytes later, clamp to avoid overflow */
+        if (val > clamp) {
+                val = clamp;
+        } else if (val < TM_RING_BUFFER_MIN_SIZE) {
+                val = TM_RING_BUFFER_MIN_SIZE;
+        }
+
+        return val;
+}
+
+int max_inflight_posts_config(void)
+{
+        initialize_config();
+        int64_t val = config->intValues[CONF_MAX_INFLIGHT_POSTS];
+
+        if (val < 1) {
+                val = 1;
+        } else if (val > TM_MAX_INFLIGHT_POSTS) {
+                val = TM_MAX_INFLIGHT_POSTS;
+        }
+
+        return (int)val;
+}
+
+bool batch_post_enabled_config(void)
+{
+        initialize_config();
+        return config->boolValues[CONF_BATCH_POST_ENABLED];
+}
+
+int batch_post_max_records_config(void)
+{
+        initialize_config();
+        int64_t val = config->intValues[CONF_BATCH_POST_MAX_RECORDS];
+
+        if (val < 1) {
+                val = 1;
+        } else if (val > TM_BATCH_POST_MAX_RECORDS) {
+                val = TM_BATCH_POST_MAX_RECORDS;
+        }
+
+        return (int)val;
+}
+
+int64_t batch_post_max_size_config(void)
+{
+        initialize_config();
+        int64_t val = config->intValues[CONF_BATCH_POST_MAX_SIZE];
+
+        if (val < TM_BATCH_POST_MIN_SIZE) {
+                val = TM_BATCH_POST_MIN_SIZE;
+        } else if (val > TM_BATCH_POST_MAX_SIZE) {
+                val = TM_BATCH_POST_MAX_SIZE;
+        }
+
+        return val;
+}
+
+int batch_post_max_time_config(void)
+{
+        initialize_config();
+        int64_t val = config->intValues[CONF_BATCH_POST_MAX_TIME];
+
+        if (val < 0) {
+                val = 0;
+        } else if (val > TM_BATCH_POST_MAX_TIME) {
+                val = TM_BATCH_POST_MAX_TIME;
+        }
+
+        return (int)val;
+}
+
+int spool_drain_min_records_config(void)
+{
+        initialize_config();
+        int64_t val = config->intValues[CONF_SPOOL_DRAIN_MIN_RECORDS];
+
+        if (val < 1) {
+                val = 1;
+        } else if (val > TM_SPOOL_DRAIN_MAX_RECORDS) {
+                val = TM_SPOOL_DRAIN_MAX_RECORDS;
+        }
+
+        return (int)val;
+}
+
+int spool_drain_max_records_config(void)
+{
+        initialize_config();
+        int64_t val = config->intValues[CONF_SPOOL_DRAIN_MAX_RECORDS];
+        int min = spool_drain_min_records_config();
+
+        if (val < min) {
+                val = min;
+        } else if (val > TM_SPOOL_DRAIN_MAX_RECORDS) {
+                val = TM_SPOOL_DRAIN_MAX_RECORDS;
+        }
+
+        return (int)val;
+}
+
+bool compressed_uploads_config(void)
+{
+        initialize_config();
+        return config->boolValues[CONF_COMPRESSED_UPLOADS];
+}
+
+bool compressed_spool_config(void)
+{
+        initialize_config();
+        return config->boolValues[CONF_COMPRESSED_SPOOL];
+}
+
+bool compressed_retention_config(void)
+{
+        initialize_config();
+        return config->boolValues[CONF_COMPRESSED_RETENTION];
+}
+
+bool http_keepalive_config(void)
+{
+        initialize_config();
+        return config->boolValues[CONF_HTTP_KEEPALIVE];
+}
+
+bool http2_enabled_config(void)
+{
+        initialize_config();
+        return config->boolValues[CONF_HTTP2_ENABLED];
+}
+
+bool record_tracing_config(void)
+{
+        initialize_config();
+        return config->boolValues[CONF_RECORD_TRACING];
+}
+
+bool record_trace_header_config(void)
+{
+        initialize_config();
+        return config->boolValues[CONF_RECORD_TRACE_HEADER];
+}
+
+bool io_uring_enabled_config(void)
+{
+        initialize_config();
+        return config->boolValues[CONF_IO_URING_ENABLED];
+}
+
 /* vi: set ts=8 sw=8 sts=4 et tw=80 cino=(0: */
@@ -25,6 +25,13 @@
 #define DEFAULT_RATE_LIMIT_STRATEGY "spool"
 #define DEFAULT_CAINFO ""
 #define DEFAULT_TIDHEADER "X-Telemetry-TID: 6907c830-eed9-4ce9-81ae-76daf8d88f0f"
+#define DEFAULT_CLASS_RATE_LIMITS ""
+#define DEFAULT_JOURNAL_SYNC "none"
+#define DEFAULT_HEARTBEAT_PAYLOAD "locale,uptime"
+#define DEFAULT_DESTINATIONS ""
+#define DEFAULT_CLASS_SAMPLE_RATES ""
+#define DEFAULT_CLASS_AGGREGATION ""
+#define DEFAULT_SOCKET_TRANSPORT "stream"
 
 #define DEFAULT_RECORD_EXPIRY 1200
 #define DEFAULT_SPOOL_MAX_SIZE 5120
@@ -33,11 +40,77 @@
 #define DEFAULT_BYTE_WINDOW_LENGTH 20
 #define DEFAULT_RECORD_BURST_LIMIT 1000
 #define DEFAULT_BYTE_BURST_LIMIT -1
+#define DEFAULT_SOCKET_WRITE_TIMEOUT 1000
+#define DEFAULT_STAGING_SEGMENT_SIZE 1024
+#define DEFAULT_RING_BUFFER_SIZE 256
+#define DEFAULT_PROBE_WORKER_THREADS 0
+#define DEFAULT_MAX_INFLIGHT_POSTS 1
+#define DEFAULT_BATCH_POST_MAX_RECORDS 100
+#define DEFAULT_BATCH_POST_MAX_SIZE 256
+#define DEFAULT_BATCH_POST_MAX_TIME 1000
+#define DEFAULT_SPOOL_DRAIN_MIN_RECORDS 1
+#define DEFAULT_SPOOL_DRAIN_MAX_RECORDS 1000
+#define DEFAULT_JOURNAL_GROUP_ENTRIES 32
+#define DEFAULT_JOURNAL_GROUP_TIME 1000
+#define DEFAULT_CRASH_DEDUP_WINDOW 0
+#define DEFAULT_HEARTBEAT_INTERVAL 0
+#define DEFAULT_RAW_PAYLOAD_MAX_SIZE 4096
+#define DEFAULT_MEMORY_BUDGET 0
+#define DEFAULT_POST_WORKER_THREADS 0
 
 #define DEFAULT_RATE_LIMIT_ENABLED true
 #define DEFAULT_DAEMON_RECYCLING_ENABLED true
 #define DEFAULT_RECORD_RETENTION_ENABLED false
 #define DEFAULT_RECORD_SERVER_DELIVERY_ENABLED true
+#define DEFAULT_STAGING_LOG_ENABLED false
+#define DEFAULT_RING_BUFFER_ENABLED false
+#define DEFAULT_HTTP_KEEPALIVE false
+#define DEFAULT_HTTP2_ENABLED false
+#define DEFAULT_BATCH_POST_ENABLED false
+#define DEFAULT_COMPRESSED_UPLOADS false
+#define DEFAULT_COMPRESSED_SPOOL false
+#define DEFAULT_COMPRESSED_RETENTION false
+#define DEFAULT_RECORD_TRACING false
+#define DEFAULT_RECORD_TRACE_HEADER false
+#define DEFAULT_IO_URING_ENABLED false
+
+/* A staging log segment must fit at least one record of maximum size */
+#define TM_STAGING_SEGMENT_MIN_SIZE 16
+
+#define TM_MAX_PROBE_WORKER_THREADS 64
+
+#define TM_MAX_POST_WORKER_THREADS 64
+
+#define TM_MAX_INFLIGHT_POSTS 64
+
+#define TM_BATCH_POST_MAX_RECORDS 1000
+
+/* A batch must fit at least one record of maximum size */
+#define TM_BATCH_POST_MIN_SIZE 16
+#define TM_BATCH_POST_MAX_SIZE 4096
+
+#define TM_BATCH_POST_MAX_TIME (60 * 1000)
+
+#define TM_SPOOL_DRAIN_MAX_RECORDS 10000
+
+#define TM_JOURNAL_GROUP_MAX_ENTRIES 1000
+#define TM_JOURNAL_GROUP_MAX_TIME (60 * 1000)
+
+#define TM_CRASH_DEDUP_MAX_WINDOW (24 * 60 * 60)
+
+#define TM_HEARTBEAT_MIN_INTERVAL 60
+#define TM_HEARTBEAT_MAX_INTERVAL (7 * 24 * 60 * 60)
+
+/* Binary payloads may always be as large as text payloads */
+#define TM_RAW_PAYLOAD_MIN_SIZE 8
+#define TM_RAW_PAYLOAD_MAX_SIZE (1024 * 1024)
+
+/* Below a few MiB a daemon would trim on every check */
+#define TM_MEMORY_BUDGET_MIN_SIZE (4 * 1024)
+#define TM_MEMORY_BUDGET_MAX_SIZE (4 * 1024 * 1024)
+
+/* The record ring must fit at least one record of maximum size */
+#define TM_RING_BUFFER_MIN_SIZE 32
 
 #define TM_MAX_WINDOW_LENGTH (1 /*h*/ * 60 /*m*/)
 
@@ -48,6 +121,13 @@ enum config_str_keys {
         CONF_RATE_LIMIT_STRATEGY,
         CONF_CAINFO,
         CONF_TIDHEADER,
+        CONF_CLASS_RATE_LIMITS,
+        CONF_JOURNAL_SYNC,
+        CONF_HEARTBEAT_PAYLOAD,
+        CONF_DESTINATIONS,
+        CONF_CLASS_SAMPLE_RATES,
+        CONF_CLASS_AGGREGATION,
+        CONF_SOCKET_TRANSPORT,
         CONF_STR_MAX
 };
 
@@ -59,6 +139,23 @@ enum config_int_keys {
         CONF_BYTE_WINDOW_LENGTH,
         CONF_RECORD_BURST_LIMIT,
         CONF_BYTE_BURST_LIMIT,
+        CONF_SOCKET_WRITE_TIMEOUT,
+        CONF_STAGING_SEGMENT_SIZE,
+        CONF_RING_BUFFER_SIZE,
+        CONF_PROBE_WORKER_THREADS,
+        CONF_MAX_INFLIGHT_POSTS,
+        CONF_BATCH_POST_MAX_RECORDS,
+        CONF_BATCH_POST_MAX_SIZE,
+        CONF_BATCH_POST_MAX_TIME,
+        CONF_SPOOL_DRAIN_MIN_RECORDS,
+        CONF_SPOOL_DRAIN_MAX_RECORDS,
+        CONF_JOURNAL_GROUP_ENTRIES,
+        CONF_JOURNAL_GROUP_TIME,
+        CONF_CRASH_DEDUP_WINDOW,
+        CONF_HEARTBEAT_INTERVAL,
+        CONF_RAW_PAYLOAD_MAX_SIZE,
+        CONF_MEMORY_BUDGET,
+        CONF_POST_WORKER_THREADS,
         CONF_INT_MAX
 };
 
@@ -67,6 +164,17 @@ enum config_bool_keys {
         CONF_DAEMON_RECYCLING_ENABLED,
         CONF_RECORD_RETENTION_ENABLED,
         CONF_RECORD_SERVER_DELIVERY_ENABLED,
+        CONF_STAGING_LOG_ENABLED,
+        CONF_RING_BUFFER_ENABLED,
+        CONF_HTTP_KEEPALIVE,
+        CONF_HTTP2_ENABLED,
+        CONF_BATCH_POST_ENABLED,
+        CONF_COMPRESSED_UPLOADS,
+        CONF_COMPRESSED_SPOOL,
+        CONF_COMPRESSED_RETENTION,
+        CONF_RECORD_TRACING,
+        CONF_RECORD_TRACE_HEADER,
+        CONF_IO_URING_ENABLED,
         CONF_BOOL_MAX
 };
 
@@ -76,6 +184,9 @@ typedef struct configuration {
         bool boolValues[CONF_BOOL_MAX];
         bool initialized;
         char *config_file;
+        /* mapping of the snapshot holding strValues, if read from one */
+        void *snapshot;
+        size_t snapshot_size;
 } configuration;
 
 /* Sets the configuration file to be used later */
@@ -87,14 +198,89 @@ const char *get_config_file(void);
 /* Gets the configuration specified via command line or NULL */
 const char *get_cmd_line_config_file(void);
 
+#define CONFIG_FILES_MAX 2
+
+/* Gets the files the configuration may be read from, the one specified via
+ * command line or else the custom one and the default one. Returns their
+ * number. */
+int get_config_files(const char *files[CONFIG_FILES_MAX]);
+
 /* Sets all default configuration values to a given config */
 bool set_default_config_values(struct configuration *config);
 
 /* Parses the ini format config file */
 bool read_config_from_file(char *filename, struct configuration *config);
 
-/* Causes the daemon to read the configuration file */
-void reload_config(void);
+/*
+ * Causes the daemon to read the configuration file again. Returns false,
+ * keeping the configuration in use, if the file cannot be parsed. For the
+ * calling thread, the values of the configuration it replaces stay valid
+ * until its next reload. For a reader thread, see config_reader_register(),
+ * they stay valid until its next checkpoint.
+ */
+bool reload_config(void);
+
+/* Threads that may read configuration values while another one reloads,
+ * such as the worker threads of telemprobd */
+#define CONFIG_READERS_MAX TM_MAX_PROBE_WORKER_THREADS
+
+/*
+ * Registers the calling thread as a reader of the configuration, before it
+ * reads any value. Returns the reader, or -ENOSPC if there are
+ * CONFIG_READERS_MAX readers already; such a thread must not read values
+ * while the configuration may be reloaded.
+ */
+int config_reader_register(void);
+
+/* Unregisters a reader, once it reads no more values */
+void config_reader_unregister(int reader);
+
+/*
+ * Tells that the reader keeps no value read before the call, such as
+ * between two records. A configuration replaced by reload_config() is only
+ * freed once every reader has passed a checkpoint since.
+ */
+void config_reader_checkpoint(int reader);
+
+/*
+ * Tells that the reader keeps no value and reads none until its next
+ * checkpoint, such as while it waits for work, so that it does not hold
+ * back replaced configurations meanwhile.
+ */
+void config_reader_offline(int reader);
+
+/* Gets the configuration currently in use, read on first use */
+const struct configuration *get_config(void);
+
+/*
+ * Snapshot of the configuration in use, written by telemprobd once it has
+ * read its configuration. Other processes map it on first use instead of
+ * parsing the config file, as long as it was written from the file they
+ * would read, unmodified since. The strings it holds are read-only.
+ */
+#define CONFIG_SNAPSHOT_FILE LOCALSTATEDIR "/lib/telemetry/config.snapshot"
+
+/* Sets the snapshot file to read and write, NULL to not use one. The
+ * string is not copied. */
+void set_config_snapshot_file(const char *filename);
+
+/*
+ * Reads the configuration from the snapshot file, if it is not stale for
+ * the given config file, or for using defaults if source is NULL
+ */
+bool read_config_snapshot(const char *source, struct configuration *config);
+
+/* Writes the configuration in use to the snapshot file, returns 0 or a
+ * negative errno value */
+int write_config_snapshot(void);
+
+/*
+ * Gets the configuration parsed from a file, kept in a cache keyed by path
+ * and read again once the file is modified. Returns NULL if the file is not
+ * an absolute path to a regular file or cannot be parsed. The configuration
+ * stays valid until the next call for the same file. Not thread safe.
+ */
+const struct configuration *get_cached_config(const char *filename);
 
 /* Getters for the configuration values */
 
@@ -104,6 +290,9 @@ const char *server_addr_config(void);
 /* Gets the path for the unix domain socket */
 const char *socket_path_config(void);
 
+/* Gets the type of the unix domain socket: "stream" or "seqpacket" */
+const char *socket_transport_config(void);
+
 /* Gets the path for the spool directory */
 const char *spool_dir_config(void);
 
@@ -131,6 +320,12 @@ int64_t byte_burst_limit_config(void);
 /* Gets the byte window length */
 int byte_window_length_config(void);
 
+/*
+ * Gets how long, in milliseconds, libtelemetry waits for telemprobd to drain
+ * the socket before giving up on a record, or -1 to wait indefinitely
+ */
+int socket_write_timeout_config(void);
+
 /* Gets whether rate limiting is enabled */
 bool rate_limit_enabled_config(void);
 
@@ -143,6 +338,46 @@ const char *get_cainfo_config(void);
 /* Gets tidheader */
 const char *get_tidheader_config(void);
 
+/* Gets the rate limits of classifications, see class_limits_init() */
+const char *class_rate_limits_config(void);
+
+/* Gets when journal writes are synced: "none", "group" or "entry" */
+const char *journal_sync_config(void);
+
+/* Gets the most journal entries written before a group is synced */
+int journal_group_entries_config(void);
+
+/* Gets the most time in milliseconds journal entries wait for a group sync */
+int journal_group_time_config(void);
+
+/* Gets the seconds in which the duplicates of a crash are counted, not sent */
+int crash_dedup_window_config(void);
+
+/* Gets the seconds between heartbeats staged by telemprobd, 0 for none */
+int heartbeat_interval_config(void);
+
+/* Gets the largest binary payload in bytes, see tm_set_payload_binary() */
+size_t raw_payload_max_size_config(void);
+
+/* Gets the resident set size in bytes above which a daemon trims its heap,
+ * 0 to trim only when idle */
+size_t memory_budget_config(void);
+
+/* Gets the comma separated lines of the heartbeat payload */
+const char *heartbeat_payload_config(void);
+
+/* Gets the comma separated name[:records]=url destinations records are also
+ * sent to, besides the server */
+const char *destinations_config(void);
+
+/* Gets the comma separated prefix:N entries of the classifications of which
+ * one record in N is kept */
+const char *class_sample_rates_config(void);
+
+/* Gets the comma separated prefix:seconds aggregation windows of
+ * classifications */
+const char *class_aggregation_config(void);
+
 /* Gets whether recycling is enabled */
 bool daemon_recycling_enabled_config(void);
 
@@ -152,4 +387,69 @@ bool record_retention_enabled_config(void);
 /* Gets whether records should be sent to server_addr */
 bool record_server_delivery_enabled_config(void);
 
+/* Gets whether records are staged in a segmented log instead of one file each */
+bool staging_log_enabled_config(void);
+
+/* Gets the size in KB after which a new staging log segment is started */
+int64_t staging_segment_size_config(void);
+
+/* Gets the number of telemprobd worker threads, 0 to handle clients in the
+ * main thread */
+int probe_worker_threads_config(void);
+
+/* Gets the number of telempostd threads reading staged record files, 0 to
+ * read them in the thread processing them */
+int post_worker_threads_config(void);
+
+/* Gets whether telempostd hands a shared memory ring to telemprobd */
+bool ring_buffer_enabled_config(void);
+
+/* Gets the size in KB of the shared memory record ring */
+int64_t ring_buffer_size_config(void);
+
+/* Gets the number of POSTs telempostd runs concurrently */
+int max_inflight_posts_config(void);
+
+/* Gets whether spooled and retried records are sent several per POST */
+bool batch_post_enabled_config(void);
+
+/* Gets the maximum number of records in a batched POST */
+int batch_post_max_records_config(void);
+
+/* Gets the maximum size in KB of a batched POST body */
+int64_t batch_post_max_size_config(void);
+
+/* Gets the maximum time in milliseconds spent filling a batch */
+int batch_post_max_time_config(void);
+
+/* Gets the least number of records a spool pass sends while draining */
+int spool_drain_min_records_config(void);
+
+/* Gets the most records a spool pass sends, at least the least number */
+int spool_drain_max_records_config(void);
+
+/* Gets whether telempostd compresses the POST bodies it sends */
+bool compressed_uploads_config(void);
+
+/* Gets whether the payloads of records kept in the spool are compressed */
+bool compressed_spool_config(void);
+
+/* Gets whether the local copies of records are compressed */
+bool compressed_retention_config(void);
+
+/* Gets whether telempostd keeps its HTTP connection open between records */
+bool http_keepalive_config(void);
+
+/* Gets whether telempostd may use HTTP/2 with the server */
+bool http2_enabled_config(void);
+
+/* Gets whether records carry the times they went through each stage */
+bool record_tracing_config(void);
+
+/* Gets whether telempostd sends the trace of a record in an HTTP header */
+bool record_trace_header_config(void);
+
+/* Gets whether telempostd reads and removes record files with io_uring */
+bool io_uring_enabled_config(void);
+
 /* vi: set ts=8 sw=8 sts=4 et tw=80 cino=(0: */
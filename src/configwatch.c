@@ -0,0 +1,125 @@
+/*
+ * This program is part of the Clear Linux Project
+ *
+ * Copyright 2019 Intel Corporation
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms and conditions of the GNU Lesser General Public License, as
+ * published by the Free Software Foundation; either version 2.1 of the License,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU Lesser General Public License for more
+ * details.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <libgen.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+
+#include "configwatch.h"
+#include "log.h"
+
+#define CONFIG_WATCH_EVENTS (IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM | \
+                             IN_DELETE)
+#define CONFIG_WATCH_BUFFER (16 * (sizeof(struct inotify_event) + NAME_MAX + 1))
+
+int config_watch_init(struct config_watch *watch)
+{
+        const char *files[CONFIG_FILES_MAX];
+        int count = get_config_files(files);
+        int watched = 0;
+        int ret = 0;
+
+        for (int i = 0; i < CONFIG_FILES_MAX; i++) {
+                watch->wd[i] = -1;
+                watch->name[i] = NULL;
+        }
+
+        watch->fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+        if (watch->fd < 0) {
+                return -errno;
+        }
+
+        for (int i = 0; i < count; i++) {
+                char *dir = strdup(files[i]);
+                char *name = strdup(files[i]);
+
+                if (!dir || !name) {
+                        free(dir);
+                        free(name);
+                        ret = -ENOMEM;
+                        break;
+                }
+                watch->name[i] = strdup(basename(name));
+                free(name);
+                if (!watch->name[i]) {
+                        free(dir);
+                        ret = -ENOMEM;
+                        break;
+                }
+
+                /* The directory may not exist, as the custom one often */
+                watch->wd[i] = inotify_add_watch(watch->fd, dirname(dir),
+                                                 CONFIG_WATCH_EVENTS);
+                if (watch->wd[i] >= 0) {
+                        watched++;
+                } else {
+                        telem_debug("DEBUG: Not watching %s: %s\n", dir,
+                                    strerror(errno));
+                }
+                free(dir);
+        }
+
+        if (ret < 0 || watched == 0) {
+                config_watch_close(watch);
+        }
+
+        return ret;
+}
+
+bool config_watch_read(struct config_watch *watch)
+{
+        char buffer[CONFIG_WATCH_BUFFER]
+                __attribute__((aligned(__alignof__(struct inotify_event))));
+        bool changed = false;
+        ssize_t length;
+
+        while ((length = read(watch->fd, buffer, sizeof(buffer))) > 0) {
+                for (ssize_t i = 0; i < length;) {
+                        struct inotify_event *event = (struct inotify_event *)&buffer[i];
+
+                        /* Both files may be in the same directory */
+                        for (int j = 0; event->len && j < CONFIG_FILES_MAX; j++) {
+                                if (event->wd == watch->wd[j] &&
+                                    strcmp(event->name, watch->name[j]) == 0) {
+                                        changed = true;
+                                }
+                        }
+                        i += (ssize_t)sizeof(struct inotify_event) + event->len;
+                }
+        }
+
+        return changed;
+}
+
+void config_watch_close(struct config_watch *watch)
+{
+        if (watch->fd >= 0) {
+                close(watch->fd);
+                watch->fd = -1;
+        }
+        for (int i = 0; i < CONFIG_FILES_MAX; i++) {
+                watch->wd[i] = -1;
+                free(watch->name[i]);
+                watch->name[i] = NULL;
+        }
+}
+
+/* vi: set ts=8 sw=8 sts=4 et tw=80 cino=(0: */
@@ -0,0 +1,63 @@
+/*
+ * This program is part of the Clear Linux Project
+ *
+ * Copyright 2019 Intel Corporation
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms and conditions of the GNU Lesser General Public License, as
+ * published by the Free Software Foundation; either version 2.1 of the License,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU Lesser General Public License for more
+ * details.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+
+#include "configuration.h"
+
+/*
+ * Watches the configuration files, so that the daemons reload their
+ * configuration once it is edited, without waiting for a SIGHUP. The
+ * directories are watched rather than the files, to see files replaced by
+ * a rename and files created where there were none.
+ */
+struct config_watch {
+        /* inotify descriptor, -1 if nothing is watched */
+        int fd;
+        int wd[CONFIG_FILES_MAX];
+        /* name of the file watched in each directory */
+        char *name[CONFIG_FILES_MAX];
+};
+
+/**
+ * Starts watching the files the configuration may be read from
+ *
+ * @param watch The watch, with fd -1 if no directory could be watched
+ *
+ * @return 0 on success, or a negative errno value
+ */
+int config_watch_init(struct config_watch *watch);
+
+/**
+ * Reads the pending events of the watch, to be called once its fd is
+ * readable
+ *
+ * @param watch The watch
+ *
+ * @return true if a configuration file was written, replaced or removed
+ */
+bool config_watch_read(struct config_watch *watch);
+
+/**
+ * Stops watching
+ *
+ * @param watch The watch
+ */
+void config_watch_close(struct config_watch *watch);
+
+/* vi: set ts=8 sw=8 sts=4 et tw=80 cino=(0: */
@@ -0,0 +1,503 @@
+/*
+ * This program is part of the Clear Linux Project
+ *
+ * Copyright 2019 Intel Corporation
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms and conditions of the GNU Lesser General Public License, as
+ * published by the Free Software Foundation; either version 2.1 of the License,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU Lesser General Public License for more
+ * details.
+ */
+
+#define _GNU_SOURCE
+#include <ctype.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "configuration.h"
+#include "destination.h"
+#include "log.h"
+
+/* Gets the current monotonic time in milliseconds */
+static int64_t destination_clock(void)
+{
+        struct timespec now;
+
+        clock_gettime(CLOCK_MONOTONIC, &now);
+
+        return (int64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+static bool valid_name(const char *name, size_t len)
+{
+        if (len == 0 || len > TM_DESTINATION_NAME_MAX) {
+                return false;
+        }
+        for (size_t i = 0; i < len; i++) {
+                if (!isalnum((unsigned char)name[i]) && name[i] != '-' && name[i] != '_') {
+                        return false;
+                }
+        }
+
+        return true;
+}
+
+/* Parses a name[:records]=url entry */
+static int parse_destination(struct destination *dest, const char *entry)
+{
+        const char *eq = strchr(entry, '=');
+        const char *colon;
+        size_t name_len;
+        char *end;
+
+        if (!eq || eq[1] == '\0') {
+                return -EINVAL;
+        }
+        colon = memchr(entry, ':', (size_t)(eq - entry));
+        name_len = (size_t)((colon ? colon : eq) - entry);
+        if (!valid_name(entry, name_len)) {
+                return -EINVAL;
+        }
+        if (colon) {
+                long rate;
+
+                errno = 0;
+                rate = strtol(colon + 1, &end, 10);
+                if (errno != 0 || end != eq || end == colon + 1 || rate <= 0) {
+                        return -EINVAL;
+                }
+                dest->rate = (double)rate;
+        }
+
+        dest->name = strndup(entry, name_len);
+        dest->url = strdup(eq + 1);
+        if (!dest->name || !dest->url) {
+                return -ENOMEM;
+        }
+
+        return 0;
+}
+
+/* Removes a directory of records and its records */
+static void remove_records_dir(const char *path)
+{
+        DIR *dir = opendir(path);
+        struct dirent *de;
+
+        if (!dir) {
+                return;
+        }
+        while ((de = readdir(dir)) != NULL) {
+                if (strcmp(de->d_name, ".") != 0 && strcmp(de->d_name, "..") != 0) {
+                        unlinkat(dirfd(dir), de->d_name, 0);
+                }
+        }
+        closedir(dir);
+        if (rmdir(path) != 0) {
+                telem_log(LOG_WARNING, "Unable to remove %s: %s\n", path, strerror(errno));
+        }
+}
+
+/* Removes the directories of the destinations that are not listed */
+static void remove_unlisted(struct destinations *dests, const char *top)
+{
+        DIR *dir = opendir(top);
+        struct dirent *de;
+
+        if (!dir) {
+                return;
+        }
+        while ((de = readdir(dir)) != NULL) {
+                bool listed = false;
+                char *path;
+
+                if (de->d_name[0] == '.') {
+                        continue;
+                }
+                for (int i = 0; i < dests->count; i++) {
+                        listed = listed || strcmp(dests->list[i].name, de->d_name) == 0;
+                }
+                if (listed) {
+                        continue;
+                }
+                if (asprintf(&path, "%s/%s", top, de->d_name) == -1) {
+                        telem_log(LOG_ERR, "Unable to allocate memory, exiting\n");
+                        exit(EXIT_FAILURE);
+                }
+                telem_log(LOG_INFO, "Removing the records of destination %s\n", de->d_name);
+                remove_records_dir(path);
+                free(path);
+        }
+        closedir(dir);
+}
+
+int destinations_init(struct destinations *dests, const char *spec,
+                      const char *spool_dir)
+{
+        char *copy, *entry, *saveptr = NULL;
+        char *top = NULL;
+        int ret = 0;
+
+        memset(dests, 0, sizeof(struct destinations));
+        copy = strdup(spec);
+        if (!copy) {
+                return -ENOMEM;
+        }
+        dests->list = calloc(TM_MAX_DESTINATIONS, sizeof(struct destination));
+        if (!dests->list) {
+                free(copy);
+                return -ENOMEM;
+        }
+
+        for (entry = strtok_r(copy, ",", &saveptr); entry;
+             entry = strtok_r(NULL, ",", &saveptr)) {
+                struct destination *dest;
+
+                while (isspace((unsigned char)*entry)) {
+                        entry++;
+                }
+                if (*entry == '\0') {
+                        continue;
+                }
+                if (dests->count == TM_MAX_DESTINATIONS) {
+                        ret = -EINVAL;
+                        goto out;
+                }
+                dest = &dests->list[dests->count++];
+                spool_index_init(&dest->index);
+                ret = parse_destination(dest, entry);
+                if (ret < 0) {
+                        goto out;
+                }
+                for (int i = 0; i < dests->count - 1; i++) {
+                        if (strcmp(dests->list[i].name, dest->name) == 0) {
+                                ret = -EINVAL;
+                                goto out;
+                        }
+                }
+        }
+
+        if (asprintf(&top, "%s/%s", spool_dir, DESTINATIONS_DIR) == -1) {
+                ret = -ENOMEM;
+                goto out;
+        }
+        if (dests->count > 0 && mkdir(top, S_IRWXU) != 0 && errno != EEXIST) {
+                ret = -errno;
+                goto out;
+        }
+        remove_unlisted(dests, top);
+
+        for (int i = 0; i < dests->count; i++) {
+                struct destination *dest = &dests->list[i];
+
+                if (asprintf(&dest->dir, "%s/%s", top, dest->name) == -1) {
+                        ret = -ENOMEM;
+                        goto out;
+                }
+                if (mkdir(dest->dir, S_IRWXU) != 0 && errno != EEXIST) {
+                        ret = -errno;
+                        goto out;
+                }
+                ret = spool_index_rebuild(&dest->index, dest->dir);
+                if (ret < 0) {
+                        goto out;
+                }
+                retry_sched_init(&dest->sched, (unsigned int)time(NULL) ^
+                                 (unsigned int)getpid() ^ (unsigned int)i,
+                                 spool_drain_min_records_config(),
+                                 spool_drain_max_records_config());
+                dest->tokens = dest->rate;
+                dest->updated = destination_clock();
+                dest->last_pass = time(NULL);
+                dest->fresh = dest->index.count > 0;
+        }
+        ret = dests->count;
+out:
+        if (ret < 0) {
+                destinations_free(dests);
+        }
+        free(top);
+        free(copy);
+
+        return ret;
+}
+
+/* Adds a record linked into the directory of a destination */
+static void add_record(struct destination *dest, const char *name, time_t mtime,
+                       long disk_size, int priority)
+{
+        spool_index_add(&dest->index, name, mtime, disk_size, priority);
+        dest->fresh = true;
+}
+
+/* Links a record file into the directory of a destination */
+static bool link_record(struct destination *dest, const char *path,
+                        const char *name)
+{
+        char *dest_path;
+        bool ret;
+
+        if (asprintf(&dest_path, "%s/%s", dest->dir, name) == -1) {
+                telem_log(LOG_ERR, "Unable to allocate memory, exiting\n");
+                exit(EXIT_FAILURE);
+        }
+        ret = link(path, dest_path) == 0 || errno == EEXIST;
+        if (!ret) {
+                telem_log(LOG_ERR, "Unable to add record to destination %s: %s\n",
+                          dest->name, strerror(errno));
+        }
+        free(dest_path);
+
+        return ret;
+}
+
+int destinations_fan_out_file(struct destinations *dests, const char *path,
+                              const struct stat *st, int priority)
+{
+        const char *name = strrchr(path, '/');
+        int ret = 0;
+
+        name = name ? name + 1 : path;
+        for (int i = 0; i < dests->count; i++) {
+                if (link_record(&dests->list[i], path, name)) {
+                        add_record(&dests->list[i], name, st->st_mtime,
+                                   st->st_blocks * 512, priority);
+                        ret++;
+                }
+        }
+
+        /* Changes the ctime only, record expiry is based on the mtime */
+        if (dests->count > 0 &&
+            chmod(path, (st->st_mode & 07777) | TM_FANNED_OUT_MODE) != 0) {
+                telem_log(LOG_WARNING, "Unable to mark record %s: %s\n", path,
+                          strerror(errno));
+        }
+
+        return ret;
+}
+
+int destinations_fan_out_data(struct destinations *dests, const char *data,
+                              size_t size, time_t staged_time, int priority)
+{
+        struct timespec times[2];
+        struct stat st;
+        const char *name;
+        char *path;
+        int ret = 0;
+        int fd;
+
+        if (dests->count == 0) {
+                return 0;
+        }
+
+        /* Written in the directory of the first destination, linked into
+         * the others */
+        if (asprintf(&path, "%s/XXXXXX", dests->list[0].dir) == -1) {
+                telem_log(LOG_ERR, "Unable to allocate memory, exiting\n");
+                exit(EXIT_FAILURE);
+        }
+        fd = mkstemp(path);
+        if (fd < 0) {
+                telem_perror("Error opening destination record file");
+                free(path);
+                return 0;
+        }
+        if (write(fd, data, size) != (ssize_t)size) {
+                telem_perror("Error writing destination record file");
+                close(fd);
+                unlink(path);
+                free(path);
+                return 0;
+        }
+        times[0].tv_sec = times[1].tv_sec = staged_time;
+        times[0].tv_nsec = times[1].tv_nsec = 0;
+        if (futimens(fd, times) != 0) {
+                telem_perror("Error setting destination record file time");
+        }
+        fstat(fd, &st);
+        close(fd);
+
+        name = path + strlen(dests->list[0].dir) + 1;
+        add_record(&dests->list[0], name, staged_time, st.st_blocks * 512, priority);
+        ret++;
+        for (int i = 1; i < dests->count; i++) {
+                if (link_record(&dests->list[i], path, name)) {
+                        add_record(&dests->list[i], name, staged_time,
+                                   st.st_blocks * 512, priority);
+                        ret++;
+                }
+        }
+        free(path);
+
+        return ret;
+}
+
+static time_t next_pass(struct destination *dest, int interval)
+{
+        if (dest->index.count == 0) {
+                return 0;
+        }
+        if (dest->fresh) {
+                return dest->last_pass;
+        }
+
+        return retry_sched_next_pass(&dest->sched, dest->last_pass, interval, true);
+}
+
+time_t destinations_next_pass(struct destinations *dests, int interval)
+{
+        time_t next = 0;
+
+        for (int i = 0; i < dests->count; i++) {
+                time_t due = next_pass(&dests->list[i], interval);
+
+                if (due > 0 && (next == 0 || due < next)) {
+                        next = due;
+                }
+        }
+
+        return next;
+}
+
+/* Takes a token for a record, if the destination has a rate limit */
+static bool take_token(struct destination *dest)
+{
+        int64_t now = destination_clock();
+
+        if (dest->rate == 0) {
+                return true;
+        }
+        dest->tokens += (double)(now - dest->updated) * dest->rate / 60000.0;
+        if (dest->tokens > dest->rate) {
+                dest->tokens = dest->rate;
+        }
+        dest->updated = now;
+        if (dest->tokens < 1.0) {
+                return false;
+        }
+        dest->tokens -= 1.0;
+
+        return true;
+}
+
+/* Sends the records of a destination, oldest first, up to the first failed
+ * POST */
+static int destination_pass(struct destination *dest)
+{
+        struct spool_index kept;
+        struct spool_entry entry;
+        int64_t started = destination_clock();
+        int limit = retry_sched_pass_limit(&dest->sched, time(NULL));
+        bool failed = false;
+        int sent = 0;
+
+        dest->last_pass = time(NULL);
+        dest->fresh = false;
+        if (limit == 0) {
+                return 0;
+        }
+
+        spool_index_init(&kept);
+        while (!failed && sent < limit && spool_index_pop(&dest->index, &entry)) {
+                struct staged_record record = { 0 };
+                char *record_name;
+
+                if (asprintf(&record_name, "%s/%s", dest->dir, entry.name) == -1) {
+                        telem_log(LOG_ERR, "Unable to allocate memory, exiting\n");
+                        exit(EXIT_FAILURE);
+                }
+
+                if (time(NULL) - entry.mtime > (record_expiry_config() * 60)) {
+                        /* Expired */
+                        unlink(record_name);
+                        free(entry.name);
+                } else if (!take_token(dest)) {
+                        /* Waits for the next pass */
+                        spool_index_push(&kept, &entry);
+                        free(record_name);
+                        break;
+                } else if (!read_record(record_name, &record)) {
+                        telem_log(LOG_WARNING, "Unable to read record %s\n", record_name);
+                        unlink(record_name);
+                        free(entry.name);
+                } else if (post_destination_ptr(&record, dest)) {
+                        telem_log(LOG_DEBUG, "Record %s sent to %s\n", entry.name,
+                                  dest->name);
+                        unlink(record_name);
+                        retry_sched_success(&dest->sched);
+                        free(entry.name);
+                        sent++;
+                } else {
+                        telem_log(LOG_DEBUG, "Unable to send records to %s\n", dest->name);
+                        retry_sched_failure(&dest->sched, time(NULL));
+                        spool_index_push(&kept, &entry);
+                        failed = true;
+                }
+                free_record(&record);
+                free(record_name);
+        }
+
+        if (!failed && sent == 0) {
+                /* Nothing sent, give back the probe if not failed */
+                retry_sched_cancel(&dest->sched);
+        }
+        retry_sched_pass_done(&dest->sched, limit, sent, destination_clock() - started);
+        while (spool_index_pop(&kept, &entry)) {
+                spool_index_push(&dest->index, &entry);
+        }
+        spool_index_free(&kept);
+
+        return sent;
+}
+
+int destinations_run(struct destinations *dests, int interval)
+{
+        time_t now = time(NULL);
+        int sent = 0;
+
+        for (int i = 0; i < dests->count; i++) {
+                time_t due = next_pass(&dests->list[i], interval);
+
+                if (due > 0 && now >= due) {
+                        sent += destination_pass(&dests->list[i]);
+                }
+        }
+
+        return sent;
+}
+
+void destinations_close(struct destinations *dests)
+{
+        for (int i = 0; i < dests->count; i++) {
+                if (dests->list[i].handle) {
+                        curl_easy_cleanup(dests->list[i].handle);
+                        dests->list[i].handle = NULL;
+                        curl_global_cleanup();
+                }
+        }
+}
+
+void destinations_free(struct destinations *dests)
+{
+        destinations_close(dests);
+        for (int i = 0; i < dests->count; i++) {
+                free(dests->list[i].name);
+                free(dests->list[i].url);
+                free(dests->list[i].dir);
+                spool_index_free(&dests->list[i].index);
+        }
+        free(dests->list);
+        memset(dests, 0, sizeof(struct destinations));
+}
+
+/* vi: set ts=8 sw=8 sts=4 et tw=80 cino=(0: */
@@ -0,0 +1,161 @@
+/*
+ * This program is part of the Clear Linux Project
+ *
+ * Copyright 2019 Intel Corporation
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms and conditions of the GNU Lesser General Public License, as
+ * published by the Free Software Foundation; either version 2.1 of the License,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU Lesser General Public License for more
+ * details.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <curl/curl.h>
+
+#include "iorecord.h"
+#include "retrysched.h"
+#include "spool.h"
+
+/*
+ * Servers records are sent to besides server_addr, such as a central
+ * archive next to a regional collector. Each destination has a directory
+ * under DESTINATIONS_DIR in the spool directory, holding a hard link to
+ * each record file it was not sent yet, so that a record is staged once
+ * and its file is gone once every destination, and the spool, let go of
+ * it. A destination has its own index of the records in its directory,
+ * retry scheduler, rate limit and kept connection.
+ *
+ * Record files are fanned out when telempostd first picks them up. Files
+ * that were, and the spool copies telempostd writes, are marked with
+ * TM_FANNED_OUT_MODE, so that they are not fanned out again when the
+ * spool is retried at startup. Records with their own configuration file
+ * name their own server and are not fanned out.
+ */
+#define DESTINATIONS_DIR ".destinations"
+#define TM_MAX_DESTINATIONS 8
+#define TM_DESTINATION_NAME_MAX 32
+/* The sticky bit has no meaning for regular files */
+#define TM_FANNED_OUT_MODE S_ISVTX
+
+struct destination {
+        char *name;
+        char *url;
+        /* directory of the records not sent there yet */
+        char *dir;
+        struct spool_index index;
+        struct retry_sched sched;
+        /* records per minute, 0 without a limit, as a token bucket */
+        double rate;
+        double tokens;
+        int64_t updated;
+        time_t last_pass;
+        /* records were fanned out since the last pass */
+        bool fresh;
+        /* kept between POSTs, with its connections */
+        CURL *handle;
+};
+
+struct destinations {
+        struct destination *list;
+        int count;
+};
+
+/**
+ * Parses the destinations, a comma separated list of name[:records]=url
+ * entries with records per minute, and indexes their directories. The
+ * directories of destinations no longer listed are removed, with the
+ * records they held.
+ *
+ * @param dests The destinations
+ * @param spec The list, may be empty
+ * @param spool_dir Path of the spool directory
+ *
+ * @return the number of destinations, or -EINVAL if an entry is invalid,
+ *     or another negative errno-style value
+ */
+int destinations_init(struct destinations *dests, const char *spec,
+                      const char *spool_dir);
+
+/**
+ * Links a record file into the directory of each destination, and marks it
+ * as fanned out
+ *
+ * @param dests The destinations
+ * @param path Path of the record file
+ * @param st Status of the record file
+ * @param priority Delivery priority class of the record
+ *
+ * @return the number of destinations the record was added to
+ */
+int destinations_fan_out_file(struct destinations *dests, const char *path,
+                              const struct stat *st, int priority);
+
+/**
+ * Writes a record read from the staging log or the record ring once, and
+ * links it into the directory of each destination
+ *
+ * @param dests The destinations
+ * @param data The record, in the staged record layout
+ * @param size Size of data
+ * @param staged_time Time the record was staged
+ * @param priority Delivery priority class of the record
+ *
+ * @return the number of destinations the record was added to
+ */
+int destinations_fan_out_data(struct destinations *dests, const char *data,
+                              size_t size, time_t staged_time, int priority);
+
+/**
+ * Gets when the next pass over the records of a destination is due
+ *
+ * @param dests The destinations
+ * @param interval Seconds between passes, spool_process_time
+ *
+ * @return the time of the next pass, or 0 if no destination has records
+ */
+time_t destinations_next_pass(struct destinations *dests, int interval);
+
+/**
+ * Sends the records of the destinations of which a pass is due, as many as
+ * the retry scheduler and the rate limit of each destination allow
+ *
+ * @param dests The destinations
+ * @param interval Seconds between passes, spool_process_time
+ *
+ * @return the number of records sent
+ */
+int destinations_run(struct destinations *dests, int interval);
+
+/**
+ * Closes the kept connections, while the daemon is idle
+ *
+ * @param dests The destinations
+ */
+void destinations_close(struct destinations *dests);
+
+/**
+ * Releases the destinations, their records stay in their directories
+ *
+ * @param dests The destinations
+ */
+void destinations_free(struct destinations *dests);
+
+/**
+ * Pointer to the function posting a record to a destination, to isolate
+ * the backend call during unit testing
+ */
+extern bool (*post_destination_ptr)(struct staged_record *record,
+                                    struct destination *dest);
+
+/* vi: set ts=8 sw=8 sts=4 et tw=80 cino=(0: */
@@ -0,0 +1,136 @@
+/*
+ * This program is part of the Clear Linux Project
+ *
+ * Copyright 2019 Intel Corporation
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms and conditions of the GNU Lesser General Public License, as
+ * published by the Free Software Foundation; either version 2.1 of the License,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU Lesser General Public License for more
+ * details.
+ */
+
+#define _GNU_SOURCE
+#include <ctype.h>
+#include <dirent.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/sysinfo.h>
+
+#include "common.h"
+#include "heartbeat.h"
+#include "log.h"
+
+static long get_uptime(void)
+{
+        struct sysinfo s_info;
+        if (sysinfo(&s_info) == 0) {
+                return s_info.uptime;
+        }
+        return 0;
+}
+
+static int nodots(const struct dirent *dp)
+{
+        return (dp->d_name[0] != '.');
+}
+
+char *create_heartbeat_payload(unsigned options, const char *locale)
+{
+        int n, buflen;
+        char *ppos, *payload;
+
+        payload = calloc(sizeof(char), MAX_PAYLOAD_LENGTH);
+        if (payload == NULL) {
+                return NULL;
+        }
+
+        ppos = payload;
+        buflen = MAX_PAYLOAD_LENGTH;
+
+        n = snprintf(ppos, (size_t)buflen, "hello\n");
+        buflen -= n, ppos += n;
+
+        if (options & HEARTBEAT_LOCALE) {
+                n = snprintf(ppos, (size_t)buflen, "LC_ALL: %s\n", locale);
+                buflen -= n, ppos += n;
+        }
+
+        if (options & HEARTBEAT_UPTIME) {
+                n = snprintf(ppos, (size_t)buflen, "uptime: %ld\n", get_uptime());
+                buflen -= n, ppos += n;
+        }
+
+        if (options & HEARTBEAT_BUNDLES) {
+                int num_bundles, i;
+                struct dirent **entries;
+
+                num_bundles = scandir(HEARTBEAT_BUNDLES_DIR, &entries, nodots, alphasort);
+                if (num_bundles < 0) {
+                        telem_perror("scandir failed");
+                        free(payload);
+                        return NULL;
+                }
+                n = snprintf(ppos, (size_t)buflen, "\nBundles (%d):\n", num_bundles);
+                buflen -= n, ppos += n;
+
+                for (i = 0; i < num_bundles; i++) {
+                        n = snprintf(ppos, (size_t)buflen, "%s\n", entries[i]->d_name);
+                        /* Test if truncated output */
+                        if (n >= buflen) {
+                                int lastix = MAX_PAYLOAD_LENGTH-1;
+                                payload[lastix] = '\0';
+                                payload[lastix-1] = '.';
+                                payload[lastix-2] = '.';
+                                payload[lastix-3] = '.';
+                                payload[lastix-4] = '\n';
+                                break;
+                        }
+                        buflen -= n, ppos += n;
+                }
+
+                for (i= 0; i < num_bundles; i++) {
+                        free(entries[i]);
+                }
+
+                free(entries);
+        }
+
+        return payload;
+}
+
+unsigned parse_heartbeat_options(const char *list)
+{
+        unsigned options = 0;
+        const char *name = list;
+
+        while (*name) {
+                size_t len = strcspn(name, ",");
+                const char *next = name + len;
+
+                while (len > 0 && isspace((unsigned char)*name)) {
+                        name++, len--;
+                }
+                while (len > 0 && isspace((unsigned char)name[len - 1])) {
+                        len--;
+                }
+                if (len == 6 && strncasecmp(name, "locale", len) == 0) {
+                        options |= HEARTBEAT_LOCALE;
+                } else if (len == 6 && strncasecmp(name, "uptime", len) == 0) {
+                        options |= HEARTBEAT_UPTIME;
+                } else if (len == 7 && strncasecmp(name, "bundles", len) == 0) {
+                        options |= HEARTBEAT_BUNDLES;
+                }
+                name = *next ? next + 1 : next;
+        }
+
+        return options;
+}
+
+/* vi: set ts=8 sw=8 sts=4 et tw=80 cino=(0: */
@@ -0,0 +1,53 @@
+/*
+ * This program is part of the Clear Linux Project
+ *
+ * Copyright 2019 Intel Corporation
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms and conditions of the GNU Lesser General Public License, as
+ * published by the Free Software Foundation; either version 2.1 of the License,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU Lesser General Public License for more
+ * details.
+ */
+
+#pragma once
+
+/* Optional lines of a heartbeat payload */
+#define HEARTBEAT_LOCALE  0x01
+#define HEARTBEAT_UPTIME  0x02
+#define HEARTBEAT_BUNDLES 0x04
+
+#define HEARTBEAT_CLASSIFICATION "org.clearlinux/heartbeat/ping"
+#define HEARTBEAT_SEVERITY 1
+#define HEARTBEAT_PAYLOAD_VERSION 1
+
+/* When telemprobd last staged a heartbeat */
+#define HEARTBEAT_STATE_FILE LOCALSTATEDIR "/lib/telemetry/heartbeat"
+
+#define HEARTBEAT_BUNDLES_DIR "/usr/share/clear/bundles"
+
+/**
+ * Creates the payload of a heartbeat record
+ *
+ * @param options HEARTBEAT_* lines included in the payload
+ * @param locale Locale reported with HEARTBEAT_LOCALE
+ *
+ * @return the payload, to be freed by the caller, or NULL on error
+ */
+char *create_heartbeat_payload(unsigned options, const char *locale);
+
+/**
+ * Parses a comma separated list of the heartbeat payload lines, among
+ * "locale", "uptime" and "bundles". Unknown names are ignored.
+ *
+ * @param list The list
+ *
+ * @return the HEARTBEAT_* options
+ */
+unsigned parse_heartbeat_options(const char *list);
+
+/* vi: set ts=8 sw=8 sts=4 et tw=80 cino=(0: */
@@ -20,6 +20,8 @@
 #include <unistd.h>
 #include <limits.h>
 #include <stdbool.h>
+#include <string.h>
+#include <fcntl.h>
 #include <sys/stat.h>
 
 #include "log.h"
@@ -27,117 +29,321 @@
 #include "common.h"
 #include "iorecord.h"
 
-bool _fgets(char *s, int n, FILE *stream)
+bool parse_record(char *data, size_t size, struct staged_record *record)
 {
-        char *i;
+        struct header_view views[NUM_HEADERS];
+        char *pos = data;
+        char *end = data + size;
+        size_t header_size;
 
-        if (!fgets(s, n, stream)) {
+        record->cfg_file = NULL;
+        record->raw = false;
+        record->streamed = false;
+        record->body_fd = -1;
+        record->body_offset = 0;
+
+        // First line may contain configuration file path
+        if (size >= CFG_PREFIX_LENGTH && *(uint32_t *)data == CFG_PREFIX_32BIT) {
+                char *nl = memchr(data, '\n', size);
+
+                if (!nl || (size_t)(nl - data) - CFG_PREFIX_LENGTH > PATH_MAX) {
+                        telem_log(LOG_ERR, "Error while parsing staged record configuration info.\n");
+                        return false;
+                }
+                *nl = '\0';
+                record->cfg_file = data + CFG_PREFIX_LENGTH;
+                telem_debug("DEBUG: cfg_file specified: %s\n", record->cfg_file);
+                pos = nl + 1;
+        }
+
+        // Then a line marking binary payloads
+        if ((size_t)(end - pos) > RAW_PREFIX_LENGTH &&
+            memcmp(pos, RAW_PREFIX "\n", RAW_PREFIX_LENGTH + 1) == 0) {
+                record->raw = true;
+                pos += RAW_PREFIX_LENGTH + 1;
+        }
+
+        // And the line of a traced record, which is kept as it is
+        memset(&record->trace, 0, sizeof(record->trace));
+        if ((size_t)(end - pos) > TRACE_LINE_LENGTH && pos[TRACE_LINE_LENGTH] == '\n' &&
+            trace_parse_line(pos, TRACE_LINE_LENGTH, &record->trace)) {
+                record->trace.offset = (size_t)(pos - data);
+                pos += TRACE_LINE_LENGTH + 1;
+        }
+
+        // And the line of an aggregated record
+        record->occurrences = 0;
+        if ((size_t)(end - pos) > AGG_PREFIX_LENGTH &&
+            memcmp(pos, AGG_PREFIX, AGG_PREFIX_LENGTH) == 0) {
+                char *nl = memchr(pos, '\n', (size_t)(end - pos));
+                long long first, last;
+                int count;
+
+                if (!nl || sscanf(pos + AGG_PREFIX_LENGTH, "%d %lld %lld", &count,
+                                  &first, &last) != 3 || count <= 0) {
+                        telem_log(LOG_ERR, "Error while parsing staged record aggregation info.\n");
+                        return false;
+                }
+                record->occurrences = count;
+                record->first_staged = (time_t)first;
+                record->last_staged = (time_t)last;
+                pos = nl + 1;
+        }
+
+        header_size = parse_header_views(pos, (size_t)(end - pos), views);
+        if (header_size == 0) {
+                telem_log(LOG_ERR, "read_record: Incorrect headers in record\n");
+                record->cfg_file = NULL;
                 return false;
         }
-        if ((i = strchr(s, '\n')) != NULL) {
-                *i = '\0';
+
+        // Headers are used in place, replace their newlines
+        for (int i = 0; i < NUM_HEADERS; i++) {
+                record->headers[i] = (char *)views[i].data;
+                record->headers[i][views[i].len] = '\0';
         }
 
+        record->body = pos + header_size;
+        if (record->body == end) {
+                telem_log(LOG_ERR, "Error reading staged record payload\n");
+                return false;
+        }
+        record->body_size = (size_t)(end - record->body);
+
+        /* Payloads are text, unless they start with the gzip magic */
+        record->compressed = (!record->raw && record->body_size >= 2 &&
+                              (unsigned char)record->body[0] == 0x1f &&
+                              (unsigned char)record->body[1] == 0x8b);
+
         return true;
 }
 
-bool read_record(char *fullpath, char *headers[], char **body, char **cfg_file)
+/* Gets the class from the values of the severity and classification headers */
+static int priority_class(const char *severity, size_t severity_len,
+                          const char *classification, size_t classification_len)
 {
-        int i = 0;
-        bool result = false;
-        FILE *fp = NULL;
-        long offset;
-#if (LINE_MAX > PATH_MAX)
-        char line[LINE_MAX+1] = { 0 };
-#else
-        char line[PATH_MAX+1] = { 0 };
-#endif
-        long size;
-        uint32_t cfg_prefix = 0;
-
-        fp = fopen(fullpath, "r");
-        if (fp == NULL) {
-                telem_log(LOG_ERR, "Unable to open file %s in staging\n", fullpath);
-                return false;
+        const char *group = memchr(classification, '/', classification_len);
+        const char *end = classification + classification_len;
+        int priority = 0;
+
+        if (severity_len > 0 && severity[0] >= '1' &&
+            severity[0] < '1' + TM_PRIORITY_CLASSES) {
+                priority = severity[0] - '1';
         }
 
-        // Get the file size
-        fseek(fp, 0 , SEEK_END);
-        size = ftell(fp);
-        fseek(fp, 0 , SEEK_SET);
+        /* Crash reports are the most important records */
+        if (group && end - (group + 1) >= 5 && memcmp(group + 1, "crash", 5) == 0 &&
+            (group + 6 == end || group[6] == '/')) {
+                priority = TM_PRIORITY_CLASSES - 1;
+        }
 
-        // First line may contain configuration file path
-        if (fread(&cfg_prefix, CFG_PREFIX_LENGTH, 1, fp) != 1) {
-                telem_log(LOG_ERR, "Error while parsing staged record configuration info.\n");
-                goto read_error;
+        return priority;
+}
+
+/* Gets the value of a header line, without the header name */
+static const char *header_line_value(const char *line, size_t len, size_t *value_len)
+{
+        const char *sep = memchr(line, ':', len);
+
+        if (!sep) {
+                *value_len = 0;
+                return line;
+        }
+        sep++;
+        if (sep < line + len && *sep == ' ') {
+                sep++;
         }
+        *value_len = (size_t)(line + len - sep);
 
-        if (cfg_prefix == CFG_PREFIX_32BIT) {
-                if (!_fgets(line, sizeof(line), fp)) {
-                        telem_log(LOG_ERR, "Error while parsing staged record [%x]\n", cfg_prefix);
-                        goto read_error;
-                }
+        return sep;
+}
 
-                size_t pathlen = strlen(line);
-                *cfg_file = malloc(pathlen + 1);
-                if (*cfg_file == NULL) {
-                        telem_log(LOG_ERR, "Could not allocate memory for config file path\n");
-                        goto read_error;
+int record_priority(struct staged_record *record)
+{
+        const char *severity;
+        const char *classification;
+        size_t severity_len;
+        size_t classification_len;
+
+        if (!record->headers[TM_SEVERITY] || !record->headers[TM_CLASSIFICATION]) {
+                return 0;
+        }
+        severity = header_line_value(record->headers[TM_SEVERITY],
+                                     strlen(record->headers[TM_SEVERITY]),
+                                     &severity_len);
+        classification = header_line_value(record->headers[TM_CLASSIFICATION],
+                                           strlen(record->headers[TM_CLASSIFICATION]),
+                                           &classification_len);
+
+        return priority_class(severity, severity_len, classification,
+                              classification_len);
+}
+
+int record_data_priority(const char *data, size_t size)
+{
+        const char *pos = data;
+        const char *end = data + size;
+        const char *severity = NULL;
+        const char *classification = NULL;
+        size_t severity_len = 0;
+        size_t classification_len = 0;
+
+        /* The configuration file, binary payload, trace and aggregation
+         * lines, then the headers */
+        for (int i = 0; i <= NUM_HEADERS + 3 && pos < end; i++) {
+                const char *nl = memchr(pos, '\n', (size_t)(end - pos));
+                size_t len = nl ? (size_t)(nl - pos) : (size_t)(end - pos);
+
+                if (!severity && len > strlen(TM_SEVERITY_STR) &&
+                    memcmp(pos, TM_SEVERITY_STR ":", strlen(TM_SEVERITY_STR) + 1) == 0) {
+                        severity = header_line_value(pos, len, &severity_len);
+                } else if (!classification && len > strlen(TM_CLASSIFICATION_STR) &&
+                           memcmp(pos, TM_CLASSIFICATION_STR ":",
+                                  strlen(TM_CLASSIFICATION_STR) + 1) == 0) {
+                        classification = header_line_value(pos, len, &classification_len);
                 }
-                strcpy (*cfg_file, line);
-                telem_debug("DEBUG: cfg_file specified: %s\n", *cfg_file);
-        } else {
-                telem_debug("DEBUG: no user cfg file specified, cfg_prefix: %08x\n", cfg_prefix);
-                *cfg_file = NULL;
-                rewind(fp);
-        }
-
-        for (i = 0; i < NUM_HEADERS; i++) {
-                const char *header_name = get_header_name(i);
-                if (!_fgets(line, sizeof(line), fp)) {
-                        telem_log(LOG_ERR, "Error while parsing staged record\n");
-                        fclose(fp);
-                        return false;
+                if (!nl || (severity && classification)) {
+                        break;
                 }
-                //Get rid of trailing newline
-                result = get_header(line, header_name, &headers[i]);
-                if (!result) {
-                        telem_log(LOG_ERR, "read_record: Incorrect"
-                                  " headers in record\n");
-                        goto read_error;
+                pos = nl + 1;
+        }
+        if (!severity || !classification) {
+                return 0;
+        }
+
+        return priority_class(severity, severity_len, classification,
+                              classification_len);
+}
+
+void unparse_record(struct staged_record *record)
+{
+        if (record->cfg_file) {
+                record->cfg_file[strlen(record->cfg_file)] = '\n';
+        }
+        for (int i = 0; i < NUM_HEADERS; i++) {
+                record->headers[i][strlen(record->headers[i])] = '\n';
+        }
+}
+
+/* Reads up to size bytes of a record file from offset */
+static ssize_t read_record_data(int fd, char *data, size_t size, off_t offset)
+{
+        size_t done = 0;
+
+        while (done < size) {
+                ssize_t len = pread(fd, data + done, size - done, offset + (off_t)done);
+
+                if (len < 0) {
+                        return -1;
+                } else if (len == 0) {
+                        break;
                 }
+                done += (size_t)len;
+        }
+
+        return (ssize_t)done;
+}
+
+bool read_record(char *fullpath, struct staged_record *record)
+{
+        struct stat buf;
+        ssize_t len;
+        size_t size;
+        int fd;
+
+        record->data = NULL;
+        record->streamed = false;
+
+        fd = open(fullpath, O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+                telem_log(LOG_ERR, "Unable to open file %s in staging\n", fullpath);
+                return false;
         }
 
-        offset = ftell(fp);
-        if (offset == -1) {
-                telem_perror("Failed to get staged file offset of record payload");
-                result = false;
+        if (fstat(fd, &buf) != 0) {
+                telem_perror("Unable to stat staged record");
                 goto read_error;
         }
 
-        size = size - offset + 1;
-        *body = malloc((size_t)size);
-        if (*body == NULL) {
-                telem_log(LOG_ERR, "Could not allocate memory for payload from staged file\n");
-                result = false;
+        // Read the whole record, headers and payload point into it, or only
+        // the beginning of a large one, in case its payload is binary
+        size = (size_t)buf.st_size;
+        if (buf.st_size > TM_STREAM_RECORD_SIZE && size > TM_RECORD_HEAD_SIZE) {
+                size = TM_RECORD_HEAD_SIZE;
+        }
+        record->data = malloc(size + 1);
+        if (record->data == NULL) {
+                telem_log(LOG_ERR, "Could not allocate memory for staged record\n");
                 goto read_error;
         }
-        memset(*body, 0, (size_t)size);
 
-        //read rest of file
-        size_t newlen = fread(*body, sizeof(char), (size_t)size, fp);
-        if (newlen == 0) {
+        len = read_record_data(fd, record->data, size, 0);
+        if (len < 0) {
                 telem_perror("Error reading staged file");
-                result = false;
                 goto read_error;
-        } else {
-                result = true;
         }
+        record->data[len] = '\0';
 
-read_error:
-        if (fp) {
-                fclose(fp);
+        if (!parse_record(record->data, (size_t)len, record)) {
+                free_record(record);
+                close(fd);
+                return false;
+        }
+
+        if ((size_t)len == size && size < (size_t)buf.st_size) {
+                char *data;
+
+                // The binary payload is read from the file as it is sent
+                if (record->raw) {
+                        record->body_offset = record->body - record->data;
+                        record->body_size = (size_t)(buf.st_size - record->body_offset);
+                        record->body = NULL;
+                        record->body_fd = fd;
+                        record->streamed = true;
+                        return true;
+                }
+
+                // Otherwise read the rest, and parse the whole record again
+                unparse_record(record);
+                data = realloc(record->data, (size_t)buf.st_size + 1);
+                if (data == NULL) {
+                        telem_log(LOG_ERR, "Could not allocate memory for staged record\n");
+                        goto read_error;
+                }
+                record->data = data;
+                len = read_record_data(fd, data + size, (size_t)buf.st_size - size,
+                                       (off_t)size);
+                if (len < 0) {
+                        telem_perror("Error reading staged file");
+                        goto read_error;
+                }
+                len += (ssize_t)size;
+                data[len] = '\0';
+                if (!parse_record(data, (size_t)len, record)) {
+                        free_record(record);
+                        close(fd);
+                        return false;
+                }
         }
+        close(fd);
 
-        return result;
+        return true;
+
+read_error:
+        free(record->data);
+        record->data = NULL;
+        close(fd);
+        return false;
 }
+
+void free_record(struct staged_record *record)
+{
+        free(record->data);
+        record->data = NULL;
+        if (record->streamed) {
+                close(record->body_fd);
+                record->streamed = false;
+                record->body_fd = -1;
+        }
+}
+
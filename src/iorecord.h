@@ -14,15 +14,119 @@
  * details.
  */
 
+#pragma once
+
+#include <limits.h>
 #include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+#include <time.h>
+
+#include "common.h"
+#include "recordtrace.h"
+
+/* A record in the staged record layout, parsed in place */
+struct staged_record {
+        /* record data read by read_record(), NULL if not owned */
+        char *data;
+        /* null terminated headers, body and configuration file path, all
+         * pointing into the record data */
+        char *headers[NUM_HEADERS];
+        char *body;
+        char *cfg_file;
+        /* size of the payload, which is binary if compressed */
+        size_t body_size;
+        /* payload compressed with gzip, see compress_record() */
+        bool compressed;
+        /* binary payload, after a RAW line, never compressed in the spool */
+        bool raw;
+        /* payload left in the record file by read_record(), with body NULL,
+         * to be read from body_fd at body_offset as it is sent */
+        bool streamed;
+        int body_fd;
+        off_t body_offset;
+        /* times of the stages the record went through, from its TRACE line */
+        struct record_trace trace;
+        /* identical records it stands for, from its AGG line, 0 without one,
+         * and when the first and last of them were staged */
+        int occurrences;
+        time_t first_staged;
+        time_t last_staged;
+};
+
+/* Records files larger than this with a binary payload are not read into
+ * memory, their payload is streamed from the file as it is sent */
+#define TM_STREAM_RECORD_SIZE (64 * 1024)
+
+/* Space read for the lines before the payload of a streamed record */
+#define TM_RECORD_HEAD_SIZE (PATH_MAX + 2 * 1024 * NUM_HEADERS)
+
+/*
+ * Delivery priority classes, from 0 to TM_PRIORITY_CLASSES - 1. The class of
+ * a record is its severity minus one, and the highest class for crash
+ * reports, classifications of the crash group. Records of higher classes are
+ * sent first, but a record waiting TM_PRIORITY_AGING seconds more than
+ * another goes before it if it is one class lower.
+ */
+#define TM_PRIORITY_CLASSES 4
+#define TM_PRIORITY_AGING 600
+
+/**
+ * Parses a telemetry record in memory, in the same layout as a staged
+ * record file. The data is modified to null terminate the headers, which
+ * are used in place, so nothing is allocated.
+ *
+ * @param data pointer to the record data, null terminated
+ * @param size size of data in bytes, not including the null byte
+ * @param record set to the parsed record, pointing into data
+ *
+ * @return true if successful otherwise false
+ */
+bool parse_record(char *data, size_t size, struct staged_record *record);
+
+/**
+ * Puts back the newlines parse_record() replaced, so the data is in the
+ * staged record layout again
+ *
+ * @param record the record
+ */
+void unparse_record(struct staged_record *record);
 
 /**
- * Reads a telemetry record
+ * Reads a telemetry record. The payload of a large record with a binary
+ * payload is not read, see TM_STREAM_RECORD_SIZE.
  *
  * @param fullpath pointer to full path file name
- * @param headers pointer to array of headers and values
- * @param body record message content
+ * @param record set to the record read, to be released with free_record()
  *
  * @return true if successful otherwise false
  */
-bool read_record(char *fullpath, char *headers[], char **body, char **cfg);
+bool read_record(char *fullpath, struct staged_record *record);
+
+/**
+ * Gets the delivery priority class of a parsed record
+ *
+ * @param record the record
+ *
+ * @return the class
+ */
+int record_priority(struct staged_record *record);
+
+/**
+ * Gets the delivery priority class of a record in the staged record layout,
+ * from the headers alone
+ *
+ * @param data the record data, or its beginning
+ * @param size size of data in bytes
+ *
+ * @return the class, 0 if the headers are not found
+ */
+int record_data_priority(const char *data, size_t size);
+
+/**
+ * Releases the data of a record read with read_record(), and its record file
+ * if the payload is streamed
+ *
+ * @param record the record
+ */
+void free_record(struct staged_record *record);
@@ -20,6 +20,8 @@
 #include <stdio.h>
 #include <string.h>
 #include <getopt.h>
+#include <time.h>
+#include <errno.h>
 
 #include "common.h"
 #include "journal.h"
@@ -27,12 +29,17 @@
 static void print_usage(void)
 {
         printf("Usage:\n");
-        printf("  telem_journal [-Vi] [-r <record_id>] [-e <event_id>] [-c <classification>] [-b <boot_id>]\n\n");
+        printf("  telem_journal [-Vi] [-r <record_id>] [-e <event_id>] [-c <classification>] [-b <boot_id>]\n");
+        printf("                [-s <time>] [-u <time>]\n\n");
         printf("Where:\n");
         printf("  -r,  --record_id        Print record with specific record_id\n");
         printf("  -e,  --event_id         Print records with specific event_id\n");
         printf("  -c,  --classification   Print records with specific classification\n");
         printf("  -b,  --boot_id          Print records with specific boot_id\n");
+        printf("  -s,  --since            Print records created at or after time\n");
+        printf("  -u,  --until            Print records created at or before time\n");
+        printf("                          Times are seconds since the epoch, or local\n");
+        printf("                          YYYY-MM-DD or YYYY-MM-DDTHH:MM:SS\n");
         printf("  -i,  --include_record   Include record content if available.\n");
         printf("                          Content only available when telemetry is configured\n");
         printf("                          with \"record_retention_enabled=true\"\n");
@@ -40,6 +47,42 @@ static void print_usage(void)
         printf("  -h,  --help             Display this help message\n");
 }
 
+/**
+ * Parses a time given on the command line
+ *
+ * @param str The time, seconds since the epoch or a local date and time
+ * @param t Set with the time
+ *
+ * @return 0 on success, -1 if str is not a time
+ */
+static int parse_time(const char *str, time_t *t)
+{
+        const char *formats[] = { "%Y-%m-%dT%H:%M:%S", "%Y-%m-%dT%H:%M",
+                                  "%Y-%m-%d", NULL };
+        char *end = NULL;
+        long long secs;
+        struct tm tm;
+
+        errno = 0;
+        secs = strtoll(str, &end, 10);
+        if (errno == 0 && end != str && *end == '\0' && secs > 0) {
+                *t = (time_t)secs;
+                return 0;
+        }
+
+        for (int i = 0; formats[i] != NULL; i++) {
+                memset(&tm, 0, sizeof(tm));
+                end = strptime(str, formats[i], &tm);
+                if (end != NULL && *end == '\0') {
+                        tm.tm_isdst = -1;
+                        *t = mktime(&tm);
+                        return *t > 0 ? 0 : -1;
+                }
+        }
+
+        return -1;
+}
+
 int main(int argc, char **argv)
 {
 
@@ -51,6 +94,8 @@ int main(int argc, char **argv)
         char *record_id = NULL;
         char *event_id = NULL;
         char *classification = NULL;
+        time_t since = 0;
+        time_t until = 0;
         struct TelemJournal *telem_journal = NULL;
 
         /** opts */
@@ -61,13 +106,15 @@ int main(int argc, char **argv)
                 { "event_id", 1, NULL, 'e' },
                 { "classification", 1, NULL, 'c' },
                 { "boot_id", 1, NULL, 'b' },
+                { "since", 1, NULL, 's' },
+                { "until", 1, NULL, 'u' },
                 { "verbose", 0, NULL, 'V' },
                 { "include_record", 0, NULL, 'i' },
                 { "help", 0, NULL, 'h' },
                 { NULL, 0, NULL, 0 }
         };
 
-        while ((c = getopt_long(argc, argv, "r:e:c:b:Vih", opts, &opt_index)) != -1) {
+        while ((c = getopt_long(argc, argv, "r:e:c:b:s:u:Vih", opts, &opt_index)) != -1) {
                 switch (c) {
                         case 'r':
                                 record_id = optarg;
@@ -81,6 +128,13 @@ int main(int argc, char **argv)
                         case 'b':
                                 boot_id = optarg;
                                 break;
+                        case 's':
+                        case 'u':
+                                if (parse_time(optarg, c == 's' ? &since : &until) != 0) {
+                                        fprintf(stderr, "Invalid time: %s\n", optarg);
+                                        exit(EXIT_FAILURE);
+                                }
+                                break;
                         case 'V':
                                 verbose_output = true;
                                 break;
@@ -96,12 +150,16 @@ int main(int argc, char **argv)
                 }
         }
 
+        /* Entries are written out in large blocks, not line by line */
+        setvbuf(stdout, NULL, _IOFBF, 64 * 1024);
+
         if ((telem_journal = open_journal(JOURNAL_PATH))) {
                 if (verbose_output) {
                         fprintf(stdout, "%-30s %-27s %-32s %-32s %-36s\n", "Classification", "Time stamp",
                                 "Record ID", "Event ID", "Boot ID");
                 }
-                count = print_journal(telem_journal, classification, record_id, event_id, boot_id, record);
+                count = print_journal_range(telem_journal, classification, record_id, event_id,
+                                            boot_id, since, until, record);
                 if (verbose_output) {
                         fprintf(stdout, "Total records: %d\n", count);
                 }
@@ -16,10 +16,10 @@
 
 #define _GNU_SOURCE
 
-#define ID_LEN 32
 #define BOOTID_LEN 37 // Includes the \n character at the end
 #define BOOTID_FILE "/proc/sys/kernel/random/boot_id"
-#define MID_BUFF 1024
+#define RECORD_READ_BUFF (64 * 1024)
+#define JOURNAL_PRUNE_BATCH 64
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -28,6 +28,7 @@
 #include <inttypes.h>
 #include <sys/uio.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <assert.h>
@@ -36,293 +37,1130 @@
 #include "util.h"
 #include "common.h"
 #include "journal.h"
+#include "recordpack.h"
+#include "validate.h"
 
-/*
- * Packs journal entry values into one line string separated
- * by '\036' RS.
+/**
+ * Copies a string into a fixed width field of an entry
  *
- * @param entry A pointer to a JournalEntry struct with values
- *              to serialize.
- * @param buff A pointer to be initialized and set with the
- *             serialized values.
+ * @param dst The field
+ * @param size Size of the field, including the terminating NUL
+ * @param src The string, truncated to fit
+ */
+static void copy_field(char *dst, size_t size, const char *src)
+{
+        size_t len = strnlen(src, size - 1);
+
+        memcpy(dst, src, len);
+        dst[len] = '\0';
+}
+
+/**
+ * Unpacks a line of a journal in the former text format, values
+ * separated by '\036' RS, into a JournalEntry.
+ *
+ * @param line A pointer to the data to unpack.
+ * @param entry A pointer to set with values parsed from line.
  *
  * @return 0 on success, -1 on failure.
  */
-static int serialize_journal_entry(struct JournalEntry *entry, char **buff)
+static int deserialize_journal_entry(char *line, struct JournalEntry *entry)
 {
-        int rc = 0;
+        size_t len = 0;
+        size_t llen = 0;
+        size_t offset = 0;
+        char timestamp[24];
 
-        if (entry == NULL) {
+        if (line == NULL || !strlen(line)) {
                 return -1;
         }
 
-        if (asprintf(buff, "%s\036%lld\036%s\036%s\036%s", entry->record_id, (long long int)entry->timestamp,
-                     entry->classification, entry->event_id, entry->boot_id) < 0) {
-                telem_log(LOG_ERR, "Error: Unable to serialize data in buff\n");
-                rc = -1;
+        memset(entry, 0, sizeof(struct JournalEntry));
+        llen = strlen(line);
+
+        for (int i = 0; i < 5; i++) {
+                char *out = line + offset;
+
+                if (offset >= llen) {
+                        return -1;
+                }
+                len = strcspn(out, "\036\n");
+                out[len] = '\0';
+                offset += len + 1;
+                switch (i) {
+                        case 0:
+                                copy_field(entry->record_id, sizeof(entry->record_id), out);
+                                break;
+                        case 1:
+                                copy_field(timestamp, sizeof(timestamp), out);
+                                entry->timestamp = atoll(timestamp);
+                                break;
+                        case 2:
+                                copy_field(entry->classification,
+                                           sizeof(entry->classification), out);
+                                break;
+                        case 3:
+                                copy_field(entry->event_id, sizeof(entry->event_id), out);
+                                break;
+                        case 4:
+                                copy_field(entry->boot_id, sizeof(entry->boot_id), out);
+                                break;
+                }
         }
 
-        return rc;
+        return 0;
 }
 
 /**
- *  Frees journal entry struct members and journal entry pointer.
+ * Gets the size of a journal file
  *
- *  @param the pointer to the entry structure to free.
+ * @param capacity Number of entries of the ring
+ *
+ * @return the size in bytes
  */
-static void free_journal_entry(struct JournalEntry *entry)
+static size_t journal_size(uint32_t capacity)
 {
-        if (entry) {
-                free(entry->classification);
-                free(entry->record_id);
-                free(entry->event_id);
-                free(entry->boot_id);
-                free(entry);
+        uint32_t segments = (capacity + JOURNAL_SEGMENT_ENTRIES - 1) / JOURNAL_SEGMENT_ENTRIES;
+
+        return sizeof(struct JournalHeader) + (size_t)capacity * sizeof(struct JournalEntry) +
+               (size_t)segments * sizeof(struct JournalSegment);
+}
+
+/**
+ * Gets the slot after the last of the segment of a slot
+ *
+ * @param telem_journal Pointer to a telemetry journal.
+ * @param slot The slot.
+ *
+ * @return the slot, at most the capacity of the ring.
+ */
+static uint32_t segment_end(struct TelemJournal *telem_journal, uint32_t slot)
+{
+        uint32_t end = (slot / JOURNAL_SEGMENT_ENTRIES + 1) * JOURNAL_SEGMENT_ENTRIES;
+
+        return end < telem_journal->header->capacity ? end : telem_journal->header->capacity;
+}
+
+/**
+ * Gets an entry of the ring
+ *
+ * @param telem_journal Pointer to a telemetry journal.
+ * @param n Position of the entry, from the oldest.
+ *
+ * @return a pointer to the slot of the entry.
+ */
+static struct JournalEntry *journal_slot(struct TelemJournal *telem_journal, uint32_t n)
+{
+        struct JournalHeader *header = telem_journal->header;
+
+        return &telem_journal->entries[(header->head + n) % header->capacity];
+}
+
+/**
+ * Gets the position from the oldest of the entry in a slot
+ *
+ * @param telem_journal Pointer to a telemetry journal.
+ * @param slot The slot.
+ *
+ * @return the position, at least the number of entries if the slot is free.
+ */
+static uint32_t journal_position(struct TelemJournal *telem_journal, uint32_t slot)
+{
+        struct JournalHeader *header = telem_journal->header;
+
+        return (slot + header->capacity - header->head) % header->capacity;
+}
+
+/**
+ * Maps the ring of a journal file in memory.
+ *
+ * @param telem_journal Pointer to a telemetry journal, with fd set.
+ * @param size Size of the journal file.
+ * @param capacity Number of entries of the ring.
+ *
+ * @return 0 on success, -1 on failure.
+ */
+static int map_journal(struct TelemJournal *telem_journal, size_t size, uint32_t capacity)
+{
+        void *map;
+
+        map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                   telem_journal->fd, 0);
+        if (map == MAP_FAILED) {
+                telem_perror("Error while mapping journal file");
+                return -1;
         }
+
+        telem_journal->header = map;
+        telem_journal->entries = (struct JournalEntry *)((char *)map +
+                                                         sizeof(struct JournalHeader));
+        telem_journal->segments = (struct JournalSegment *)(telem_journal->entries + capacity);
+        telem_journal->map_size = size;
+
+        return 0;
 }
 
 /**
- * Unpacks a record that was stored in file and initializes a
- * JournalEntry struct with parsed values.
+ * Gets the path of the index file of a journal.
  *
- * @param line A pointer to the data to unpack.
- * @param entry A pointer to be initialized and set with values
- *        parsed from parameter line.
+ * @param journal_file Path of the journal file.
+ *
+ * @return the path, NULL if out of memory.
+ */
+static char *index_path(const char *journal_file)
+{
+        char *path = NULL;
+
+        if (asprintf(&path, "%s.idx", journal_file) == -1) {
+                return NULL;
+        }
+
+        return path;
+}
+
+/**
+ * Sizes an empty journal file for a ring, and maps it.
+ *
+ * @param telem_journal Pointer to a telemetry journal, with fd set.
+ * @param capacity Number of entries of the ring.
  *
  * @return 0 on success, -1 on failure.
  */
-static int deserialize_journal_entry(char *line, struct JournalEntry **entry)
+static int create_journal(struct TelemJournal *telem_journal, uint32_t capacity)
 {
-        int rc = -1;
-        size_t len = 0;
-        size_t llen = 0;
-        size_t offset = 0;
-        struct JournalEntry *e = NULL;
+        struct JournalHeader *header;
+        size_t size = journal_size(capacity);
+        char *path = index_path(telem_journal->journal_file);
+
+        /* The index of a former journal does not describe the new one */
+        if (path) {
+                unlink(path);
+                free(path);
+        }
 
-        /* Assume an error... */
-        *entry = NULL;
+        if (ftruncate(telem_journal->fd, 0) != 0 ||
+            ftruncate(telem_journal->fd, (off_t)size) != 0) {
+                telem_perror("Error while sizing journal file");
+                return -1;
+        }
+        if (map_journal(telem_journal, size, capacity) != 0) {
+                return -1;
+        }
 
-        if (line == NULL || !strlen(line)) {
+        header = telem_journal->header;
+        header->version = JOURNAL_VERSION;
+        header->entry_size = sizeof(struct JournalEntry);
+        header->capacity = capacity;
+        header->head = 0;
+        header->count = 0;
+        header->appended = 0;
+        memcpy(header->magic, JOURNAL_MAGIC, sizeof(header->magic));
+
+        return 0;
+}
+
+/**
+ * Checks that the header of a journal file describes its content.
+ *
+ * @param header The header, read from the file.
+ * @param size Size of the journal file.
+ *
+ * @return true if the ring can be used.
+ */
+static bool valid_header(struct JournalHeader *header, size_t size)
+{
+        return header->version == JOURNAL_VERSION &&
+               header->entry_size == sizeof(struct JournalEntry) &&
+               header->capacity > 0 && size == journal_size(header->capacity) &&
+               header->head < header->capacity &&
+               header->count <= header->capacity;
+}
+
+/**
+ * Checks if class is a prefix i.e. t/\* or t/t/\*
+ *
+ * @param class A pointer to string with classification
+ *              value to check.
+ * @return 1 if class is a prefix, 0 otherwise
+ */
+static int is_class_prefix(char *class)
+{
+        size_t class_len = strlen(class);
+        return (strcmp((char *)(class + class_len - 2), "/*") == 0) ? 1 : 0;
+}
+
+/* Orders positions of entries, for qsort */
+static int compare_positions(const void *a, const void *b)
+{
+        uint32_t pa = *(const uint32_t *)a;
+        uint32_t pb = *(const uint32_t *)b;
+
+        return (pa > pb) - (pa < pb);
+}
+
+/**
+ * Hashes the first bytes of a string, FNV-1a
+ *
+ * @param str The string.
+ * @param len Number of bytes to hash.
+ *
+ * @return the hash.
+ */
+static uint32_t journal_hash_n(const char *str, size_t len)
+{
+        uint32_t hash = 2166136261u;
+
+        for (size_t i = 0; i < len; i++) {
+                hash ^= (unsigned char)str[i];
+                hash *= 16777619u;
+        }
+
+        return hash;
+}
+
+/**
+ * Hashes an id, FNV-1a
+ *
+ * @param id The id.
+ *
+ * @return the hash.
+ */
+static uint32_t journal_hash(const char *id)
+{
+        return journal_hash_n(id, strlen(id));
+}
+
+/* Gets an indexed id of an entry */
+static const char *entry_id(struct JournalEntry *entry, int id)
+{
+        switch (id) {
+                case JOURNAL_INDEX_RECORD_ID:
+                        return entry->record_id;
+                case JOURNAL_INDEX_EVENT_ID:
+                        return entry->event_id;
+                default:
+                        return entry->boot_id;
+        }
+}
+
+/* Gets the size of an index file */
+static size_t index_size(uint32_t capacity, uint32_t buckets)
+{
+        return sizeof(struct JournalIndexHeader) +
+               sizeof(uint32_t) * ((size_t)JOURNAL_INDEX_IDS * buckets +
+                                   (size_t)JOURNAL_INDEX_IDS * 2 * capacity + capacity);
+}
+
+/* Gets the number of hash buckets of an index, at least twice the capacity */
+static uint32_t index_buckets(uint32_t capacity)
+{
+        uint32_t buckets = 1;
+
+        while (buckets < 2 * capacity) {
+                buckets *= 2;
+        }
+
+        return buckets;
+}
+
+/* Gets the first slots of the buckets of an id */
+static uint32_t *index_heads(struct TelemJournal *telem_journal, int id)
+{
+        struct JournalIndexHeader *index = telem_journal->index;
+
+        return (uint32_t *)(index + 1) + (size_t)id * index->buckets;
+}
+
+/* Gets the next slots in the buckets of an id, or with prev the previous */
+static uint32_t *index_links(struct TelemJournal *telem_journal, int id, bool prev)
+{
+        struct JournalIndexHeader *index = telem_journal->index;
+
+        return (uint32_t *)(index + 1) + (size_t)JOURNAL_INDEX_IDS * index->buckets +
+               ((size_t)id * 2 + (prev ? 1 : 0)) * index->capacity;
+}
+
+/* Gets the slots sorted by classification */
+static uint32_t *index_classes(struct TelemJournal *telem_journal)
+{
+        return index_links(telem_journal, JOURNAL_INDEX_IDS, false);
+}
+
+/**
+ * Checks that the index describes the ring as it is.
+ *
+ * @param telem_journal Pointer to a telemetry journal.
+ *
+ * @return true if the index can be used.
+ */
+static bool index_current(struct TelemJournal *telem_journal)
+{
+        struct JournalIndexHeader *index = telem_journal->index;
+        struct JournalHeader *header = telem_journal->header;
+
+        return index != NULL && index->head == header->head &&
+               index->count == header->count && index->appended == header->appended;
+}
+
+/**
+ * Finds the first slot of which the classification is not before a
+ * classification, in the classification index.
+ *
+ * @param telem_journal Pointer to a telemetry journal.
+ * @param classification The classification, or prefix.
+ *
+ * @return the position in the classification index.
+ */
+static uint32_t index_class_lower_bound(struct TelemJournal *telem_journal,
+                                        const char *classification)
+{
+        uint32_t *classes = index_classes(telem_journal);
+        uint32_t low = 0;
+        uint32_t high = telem_journal->index->count;
+
+        while (low < high) {
+                uint32_t mid = low + (high - low) / 2;
+                struct JournalEntry *entry = &telem_journal->entries[classes[mid] - 1];
+
+                if (strcmp(entry->classification, classification) < 0) {
+                        low = mid + 1;
+                } else {
+                        high = mid;
+                }
+        }
+
+        return low;
+}
+
+/**
+ * Adds the entry in a slot to the index.
+ *
+ * @param telem_journal Pointer to a telemetry journal.
+ * @param slot The slot.
+ */
+static void index_insert(struct TelemJournal *telem_journal, uint32_t slot)
+{
+        struct JournalIndexHeader *index = telem_journal->index;
+        struct JournalEntry *entry = &telem_journal->entries[slot];
+        uint32_t *classes = index_classes(telem_journal);
+        uint32_t pos;
+
+        for (int id = 0; id < JOURNAL_INDEX_IDS; id++) {
+                uint32_t *heads = index_heads(telem_journal, id);
+                uint32_t *next = index_links(telem_journal, id, false);
+                uint32_t *prev = index_links(telem_journal, id, true);
+                uint32_t bucket = journal_hash(entry_id(entry, id)) & (index->buckets - 1);
+
+                next[slot] = heads[bucket];
+                prev[slot] = 0;
+                if (heads[bucket] != 0) {
+                        prev[heads[bucket] - 1] = slot + 1;
+                }
+                heads[bucket] = slot + 1;
+        }
+
+        pos = index_class_lower_bound(telem_journal, entry->classification);
+        memmove(&classes[pos + 1], &classes[pos],
+                (index->count - pos) * sizeof(uint32_t));
+        classes[pos] = slot + 1;
+        index->count++;
+}
+
+/**
+ * Removes the entry in a slot from the index.
+ *
+ * @param telem_journal Pointer to a telemetry journal.
+ * @param slot The slot.
+ */
+static void index_remove(struct TelemJournal *telem_journal, uint32_t slot)
+{
+        struct JournalIndexHeader *index = telem_journal->index;
+        struct JournalEntry *entry = &telem_journal->entries[slot];
+        uint32_t *classes = index_classes(telem_journal);
+        uint32_t pos;
+
+        for (int id = 0; id < JOURNAL_INDEX_IDS; id++) {
+                uint32_t *next = index_links(telem_journal, id, false);
+                uint32_t *prev = index_links(telem_journal, id, true);
+
+                if (prev[slot] != 0) {
+                        next[prev[slot] - 1] = next[slot];
+                } else {
+                        uint32_t *heads = index_heads(telem_journal, id);
+                        uint32_t bucket = journal_hash(entry_id(entry, id)) &
+                                          (index->buckets - 1);
+
+                        heads[bucket] = next[slot];
+                }
+                if (next[slot] != 0) {
+                        prev[next[slot] - 1] = prev[slot];
+                }
+        }
+
+        pos = index_class_lower_bound(telem_journal, entry->classification);
+        while (pos < index->count && classes[pos] != slot + 1) {
+                pos++;
+        }
+        if (pos < index->count) {
+                memmove(&classes[pos], &classes[pos + 1],
+                        (index->count - pos - 1) * sizeof(uint32_t));
+                index->count--;
+        }
+}
+
+/**
+ * Records that the index describes the ring as it is.
+ *
+ * @param telem_journal Pointer to a telemetry journal.
+ */
+static void index_mark_current(struct TelemJournal *telem_journal)
+{
+        telem_journal->index->head = telem_journal->header->head;
+        telem_journal->index->count = telem_journal->header->count;
+        telem_journal->index->appended = telem_journal->header->appended;
+}
+
+/**
+ * Rebuilds the index from the ring.
+ *
+ * @param telem_journal Pointer to a telemetry journal.
+ */
+static void index_rebuild(struct TelemJournal *telem_journal)
+{
+        struct JournalIndexHeader *index = telem_journal->index;
+        struct JournalHeader *header = telem_journal->header;
+
+        memset(index + 1, 0, telem_journal->index_size - sizeof(struct JournalIndexHeader));
+        index->count = 0;
+        for (uint32_t n = 0; n < header->count; n++) {
+                index_insert(telem_journal, (header->head + n) % header->capacity);
+        }
+        index_mark_current(telem_journal);
+        telem_debug("DEBUG: Rebuilt journal index, %u entries\n", index->count);
+}
+
+/**
+ * Gets the index ready to be updated with a change to the ring.
+ *
+ * @param telem_journal Pointer to a telemetry journal.
+ *
+ * @return true if there is an index to update.
+ */
+static bool index_prepare(struct TelemJournal *telem_journal)
+{
+        if (telem_journal->index == NULL) {
+                return false;
+        }
+        if (!index_current(telem_journal)) {
+                index_rebuild(telem_journal);
+        }
+
+        return true;
+}
+
+/**
+ * Opens the index file of a journal, creating it if it does not match
+ * the ring. The journal works without an index if it cannot be opened.
+ *
+ * @param telem_journal Pointer to a telemetry journal, with the ring mapped.
+ */
+static void open_index(struct TelemJournal *telem_journal)
+{
+        int fd = -1;
+        char *path = NULL;
+        void *map = NULL;
+        struct stat st;
+        struct JournalIndexHeader header;
+        uint32_t capacity = telem_journal->header->capacity;
+        uint32_t buckets = index_buckets(capacity);
+        size_t size = index_size(capacity, buckets);
+        bool valid = false;
+
+        if ((path = index_path(telem_journal->journal_file)) == NULL) {
+                return;
+        }
+        fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+        free(path);
+        if (fd < 0 || fstat(fd, &st) != 0) {
+                telem_log(LOG_INFO, "Unable to open journal index: %s\n", strerror(errno));
+                goto fail;
+        }
+
+        if ((size_t)st.st_size == size &&
+            pread(fd, &header, sizeof(header), 0) == sizeof(header)) {
+                valid = memcmp(header.magic, JOURNAL_INDEX_MAGIC, sizeof(header.magic)) == 0 &&
+                        header.version == JOURNAL_INDEX_VERSION &&
+                        header.capacity == capacity && header.buckets == buckets;
+        }
+        if (!valid && (ftruncate(fd, 0) != 0 || ftruncate(fd, (off_t)size) != 0)) {
+                telem_log(LOG_INFO, "Unable to size journal index: %s\n", strerror(errno));
+                goto fail;
+        }
+
+        map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (map == MAP_FAILED) {
+                telem_log(LOG_INFO, "Unable to map journal index: %s\n", strerror(errno));
+                goto fail;
+        }
+        telem_journal->index_fd = fd;
+        telem_journal->index = map;
+        telem_journal->index_size = size;
+
+        if (!valid) {
+                telem_journal->index->version = JOURNAL_INDEX_VERSION;
+                telem_journal->index->capacity = capacity;
+                telem_journal->index->buckets = buckets;
+                memcpy(telem_journal->index->magic, JOURNAL_INDEX_MAGIC,
+                       sizeof(telem_journal->index->magic));
+                index_rebuild(telem_journal);
+        }
+        return;
+
+fail:
+        if (fd >= 0) {
+                close(fd);
+        }
+}
+
+/**
+ * Looks up the entries matching the filters in the index, using the most
+ * selective filter provided.
+ *
+ * @param telem_journal Pointer to a telemetry journal.
+ * @param classification Classification filter, or NULL.
+ * @param record_id Record id filter, or NULL.
+ * @param event_id Event id filter, or NULL.
+ * @param boot_id Boot id filter, or NULL.
+ * @param positions Set with the positions from the oldest of the entries
+ *        that may match, in order. Fits the capacity of the ring.
+ *
+ * @return the number of positions, -1 if the index cannot be used.
+ */
+static int index_lookup(struct TelemJournal *telem_journal, char *classification,
+                        char *record_id, char *event_id, char *boot_id,
+                        uint32_t *positions)
+{
+        struct JournalIndexHeader *index = telem_journal->index;
+        uint32_t count = telem_journal->header->count;
+        uint32_t capacity = telem_journal->header->capacity;
+        const char *key = NULL;
+        int id = -1;
+        uint32_t n = 0;
+
+        if (!index_current(telem_journal)) {
                 return -1;
         }
 
-        e = calloc(1, sizeof(struct JournalEntry));
-        if (!e) {
+        if (record_id != NULL) {
+                id = JOURNAL_INDEX_RECORD_ID;
+                key = record_id;
+        } else if (event_id != NULL) {
+                id = JOURNAL_INDEX_EVENT_ID;
+                key = event_id;
+        } else if (classification == NULL && boot_id != NULL) {
+                id = JOURNAL_INDEX_BOOT_ID;
+                key = boot_id;
+        }
+
+        if (id >= 0) {
+                uint32_t *next = index_links(telem_journal, id, false);
+                uint32_t bucket = journal_hash(key) & (index->buckets - 1);
+                uint32_t slot = index_heads(telem_journal, id)[bucket];
+
+                // Bounded, the daemon may change the index meanwhile
+                for (uint32_t i = 0; slot != 0 && slot <= capacity && i < capacity; i++) {
+                        if (strcmp(entry_id(&telem_journal->entries[slot - 1], id), key) == 0) {
+                                positions[n++] = journal_position(telem_journal, slot - 1);
+                        }
+                        slot = next[slot - 1];
+                }
+        } else if (classification != NULL) {
+                uint32_t *classes = index_classes(telem_journal);
+                size_t len = strlen(classification);
+                bool prefix = is_class_prefix(classification);
+                char *key_class = strndup(classification, prefix ? len - 1 : len);
+                uint32_t pos;
+
+                if (!key_class) {
+                        return -1;
+                }
+                pos = index_class_lower_bound(telem_journal, key_class);
+                for (; pos < index->count && pos < capacity; pos++) {
+                        const char *entry_class =
+                                telem_journal->entries[classes[pos] - 1].classification;
+
+                        if (prefix ? strncmp(entry_class, key_class, len - 1) != 0 :
+                            strcmp(entry_class, key_class) != 0) {
+                                break;
+                        }
+                        positions[n++] = journal_position(telem_journal, classes[pos] - 1);
+                }
+                free(key_class);
+        } else {
                 return -1;
         }
 
-        llen = strlen(line);
+        if (!index_current(telem_journal) || telem_journal->header->count != count) {
+                return -1;
+        }
+        qsort(positions, n, sizeof(uint32_t), compare_positions);
 
-        for (int i = 0; i < 5; i++) {
-                char *out = NULL;
-                if (offset > llen) {
-                        rc = -1;
-                        break;
+        return (int)n;
+}
+
+/**
+ * Sets or tests the bits of a string in the classification filter of a
+ * segment.
+ *
+ * @param segment The segment.
+ * @param key The string.
+ * @param len Length of the string.
+ * @param set true to set the bits, false to test them.
+ *
+ * @return true if all the bits are set.
+ */
+static bool segment_bloom(struct JournalSegment *segment, const char *key, size_t len,
+                          bool set)
+{
+        uint32_t hash = journal_hash_n(key, len);
+        uint32_t step = (hash >> 16) | 1;
+        bool found = true;
+
+        for (int i = 0; i < 3; i++) {
+                uint32_t bit = (hash + (uint32_t)i * step) % JOURNAL_BLOOM_BITS;
+                uint8_t mask = (uint8_t)(1u << (bit % 8));
+
+                if (set) {
+                        segment->classes[bit / 8] |= mask;
+                } else if (!(segment->classes[bit / 8] & mask)) {
+                        found = false;
                 }
-                len = strcspn(line + offset, "\036\n");
-                out = strndup((line + offset), len);
-                offset += len + 1;
-                if (out) {
-                        switch (i) {
-                                case 0:
-                                        e->record_id = out;
-                                        break;
-                                case 1:
-                                        e->timestamp = atoll(out);
-                                        free(out);
-                                        break;
-                                case 2:
-                                        e->classification = out;
-                                        break;
-                                case 3:
-                                        e->event_id = out;
-                                        break;
-                                case 4:
-                                        e->boot_id = out;
-                                        rc = 0;
-                                        break;
+        }
+
+        return found;
+}
+
+/**
+ * Adds an entry written to a slot to the footer of its segment, reset by
+ * the first slot.
+ *
+ * @param telem_journal Pointer to a telemetry journal.
+ * @param slot The slot.
+ */
+static void segment_add(struct TelemJournal *telem_journal, uint32_t slot)
+{
+        struct JournalSegment *segment = &telem_journal->segments[slot / JOURNAL_SEGMENT_ENTRIES];
+        struct JournalEntry *entry = &telem_journal->entries[slot];
+        uint32_t boot_id = journal_hash(entry->boot_id);
+        bool known = false;
+        uint32_t held;
+
+        if (slot % JOURNAL_SEGMENT_ENTRIES == 0) {
+                memset(segment, 0, sizeof(struct JournalSegment));
+        }
+        if (segment->entries == 0 || entry->timestamp < segment->min_timestamp) {
+                segment->min_timestamp = entry->timestamp;
+        }
+        if (segment->entries == 0 || entry->timestamp > segment->max_timestamp) {
+                segment->max_timestamp = entry->timestamp;
+        }
+        segment->entries++;
+
+        held = segment->boot_ids < JOURNAL_SEGMENT_BOOT_IDS ? segment->boot_ids :
+               JOURNAL_SEGMENT_BOOT_IDS;
+        for (uint32_t i = 0; i < held; i++) {
+                known = known || segment->boot_id_hashes[i] == boot_id;
+        }
+        if (!known && segment->boot_ids <= JOURNAL_SEGMENT_BOOT_IDS) {
+                if (segment->boot_ids < JOURNAL_SEGMENT_BOOT_IDS) {
+                        segment->boot_id_hashes[segment->boot_ids] = boot_id;
+                }
+                segment->boot_ids++;
+        }
+
+        // The classification, and its prefixes for t/\* filters
+        for (size_t i = 0; entry->classification[i] != '\0'; i++) {
+                if (entry->classification[i] == '/') {
+                        segment_bloom(segment, entry->classification, i + 1, true);
+                }
+        }
+        segment_bloom(segment, entry->classification, strlen(entry->classification), true);
+}
+
+/**
+ * Checks whether a segment may hold entries matching filters, from its
+ * footer.
+ *
+ * @param telem_journal Pointer to a telemetry journal.
+ * @param slot A slot of the segment.
+ * @param classification Classification filter, or NULL.
+ * @param boot_id Boot id filter, or NULL.
+ * @param since Oldest time stamp, 0 for no limit.
+ * @param until Newest time stamp, 0 for no limit.
+ *
+ * @return false if no entry of the segment matches.
+ */
+static bool segment_may_match(struct TelemJournal *telem_journal, uint32_t slot,
+                              char *classification, char *boot_id, time_t since,
+                              time_t until)
+{
+        /* Copied, the daemon may append to the journal meanwhile */
+        struct JournalSegment segment = telem_journal->segments[slot / JOURNAL_SEGMENT_ENTRIES];
+
+        if (segment.entries == 0) {
+                return false;
+        }
+        if ((since > 0 && segment.max_timestamp < (int64_t)since) ||
+            (until > 0 && segment.min_timestamp > (int64_t)until)) {
+                return false;
+        }
+        if (boot_id != NULL && segment.boot_ids <= JOURNAL_SEGMENT_BOOT_IDS) {
+                uint32_t hash = journal_hash(boot_id);
+                bool found = false;
+
+                for (uint32_t i = 0; i < segment.boot_ids; i++) {
+                        found = found || segment.boot_id_hashes[i] == hash;
+                }
+                if (!found) {
+                        return false;
+                }
+        }
+        if (classification != NULL) {
+                size_t len = strlen(classification);
+
+                // A t/\* prefix was added with its trailing '/'
+                if (is_class_prefix(classification)) {
+                        len--;
+                }
+                if (!segment_bloom(&segment, classification, len, false)) {
+                        return false;
+                }
+        }
+
+        return true;
+}
+
+/**
+ * Prunes the oldest entries of the journal, passing their record ids to the
+ * prune callbacks JOURNAL_PRUNE_BATCH at a time.
+ *
+ * @param telem_journal Pointer to a telemetry journal.
+ * @param n Number of entries to prune, at most the number of entries.
+ */
+static void drop_oldest(struct TelemJournal *telem_journal, uint32_t n)
+{
+        struct JournalHeader *header = telem_journal->header;
+        char record_ids[JOURNAL_PRUNE_BATCH][JOURNAL_ID_LEN + 1];
+        char *batch[JOURNAL_PRUNE_BATCH];
+        bool indexed = index_prepare(telem_journal);
+
+        while (n > 0) {
+                int k = n < JOURNAL_PRUNE_BATCH ? (int)n : JOURNAL_PRUNE_BATCH;
+
+                for (int i = 0; i < k; i++) {
+                        copy_field(record_ids[i], sizeof(record_ids[i]),
+                                   journal_slot(telem_journal, 0)->record_id);
+                        batch[i] = record_ids[i];
+                        if (indexed) {
+                                index_remove(telem_journal, header->head);
                         }
-                } else {
-                        rc = -1;
-                        break;
+                        header->head = (header->head + 1) % header->capacity;
+                        header->count--;
                 }
+                n -= (uint32_t)k;
+
+                if (telem_journal->prune_batch_callback != NULL) {
+                        telem_journal->prune_batch_callback(batch, k);
+                } else if (telem_journal->prune_entry_callback != NULL) {
+                        for (int i = 0; i < k; i++) {
+                                telem_journal->prune_entry_callback(batch[i]);
+                        }
+                }
+        }
+        if (indexed) {
+                index_mark_current(telem_journal);
         }
+        telem_journal->record_count = (int)header->count;
+}
 
-        if (rc == 0) {
-                *entry = e;
-        } else {
-                free_journal_entry(e);
+/**
+ * Gets the number of entries past which the journal is pruned down to
+ * record_count_limit, at most the capacity of the ring.
+ *
+ * @param telem_journal Pointer to a telemetry journal.
+ *
+ * @return the high watermark.
+ */
+static uint32_t high_watermark(struct TelemJournal *telem_journal)
+{
+        uint32_t capacity = telem_journal->header->capacity;
+        int64_t high = (int64_t)telem_journal->record_count_limit + DEVIATION;
+
+        if (high < 0) {
+                return 0;
         }
 
-        return rc;
+        return high < (int64_t)capacity ? (uint32_t)high : capacity;
+}
+
+/**
+ * Prunes the journal down to record_count_limit if it reached its high
+ * watermark.
+ *
+ * @param telem_journal Pointer to a telemetry journal.
+ */
+static void prune_to_limit(struct TelemJournal *telem_journal)
+{
+        uint32_t count = telem_journal->header->count;
+        uint32_t limit = telem_journal->record_count_limit > 0 ?
+                         (uint32_t)telem_journal->record_count_limit : 0;
+
+        if (count > limit && count >= high_watermark(telem_journal)) {
+                drop_oldest(telem_journal, count - limit);
+                telem_debug("DEBUG: record_count: %d\n", telem_journal->record_count);
+        }
 }
 
 /**
- * Counts the number of records in journal.
- *
- * @param telem_journal Pointer to a telemetry journal
- *        to get record count.
- *
- * @return record count
+ * Appends an entry after the newest. Entering a segment, the oldest
+ * entries left in it are pruned first, the whole segment at once.
  *
+ * @param telem_journal Pointer to a telemetry journal.
+ * @param entry The entry.
  */
-static int get_record_count(struct TelemJournal *telem_journal)
+static void append_entry(struct TelemJournal *telem_journal, struct JournalEntry *entry)
 {
-        int count = 0;
-        size_t len;
-        ssize_t read;
-        char *line = NULL;
-
-        rewind(telem_journal->fptr);
-        // read until the end line by line
-        while ((read = getline(&line, &len, telem_journal->fptr)) != -1) {
-                count++;
+        struct JournalHeader *header = telem_journal->header;
+        uint32_t slot = (header->head + header->count) % header->capacity;
+        uint32_t free_slots = header->capacity - header->count;
+        uint32_t end = segment_end(telem_journal, slot);
+        bool indexed;
+
+        // The free slots start at slot, entries past them are the oldest
+        if (slot % JOURNAL_SEGMENT_ENTRIES == 0 && end - slot > free_slots) {
+                drop_oldest(telem_journal, end - slot - free_slots);
+        } else if (free_slots == 0) {
+                drop_oldest(telem_journal, 1);
         }
-        free(line);
-
-        return count;
+        indexed = index_prepare(telem_journal);
+        telem_journal->entries[slot] = *entry;
+        segment_add(telem_journal, slot);
+        header->count++;
+        header->appended++;
+        if (indexed) {
+                index_insert(telem_journal, slot);
+                index_mark_current(telem_journal);
+        }
+        telem_journal->record_count = (int)header->count;
 }
 
 /**
- * Serializes JournalEntry and saves it to file.
+ * Replaces the journal file by a ring holding entries, the newest that fit.
  *
- * @param fptr A FILE pointer.
- * @param entry A pointer to data.
+ * @param telem_journal Pointer to a telemetry journal, with fd set to
+ *        the former journal.
+ * @param entries The entries, from the oldest.
+ * @param n Number of entries.
  *
- * @return 0 on succes, !=0 on failure
+ * @return 0 on success, -1 on failure.
  */
-static int save_entry(FILE *fptr, struct JournalEntry *entry)
+static int replace_journal(struct TelemJournal *telem_journal,
+                           struct JournalEntry *entries, uint32_t n)
 {
         int rc = -1;
-        char *serialized_data = NULL;
+        int fd = -1;
+        char *tmp_path = NULL;
 
-        if (fptr == NULL || entry == NULL) {
+        if (asprintf(&tmp_path, "%s.tmp", telem_journal->journal_file) == -1) {
                 return rc;
         }
+        fd = open(tmp_path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (fd < 0) {
+                telem_perror("Error while creating journal file");
+                goto quit;
+        }
 
-        if ((rc = serialize_journal_entry(entry, &serialized_data)) == 0) {
-                telem_debug("DEBUG: Saving: %s\n", serialized_data);
-                fprintf(fptr, "%s\n", serialized_data);
-                fflush(fptr);
-                free(serialized_data);
+        close(telem_journal->fd);
+        telem_journal->fd = fd;
+        if (create_journal(telem_journal, RECORD_LIMIT + DEVIATION) != 0) {
+                goto quit;
+        }
+        for (uint32_t i = 0; i < n; i++) {
+                append_entry(telem_journal, &entries[i]);
+        }
+        if (rename(tmp_path, telem_journal->journal_file) != 0) {
+                telem_perror("Error while replacing journal");
+                goto quit;
+        }
+        rc = 0;
+
+quit:
+        if (rc != 0) {
+                unlink(tmp_path);
         }
+        free(tmp_path);
 
         return rc;
 }
 
 /**
- * Reads the boot unique identifier from BOOTID_FILE
+ * Replaces a journal in the former text format by a ring holding
+ * its newest entries.
  *
- * @param buff pointer to a BOOTID_LEN allocated
+ * @param telem_journal Pointer to a telemetry journal, with fd set to
+ *        the text journal.
  *
- * @return 0 on success, -1 on failure
+ * @return 0 on success, -1 on failure.
  */
-static int read_boot_id(char buff[])
+static int convert_text_journal(struct TelemJournal *telem_journal)
 {
         int rc = -1;
-        FILE *fs = NULL;
+        char *line = NULL;
+        size_t len = 0;
+        FILE *fptr = NULL;
+        struct JournalEntry *entries = NULL;
+        uint32_t n = 0;
+        uint32_t alloc = 0;
 
-        fs = fopen(BOOTID_FILE, "r");
-        if (!fs) {
-                telem_log(LOG_ERR, "Error: Unable to open %s for reading: %d\n", BOOTID_FILE, errno);
+        fptr = fopen(telem_journal->journal_file, "r");
+        if (!fptr) {
+                telem_perror("Error while opening text journal");
                 return rc;
         }
-
-        if (fgets(buff, BOOTID_LEN, fs)) {
-                rc = 0;
+        while (getline(&line, &len, fptr) != -1) {
+                if (n == alloc) {
+                        void *larger;
+
+                        alloc = alloc ? alloc * 2 : RECORD_LIMIT + DEVIATION;
+                        larger = realloc(entries, alloc * sizeof(struct JournalEntry));
+                        if (!larger) {
+                                telem_log(LOG_CRIT, "CRIT: Unable to allocate memory\n");
+                                goto quit;
+                        }
+                        entries = larger;
+                }
+                if (deserialize_journal_entry(line, &entries[n]) == 0) {
+                        n++;
+                }
         }
-        fclose(fs);
+        rc = replace_journal(telem_journal, entries, n);
+        if (rc == 0) {
+                telem_log(LOG_INFO, "Converted text journal, %d entries kept\n",
+                          telem_journal->record_count);
+        }
+
+quit:
+        free(entries);
+        free(line);
+        fclose(fptr);
 
         return rc;
 }
 
 /**
- * Moves the file position indicator n lines.
+ * Replaces a ring of the first version, without segment footers, by a
+ * ring of the current version with the same entries.
  *
- * @param n Number of lines to skip.
- * @param fptr A file pointer.
- * @param found_record A pointer to a function to be called
- *                     every time a valid record is found, if
- *                     pointer is not set to null.
+ * @param telem_journal Pointer to a telemetry journal, with fd set to
+ *        the former journal.
+ * @param header The header of the former journal, valid.
  *
- * @returns 0 on success, on failure -1 if n > existing
- *            lines in file or errno if failure happens
- *            during file operation.
+ * @return 0 on success, -1 on failure.
  */
-static int skip_n_lines(int n, FILE *fptr, int (*found_record)(char *))
+static int upgrade_journal(struct TelemJournal *telem_journal, struct JournalHeader *header)
 {
-        int rc = 0;
-        size_t len = 0;
-        char *line = NULL;
-        struct JournalEntry *entry = NULL;
-
-        if (fptr == NULL) {
-                telem_log(LOG_ERR, "fptr argument to skip_n_lines is invalid\n");
-                // File descriptor in bad state
-                return EBADFD;
-        }
+        int rc = -1;
+        struct JournalEntry *entries = NULL;
 
-        if (fseek(fptr, 0, 0) != 0) {
-                return errno;
+        entries = calloc(header->capacity, sizeof(struct JournalEntry));
+        if (!entries) {
+                telem_log(LOG_CRIT, "CRIT: Unable to allocate memory\n");
+                return rc;
         }
-
-        for (int i = 0; i < n; i++) {
-                if (getline(&line, &len, fptr) == -1) {
-                        rc = -1;
-                        break;
-                }
-                if (found_record != NULL) {
-                        if (!strlen(line))
-                            continue;
-                        deserialize_journal_entry(line, &entry);
-                        if (entry) {
-                                found_record(entry->record_id);
-                                free_journal_entry(entry);
-                                entry = NULL;
-                        }
+        for (uint32_t i = 0; i < header->count; i++) {
+                off_t offset = (off_t)sizeof(struct JournalHeader) +
+                               (off_t)((header->head + i) % header->capacity) *
+                               (off_t)sizeof(struct JournalEntry);
+
+                if (pread(telem_journal->fd, &entries[i], sizeof(struct JournalEntry),
+                          offset) != sizeof(struct JournalEntry)) {
+                        telem_perror("Error while reading journal file");
+                        goto quit;
                 }
         }
-        free(line);
+        rc = replace_journal(telem_journal, entries, header->count);
+        if (rc == 0) {
+                telem_log(LOG_INFO, "Upgraded journal, %d entries kept\n",
+                          telem_journal->record_count);
+        }
+
+quit:
+        free(entries);
 
         return rc;
 }
 
 /**
- * Copies contents of fptr to a known location.
+ * Maps an existing journal file, or initializes a new one.
  *
- * @param fptr A file pointer from source file.
+ * @param telem_journal Pointer to a telemetry journal, with fd set.
  *
- * @returns 0 on success, errno on failure
+ * @return 0 on success, -1 on failure.
  */
-static int copy_to_tmp(FILE *fptr, char *tmp_path)
+static int load_journal(struct TelemJournal *telem_journal)
 {
-        int rc = 0;
-        size_t len;
-        char *line = NULL;
-        FILE *fptr_tmp = NULL;
+        struct stat st;
+        struct JournalHeader header;
 
-        if (fptr == NULL) {
+        if (fstat(telem_journal->fd, &st) != 0) {
+                telem_perror("Error while reading journal file");
                 return -1;
         }
+        if (st.st_size == 0) {
+                return create_journal(telem_journal, RECORD_LIMIT + DEVIATION);
+        }
 
-        fptr_tmp = fopen(tmp_path, "w");
-        if (!fptr_tmp) {
-                return errno;
+        if (pread(telem_journal->fd, &header, sizeof(header), 0) != sizeof(header) ||
+            memcmp(header.magic, JOURNAL_MAGIC, sizeof(header.magic)) != 0) {
+                return convert_text_journal(telem_journal);
+        }
+        if (header.version == 1 && header.entry_size == sizeof(struct JournalEntry) &&
+            header.capacity > 0 && header.head < header.capacity &&
+            header.count <= header.capacity &&
+            (size_t)st.st_size == sizeof(struct JournalHeader) +
+            (size_t)header.capacity * sizeof(struct JournalEntry)) {
+                return upgrade_journal(telem_journal, &header);
+        }
+        if (!valid_header(&header, (size_t)st.st_size)) {
+                telem_log(LOG_WARNING, "Journal file is invalid, starting a new one\n");
+                return create_journal(telem_journal, RECORD_LIMIT + DEVIATION);
         }
 
-        // Copy lines to new file
-        while (getline(&line, &len, fptr) > -1) {
-                if (fprintf(fptr_tmp, "%s", line) < 0) {
-                        rc = errno;
-                        break;
-                }
+        return map_journal(telem_journal, (size_t)st.st_size, header.capacity);
+}
+
+/**
+ * Reads the boot unique identifier from BOOTID_FILE
+ *
+ * @param buff pointer to a BOOTID_LEN allocated
+ *
+ * @return 0 on success, -1 on failure
+ */
+static int read_boot_id(char buff[])
+{
+        int rc = -1;
+        FILE *fs = NULL;
+
+        fs = fopen(BOOTID_FILE, "r");
+        if (!fs) {
+                telem_log(LOG_ERR, "Error: Unable to open %s for reading: %d\n", BOOTID_FILE, errno);
+                return rc;
         }
 
-        if (fclose(fptr_tmp) != 0) {
-                rc = errno;
-                telem_perror("Error");
+        if (fgets(buff, BOOTID_LEN, fs)) {
+                rc = 0;
         }
-        free(line);
+        fclose(fs);
 
         return rc;
 }
@@ -330,43 +1168,54 @@ static int copy_to_tmp(FILE *fptr, char *tmp_path)
 /* Exported function */
 TelemJournal *open_journal(const char *journal_file)
 {
-        FILE *fptr = NULL;
+        int fd = -1;
         char boot_id[BOOTID_LEN] = { '\0' };
         struct TelemJournal *telem_journal;
 
         // Use default location if journal_file parameter is NULL
         if (journal_file == NULL) {
-                fptr = fopen(JOURNAL_PATH, "a+");
-        } else {
-                fptr = fopen(journal_file, "a+");
+                journal_file = JOURNAL_PATH;
         }
-        if (fptr == NULL) {
+        fd = open(journal_file, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+        if (fd < 0) {
                 telem_perror("Error while opening journal file");
                 return NULL;
         }
 
         if (read_boot_id(boot_id) != 0) {
                 telem_perror("Error while reading boot_id");
-                fclose(fptr);
+                close(fd);
                 return NULL;
         }
 
-        telem_journal = malloc(sizeof(struct TelemJournal));
+        telem_journal = calloc(1, sizeof(struct TelemJournal));
         if (!telem_journal) {
                 telem_log(LOG_CRIT, "CRIT: Unable to allocate memory\n");
-                fclose(fptr);
+                close(fd);
                 return NULL;
         }
 
-        telem_journal->fptr = fptr;
-        telem_journal->journal_file = \
-                (journal_file == NULL) ? strdup(JOURNAL_PATH) : strdup(journal_file);
+        telem_journal->fd = fd;
+        telem_journal->index_fd = -1;
+        telem_journal->journal_file = strdup(journal_file);
+        if (!telem_journal->journal_file || load_journal(telem_journal) != 0) {
+                close(telem_journal->fd);
+                free(telem_journal->journal_file);
+                free(telem_journal);
+                return NULL;
+        }
+        open_index(telem_journal);
         /* boot_id includes \n at the end, strip RC during duplication */
         telem_journal->boot_id = strndup(boot_id, BOOTID_LEN - 1);
-        telem_journal->record_count = get_record_count(telem_journal);
+        telem_journal->record_count = (int)telem_journal->header->count;
         telem_journal->record_count_limit = RECORD_LIMIT;
         telem_journal->latest_record_id = NULL;
         telem_journal->prune_entry_callback = NULL;
+        telem_journal->prune_batch_callback = NULL;
+        telem_journal->sync = JOURNAL_SYNC_NONE;
+        telem_journal->group_entries = 1;
+        telem_journal->group_time = 0;
+        telem_journal->pending = 0;
 
         telem_debug("Records in db: %d\n", telem_journal->record_count);
 
@@ -377,169 +1226,283 @@ TelemJournal *open_journal(const char *journal_file)
 void close_journal(TelemJournal *telem_journal)
 {
         if (telem_journal) {
+                commit_journal(telem_journal, true);
                 free(telem_journal->boot_id);
                 free(telem_journal->journal_file);
                 free(telem_journal->latest_record_id);
-                fclose(telem_journal->fptr);
+                if (telem_journal->index) {
+                        munmap(telem_journal->index, telem_journal->index_size);
+                        close(telem_journal->index_fd);
+                }
+                munmap(telem_journal->header, telem_journal->map_size);
+                close(telem_journal->fd);
                 free(telem_journal);
         }
 }
 
-/**
- * Checks if class is a prefix i.e. t/\* or t/t/\*
- *
- * @param class A pointer to string with classification
- *              value to check.
- * @return 1 if class is a prefix, 0 otherwise
- */
-static int is_class_prefix(char *class)
-{
-        size_t class_len = strlen(class);
-        return (strcmp((char *)(class + class_len - 2), "/*") == 0) ? 1 : 0;
-}
+/* Filters and output state of print_journal */
+struct journal_query {
+        char *classification;
+        char *record_id;
+        char *event_id;
+        char *boot_id;
+        bool include_record;
+        /* retention directory, its pack and read buffer, for record contents */
+        int records_dir;
+        struct record_pack pack;
+        bool packed;
+        char *buff;
+};
 
 /**
  * Print records content
  *
+ * @param query The query, with the retention directory open.
  * @param record_id Unique record identifier
  *
  */
-static void print_record(char *record_id)
+static void print_record(struct journal_query *query, char *record_id)
 {
-        int rc = 0;
-        size_t read = 0;
-        char buff[MID_BUFF] = { '\0' };
-        char *filepath = NULL;
-        FILE *recordfp = NULL;
-
-        rc = asprintf(&filepath, "%s/%s", RECORD_RETENTION_DIR, record_id);
-        if (rc == -1) {
-                // just bail out, there are worse problems
+        int fd = -1;
+        ssize_t len = 0;
+        char *body = NULL;
+        size_t size = 0;
+        int ret = -ENOENT;
+
+        if (query->packed) {
+                ret = record_pack_get(&query->pack, record_id, &body, &size);
+        }
+        if (ret == 0) {
+                fwrite(body, 1, size, stdout);
+                fputc('\n', stdout);
+                free(body);
+                return;
+        }
+        if (ret != -ENOENT) {
+                telem_log(LOG_INFO, "Could not read record %s: %s\n", record_id, strerror(-ret));
                 return;
         }
 
-        recordfp = fopen(filepath, "r");
-        if (!recordfp) {
+        /* Saved before records were packed */
+        fd = openat(query->records_dir, record_id, O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
                 telem_log(LOG_INFO, "Could not open record %s: %s\n", record_id, strerror(errno));
                 return;
         }
 
-        while ((read = fread(buff, 1, sizeof(buff), recordfp)) > 0) {
-                fwrite(buff, 1, read, stdout);
+        while ((len = read(fd, query->buff, RECORD_READ_BUFF)) > 0) {
+                fwrite(query->buff, 1, (size_t)len, stdout);
+        }
+
+        close(fd);
+}
+
+/**
+ * Prints an entry of the journal if it matches the filters.
+ *
+ * @param telem_journal A pointer to struct initialized by open_journal call.
+ * @param n Position of the entry, from the oldest.
+ * @param query The filters, NULL members match any entry.
+ *
+ * @return 1 if the entry was printed, 0 otherwise.
+ */
+static int print_entry(TelemJournal *telem_journal, uint32_t n,
+                       struct journal_query *query)
+{
+        char str_time[80] = { '\0' };
+        time_t timestamp;
+        struct tm ts;
+        struct JournalEntry entry;
+
+        /* Copied, the daemon may append to the journal meanwhile */
+        entry = *journal_slot(telem_journal, n);
+        entry.classification[sizeof(entry.classification) - 1] = '\0';
+        entry.record_id[sizeof(entry.record_id) - 1] = '\0';
+        entry.event_id[sizeof(entry.event_id) - 1] = '\0';
+        entry.boot_id[sizeof(entry.boot_id) - 1] = '\0';
+
+        /* filter entry out if one is provided */
+        if (query->record_id != NULL && strcmp(entry.record_id, query->record_id) != 0) {
+                return 0;
+        }
+        if (query->boot_id != NULL && strcmp(entry.boot_id, query->boot_id) != 0) {
+                return 0;
+        }
+        if (query->event_id != NULL && strcmp(entry.event_id, query->event_id) != 0) {
+                return 0;
+        }
+        // In the case of class checking prefixes is an option
+        if (query->classification != NULL) {
+                char *classification = query->classification;
+
+                // Check prefixes when classification ends in /*, otherwise use strcomp
+                if (is_class_prefix(classification)) {
+                        if (strncmp(entry.classification, classification, strlen(classification) - 1) != 0) {
+                                return 0;
+                        }
+                } else if (strcmp(entry.classification, classification) != 0) {
+                        return 0;
+                }
+        }
+        /* end filters section */
+        timestamp = (time_t)entry.timestamp;
+        if (localtime_r(&timestamp, &ts) == NULL ||
+            strftime(str_time, sizeof(str_time), "%a %Y-%m-%d %H:%M:%S %Z", &ts) == 0) {
+                return 0;
+        }
+        /* print record metadata */
+        fprintf(stdout, "%-30s %s %s %s %s\n", entry.classification, str_time, entry.record_id, entry.event_id, entry.boot_id);
+        /* print record content */
+        if (query->include_record && query->records_dir >= 0) {
+                print_record(query, entry.record_id);
+        }
+
+        return 1;
+}
+
+/**
+ * Finds the first entry not older than a time, by binary search over
+ * the timestamps of the entries, which are appended in order.
+ *
+ * @param telem_journal A pointer to struct initialized by open_journal call.
+ * @param low Position of the first entry to search.
+ * @param high Position after the last entry to search.
+ * @param t The time.
+ * @param after true to find the first entry newer than t instead.
+ *
+ * @return the position, high if there is none.
+ */
+static uint32_t seek_time(TelemJournal *telem_journal, uint32_t low, uint32_t high,
+                          time_t t, bool after)
+{
+        while (low < high) {
+                uint32_t mid = low + (high - low) / 2;
+                int64_t timestamp = journal_slot(telem_journal, mid)->timestamp;
+
+                if (timestamp < (int64_t)t || (after && timestamp == (int64_t)t)) {
+                        low = mid + 1;
+                } else {
+                        high = mid;
+                }
         }
 
-        free(filepath);
-        fclose(recordfp);
+        return low;
 }
 
 /* Exported function */
 int print_journal(TelemJournal *telem_journal, char *classification,
                   char *record_id, char *event_id, char *boot_id,
                   bool include_record)
+{
+        return print_journal_range(telem_journal, classification, record_id,
+                                   event_id, boot_id, 0, 0, include_record);
+}
+
+/* Exported function */
+int print_journal_range(TelemJournal *telem_journal, char *classification,
+                        char *record_id, char *event_id, char *boot_id,
+                        time_t since, time_t until, bool include_record)
 {
         int n = 0;
-        int rc = 0;
         int count = 0;
-        char str_time[80] = { '\0' };
-        char *line = NULL;
-        size_t len = 0;
-        FILE *journal_fileptr = NULL;
-        struct tm ts;
-        struct JournalEntry *entry = NULL;
+        int entries = 0;
+        int found = -1;
+        uint32_t *positions = NULL;
+        struct journal_query query = { classification, record_id, event_id, boot_id,
+                                       include_record, -1, { 0 }, false, NULL };
 
         if (telem_journal == NULL) {
                 return -1;
         }
 
-        journal_fileptr = fopen(telem_journal->journal_file, "r");
-        if (!journal_fileptr) {
-                return -1;
+        // Skip the entries beyond the limit, from the oldest
+        entries = (int)telem_journal->header->count;
+        n = entries - telem_journal->record_count_limit;
+        if (n < 0) {
+                n = 0;
+        }
+        if (since > 0) {
+                n = (int)seek_time(telem_journal, (uint32_t)n, (uint32_t)entries, since, false);
+        }
+        if (until > 0) {
+                entries = (int)seek_time(telem_journal, (uint32_t)n, (uint32_t)entries,
+                                         until, true);
         }
 
-        // Advance file pointer to line n
-        n = telem_journal->record_count - telem_journal->record_count_limit;
-        if (n > 0) {
-                rc = skip_n_lines(n, journal_fileptr, NULL);
-                if (rc == -1) {
-                        return rc;
-                } else if (rc != 0) {
-                        telem_log(LOG_ERR, "An error occurred while advancing journal file: %s\n", strerror(rc));
+        if (include_record) {
+                query.records_dir = open(RECORD_RETENTION_DIR, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+                if (query.records_dir < 0) {
+                        telem_log(LOG_INFO, "Could not open records: %s\n", strerror(errno));
+                } else {
+                        query.packed = record_pack_open(&query.pack, query.records_dir,
+                                                        false, false) == 0;
+                }
+                query.buff = malloc(RECORD_READ_BUFF);
+                if (!query.buff) {
+                        telem_log(LOG_CRIT, "CRIT: Unable to allocate memory\n");
+                        count = -1;
+                        goto quit;
                 }
         }
 
-        while (getline(&line, &len, journal_fileptr) != -1) {
-                if (!strlen(line))
-                    continue;
-                deserialize_journal_entry(line, &entry);
-                if (entry) {
-                        /* filter entry out if one is provided */
-                        if (record_id != NULL && strcmp(entry->record_id, record_id) != 0) {
-                                goto skip_print;
-                        }
-                        if (boot_id != NULL && strcmp(entry->boot_id, boot_id) != 0) {
-                                goto skip_print;
-                        }
-                        if (event_id != NULL && strcmp(entry->event_id, event_id) != 0) {
-                                goto skip_print;
-                        }
-                        // In the case of class checking prefixes is an option
-                        if (classification != NULL) {
-                                // Check prefixes when classification ends in /*, otherwise use strcomp
-                                if (is_class_prefix(classification)) {
-                                        if (strncmp(entry->classification, classification, strlen(classification) - 1) != 0) {
-                                                goto skip_print;
-                                        }
-                                } else if (strcmp(entry->classification, classification) != 0) {
-                                        goto skip_print;
+        if (telem_journal->index != NULL) {
+                positions = malloc(telem_journal->header->capacity * sizeof(uint32_t));
+                if (!positions) {
+                        telem_log(LOG_CRIT, "CRIT: Unable to allocate memory\n");
+                        count = -1;
+                        goto quit;
+                }
+                found = index_lookup(telem_journal, classification, record_id,
+                                     event_id, boot_id, positions);
+        }
+
+        if (found < 0) {
+                uint32_t checked = UINT32_MAX;
+
+                // No filter, or no usable index: scan the range, by segment
+                for (; n < entries; n++) {
+                        uint32_t slot = (telem_journal->header->head + (uint32_t)n) %
+                                        telem_journal->header->capacity;
+
+                        if (slot / JOURNAL_SEGMENT_ENTRIES != checked) {
+                                checked = slot / JOURNAL_SEGMENT_ENTRIES;
+                                if (!segment_may_match(telem_journal, slot, classification,
+                                                       boot_id, since, until)) {
+                                        n += (int)(segment_end(telem_journal, slot) - slot) - 1;
+                                        continue;
                                 }
                         }
-                        /* end filters section */
-                        ts = *localtime(&entry->timestamp);
-                        if (strftime(str_time, sizeof(str_time), "%a %Y-%m-%d %H:%M:%S %Z", &ts) == 0) {
-                                goto skip_print;
-                        }
-                        /* print record metadata */
-                        fprintf(stdout, "%-30s %s %s %s %s\n", entry->classification, str_time, entry->record_id, entry->event_id, entry->boot_id);
-                        /* print record content */
-                        if (include_record) {
-                                print_record(entry->record_id);
+                        count += print_entry(telem_journal, (uint32_t)n, &query);
+                }
+        } else {
+                for (int i = 0; i < found; i++) {
+                        if ((int)positions[i] >= n && (int)positions[i] < entries) {
+                                count += print_entry(telem_journal, positions[i], &query);
                         }
-                        count++;
-skip_print:
-                        free_journal_entry(entry);
                 }
         }
-        free(line);
-        fclose(journal_fileptr);
+
+quit:
+        if (query.packed) {
+                record_pack_close(&query.pack);
+        }
+        if (query.records_dir >= 0) {
+                close(query.records_dir);
+        }
+        free(query.buff);
+        free(positions);
 
         return count;
 }
 
-/**
- * Validation for event id. Thic check makes sure
- * that an event_id is a 32 hexadecimal chars long.
- *
- * @param event_id A pointer to id value.
- *
- * @return 0 on success, 1 on failure
- */
-static int validate_event_id(char *event_id)
+/* Gets the current monotonic time in milliseconds */
+static int64_t journal_clock(void)
 {
-        const char alphab[] = EVENT_ID_ALPHAB;
-
-        if (event_id == NULL) {
-                return 1;
-        }
+        struct timespec now;
 
-        if (strlen(event_id) != EVENT_ID_LEN) {
-                return 1;
-        }
-
-        if (strspn(event_id, alphab) != EVENT_ID_LEN) {
-                return 1;
-        }
+        clock_gettime(CLOCK_MONOTONIC, &now);
 
-        return 0;
+        return (int64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
 }
 
 /* Exported function */
@@ -547,9 +1510,8 @@ int new_journal_entry(TelemJournal *telem_journal, char *classification,
                       time_t timestamp, char *event_id)
 {
         int rc = 1;
-        char boot_id[BOOTID_LEN] = { '\0' };
         char *record_id = NULL;
-        struct JournalEntry *entry = NULL;
+        struct JournalEntry entry = { 0 };
 
         if (telem_journal == NULL) {
                 telem_log(LOG_ERR, "telem_journal was not initialized\n");
@@ -564,115 +1526,94 @@ int new_journal_entry(TelemJournal *telem_journal, char *classification,
                 return rc;
         }
 
-        entry = malloc(sizeof(struct JournalEntry));
-        if (!entry) {
-                telem_log(LOG_CRIT, "CRIT: unable to allocate memory\n");
-                return rc;
-        }
-        entry->classification = NULL;
-        entry->record_id = NULL;
-        entry->event_id = NULL;
-        entry->boot_id = NULL;
-
         if (get_random_id(&record_id) != 0) {
                 telem_log(LOG_ERR, "Erorr: Unable to generate random id\n");
-                goto quit;
+                return rc;
         }
 
-        if (read_boot_id(boot_id) != 0) {
-                telem_log(LOG_ERR, "Error: Unable to read boot_id\n");
-                goto quit;
-        }
+        copy_field(entry.classification, sizeof(entry.classification), classification);
+        copy_field(entry.record_id, sizeof(entry.record_id), record_id);
+        copy_field(entry.event_id, sizeof(entry.event_id), event_id);
+        /* read once by open_journal() */
+        copy_field(entry.boot_id, sizeof(entry.boot_id), telem_journal->boot_id);
+        entry.timestamp = (int64_t)timestamp;
 
-        if ((entry->classification = strdup(classification)) == NULL) {
-                goto quit;
-        }
-        if ((entry->event_id = strdup(event_id)) == NULL) {
-                goto quit;
+        telem_debug("DEBUG: Saving: %s\n", entry.record_id);
+        prune_to_limit(telem_journal);
+        append_entry(telem_journal, &entry);
+        telem_debug("DEBUG: %d records in journal\n", telem_journal->record_count);
+
+        free(telem_journal->latest_record_id);
+        telem_journal->latest_record_id = record_id;
+
+        if (telem_journal->sync == JOURNAL_SYNC_ENTRY) {
+                telem_journal->pending = 1;
+                commit_journal(telem_journal, true);
+        } else if (telem_journal->sync == JOURNAL_SYNC_GROUP) {
+                if (telem_journal->pending++ == 0) {
+                        telem_journal->pending_since = journal_clock();
+                }
+                commit_journal(telem_journal, false);
         }
 
-        entry->record_id = record_id;
-        /* boot_id includes \n at the end, strip RC during duplication */
-        entry->boot_id = strndup(boot_id, BOOTID_LEN - 1);
-        entry->timestamp = timestamp;
+        return 0;
+}
 
-        if ((rc = save_entry(telem_journal->fptr, entry)) == 0) {
-                telem_journal->record_count = telem_journal->record_count + 1;
-                telem_debug("DEBUG: %d records in journal\n", telem_journal->record_count);
+/* Exported function */
+int prune_journal(struct TelemJournal *telem_journal, char *tmp_dir)
+{
+        if (telem_journal == NULL) {
+                return 1;
         }
 
-        free(telem_journal->latest_record_id);
-        telem_journal->latest_record_id = strdup(entry->record_id);
+        prune_to_limit(telem_journal);
 
-quit:
-        free_journal_entry(entry);
+        return 0;
+}
 
-        return rc;
+/* Exported function */
+void set_journal_sync(TelemJournal *telem_journal, enum journal_sync sync,
+                      int group_entries, int group_time)
+{
+        telem_journal->sync = sync;
+        telem_journal->group_entries = group_entries > 0 ? group_entries : 1;
+        telem_journal->group_time = group_time > 0 ? group_time : 0;
 }
 
 /* Exported function */
-int prune_journal(struct TelemJournal *telem_journal, char *tmp_dir)
+int commit_journal(TelemJournal *telem_journal, bool force)
 {
+        int rc = 0;
 
-        int rc = 1;
-        int count = 0;
-        int deviation = DEVIATION;
-        char *tmp_file_path = NULL;
+        if (telem_journal == NULL || telem_journal->pending == 0) {
+                return 0;
+        }
+        if (!force && telem_journal->pending < telem_journal->group_entries &&
+            journal_clock() - telem_journal->pending_since < telem_journal->group_time) {
+                return 0;
+        }
 
-        if (telem_journal == NULL) {
-                return rc;
+        // Writes back the dirty pages of the ring, like fdatasync
+        if (msync(telem_journal->header, telem_journal->map_size, MS_SYNC) != 0) {
+                rc = errno;
+                telem_perror("Error syncing journal file");
         }
+        telem_journal->pending = 0;
 
-        if (telem_journal->record_count > (deviation + telem_journal->record_count_limit)) {
-                count = telem_journal->record_count - telem_journal->record_count_limit;
+        return rc;
+}
 
-                // jump to line# count
-                if ((rc = skip_n_lines(count, telem_journal->fptr, telem_journal->prune_entry_callback)) != 0) {
-                        telem_log(LOG_ERR, "Error skipping %d journal lines\n", count);
-                        // if rc == -1 (n > #lines in file, change to errno style)
-                        return (rc == -1) ? EADDRNOTAVAIL : rc;
-                }
-                // Use default if not tmp_dir is specified
-                if (tmp_dir == NULL) {
-                        if ((asprintf(&tmp_file_path, "%s/.journal", JOURNAL_TMPDIR) == -1)) {
-                                return ENOMEM;
-                        }
-                } else {
-                        if ((asprintf(&tmp_file_path, "%s/.journal", tmp_dir) == -1)) {
-                                return ENOMEM;
-                        }
-                }
-                // create new file with rest of file
-                if ((rc = copy_to_tmp(telem_journal->fptr, tmp_file_path)) != 0) {
-                        telem_log(LOG_ERR, "Error copying partial journal to temp journal file\n");
-                        goto quit;
-                }
-                // close file handler
-                if ((rc = fclose(telem_journal->fptr)) != 0) {
-                        telem_log(LOG_ERR, "Error closing journal file handler\n");
-                        goto quit;
-                }
-                // overwrite file
-                if ((rc = rename(tmp_file_path, telem_journal->journal_file)) != 0) {
-                        telem_log(LOG_ERR, "Error while overwriting journal file\n");
-                        goto quit;
-                }
-                // reopen file handler
-                telem_journal->fptr = fopen(telem_journal->journal_file, "a+");
-                if (!telem_journal->fptr) {
-                        telem_log(LOG_ERR, "Error re-opening journal file\n");
-                        return rc;
-                }
-                // update record count
-                telem_journal->record_count = telem_journal->record_count - count;
-                telem_debug("DEBUG: record_count: %d\n", telem_journal->record_count);
-        }
-        rc = 0;
+/* Exported function */
+int journal_commit_timeout(TelemJournal *telem_journal)
+{
+        int64_t left;
 
-quit:
-        free(tmp_file_path);
+        if (telem_journal == NULL || telem_journal->pending == 0) {
+                return -1;
+        }
+        left = telem_journal->group_time - (journal_clock() - telem_journal->pending_since);
 
-        return rc;
+        return left > 0 ? (int)left : 0;
 }
 
 /* vi: set ts=8 sw=8 sts=4 et tw=80 cino=(0: */
@@ -22,26 +22,138 @@
 
 #include <time.h>
 #include <stdio.h>
+#include <stdint.h>
 #include <stdbool.h>
 
-/* Journal entry type */
+#include "common.h"
+
+#define JOURNAL_ID_LEN 32
+#define JOURNAL_BOOTID_LEN 36
+
+#define JOURNAL_MAGIC "TMJRNL\0\0"
+#define JOURNAL_VERSION 2
+
+/* Slots of a segment of the ring, and bits of its classification filter */
+#define JOURNAL_SEGMENT_ENTRIES 10
+#define JOURNAL_SEGMENT_BOOT_IDS 2
+#define JOURNAL_BLOOM_BITS 512
+
+/*
+ * The journal is a file holding a ring of RECORD_LIMIT + DEVIATION fixed
+ * width entries after a header, mapped in memory, then a footer per segment
+ * of JOURNAL_SEGMENT_ENTRIES slots. Entries are appended after the newest,
+ * and the oldest are pruned by moving the head of the ring.
+ *
+ * The footer of a segment summarizes the entries written to its slots: the
+ * range of their time stamps, their boot ids, and a bloom filter of their
+ * classifications and of the prefixes of those ending with a '/'. Queries
+ * skip the segments that cannot hold a match. The footer is reset when the
+ * first slot of the segment is written again, after dropping what is left
+ * of the segment, so that it never misses a live entry.
+ */
+
+/* Journal entry type, a slot of the ring */
 typedef struct JournalEntry {
-        time_t timestamp;
-        char *classification;
-        char *record_id;
-        char *event_id;
-        char *boot_id;
+        int64_t timestamp;
+        char classification[MAX_CLASS_LENGTH + 1];
+        char record_id[JOURNAL_ID_LEN + 1];
+        char event_id[JOURNAL_ID_LEN + 1];
+        char boot_id[JOURNAL_BOOTID_LEN + 1];
 } JournalEntry;
 
+/* Journal file header */
+typedef struct JournalHeader {
+        char magic[8];
+        uint32_t version;
+        uint32_t entry_size;
+        /* number of slots, the oldest entry, and the number of entries */
+        uint32_t capacity;
+        uint32_t head;
+        uint32_t count;
+        /* entries appended since the journal was created, wrapping */
+        uint32_t appended;
+} JournalHeader;
+
+/* Footer of a segment of the ring */
+typedef struct JournalSegment {
+        /* entries written to the segment since its first slot */
+        uint32_t entries;
+        /* distinct boot ids, more than JOURNAL_SEGMENT_BOOT_IDS match any */
+        uint32_t boot_ids;
+        int64_t min_timestamp;
+        int64_t max_timestamp;
+        uint32_t boot_id_hashes[JOURNAL_SEGMENT_BOOT_IDS];
+        uint8_t classes[JOURNAL_BLOOM_BITS / 8];
+} JournalSegment;
+
+#define JOURNAL_INDEX_MAGIC "TMJIDX\0\0"
+#define JOURNAL_INDEX_VERSION 1
+
+/* Ids indexed by hash */
+enum journal_index_id {
+        JOURNAL_INDEX_RECORD_ID = 0,
+        JOURNAL_INDEX_EVENT_ID,
+        JOURNAL_INDEX_BOOT_ID,
+        JOURNAL_INDEX_IDS
+};
+
+/*
+ * The index file, next to the journal file and mapped in memory too,
+ * holds after its header:
+ *
+ * - for each indexed id, the first slot of each hash bucket, then the next
+ *   and previous slots of each slot in its bucket;
+ * - the slots of the entries, sorted by classification.
+ *
+ * Slots are stored plus one, zero means none. The index describes the ring
+ * as it was when head, count and appended were those of the journal; it is
+ * rebuilt by the next change to a journal it does not describe, and not used
+ * meanwhile.
+ */
+typedef struct JournalIndexHeader {
+        char magic[8];
+        uint32_t version;
+        uint32_t capacity;
+        uint32_t buckets;
+        uint32_t head;
+        uint32_t count;
+        uint32_t appended;
+} JournalIndexHeader;
+
+/* When entries written to the journal are synced to disk */
+enum journal_sync {
+        /* left to the kernel writeback */
+        JOURNAL_SYNC_NONE = 0,
+        /* once group_entries are pending, or the oldest waited group_time */
+        JOURNAL_SYNC_GROUP,
+        JOURNAL_SYNC_ENTRY
+};
+
 /* Telemetry journal type */
 typedef struct TelemJournal {
-        FILE *fptr;
+        int fd;
+        JournalHeader *header;
+        JournalEntry *entries;
+        JournalSegment *segments;
+        size_t map_size;
+        /* index of the ring, NULL if it could not be opened */
+        int index_fd;
+        JournalIndexHeader *index;
+        size_t index_size;
         char *journal_file;
         char *boot_id;
         char *latest_record_id;
         int record_count;
         int record_count_limit;
         int (*prune_entry_callback)(char *);
+        /* called instead of prune_entry_callback with several record ids */
+        int (*prune_batch_callback)(char **, int);
+        enum journal_sync sync;
+        int group_entries;
+        int group_time;
+        /* entries not synced yet, and monotonic time in ms of the oldest */
+        int pending;
+        int64_t pending_since;
 } TelemJournal;
 
 /**
@@ -53,7 +165,8 @@ typedef struct TelemJournal {
  *        will be used.
  *
  * @returns a telemetry journal structure in success or
- *          NULL in case of failure.
+ *          NULL in case of failure. A journal in the former text
+ *          format, or of an older version, is converted.
  */
 TelemJournal *open_journal(const char *journal_file);
 
@@ -69,7 +182,8 @@ void close_journal(TelemJournal *telem_journal);
 
 /**
  * Prints journal contents to stdout. Use function parameters
- * to filter journal entries to print.
+ * to filter journal entries to print. Entries are looked up in
+ * the index when a filter is provided.
  *
  * @param telem_journal A pointer to struct initialized
  *        by open_journal call.
@@ -88,7 +202,33 @@ int print_journal(TelemJournal *telem_journal, char *classification,
                   bool include_record);
 
 /**
- * Creates a new entry in journal.
+ * Prints the journal entries of a time range to stdout, found by binary
+ * search over the timestamps of the entries. Use function parameters to
+ * filter journal entries to print. Without a usable index, the segments
+ * of which the footer rules out the filters are skipped.
+ *
+ * @param telem_journal A pointer to struct initialized
+ *        by open_journal call.
+ * @param classification A pointer to string used as
+ *        classification filter.
+ * @param record_id A pointer to string used as record_id filter.
+ * @param event_id A pointer to string used as event_id filter.
+ * @param boot_id A pointer to string used as boor_id filter.
+ * @param since Oldest time stamp to print, 0 for no limit.
+ * @param until Newest time stamp to print, 0 for no limit.
+ * @param include_record A flag to control record content print.
+ *
+ * @return the number of entries printed to stdout on success, -1
+ *         on failure.
+ */
+int print_journal_range(TelemJournal *telem_journal, char *classification,
+                        char *record_id, char *event_id, char *boot_id,
+                        time_t since, time_t until, bool include_record);
+
+/**
+ * Creates a new entry in journal. When the journal reached
+ * record_count_limit + DEVIATION entries, or the ring is full, it is
+ * first pruned down to record_count_limit.
  *
  * @param telem_journal A pointer to telemetry journal.
  * @param classification A pointer to a classification value.
@@ -102,16 +242,52 @@ int new_journal_entry(TelemJournal *telem_journal, char *classification,
                       time_t timestamp, char *event_id);
 
 /**
- * Checks number of lines in log and prunes the oldest records
- * if journal grows more than telem_journal->record_count_limit.
+ * Checks number of entries in journal and prunes the oldest records
+ * down to telem_journal->record_count_limit if journal reached
+ * record_count_limit + DEVIATION entries, or the ring is full. Journals
+ * are pruned as entries are added, this is only needed after lowering
+ * record_count_limit.
  *
  * @param telem_journal A pointer to telemetry journal struct
  *        returned by open_journal call.
- * @param tmp_dir A pointer to a string with the path to use for
- *                temp file during pruning process.
+ * @param tmp_dir Unused, the journal is pruned in place.
  *
  * @return 0 on success, errno on failure
  */
 int prune_journal(TelemJournal *telem_journal, char *tmp_dir);
 
+/**
+ * Sets when entries written to the journal are synced to disk. The
+ * default is JOURNAL_SYNC_NONE.
+ *
+ * @param telem_journal A pointer to telemetry journal.
+ * @param sync The policy.
+ * @param group_entries Entries synced together with JOURNAL_SYNC_GROUP.
+ * @param group_time Milliseconds an entry waits at most for its group to
+ *        be synced with JOURNAL_SYNC_GROUP.
+ */
+void set_journal_sync(TelemJournal *telem_journal, enum journal_sync sync,
+                      int group_entries, int group_time);
+
+/**
+ * Syncs the pending group of entries, if it is complete or waited long
+ * enough.
+ *
+ * @param telem_journal A pointer to telemetry journal.
+ * @param force true to sync any pending entry now.
+ *
+ * @return 0 on success, errno on failure
+ */
+int commit_journal(TelemJournal *telem_journal, bool force);
+
+/**
+ * Gets when the pending group of entries is due to be synced.
+ *
+ * @param telem_journal A pointer to telemetry journal.
+ *
+ * @return the milliseconds until commit_journal() syncs it, -1 if no
+ *         entry is pending.
+ */
+int journal_commit_timeout(TelemJournal *telem_journal);
+
 /* vi: set ts=8 sw=8 sts=4 et tw=80 cino=(0: */
@@ -3,13 +3,18 @@ bin_PROGRAMS += \
 
 %C%_telem_journal_SOURCES = %D%/cli.c \
 	%D%/journal.c \
+	src/recordpack.c \
 	src/util.c \
+	src/validate.c \
 	src/common.c
 %C%_telem_journal_CFLAGS = \
-	$(AM_CFLAGS)
+	$(AM_CFLAGS) \
+	$(ZLIB_CFLAGS)
+%C%_telem_journal_LDADD = \
+	$(ZLIB_LIBS)
 
 if LOG_SYSTEMD
 %C%_telem_journal_CFLAGS += $(SYSTEMD_JOURNAL_CFLAGS)
-%C%_telem_journal_LDADD = $(SYSTEMD_JOURNAL_LIBS)
+%C%_telem_journal_LDADD += $(SYSTEMD_JOURNAL_LIBS)
 endif
 # vim: filetype=automake tabstop=8 shiftwidth=8 noexpandtab
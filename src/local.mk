@@ -4,28 +4,62 @@ bin_PROGRAMS = \
 	%D%/telemctl
 
 %C%_telemctl_SOURCES = \
-	%D%/telemctl.c
+	%D%/telemctl.c \
+	%D%/archive.c \
+	%D%/archive.h \
+	%D%/compress.c \
+	%D%/compress.h \
+	%D%/iorecord.c \
+	%D%/iorecord.h \
+	%D%/staginglog.c \
+	%D%/staginglog.h
+
+%C%_telemctl_LDADD = \
+	$(ZLIB_LIBS) \
+	%D%/libtelem-shared.la \
+	@PTHREAD_LIBS@
 
 %C%_telemctl_CFLAGS = \
-	$(AM_CFLAGS)
+	$(AM_CFLAGS) \
+	$(ZLIB_CFLAGS)
 
 %C%_telemctl_LDFLAGS = \
 	$(AM_LDFLAGS) \
 	-pie
 
+if LOG_SYSTEMD
+if HAVE_SYSTEMD_JOURNAL
+%C%_telemctl_CFLAGS += \
+	$(SYSTEMD_JOURNAL_CFLAGS)
+%C%_telemctl_LDADD += \
+	$(SYSTEMD_JOURNAL_LIBS)
+endif
+endif
+
 %C%_telemprobd_SOURCES = \
 	%D%/probe.c \
 	%D%/telemdaemon.c \
 	%D%/telemdaemon.h \
+	%D%/staginglog.c \
+	%D%/staginglog.h \
+	%D%/ringbuf.c \
+	%D%/ringbuf.h \
 	%D%/journal/journal.c \
-	%D%/journal/journal.h
+	%D%/journal/journal.h \
+	%D%/recordpack.c \
+	%D%/recordpack.h \
+	%D%/heartbeat.c \
+	%D%/heartbeat.h
 
 %C%_telemprobd_LDADD = $(CURL_LIBS) \
+	$(ZLIB_LIBS) \
 	%D%/libtelem-shared.la \
-	%D%/libtelemetry.la
+	%D%/libtelemetry.la \
+	@PTHREAD_LIBS@
 
 %C%_telemprobd_CFLAGS = \
-	$(AM_CFLAGS)
+	$(AM_CFLAGS) \
+	$(ZLIB_CFLAGS)
 
 %C%_telemprobd_LDFLAGS = \
 	$(AM_LDFLAGS) \
@@ -58,15 +92,46 @@ endif
 	%D%/spool.c \
 	%D%/retention.h \
 	%D%/retention.c \
+	%D%/recordpack.h \
+	%D%/recordpack.c \
 	%D%/iorecord.c \
-	%D%/iorecord.h
+	%D%/iorecord.h \
+	%D%/staginglog.c \
+	%D%/staginglog.h \
+	%D%/ringbuf.c \
+	%D%/ringbuf.h \
+	%D%/postmulti.c \
+	%D%/postmulti.h \
+	%D%/postbatch.c \
+	%D%/postbatch.h \
+	%D%/compress.c \
+	%D%/compress.h \
+	%D%/retrysched.c \
+	%D%/retrysched.h \
+	%D%/classlimit.c \
+	%D%/classlimit.h \
+	%D%/poststate.c \
+	%D%/poststate.h \
+	%D%/spoolusage.c \
+	%D%/spoolusage.h \
+	%D%/destination.c \
+	%D%/destination.h \
+	%D%/aggregate.c \
+	%D%/aggregate.h \
+	%D%/recordio.c \
+	%D%/recordio.h \
+	%D%/stagepool.c \
+	%D%/stagepool.h
 
 %C%_telempostd_LDADD = $(CURL_LIBS) \
+	$(ZLIB_LIBS) \
 	%D%/libtelem-shared.la \
-	%D%/libtelemetry.la
+	%D%/libtelemetry.la \
+	@PTHREAD_LIBS@
 
 %C%_telempostd_CFLAGS = \
-	$(AM_CFLAGS)
+	$(AM_CFLAGS) \
+	$(ZLIB_CFLAGS)
 
 %C%_telempostd_LDFLAGS = \
 	$(AM_LDFLAGS) \
@@ -79,6 +144,13 @@ if HAVE_SYSTEMD_DAEMON
 	$(SYSTEMD_DAEMON_LIBS)
 endif
 
+if HAVE_IO_URING
+%C%_telempostd_CFLAGS += \
+	$(URING_CFLAGS)
+%C%_telempostd_LDADD += \
+	$(URING_LIBS)
+endif
+
 if LOG_SYSTEMD
 if HAVE_SYSTEMD_JOURNAL
 %C%_telempostd_CFLAGS += \
@@ -89,9 +161,9 @@ endif
 endif
 
 # set library version info
-SHAREDLIB_CURRENT=4
+SHAREDLIB_CURRENT=8
 SHAREDLIB_REVISION=0
-SHAREDLIB_AGE=1
+SHAREDLIB_AGE=5
 
 noinst_LTLIBRARIES = %D%/libtelem-shared.la
 
@@ -100,11 +172,28 @@ noinst_LTLIBRARIES = %D%/libtelem-shared.la
 	%D%/util.h \
 	%D%/configuration.c \
 	%D%/nica/inifile.c \
-	%D%/nica/hashmap.c \
 	%D%/nica/b64enc.c \
 	%D%/configuration.h \
+	%D%/configwatch.c \
+	%D%/configwatch.h \
+	%D%/validate.c \
+	%D%/validate.h \
 	%D%/common.c \
-	%D%/common.h
+	%D%/common.h \
+	%D%/metrics.c \
+	%D%/metrics.h \
+	%D%/recordtrace.c \
+	%D%/recordtrace.h \
+	%D%/membudget.c \
+	%D%/membudget.h \
+	%D%/sampling.c \
+	%D%/sampling.h
+
+if HASHMAP_OPEN
+%C%_libtelem_shared_la_SOURCES += %D%/nica/hashmap-open.c
+else
+%C%_libtelem_shared_la_SOURCES += %D%/nica/hashmap.c
+endif
 
 %C%_libtelem_shared_la_CFLAGS = \
 	$(AM_CFLAGS)
@@ -112,6 +201,9 @@ noinst_LTLIBRARIES = %D%/libtelem-shared.la
 %C%_libtelem_shared_la_LDFLAGS = \
 	$(AM_LDFLAGS)
 
+%C%_libtelem_shared_la_LIBADD = \
+	@PTHREAD_LIBS@
+
 lib_LTLIBRARIES = \
 	%D%/libtelemetry.la
 
@@ -135,6 +227,7 @@ EXTRA_DIST += \
 
 %C%_libtelemetry_la_LIBADD = \
 	%D%/libtelem-shared.la \
+	@PTHREAD_LIBS@ \
 	-ldl
 
 # vim: filetype=automake tabstop=8 shiftwidth=8 noexpandtab
@@ -0,0 +1,139 @@
+/*
+ * This program is part of the Clear Linux Project
+ *
+ * Copyright 2019 Intel Corporation
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms and conditions of the GNU Lesser General Public License, as
+ * published by the Free Software Foundation; either version 2.1 of the License,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU Lesser General Public License for more
+ * details.
+ */
+
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <malloc.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "config.h"
+#include "membudget.h"
+
+static size_t budget_limit = 0;
+static enum metric_gauge rss_gauge = METRIC_GAUGE_MAX;
+static enum metric_gauge heap_gauge = METRIC_GAUGE_MAX;
+static enum metric_counter trim_counter = METRIC_COUNTER_MAX;
+
+/* metrics_clock() of the next sample, and whether memory was used since
+ * the last trim */
+static uint64_t next_sample = 0;
+static bool busy = false;
+
+void mem_budget_init(size_t limit, enum metric_gauge rss, enum metric_gauge heap,
+                     enum metric_counter trims)
+{
+        __atomic_store_n(&budget_limit, limit, __ATOMIC_RELAXED);
+        rss_gauge = rss;
+        heap_gauge = heap;
+        trim_counter = trims;
+        __atomic_store_n(&next_sample, 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&busy, false, __ATOMIC_RELAXED);
+}
+
+void mem_budget_set_limit(size_t limit)
+{
+        __atomic_store_n(&budget_limit, limit, __ATOMIC_RELAXED);
+}
+
+size_t mem_budget_rss(void)
+{
+        char buf[64];
+        unsigned long size, resident;
+        ssize_t len;
+        int fd;
+
+        /* The sizes in pages of the process, then of its resident set */
+        fd = open("/proc/self/statm", O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+                return 0;
+        }
+        len = read(fd, buf, sizeof(buf) - 1);
+        close(fd);
+        if (len <= 0) {
+                return 0;
+        }
+        buf[len] = '\0';
+        if (sscanf(buf, "%lu %lu", &size, &resident) != 2) {
+                return 0;
+        }
+
+        return (size_t)resident * (size_t)sysconf(_SC_PAGESIZE);
+}
+
+/* Gets the heap memory allocated, 0 if unknown */
+static size_t heap_in_use(void)
+{
+#ifdef HAVE_MALLINFO2
+        struct mallinfo2 info = mallinfo2();
+
+        return info.uordblks + info.hblkhd;
+#else
+        return 0;
+#endif
+}
+
+static void sample(size_t rss)
+{
+        if (rss_gauge < METRIC_GAUGE_MAX) {
+                metrics_set(rss_gauge, (int64_t)rss);
+        }
+        if (heap_gauge < METRIC_GAUGE_MAX) {
+                metrics_set(heap_gauge, (int64_t)heap_in_use());
+        }
+}
+
+bool mem_budget_check(bool idle)
+{
+        uint64_t now = metrics_clock();
+        uint64_t due = __atomic_load_n(&next_sample, __ATOMIC_RELAXED);
+        size_t limit = __atomic_load_n(&budget_limit, __ATOMIC_RELAXED);
+        bool trim = false;
+        size_t rss = 0;
+
+        if (!idle) {
+                __atomic_store_n(&busy, true, __ATOMIC_RELAXED);
+        } else if (__atomic_exchange_n(&busy, false, __ATOMIC_RELAXED)) {
+                /* Nothing happened for a while, give memory back */
+                trim = true;
+        }
+
+        /* One thread samples at a time */
+        if (now >= due &&
+            __atomic_compare_exchange_n(&next_sample, &due,
+                                        now + MEM_BUDGET_INTERVAL * 1000000ULL, false,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                rss = mem_budget_rss();
+                trim = trim || (limit > 0 && rss > limit);
+        }
+
+        if (trim) {
+                malloc_trim(0);
+                if (trim_counter < METRIC_COUNTER_MAX) {
+                        metrics_count(trim_counter, 1);
+                }
+                rss = mem_budget_rss();
+        }
+        if (rss > 0) {
+                sample(rss);
+        }
+
+        return trim;
+}
+
+/* vi: set ts=8 sw=8 sts=4 et tw=80 cino=(0: */
@@ -0,0 +1,71 @@
+/*
+ * This program is part of the Clear Linux Project
+ *
+ * Copyright 2019 Intel Corporation
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms and conditions of the GNU Lesser General Public License, as
+ * published by the Free Software Foundation; either version 2.1 of the License,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU Lesser General Public License for more
+ * details.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "metrics.h"
+
+/*
+ * Memory budget of a daemon. Free heap memory is given back to the system
+ * with malloc_trim() once the daemon is idle after some activity, or as
+ * soon as its resident set grows above the budget, rather than on every
+ * wakeup: trimming walks the whole heap. The resident set and the heap in
+ * use are sampled at most every MEM_BUDGET_INTERVAL milliseconds, into
+ * gauges of the metrics page. Safe to use from several threads.
+ */
+#define MEM_BUDGET_INTERVAL 1000
+
+/**
+ * Sets the budget and the metrics of the daemon
+ *
+ * @param limit Resident set size in bytes above which memory is trimmed at
+ *     once, 0 to only trim when idle
+ * @param rss Gauge of the resident set size
+ * @param heap Gauge of the heap in use
+ * @param trims Counter of the trims
+ */
+void mem_budget_init(size_t limit, enum metric_gauge rss, enum metric_gauge heap,
+                     enum metric_counter trims);
+
+/**
+ * Changes the budget, after a configuration reload
+ *
+ * @param limit Resident set size in bytes, 0 to only trim when idle
+ */
+void mem_budget_set_limit(size_t limit);
+
+/**
+ * Gets the resident set size of the process
+ *
+ * @return the size in bytes, or 0 if it cannot be read
+ */
+size_t mem_budget_rss(void);
+
+/**
+ * Samples the memory use of the daemon if due, and trims the heap if the
+ * daemon is idle after some activity or above its budget. To be called
+ * once per loop iteration.
+ *
+ * @param idle true if the daemon is idle, the wait for events timed out
+ *
+ * @return true if the heap was trimmed
+ */
+bool mem_budget_check(bool idle);
+
+/* vi: set ts=8 sw=8 sts=4 et tw=80 cino=(0: */
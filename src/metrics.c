@@ -0,0 +1,508 @@
+/*
+ * This program is part of the Clear Linux Project
+ *
+ * Copyright 2019 Intel Corporation
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms and conditions of the GNU Lesser General Public License, as
+ * published by the Free Software Foundation; either version 2.1 of the License,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU Lesser General Public License for more
+ * details.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "metrics.h"
+
+struct metric_info {
+        /* daemon updating the metric */
+        const char *daemon;
+        const char *name;
+        /* labels of the Prometheus sample, or NULL */
+        const char *labels;
+        const char *help;
+};
+
+static const struct metric_info counter_info[METRIC_COUNTER_MAX] = {
+        [METRIC_PROBD_RECORDS_RECEIVED] = { "telemprobd", "records_received_total", NULL,
+                                            "Records received from probes and staged" },
+        [METRIC_PROBD_RECORDS_STREAMED] = { "telemprobd", "records_streamed_total", NULL,
+                                            "Records too large for a receive buffer, streamed to the spool" },
+        [METRIC_PROBD_RECORDS_REJECTED] = { "telemprobd", "records_rejected_total", NULL,
+                                            "Records dropped for an invalid size or header" },
+        [METRIC_PROBD_BYTES_RECEIVED] = { "telemprobd", "bytes_received_total", NULL,
+                                          "Bytes received from probes" },
+        [METRIC_PROBD_MEMORY_TRIMS] = { "telemprobd", "memory_trims_total", NULL,
+                                        "Free heap memory given back to the system" },
+        [METRIC_POSTD_POSTS_SENT] = { "telempostd", "posts_total", "result=\"sent\"",
+                                      "POST requests to the server" },
+        [METRIC_POSTD_POSTS_FAILED] = { "telempostd", "posts_total", "result=\"failed\"",
+                                        "POST requests to the server" },
+        [METRIC_POSTD_HTTP_2XX] = { "telempostd", "http_responses_total", "code=\"2xx\"",
+                                    "Responses of the server, by status class" },
+        [METRIC_POSTD_HTTP_3XX] = { "telempostd", "http_responses_total", "code=\"3xx\"",
+                                    "Responses of the server, by status class" },
+        [METRIC_POSTD_HTTP_4XX] = { "telempostd", "http_responses_total", "code=\"4xx\"",
+                                    "Responses of the server, by status class" },
+        [METRIC_POSTD_HTTP_5XX] = { "telempostd", "http_responses_total", "code=\"5xx\"",
+                                    "Responses of the server, by status class" },
+        [METRIC_POSTD_HTTP_ERRORS] = { "telempostd", "http_errors_total", NULL,
+                                       "POST requests that got no response" },
+        [METRIC_POSTD_RATE_LIMIT_DROPPED] = { "telempostd", "rate_limited_total", "action=\"drop\"",
+                                              "Records held back by the rate limits" },
+        [METRIC_POSTD_RATE_LIMIT_SPOOLED] = { "telempostd", "rate_limited_total", "action=\"spool\"",
+                                              "Records held back by the rate limits" },
+        [METRIC_POSTD_JOURNAL_PRUNED] = { "telempostd", "journal_pruned_total", NULL,
+                                          "Journal entries pruned to make room" },
+        [METRIC_POSTD_TRACE_RETRIES] = { "telempostd", "record_retries_total", NULL,
+                                         "Spool retries of the traced records delivered" },
+        [METRIC_POSTD_MEMORY_TRIMS] = { "telempostd", "memory_trims_total", NULL,
+                                        "Free heap memory given back to the system" },
+        [METRIC_POSTD_STAGING_CORRUPT] = { "telempostd", "staging_corrupt_total", NULL,
+                                           "Corrupted or torn records skipped in the staging log" },
+        [METRIC_POSTD_STAGING_FAILED] = { "telempostd", "staging_failed_total", NULL,
+                                          "Unreadable staging log segments set aside" },
+};
+
+static const struct metric_info gauge_info[METRIC_GAUGE_MAX] = {
+        [METRIC_PROBD_RSS_BYTES] = { "telemprobd", "resident_bytes", NULL,
+                                     "Resident set size of the daemon" },
+        [METRIC_PROBD_HEAP_BYTES] = { "telemprobd", "heap_bytes", NULL,
+                                      "Heap memory allocated by the daemon" },
+        [METRIC_POSTD_SPOOL_RECORDS] = { "telempostd", "spool_records", NULL,
+                                         "Records waiting in the spool" },
+        [METRIC_POSTD_SPOOL_BYTES] = { "telempostd", "spool_bytes", NULL,
+                                       "Size of the spool directory" },
+        [METRIC_POSTD_RSS_BYTES] = { "telempostd", "resident_bytes", NULL,
+                                     "Resident set size of the daemon" },
+        [METRIC_POSTD_HEAP_BYTES] = { "telempostd", "heap_bytes", NULL,
+                                      "Heap memory allocated by the daemon" },
+};
+
+static const struct metric_info histogram_info[METRIC_HISTOGRAM_MAX] = {
+        [METRIC_PROBD_STAGE_TIME] = { "telemprobd", "stage_seconds", NULL,
+                                      "Time to stage a record" },
+        [METRIC_POSTD_POST_TIME] = { "telempostd", "post_seconds", NULL,
+                                     "Time of POST requests to the server" },
+        [METRIC_POSTD_JOURNAL_PRUNE_TIME] = { "telempostd", "journal_prune_seconds", NULL,
+                                              "Time of journal entries that pruned the journal" },
+        [METRIC_POSTD_TRACE_PROBE_TIME] = { "telempostd", "record_stage_seconds",
+                                            "stage=\"probe\"",
+                                            "Time traced records spent in each stage" },
+        [METRIC_POSTD_TRACE_PROBD_TIME] = { "telempostd", "record_stage_seconds",
+                                            "stage=\"telemprobd\"",
+                                            "Time traced records spent in each stage" },
+        [METRIC_POSTD_TRACE_STAGING_TIME] = { "telempostd", "record_stage_seconds",
+                                              "stage=\"staging\"",
+                                              "Time traced records spent in each stage" },
+        [METRIC_POSTD_TRACE_POSTD_TIME] = { "telempostd", "record_stage_seconds",
+                                            "stage=\"telempostd\"",
+                                            "Time traced records spent in each stage" },
+        [METRIC_POSTD_TRACE_SPOOL_TIME] = { "telempostd", "record_stage_seconds",
+                                            "stage=\"spool\"",
+                                            "Time traced records spent in each stage" },
+        [METRIC_POSTD_TRACE_TOTAL_TIME] = { "telempostd", "record_delivery_seconds", NULL,
+                                            "Time from sending traced records to delivering them" },
+};
+
+static struct metrics_page local_page;
+static struct metrics_page *page = &local_page;
+static char *page_path = NULL;
+
+static __thread int thread_shard = -1;
+static int next_shard = 0;
+
+static struct metrics_shard *current_shard(void)
+{
+        struct metrics_page *p = __atomic_load_n(&page, __ATOMIC_ACQUIRE);
+
+        if (thread_shard < 0) {
+                thread_shard = __atomic_fetch_add(&next_shard, 1, __ATOMIC_RELAXED) %
+                               METRICS_SHARDS;
+        }
+
+        return &p->shards[thread_shard];
+}
+
+int metrics_open(const char *path, const char *name)
+{
+        struct metrics_page *map, *previous;
+        char *tmppath = NULL;
+        char *saved_path;
+        int ret = 0;
+        int fd;
+
+        saved_path = strdup(path);
+        if (!saved_path || asprintf(&tmppath, "%s.XXXXXX", path) < 0) {
+                free(saved_path);
+                return -ENOMEM;
+        }
+
+        /* Created aside and renamed, so that readers never see half a page */
+        fd = mkostemp(tmppath, O_CLOEXEC);
+        if (fd < 0) {
+                ret = -errno;
+                goto out;
+        }
+        if (fchmod(fd, 0644) != 0 ||
+            ftruncate(fd, (off_t)sizeof(struct metrics_page)) != 0) {
+                ret = -errno;
+                goto fail;
+        }
+        map = mmap(NULL, sizeof(struct metrics_page), PROT_READ | PROT_WRITE,
+                   MAP_SHARED, fd, 0);
+        if (map == MAP_FAILED) {
+                ret = -errno;
+                goto fail;
+        }
+
+        memcpy(map->magic, METRICS_MAGIC, sizeof(map->magic));
+        map->size = (uint32_t)sizeof(struct metrics_page);
+        map->pid = (int32_t)getpid();
+        map->start_time = (int64_t)time(NULL);
+        strncpy(map->name, name, sizeof(map->name) - 1);
+
+        if (rename(tmppath, path) != 0) {
+                ret = -errno;
+                munmap(map, sizeof(struct metrics_page));
+                goto fail;
+        }
+
+        /* A page opened before is replaced, its file removed unless the new
+         * page took its place */
+        previous = page;
+        __atomic_store_n(&page, map, __ATOMIC_RELEASE);
+        if (previous != &local_page) {
+                if (strcmp(page_path, path) != 0) {
+                        unlink(page_path);
+                }
+                munmap(previous, sizeof(struct metrics_page));
+        }
+        free(page_path);
+        page_path = saved_path;
+        saved_path = NULL;
+        close(fd);
+        goto out;
+
+fail:
+        close(fd);
+        unlink(tmppath);
+out:
+        free(saved_path);
+        free(tmppath);
+
+        return ret;
+}
+
+void metrics_close(void)
+{
+        struct metrics_page *map = page;
+
+        if (map == &local_page) {
+                return;
+        }
+        __atomic_store_n(&page, &local_page, __ATOMIC_RELEASE);
+        unlink(page_path);
+        free(page_path);
+        page_path = NULL;
+        munmap(map, sizeof(struct metrics_page));
+}
+
+const struct metrics_page *metrics_page(void)
+{
+        return __atomic_load_n(&page, __ATOMIC_ACQUIRE);
+}
+
+void metrics_count(enum metric_counter counter, uint64_t n)
+{
+        __atomic_fetch_add(&current_shard()->counters[counter], n, __ATOMIC_RELAXED);
+}
+
+void metrics_set(enum metric_gauge gauge, int64_t value)
+{
+        struct metrics_page *p = __atomic_load_n(&page, __ATOMIC_ACQUIRE);
+
+        __atomic_store_n(&p->gauges[gauge], value, __ATOMIC_RELAXED);
+}
+
+void metrics_observe(enum metric_histogram histogram, uint64_t ns)
+{
+        struct metrics_shard *shard = current_shard();
+        uint64_t us = ns / 1000;
+        uint64_t v = us;
+        int bucket = 0;
+
+        while (v > 0 && bucket < METRICS_BUCKETS - 1) {
+                v >>= 1;
+                bucket++;
+        }
+
+        __atomic_fetch_add(&shard->buckets[histogram][bucket], 1, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&shard->sum_us[histogram], us, __ATOMIC_RELAXED);
+}
+
+uint64_t metrics_clock(void)
+{
+        struct timespec ts;
+
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+
+        return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+int metrics_map(const char *path, const struct metrics_page **page_out)
+{
+        const struct metrics_page *map;
+        struct stat sbuf;
+        int fd;
+
+        fd = open(path, O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+                return -errno;
+        }
+        if (fstat(fd, &sbuf) != 0) {
+                close(fd);
+                return -errno;
+        }
+        if (!S_ISREG(sbuf.st_mode) ||
+            sbuf.st_size != (off_t)sizeof(struct metrics_page)) {
+                close(fd);
+                return -EINVAL;
+        }
+        map = mmap(NULL, sizeof(struct metrics_page), PROT_READ, MAP_SHARED, fd, 0);
+        close(fd);
+        if (map == MAP_FAILED) {
+                return -errno;
+        }
+        if (memcmp(map->magic, METRICS_MAGIC, sizeof(map->magic)) != 0 ||
+            map->size != sizeof(struct metrics_page)) {
+                metrics_unmap(map);
+                return -EINVAL;
+        }
+
+        *page_out = map;
+
+        return 0;
+}
+
+void metrics_unmap(const struct metrics_page *map)
+{
+        munmap((void *)map, sizeof(struct metrics_page));
+}
+
+uint64_t metrics_counter_value(const struct metrics_page *p,
+                               enum metric_counter counter)
+{
+        uint64_t value = 0;
+
+        for (int i = 0; i < METRICS_SHARDS; i++) {
+                value += __atomic_load_n(&p->shards[i].counters[counter],
+                                         __ATOMIC_RELAXED);
+        }
+
+        return value;
+}
+
+uint64_t metrics_histogram_value(const struct metrics_page *p,
+                                 enum metric_histogram histogram,
+                                 uint64_t buckets[METRICS_BUCKETS],
+                                 uint64_t *sum_us)
+{
+        uint64_t count = 0;
+
+        memset(buckets, 0, METRICS_BUCKETS * sizeof(uint64_t));
+        *sum_us = 0;
+        for (int i = 0; i < METRICS_SHARDS; i++) {
+                const struct metrics_shard *shard = &p->shards[i];
+
+                for (int b = 0; b < METRICS_BUCKETS; b++) {
+                        buckets[b] += __atomic_load_n(&shard->buckets[histogram][b],
+                                                      __ATOMIC_RELAXED);
+                }
+                *sum_us += __atomic_load_n(&shard->sum_us[histogram], __ATOMIC_RELAXED);
+        }
+        for (int b = 0; b < METRICS_BUCKETS; b++) {
+                count += buckets[b];
+        }
+
+        return count;
+}
+
+/* A page without a name, private to a process, shows every metric */
+static bool shown(const struct metrics_page *p, const struct metric_info *info)
+{
+        return p->name[0] == '\0' ||
+               strncmp(p->name, info->daemon, sizeof(p->name)) == 0;
+}
+
+/* Upper bound of the bucket holding the given fraction of the latencies, in us */
+static uint64_t percentile(const uint64_t buckets[METRICS_BUCKETS], uint64_t count,
+                           double fraction)
+{
+        uint64_t rank = (uint64_t)((double)count * fraction);
+        uint64_t seen = 0;
+
+        for (int i = 0; i < METRICS_BUCKETS; i++) {
+                seen += buckets[i];
+                if (seen > rank) {
+                        return (uint64_t)1 << i;
+                }
+        }
+
+        return (uint64_t)1 << (METRICS_BUCKETS - 1);
+}
+
+static void print_prometheus_header(FILE *out, const struct metric_info *info,
+                                    const struct metric_info *previous,
+                                    const char *type)
+{
+        /* Samples of the same metric with other labels follow each other */
+        if (previous && strcmp(previous->name, info->name) == 0) {
+                return;
+        }
+        fprintf(out, "# HELP telemetrics_%s %s\n", info->name, info->help);
+        fprintf(out, "# TYPE telemetrics_%s %s\n", info->name, type);
+}
+
+static void print_prometheus(FILE *out, const struct metrics_page *p)
+{
+        const struct metric_info *previous = NULL;
+        uint64_t buckets[METRICS_BUCKETS];
+        uint64_t count, sum_us, cumulative;
+
+        for (int i = 0; i < METRIC_COUNTER_MAX; i++) {
+                const struct metric_info *info = &counter_info[i];
+
+                if (!shown(p, info)) {
+                        continue;
+                }
+                print_prometheus_header(out, info, previous, "counter");
+                fprintf(out, "telemetrics_%s{daemon=\"%s\"%s%s} %" PRIu64 "\n",
+                        info->name, info->daemon, info->labels ? "," : "",
+                        info->labels ? info->labels : "",
+                        metrics_counter_value(p, (enum metric_counter)i));
+                previous = info;
+        }
+
+        for (int i = 0; i < METRIC_GAUGE_MAX; i++) {
+                const struct metric_info *info = &gauge_info[i];
+
+                if (!shown(p, info)) {
+                        continue;
+                }
+                print_prometheus_header(out, info, NULL, "gauge");
+                fprintf(out, "telemetrics_%s{daemon=\"%s\"} %" PRId64 "\n",
+                        info->name, info->daemon,
+                        __atomic_load_n(&p->gauges[i], __ATOMIC_RELAXED));
+        }
+
+        previous = NULL;
+        for (int i = 0; i < METRIC_HISTOGRAM_MAX; i++) {
+                const struct metric_info *info = &histogram_info[i];
+                const char *sep = info->labels ? "," : "";
+                const char *labels = info->labels ? info->labels : "";
+
+                if (!shown(p, info)) {
+                        continue;
+                }
+                count = metrics_histogram_value(p, (enum metric_histogram)i,
+                                                buckets, &sum_us);
+                print_prometheus_header(out, info, previous, "histogram");
+                cumulative = 0;
+                for (int b = 0; b < METRICS_BUCKETS - 1; b++) {
+                        cumulative += buckets[b];
+                        fprintf(out, "telemetrics_%s_bucket{daemon=\"%s\"%s%s,le=\"%g\"} %"
+                                PRIu64 "\n", info->name, info->daemon, sep, labels,
+                                (double)((uint64_t)1 << b) / 1e6, cumulative);
+                }
+                fprintf(out, "telemetrics_%s_bucket{daemon=\"%s\"%s%s,le=\"+Inf\"} %"
+                        PRIu64 "\n", info->name, info->daemon, sep, labels, count);
+                fprintf(out, "telemetrics_%s_sum{daemon=\"%s\"%s%s} %.6f\n",
+                        info->name, info->daemon, sep, labels, (double)sum_us / 1e6);
+                fprintf(out, "telemetrics_%s_count{daemon=\"%s\"%s%s} %" PRIu64 "\n",
+                        info->name, info->daemon, sep, labels, count);
+                previous = info;
+        }
+}
+
+static void print_summary(FILE *out, const struct metrics_page *p)
+{
+        uint64_t buckets[METRICS_BUCKETS];
+        uint64_t count, sum_us;
+        char name[64];
+
+        if (p->name[0] != '\0') {
+                fprintf(out, "%.*s: pid %d, up %" PRId64 " s\n",
+                        (int)sizeof(p->name), p->name, p->pid,
+                        (int64_t)time(NULL) - p->start_time);
+        }
+
+        for (int i = 0; i < METRIC_COUNTER_MAX; i++) {
+                const struct metric_info *info = &counter_info[i];
+
+                if (!shown(p, info)) {
+                        continue;
+                }
+                snprintf(name, sizeof(name), "%s%s%s%s", info->name,
+                         info->labels ? "{" : "", info->labels ? info->labels : "",
+                         info->labels ? "}" : "");
+                fprintf(out, "  %-36s %" PRIu64 "\n", name,
+                        metrics_counter_value(p, (enum metric_counter)i));
+        }
+
+        for (int i = 0; i < METRIC_GAUGE_MAX; i++) {
+                const struct metric_info *info = &gauge_info[i];
+
+                if (!shown(p, info)) {
+                        continue;
+                }
+                fprintf(out, "  %-36s %" PRId64 "\n", info->name,
+                        __atomic_load_n(&p->gauges[i], __ATOMIC_RELAXED));
+        }
+
+        for (int i = 0; i < METRIC_HISTOGRAM_MAX; i++) {
+                const struct metric_info *info = &histogram_info[i];
+
+                if (!shown(p, info)) {
+                        continue;
+                }
+                count = metrics_histogram_value(p, (enum metric_histogram)i,
+                                                buckets, &sum_us);
+                snprintf(name, sizeof(name), "%s%s%s%s", info->name,
+                         info->labels ? "{" : "", info->labels ? info->labels : "",
+                         info->labels ? "}" : "");
+                fprintf(out, "  %-36s %" PRIu64, name, count);
+                if (count > 0) {
+                        fprintf(out, ", avg %" PRIu64 " us, p50 < %" PRIu64
+                                " us, p90 < %" PRIu64 " us, p99 < %" PRIu64 " us",
+                                sum_us / count, percentile(buckets, count, 0.50),
+                                percentile(buckets, count, 0.90),
+                                percentile(buckets, count, 0.99));
+                }
+                fprintf(out, "\n");
+        }
+}
+
+void metrics_print(FILE *out, const struct metrics_page *p, bool prometheus)
+{
+        if (prometheus) {
+                print_prometheus(out, p);
+        } else {
+                print_summary(out, p);
+        }
+}
+
+/* vi: set ts=8 sw=8 sts=4 et tw=80 cino=(0: */
@@ -0,0 +1,220 @@
+/*
+ * This program is part of the Clear Linux Project
+ *
+ * Copyright 2019 Intel Corporation
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms and conditions of the GNU Lesser General Public License, as
+ * published by the Free Software Foundation; either version 2.1 of the License,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU Lesser General Public License for more
+ * details.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+/*
+ * Metrics of telemprobd and telempostd: counters, gauges and latency
+ * histograms in a page of shared memory, mapped from a file in METRICS_DIR
+ * that "telemctl stats" reads. Each thread updates its own shard of the
+ * page with relaxed atomics, and readers sum the shards. Until
+ * metrics_open() is called, metrics go to a page private to the process.
+ */
+
+#define METRICS_DIR LOCALSTATEDIR "/lib/telemetry"
+#define METRICS_SUFFIX ".metrics"
+#define METRICS_MAGIC "TMMETR\1"
+
+#define METRICS_SHARDS 8
+
+/* Bucket i of a histogram counts latencies below 2^i us, the last one all
+ * the others */
+#define METRICS_BUCKETS 26
+
+enum metric_counter {
+        METRIC_PROBD_RECORDS_RECEIVED = 0,
+        METRIC_PROBD_RECORDS_STREAMED,
+        METRIC_PROBD_RECORDS_REJECTED,
+        METRIC_PROBD_BYTES_RECEIVED,
+        METRIC_PROBD_MEMORY_TRIMS,
+        METRIC_POSTD_POSTS_SENT,
+        METRIC_POSTD_POSTS_FAILED,
+        METRIC_POSTD_HTTP_2XX,
+        METRIC_POSTD_HTTP_3XX,
+        METRIC_POSTD_HTTP_4XX,
+        METRIC_POSTD_HTTP_5XX,
+        METRIC_POSTD_HTTP_ERRORS,
+        METRIC_POSTD_RATE_LIMIT_DROPPED,
+        METRIC_POSTD_RATE_LIMIT_SPOOLED,
+        METRIC_POSTD_JOURNAL_PRUNED,
+        METRIC_POSTD_TRACE_RETRIES,
+        METRIC_POSTD_MEMORY_TRIMS,
+        METRIC_POSTD_STAGING_CORRUPT,
+        METRIC_POSTD_STAGING_FAILED,
+        METRIC_COUNTER_MAX
+};
+
+enum metric_gauge {
+        METRIC_PROBD_RSS_BYTES = 0,
+        METRIC_PROBD_HEAP_BYTES,
+        METRIC_POSTD_SPOOL_RECORDS,
+        METRIC_POSTD_SPOOL_BYTES,
+        METRIC_POSTD_RSS_BYTES,
+        METRIC_POSTD_HEAP_BYTES,
+        METRIC_GAUGE_MAX
+};
+
+enum metric_histogram {
+        METRIC_PROBD_STAGE_TIME = 0,
+        METRIC_POSTD_POST_TIME,
+        METRIC_POSTD_JOURNAL_PRUNE_TIME,
+        /* stages of the traced records delivered, see recordtrace.h */
+        METRIC_POSTD_TRACE_PROBE_TIME,
+        METRIC_POSTD_TRACE_PROBD_TIME,
+        METRIC_POSTD_TRACE_STAGING_TIME,
+        METRIC_POSTD_TRACE_POSTD_TIME,
+        METRIC_POSTD_TRACE_SPOOL_TIME,
+        METRIC_POSTD_TRACE_TOTAL_TIME,
+        METRIC_HISTOGRAM_MAX
+};
+
+/* Cache line aligned, so that threads do not share lines */
+struct metrics_shard {
+        uint64_t counters[METRIC_COUNTER_MAX];
+        uint64_t buckets[METRIC_HISTOGRAM_MAX][METRICS_BUCKETS];
+        /* sum of the latencies of each histogram, in us */
+        uint64_t sum_us[METRIC_HISTOGRAM_MAX];
+} __attribute__((aligned(64)));
+
+struct metrics_page {
+        char magic[8];
+        /* size of the page, so that readers of another layout reject it */
+        uint32_t size;
+        int32_t pid;
+        int64_t start_time;
+        /* daemon updating the page */
+        char name[16];
+        int64_t gauges[METRIC_GAUGE_MAX];
+        struct metrics_shard shards[METRICS_SHARDS];
+} __attribute__((aligned(64)));
+
+/**
+ * Creates the metrics page of the daemon, and maps it for the metrics of
+ * all its threads. To be called before the daemon starts its threads.
+ *
+ * @param path File of the page, replaced if it exists. A page opened before
+ *     is closed.
+ * @param name Name of the daemon
+ *
+ * @return 0 on success, or a negative errno value. Metrics stay private to
+ *     the process on error.
+ */
+int metrics_open(const char *path, const char *name);
+
+/**
+ * Removes and unmaps the metrics page, after which metrics go to the private
+ * page again. To be called once the threads of the daemon are stopped.
+ */
+void metrics_close(void);
+
+/**
+ * Gets the page metrics are updated in
+ *
+ * @return the shared page after metrics_open(), the private page otherwise
+ */
+const struct metrics_page *metrics_page(void);
+
+/**
+ * Adds to a counter
+ *
+ * @param counter The counter
+ * @param n Value to add
+ */
+void metrics_count(enum metric_counter counter, uint64_t n);
+
+/**
+ * Sets a gauge
+ *
+ * @param gauge The gauge
+ * @param value Value of the gauge
+ */
+void metrics_set(enum metric_gauge gauge, int64_t value);
+
+/**
+ * Adds a latency to a histogram
+ *
+ * @param histogram The histogram
+ * @param ns Latency in nanoseconds
+ */
+void metrics_observe(enum metric_histogram histogram, uint64_t ns);
+
+/**
+ * Gets the time latencies are measured with
+ *
+ * @return the monotonic clock, in nanoseconds
+ */
+uint64_t metrics_clock(void);
+
+/**
+ * Maps the metrics page of a daemon read-only
+ *
+ * @param path File of the page
+ * @param page Set to the page on success, to be unmapped with
+ *     metrics_unmap()
+ *
+ * @return 0 on success, -EINVAL if the file is not a page of this version,
+ *     or another negative errno value
+ */
+int metrics_map(const char *path, const struct metrics_page **page);
+
+/**
+ * Unmaps a page mapped with metrics_map()
+ *
+ * @param page The page
+ */
+void metrics_unmap(const struct metrics_page *page);
+
+/**
+ * Sums a counter over the shards of a page
+ *
+ * @param page The page
+ * @param counter The counter
+ *
+ * @return the value of the counter
+ */
+uint64_t metrics_counter_value(const struct metrics_page *page,
+                               enum metric_counter counter);
+
+/**
+ * Sums a histogram over the shards of a page
+ *
+ * @param page The page
+ * @param histogram The histogram
+ * @param buckets Set to the counts of each bucket
+ * @param sum_us Set to the sum of the latencies, in us
+ *
+ * @return the number of latencies in the histogram
+ */
+uint64_t metrics_histogram_value(const struct metrics_page *page,
+                                 enum metric_histogram histogram,
+                                 uint64_t buckets[METRICS_BUCKETS],
+                                 uint64_t *sum_us);
+
+/**
+ * Prints the metrics of the daemon of a page
+ *
+ * @param out Stream to print to
+ * @param page The page
+ * @param prometheus true for the Prometheus text format, false for a
+ *     summary
+ */
+void metrics_print(FILE *out, const struct metrics_page *page, bool prometheus);
+
+/* vi: set ts=8 sw=8 sts=4 et tw=80 cino=(0: */
@@ -11,11 +11,27 @@
 
 #define _GNU_SOURCE
 
+#include <errno.h>
+#include <fcntl.h>
 #include <stdio.h>
 #include <stdint.h>
+#include <string.h>
+#include <unistd.h>
 #include "b64enc.h"
 
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define B64_X86
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+#include <arm_neon.h>
+#define B64_NEON
+#endif
+
 #define B64_LINE_LEN 76
+/* Input bytes of a whole line */
+#define B64_LINE_BYTES (B64_LINE_LEN / 4 * 3)
+/* Input bytes read at once, a whole number of lines */
+#define B64_CHUNK (B64_LINE_BYTES * 256)
 
 static int padding[] = {0, 2, 1, 0};
 static char table[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
@@ -43,7 +59,7 @@ static char table[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz01234
  *                          ------
  *
  */
-static void b64_3b(char bin[3], char *out) {
+static void b64_3b(const char bin[3], char *out) {
 
     uint32_t x = (((uint32_t) bin[0] << 16) & 0xFF0000) |
                  (((uint32_t) bin[1] <<  8) & 0xFF00)   |
@@ -75,80 +91,515 @@ static void b64_padding(char *out, int pad_size) {
 
 
 /*
- * Encode file contents as b64 string
+ * Block encoders: encode the whole groups of three bytes of in, without
+ * line breaks, and return the number of bytes encoded
  */
-int nc_b64enc_file(FILE *fh, char *buff, size_t buff_size) {
+typedef size_t (*b64_block_fn)(const uint8_t *in, size_t len, char *out);
+
+static size_t b64_block_scalar(const uint8_t *in, size_t len, char *out) {
+
+    size_t done = 0;
+
+    for (; len - done >= 3; done += 3) {
+        b64_3b((const char *) in + done, out);
+        out += 4;
+    }
+
+    return done;
+}
+
+#ifdef B64_X86
+
+/*
+ * The vector encoders follow http://0x80.pl/notesen/2016-01-12-sse-base64-encoding.html:
+ * bytes of each group are shuffled into a 32-bit lane, the four 6-bit
+ * indices are moved to one byte each with multiplies, and the indices are
+ * turned to characters by adding an offset looked up by range.
+ */
+
+/* The offsets by range, as chars since some of them are negative */
+#define B64_OFFSETS (char)('a' - 26), (char)('0' - 52), (char)('0' - 52), \
+                    (char)('0' - 52), (char)('0' - 52), (char)('0' - 52), \
+                    (char)('0' - 52), (char)('0' - 52), (char)('0' - 52), \
+                    (char)('0' - 52), (char)('0' - 52), (char)('+' - 62), \
+                    (char)('/' - 63), 'A', 0, 0
+
+__attribute__((target("ssse3")))
+static size_t b64_block_ssse3(const uint8_t *in, size_t len, char *out) {
+
+    const __m128i shuf = _mm_set_epi8(10, 11, 9, 10, 7, 8, 6, 7,
+                                      4, 5, 3, 4, 1, 2, 0, 1);
+    const __m128i offsets = _mm_setr_epi8(B64_OFFSETS);
+    size_t done = 0;
+
+    /* Each load is of 16 bytes of which 12 are encoded */
+    while (len - done >= 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *) (in + done));
+        __m128i hi, lo, idx, range;
+
+        v = _mm_shuffle_epi8(v, shuf);
+        hi = _mm_mulhi_epu16(_mm_and_si128(v, _mm_set1_epi32(0x0fc0fc00)),
+                             _mm_set1_epi32(0x04000040));
+        lo = _mm_mullo_epi16(_mm_and_si128(v, _mm_set1_epi32(0x003f03f0)),
+                             _mm_set1_epi32(0x01000010));
+        idx = _mm_or_si128(hi, lo);
+
+        range = _mm_subs_epu8(idx, _mm_set1_epi8(51));
+        range = _mm_or_si128(range, _mm_and_si128(_mm_cmpgt_epi8(_mm_set1_epi8(26), idx),
+                                                  _mm_set1_epi8(13)));
+        v = _mm_add_epi8(_mm_shuffle_epi8(offsets, range), idx);
+
+        _mm_storeu_si128((__m128i *) out, v);
+        done += 12;
+        out += 16;
+    }
+
+    return done + b64_block_scalar(in + done, len - done, out);
+}
+
+__attribute__((target("avx2")))
+static size_t b64_block_avx2(const uint8_t *in, size_t len, char *out) {
+
+    const __m256i shuf = _mm256_broadcastsi128_si256(
+            _mm_set_epi8(10, 11, 9, 10, 7, 8, 6, 7, 4, 5, 3, 4, 1, 2, 0, 1));
+    const __m256i offsets = _mm256_broadcastsi128_si256(
+            _mm_setr_epi8(B64_OFFSETS));
+    size_t done = 0;
+
+    /* Each 128-bit lane loads 16 bytes and encodes 12 of them */
+    while (len - done >= 28) {
+        __m256i v = _mm256_inserti128_si256(
+                _mm256_castsi128_si256(_mm_loadu_si128((const __m128i *) (in + done))),
+                _mm_loadu_si128((const __m128i *) (in + done + 12)), 1);
+        __m256i hi, lo, idx, range;
+
+        v = _mm256_shuffle_epi8(v, shuf);
+        hi = _mm256_mulhi_epu16(_mm256_and_si256(v, _mm256_set1_epi32(0x0fc0fc00)),
+                                _mm256_set1_epi32(0x04000040));
+        lo = _mm256_mullo_epi16(_mm256_and_si256(v, _mm256_set1_epi32(0x003f03f0)),
+                                _mm256_set1_epi32(0x01000010));
+        idx = _mm256_or_si256(hi, lo);
+
+        range = _mm256_subs_epu8(idx, _mm256_set1_epi8(51));
+        range = _mm256_or_si256(range, _mm256_and_si256(_mm256_cmpgt_epi8(_mm256_set1_epi8(26), idx),
+                                                        _mm256_set1_epi8(13)));
+        v = _mm256_add_epi8(_mm256_shuffle_epi8(offsets, range), idx);
+
+        _mm256_storeu_si256((__m256i *) out, v);
+        done += 24;
+        out += 32;
+    }
+
+    return done + b64_block_scalar(in + done, len - done, out);
+}
+
+static bool b64_have_ssse3(void) {
+
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("ssse3");
+}
+
+static bool b64_have_avx2(void) {
+
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2");
+}
+
+#endif
+
+#ifdef B64_NEON
+
+/*
+ * Groups are split into their three bytes by a deinterleaving load, and the
+ * indices are looked up in the 64 byte table directly
+ */
+static size_t b64_block_neon(const uint8_t *in, size_t len, char *out) {
+
+    const uint8x16_t mask = vdupq_n_u8(0x3f);
+    uint8x16x4_t lut;
+    size_t done = 0;
+
+    for (int i = 0; i < 4; i++) {
+        lut.val[i] = vld1q_u8((const uint8_t *) table + 16 * i);
+    }
+
+    while (len - done >= 48) {
+        uint8x16x3_t src = vld3q_u8(in + done);
+        uint8x16x4_t idx;
+
+        idx.val[0] = vshrq_n_u8(src.val[0], 2);
+        idx.val[1] = vandq_u8(vorrq_u8(vshrq_n_u8(src.val[1], 4),
+                                       vshlq_n_u8(src.val[0], 4)), mask);
+        idx.val[2] = vandq_u8(vorrq_u8(vshrq_n_u8(src.val[2], 6),
+                                       vshlq_n_u8(src.val[1], 2)), mask);
+        idx.val[3] = vandq_u8(src.val[2], mask);
+        for (int i = 0; i < 4; i++) {
+            idx.val[i] = vqtbl4q_u8(lut, idx.val[i]);
+        }
+
+        vst4q_u8((uint8_t *) out, idx);
+        done += 48;
+        out += 64;
+    }
+
+    return done + b64_block_scalar(in + done, len - done, out);
+}
+
+#endif
+
+static bool b64_always(void) {
+
+    return true;
+}
+
+struct b64_impl {
+    NcB64Impl id;
+    const char *name;
+    b64_block_fn block;
+    bool (*supported)(void);
+};
+
+/* In order of preference */
+static const struct b64_impl impls[] = {
+#ifdef B64_X86
+    { NC_B64_IMPL_AVX2, "avx2", b64_block_avx2, b64_have_avx2 },
+    { NC_B64_IMPL_SSSE3, "ssse3", b64_block_ssse3, b64_have_ssse3 },
+#endif
+#ifdef B64_NEON
+    { NC_B64_IMPL_NEON, "neon", b64_block_neon, b64_always },
+#endif
+    { NC_B64_IMPL_SCALAR, "scalar", b64_block_scalar, b64_always },
+};
+
+static const struct b64_impl *selected = NULL;
+
+static const struct b64_impl *b64_find(NcB64Impl id) {
+
+    for (size_t i = 0; i < sizeof(impls) / sizeof(impls[0]); i++) {
+        if ((id == NC_B64_IMPL_AUTO || impls[i].id == id) &&
+            impls[i].supported()) {
+            return &impls[i];
+        }
+    }
+
+    return NULL;
+}
+
+static const struct b64_impl *b64_impl(void) {
+
+    const struct b64_impl *impl = __atomic_load_n(&selected, __ATOMIC_ACQUIRE);
+
+    if (!impl) {
+        impl = b64_find(NC_B64_IMPL_AUTO);
+        __atomic_store_n(&selected, impl, __ATOMIC_RELEASE);
+    }
+
+    return impl;
+}
+
+bool nc_b64enc_use(NcB64Impl impl) {
+
+    const struct b64_impl *found = b64_find(impl);
+
+    if (!found) {
+        return false;
+    }
+    __atomic_store_n(&selected, found, __ATOMIC_RELEASE);
+
+    return true;
+}
+
+const char *nc_b64enc_impl_name(void) {
+
+    return b64_impl()->name;
+}
+
+
+size_t nc_b64enc_len(size_t len) {
+
+    /* Every whole line of input ends with a line break */
+    return (len + 2) / 3 * 4 + len / B64_LINE_BYTES;
+}
+
+
+void nc_b64enc_init(NcB64Encoder *enc) {
+
+    memset(enc, 0, sizeof(*enc));
+}
+
+
+size_t nc_b64enc_update_len(const NcB64Encoder *enc, size_t len) {
+
+    size_t chars = ((size_t) enc->carry_len + len) / 3 * 4;
+
+    return chars + ((size_t) enc->column + chars) / B64_LINE_LEN;
+}
+
+
+/*
+ * Accounts for chars characters of whole groups written at out, breaking the
+ * line when it is full
+ */
+static char *b64_advance(NcB64Encoder *enc, char *out, size_t chars) {
+
+    out += chars;
+    enc->column += (int) chars;
+    if (enc->column == B64_LINE_LEN) {
+        *out++ = '\n';
+        enc->column = 0;
+    }
+
+    return out;
+}
+
+
+size_t nc_b64enc_update(NcB64Encoder *enc, const void *in, size_t len,
+                        char *out) {
+
+    b64_block_fn block = b64_impl()->block;
+    const uint8_t *bin = in;
+    char *out_ptr = out;
+
+    if (enc->carry_len > 0) {
+        while (enc->carry_len < 3 && len > 0) {
+            enc->carry[enc->carry_len++] = *bin++;
+            len--;
+        }
+        if (enc->carry_len < 3) {
+            return 0;
+        }
+        b64_3b((const char *) enc->carry, out_ptr);
+        out_ptr = b64_advance(enc, out_ptr, 4);
+        enc->carry_len = 0;
+    }
+
+    /* Up to the end of the current line at a time */
+    while (len >= 3) {
+        size_t n = (size_t) (B64_LINE_LEN - enc->column) / 4 * 3;
+
+        if (n > len) {
+            n = len;
+        }
+        n = block(bin, n, out_ptr);
+        out_ptr = b64_advance(enc, out_ptr, n / 3 * 4);
+        bin += n;
+        len -= n;
+    }
+
+    memcpy(enc->carry, bin, len);
+    enc->carry_len = (int) len;
+
+    return (size_t) (out_ptr - out);
+}
+
+
+size_t nc_b64enc_final(NcB64Encoder *enc, char *out) {
 
-    int ret_val = 1;
-    int out_count = 0;
-    int pad_size = 0;
-    char *buff_ptr = buff;
     char bin[3] = {0, 0, 0};
     size_t len = 0;
 
-    while ((len = fread(bin, 1, 3, fh)) > 0) {
-        b64_3b(bin, buff_ptr);
-        /*
-         Reset 2nd and 3rd bytes in case only one byte was read. If these
-         bytes are not clean b64 output will be corrupted with old bits.
-         */
-        bin[1] = bin[2] = 0;
-        /*
-         Advance pointer to the next free position of the b64 encoded
-         buffer. This happens to be len + 1 (as longs as len >= 1 and len <= 3)
-
-            len = 1 byte  -> b64 -> 2 bytes (or len + 1)
-            len = 2 bytes -> b64 -> 3 bytes (or len + 1)
-            len = 3 bytes -> b64 -> 4 bytes (or len + 1)
-        */
-        buff_ptr += (len + 1);
-        /*
-         Line break every 76 characters
-        */
-        out_count += (int) (len + 1);
-        if (out_count % B64_LINE_LEN == 0) {
-            *buff_ptr++ = '\n';
-        }
-        pad_size = padding[len];
-        /*
-         Check not to overflow buffer
-
-            buffer size <= b64 characters + padding length + null termination
-        */
-        if (buff_size <= (size_t) (buff_ptr - buff) + (size_t) pad_size + 1) {
-           ret_val = 0;
-           goto end_b64_enc;
+    if (enc->carry_len > 0) {
+        memcpy(bin, enc->carry, (size_t) enc->carry_len);
+        b64_3b(bin, out);
+        len = (size_t) enc->carry_len + 1;
+    }
+    b64_padding(out + len, padding[enc->carry_len]);
+    len += (size_t) padding[enc->carry_len];
+
+    nc_b64enc_init(enc);
+
+    return len;
+}
+
+
+size_t nc_b64enc(const void *in, size_t len, char *out) {
+
+    NcB64Encoder enc;
+    size_t out_len;
+
+    nc_b64enc_init(&enc);
+    out_len = nc_b64enc_update(&enc, in, len, out);
+
+    return out_len + nc_b64enc_final(&enc, out + out_len);
+}
+
+
+/*
+ * Reads up to len bytes, returning 0 at end of input and -1 on errors
+ */
+typedef ssize_t (*b64_read_fn)(void *src, uint8_t *buf, size_t len);
+
+static ssize_t b64_read_fd(void *src, uint8_t *buf, size_t len) {
+
+    ssize_t ret;
+
+    do {
+        ret = read(*(int *) src, buf, len);
+    } while (ret < 0 && errno == EINTR);
+
+    return ret;
+}
+
+static ssize_t b64_read_file(void *src, uint8_t *buf, size_t len) {
+
+    FILE *fh = src;
+    size_t ret = fread(buf, 1, len, fh);
+
+    if (ret == 0 && ferror(fh)) {
+        return -1;
+    }
+
+    return (ssize_t) ret;
+}
+
+
+/*
+ * Encodes a whole input into buff, failing if it does not fit together with
+ * the NUL termination
+ */
+static int b64_encode_stream(b64_read_fn read_fn, void *src, char *buff,
+                             size_t buff_size) {
+
+    NcB64Encoder enc;
+    uint8_t chunk[B64_CHUNK];
+    size_t used = 0;
+    ssize_t len;
+
+    if (buff_size == 0) {
+        return 0;
+    }
+
+    nc_b64enc_init(&enc);
+    while ((len = read_fn(src, chunk, sizeof(chunk))) > 0) {
+        if (used + nc_b64enc_update_len(&enc, (size_t) len) >= buff_size) {
+            buff[used] = '\0';
+            return 0;
         }
+        used += nc_b64enc_update(&enc, chunk, (size_t) len, buff + used);
     }
 
-    b64_padding(buff_ptr, pad_size);
+    if (len < 0 || used + (enc.carry_len > 0 ? 4 : 0) >= buff_size) {
+        buff[used] = '\0';
+        return 0;
+    }
+    nc_b64enc_final(&enc, buff + used);
+
+    return 1;
+}
+
 
-end_b64_enc:
+/*
+ * Encode file contents as b64 string
+ */
+int nc_b64enc_file(FILE *fh, char *buff, size_t buff_size) {
 
-    return ret_val;
+    return b64_encode_stream(b64_read_file, fh, buff, buff_size);
+}
+
+
+int nc_b64enc_fd(int fd, char *buff, size_t buff_size) {
+
+    return b64_encode_stream(b64_read_fd, &fd, buff, buff_size);
 }
 
 
 int nc_b64enc_filename(const char *filename, char *buff, size_t buff_size) {
 
     int ret = 0;
-    FILE *fh = NULL;
+    int fd = -1;
 
-    fh = fopen(filename, "rb");
+    fd = open(filename, O_RDONLY | O_CLOEXEC);
 
-    if (fh == NULL) {
+    if (fd < 0) {
         goto nc_b64_clean;
     }
 
-    ret = nc_b64enc_file(fh, buff, buff_size);
+    ret = nc_b64enc_fd(fd, buff, buff_size);
 
 nc_b64_clean:
 
-    if (fh) {
-        fclose(fh);
+    if (fd >= 0) {
+        close(fd);
     }
 
     return ret;
 }
 
+
+static int b64_value(char c) {
+
+    if (c >= 'A' && c <= 'Z') {
+        return c - 'A';
+    }
+    if (c >= 'a' && c <= 'z') {
+        return c - 'a' + 26;
+    }
+    if (c >= '0' && c <= '9') {
+        return c - '0' + 52;
+    }
+    if (c == '+') {
+        return 62;
+    }
+    if (c == '/') {
+        return 63;
+    }
+
+    return -1;
+}
+
+
+ssize_t nc_b64dec(const char *in, size_t len, void *out, size_t out_size) {
+
+    uint8_t *out_ptr = out;
+    size_t used = 0;
+    uint32_t group = 0;
+    int count = 0;
+    int pad_size = 0;
+    bool ended = false;
+
+    for (size_t i = 0; i < len; i++) {
+        int value = 0;
+        size_t bytes;
+
+        if (in[i] == '\n' || in[i] == '\r') {
+            continue;
+        }
+        if (ended) {
+            return -1;
+        }
+        if (in[i] == '=') {
+            pad_size++;
+        } else if (pad_size > 0 || (value = b64_value(in[i])) < 0) {
+            return -1;
+        }
+
+        group = group << 6 | (uint32_t) value;
+        if (++count < 4) {
+            continue;
+        }
+
+        /* A padded group is the last one */
+        bytes = (size_t) (3 - pad_size);
+        if (pad_size > 2 || used + bytes > out_size) {
+            return -1;
+        }
+        out_ptr[used++] = (uint8_t) (group >> 16);
+        if (bytes > 1) {
+            out_ptr[used++] = (uint8_t) (group >> 8);
+        }
+        if (bytes > 2) {
+            out_ptr[used++] = (uint8_t) group;
+        }
+        ended = pad_size > 0;
+        group = 0;
+        count = 0;
+    }
+
+    if (count != 0) {
+        return -1;
+    }
+
+    return (ssize_t) used;
+}
+
 /* vi: set ts=8 sw=8 sts=4 et tw=80 cino=(0: */
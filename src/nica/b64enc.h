@@ -15,8 +15,40 @@
 
 #define _GNU_SOURCE
 
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/types.h>
+
 #include "macros.h"
 
+/*
+ * Output is broken in lines of 76 characters, each followed by a '\n',
+ * and the last line is padded with '='.
+ */
+
+/*
+ * Block encoders, the vectorized ones are only used if the CPU has the
+ * instructions they need
+ */
+typedef enum {
+    NC_B64_IMPL_AUTO = 0,
+    NC_B64_IMPL_SCALAR,
+    NC_B64_IMPL_SSSE3,
+    NC_B64_IMPL_AVX2,
+    NC_B64_IMPL_NEON,
+} NcB64Impl;
+
+/*
+ * State of a streaming encode, to be initialized with nc_b64enc_init()
+ */
+typedef struct NcB64Encoder {
+    uint8_t carry[3];   /* Input bytes not yet making a whole group */
+    int carry_len;
+    int column;         /* Characters written on the current line */
+} NcB64Encoder;
+
 /*
  * Encodes contents of file handler in base64
  *
@@ -40,3 +72,103 @@ _nica_public_ int nc_b64enc_file(FILE *fh, char *buff, size_t buff_size);
  */
 _nica_public_ int nc_b64enc_filename(const char *filename, char *buff, size_t buff_size);
 
+
+/*
+ * Encodes what can be read from a file descriptor in base64, reading it in
+ * large chunks without going through stdio
+ *
+ * @param fd File descriptor to read until end of file
+ * @param buff Output buffer where the base64 output should be written
+ * @param buff_size Size of the output buffer
+ *
+ * @returns 1 in success and 0 in failure
+ */
+_nica_public_ int nc_b64enc_fd(int fd, char *buff, size_t buff_size);
+
+
+/*
+ * Length of the base64 encoding of len bytes, line breaks and padding
+ * included, NUL termination excluded
+ */
+_nica_public_ size_t nc_b64enc_len(size_t len);
+
+
+/*
+ * Encodes a buffer in base64
+ *
+ * @param in Bytes to encode
+ * @param len Number of bytes to encode
+ * @param out Output of at least nc_b64enc_len(len) + 1 characters
+ *
+ * @returns the number of characters written, NUL termination excluded
+ */
+_nica_public_ size_t nc_b64enc(const void *in, size_t len, char *out);
+
+
+/*
+ * Starts a streaming encode
+ */
+_nica_public_ void nc_b64enc_init(NcB64Encoder *enc);
+
+
+/*
+ * Encodes the next part of a stream. Bytes that do not make a whole group
+ * of three are kept in the encoder until the next call.
+ *
+ * @param enc Encoder state
+ * @param in Bytes to encode
+ * @param len Number of bytes to encode
+ * @param out Output of at least nc_b64enc_update_len(enc, len) characters
+ *
+ * @returns the number of characters written, not NUL terminated
+ */
+_nica_public_ size_t nc_b64enc_update(NcB64Encoder *enc, const void *in,
+                                      size_t len, char *out);
+
+
+/*
+ * Number of characters the next nc_b64enc_update() of len bytes writes
+ */
+_nica_public_ size_t nc_b64enc_update_len(const NcB64Encoder *enc, size_t len);
+
+
+/*
+ * Ends a streaming encode, writing the last group with its padding
+ *
+ * @param enc Encoder state
+ * @param out Output of at least 5 characters
+ *
+ * @returns the number of characters written, NUL termination excluded
+ */
+_nica_public_ size_t nc_b64enc_final(NcB64Encoder *enc, char *out);
+
+
+/*
+ * Decodes base64 text, skipping line breaks
+ *
+ * @param in Text to decode
+ * @param len Length of the text
+ * @param out Output buffer, (len / 4) * 3 bytes always suffice
+ * @param out_size Size of the output buffer
+ *
+ * @returns the number of bytes decoded, or -1 if the text is not valid
+ *          base64 or does not fit in the output buffer
+ */
+_nica_public_ ssize_t nc_b64dec(const char *in, size_t len, void *out,
+                                size_t out_size);
+
+
+/*
+ * Selects the block encoder, NC_B64_IMPL_AUTO picking the fastest one the
+ * CPU supports
+ *
+ * @returns false if the encoder is not supported on this CPU, in which case
+ *          the selection is unchanged
+ */
+_nica_public_ bool nc_b64enc_use(NcB64Impl impl);
+
+
+/*
+ * Name of the block encoder in use
+ */
+_nica_public_ const char *nc_b64enc_impl_name(void);
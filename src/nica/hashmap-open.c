@@ -0,0 +1,562 @@
+/*
+ * This file is part of libnica.
+ *
+ * Copyright © 2019 Intel Corporation
+ *
+ * libnica is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2.1
+ * of the License, or (at your option) any later version.
+ *
+ * Open addressing implementation of the NcHashmap API, selected with
+ * --with-hashmap=open. Each slot has a control byte, holding 7 bits of the
+ * hash of its key when it is occupied, and the control bytes are probed 8
+ * at a time, so most lookups compare a single key. Slots are looked for in
+ * groups of 8, following a triangular sequence of groups, and the control
+ * bytes of a group are stored with its slots to share their cache lines.
+ *
+ * When the table is full, a new one is allocated and the entries are moved
+ * to it a few slots at a time by each following insertion and removal,
+ * instead of all at once. Until then, keys are looked up in both tables.
+ */
+
+#define _GNU_SOURCE
+#include <endian.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "hashmap.h"
+
+/* Slots of a new map, a power of two */
+#define INITIAL_SIZE 64
+
+/* Slots of a control group */
+#define GROUP_SIZE 8
+
+/* Slots of the old table moved to the new one per insertion or removal */
+#define MIGRATE_STEP 16
+
+#define CTRL_EMPTY 0x80
+#define CTRL_DELETED 0xfe
+
+#define GROUP_LSBS 0x0101010101010101ULL
+#define GROUP_MSBS 0x8080808080808080ULL
+
+/**
+ * A slot of a table
+ */
+typedef struct NcHashmapSlot {
+        void *key;   /**<The key for this item */
+        void *value; /**<Value for this item */
+} NcHashmapSlot;
+
+/**
+ * A group of slots
+ */
+typedef struct NcHashmapGroup {
+        uint8_t ctrl[GROUP_SIZE];           /**<Control byte of each slot */
+        NcHashmapSlot slots[GROUP_SIZE];    /**<The slots */
+} NcHashmapGroup;
+
+/**
+ * A table of slots
+ */
+typedef struct NcHashmapTable {
+        NcHashmapGroup *groups; /**<The groups of slots */
+        unsigned capacity;      /**<Number of slots, a power of two */
+        unsigned used;          /**<Slots not empty, deleted ones included */
+} NcHashmapTable;
+
+/**
+ * A NcHashmap
+ */
+struct NcHashmap {
+        int size;              /**<Current size of the hashmap */
+        NcHashmapTable table;  /**<Table new items are inserted into */
+        NcHashmapTable old;    /**<Table being moved into table, if any */
+        unsigned migrated;     /**<Slots of old already moved */
+
+        nc_hash_create_func hash;     /**<Hash generation function */
+        nc_hash_compare_func compare; /**<Key comparison function */
+        nc_hash_free_func key_free;   /**<Cleanup function for keys */
+        nc_hash_free_func value_free; /**<Cleanup function for values */
+};
+
+/**
+ * Iteration object
+ */
+typedef struct _NcHashmapIter {
+        int slot;       /**<Current slot position */
+        NcHashmap *map; /**<Associated NcHashmap */
+        void *old;      /**<Non-NULL once iterating the old table */
+} _NcHashmapIter;
+
+/* Mixes the hash, so that the slot and the control byte both use well
+ * distributed bits, even for the identity hash of integer keys */
+static inline unsigned nc_hashmap_get_hash(NcHashmap *self, const void *key)
+{
+        unsigned hash = self->hash(key);
+
+        hash ^= hash >> 16;
+        hash *= 0x85ebca6bU;
+        hash ^= hash >> 13;
+        hash *= 0xc2b2ae35U;
+        hash ^= hash >> 16;
+        return hash;
+}
+
+static inline uint8_t hash_tag(unsigned hash)
+{
+        return (uint8_t)(hash >> 25);
+}
+
+static inline uint64_t load_group(const NcHashmapGroup *group)
+{
+        uint64_t ctrl;
+
+        memcpy(&ctrl, group->ctrl, sizeof(ctrl));
+        return le64toh(ctrl);
+}
+
+static inline uint8_t *slot_ctrl(const NcHashmapTable *table, unsigned slot)
+{
+        return &table->groups[slot / GROUP_SIZE].ctrl[slot % GROUP_SIZE];
+}
+
+static inline NcHashmapSlot *slot_item(const NcHashmapTable *table, unsigned slot)
+{
+        return &table->groups[slot / GROUP_SIZE].slots[slot % GROUP_SIZE];
+}
+
+/* Bytes of the group equal to tag, with rare false positives */
+static inline uint64_t group_match(uint64_t ctrl, uint8_t tag)
+{
+        uint64_t x = ctrl ^ (GROUP_LSBS * tag);
+
+        return (x - GROUP_LSBS) & ~x & GROUP_MSBS;
+}
+
+static inline uint64_t group_match_empty(uint64_t ctrl)
+{
+        return ctrl & ~(ctrl << 6) & GROUP_MSBS;
+}
+
+static inline uint64_t group_match_free(uint64_t ctrl)
+{
+        return ctrl & GROUP_MSBS;
+}
+
+static inline unsigned group_first(uint64_t mask)
+{
+        return (unsigned)__builtin_ctzll(mask) / 8;
+}
+
+static inline unsigned table_threshold(const NcHashmapTable *table)
+{
+        return table->capacity - table->capacity / 8;
+}
+
+static bool nc_hashmap_table_init(NcHashmapTable *table, unsigned capacity)
+{
+        unsigned n_groups = capacity / GROUP_SIZE;
+
+        table->groups = malloc(n_groups * sizeof(NcHashmapGroup));
+        if (!table->groups) {
+                return false;
+        }
+        for (unsigned i = 0; i < n_groups; i++) {
+                memset(table->groups[i].ctrl, CTRL_EMPTY, GROUP_SIZE);
+        }
+        table->capacity = capacity;
+        table->used = 0;
+
+        return true;
+}
+
+static void nc_hashmap_table_release(NcHashmapTable *table)
+{
+        free(table->groups);
+        memset(table, 0, sizeof(NcHashmapTable));
+}
+
+static NcHashmapSlot *nc_hashmap_table_find(NcHashmap *self, NcHashmapTable *table,
+                                            unsigned hash, const void *key,
+                                            uint8_t **ctrl_byte)
+{
+        unsigned n_groups = table->capacity / GROUP_SIZE;
+        unsigned index = hash & (n_groups - 1);
+        uint8_t tag = hash_tag(hash);
+
+        if (!table->groups) {
+                return NULL;
+        }
+
+        for (unsigned i = 1; i <= n_groups; i++) {
+                NcHashmapGroup *group = &table->groups[index];
+                uint64_t ctrl = load_group(group);
+                uint64_t match = group_match(ctrl, tag);
+
+                while (match) {
+                        unsigned slot = group_first(match);
+
+                        if (group->ctrl[slot] == tag &&
+                            self->compare(group->slots[slot].key, key)) {
+                                *ctrl_byte = &group->ctrl[slot];
+                                return &group->slots[slot];
+                        }
+                        match &= match - 1;
+                }
+                if (group_match_empty(ctrl)) {
+                        return NULL;
+                }
+                index = (index + i) & (n_groups - 1);
+        }
+
+        return NULL;
+}
+
+/* Stores a key known not to be in the table, which must have a free slot */
+static void nc_hashmap_table_insert(NcHashmapTable *table, unsigned hash,
+                                    const void *key, void *value)
+{
+        unsigned n_groups = table->capacity / GROUP_SIZE;
+        unsigned index = hash & (n_groups - 1);
+
+        for (unsigned i = 1;; i++) {
+                NcHashmapGroup *group = &table->groups[index];
+                uint64_t free_slots = group_match_free(load_group(group));
+
+                if (free_slots) {
+                        unsigned slot = group_first(free_slots);
+
+                        if (group->ctrl[slot] == CTRL_EMPTY) {
+                                table->used++;
+                        }
+                        group->ctrl[slot] = hash_tag(hash);
+                        group->slots[slot].key = (void *)key;
+                        group->slots[slot].value = value;
+                        return;
+                }
+                index = (index + i) & (n_groups - 1);
+        }
+}
+
+/* Moves a slot of a table to the current one */
+static void nc_hashmap_move_slot(NcHashmap *self, NcHashmapTable *dst,
+                                 NcHashmapTable *src, unsigned slot)
+{
+        uint8_t *ctrl = slot_ctrl(src, slot);
+        NcHashmapSlot *item = slot_item(src, slot);
+
+        if (*ctrl & CTRL_EMPTY) {
+                return;
+        }
+        nc_hashmap_table_insert(dst, nc_hashmap_get_hash(self, item->key),
+                                item->key, item->value);
+        *ctrl = CTRL_DELETED;
+}
+
+/* Moves up to count slots of the old table, releasing it once empty */
+static void nc_hashmap_migrate(NcHashmap *self, unsigned count)
+{
+        NcHashmapTable *old = &self->old;
+
+        if (!old->groups) {
+                return;
+        }
+        for (; count > 0 && self->migrated < old->capacity; count--, self->migrated++) {
+                nc_hashmap_move_slot(self, &self->table, old, self->migrated);
+        }
+        if (self->migrated == old->capacity) {
+                nc_hashmap_table_release(old);
+                self->migrated = 0;
+        }
+}
+
+/* Moves all the entries of a table into another with enough free slots */
+static void nc_hashmap_table_move(NcHashmap *self, NcHashmapTable *dst,
+                                  NcHashmapTable *src)
+{
+        for (unsigned i = 0; i < src->capacity; i++) {
+                nc_hashmap_move_slot(self, dst, src, i);
+        }
+        nc_hashmap_table_release(src);
+}
+
+/* Starts moving the entries to a new table, twice as large unless most of
+ * the used slots are deleted ones */
+static bool nc_hashmap_resize(NcHashmap *self)
+{
+        NcHashmapTable table;
+        unsigned capacity = self->table.capacity;
+
+        if ((unsigned)self->size >= capacity / 2) {
+                capacity *= 2;
+        }
+        if (!nc_hashmap_table_init(&table, capacity)) {
+                return false;
+        }
+
+        /* The table filled up before the last resize was finished, both
+         * tables are moved at once */
+        if (self->old.groups) {
+                nc_hashmap_table_move(self, &table, &self->old);
+                nc_hashmap_table_move(self, &table, &self->table);
+                self->table = table;
+                self->migrated = 0;
+                return true;
+        }
+
+        self->old = self->table;
+        self->table = table;
+        self->migrated = 0;
+
+        return true;
+}
+
+static NcHashmap *nc_hashmap_new_internal(nc_hash_create_func create, nc_hash_compare_func compare,
+                                          nc_hash_free_func key_free, nc_hash_free_func value_free)
+{
+        NcHashmap *map = NULL;
+
+        map = calloc(1, sizeof(NcHashmap));
+        if (!map) {
+                return NULL;
+        }
+        if (!nc_hashmap_table_init(&map->table, INITIAL_SIZE)) {
+                free(map);
+                return NULL;
+        }
+        map->hash = create ? create : nc_simple_hash;
+        map->compare = compare ? compare : nc_simple_compare;
+        map->key_free = key_free;
+        map->value_free = value_free;
+        map->size = 0;
+
+        return map;
+}
+
+NcHashmap *nc_hashmap_new(nc_hash_create_func create, nc_hash_compare_func compare)
+{
+        return nc_hashmap_new_internal(create, compare, NULL, NULL);
+}
+
+NcHashmap *nc_hashmap_new_full(nc_hash_create_func create, nc_hash_compare_func compare,
+                               nc_hash_free_func key_free, nc_hash_free_func value_free)
+{
+        return nc_hashmap_new_internal(create, compare, key_free, value_free);
+}
+
+/* Finds the slot of a key in either table, and its control byte */
+static NcHashmapSlot *nc_hashmap_find(NcHashmap *self, unsigned hash, const void *key,
+                                      uint8_t **ctrl)
+{
+        NcHashmapSlot *item;
+
+        if ((item = nc_hashmap_table_find(self, &self->table, hash, key, ctrl)) != NULL) {
+                return item;
+        }
+        return nc_hashmap_table_find(self, &self->old, hash, key, ctrl);
+}
+
+bool nc_hashmap_put(NcHashmap *self, const void *key, void *value)
+{
+        uint8_t *ctrl = NULL;
+        NcHashmapSlot *item;
+        unsigned hash;
+
+        if (!self) {
+                return false;
+        }
+
+        hash = nc_hashmap_get_hash(self, key);
+        item = nc_hashmap_find(self, hash, key, &ctrl);
+        if (item) {
+                if (self->value_free) {
+                        self->value_free(item->value);
+                }
+                if (self->key_free) {
+                        self->key_free(item->key);
+                }
+                item->key = (void *)key;
+                item->value = value;
+                return true;
+        }
+
+        if (self->table.used >= table_threshold(&self->table)) {
+                if (!nc_hashmap_resize(self)) {
+                        return false;
+                }
+        }
+        nc_hashmap_table_insert(&self->table, hash, key, value);
+        self->size += 1;
+        nc_hashmap_migrate(self, MIGRATE_STEP);
+
+        return true;
+}
+
+void *nc_hashmap_get(NcHashmap *self, const void *key)
+{
+        uint8_t *ctrl = NULL;
+        NcHashmapSlot *item;
+
+        if (!self) {
+                return NULL;
+        }
+
+        item = nc_hashmap_find(self, nc_hashmap_get_hash(self, key), key, &ctrl);
+        if (item) {
+                return item->value;
+        }
+        return NULL;
+}
+
+static bool nc_hashmap_remove_internal(NcHashmap *self, const void *key, bool remove)
+{
+        uint8_t *ctrl = NULL;
+        NcHashmapSlot *item;
+
+        if (!self) {
+                return false;
+        }
+        item = nc_hashmap_find(self, nc_hashmap_get_hash(self, key), key, &ctrl);
+        if (!item) {
+                return false;
+        }
+
+        if (remove) {
+                if (self->key_free) {
+                        self->key_free(item->key);
+                }
+                if (self->value_free) {
+                        self->value_free(item->value);
+                }
+        }
+        self->size -= 1;
+        *ctrl = CTRL_DELETED;
+        nc_hashmap_migrate(self, MIGRATE_STEP);
+
+        return true;
+}
+
+bool nc_hashmap_steal(NcHashmap *self, const void *key)
+{
+        return nc_hashmap_remove_internal(self, key, false);
+}
+
+bool nc_hashmap_remove(NcHashmap *self, const void *key)
+{
+        return nc_hashmap_remove_internal(self, key, true);
+}
+
+bool nc_hashmap_contains(NcHashmap *self, const void *key)
+{
+        return (nc_hashmap_get(self, key)) != NULL;
+}
+
+static void nc_hashmap_free_table(NcHashmap *self, NcHashmapTable *table)
+{
+        for (unsigned i = 0; table->groups && i < table->capacity; i++) {
+                NcHashmapSlot *item = slot_item(table, i);
+
+                if (*slot_ctrl(table, i) & CTRL_EMPTY) {
+                        continue;
+                }
+                if (self->key_free) {
+                        self->key_free(item->key);
+                }
+                if (self->value_free) {
+                        self->value_free(item->value);
+                }
+        }
+        nc_hashmap_table_release(table);
+}
+
+void nc_hashmap_free(NcHashmap *self)
+{
+        if (!self) {
+                return;
+        }
+        nc_hashmap_free_table(self, &self->table);
+        nc_hashmap_free_table(self, &self->old);
+
+        free(self);
+}
+
+int nc_hashmap_size(NcHashmap *self)
+{
+        if (!self) {
+                return -1;
+        }
+        return self->size;
+}
+
+void nc_hashmap_iter_init(NcHashmap *map, NcHashmapIter *citer)
+{
+        _NcHashmapIter *iter = NULL;
+        if (!map || !citer) {
+                return;
+        }
+        iter = (_NcHashmapIter *)citer;
+        _NcHashmapIter it = {
+                .slot = -1, .map = map, .old = NULL,
+        };
+        *iter = it;
+}
+
+bool nc_hashmap_iter_next(NcHashmapIter *citer, void **key, void **value)
+{
+        _NcHashmapIter *iter = NULL;
+        NcHashmapTable *table = NULL;
+        NcHashmap *map = NULL;
+
+        if (!citer) {
+                return false;
+        }
+
+        iter = (_NcHashmapIter *)citer;
+        map = iter->map;
+        if (!map) {
+                return false;
+        }
+
+        for (;;) {
+                table = iter->old ? &map->old : &map->table;
+                iter->slot++;
+                if (!table->groups || (unsigned)iter->slot >= table->capacity) {
+                        if (iter->old) {
+                                return false;
+                        }
+                        iter->old = map;
+                        iter->slot = -1;
+                        continue;
+                }
+                if (!(*slot_ctrl(table, (unsigned)iter->slot) & CTRL_EMPTY)) {
+                        break;
+                }
+        }
+
+        if (key) {
+                *key = slot_item(table, (unsigned)iter->slot)->key;
+        }
+        if (value) {
+                *value = slot_item(table, (unsigned)iter->slot)->value;
+        }
+
+        return true;
+}
+
+/*
+ * Editor modelines  -  https://www.wireshark.org/tools/modelines.html
+ *
+ * Local variables:
+ * c-basic-offset: 8
+ * tab-width: 8
+ * indent-tabs-mode: nil
+ * End:
+ *
+ * vi: set shiftwidth=8 tabstop=8 expandtab:
+ * :indentSize=8:tabSize=8:noTabs=true:
+ */
@@ -11,6 +11,7 @@
 
 #define _GNU_SOURCE
 
+#include <limits.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -18,18 +19,95 @@
 
 #include "nc-string.h"
 
+static nc_string *nc_string_new(void)
+{
+        struct nc_string_t *st = malloc(sizeof(struct nc_string_t));
+
+        if (!st) {
+                return NULL;
+        }
+        st->str = st->inline_str;
+        st->str[0] = '\0';
+        st->len = 0;
+        st->cap = NC_STRING_INLINE_SIZE;
+
+        return st;
+}
+
+bool nc_string_reserve(nc_string *st, size_t len)
+{
+        size_t cap;
+        char *buf;
+
+        if (!st || !st->str) {
+                return false;
+        }
+        if (len < (size_t)st->cap) {
+                return true;
+        }
+        if (len >= INT_MAX) {
+                return false;
+        }
+
+        cap = (size_t)st->cap * 2;
+        if (cap <= len || cap > INT_MAX) {
+                cap = len + 1;
+        }
+        if (st->str == st->inline_str) {
+                buf = malloc(cap);
+                if (buf) {
+                        memcpy(buf, st->str, (size_t)st->len + 1);
+                }
+        } else {
+                buf = realloc(st->str, cap);
+        }
+        if (!buf) {
+                return false;
+        }
+        st->str = buf;
+        st->cap = (int)cap;
+
+        return true;
+}
+
+static nc_string *nc_string_append_vprintf(nc_string *st, const char *ptn, va_list va)
+{
+        size_t spare = (size_t)(st->cap - st->len);
+        va_list copy;
+        int ret;
+
+        va_copy(copy, va);
+        ret = vsnprintf(st->str + st->len, spare, ptn, copy);
+        va_end(copy);
+        if (ret < 0) {
+                st->str[st->len] = '\0';
+                return st;
+        }
+
+        /* Formatted again once the string got room for it */
+        if ((size_t)ret >= spare) {
+                if (!nc_string_reserve(st, (size_t)st->len + (size_t)ret)) {
+                        st->str[st->len] = '\0';
+                        return NULL;
+                }
+                vsnprintf(st->str + st->len, (size_t)ret + 1, ptn, va);
+        }
+        st->len += ret;
+
+        return st;
+}
+
 nc_string *nc_string_dup(const char *str)
 {
         if (!str) {
                 return NULL;
         }
-        struct nc_string_t *st = calloc(1, sizeof(struct nc_string_t));
+        struct nc_string_t *st = nc_string_new();
         if (!st) {
                 return NULL;
         }
-        st->len = asprintf(&st->str, "%s", str);
-        if (st->len < 0 || !st->str) {
-                free(st);
+        if (!nc_string_cat(st, str)) {
+                nc_string_free(st);
                 return NULL;
         }
         return st;
@@ -41,7 +119,7 @@ nc_string *nc_string_dup_printf(const char *ptn, ...)
                 return NULL;
         }
 
-        struct nc_string_t *st = calloc(1, sizeof(struct nc_string_t));
+        struct nc_string_t *st = nc_string_new();
         if (!st) {
                 return NULL;
         }
@@ -49,13 +127,10 @@ nc_string *nc_string_dup_printf(const char *ptn, ...)
         va_list va;
         va_start(va, ptn);
 
-        st->len = vasprintf(&st->str, ptn, va);
-        if (st->len < 0 || !st->str) {
-                free(st);
+        if (!nc_string_append_vprintf(st, ptn, va)) {
+                nc_string_free(st);
                 st = NULL;
-                goto end;
         }
-end:
         va_end(va);
 
         return st;
@@ -63,9 +138,7 @@ end:
 
 nc_string *nc_string_append_printf(nc_string *st, const char *ptn, ...)
 {
-	char *newstr;
-	char *newstr2;
-	int ret;
+        nc_string *ret;
 
         if (!ptn) {
                 return NULL;
@@ -74,24 +147,24 @@ nc_string *nc_string_append_printf(nc_string *st, const char *ptn, ...)
         va_list va;
         va_start(va, ptn);
 
-        ret = vasprintf(&newstr, ptn, va);
-	if (ret <= 0)
-		newstr = strdup("");
-
-	st->len = asprintf(&newstr2, "%s%s", st->str, newstr);
-	free(st->str);
-	st->str = newstr2;
-	free(newstr);
+        ret = nc_string_append_vprintf(st, ptn, va);
         va_end(va);
 
-        return st;
+        return ret;
 }
 
 
+/* Whether text points into the buffer of s, which growing may move */
+static inline bool nc_string_overlaps(nc_string *s, const char *text)
+{
+        return text >= s->str && text < s->str + s->cap;
+}
+
 bool nc_string_cat(nc_string *s, const char *append)
 {
-        char *p = NULL;
-        int len = 0;
+        char *copy = NULL;
+        size_t len;
+        bool ret = false;
 
         if (!s || !append) {
                 return false;
@@ -99,20 +172,24 @@ bool nc_string_cat(nc_string *s, const char *append)
         if (!s->str) {
                 return false;
         }
-        len = asprintf(&p, "%s%s", s->str, append);
-        if (!p || len < s->len) {
+        if (nc_string_overlaps(s, append) && !(append = copy = strdup(append))) {
                 return false;
         }
-        free(s->str);
-        s->str = p;
-        s->len = len;
-        return true;
+        len = strlen(append);
+        if (nc_string_reserve(s, (size_t)s->len + len)) {
+                memcpy(s->str + s->len, append, len + 1);
+                s->len += (int)len;
+                ret = true;
+        }
+        free(copy);
+        return ret;
 }
 
 bool nc_string_prepend(nc_string *s, const char *prepend)
 {
-        char *p = NULL;
-        int len = 0;
+        char *copy = NULL;
+        size_t len;
+        bool ret = false;
 
         if (!s || !prepend) {
                 return false;
@@ -120,14 +197,18 @@ bool nc_string_prepend(nc_string *s, const char *prepend)
         if (!s->str) {
                 return false;
         }
-        len = asprintf(&p, "%s%s", prepend, s->str);
-        if (!p || len < s->len) {
+        if (nc_string_overlaps(s, prepend) && !(prepend = copy = strdup(prepend))) {
                 return false;
         }
-        free(s->str);
-        s->str = p;
-        s->len = len;
-        return true;
+        len = strlen(prepend);
+        if (nc_string_reserve(s, (size_t)s->len + len)) {
+                memmove(s->str + len, s->str, (size_t)s->len + 1);
+                memcpy(s->str, prepend, len);
+                s->len += (int)len;
+                ret = true;
+        }
+        free(copy);
+        return ret;
 }
 
 /*
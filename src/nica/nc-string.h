@@ -20,12 +20,19 @@
 
 #include "macros.h"
 
+/* Strings of fewer bytes are stored in the nc_string itself */
+#define NC_STRING_INLINE_SIZE 64
+
 /**
  * Safely represent and store a buffer as a string
+ *
+ * @note str may point into the nc_string, which must not be copied by value
  */
 typedef struct nc_string_t {
         char *str; /**<Buffer holding a NUL-terminated string */
         int len;   /**<Current length of the string */
+        int cap;   /**<Size of the buffer, NUL included */
+        char inline_str[NC_STRING_INLINE_SIZE]; /**<Buffer of short strings */
 } nc_string;
 
 /**
@@ -40,9 +47,31 @@ _nica_public_ nc_string *nc_string_dup_printf(const char *format, ...)
     __attribute__((format(printf, 1, 2)));
 
 
+/**
+ * Append to a string using printf style syntax. The text is formatted
+ * directly into the spare capacity of the string when it fits, so the
+ * arguments must not point into the string itself.
+ *
+ * @param st Pointer to a valid nc_string
+ * @param ptn Printf-style format string
+ * @param ... Variable arguments
+ *
+ * @return st, or NULL if the string could not be grown
+ */
 _nica_public_ nc_string *nc_string_append_printf(nc_string *st, const char *ptn, ...)
 	__attribute__((format(printf, 2, 3)));
 
+/**
+ * Make room for a string of the given length, so that appending up to it
+ * does not allocate. The capacity otherwise doubles as the string grows.
+ *
+ * @param st Pointer to a valid nc_string
+ * @param len Length of the string to make room for, NUL excluded
+ *
+ * @return a boolean value indicating success
+ */
+_nica_public_ bool nc_string_reserve(nc_string *st, size_t len);
+
 /**
  * Duplicate a string into a new NUL-terminated nc_string
  *
@@ -61,7 +90,7 @@ static inline void nc_string_free(nc_string *str)
         if (!str) {
                 return;
         }
-        if (str->str) {
+        if (str->str && str->str != str->inline_str) {
                 free(str->str);
         }
         free(str);
@@ -19,6 +19,7 @@
 #include <getopt.h>
 #include <unistd.h>
 #include <stdbool.h>
+#include <string.h>
 #include <sys/stat.h>
 
 #include "telemetry.h"
@@ -26,6 +27,9 @@
 #include "spool.h"
 #include "configuration.h"
 #include "telempostdaemon.h"
+#include "poststate.h"
+#include "metrics.h"
+#include "membudget.h"
 
 /*
  *  Using a function pointer for unit testing to isolate the call to actual post function.
@@ -33,7 +37,10 @@
  *  using pointer to a fake function.
  */
 
-bool (*post_record_ptr)(char *[], char *, char *) = post_record_http;
+bool (*post_record_ptr)(struct staged_record *) = post_record_http;
+int (*post_batch_ptr)(struct post_batch *) = post_batch_http;
+bool (*post_destination_ptr)(struct staged_record *, struct destination *) =
+        post_record_destination;
 
 void print_usage(char *prog)
 {
@@ -48,6 +55,7 @@ int main(int argc, char **argv)
 
         int c;
         int opt_index = 0;
+        int ret;
         TelemPostDaemon daemon;
 
         struct option opts[] = {
@@ -78,9 +86,16 @@ int main(int argc, char **argv)
                 }
         }
 
+        daemon.state_file = POST_STATE_FILE;
         initialize_post_daemon(&daemon);
 
-        daemon.current_spool_size = get_spool_dir_size();
+        ret = metrics_open(METRICS_DIR "/telempostd" METRICS_SUFFIX, "telempostd");
+        if (ret < 0) {
+                telem_log(LOG_WARNING, "Unable to create the metrics page: %s\n",
+                          strerror(-ret));
+        }
+        mem_budget_init(memory_budget_config(), METRIC_POSTD_RSS_BYTES,
+                        METRIC_POSTD_HEAP_BYTES, METRIC_POSTD_MEMORY_TRIMS);
 
         /* When path activated this will process
          * the activating message or previously
@@ -92,6 +107,7 @@ int main(int argc, char **argv)
         run_daemon(&daemon);
 
         close_daemon(&daemon);
+        metrics_close();
 
         return 0;
 }
@@ -0,0 +1,225 @@
+/*
+ * This program is part of the Clear Linux Project
+ *
+ * Copyright 2018 Intel Corporation
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms and conditions of the GNU Lesser General Public License, as
+ * published by the Free Software Foundation; either version 2.1 of the License,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU Lesser General Public License for more
+ * details.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+
+#include "postbatch.h"
+#include "compress.h"
+#include "common.h"
+#include "sampling.h"
+#include "aggregate.h"
+
+void post_batch_init(struct post_batch *batch, int max_records,
+                     size_t max_size, int max_time)
+{
+        memset(batch, 0, sizeof(struct post_batch));
+        batch->max_records = max_records;
+        batch->max_size = max_size;
+        batch->max_time = max_time;
+}
+
+/* Makes room for needed more bytes in the body, plus a null byte */
+static int reserve(struct post_batch *batch, size_t needed)
+{
+        size_t n = batch->alloc ? batch->alloc : 4096;
+        char *tmp;
+
+        if (batch->size + needed < batch->alloc) {
+                return 0;
+        }
+        while (n <= batch->size + needed) {
+                n *= 2;
+        }
+        tmp = realloc(batch->body, n);
+        if (!tmp) {
+                return -ENOMEM;
+        }
+        batch->body = tmp;
+        batch->alloc = n;
+
+        return 0;
+}
+
+int post_batch_add(struct post_batch *batch, struct staged_record *record,
+                   post_done_fn fn, void *arg)
+{
+        char **headers = record->headers;
+        size_t header_len[NUM_HEADERS];
+        size_t body_len = record->body_size;
+        char length[320];
+        long sample_rate = record_sample_rate(record->headers);
+        char rate[64] = "";
+        char occurrences[160] = "";
+        size_t length_len;
+        size_t needed = 0;
+        char *pos;
+
+        for (int i = 0; i < NUM_HEADERS; i++) {
+                header_len[i] = strlen(headers[i]);
+                needed += header_len[i] + 1;
+        }
+        if (sample_rate > 1) {
+                snprintf(rate, sizeof(rate), SAMPLE_RATE_HEADER ": %ld\n", sample_rate);
+        }
+        if (record->occurrences > 0) {
+                snprintf(occurrences, sizeof(occurrences),
+                         OCCURRENCES_HEADER ": %d\n" OCCURRENCE_TIMES_HEADER ": %lld-%lld\n",
+                         record->occurrences, (long long)record->first_staged,
+                         (long long)record->last_staged);
+        }
+        length_len = (size_t)snprintf(length, sizeof(length),
+                                      "Content-Length: %zu\n%s%s%s\n", body_len,
+                                      record->compressed ? GZIP_CONTENT_ENCODING "\n" :
+                                      record->raw ? POST_BATCH_RAW_CONTENT_TYPE "\n" : "",
+                                      rate, occurrences);
+        needed += length_len + body_len + 1;
+
+        if (batch->count > 0 && batch->size + needed > batch->max_size) {
+                return -ENOSPC;
+        }
+
+        if (reserve(batch, needed) < 0) {
+                return -ENOMEM;
+        }
+        if (batch->count % 16 == 0) {
+                struct post_batch_entry *tmp;
+
+                tmp = realloc(batch->entries, (size_t)(batch->count + 16) *
+                              sizeof(struct post_batch_entry));
+                if (!tmp) {
+                        return -ENOMEM;
+                }
+                batch->entries = tmp;
+        }
+
+        pos = batch->body + batch->size;
+        for (int i = 0; i < NUM_HEADERS; i++) {
+                memcpy(pos, headers[i], header_len[i]);
+                pos += header_len[i];
+                *pos++ = '\n';
+        }
+        memcpy(pos, length, length_len);
+        pos += length_len;
+        memcpy(pos, record->body, body_len);
+        pos += body_len;
+        *pos++ = '\n';
+        *pos = '\0';
+        batch->size += needed;
+
+        if (batch->count == 0) {
+                clock_gettime(CLOCK_MONOTONIC, &batch->started);
+        }
+        batch->entries[batch->count].fn = fn;
+        batch->entries[batch->count].arg = arg;
+        batch->count++;
+
+        return 0;
+}
+
+bool post_batch_full(struct post_batch *batch)
+{
+        struct timespec now;
+        int64_t elapsed;
+
+        if (batch->count == 0) {
+                return false;
+        }
+        if (batch->count >= batch->max_records || batch->size >= batch->max_size) {
+                return true;
+        }
+
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        elapsed = (int64_t)(now.tv_sec - batch->started.tv_sec) * 1000 +
+                  (now.tv_nsec - batch->started.tv_nsec) / 1000000;
+
+        return elapsed >= batch->max_time;
+}
+
+/**
+ * Reads the status of the next record in the response
+ *
+ * @return true if the server accepted the record
+ */
+static bool next_status(const char **pos, const char *end)
+{
+        long status = 0;
+        bool digits = false;
+
+        while (*pos < end && **pos != '\n') {
+                if (**pos >= '0' && **pos <= '9' && status < 1000) {
+                        status = status * 10 + (**pos - '0');
+                        digits = true;
+                } else if (**pos != ' ' && **pos != '\r') {
+                        digits = false;
+                        status = 1000;
+                }
+                (*pos)++;
+        }
+        if (*pos < end) {
+                (*pos)++;
+        }
+
+        return digits && (status == 201 || status == 200);
+}
+
+int post_batch_complete(struct post_batch *batch, bool accepted,
+                        const char *response, size_t len)
+{
+        struct post_batch_entry *entries = batch->entries;
+        int count = batch->count;
+        const char *pos = response;
+        const char *end = response ? response + len : NULL;
+        int sent = 0;
+
+        /* Empty the batch first, the callbacks may fill it again */
+        batch->entries = NULL;
+        batch->count = 0;
+        batch->size = 0;
+
+        for (int i = 0; i < count; i++) {
+                bool ok = false;
+
+                /* Records the server did not answer for were not sent */
+                if (accepted && pos && pos < end) {
+                        ok = next_status(&pos, end);
+                }
+                if (ok) {
+                        sent++;
+                }
+                entries[i].fn(ok, entries[i].arg);
+        }
+        free(entries);
+
+        return sent;
+}
+
+void post_batch_free(struct post_batch *batch)
+{
+        free(batch->body);
+        free(batch->entries);
+        batch->body = NULL;
+        batch->entries = NULL;
+        batch->alloc = 0;
+        batch->size = 0;
+        batch->count = 0;
+}
+
+/* vi: set ts=8 sw=8 sts=4 et tw=80 cino=(0: */
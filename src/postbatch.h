@@ -0,0 +1,128 @@
+/*
+ * This program is part of the Clear Linux Project
+ *
+ * Copyright 2018 Intel Corporation
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms and conditions of the GNU Lesser General Public License, as
+ * published by the Free Software Foundation; either version 2.1 of the License,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU Lesser General Public License for more
+ * details.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <time.h>
+
+#include "postmulti.h"
+#include "iorecord.h"
+
+/*
+ * Batched POSTs: several records are framed into one request body, sent with
+ * the POST_BATCH_CONTENT_TYPE content type. Each record is framed as its
+ * header lines, a Content-Length line with the size of the payload, an empty
+ * line and the payload followed by a newline:
+ *
+ *     record_format_version: 4
+ *     classification: org.clearlinux/hello/world
+ *     ...
+ *     Content-Length: 5
+ *
+ *     hello
+ *
+ * Payloads kept compressed in the spool are framed as they are, with a
+ * Content-Encoding: gzip line after the Content-Length line.
+ * Binary payloads have a POST_BATCH_RAW_CONTENT_TYPE line there instead.
+ * Sampled records have a SAMPLE_RATE_HEADER line after those, and aggregated
+ * records OCCURRENCES_HEADER and OCCURRENCE_TIMES_HEADER lines.
+ *
+ * The server answers with one line per record, in the same order, holding
+ * the HTTP status of that record. Records without a 200 or 201 status are
+ * treated like a failed POST of that record alone.
+ */
+
+#define POST_BATCH_CONTENT_TYPE "Content-Type: application/x-telemetry-batch"
+#define POST_BATCH_COUNT_HEADER "X-Telemetry-Batch-Records"
+#define POST_BATCH_RAW_CONTENT_TYPE "Content-Type: application/octet-stream"
+
+struct post_batch_entry {
+        post_done_fn fn;
+        void *arg;
+};
+
+struct post_batch {
+        char *body;
+        size_t size;
+        size_t alloc;
+        struct post_batch_entry *entries;
+        int count;
+        /* limits the batch is sent at, and when its first record was added */
+        int max_records;
+        size_t max_size;
+        int max_time;
+        struct timespec started;
+};
+
+/**
+ * Initializes an empty batch
+ *
+ * @param batch The batch
+ * @param max_records Maximum number of records
+ * @param max_size Maximum size of the body in bytes
+ * @param max_time Maximum time in milliseconds between the first record
+ *     added and the batch being sent
+ */
+void post_batch_init(struct post_batch *batch, int max_records,
+                     size_t max_size, int max_time);
+
+/**
+ * Frames a record into the batch. The headers and body are copied.
+ *
+ * @param batch The batch
+ * @param record The record
+ * @param fn Function called with the outcome once the batch is sent
+ * @param arg Argument passed to fn
+ *
+ * @return 0 on success, -ENOSPC if the batch is not empty and the record does
+ *     not fit in it, or -ENOMEM
+ */
+int post_batch_add(struct post_batch *batch, struct staged_record *record,
+                   post_done_fn fn, void *arg);
+
+/**
+ * Checks whether a batch should be sent
+ *
+ * @param batch The batch
+ *
+ * @return true if one of the limits of the batch is reached
+ */
+bool post_batch_full(struct post_batch *batch);
+
+/**
+ * Calls the callbacks of the records in a batch that was sent, and empties
+ * it. The callbacks may add records to the batch.
+ *
+ * @param batch The batch
+ * @param accepted true if the server accepted the request
+ * @param response The status lines the server answered with, or NULL
+ * @param len Length of response
+ *
+ * @return the number of records the server accepted
+ */
+int post_batch_complete(struct post_batch *batch, bool accepted,
+                        const char *response, size_t len);
+
+/**
+ * Releases the memory of an empty batch
+ *
+ * @param batch The batch
+ */
+void post_batch_free(struct post_batch *batch);
+
+/* vi: set ts=8 sw=8 sts=4 et tw=80 cino=(0: */
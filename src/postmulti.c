@@ -0,0 +1,308 @@
+/*
+ * This program is part of the Clear Linux Project
+ *
+ * Copyright 2018 Intel Corporation
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms and conditions of the GNU Lesser General Public License, as
+ * published by the Free Software Foundation; either version 2.1 of the License,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU Lesser General Public License for more
+ * details.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+
+#include "postmulti.h"
+#include "metrics.h"
+#include "log.h"
+
+/* Longest wait in curl_multi_wait() while waiting for a free slot */
+#define POST_MULTI_WAIT 1000
+
+struct post_transfer {
+        CURL *curl;
+        struct curl_slist *headers;
+        char *key;
+        post_done_fn fn;
+        void *arg;
+        bool sent;
+        char errorbuf[CURL_ERROR_SIZE];
+        struct post_transfer *next;
+};
+
+void post_multi_init(struct post_multi *pm, int max_inflight)
+{
+        pm->multi = NULL;
+        pm->transfers = NULL;
+        pm->count = 0;
+        pm->max_inflight = max_inflight;
+}
+
+bool post_multi_enabled(struct post_multi *pm)
+{
+        return pm->max_inflight > 1;
+}
+
+bool post_multi_full(struct post_multi *pm)
+{
+        return pm->count >= pm->max_inflight;
+}
+
+bool post_request_succeeded(CURL *curl, CURLcode res, const char *errorbuf)
+{
+        long http_response = 0;
+        double total_time = 0;
+
+        curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &http_response);
+        curl_easy_getinfo(curl, CURLINFO_TOTAL_TIME, &total_time);
+
+        metrics_observe(METRIC_POSTD_POST_TIME, (uint64_t)(total_time * 1e9));
+        if (http_response >= 200 && http_response < 600) {
+                metrics_count((enum metric_counter)(METRIC_POSTD_HTTP_2XX +
+                                                    http_response / 100 - 2), 1);
+        } else {
+                metrics_count(METRIC_POSTD_HTTP_ERRORS, 1);
+        }
+        metrics_count(!res && (http_response == 201 || http_response == 200) ?
+                      METRIC_POSTD_POSTS_SENT : METRIC_POSTD_POSTS_FAILED, 1);
+
+        if (res) {
+                size_t len = strlen(errorbuf);
+                if (len) {
+                        telem_log(LOG_DEBUG, "Failed sending record: %s%s", errorbuf,
+                                  ((errorbuf[len - 1] != '\n') ? "\n" : ""));
+                } else {
+                        telem_log(LOG_DEBUG, "Failed sending record: %s\n",
+                                  curl_easy_strerror(res));
+                }
+                return false;
+        } else if (http_response != 201 && http_response != 200) {
+                /*  201 means the record was  successfully created
+                 *  200 is a generic "ok".
+                 */
+                telem_log(LOG_ERR, "Encountered error %ld on the server\n",
+                          http_response);
+                // We treat HTTP error codes the same as libcurl errors
+                return false;
+        }
+
+        telem_log(LOG_INFO, "Record sent successfully\n");
+
+        return true;
+}
+
+static void free_transfer(struct post_transfer *t)
+{
+        curl_easy_cleanup(t->curl);
+        curl_slist_free_all(t->headers);
+        free(t->key);
+        free(t);
+}
+
+/**
+ * Makes progress on the transfers and calls the completion callback of those
+ * that completed. The callbacks may add new transfers.
+ */
+static void post_multi_perform(struct post_multi *pm)
+{
+        struct post_transfer *done = NULL;
+        struct post_transfer *t, **prev;
+        CURLMsg *msg;
+        int running = 0;
+        int left = 0;
+
+        curl_multi_perform(pm->multi, &running);
+
+        while ((msg = curl_multi_info_read(pm->multi, &left)) != NULL) {
+                if (msg->msg != CURLMSG_DONE) {
+                        continue;
+                }
+
+                for (prev = &pm->transfers; (t = *prev) != NULL; prev = &t->next) {
+                        if (t->curl == msg->easy_handle) {
+                                break;
+                        }
+                }
+                if (!t) {
+                        continue;
+                }
+                *prev = t->next;
+                pm->count--;
+
+                /* msg is only valid until the handle is removed */
+                t->sent = post_request_succeeded(t->curl, msg->data.result,
+                                                 t->errorbuf);
+                curl_multi_remove_handle(pm->multi, t->curl);
+                t->next = done;
+                done = t;
+        }
+
+        while ((t = done) != NULL) {
+                done = t->next;
+                t->fn(t->sent, t->arg);
+                free_transfer(t);
+        }
+}
+
+int post_multi_add(struct post_multi *pm, CURL *curl, struct curl_slist *headers,
+                   const char *key, post_done_fn fn, void *arg)
+{
+        struct post_transfer *t;
+
+        if (!pm->multi) {
+                curl_global_init(CURL_GLOBAL_ALL);
+                pm->multi = curl_multi_init();
+                if (!pm->multi) {
+                        telem_log(LOG_ERR, "curl_multi_init(): Unable to start libcurl"
+                                  " multi session\n");
+                        curl_global_cleanup();
+                        goto fail;
+                }
+                curl_multi_setopt(pm->multi, CURLMOPT_MAX_TOTAL_CONNECTIONS,
+                                  (long)pm->max_inflight);
+        }
+
+        while (post_multi_full(pm)) {
+                curl_multi_wait(pm->multi, NULL, 0, POST_MULTI_WAIT, NULL);
+                post_multi_perform(pm);
+        }
+
+        t = calloc(1, sizeof(struct post_transfer));
+        if (!t) {
+                goto fail;
+        }
+        if (key && !(t->key = strdup(key))) {
+                free(t);
+                goto fail;
+        }
+        t->curl = curl;
+        t->headers = headers;
+        t->fn = fn;
+        t->arg = arg;
+        curl_easy_setopt(curl, CURLOPT_ERRORBUFFER, t->errorbuf);
+
+        if (curl_multi_add_handle(pm->multi, curl) != CURLM_OK) {
+                free(t->key);
+                free(t);
+                goto fail;
+        }
+        t->next = pm->transfers;
+        pm->transfers = t;
+        pm->count++;
+
+        return 0;
+fail:
+        curl_easy_cleanup(curl);
+        curl_slist_free_all(headers);
+        return -ENOMEM;
+}
+
+bool post_multi_pending(struct post_multi *pm, const char *key)
+{
+        for (struct post_transfer *t = pm->transfers; t; t = t->next) {
+                if (t->key && strcmp(t->key, key) == 0) {
+                        return true;
+                }
+        }
+
+        return false;
+}
+
+static int time_left(const struct timespec *deadline)
+{
+        struct timespec now;
+        int64_t left;
+
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        left = (int64_t)(deadline->tv_sec - now.tv_sec) * 1000 +
+               (deadline->tv_nsec - now.tv_nsec) / 1000000;
+
+        return (left < 0) ? 0 : (int)left;
+}
+
+int post_multi_poll(struct post_multi *pm, struct pollfd *fds, nfds_t nfds,
+                    int timeout)
+{
+        struct curl_waitfd waitfds[nfds];
+        struct timespec deadline;
+        int left = timeout;
+        int ready;
+
+        if (timeout >= 0) {
+                clock_gettime(CLOCK_MONOTONIC, &deadline);
+                deadline.tv_sec += timeout / 1000;
+                deadline.tv_nsec += (long)(timeout % 1000) * 1000000;
+                if (deadline.tv_nsec >= 1000000000) {
+                        deadline.tv_sec++;
+                        deadline.tv_nsec -= 1000000000;
+                }
+        }
+
+        while (pm->count > 0) {
+                for (nfds_t i = 0; i < nfds; i++) {
+                        waitfds[i].fd = fds[i].fd;
+                        waitfds[i].events = (short)(((fds[i].events & POLLIN) ? CURL_WAIT_POLLIN : 0) |
+                                                    ((fds[i].events & POLLPRI) ? CURL_WAIT_POLLPRI : 0) |
+                                                    ((fds[i].events & POLLOUT) ? CURL_WAIT_POLLOUT : 0));
+                        waitfds[i].revents = 0;
+                }
+
+                /* Returns early once a transfer needs attention */
+                if (curl_multi_wait(pm->multi, waitfds, (unsigned int)nfds,
+                                    (left < 0) ? POST_MULTI_WAIT : left, NULL) != CURLM_OK) {
+                        errno = EIO;
+                        return -1;
+                }
+                post_multi_perform(pm);
+
+                ready = 0;
+                for (nfds_t i = 0; i < nfds; i++) {
+                        fds[i].revents = (short)(((waitfds[i].revents & CURL_WAIT_POLLIN) ? POLLIN : 0) |
+                                                 ((waitfds[i].revents & CURL_WAIT_POLLPRI) ? POLLPRI : 0) |
+                                                 ((waitfds[i].revents & CURL_WAIT_POLLOUT) ? POLLOUT : 0));
+                        if (fds[i].revents != 0) {
+                                ready++;
+                        }
+                }
+                if (ready > 0) {
+                        return ready;
+                }
+
+                if (timeout >= 0) {
+                        left = time_left(&deadline);
+                        if (left == 0) {
+                                return 0;
+                        }
+                }
+        }
+
+        return poll(fds, nfds, (timeout >= 0) ? time_left(&deadline) : -1);
+}
+
+void post_multi_wait_all(struct post_multi *pm)
+{
+        while (pm->count > 0) {
+                curl_multi_wait(pm->multi, NULL, 0, POST_MULTI_WAIT, NULL);
+                post_multi_perform(pm);
+        }
+}
+
+void post_multi_cleanup(struct post_multi *pm)
+{
+        if (pm->multi && pm->count == 0) {
+                curl_multi_cleanup(pm->multi);
+                pm->multi = NULL;
+                curl_global_cleanup();
+        }
+}
+
+/* vi: set ts=8 sw=8 sts=4 et tw=80 cino=(0: */
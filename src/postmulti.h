@@ -0,0 +1,144 @@
+/*
+ * This program is part of the Clear Linux Project
+ *
+ * Copyright 2018 Intel Corporation
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms and conditions of the GNU Lesser General Public License, as
+ * published by the Free Software Foundation; either version 2.1 of the License,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU Lesser General Public License for more
+ * details.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <poll.h>
+#include <curl/curl.h>
+
+/*
+ * Concurrent POSTs: up to max_inflight_posts transfers run at once on a curl
+ * multi handle, which also keeps the connections to the server between
+ * records. Transfers make progress while the daemon waits for its own file
+ * descriptors in post_multi_poll(), and a completion callback is called for
+ * each of them with the outcome.
+ */
+
+/**
+ * Called once a POST completes
+ *
+ * @param sent true if the server accepted the record
+ * @param arg Argument passed to post_multi_add
+ */
+typedef void (*post_done_fn)(bool sent, void *arg);
+
+struct post_transfer;
+
+struct post_multi {
+        /* created with the first transfer, NULL while idle */
+        CURLM *multi;
+        struct post_transfer *transfers;
+        int count;
+        int max_inflight;
+};
+
+/**
+ * Initializes the transfer engine
+ *
+ * @param pm The engine
+ * @param max_inflight Maximum number of concurrent transfers
+ */
+void post_multi_init(struct post_multi *pm, int max_inflight);
+
+/**
+ * Checks whether records should be sent through the engine rather than with
+ * a blocking POST
+ *
+ * @param pm The engine
+ *
+ * @return true if more than one transfer may run at once
+ */
+bool post_multi_enabled(struct post_multi *pm);
+
+/**
+ * Checks whether all transfer slots are in use
+ *
+ * @param pm The engine
+ *
+ * @return true if adding a transfer will wait for another one to complete
+ */
+bool post_multi_full(struct post_multi *pm);
+
+/**
+ * Starts a transfer. If all slots are in use, runs the transfers until one
+ * completes first.
+ *
+ * @param pm The engine
+ * @param curl Easy handle with the POST options set, owned by the engine
+ * @param headers Headers set on the handle, freed with the handle
+ * @param key Name of the record being sent, or NULL
+ * @param fn Function called once the transfer completes
+ * @param arg Argument passed to fn
+ *
+ * @return 0 on success, or a negative errno-style value on error, in which
+ *     case fn is not called and the handle is released
+ */
+int post_multi_add(struct post_multi *pm, CURL *curl, struct curl_slist *headers,
+                   const char *key, post_done_fn fn, void *arg);
+
+/**
+ * Checks whether a record is being sent
+ *
+ * @param pm The engine
+ * @param key Name the record was added with
+ *
+ * @return true if a transfer for key is in flight
+ */
+bool post_multi_pending(struct post_multi *pm, const char *key);
+
+/**
+ * Waits like poll(), running the transfers in the meantime. Completion
+ * callbacks are called from here.
+ *
+ * @param pm The engine
+ * @param fds File descriptors to wait for
+ * @param nfds Number of entries in fds
+ * @param timeout Maximum time to wait in milliseconds, or -1
+ *
+ * @return the number of entries in fds with events, 0 on timeout, or -1 on
+ *     error with errno set
+ */
+int post_multi_poll(struct post_multi *pm, struct pollfd *fds, nfds_t nfds,
+                    int timeout);
+
+/**
+ * Runs the transfers until all of them completed
+ *
+ * @param pm The engine
+ */
+void post_multi_wait_all(struct post_multi *pm);
+
+/**
+ * Releases the multi handle and the connections it keeps, if no transfer
+ * is running
+ *
+ * @param pm The engine
+ */
+void post_multi_cleanup(struct post_multi *pm);
+
+/**
+ * Logs the outcome of a completed POST
+ *
+ * @param curl The easy handle
+ * @param res Result of the transfer
+ * @param errorbuf Error buffer set on the handle
+ *
+ * @return true if the server accepted the record
+ */
+bool post_request_succeeded(CURL *curl, CURLcode res, const char *errorbuf);
+
+/* vi: set ts=8 sw=8 sts=4 et tw=80 cino=(0: */
@@ -0,0 +1,347 @@
+/*
+ * This program is part of the Clear Linux Project
+ *
+ * Copyright 2019 Intel Corporation
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms and conditions of the GNU Lesser General Public License, as
+ * published by the Free Software Foundation; either version 2.1 of the License,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU Lesser General Public License for more
+ * details.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "log.h"
+#include "telempostdaemon.h"
+#include "poststate.h"
+
+#define POST_STATE_MAGIC "TMPOSTS\2"
+/* A spool index of a few million records, anything larger is not one */
+#define POST_STATE_MAX_SIZE (256 * 1024 * 1024)
+
+/*
+ * Layout of the state file, in the byte order of the host. The entries of
+ * the spool index follow the header, each followed by its name, in the
+ * order of the index.
+ */
+struct post_state_header {
+        char magic[8];
+        uint64_t size;
+        uint64_t entries;
+        /* when the state was written */
+        int64_t saved;
+        /* the spool directory the index is of */
+        uint64_t spool_dev;
+        uint64_t spool_ino;
+        int64_t spool_mtime_sec;
+        int64_t spool_mtime_nsec;
+        uint64_t spool_seq;
+        /* space the records take, see struct spool_usage */
+        int64_t spool_bytes;
+        /* retry scheduler */
+        int32_t retry_state;
+        int32_t retry_failures;
+        int64_t retry_at;
+        int32_t drain_limit;
+        int32_t ramp_interval;
+        uint32_t draining;
+        uint32_t reserved;
+        /* rate limit windows, by minute of the hour */
+        uint64_t record_burst[TM_RATE_LIMIT_SLOTS];
+        uint64_t byte_burst[TM_RATE_LIMIT_SLOTS];
+};
+
+struct post_state_entry {
+        int64_t mtime;
+        int64_t disk_size;
+        uint64_t seq;
+        int32_t priority;
+        /* length of the name that follows, not null terminated */
+        uint32_t name_length;
+};
+
+static int write_state_file(const char *path, const char *buf, size_t size)
+{
+        char *tmppath = NULL;
+        ssize_t written;
+        int ret = 0;
+        int fd;
+
+        /* Written aside and renamed, a later run never reads half of one */
+        if (asprintf(&tmppath, "%s.XXXXXX", path) < 0) {
+                return -ENOMEM;
+        }
+        fd = mkostemp(tmppath, O_CLOEXEC);
+        if (fd < 0) {
+                ret = -errno;
+                goto out;
+        }
+        for (size_t offset = 0; ret == 0 && offset < size; offset += (size_t)written) {
+                written = write(fd, buf + offset, size - offset);
+                if (written < 0 && errno != EINTR) {
+                        ret = -errno;
+                } else if (written < 0) {
+                        written = 0;
+                }
+        }
+        if (close(fd) != 0 && ret == 0) {
+                ret = -errno;
+        }
+        if (ret == 0 && rename(tmppath, path) != 0) {
+                ret = -errno;
+        }
+        if (ret < 0) {
+                unlink(tmppath);
+        }
+out:
+        free(tmppath);
+
+        return ret;
+}
+
+int post_state_save(TelemPostDaemon *daemon, const char *path, const char *spool_dir)
+{
+        struct spool_index *index = &daemon->spool_index;
+        struct retry_sched *sched = &daemon->retry_sched;
+        struct post_state_header *header;
+        size_t size = sizeof(struct post_state_header);
+        struct stat sbuf;
+        char *buf, *pos;
+        int ret;
+
+        if (stat(spool_dir, &sbuf) != 0) {
+                return -errno;
+        }
+        for (size_t i = 0; i < index->count; i++) {
+                size += sizeof(struct post_state_entry) + strlen(index->entries[i].name);
+        }
+        if (size > POST_STATE_MAX_SIZE) {
+                return -E2BIG;
+        }
+
+        buf = calloc(1, size);
+        if (!buf) {
+                return -ENOMEM;
+        }
+        header = (struct post_state_header *)buf;
+        memcpy(header->magic, POST_STATE_MAGIC, sizeof(header->magic));
+        header->size = size;
+        header->entries = index->count;
+        header->saved = (int64_t)time(NULL);
+        header->spool_dev = (uint64_t)sbuf.st_dev;
+        header->spool_ino = (uint64_t)sbuf.st_ino;
+        header->spool_mtime_sec = (int64_t)sbuf.st_mtim.tv_sec;
+        header->spool_mtime_nsec = (int64_t)sbuf.st_mtim.tv_nsec;
+        header->spool_seq = index->seq;
+        header->spool_bytes = daemon->spool_usage.bytes;
+        header->retry_state = (int32_t)sched->state;
+        header->retry_failures = sched->failures;
+        header->retry_at = (int64_t)sched->retry_at;
+        header->drain_limit = sched->drain_limit;
+        header->ramp_interval = sched->ramp_interval;
+        header->draining = sched->draining;
+        for (int i = 0; i < TM_RATE_LIMIT_SLOTS; i++) {
+                header->record_burst[i] = daemon->record_burst_array[i];
+                header->byte_burst[i] = daemon->byte_burst_array[i];
+        }
+
+        pos = buf + sizeof(struct post_state_header);
+        for (size_t i = 0; i < index->count; i++) {
+                struct spool_entry *entry = &index->entries[i];
+                struct post_state_entry state_entry;
+
+                state_entry.mtime = (int64_t)entry->mtime;
+                state_entry.disk_size = entry->disk_size;
+                state_entry.seq = entry->seq;
+                state_entry.priority = entry->priority;
+                state_entry.name_length = (uint32_t)strlen(entry->name);
+                memcpy(pos, &state_entry, sizeof(state_entry));
+                pos += sizeof(state_entry);
+                memcpy(pos, entry->name, state_entry.name_length);
+                pos += state_entry.name_length;
+        }
+
+        ret = write_state_file(path, buf, size);
+        free(buf);
+
+        return ret;
+}
+
+/* Reads the entries of the spool index that follow the header */
+static bool read_state_index(const char *buf, size_t size, uint64_t entries,
+                             struct spool_index *index)
+{
+        const char *pos = buf + sizeof(struct post_state_header);
+        const char *end = buf + size;
+
+        for (uint64_t i = 0; i < entries; i++) {
+                struct post_state_entry state_entry;
+                struct spool_entry entry;
+
+                if ((size_t)(end - pos) < sizeof(state_entry)) {
+                        return false;
+                }
+                memcpy(&state_entry, pos, sizeof(state_entry));
+                pos += sizeof(state_entry);
+                if (state_entry.name_length == 0 ||
+                    state_entry.name_length > (size_t)(end - pos) ||
+                    state_entry.priority < 0 || state_entry.priority >= TM_PRIORITY_CLASSES) {
+                        return false;
+                }
+                entry.name = strndup(pos, state_entry.name_length);
+                if (!entry.name) {
+                        telem_log(LOG_ERR, "Unable to allocate memory, exiting\n");
+                        exit(EXIT_FAILURE);
+                }
+                pos += state_entry.name_length;
+                if (strlen(entry.name) != state_entry.name_length ||
+                    strchr(entry.name, '/') || entry.name[0] == '.') {
+                        free(entry.name);
+                        return false;
+                }
+                entry.mtime = (time_t)state_entry.mtime;
+                entry.disk_size = (long)state_entry.disk_size;
+                entry.priority = state_entry.priority;
+                entry.seq = state_entry.seq;
+                spool_index_push(index, &entry);
+        }
+
+        return pos == end;
+}
+
+/*
+ * Restores a rate limit window, without the counts of the minutes that
+ * elapsed since it was saved
+ */
+static void restore_window(size_t *array, const uint64_t *saved, time_t saved_at,
+                           time_t now)
+{
+        int64_t elapsed = (int64_t)(now / 60) - (int64_t)(saved_at / 60);
+        struct tm tm;
+
+        if (elapsed < 0 || elapsed >= TM_RATE_LIMIT_SLOTS ||
+            localtime_r(&saved_at, &tm) == NULL) {
+                return;
+        }
+        for (int i = 0; i < TM_RATE_LIMIT_SLOTS; i++) {
+                array[i] = (size_t)saved[i];
+        }
+        for (int64_t i = 1; i <= elapsed; i++) {
+                array[(tm.tm_min + i) % TM_RATE_LIMIT_SLOTS] = 0;
+        }
+}
+
+bool post_state_load(TelemPostDaemon *daemon, const char *path, const char *spool_dir)
+{
+        struct retry_sched *sched = &daemon->retry_sched;
+        struct post_state_header header;
+        struct spool_index index;
+        struct stat sbuf, dir;
+        char *buf = NULL;
+        bool ret = false;
+        bool changed;
+        ssize_t len = 0;
+        int fd;
+
+        fd = open(path, O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+                return false;
+        }
+        /* The state is only good for the run after the one that wrote it */
+        unlink(path);
+        if (fstat(fd, &sbuf) != 0 || sbuf.st_size < (off_t)sizeof(header) ||
+            sbuf.st_size > POST_STATE_MAX_SIZE) {
+                close(fd);
+                return false;
+        }
+        buf = malloc((size_t)sbuf.st_size);
+        if (buf) {
+                len = pread(fd, buf, (size_t)sbuf.st_size, 0);
+        }
+        close(fd);
+        if (len != sbuf.st_size) {
+                free(buf);
+                return false;
+        }
+        memcpy(&header, buf, sizeof(header));
+
+        spool_index_init(&index);
+        if (memcmp(header.magic, POST_STATE_MAGIC, sizeof(header.magic)) != 0 ||
+            header.size != (uint64_t)sbuf.st_size || header.spool_bytes < 0 ||
+            header.retry_state < RETRY_CLOSED || header.retry_state > RETRY_HALF_OPEN ||
+            stat(spool_dir, &dir) != 0 || !S_ISDIR(dir.st_mode) ||
+            header.spool_dev != (uint64_t)dir.st_dev ||
+            header.spool_ino != (uint64_t)dir.st_ino) {
+                goto out;
+        }
+        if (!read_state_index(buf, (size_t)sbuf.st_size, header.entries, &index)) {
+                telem_log(LOG_WARNING, "Invalid state file %s, ignoring it\n", path);
+                goto out;
+        }
+        index.seq = header.spool_seq;
+
+        /* Records were added to or removed from the spool meanwhile */
+        changed = header.spool_mtime_sec != (int64_t)dir.st_mtim.tv_sec ||
+                  header.spool_mtime_nsec != (int64_t)dir.st_mtim.tv_nsec;
+        if (changed) {
+                int added = spool_index_reconcile(&index, &daemon->unindexed, spool_dir);
+
+                if (added < 0) {
+                        telem_log(LOG_ERR, "Error while scanning spool: %s\n",
+                                  strerror(-added));
+                        spool_index_free(&daemon->unindexed);
+                        goto out;
+                }
+                telem_log(LOG_DEBUG, "%d records added to the spool\n", added);
+        }
+
+        spool_index_free(&daemon->spool_index);
+        daemon->spool_index = index;
+        spool_index_init(&index);
+        /* The records added meanwhile are counted as they are processed */
+        if (changed) {
+                spool_usage_init(&daemon->spool_usage,
+                                 spool_index_disk_size(&daemon->spool_index));
+        } else {
+                spool_usage_init(&daemon->spool_usage, (long)header.spool_bytes);
+        }
+
+        restore_window(daemon->record_burst_array, header.record_burst,
+                       (time_t)header.saved, time(NULL));
+        restore_window(daemon->byte_burst_array, header.byte_burst,
+                       (time_t)header.saved, time(NULL));
+
+        /* A probe of a half open breaker was not sent */
+        sched->state = (enum retry_state)header.retry_state;
+        sched->failures = header.retry_failures;
+        sched->retry_at = (time_t)header.retry_at;
+        sched->probing = false;
+        sched->drain_limit = header.drain_limit;
+        retry_sched_set_drain_bounds(sched, sched->drain_min, sched->drain_max);
+        sched->draining = header.draining != 0;
+        if (header.ramp_interval > 0) {
+                sched->ramp_interval = header.ramp_interval;
+        }
+        ret = true;
+out:
+        spool_index_free(&index);
+        free(buf);
+
+        return ret;
+}
+
+/* vi: set ts=8 sw=8 sts=4 et tw=80 cino=(0: */
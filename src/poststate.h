@@ -0,0 +1,63 @@
+/*
+ * This program is part of the Clear Linux Project
+ *
+ * Copyright 2019 Intel Corporation
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms and conditions of the GNU Lesser General Public License, as
+ * published by the Free Software Foundation; either version 2.1 of the License,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU Lesser General Public License for more
+ * details.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+
+struct TelemPostDaemon;
+
+/*
+ * Warm state of telempostd, written as it exits and read back by the next
+ * run, so that a daemon restarted by path activation after exiting for
+ * recycling goes straight to delivery: the spool index and its size, the
+ * rate limit windows and the state of the retry scheduler. The spool index
+ * is used as it is if the spool directory was not modified since, and is
+ * otherwise checked against the file names of the directory, reading only
+ * the records added. The state is removed once read, and ignored if not
+ * written for the same spool directory.
+ */
+#define POST_STATE_FILE LOCALSTATEDIR "/lib/telemetry/telempostd.state"
+
+/**
+ * Writes the warm state of a daemon
+ *
+ * @param daemon a pointer to telemetry post daemon
+ * @param path The state file
+ * @param spool_dir The spool directory the index is of
+ *
+ * @return 0 on success, or a negative errno value
+ */
+int post_state_save(struct TelemPostDaemon *daemon, const char *path,
+                    const char *spool_dir);
+
+/**
+ * Reads the warm state of a previous run into a daemon, replacing its spool
+ * index, spool size, rate limit windows and retry scheduler state. The
+ * records found in the spool directory that the state does not index are
+ * put in daemon->unindexed. The state file is removed.
+ *
+ * @param daemon a pointer to telemetry post daemon, initialized
+ * @param path The state file
+ * @param spool_dir The spool directory
+ *
+ * @return true if the state was read, false if there is no valid state for
+ *     the spool directory, the daemon is then left alone
+ */
+bool post_state_load(struct TelemPostDaemon *daemon, const char *path,
+                     const char *spool_dir);
+
+/* vi: set ts=8 sw=8 sts=4 et tw=80 cino=(0: */
@@ -29,11 +29,16 @@
 #include <unistd.h>
 #include <sys/signalfd.h>
 #include <signal.h>
-#include <malloc.h>
+#include <string.h>
+#include <pthread.h>
+#include <locale.h>
 
 #include "telemetry.h"
 #include "config.h"
 #include "common.h"
+#ifdef HAVE_SYS_EPOLL_H
+#include <sys/epoll.h>
+#endif
 #ifdef  HAVE_SYSTEMD_SD_DAEMON_H
 
 /* Certain static analysis tools do not understand GCC's __INCLUDE_LEVEL__
@@ -49,7 +54,12 @@
 #endif
 #include "log.h"
 #include "telemdaemon.h"
+#include "staginglog.h"
 #include "configuration.h"
+#include "configwatch.h"
+#include "heartbeat.h"
+#include "membudget.h"
+#include "metrics.h"
 
 void print_usage(char *prog)
 {
@@ -59,19 +69,639 @@ void print_usage(char *prog)
         printf("  -V,  --version        Print the program version\n");
 }
 
+struct probe_worker;
+
+/* Event loop state shared by the epoll and poll backends */
+struct probe_loop {
+        TelemDaemon *daemon;
+        /* -1 in worker threads, signals are handled by the main thread */
+        int sigfd;
+        /* listening socket, or the handoff pipe in worker threads */
+        int sockfd;
+        /* configuration files, fd -1 if not watched or in worker threads */
+        struct config_watch watch;
+        bool daemon_recycling_enabled;
+        int spool_process_time;
+        time_t last_record_received;
+        time_t last_refresh_time;
+        /* worker threads clients are handed to, NULL to handle them here */
+        struct probe_worker *workers;
+        int nworkers;
+        int next_worker;
+        bool is_worker;
+        /* configuration reader of a worker thread, -1 in the main thread */
+        int config_reader;
+        /* set once the main thread closed the handoff pipe */
+        bool stopped;
+        /* seconds between heartbeats, 0 when they are left to hprobe */
+        int heartbeat_interval;
+        unsigned heartbeat_options;
+        time_t next_heartbeat;
+        /* locale of the environment the daemon was started in */
+        char *heartbeat_locale;
+};
+
+/* A worker thread, with its own client list and staging shard */
+struct probe_worker {
+        TelemDaemon daemon;
+        pthread_t thread;
+        /* accepted connections are written to pipefd[1] by the main thread */
+        int pipefd[2];
+        int spool_process_time;
+};
+
+/* Reads when the last heartbeat was staged, 0 if never */
+static time_t read_heartbeat_time(void)
+{
+        long long last = 0;
+        FILE *fp;
+
+        fp = fopen(HEARTBEAT_STATE_FILE, "r");
+        if (!fp) {
+                return 0;
+        }
+        if (fscanf(fp, "%lld", &last) != 1) {
+                last = 0;
+        }
+        fclose(fp);
+
+        return (time_t)last;
+}
+
+static void write_heartbeat_time(time_t now)
+{
+        FILE *fp;
+
+        fp = fopen(HEARTBEAT_STATE_FILE, "w");
+        if (!fp) {
+                telem_perror("Failed to open heartbeat state file");
+                return;
+        }
+        fprintf(fp, "%lld\n", (long long)now);
+        if (fclose(fp) != 0) {
+                telem_perror("Failed to write heartbeat state file");
+        }
+}
+
+/**
+ * Read the heartbeat settings from the configuration, and schedule the next
+ * heartbeat an interval after the last one staged, by this daemon or a
+ * previous one.
+ */
+static void configure_heartbeat(struct probe_loop *loop)
+{
+        time_t now = time(NULL);
+        time_t last;
+
+        loop->heartbeat_interval = heartbeat_interval_config();
+        loop->heartbeat_options = parse_heartbeat_options(heartbeat_payload_config());
+        if (loop->heartbeat_interval == 0) {
+                return;
+        }
+
+        last = read_heartbeat_time();
+        if (last <= 0 || last > now) {
+                loop->next_heartbeat = now;
+        } else {
+                loop->next_heartbeat = last + loop->heartbeat_interval;
+        }
+        telem_log(LOG_INFO, "Staging a heartbeat every %d seconds\n",
+                  loop->heartbeat_interval);
+}
+
+/* Stage a heartbeat record, without the socket round trip of hprobe */
+static void send_heartbeat(struct probe_loop *loop, time_t now)
+{
+        struct telem_ref *handle = NULL;
+        struct stat unused;
+        char *payload;
+        int ret;
+
+        if (stat(TM_OPT_OUT_FILE, &unused) == 0) {
+                return;
+        }
+
+        payload = create_heartbeat_payload(loop->heartbeat_options,
+                                           loop->heartbeat_locale);
+        if (!payload) {
+                telem_log(LOG_ERR, "Failed to create heartbeat payload\n");
+                return;
+        }
+
+        if ((ret = tm_create_record(&handle, HEARTBEAT_SEVERITY,
+                                    HEARTBEAT_CLASSIFICATION,
+                                    HEARTBEAT_PAYLOAD_VERSION)) < 0) {
+                telem_log(LOG_ERR, "Failed to create heartbeat record: %s\n",
+                          strerror(-ret));
+                free(payload);
+                return;
+        }
+
+        if ((ret = tm_set_payload(handle, payload)) < 0) {
+                telem_log(LOG_ERR, "Failed to set heartbeat payload: %s\n",
+                          strerror(-ret));
+        } else {
+                stage_local_record(loop->daemon, handle);
+                write_heartbeat_time(now);
+                telem_log(LOG_INFO, "Heartbeat staged\n");
+        }
+
+        free(payload);
+        tm_free_record(handle);
+}
+
+/**
+ * Write the configuration snapshot that short-lived probes read instead of
+ * parsing the configuration file.
+ */
+static void publish_config_snapshot(void)
+{
+        int ret = write_config_snapshot();
+
+        if (ret < 0) {
+                telem_log(LOG_WARNING, "Unable to write configuration snapshot: %s\n",
+                          strerror(-ret));
+        }
+}
+
+/**
+ * Reload the configuration, and apply what changed to the loop. The socket,
+ * the staging options and the worker threads keep their settings until a
+ * restart.
+ */
+static void reload_loop_config(struct probe_loop *loop)
+{
+        if (!reload_probe_config()) {
+                return;
+        }
+        publish_config_snapshot();
+        configure_heartbeat(loop);
+        loop->daemon_recycling_enabled = daemon_recycling_enabled_config();
+        loop->spool_process_time = spool_process_time_config();
+        mem_budget_set_limit(memory_budget_config());
+        telem_log(LOG_INFO, "Configuration reloaded\n");
+}
+
+/**
+ * Read a signal from the signal fd.
+ *
+ * @return false if the daemon should exit, true otherwise
+ */
+static bool handle_signal(struct probe_loop *loop)
+{
+        struct signalfd_siginfo fdsi;
+        ssize_t s;
+
+        s = read(loop->sigfd, &fdsi, sizeof(struct signalfd_siginfo));
+        if (s != sizeof(struct signalfd_siginfo)) {
+                telem_perror("Error while reading from the signal"
+                             "file descriptor");
+                exit(EXIT_FAILURE);
+        }
+
+        if (fdsi.ssi_signo == SIGTERM || fdsi.ssi_signo == SIGINT) {
+                telem_log(LOG_INFO, "Received either a "
+                                     "SIGINT/SIGTERM signal\n");
+                return false;
+        }
+
+        if (fdsi.ssi_signo == SIGHUP) {
+                telem_log(LOG_INFO, "Received a SIGHUP signal\n");
+                reload_loop_config(loop);
+        }
+
+        return true;
+}
+
+/**
+ * Accept a connection on the listening socket and add it to the client list.
+ *
+ * @return the new client, or NULL if no connection could be accepted
+ */
+static client *accept_client(struct probe_loop *loop)
+{
+        client *cl;
+        ssize_t len;
+        int fd;
+
+        if (loop->is_worker) {
+                /* Connection accepted by the main thread */
+                len = read(loop->sockfd, &fd, sizeof(fd));
+                if (len == 0) {
+                        loop->stopped = true;
+                        return NULL;
+                } else if (len != sizeof(fd)) {
+                        telem_perror("Failed to read connection from main thread");
+                        return NULL;
+                }
+        } else {
+                if ((fd = accept(loop->sockfd, NULL, NULL)) == -1) {
+                        telem_perror("Failed to accept socket");
+                        return NULL;
+                }
+                telem_log(LOG_INFO, "New client %d connected\n", fd);
+
+                /* set socket to non-blocking */
+                if (fcntl(fd, F_SETFL, O_NONBLOCK)) {
+                        telem_perror("Failed to set socket as nonblocking");
+                        close(fd);
+                        return NULL;
+                }
+        }
+
+        if (loop->workers) {
+                struct probe_worker *worker = &loop->workers[loop->next_worker];
+
+                /* Spread connections over the workers */
+                loop->next_worker = (loop->next_worker + 1) % loop->nworkers;
+                loop->last_record_received = time(NULL);
+                if (write(worker->pipefd[1], &fd, sizeof(fd)) != sizeof(fd)) {
+                        telem_perror("Failed to hand connection to worker");
+                        close(fd);
+                }
+                return NULL;
+        }
+
+        /* Add the fd to the client list */
+        if (!(cl = add_client(&(loop->daemon->client_head), fd))) {
+                telem_log(LOG_ERR, "Unable to add the client to list\n");
+                exit(EXIT_FAILURE);
+        }
+
+        return cl;
+}
+
+/**
+ * Housekeeping done once per loop iteration. idle is true when the wait
+ * for events timed out.
+ *
+ * @return false if the daemon should exit, true otherwise
+ */
+static bool handle_timers(struct probe_loop *loop, bool idle)
+{
+        time_t now = time(NULL);
+
+        if (idle) {
+                /* Nothing happened for a while, give memory back */
+                trim_probe_daemon(loop->daemon);
+
+                /* time to recycle the daemon has elapsed, heartbeats
+                 * need the daemon to stay */
+                if (loop->daemon_recycling_enabled && loop->heartbeat_interval == 0 &&
+                    difftime(now, loop->last_record_received) >= TM_DAEMON_EXIT_TIME) {
+                        /* Exit */
+                        telem_log(LOG_INFO, "Daemon exiting for recycling\n");
+                        return false;
+                }
+        } else {
+                /* Busy, trim only above the memory budget */
+                mem_budget_check(false);
+        }
+
+        if (!loop->is_worker &&
+            difftime(now, loop->last_refresh_time) >= TM_REFRESH_RATE) {
+                if (update_machine_id() == -1) {
+                        telem_log(LOG_ERR, "Unable to update machine id\n");
+                }
+                loop->last_refresh_time = time(NULL);
+        }
+
+        if (!loop->is_worker && loop->heartbeat_interval > 0 &&
+            now >= loop->next_heartbeat) {
+                send_heartbeat(loop, now);
+                loop->next_heartbeat = now + loop->heartbeat_interval;
+        }
+
+        return true;
+}
+
+#ifdef HAVE_SYS_EPOLL_H
+#define TM_EPOLL_EVENTS 64
+
+static int epoll_watch(int epfd, int fd, uint32_t events, void *ptr)
+{
+        struct epoll_event ev;
+
+        memset(&ev, 0, sizeof(ev));
+        ev.events = events;
+        ev.data.ptr = ptr;
+
+        return epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev);
+}
+
+/**
+ * Run the event loop on epoll. Clients are registered edge-triggered with
+ * the client struct as event data, so no lookup is needed on wakeup. The
+ * signal and listening fds are told apart by the address of their fields
+ * in loop.
+ *
+ * @return false if epoll could not be set up, true once the daemon should
+ *     exit
+ */
+static bool run_epoll_loop(struct probe_loop *loop)
+{
+        TelemDaemon *daemon = loop->daemon;
+        struct epoll_event events[TM_EPOLL_EVENTS];
+        client *cl;
+        int n;
+
+        daemon->epfd = epoll_create1(EPOLL_CLOEXEC);
+        if (daemon->epfd < 0) {
+                telem_perror("Failed to create epoll fd, falling back to poll");
+                return false;
+        }
+
+        if ((loop->sigfd >= 0 &&
+             epoll_watch(daemon->epfd, loop->sigfd, EPOLLIN, &loop->sigfd) < 0) ||
+            (loop->watch.fd >= 0 &&
+             epoll_watch(daemon->epfd, loop->watch.fd, EPOLLIN, &loop->watch) < 0) ||
+            epoll_watch(daemon->epfd, loop->sockfd, EPOLLIN, &loop->sockfd) < 0) {
+                telem_perror("Failed to add fd to epoll, falling back to poll");
+                close(daemon->epfd);
+                daemon->epfd = -1;
+                return false;
+        }
+
+        while (1) {
+                /* No configuration value is kept between events */
+                config_reader_offline(loop->config_reader);
+                n = epoll_wait(daemon->epfd, events, TM_EPOLL_EVENTS,
+                               loop->spool_process_time * 1000);
+                config_reader_checkpoint(loop->config_reader);
+                if (n == -1) {
+                        if (errno == EINTR) {
+                                continue;
+                        }
+                        telem_perror("Failed to wait on daemon file descriptors");
+                        break;
+                }
+
+                for (int i = 0; i < n; i++) {
+                        if (events[i].data.ptr == &loop->sigfd) {
+                                if (!handle_signal(loop)) {
+                                        return true;
+                                }
+                        } else if (events[i].data.ptr == &loop->watch) {
+                                if (config_watch_read(&loop->watch)) {
+                                        reload_loop_config(loop);
+                                }
+                        } else if (events[i].data.ptr == &loop->sockfd) {
+                                if (!(cl = accept_client(loop))) {
+                                        if (loop->stopped) {
+                                                return true;
+                                        }
+                                        continue;
+                                }
+                                if (epoll_watch(daemon->epfd, cl->fd,
+                                                EPOLLIN | EPOLLRDHUP | EPOLLET, cl) < 0) {
+                                        telem_perror("Failed to add client to epoll");
+                                        remove_client(&(daemon->client_head), cl);
+                                }
+                        } else {
+                                cl = events[i].data.ptr;
+                                handle_client(daemon, 0, cl);
+                                loop->last_record_received = time(NULL);
+                        }
+                }
+
+                if (!handle_timers(loop, n == 0)) {
+                        break;
+                }
+        }
+
+        return true;
+}
+#endif
+
+/**
+ * Run the event loop on poll, for systems without epoll.
+ */
+static void run_poll_loop(struct probe_loop *loop)
+{
+        TelemDaemon *daemon = loop->daemon;
+        client *cl = NULL;
+        client *current_client = NULL;
+        nfds_t i;
+        int ret;
+
+        while (1) {
+                /* No configuration value is kept between events */
+                config_reader_offline(loop->config_reader);
+                ret = poll(daemon->pollfds, daemon->nfds,
+                           loop->spool_process_time * 1000);
+                config_reader_checkpoint(loop->config_reader);
+                if (ret == -1) {
+                        telem_perror("Failed to poll daemon file descriptors");
+                        break;
+                }
+
+                for (i = 0; ret != 0 && i < daemon->nfds; i++) {
+                        int fd = daemon->pollfds[i].fd;
+
+                        if (daemon->pollfds[i].revents == 0) {
+                                continue;
+                        }
+
+                        if (fd == loop->sigfd) {
+                                /* Check if a signal was received */
+                                if (!handle_signal(loop)) {
+                                        return;
+                                }
+                        } else if (fd == loop->watch.fd) {
+                                if (config_watch_read(&loop->watch)) {
+                                        reload_loop_config(loop);
+                                }
+                        } else if (fd == loop->sockfd) {
+                                /* Accept connection if data arrives on listening socket */
+                                if (!(cl = accept_client(loop))) {
+                                        if (loop->stopped) {
+                                                return;
+                                        }
+                                        break;
+                                }
+
+                                /* Add fd to the poll array */
+                                add_pollfd(daemon, cl->fd, POLLIN | POLLPRI);
+                        } else {
+                                /* Lookup client and handle data on client */
+                                current_client = NULL;
+                                LIST_FOREACH(cl, &(daemon->client_head), client_ptrs) {
+                                        if (cl->fd == fd) {
+                                                current_client = cl;
+                                                telem_log(LOG_INFO, "Client found: %d\n",
+                                                          current_client->fd);
+                                                break;
+                                        }
+                                }
+                                assert(current_client);
+                                handle_client(daemon, i, current_client);
+                                loop->last_record_received = time(NULL);
+
+                                /* The client was removed and the next fd
+                                 * moved into its slot */
+                                if (i >= daemon->nfds || daemon->pollfds[i].fd != fd) {
+                                        i--;
+                                }
+                        }
+                }
+
+                if (!handle_timers(loop, ret == 0)) {
+                        break;
+                }
+        }
+}
+
+static void run_loop(struct probe_loop *loop)
+{
+#ifdef HAVE_SYS_EPOLL_H
+        if (!run_epoll_loop(loop))
+#endif
+        {
+                run_poll_loop(loop);
+        }
+}
+
+static void free_daemon_clients(TelemDaemon *daemon)
+{
+        client *cl = NULL;
+
+        while ((cl = LIST_FIRST(&(daemon->client_head))) != NULL) {
+                remove_client(&(daemon->client_head), cl);
+        }
+        if (daemon->epfd >= 0) {
+                close(daemon->epfd);
+                daemon->epfd = -1;
+        }
+        trim_probe_daemon(daemon);
+        free(daemon->pollfds);
+        daemon->pollfds = NULL;
+}
+
+static void *run_worker(void *arg)
+{
+        struct probe_worker *worker = (struct probe_worker *)arg;
+        struct probe_loop loop;
+
+        memset(&loop, 0, sizeof(loop));
+        loop.daemon = &worker->daemon;
+        loop.sigfd = -1;
+        loop.sockfd = worker->pipefd[0];
+        loop.watch.fd = -1;
+        loop.daemon_recycling_enabled = false;
+        loop.spool_process_time = worker->spool_process_time;
+        loop.last_record_received = time(NULL);
+        loop.is_worker = true;
+        /* At most as many workers as readers are started */
+        loop.config_reader = config_reader_register();
+
+        add_pollfd(&worker->daemon, loop.sockfd, POLLIN);
+        run_loop(&loop);
+        free_daemon_clients(&worker->daemon);
+        config_reader_unregister(loop.config_reader);
+
+        return NULL;
+}
+
+/* Gets the type of socket probes connect to, see socket_transport */
+static int socket_type(void)
+{
+        return strcmp(socket_transport_config(), "seqpacket") == 0 ?
+               SOCK_SEQPACKET : SOCK_STREAM;
+}
+
+static bool is_seqpacket_socket(int fd)
+{
+        int type = 0;
+        socklen_t len = sizeof(type);
+
+        if (getsockopt(fd, SOL_SOCKET, SO_TYPE, &type, &len) < 0) {
+                telem_perror("Unable to get the socket type");
+                return false;
+        }
+
+        return type == SOCK_SEQPACKET;
+}
+
+/**
+ * Start the worker threads, each with its own staging shard.
+ *
+ * @return the workers, or NULL if clients are handled by the main thread
+ */
+static struct probe_worker *start_workers(struct probe_loop *loop, int nworkers)
+{
+        struct probe_worker *workers;
+        int ret;
+
+        workers = calloc((size_t)nworkers, sizeof(struct probe_worker));
+        if (!workers) {
+                telem_log(LOG_ERR, "Unable to allocate memory, exiting\n");
+                exit(EXIT_FAILURE);
+        }
+
+        for (int i = 0; i < nworkers; i++) {
+                struct probe_worker *worker = &workers[i];
+
+                initialize_probe_daemon(&worker->daemon);
+                worker->daemon.machine_id_override = loop->daemon->machine_id_override;
+                worker->daemon.seqpacket = loop->daemon->seqpacket;
+                worker->spool_process_time = loop->spool_process_time;
+                if (create_staging_shard(i) == 0) {
+                        worker->daemon.shard = i;
+                }
+
+                if (pipe(worker->pipefd) != 0) {
+                        telem_perror("Failed to create worker pipe");
+                        exit(EXIT_FAILURE);
+                }
+
+                ret = pthread_create(&worker->thread, NULL, run_worker, worker);
+                if (ret != 0) {
+                        telem_log(LOG_ERR, "Failed to start worker thread: %s\n",
+                                  strerror(ret));
+                        exit(EXIT_FAILURE);
+                }
+        }
+        telem_log(LOG_INFO, "Started %d worker threads\n", nworkers);
+
+        return workers;
+}
+
+static void stop_workers(struct probe_worker *workers, int nworkers)
+{
+        /* Workers exit when they see the pipe closed */
+        for (int i = 0; i < nworkers; i++) {
+                close(workers[i].pipefd[1]);
+        }
+
+        for (int i = 0; i < nworkers; i++) {
+                pthread_join(workers[i].thread, NULL);
+                close(workers[i].pipefd[0]);
+        }
+        free(workers);
+}
+
 int main(int argc, char **argv)
 {
         struct sockaddr_un addr;
-        int sockfd, fd, sigfd;
+        int sockfd, sigfd;
         int ret = 0;
         TelemDaemon daemon;
-        nfds_t i;
-        client *cl = NULL;
-        client *current_client = NULL;
+        struct probe_loop loop;
         int c;
         int opt_index = 0;
         sigset_t mask;
         //bool interrupted = false;
+        char *locale;
+
+        /* Keep the locale of the system for heartbeats, the daemon runs in
+         * the C locale */
+        locale = setlocale(LC_ALL, "");
+        locale = strdup(locale ? locale : "C");
+        if (!locale) {
+                telem_log(LOG_ERR, "Unable to allocate memory, exiting\n");
+                exit(EXIT_FAILURE);
+        }
+        setlocale(LC_ALL, "C");
 
         if (setenv("LC_ALL", "C", 1)) {
                 perror("Cannot set LC_ALL to C");
@@ -106,6 +736,15 @@ int main(int argc, char **argv)
                 }
         }
         initialize_probe_daemon(&daemon);
+        publish_config_snapshot();
+
+        ret = metrics_open(METRICS_DIR "/telemprobd" METRICS_SUFFIX, "telemprobd");
+        if (ret < 0) {
+                telem_log(LOG_WARNING, "Unable to create the metrics page: %s\n",
+                          strerror(-ret));
+        }
+        mem_budget_init(memory_budget_config(), METRIC_PROBD_RSS_BYTES,
+                        METRIC_PROBD_HEAP_BYTES, METRIC_PROBD_MEMORY_TRIMS);
 
         sigemptyset(&mask);
 
@@ -147,10 +786,10 @@ int main(int argc, char **argv)
                   ret);
 
         if (ret >= 1) {
-                fd = SD_LISTEN_FDS_START + 0;
+                int fd = SD_LISTEN_FDS_START + 0;
 
-                /* Check if the socket is of correct type */
-                if (sd_is_socket_unix(fd, SOCK_STREAM, 1, socket_path_config(), 0)) {
+                /* Check if the socket is of correct type, stream or seqpacket */
+                if (sd_is_socket_unix(fd, 0, 1, socket_path_config(), 0)) {
                         telem_log(LOG_INFO, "Socket of type AF_UNIX passed by systemd\n");
                         add_pollfd(&daemon, fd, POLLIN | POLLPRI);
                 } else if (sd_is_socket(fd, AF_UNSPEC, 0, -1)) {
@@ -168,7 +807,7 @@ int main(int argc, char **argv)
         } else
 #endif
         {
-                sockfd = socket(AF_UNIX, SOCK_STREAM, 0);
+                sockfd = socket(AF_UNIX, socket_type(), 0);
                 if (sockfd < 0) {
                         telem_perror("Socket creation failed");
                         exit(EXIT_FAILURE);
@@ -204,11 +843,33 @@ int main(int argc, char **argv)
                 add_pollfd(&daemon, sockfd, POLLIN | POLLPRI);
         }
 
+        /* Records are read as the socket was created, by systemd or here */
+        daemon.seqpacket = is_seqpacket_socket(sockfd);
+        if ((daemon.seqpacket ? SOCK_SEQPACKET : SOCK_STREAM) != socket_type()) {
+                telem_log(LOG_WARNING, "Socket type differs from socket_transport,"
+                          " probes are unable to connect\n");
+        }
+
         telem_log(LOG_INFO, "Listening on socket...\n");
 
-        bool daemon_recycling_enabled = daemon_recycling_enabled_config();
-        int spool_process_time = spool_process_time_config();
-        time_t last_record_received = time(NULL);
+        memset(&loop, 0, sizeof(loop));
+        loop.daemon = &daemon;
+        loop.sigfd = sigfd;
+        loop.sockfd = sockfd;
+        loop.config_reader = -1;
+        loop.daemon_recycling_enabled = daemon_recycling_enabled_config();
+        loop.spool_process_time = spool_process_time_config();
+        loop.last_record_received = time(NULL);
+
+        /* Reload the configuration once edited, as on SIGHUP */
+        ret = config_watch_init(&loop.watch);
+        if (ret < 0) {
+                telem_log(LOG_WARNING, "Not watching the configuration files: %s\n",
+                          strerror(-ret));
+        }
+        if (loop.watch.fd >= 0) {
+                add_pollfd(&daemon, loop.watch.fd, POLLIN);
+        }
 
         ret = update_machine_id();
         if (ret == -1) {
@@ -218,122 +879,30 @@ int main(int argc, char **argv)
         /* Read the static machine id file if it exists.*/
         daemon.machine_id_override = read_machine_id_override();
 
-        time_t last_refresh_time = time(NULL);
-
-        /* Loop to accept clients */
-        while (1) {
-                malloc_trim(0);
-                ret = poll(daemon.pollfds, daemon.nfds, spool_process_time * 1000);
-                if (ret == -1) {
-                        telem_perror("Failed to poll daemon file descriptors");
-                        break;
-                } else if (ret != 0) {
-                        for (i = 0; i < daemon.nfds; i++) {
-
-                                /* Check if a signal was received */
-                                if (daemon.pollfds[0].revents != 0) {
-                                        struct signalfd_siginfo fdsi;
-                                        ssize_t s;
-
-                                        s = read(sigfd, &fdsi, sizeof(struct signalfd_siginfo));
-                                        if (s != sizeof(struct signalfd_siginfo)) {
-                                                telem_perror("Error while reading from the signal"
-                                                             "file descriptor");
-                                                exit(EXIT_FAILURE);
-                                        }
-
-                                        if (fdsi.ssi_signo == SIGTERM || fdsi.ssi_signo == SIGINT) {
-                                                telem_log(LOG_INFO, "Received either a "
-                                                                     "SIGINT/SIGTERM signal\n");
-                                                goto clean_exit;
-                                        }
-
-                                        if (fdsi.ssi_signo == SIGHUP) {
-                                                telem_log(LOG_INFO, "Received a SIGHUP signal\n");
-                                                /* reload configuration file */
-                                                reload_config();
-                                        }
-                                }
-
-                                if (daemon.pollfds[i].revents == 0) {
-                                        continue;
-                                }
-
-                                /* Accept connection if data arrives on listening socket */
-                                if (daemon.pollfds[i].fd == sockfd) {
-                                        if ((fd = accept(daemon.pollfds[i].fd, NULL, NULL)) == -1) {
-                                                telem_perror("Failed to accept socket");
-                                                //exit(EXIT_FAILURE);
-                                                break;
-                                        }
-                                        telem_log(LOG_INFO, "New client %d connected\n", fd);
-
-                                        /* set socket to non-blocking */
-                                        if (fcntl(fd, F_SETFL, O_NONBLOCK)) {
-                                                telem_perror("Failed to set socket as nonblocking");
-                                                close(fd);
-                                                break;
-                                        }
-
-                                        struct timeval timeout;
-                                        timeout.tv_sec = 10;
-                                        timeout.tv_usec = 0;
+        loop.last_refresh_time = time(NULL);
 
-                                        if (setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, &timeout,
-                                                       sizeof(timeout)) < 0) {
-                                                telem_perror("Failed to set socket timeout");
-                                        }
-
-                                        /* Add the fd to the client list */
-                                        if (!add_client(&(daemon.client_head), fd)) {
-                                                telem_log(LOG_ERR, "Unable to add the client to list\n");
-                                                exit(EXIT_FAILURE);
-                                        }
+        loop.heartbeat_locale = locale;
+        configure_heartbeat(&loop);
 
-                                        /* Add fd to the poll array */
-                                        add_pollfd(&daemon, fd, POLLIN | POLLPRI);
-                                } else if (i != 0) {
-                                        /* Lookup client and handle data on client */
-                                        LIST_FOREACH(cl, &(daemon.client_head), client_ptrs) {
-                                                if (cl->fd == daemon.pollfds[i].fd) {
-                                                        current_client = cl;
-                                                        telem_log(LOG_INFO, "Client found: %d\n",
-                                                                  current_client->fd);
-                                                }
-                                        }
-                                        assert(current_client);
-                                        handle_client(&daemon, i, current_client);
-                                        last_record_received = time(NULL);
-                                }
-                        }
-                } else {
-                        time_t now = time(NULL);
-                        /* time to recycle the daemon has elapsed*/
-                        if (daemon_recycling_enabled &&
-                            difftime(now, last_record_received) >= TM_DAEMON_EXIT_TIME) {
-                                /* Exit */
-                                telem_log(LOG_INFO, "Daemon exiting for recycling\n");
-                                goto clean_exit;
-                        }
-                }
-                time_t now = time(NULL);
-                if (difftime(now, last_refresh_time) >= TM_REFRESH_RATE) {
-                        int ret = update_machine_id();
-                        if (ret == -1) {
-                                telem_log(LOG_ERR, "Unable to update machine id\n");
-                        }
-                        last_refresh_time = time(NULL);
-                }
+        loop.nworkers = probe_worker_threads_config();
+        if (loop.nworkers > 0) {
+                loop.workers = start_workers(&loop, loop.nworkers);
         }
 
-clean_exit:
+        /* Loop to accept clients */
+        run_loop(&loop);
 
         /* Free memory before exiting */
-        while ((cl = LIST_FIRST(&(daemon.client_head))) != NULL) {
-                remove_client(&(daemon.client_head), cl);
+        if (loop.workers) {
+                stop_workers(loop.workers, loop.nworkers);
         }
-        free(daemon.pollfds);
+        free_daemon_clients(&daemon);
+        config_watch_close(&loop.watch);
+        staging_log_close();
+        close_record_ring();
+        metrics_close();
         free(daemon.machine_id_override);
+        free(loop.heartbeat_locale);
         if (LIST_EMPTY(&(daemon.client_head))) {
                 telem_log(LOG_INFO, "Client list cleared\n");
         }
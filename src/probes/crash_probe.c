@@ -16,6 +16,7 @@
 
 #define _GNU_SOURCE
 #include <assert.h>
+#include <errno.h>
 #include <fcntl.h>
 #include <getopt.h>
 #include <grp.h>
@@ -28,6 +29,7 @@
 #include <string.h>
 #include <unistd.h>
 
+#include <pthread.h>
 #include <sys/prctl.h>
 #include <sys/stat.h>
 #include <sys/types.h>
@@ -38,7 +40,12 @@
 #include "nica/nc-string.h"
 #include "config.h"
 #include "log.h"
+#include "common.h"
+#include "configuration.h"
+#include "dedup.h"
 #include "probe.h"
+#include "probe_record.h"
+#include "symcache.h"
 #include "telemetry.h"
 
 #define FRAMES_MAX 64
@@ -72,6 +79,26 @@ static char unknown_class[30] = "org.clearlinux/crash/unknown";
 
 static char temp_core[] = "/tmp/corefile-XXXXXX";
 
+static struct symcache symbols;
+static bool symbols_loaded = false;
+static pthread_mutex_t symbols_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Threads unwinding the core in parallel, and threads of the core unwound */
+static int unwind_jobs = 1;
+static int max_threads = 0;
+static bool threads_truncated = false;
+
+/* Unwinding of the threads of a core with one libdwfl session */
+struct unwind_state {
+        Dwfl *dwfl;
+        nc_string **bt;
+        /* frames of the current thread */
+        unsigned int frames;
+        /* threads unwound */
+        int threads;
+        char *error;
+};
+
 static const Dwfl_Callbacks cb =
 {
         .find_elf = dwfl_build_id_find_elf,
@@ -181,44 +208,37 @@ static int temp_core_file(void)
 }
 
 /* There are a number of initialization routines required to initialize the Elf
- * and Dwfl objects used by libdwfl to later process a core file. The argument
- * e_core is the address of an Elf pointer declared by the caller, and core_fd
- * is the open file descriptor for the core file.
+ * and Dwfl objects used by libdwfl to later process a core file. The arguments
+ * e_core and dwfl are the addresses of pointers declared by the caller, pid is
+ * set to the PID of the process of the core, and core_fd is the open file
+ * descriptor for the core file.
  */
-static int prepare_corefile(Elf **e_core, int core_fd)
+static int open_core_session(int core_fd, Elf **e_core, Dwfl **dwfl, pid_t *pid)
 {
-        // Cleanup previous corefile processing if needed
-        if (d_core) {
-                dwfl_end(d_core);
-        }
-        if (*e_core) {
-                elf_end(*e_core);
-        }
-
         // Boilerplate initialization for elfutils (libdwfl)
         if (!(*e_core = elf_begin(core_fd, ELF_C_READ, NULL))) {
                 tm_elf_err("Failed to get file descriptor for ELF core file");
                 goto fail;
         }
 
-        if (!(d_core = dwfl_begin(&cb))) {
+        if (!(*dwfl = dwfl_begin(&cb))) {
                 tm_dwfl_err("Failed to start new libdwfl session");
                 goto fail;
         }
 
         int core_modules = 0;
-        core_modules = dwfl_core_file_report(d_core, *e_core, NULL);
+        core_modules = dwfl_core_file_report(*dwfl, *e_core, NULL);
         if (core_modules == -1) {
                 tm_dwfl_err("Failed to report modules for ELF core file");
                 goto fail;
         }
 
-        if (dwfl_report_end(d_core, NULL, NULL) != 0) {
+        if (dwfl_report_end(*dwfl, NULL, NULL) != 0) {
                 tm_dwfl_err("Failed to finish reporting modules");
                 goto fail;
         }
 
-        if ((core_for_pid = dwfl_core_file_attach(d_core, *e_core)) < 0) {
+        if ((*pid = dwfl_core_file_attach(*dwfl, *e_core)) < 0) {
                 tm_dwfl_err("Failed to prepare libdwfl session for thread"
                             " iteration");
                 goto fail;
@@ -229,6 +249,21 @@ fail:
         return -1;
 }
 
+static int prepare_corefile(Elf **e_core, int core_fd)
+{
+        // Cleanup previous corefile processing if needed
+        if (d_core) {
+                dwfl_end(d_core);
+                d_core = NULL;
+        }
+        if (*e_core) {
+                elf_end(*e_core);
+                *e_core = NULL;
+        }
+
+        return open_core_session(core_fd, e_core, &d_core, &core_for_pid);
+}
+
 /* This callback is invoked for every frame in a thread. From a Dwfl_Frame, we
  * are able to extract the program counter (PC), and from that, the procedure
  * name via a Dwfl_Module.
@@ -241,16 +276,22 @@ static int frame_cb(Dwfl_Frame *frame, void *userdata)
         Dwfl_Line *line;
         const char *procname;
         const char *modname;
+        Dwarf_Addr start = 0;
+        const unsigned char *build_id = NULL;
+        GElf_Addr build_id_vaddr;
+        int build_id_len;
+        const struct symcache_entry *cached = NULL;
         bool activation;
-        nc_string **bt = (nc_string **)userdata;
+        struct unwind_state *state = userdata;
+        nc_string **bt = state->bt;
 
         if (!dwfl_frame_pc(frame, &pc, &activation)) {
                 int ret;
-                ret = asprintf(&errorstr, "Failed to find program counter for"
+                ret = asprintf(&state->error, "Failed to find program counter for"
                                " current frame: %s\n",
                                dwfl_errmsg(-1));
                 if (ret < 0) {
-                        errorstr = NULL;
+                        state->error = NULL;
                 }
                 return DWARF_CB_ABORT;
         }
@@ -265,71 +306,106 @@ static int frame_cb(Dwfl_Frame *frame, void *userdata)
                 pc_adjusted = pc;
         }
 
-        module = dwfl_addrmodule(d_core, pc_adjusted);
+        module = dwfl_addrmodule(state->dwfl, pc_adjusted);
 
         if (!module) {
-                errorstr = strdup("Failed to find module for current"
+                state->error = strdup("Failed to find module for current"
                                   " frame\n");
                 return DWARF_CB_ABORT;
         }
 
-        modname = dwfl_module_info(module, NULL, NULL, NULL, NULL, NULL, NULL,
+        modname = dwfl_module_info(module, NULL, &start, NULL, NULL, NULL, NULL,
                                    NULL);
+
+        // The build id comes from the core file, so frames of modules seen in
+        // earlier crashes are symbolized without loading their DWARF data
+        build_id_len = dwfl_module_build_id(module, &build_id, &build_id_vaddr);
+        if (symbols_loaded && modname && build_id_len > 0) {
+                pthread_mutex_lock(&symbols_lock);
+                cached = symcache_lookup(&symbols, build_id, (size_t)build_id_len,
+                                         pc_adjusted - start);
+                if (cached) {
+                        nc_string_append_printf(*bt, "#%u %s() - [%s] - %s:%i\n",
+                                                state->frames++, cached->function,
+                                                modname, cached->source, cached->line);
+                }
+                pthread_mutex_unlock(&symbols_lock);
+        }
+        if (cached) {
+                goto done;
+        }
+
         procname = dwfl_module_addrname(module, pc_adjusted);
 
         line = dwfl_module_getsrc(module, pc_adjusted);
 
         if (procname && modname) {
                 nc_string_append_printf(*bt, "#%u %s() - [%s]",
-                                        frame_counter++, procname, modname);
+                                        state->frames++, procname, modname);
         } else if (modname) {
                 nc_string_append_printf(*bt, "#%u ??? - [%s]",
-                                        frame_counter++, modname);
+                                        state->frames++, modname);
         } else {
                 // TODO: decide on "no symbol" representation
                 nc_string_append_printf(*bt, "#%u (no symbols)",
-                                        frame_counter++);
+                                        state->frames++);
         }
 
         if (line) {
                 const char *src;
                 int lineno, linecol;
-                src =  dwfl_lineinfo(line, &pc_adjusted, &lineno, &linecol, NULL, NULL);
+                Dwarf_Addr addr = pc_adjusted;
+
+                src =  dwfl_lineinfo(line, &addr, &lineno, &linecol, NULL, NULL);
                 if (src) {
                         nc_string_append_printf(*bt, " - %s:%i", src, lineno);
                 }
+
+                // Frames without symbols or source lines are resolved again,
+                // their debuginfo may still be downloading
+                if (src && procname && modname && symbols_loaded && build_id_len > 0) {
+                        pthread_mutex_lock(&symbols_lock);
+                        symcache_insert(&symbols, build_id, (size_t)build_id_len,
+                                        pc_adjusted - start, procname, src, lineno);
+                        pthread_mutex_unlock(&symbols_lock);
+                }
         }
         nc_string_append_printf(*bt, "\n");
 
-        if (frame_counter >= FRAMES_MAX) {
-                errorstr = NULL;
+done:
+        if (state->frames >= FRAMES_MAX) {
+                state->error = NULL;
                 return DWARF_CB_ABORT;
         }
 
         return DWARF_CB_OK;
 }
 
-static int thread_cb(Dwfl_Thread *thread, void *userdata)
+/* Appends the backtrace of thread tid, returns a DWARF_CB_* code. The frames
+ * are walked from thread when given, or else looked up by TID in the session.
+ */
+static int unwind_thread(Dwfl_Thread *thread, pid_t tid, struct unwind_state *state)
 {
         int ret;
-        nc_string **bt = (nc_string **)userdata;
-        pid_t tid;
-
-        tid = dwfl_thread_tid(thread);
+        nc_string **bt = state->bt;
 
         nc_string_append_printf(*bt, "\nBacktrace (TID %u):\n",
                                 (unsigned int)tid);
 
-        ret = dwfl_thread_getframes(thread, frame_cb, userdata);
+        if (thread) {
+                ret = dwfl_thread_getframes(thread, frame_cb, state);
+        } else {
+                ret = dwfl_getthread_frames(state->dwfl, tid, frame_cb, state);
+        }
 
         switch (ret) {
                 case -1:
-                        if (asprintf(&errorstr, "Error while iterating"
+                        if (asprintf(&state->error, "Error while iterating"
                                      " through frames for thread"
                                      " %u: %s\n",
                                      (unsigned int)tid,
                                      dwfl_errmsg(-1)) < 0) {
-                                errorstr = NULL;
+                                state->error = NULL;
                         }
                         return DWARF_CB_ABORT;
                 case DWARF_CB_ABORT:
@@ -343,7 +419,7 @@ static int thread_cb(Dwfl_Thread *thread, void *userdata)
         }
 
         // New threads (if any), will require a fresh frame counter
-        frame_counter = 0;
+        state->frames = 0;
 
 #if 0
         nc_string_append_printf(*bt, "\nRegisters (TID %u):\nTODO\n", current,
@@ -353,33 +429,227 @@ static int thread_cb(Dwfl_Thread *thread, void *userdata)
         return DWARF_CB_OK;
 }
 
-static bool send_data(nc_string **backtrace, uint32_t severity, char *class)
+static int thread_cb(Dwfl_Thread *thread, void *userdata)
 {
-        struct telem_ref *handle = NULL;
-        int ret;
+        struct unwind_state *state = userdata;
 
-        if ((ret = tm_create_record(&handle, severity, class, version)) < 0) {
-                telem_log(LOG_ERR, "Failed to create record: %s",
-                          strerror(-ret));
-                goto fail;
+        if (max_threads > 0 && state->threads >= max_threads) {
+                threads_truncated = true;
+                return DWARF_CB_ABORT;
         }
+        state->threads++;
 
-        if ((ret = tm_set_payload(handle, (char *)(*backtrace)->str)) < 0) {
-                telem_log(LOG_ERR, "Failed to set payload: %s", strerror(-ret));
-                tm_free_record(handle);
-                goto fail;
+        return unwind_thread(thread, dwfl_thread_tid(thread), state);
+}
+
+/* A thread unwound by a worker */
+struct unwind_job {
+        pid_t tid;
+        nc_string *bt;
+        bool truncated;
+        char *error;
+};
+
+struct unwind_worker {
+        pthread_t thread;
+        int core_fd;
+        /* session of the worker, or NULL to open one */
+        Dwfl *dwfl;
+        struct unwind_job *jobs;
+        int job_count;
+        /* the worker unwinds every step-th job from first */
+        int first;
+        int step;
+        bool started;
+};
+
+struct tid_list {
+        pid_t *tids;
+        int count;
+        int alloc;
+};
+
+static int collect_tid_cb(Dwfl_Thread *thread, void *userdata)
+{
+        struct tid_list *list = userdata;
+
+        if (max_threads > 0 && list->count >= max_threads) {
+                threads_truncated = true;
+                return DWARF_CB_ABORT;
         }
+        if (list->count == list->alloc) {
+                int alloc = list->alloc ? list->alloc * 2 : 64;
+                pid_t *tids = realloc(list->tids, (size_t)alloc * sizeof(pid_t));
 
-        if ((ret = tm_send_record(handle)) < 0) {
-                telem_log(LOG_ERR, "Failed to send record: %s", strerror(-ret));
-                tm_free_record(handle);
-                goto fail;
+                if (!tids) {
+                        return DWARF_CB_ABORT;
+                }
+                list->tids = tids;
+                list->alloc = alloc;
         }
+        list->tids[list->count++] = dwfl_thread_tid(thread);
 
-        tm_free_record(handle);
-        return true;
-fail:
-        return false;
+        return DWARF_CB_OK;
+}
+
+static void *unwind_worker_run(void *arg)
+{
+        struct unwind_worker *worker = arg;
+        Elf *elf = NULL;
+        Dwfl *dwfl = worker->dwfl;
+        pid_t pid;
+
+        // Sessions are not shared between threads, each worker has its own
+        if (!dwfl && open_core_session(worker->core_fd, &elf, &dwfl, &pid) < 0) {
+                for (int i = worker->first; i < worker->job_count; i += worker->step) {
+                        worker->jobs[i].error = strdup("Failed to prepare libdwfl"
+                                                       " session\n");
+                }
+                goto out;
+        }
+
+        for (int i = worker->first; i < worker->job_count; i += worker->step) {
+                struct unwind_job *job = &worker->jobs[i];
+                struct unwind_state state = { dwfl, &job->bt, 0, 0, NULL };
+                int ret;
+
+                job->bt = nc_string_dup("");
+                ret = unwind_thread(NULL, job->tid, &state);
+                if (ret == DWARF_CB_OK) {
+                        continue;
+                }
+                if (state.frames >= FRAMES_MAX) {
+                        job->truncated = true;
+                } else if (state.error) {
+                        job->error = state.error;
+                } else if (asprintf(&job->error, "Failed to unwind thread %u: %s\n",
+                                    (unsigned int)job->tid, dwfl_errmsg(-1)) < 0) {
+                        job->error = NULL;
+                }
+        }
+
+out:
+        if (dwfl && dwfl != worker->dwfl) {
+                dwfl_end(dwfl);
+        }
+        if (elf) {
+                elf_end(elf);
+        }
+
+        return NULL;
+}
+
+static int compare_jobs(const void *a, const void *b)
+{
+        const struct unwind_job *ja = a, *jb = b;
+
+        return (ja->tid > jb->tid) - (ja->tid < jb->tid);
+}
+
+/*
+ * Unwinds the threads of the core in unwind_jobs worker threads, each with a
+ * libdwfl session and a frame budget per thread, and appends the backtraces
+ * in TID order while they fit in a record.
+ */
+static int unwind_parallel(nc_string **backtrace, int core_fd)
+{
+        struct tid_list list = { NULL, 0, 0 };
+        struct unwind_job *jobs = NULL;
+        struct unwind_worker *workers = NULL;
+        int worker_count;
+        int unwound = 0;
+        int ret = -1;
+
+        // Gathering the threads does not unwind them
+        if (dwfl_getthreads(d_core, collect_tid_cb, &list) != DWARF_CB_OK &&
+            !threads_truncated) {
+                errorstr = strdup("Failed to list the threads of the core\n");
+                goto out;
+        }
+        if (list.count == 0) {
+                ret = 0;
+                goto out;
+        }
+
+        jobs = calloc((size_t)list.count, sizeof(struct unwind_job));
+        worker_count = unwind_jobs < list.count ? unwind_jobs : list.count;
+        workers = calloc((size_t)worker_count, sizeof(struct unwind_worker));
+        if (!jobs || !workers) {
+                goto out;
+        }
+        for (int i = 0; i < list.count; i++) {
+                jobs[i].tid = list.tids[i];
+        }
+        qsort(jobs, (size_t)list.count, sizeof(struct unwind_job), compare_jobs);
+
+        for (int w = 0; w < worker_count; w++) {
+                workers[w].core_fd = core_fd;
+                workers[w].dwfl = w == 0 ? d_core : NULL;
+                workers[w].jobs = jobs;
+                workers[w].job_count = list.count;
+                workers[w].first = w;
+                workers[w].step = worker_count;
+        }
+        // The first worker runs in this thread, with the session of the core
+        for (int w = 1; w < worker_count; w++) {
+                workers[w].started = pthread_create(&workers[w].thread, NULL,
+                                                    unwind_worker_run,
+                                                    &workers[w]) == 0;
+        }
+        unwind_worker_run(&workers[0]);
+        for (int w = 1; w < worker_count; w++) {
+                if (workers[w].started) {
+                        pthread_join(workers[w].thread, NULL);
+                } else {
+                        // Done in this thread instead, after the first worker
+                        workers[w].dwfl = d_core;
+                        unwind_worker_run(&workers[w]);
+                }
+        }
+
+        for (int i = 0; i < list.count; i++) {
+                struct unwind_job *job = &jobs[i];
+
+                if (!job->bt) {
+                        continue;
+                }
+                if (job->error) {
+                        nc_string_append_printf(job->bt, "Error: %s", job->error);
+                } else {
+                        unwound++;
+                }
+                if ((*backtrace)->len + job->bt->len + header->len + 128 >
+                    MAX_PAYLOAD_LENGTH) {
+                        threads_truncated = true;
+                        break;
+                }
+                if (job->truncated) {
+                        frame_counter = FRAMES_MAX;
+                }
+                nc_string_cat(*backtrace, job->bt->str);
+        }
+        ret = unwound > 0 ? 0 : -1;
+
+out:
+        if (jobs) {
+                for (int i = 0; i < list.count; i++) {
+                        if (jobs[i].bt) {
+                                nc_string_free(jobs[i].bt);
+                        }
+                        free(jobs[i].error);
+                }
+        }
+        free(jobs);
+        free(workers);
+        free(list.tids);
+
+        return ret;
+}
+
+static bool send_data(nc_string **backtrace, uint32_t severity, char *class)
+{
+        return probe_send_record(severity, class, version,
+                                 (char *)(*backtrace)->str) == 0;
 }
 
 /* This is the entry point for libdwfl to unwind the backtrace from the core
@@ -390,18 +660,33 @@ fail:
  * nc_string object declared by the caller which stores the backtrace data as a
  * string.
  */
-static int process_corefile(nc_string **backtrace)
+static int process_corefile(nc_string **backtrace, int core_fd)
 {
+        struct unwind_state state = { d_core, backtrace, 0, 0, NULL };
+        int ret;
+
         if (*backtrace) {
                 nc_string_free(*backtrace);
         }
         *backtrace = nc_string_dup("");
+        nc_string_reserve(*backtrace, MAX_PAYLOAD_LENGTH);
+        frame_counter = 0;
+        threads_truncated = false;
+        free(errorstr);
+        errorstr = NULL;
 
-        if (dwfl_getthreads(d_core, thread_cb, backtrace) != DWARF_CB_OK) {
-                /* We aborted unwinding, due to too many frames.
+        if (unwind_jobs > 1) {
+                return unwind_parallel(backtrace, core_fd);
+        }
+
+        ret = dwfl_getthreads(d_core, thread_cb, &state);
+        frame_counter = state.frames;
+        errorstr = state.error;
+        if (ret != DWARF_CB_OK) {
+                /* We aborted unwinding, due to too many frames or threads.
                  * We don't consider this as an error.
                  */
-                if (frame_counter >= FRAMES_MAX) {
+                if (frame_counter >= FRAMES_MAX || threads_truncated) {
                         return 0;
                 }
                 /* When errors occur during the unwinding, we reach this point.
@@ -488,6 +773,8 @@ static const struct option prog_opts[] = {
         { "process-name", required_argument, 0, 'p' },
         { "process-path", required_argument, 0, 'E' },
         { "signal", required_argument, 0, 's' },
+        { "jobs", required_argument, 0, 'j' },
+        { "max-threads", required_argument, 0, 'm' },
         { "version", no_argument, 0, 'V' },
         { "verbose", no_argument, 0, 'v' },
         { 0, 0, 0, 0 }
@@ -507,6 +794,8 @@ static void print_help(void)
         printf("  -p, --process-name    Name of process for crash report (required)\n");
         printf("  -E, --process-path    Absolute path of crashed process, with ! or / delimiters\n");
         printf("  -s, --signal          Signal number that crashed the process\n");
+        printf("  -j, --jobs            Threads unwinding the core in parallel (default 1)\n");
+        printf("  -m, --max-threads     Threads of the core to unwind, 0 for all (default)\n");
         printf("  -V, --version         Print the program version\n");
         printf("  -v, --verbose         Print the crash payload to stdout\n");
         printf("\n");
@@ -535,7 +824,7 @@ int main(int argc, char **argv)
 
         int opt;
 
-        while ((opt = getopt_long(argc, argv, "hf:c:p:E:s:Vv", prog_opts, NULL)) != -1) {
+        while ((opt = getopt_long(argc, argv, "hf:c:p:E:s:j:m:Vv", prog_opts, NULL)) != -1) {
                 switch (opt) {
                         case 'h':
                                 print_help();
@@ -574,6 +863,26 @@ int main(int argc, char **argv)
                                         goto fail;
                                 }
                                 break;
+                        case 'j':
+                        case 'm': {
+                                char *end = NULL;
+                                long n;
+
+                                errno = 0;
+                                n = strtol(optarg, &end, 10);
+                                if (errno != 0 || *end != '\0' || n < (opt == 'j' ? 1 : 0) ||
+                                    n > INT_MAX) {
+                                        telem_log(LOG_ERR, "Invalid number of threads: %s\n",
+                                                  optarg);
+                                        goto fail;
+                                }
+                                if (opt == 'j') {
+                                        unwind_jobs = (int)n;
+                                } else {
+                                        max_threads = (int)n;
+                                }
+                                break;
+                        }
                         case 'v':
                                 verbose = true;
                                 break;
@@ -641,6 +950,10 @@ int main(int argc, char **argv)
 
         elf_version(EV_CURRENT);
 
+        if (symcache_load(&symbols, SYMCACHE_FILE, SYMCACHE_ENTRIES_MAX) == 0) {
+                symbols_loaded = true;
+        }
+
         if (prepare_corefile(&e_core, core_fd) < 0) {
                 goto fail;
         }
@@ -658,14 +971,14 @@ int main(int argc, char **argv)
          * the first run (indicated by the presence of "??? - ["), wait 10
          * seconds and try again. Also retry if errors occur in the first run.
          */
-        if ((process_corefile(&backtrace) < 0) || (strstr(backtrace->str, "??? - ["))) {
+        if ((process_corefile(&backtrace, core_fd) < 0) || (strstr(backtrace->str, "??? - ["))) {
                 sleep(10);
 
                 if (prepare_corefile(&e_core, core_fd) < 0) {
                         goto fail;
                 }
 
-                if (process_corefile(&backtrace) < 0) {
+                if (process_corefile(&backtrace, core_fd) < 0) {
                         goto fail;
                 }
         }
@@ -674,22 +987,45 @@ int main(int argc, char **argv)
                 telem_log(LOG_ERR, "Too many frames. Backtrace truncated.\n");
                 nc_string_append_printf(header, "Too many frames. Backtrace truncated.\n");
         }
+        if (threads_truncated) {
+                telem_log(LOG_NOTICE, "Some threads not unwound. Backtrace truncated.\n");
+                nc_string_append_printf(header, "Some threads not unwound. Backtrace truncated.\n");
+        }
 
         nc_string_prepend(backtrace, header->str);
 
+        // A crash looping service sends one record per window
+        uint32_t occurrences;
+        int dup = dedup_check(DEDUP_FILE, clr_class, backtrace->str,
+                              crash_dedup_window_config(), time(NULL),
+                              &occurrences);
+        if (dup == 1) {
+                telem_log(LOG_NOTICE, "Duplicate crash, not reported\n");
+                goto success;
+        } else if (dup < 0) {
+                telem_log(LOG_DEBUG, "Cannot use the crash table: %s\n",
+                          strerror(-dup));
+        } else if (occurrences > 1) {
+                char line[32];
+
+                snprintf(line, sizeof(line), "Occurrences: %u\n", occurrences);
+                nc_string_prepend(backtrace, line);
+        }
+
         if (!send_data(&backtrace, default_severity, clr_class)) {
                 goto fail;
         }
 
 success:
+        ret = EXIT_SUCCESS;
+fail:
+        // The payload is printed even if it could not be sent
         if (verbose) {
                 if (backtrace != NULL) {
                         printf("%s\n", (char *)backtrace->str);
                 }
         }
 
-        ret = EXIT_SUCCESS;
-fail:
         free(core_file);
         free(proc_name);
         free(proc_path);
@@ -714,6 +1050,16 @@ fail:
                 elf_end(e_core);
         }
 
+        if (symbols_loaded) {
+                int r = symcache_save(&symbols, SYMCACHE_FILE);
+
+                if (r < 0) {
+                        telem_log(LOG_DEBUG, "Cannot save the symbol cache: %s\n",
+                                  strerror(-r));
+                }
+                symcache_free(&symbols);
+        }
+
         if (core_fd >= 0 && core_fd != STDIN_FILENO) {
                 close(core_fd);
         }
@@ -0,0 +1,157 @@
+/*
+ * This program is part of the Clear Linux Project
+ *
+ * Copyright 2019 Intel Corporation
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms and conditions of the GNU Lesser General Public License, as
+ * published by the Free Software Foundation; either version 2.1 of the License,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU Lesser General Public License for more
+ * details.
+ */
+
+#define _GNU_SOURCE
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "dedup.h"
+
+#define DEDUP_TABLE_SIZE (sizeof(struct dedup_header) + \
+                          DEDUP_SLOTS * sizeof(struct dedup_slot))
+
+static const char dedup_magic[8] = "TMDEDUP";
+
+static uint64_t hash_bytes(uint64_t hash, const char *data, size_t len)
+{
+        for (size_t i = 0; i < len; i++) {
+                hash = (hash ^ (unsigned char)data[i]) * 1099511628211ULL;
+        }
+        return hash;
+}
+
+/* Hashes the payload without the numbers following "PID: " and "TID " */
+static uint64_t hash_payload(uint64_t hash, const char *payload)
+{
+        const char *p = payload;
+
+        while (*p) {
+                const char *mark = NULL;
+
+                if (strncmp(p, "PID: ", 5) == 0) {
+                        mark = p + 5;
+                } else if (strncmp(p, "TID ", 4) == 0) {
+                        mark = p + 4;
+                }
+                if (mark) {
+                        hash = hash_bytes(hash, p, (size_t)(mark - p));
+                        p = mark;
+                        while (isdigit((unsigned char)*p)) {
+                                p++;
+                        }
+                        continue;
+                }
+                hash = hash_bytes(hash, p, 1);
+                p++;
+        }
+
+        return hash;
+}
+
+int dedup_check(const char *path, const char *classification,
+                const char *payload, int window, time_t now,
+                uint32_t *occurrences)
+{
+        struct dedup_header *header;
+        struct dedup_slot *slots;
+        struct dedup_slot *slot = NULL;
+        struct stat st;
+        void *table;
+        uint64_t hash = 14695981039346656037ULL;
+        int ret = 0;
+        int fd;
+
+        *occurrences = 1;
+        if (window <= 0) {
+                return 0;
+        }
+
+        hash = hash_bytes(hash, classification, strlen(classification) + 1);
+        hash = hash_payload(hash, payload);
+        if (hash == 0) {
+                hash = 1;
+        }
+
+        fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0640);
+        if (fd < 0) {
+                return -errno;
+        }
+        if (flock(fd, LOCK_EX) < 0 || fstat(fd, &st) < 0) {
+                ret = -errno;
+                goto out;
+        }
+        if ((size_t)st.st_size != DEDUP_TABLE_SIZE &&
+            ftruncate(fd, (off_t)DEDUP_TABLE_SIZE) < 0) {
+                ret = -errno;
+                goto out;
+        }
+
+        table = mmap(NULL, DEDUP_TABLE_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (table == MAP_FAILED) {
+                ret = -errno;
+                goto out;
+        }
+        header = table;
+        slots = (struct dedup_slot *)(header + 1);
+        if (memcmp(header->magic, dedup_magic, sizeof(dedup_magic)) != 0 ||
+            header->version != DEDUP_VERSION || header->slots != DEDUP_SLOTS) {
+                memset(table, 0, DEDUP_TABLE_SIZE);
+                memcpy(header->magic, dedup_magic, sizeof(dedup_magic));
+                header->version = DEDUP_VERSION;
+                header->slots = DEDUP_SLOTS;
+        }
+
+        for (int i = 0; i < DEDUP_PROBES; i++) {
+                struct dedup_slot *s = &slots[(hash + (uint64_t)i) % DEDUP_SLOTS];
+
+                if (s->hash == hash && s->reported != 0) {
+                        slot = s;
+                        break;
+                }
+                // Otherwise the free slot, or the one reported the longest ago
+                if (!slot || s->reported < slot->reported) {
+                        slot = s;
+                }
+        }
+
+        if (slot->hash == hash && slot->reported != 0 &&
+            now >= slot->reported && now - slot->reported < window) {
+                slot->duplicates++;
+                ret = 1;
+        } else {
+                if (slot->hash == hash && slot->reported != 0) {
+                        *occurrences = slot->duplicates + 1;
+                }
+                slot->hash = hash;
+                slot->reported = now > 0 ? (int64_t)now : 1;
+                slot->duplicates = 0;
+        }
+
+        munmap(table, DEDUP_TABLE_SIZE);
+out:
+        close(fd);
+
+        return ret;
+}
+
+/* vi: set ts=8 sw=8 sts=4 et tw=80 cino=(0: */
@@ -0,0 +1,72 @@
+/*
+ * This program is part of the Clear Linux Project
+ *
+ * Copyright 2019 Intel Corporation
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms and conditions of the GNU Lesser General Public License, as
+ * published by the Free Software Foundation; either version 2.1 of the License,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU Lesser General Public License for more
+ * details.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <time.h>
+
+/*
+ * Crashes reported by the probes in the last crash_dedup_window seconds,
+ * kept in a small table mapped from a file under the telemetry state
+ * directory and shared by the probes, under an exclusive lock. A crash is
+ * keyed by a hash of its classification and payload, in which the PIDs and
+ * TIDs are ignored. The first crash of a window is reported, the duplicates
+ * in the window are only counted, and the next crash reported after the
+ * window says how many crashes it stands for.
+ */
+
+#define DEDUP_FILE LOCALSTATEDIR "/lib/telemetry/crash-dedup"
+#define DEDUP_VERSION 1
+#define DEDUP_SLOTS 256
+/* Slots looked at for a crash, from the one its hash points to */
+#define DEDUP_PROBES 8
+
+struct dedup_header {
+        char magic[8];
+        uint32_t version;
+        uint32_t slots;
+};
+
+struct dedup_slot {
+        uint64_t hash;
+        /* when the crash was last reported, 0 for a free slot */
+        int64_t reported;
+        /* duplicates since */
+        uint32_t duplicates;
+        uint32_t pad;
+};
+
+/**
+ * Records a crash in the table
+ *
+ * @param path The table file
+ * @param classification Classification of the record of the crash
+ * @param payload Payload of the record
+ * @param window Seconds in which duplicates are not reported, 0 for none
+ * @param now Current time
+ * @param occurrences Set to the crashes the record stands for, itself and
+ *     the duplicates not reported before it
+ *
+ * @return 0 if the crash should be reported, 1 for a duplicate, or a
+ *     negative errno-style value if the table cannot be used, in which case
+ *     the crash should be reported
+ */
+int dedup_check(const char *path, const char *classification,
+                const char *payload, int window, time_t now,
+                uint32_t *occurrences);
+
+/* vi: set ts=8 sw=8 sts=4 et tw=80 cino=(0: */
@@ -21,17 +21,12 @@
 #include <sys/stat.h>
 #include <getopt.h>
 #include <locale.h>
-#include <sys/sysinfo.h>
-#include <dirent.h>
 #include "common.h"
+#include "heartbeat.h"
 #include "telemetry.h"
 #include "config.h"
 #include "log.h"
 
-#define PAYLOAD_LOCALE  0x01
-#define PAYLOAD_UPTIME  0x02
-#define PAYLOAD_BUNDLES 0x04
-
 static void print_usage(char *prog)
 {
         printf("%s: Usage\n", prog);
@@ -44,84 +39,6 @@ static void print_usage(char *prog)
         printf("  -V,  --version        Print the program version\n");
 }
 
-static long get_uptime(void)
-{
-        struct sysinfo s_info;
-        if (sysinfo(&s_info) == 0) {
-                return s_info.uptime;
-        }
-        return 0;
-}
-
-static int nodots(const struct dirent *dp)
-{
-        return (dp->d_name[0] != '.');
-}
-
-static char *create_payload(unsigned options)
-{
-        int n, buflen;
-        char *ppos, *payload;
-
-        payload = calloc(sizeof(char), MAX_PAYLOAD_LENGTH);
-        if (payload == NULL) {
-                return NULL;
-        }
-
-        ppos = payload;
-        buflen = MAX_PAYLOAD_LENGTH;
-
-        n = snprintf(ppos, (size_t)buflen, "hello\n");
-        buflen -= n, ppos += n;
-
-        if (options & PAYLOAD_LOCALE) {
-                n = snprintf(ppos, (size_t)buflen, "LC_ALL: %s\n", setlocale(LC_ALL, NULL));
-                buflen -= n, ppos += n;
-        }
-
-        if (options & PAYLOAD_UPTIME) {
-                n = snprintf(ppos, (size_t)buflen, "uptime: %ld\n", get_uptime());
-                buflen -= n, ppos += n;
-        }
-
-        if (options & PAYLOAD_BUNDLES) {
-                int num_bundles, i;
-                struct dirent **entries;
-
-                num_bundles = scandir("/usr/share/clear/bundles", &entries, nodots, alphasort);
-                if (num_bundles < 0) {
-                        telem_perror("scandir failed");
-                        free(payload);
-                        return NULL;
-                }
-                n = snprintf(ppos, (size_t)buflen, "\nBundles (%d):\n", num_bundles);
-                buflen -= n, ppos += n;
-
-                for (i = 0; i < num_bundles; i++) {
-                        n = snprintf(ppos, (size_t)buflen, "%s\n", entries[i]->d_name);
-                        /* Test if truncated output */
-                        if (n >= buflen) {
-                                int lastix = MAX_PAYLOAD_LENGTH-1;
-                                payload[lastix] = '\0';
-                                payload[lastix-1] = '.';
-                                payload[lastix-2] = '.';
-                                payload[lastix-3] = '.';
-                                payload[lastix-4] = '\n';
-                                break;
-                        }
-                        buflen -= n, ppos += n;
-                }
-
-                for (i= 0; i < num_bundles; i++) {
-                        free(entries[i]);
-                }
-
-                free(entries);
-        }
-
-        return payload;
-}
-
 int main(int argc, char **argv)
 {
         uint32_t severity = 1;
@@ -158,17 +75,17 @@ int main(int argc, char **argv)
                                 }
                                 break;
                         case 'H':
-                                str = "org.clearlinux/heartbeat/ping";
+                                str = HEARTBEAT_CLASSIFICATION;
                                 memcpy(classification, str, strlen(str));
                                 break;
                         case 'l':
-                                payload_options |= PAYLOAD_LOCALE;
+                                payload_options |= HEARTBEAT_LOCALE;
                                 break;
                         case 'u':
-                                payload_options |= PAYLOAD_UPTIME;
+                                payload_options |= HEARTBEAT_UPTIME;
                                 break;
                         case 'b':
-                                payload_options |= PAYLOAD_BUNDLES;
+                                payload_options |= HEARTBEAT_BUNDLES;
                                 break;
                         case 'h':
                                 print_usage(argv[0]);
@@ -182,7 +99,7 @@ int main(int argc, char **argv)
         }
 
         setlocale(LC_ALL, "");
-        payload = create_payload(payload_options);
+        payload = create_heartbeat_payload(payload_options, setlocale(LC_ALL, NULL));
         if (payload == NULL) {
                 exit(EXIT_FAILURE);
         }
@@ -15,12 +15,15 @@
  */
 
 #define _GNU_SOURCE
+#include <errno.h>
 #include <getopt.h>
+#include <limits.h>
 #include <poll.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 
 /* Certain static analysis tools do not understand GCC's __INCLUDE_LEVEL__
@@ -36,13 +39,22 @@
 #include <systemd/sd-id128.h>
 
 #include "config.h"
+#include "common.h"
 #include "log.h"
 #include "telemetry.h"
 #include "probe.h"
+#include "probe_record.h"
+#include "journal_cursor.h"
 #include "nica/nc-string.h"
 #define BOOT_ID_LEN 33
 
+/* Seconds a message waits for others before its record is sent */
+#define JOURNAL_BATCH_TIME 5
+
 static nc_string *payload = NULL;
+/* cursor of the last message in the payload */
+static char *payload_cursor = NULL;
+static time_t payload_since = 0;
 static uint32_t severity = 2;
 static uint32_t payload_version = 1;
 static char error_class[30] = "org.clearlinux/journal/error";
@@ -60,50 +72,53 @@ static inline void tm_journal_match_err(int ret)
 
 static void add_to_payload(const void *data, size_t length)
 {
+        // A record holds MAX_PAYLOAD_LENGTH bytes, newline included
+        if (length > MAX_PAYLOAD_LENGTH - 1) {
+                length = MAX_PAYLOAD_LENGTH - 1;
+        }
+
         if (payload != NULL) {
                 nc_string_append_printf(payload, "%.*s\n", (int)length,
                                         (char *)data);
         } else {
                 payload = nc_string_dup_printf("%.*s\n", (int)length,
                                                (char *)data);
+                nc_string_reserve(payload, MAX_PAYLOAD_LENGTH);
         }
 }
 
 static bool send_data(char *class)
 {
-        struct telem_ref *handle = NULL;
         int ret;
 
-        if ((ret = tm_create_record(&handle, severity, class,
-                                    payload_version)) < 0) {
-                telem_log(LOG_ERR, "Failed to create record: %s\n",
-                          strerror(-ret));
-                goto fail;
-        }
-
-        char *payload_str = strdup(payload->str);
+        ret = probe_send_record(severity, class, payload_version, payload->str);
         nc_string_free(payload);
         payload = NULL;
 
-        if ((ret = tm_set_payload(handle, (char *)payload_str)) < 0) {
-                telem_log(LOG_ERR, "Failed to set payload: %s\n", strerror(-ret));
-                free(payload_str);
-                tm_free_record(handle);
-                goto fail;
-        }
+        return ret == 0;
+}
 
-        free(payload_str);
+/* Sends the messages batched so far, and saves the cursor of the last one */
+static void flush_payload(void)
+{
+        if (payload == NULL) {
+                return;
+        }
 
-        if ((ret = tm_send_record(handle)) < 0) {
-                telem_log(LOG_ERR, "Failed to send record: %s\n", strerror(-ret));
-                tm_free_record(handle);
-                goto fail;
+        // Errors are ignored, hoping that it's a transient problem. The
+        // cursor stays at the last batch sent, for the next one to move.
+        if (!send_data(error_class)) {
+                telem_log(LOG_ERR, "Failed to send data. Ignoring.\n");
+        } else if (payload_cursor) {
+                journal_cursor_save(JOURNAL_CURSOR_FILE, payload_cursor);
         }
 
-        tm_free_record(handle);
-        return true;
-fail:
-        return false;
+        if (payload) {
+                nc_string_free(payload);
+                payload = NULL;
+        }
+        free(payload_cursor);
+        payload_cursor = NULL;
 }
 
 static int read_new_entries(sd_journal *journal)
@@ -120,16 +135,22 @@ static int read_new_entries(sd_journal *journal)
                         return -1;
                 }
 
+                // Messages are batched in one record, up to the payload size
+                // limit, so that error storms do not flood telemprobd
+                if (payload != NULL &&
+                    (size_t)payload->len + length + 1 > MAX_PAYLOAD_LENGTH) {
+                        flush_payload();
+                }
+                if (payload == NULL) {
+                        payload_since = time(NULL);
+                }
                 add_to_payload(data, length);
 
-                // For now, we send one record per log message, in case the
-                // there is a large backlog of messages and we exceed the
-                // payload size limit (8KB). And ignore errors, hoping that it's
-                // a transient problem.
-
-                if (!send_data(error_class)) {
-                        telem_log(LOG_ERR, "Failed to send data. Ignoring.\n");
-                        return num_entries;
+                free(payload_cursor);
+                payload_cursor = NULL;
+                ret = sd_journal_get_cursor(journal, &payload_cursor);
+                if (ret < 0) {
+                        tm_journal_err("Failed to get journal cursor", ret);
                 }
 
                 num_entries++;
@@ -148,6 +169,42 @@ static int read_new_entries(sd_journal *journal)
         }
 }
 
+/*
+ * Moves past the last message sent, if a cursor was saved
+ *
+ * @return 1 if the journal was positioned, 0 without a usable cursor, or -1
+ */
+static int seek_saved_cursor(sd_journal *journal)
+{
+        char *cursor;
+        int ret;
+
+        cursor = journal_cursor_load(JOURNAL_CURSOR_FILE);
+        if (!cursor) {
+                return 0;
+        }
+
+        ret = sd_journal_seek_cursor(journal, cursor);
+        if (ret < 0) {
+                tm_journal_err("Failed to seek to the saved journal cursor", ret);
+                free(cursor);
+                return 0;
+        }
+        // The next entry is the one of the cursor, already sent, unless it
+        // was rotated away
+        ret = sd_journal_next(journal);
+        if (ret > 0 && sd_journal_test_cursor(journal, cursor) <= 0) {
+                ret = sd_journal_previous(journal);
+        }
+        free(cursor);
+        if (ret < 0) {
+                tm_journal_err("Failed to move past the saved journal cursor", ret);
+                return -1;
+        }
+
+        return 1;
+}
+
 static bool process_existing_entries(sd_journal *journal)
 {
         int ret;
@@ -280,7 +337,14 @@ static bool process_journal(bool process_existing)
         }
 
         if (process_existing) {
-                if (!process_existing_entries(journal)) {
+                r = seek_saved_cursor(journal);
+                if (r < 0) {
+                        return false;
+                } else if (r > 0) {
+                        if (read_new_entries(journal) < 0) {
+                                return false;
+                        }
+                } else if (!process_existing_entries(journal)) {
                         return false;
                 }
         } else {
@@ -295,14 +359,28 @@ static bool process_journal(bool process_existing)
 
         // Now wait for new journal entries
         while (true) {
-                r = poll(&pfd, 1, -1);
+                int timeout = -1;
+
+                if (payload != NULL) {
+                        time_t elapsed = time(NULL) - payload_since;
+
+                        if (elapsed < 0 || elapsed >= JOURNAL_BATCH_TIME) {
+                                flush_payload();
+                        } else {
+                                timeout = (int)(JOURNAL_BATCH_TIME - elapsed) * 1000;
+                        }
+                }
+
+                r = poll(&pfd, 1, timeout);
                 if (r < 0) {
+                        if (errno == EINTR) {
+                                continue;
+                        }
                         telem_perror("Polling failed on the journal socket");
                         return false;
                 } else if (r == 0) {
-                        // unreachable, since we don't set a timeout
-                        telem_log(LOG_ERR, "poll timed out\n");
-                        return false;
+                        // The batch waited long enough
+                        flush_payload();
                 } else {
                         r = sd_journal_process(journal);
                         // we don't care about the NOP or INVALIDATE cases
@@ -382,6 +460,8 @@ fail:
         if (payload) {
                 nc_string_free(payload);
         }
+        free(payload_cursor);
+        probe_record_release();
 
         return ret;
 }
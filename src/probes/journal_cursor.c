@@ -0,0 +1,102 @@
+/*
+ * This program is part of the Clear Linux Project
+ *
+ * Copyright 2019 Intel Corporation
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms and conditions of the GNU Lesser General Public License, as
+ * published by the Free Software Foundation; either version 2.1 of the License,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU Lesser General Public License for more
+ * details.
+ */
+
+
+#define _GNU_SOURCE
+#include <ctype.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "journal_cursor.h"
+#include "log.h"
+
+/* Cursors are printable, without spaces, see sd_journal_get_cursor(3) */
+static bool valid_cursor(const char *cursor, size_t len)
+{
+        if (len == 0 || len > JOURNAL_CURSOR_MAX) {
+                return false;
+        }
+        for (size_t i = 0; i < len; i++) {
+                if (!isgraph((unsigned char)cursor[i])) {
+                        return false;
+                }
+        }
+
+        return true;
+}
+
+int journal_cursor_save(const char *path, const char *cursor)
+{
+        char tmp_file[PATH_MAX];
+        FILE *file;
+        int ret = 0;
+
+        if (!valid_cursor(cursor, strlen(cursor))) {
+                return -EINVAL;
+        }
+        if (snprintf(tmp_file, sizeof(tmp_file), "%s.tmp", path) >= (int)sizeof(tmp_file)) {
+                return -ENAMETOOLONG;
+        }
+
+        file = fopen(tmp_file, "w");
+        if (!file) {
+                ret = -errno;
+                telem_perror("Cannot save journal cursor");
+                return ret;
+        }
+        fprintf(file, "%s\n", cursor);
+        if (fclose(file) != 0 || rename(tmp_file, path) != 0) {
+                ret = -errno;
+                telem_perror("Cannot save journal cursor");
+                unlink(tmp_file);
+        }
+
+        return ret;
+}
+
+char *journal_cursor_load(const char *path)
+{
+        char *cursor = NULL;
+        size_t len = 0;
+        ssize_t n;
+        FILE *file;
+
+        file = fopen(path, "r");
+        if (!file) {
+                return NULL;
+        }
+        n = getline(&cursor, &len, file);
+
+        /* One line, complete, and nothing after it */
+        if (n < 2 || cursor[n - 1] != '\n' || fgetc(file) != EOF ||
+            !valid_cursor(cursor, (size_t)n - 1)) {
+                telem_log(LOG_WARNING, "Ignoring corrupted journal cursor in %s\n", path);
+                fclose(file);
+                free(cursor);
+                return NULL;
+        }
+        fclose(file);
+        cursor[n - 1] = '\0';
+
+        return cursor;
+}
+
+/* vi: set ts=8 sw=8 sts=4 et tw=80 cino=(0: */
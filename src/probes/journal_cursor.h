@@ -0,0 +1,51 @@
+/*
+ * This program is part of the Clear Linux Project
+ *
+ * Copyright 2019 Intel Corporation
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms and conditions of the GNU Lesser General Public License, as
+ * published by the Free Software Foundation; either version 2.1 of the License,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU Lesser General Public License for more
+ * details.
+ */
+
+#pragma once
+
+/*
+ * Cursor of the last journal message journalprobe sent, saved in a file so
+ * that a restarted probe resumes after it. The file holds the cursor on one
+ * line, and is replaced through a temporary file.
+ */
+
+#define JOURNAL_CURSOR_FILE LOCALSTATEDIR "/lib/telemetry/journalprobe.cursor"
+/* Cursors longer than this are taken as a corrupted file */
+#define JOURNAL_CURSOR_MAX 1024
+
+/**
+ * Saves a cursor
+ *
+ * @param path File of the cursor
+ * @param cursor Cursor returned by sd_journal_get_cursor()
+ *
+ * @return 0 on success, -EINVAL if cursor is not one journal_cursor_load
+ *     reads back, or another negative errno-style value
+ */
+int journal_cursor_save(const char *path, const char *cursor);
+
+/**
+ * Loads the saved cursor
+ *
+ * @param path File of the cursor
+ *
+ * @return a newly allocated cursor, or NULL if none was saved, or if the file
+ *     is corrupted, in which case the probe starts from the head of the
+ *     journal again
+ */
+char *journal_cursor_load(const char *path);
+
+/* vi: set ts=8 sw=8 sts=4 et tw=80 cino=(0: */
@@ -20,10 +20,11 @@
 #include <stdio.h>
 #include <sys/klog.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <unistd.h>
-#include <malloc.h>
 #include <signal.h>
 
+#include "config.h"
 #include "log.h"
 #include "oops_parser.h"
 #include "klog_scanner.h"
@@ -31,23 +32,48 @@
 #define SYSLOG_ACTION_READ 2
 #define SYSLOG_ACTION_SIZE_BUFFER 10
 #define MAX_BUF 8192
+#define KLOG_SEQ_FILE LOCALSTATEDIR "/lib/telemetry/klogscanner.seq"
 
-int main(void)
+/* Reads one record of the kernel log per read(), blocking until the next */
+static int scan_kmsg(int fd)
 {
-        int log_size = 0;
-        char *bufp = NULL;
-        size_t buflen = 0;
-
-        oops_parser_init(klog_process_oops_msgs);
+        struct kmsg_state state;
+        char record[KMSG_RECORD_MAX + 1];
 
-        // Signal Handling to terminate the probe.
-        if (signal (SIGINT, signal_handler_fail) == SIG_ERR) {
-                telem_log(LOG_ERR, "Error handling interrupt signal\n");
+        if (kmsg_state_init(&state, KLOG_SEQ_FILE) != 0) {
+                return 1;
         }
-        if (signal (SIGTERM, signal_handler_success) == SIG_ERR) {
-                telem_log(LOG_ERR, "Error handling terminating signal\n");
+
+        while (1) {
+                ssize_t len = read(fd, record, KMSG_RECORD_MAX);
+
+                if (len < 0) {
+                        if (errno == EINTR) {
+                                continue;
+                        }
+                        if (errno == EPIPE) {
+                                // Overwritten before being read, the next read resumes
+                                telem_log(LOG_WARNING, "Kernel log records were overwritten\n");
+                                continue;
+                        }
+                        telem_perror("Cannot read kernel log");
+                        return 1;
+                }
+                record[len] = '\0';
+                kmsg_process_record(&state, record, (size_t)len);
         }
 
+        // Not reached
+        return 0;
+}
+
+/* Reads the kernel ring buffer with klogctl, without /dev/kmsg */
+static int scan_klog(void)
+{
+        int log_size = 0;
+        char *bufp = NULL;
+        size_t buflen = 0;
+
         // Gets the size of the kernel ring buffer
         log_size = klogctl(SYSLOG_ACTION_SIZE_BUFFER, NULL, 0);
         if (log_size < 0) {
@@ -62,19 +88,23 @@ int main(void)
 
         // Gets the contents of the kernel ring buffer
         bufp = (char *)malloc(buflen);
+        if (!bufp) {
+                telem_log(LOG_ERR, "Call to malloc failed\n");
+                return 1;
+        }
 
         while (1) {
                 int bytes_read;
- 
-                malloc_trim(0);
-                memset(bufp, 0, buflen);
+
+                // Only the bytes read are processed, the buffer is not cleared
                 bytes_read = klogctl(SYSLOG_ACTION_READ, bufp, (int)buflen);
                 if (bytes_read < 0) {
                         telem_perror("Cannot read contents of kernel ring buffer");
+                        free(bufp);
                         return 1;
                 }
 
-                klog_process_buffer(bufp, (size_t)bytes_read);
+                klog_process_buffer(bufp, bytes_read);
         }
 
         // Not reached
@@ -82,4 +112,27 @@ int main(void)
         return 0;
 }
 
+int main(void)
+{
+        int fd;
+
+        oops_parser_init(klog_process_oops_msgs);
+
+        // Signal Handling to terminate the probe.
+        if (signal (SIGINT, signal_handler_fail) == SIG_ERR) {
+                telem_log(LOG_ERR, "Error handling interrupt signal\n");
+        }
+        if (signal (SIGTERM, signal_handler_success) == SIG_ERR) {
+                telem_log(LOG_ERR, "Error handling terminating signal\n");
+        }
+
+        fd = open(KMSG_PATH, O_RDONLY | O_CLOEXEC);
+        if (fd >= 0) {
+                return scan_kmsg(fd);
+        }
+        telem_perror("Cannot open " KMSG_PATH ", reading the kernel ring buffer");
+
+        return scan_klog();
+}
+
 /* vi: set ts=8 sw=8 sts=4 et tw=80 cino=(0: */
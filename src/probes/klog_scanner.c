@@ -22,10 +22,16 @@
 #include <errno.h>
 #include <unistd.h>
 #include <sys/stat.h>
+#include <limits.h>
+#include <string.h>
+#include <inttypes.h>
 
+#include "configuration.h"
+#include "dedup.h"
 #include "log.h"
 #include "oops_parser.h"
 #include "klog_scanner.h"
+#include "probe_record.h"
 #include "telemetry.h"
 #include "nica/nc-string.h"
 
@@ -33,34 +39,6 @@ static bool oops_processed = false;
 
 static uint32_t version = 1;
 
-static bool send_data(char *backtrace, char *class, uint32_t severity)
-{
-        struct telem_ref *handle = NULL;
-        int ret;
-
-        if ((ret = tm_create_record(&handle, severity, class, version)) < 0) {
-                telem_log(LOG_ERR, "Failed to create record: %s",
-                          strerror(-ret));
-                return false;
-        }
-
-        if ((ret = tm_set_payload(handle, backtrace)) < 0) {
-                telem_log(LOG_ERR, "Failed to set payload: %s", strerror(-ret));
-                tm_free_record(handle);
-                return false;
-        }
-
-        if ((ret = tm_send_record(handle)) < 0) {
-                telem_log(LOG_ERR, "Failed to send record: %s", strerror(-ret));
-                tm_free_record(handle);
-                return false;
-        }
-
-        tm_free_record(handle);
-
-        return true;
-}
-
 int klog_process_buffer(char *bufp, int bytes)
 {
         // Splits the buffer into separate lines with /0 terminating
@@ -99,59 +77,146 @@ void split_buf_by_line(char *bufp, int bytes)
         }
 }
 
-void klog_process_oops_msgs(struct oops_log_msg *msg)
+int kmsg_state_init(struct kmsg_state *state, const char *seq_file)
 {
-        size_t linelength, size;
-        char *line;
-        char *contents = NULL;
-        nc_string *payload;
+        char boot_id[40] = { 0 };
+        uint64_t seq = 0;
+        FILE *file;
 
-        // pass 1: calculate buffer size
-        size = 0;
-        for (int i = 0; i < msg->length; i++) {
-                size += strlen(msg->lines[i]) + 1;
+        memset(state, 0, sizeof(*state));
+        state->seq_file = seq_file;
+
+        file = fopen("/proc/sys/kernel/random/boot_id", "r");
+        if (!file) {
+                telem_perror("Cannot read boot id");
+                return -1;
+        }
+        if (!fgets(boot_id, sizeof(boot_id), file)) {
+                fclose(file);
+                return -1;
+        }
+        fclose(file);
+        memcpy(state->boot_id, boot_id, sizeof(state->boot_id) - 1);
+        state->boot_id[strcspn(state->boot_id, "\n")] = '\0';
+
+        // Records of the same boot may have been handled already
+        file = fopen(seq_file, "r");
+        if (!file) {
+                return 0;
+        }
+        if (fscanf(file, "%36s %" SCNu64, boot_id, &seq) == 2 &&
+            strcmp(boot_id, state->boot_id) == 0) {
+                state->resume = true;
+                state->resume_seq = seq;
         }
+        fclose(file);
+
+        return 0;
+}
 
-        contents = malloc(size);
-        if (!contents) {
-                telem_log(LOG_ERR, "Call to malloc failed");
-                oops_processed = true;
-                return;
+int kmsg_save_seq(struct kmsg_state *state)
+{
+        char tmp_file[PATH_MAX];
+        FILE *file;
+
+        if (snprintf(tmp_file, sizeof(tmp_file), "%s.tmp", state->seq_file) >=
+            (int)sizeof(tmp_file)) {
+                return -1;
+        }
+        file = fopen(tmp_file, "w");
+        if (!file) {
+                telem_perror("Cannot save kernel log sequence number");
+                return -1;
+        }
+        fprintf(file, "%s %" PRIu64 "\n", state->boot_id, state->seq);
+        if (fclose(file) != 0 || rename(tmp_file, state->seq_file) != 0) {
+                telem_perror("Cannot save kernel log sequence number");
+                unlink(tmp_file);
+                return -1;
         }
 
-        // pass 2: copy strings into the buffer
-        size_t done = 0;
-        char *bp = contents;
-        for (int i = 0; i < msg->length; i++) {
-                //Add the newline character to the end of each line
-                line = msg->lines[i];
-                linelength = strlen(line);
-                // Copy the line (without the terminating NULL)
-                memcpy(bp, line, linelength);
-                bp[linelength] = '\n';
-                done += linelength + 1;
-                bp = contents + done;
-        }
-
-        struct oops_log_msg oops_msg;
-        if (handle_entire_oops(contents, (long)size, &oops_msg)) {
-#ifdef DEBUG
-                telem_debug("DEBUG: Raw oops message:\n");
-                for (int i = 0; i < oops_msg.length; i++) {
-                        telem_log(LOG_DEBUG, "%s\n", oops_msg.lines[i]);
+        return 0;
+}
+
+int kmsg_process_record(struct kmsg_state *state, char *record, size_t len)
+{
+        char *fields;
+        char *msg;
+        char *end;
+        uint64_t seq;
+
+        /* prio,seq,timestamp,flags[,...];message\n followed by the dictionary */
+        fields = memchr(record, ',', len);
+        msg = memchr(record, ';', len);
+        if (!fields || !msg || fields > msg) {
+                return -1;
+        }
+        seq = strtoull(fields + 1, &end, 10);
+        if (end == fields + 1 || (*end != ',' && *end != ';')) {
+                return -1;
+        }
+
+        if (state->resume) {
+                if (seq <= state->resume_seq) {
+                        return 1;
                 }
+                state->resume = false;
+                state->started = true;
+                state->seq = state->resume_seq;
+        }
+        if (state->started && seq > state->seq + 1) {
+                telem_log(LOG_WARNING, "%" PRIu64 " kernel log records were lost\n",
+                          seq - state->seq - 1);
+        }
+        state->seq = seq;
+        state->started = true;
+
+        msg++;
+        end = memchr(msg, '\n', len - (size_t)(msg - record));
+        if (!end) {
+                end = record + len;
+        }
+        *end = '\0';
+
+        oops_processed = false;
+        parse_single_message(msg, (size_t)(end - msg));
+        if (oops_processed) {
+                kmsg_save_seq(state);
+        }
+
+        return 0;
+}
+
+void klog_process_oops_msgs(struct oops_log_msg *msg)
+{
+        nc_string *payload;
+
+#ifdef DEBUG
+        telem_debug("DEBUG: Raw oops message:\n");
+        for (int i = 0; i < msg->length; i++) {
+                telem_log(LOG_DEBUG, "%s\n", msg->lines[i]);
+        }
 #endif
-                payload = parse_payload(&oops_msg);
-                telem_debug("DEBUG: Payload Parsed :%s\n", payload->str);
-                oops_msg_cleanup(&oops_msg);
-                send_data(payload->str, (char *)oops_msg.pattern->classification, (uint32_t)oops_msg.pattern->severity);
-                nc_string_free(payload);
+        /* The lines and the parsing are released with the arena of msg */
+        payload = parse_payload(msg);
+        telem_debug("DEBUG: Payload Parsed :%s\n", payload->str);
+
+        // The same oops in a loop is sent once per window
+        uint32_t occurrences;
+        int dup = dedup_check(DEDUP_FILE, msg->pattern->classification, payload->str,
+                              crash_dedup_window_config(), time(NULL), &occurrences);
+        if (dup == 1) {
+                telem_log(LOG_NOTICE, "Duplicate oops, not reported\n");
         } else {
-                /* File does no contain an oops! */
-                telem_log(LOG_ERR, "Did not find an oops in the oops directory\n");
+                if (occurrences > 1) {
+                        nc_string_append_printf(payload, "Occurrences : %u\n", occurrences);
+                }
+                probe_send_record((uint32_t)msg->pattern->severity,
+                                  (char *)msg->pattern->classification,
+                                  version, payload->str);
         }
+        nc_string_free(payload);
 
-        free(contents);
         oops_processed = true;
 }
 
@@ -15,8 +15,66 @@
  */
 
 #pragma once
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
 #include "oops_parser.h"
 
+#define KMSG_PATH "/dev/kmsg"
+/* Largest record read from /dev/kmsg, message and dictionary */
+#define KMSG_RECORD_MAX 8192
+
+/*
+ * Reading /dev/kmsg, records are handled in the order of their sequence
+ * numbers. The sequence number of the record that completed the last oops
+ * is saved with the boot id, and after a restart the records up to it are
+ * skipped, so that an oops is neither sent twice nor missed.
+ */
+struct kmsg_state {
+        /* sequence number of the last record handled */
+        uint64_t seq;
+        bool started;
+        /* records up to resume_seq were handled before a restart */
+        bool resume;
+        uint64_t resume_seq;
+        const char *seq_file;
+        char boot_id[37];
+};
+
+/**
+ * Initializes the state of the /dev/kmsg reader, loading the sequence
+ * number saved during the same boot
+ *
+ * @param state The state
+ * @param seq_file Path of the file with the saved sequence number
+ *
+ * @return 0 on success, -1 if the boot id cannot be read
+ */
+int kmsg_state_init(struct kmsg_state *state, const char *seq_file);
+
+/**
+ * Handles a record read from /dev/kmsg, passing its message to the oops
+ * parser in place
+ *
+ * @param state The state
+ * @param record The record, null terminated, modified
+ * @param len Length of the record
+ *
+ * @return 0 if the record was handled, 1 if it was handled before a
+ *     restart, -1 if it is invalid
+ */
+int kmsg_process_record(struct kmsg_state *state, char *record, size_t len);
+
+/**
+ * Saves the sequence number of the last record handled
+ *
+ * @param state The state
+ *
+ * @return 0 on success, -1 on failure
+ */
+int kmsg_save_seq(struct kmsg_state *state);
+
 /**
  * Process the buffer and send it to the backend
  *
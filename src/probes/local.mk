@@ -22,7 +22,10 @@ if HAVE_SYSTEMD_JOURNAL
 endif
 endif
 
-%C%_hprobe_SOURCES = %D%/hello.c
+%C%_hprobe_SOURCES = \
+	%D%/hello.c \
+	src/heartbeat.c \
+	src/heartbeat.h
 %C%_hprobe_LDADD = $(top_builddir)/src/libtelemetry.la
 %C%_hprobe_CFLAGS = $(AM_CFLAGS)
 %C%_hprobe_LDFLAGS = \
@@ -51,10 +54,15 @@ if HAVE_SYSTEMD_JOURNAL
 endif
 endif
 
-%C%_telem_record_gen_SOURCES = %D%/telem_record_gen.c
+%C%_telem_record_gen_SOURCES = \
+	%D%/telem_record_gen.c \
+	%D%/record_bench.c \
+	%D%/record_bench.h
 %C%_telem_record_gen_CFLAGS = \
 	$(AM_CFLAGS)
-%C%_telem_record_gen_LDADD = $(top_builddir)/src/libtelemetry.la
+%C%_telem_record_gen_LDADD = \
+	$(top_builddir)/src/libtelemetry.la \
+	@PTHREAD_LIBS@
 %C%_telem_record_gen_LDFLAGS = \
 	$(AM_LDFLAGS) \
 	-pie
@@ -89,6 +97,12 @@ endif
 
 %C%_crashprobe_SOURCES = \
 	%D%/crash_probe.c \
+	%D%/dedup.c \
+	%D%/dedup.h \
+	%D%/probe_record.c \
+	%D%/probe_record.h \
+	%D%/symcache.c \
+	%D%/symcache.h \
 	src/nica/nc-string.c \
 	%D%/probe.h
 %C%_crashprobe_CFLAGS = \
@@ -96,7 +110,8 @@ endif
 %C%_crashprobe_LDADD = \
 	$(top_builddir)/src/libtelemetry.la \
 	$(top_builddir)/src/libtelem-shared.la \
-	@ELFUTILS_LIBS@
+	@ELFUTILS_LIBS@ \
+	@PTHREAD_LIBS@
 %C%_crashprobe_LDFLAGS = \
        $(AM_LDFLAGS) \
        -pie
@@ -112,6 +127,8 @@ endif
 
 %C%_pstoreprobe_SOURCES = \
 	%D%/pstore_probe.c \
+	%D%/probe_record.c \
+	%D%/probe_record.h \
 	src/nica/nc-string.c \
 	%D%/oops_parser.c
 %C%_pstoreprobe_CFLAGS = \
@@ -134,12 +151,17 @@ endif
         %D%/klog_scanner.c \
 	%D%/klog_scanner.h \
 	%D%/oops_parser.h \
+	%D%/dedup.c \
+	%D%/dedup.h \
+	%D%/probe_record.c \
+	%D%/probe_record.h \
 	src/nica/nc-string.c \
 	%D%/oops_parser.c
 %C%_klogscanner_CFLAGS = \
         $(AM_CFLAGS)
 %C%_klogscanner_LDADD = \
-        $(top_builddir)/src/libtelemetry.la
+        $(top_builddir)/src/libtelemetry.la \
+        $(top_builddir)/src/libtelem-shared.la
 %C%_klogscanner_LDFLAGS = \
         $(AM_LDFLAGS) \
         -pie
@@ -161,6 +183,10 @@ bin_PROGRAMS += \
 
 %C%_journalprobe_SOURCES = \
 	src/nica/nc-string.c \
+	%D%/probe_record.c \
+	%D%/probe_record.h \
+	%D%/journal_cursor.c \
+	%D%/journal_cursor.h \
 	%D%/journal.c
 %C%_journalprobe_CFLAGS = \
 	$(AM_CFLAGS) \
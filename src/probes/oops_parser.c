@@ -24,6 +24,7 @@
 #include <unistd.h>
 
 #include "oops_parser.h"
+#include "common.h"
 #include "log.h"
 #include "probe.h"
 
@@ -47,6 +48,7 @@ struct oops_pattern oops_patterns_arr[] = {
                 "sysctl table check failed: ",
                 "org.clearlinux/kernel/warning",
                 TM_MEDIUM,
+                false,
         },
         {
                 "IRQ handler type mismatch for IRQ",
@@ -59,12 +61,14 @@ struct oops_pattern oops_patterns_arr[] = {
                 "crash/kernel/bug",
                 TM_MEDIUM,
                 true,
+                "ALSA ",
         },
         {
                 "irq [[:digit:]]+: nobody cared",
                 "crash/kernel/warning",
                 TM_MEDIUM,
                 true,
+                ": nobody cared",
         },
         {
                 "WARNING: ",
@@ -226,6 +230,75 @@ static bool starts_with(const char *line, const char *line_end, const char *subs
         return false;
 }
 
+struct oops_arena_block {
+        struct oops_arena_block *next;
+        size_t size;
+        size_t used;
+        char data[];
+};
+
+static void *oops_arena_alloc(struct oops_arena *arena, size_t size)
+{
+        struct oops_arena_block *block = arena->blocks;
+        void *ptr;
+
+        size = (size + 7) & ~(size_t)7;
+        if (!block || block->size - block->used < size) {
+                size_t block_size = size > OOPS_ARENA_BLOCK ? size : OOPS_ARENA_BLOCK;
+
+                block = malloc(sizeof(struct oops_arena_block) + block_size);
+                if (!block) {
+                        exit(EXIT_FAILURE);
+                }
+                block->next = arena->blocks;
+                block->size = block_size;
+                block->used = 0;
+                arena->blocks = block;
+        }
+
+        ptr = block->data + block->used;
+        block->used += size;
+
+        return ptr;
+}
+
+static char *oops_arena_strndup(struct oops_arena *arena, const char *str, size_t len)
+{
+        char *copy = oops_arena_alloc(arena, len + 1);
+
+        memcpy(copy, str, len);
+        copy[len] = '\0';
+
+        return copy;
+}
+
+/* Releases what the arena holds, keeping its last block for the next message */
+static void oops_arena_reset(struct oops_arena *arena)
+{
+        struct oops_arena_block *block = arena->blocks;
+
+        if (!block) {
+                return;
+        }
+        while (block->next) {
+                struct oops_arena_block *next = block->next->next;
+
+                free(block->next);
+                block->next = next;
+        }
+        block->used = 0;
+}
+
+static void oops_arena_free(struct oops_arena *arena)
+{
+        while (arena->blocks) {
+                struct oops_arena_block *next = arena->blocks->next;
+
+                free(arena->blocks);
+                arena->blocks = next;
+        }
+}
+
 static bool str_starts_with_casei(const char *line, const char *substr)
 {
         size_t len = strlen(substr);
@@ -236,34 +309,189 @@ static bool str_starts_with_casei(const char *line, const char *substr)
         return false;
 }
 
-static bool pattern_matches(char *line, char *line_end, struct oops_pattern *pattern)
+/*
+ * The literal patterns are prefixes of the line, kept in a trie so that one
+ * walk over the start of a line finds all of those it begins with. The regex
+ * patterns are only run on the lines containing their literal, and only when
+ * they come before the literal pattern found, which keeps the priority of
+ * the patterns in oops_patterns_arr.
+ */
+struct pattern_node {
+        char c;
+        /* index of the pattern ending at this node, or -1 */
+        int pattern;
+        int child;
+        int sibling;
+};
+
+static struct pattern_node *pattern_trie = NULL;
+static int pattern_trie_cnt = 0;
+static int regex_patterns[sizeof(oops_patterns_arr) / sizeof(struct oops_pattern)];
+static int regex_patterns_cnt = 0;
+
+static int pattern_node_child(int node, char c)
 {
-        if (pattern->is_regex) {
-                return (regexec(&(pattern->regex), line, 0, NULL, 0) == 0);
-        } else {
-                return starts_with(line, line_end, pattern->begin_line);
+        for (int n = pattern_trie[node].child; n != -1; n = pattern_trie[n].sibling) {
+                if (pattern_trie[n].c == c) {
+                        return n;
+                }
+        }
+        return -1;
+}
+
+static int pattern_node_add(int node, char c)
+{
+        int n = pattern_trie_cnt++;
+
+        pattern_trie[n].c = c;
+        pattern_trie[n].pattern = -1;
+        pattern_trie[n].child = -1;
+        pattern_trie[n].sibling = pattern_trie[node].child;
+        pattern_trie[node].child = n;
+
+        return n;
+}
+
+/* Finds the first pattern of oops_patterns_arr the line matches, or -1 */
+static int match_pattern(const char *line, const char *line_end)
+{
+        int best = -1;
+        int node = 0;
+
+        for (const char *p = line; p < line_end && *p; p++) {
+                node = pattern_node_child(node, *p);
+                if (node == -1) {
+                        break;
+                }
+                if (pattern_trie[node].pattern != -1 &&
+                    (best == -1 || pattern_trie[node].pattern < best)) {
+                        best = pattern_trie[node].pattern;
+                }
+        }
+
+        for (int i = 0; i < regex_patterns_cnt; i++) {
+                struct oops_pattern *pattern = &oops_patterns_arr[regex_patterns[i]];
+
+                if (best != -1 && regex_patterns[i] > best) {
+                        break;
+                }
+                if (pattern->literal && !strcasestr(line, pattern->literal)) {
+                        continue;
+                }
+                if (regexec(&(pattern->regex), line, 0, NULL, 0) == 0) {
+                        return regex_patterns[i];
+                }
         }
+
+        return best;
 }
 
-static void init_pattern_regex(void)
+static void init_pattern_matcher(void)
 {
+        size_t nodes = 1;
+
+        for (int i = 0; i < oops_patterns_cnt; i++) {
+                if (!oops_patterns_arr[i].is_regex) {
+                        nodes += strlen(oops_patterns_arr[i].begin_line);
+                }
+        }
+
+        pattern_trie = malloc(nodes * sizeof(struct pattern_node));
+        if (!pattern_trie) {
+                exit(EXIT_FAILURE);
+        }
+        pattern_trie_cnt = 0;
+        pattern_trie[pattern_trie_cnt].c = '\0';
+        pattern_trie[pattern_trie_cnt].pattern = -1;
+        pattern_trie[pattern_trie_cnt].child = -1;
+        pattern_trie[pattern_trie_cnt].sibling = -1;
+        pattern_trie_cnt++;
+        regex_patterns_cnt = 0;
+
         for (int i = 0; i < oops_patterns_cnt; i++) {
                 struct oops_pattern *pattern = &oops_patterns_arr[i];
+                int node = 0;
+
                 if (pattern->is_regex) {
                         regcomp(&(pattern->regex), pattern->begin_line,
                                 REG_ICASE | REG_EXTENDED | REG_NOSUB);
+                        regex_patterns[regex_patterns_cnt++] = i;
+                        continue;
+                }
+
+                for (const char *p = pattern->begin_line; *p; p++) {
+                        int child = pattern_node_child(node, *p);
+
+                        node = child != -1 ? child : pattern_node_add(node, *p);
+                }
+                if (pattern_trie[node].pattern == -1) {
+                        pattern_trie[node].pattern = i;
                 }
         }
 }
 
-static void free_pattern_regex(void)
+static void free_pattern_matcher(void)
 {
-        for (int i = 0; i < oops_patterns_cnt; i++) {
-                struct oops_pattern *pattern = &oops_patterns_arr[i];
-                if (pattern->is_regex) {
-                        regfree(&(pattern->regex));
+        if (!pattern_trie) {
+                return;
+        }
+
+        for (int i = 0; i < regex_patterns_cnt; i++) {
+                regfree(&(oops_patterns_arr[regex_patterns[i]].regex));
+        }
+        regex_patterns_cnt = 0;
+        free(pattern_trie);
+        pattern_trie = NULL;
+        pattern_trie_cnt = 0;
+}
+
+/* Lines of an oops that end it, or its stack dump */
+#define OOPS_MARK_END_TRACE 0x1
+#define OOPS_MARK_NEW_OOPS 0x2
+#define OOPS_MARK_CODE 0x4
+
+struct oops_mark {
+        const char *text;
+        size_t len;
+        int flag;
+};
+
+static const struct oops_mark oops_marks[] = {
+        { "[ end trace", 11, OOPS_MARK_END_TRACE },
+        { "WARNING:", 8, OOPS_MARK_NEW_OOPS },
+        { "Unable to handle", 16, OOPS_MARK_NEW_OOPS },
+        { "Code:", 5, OOPS_MARK_CODE },
+        { "Instruction Dump::", 18, OOPS_MARK_CODE },
+};
+
+/*
+ * Finds the marks a line in the middle of an oops contains, in one pass
+ *
+ * @param line The line, null terminated
+ * @param line_end End of the line
+ * @param len Set to the length of the line
+ *
+ * @return the OOPS_MARK_* flags of the marks found
+ */
+static int find_oops_marks(const char *line, const char *line_end, size_t *len)
+{
+        const char *p;
+        int found = 0;
+
+        for (p = line; p < line_end && *p; p++) {
+                if (*p != '[' && *p != 'W' && *p != 'U' && *p != 'C' && *p != 'I') {
+                        continue;
+                }
+                for (size_t i = 0; i < sizeof(oops_marks) / sizeof(oops_marks[0]); i++) {
+                        if (*p == oops_marks[i].text[0] &&
+                            strncmp(p, oops_marks[i].text, oops_marks[i].len) == 0) {
+                                found |= oops_marks[i].flag;
+                        }
                 }
         }
+        *len = (size_t)(p - line);
+
+        return found;
 }
 
 bool handle_entire_oops(char *buf, long size, struct oops_log_msg *msg)
@@ -273,6 +501,7 @@ bool handle_entire_oops(char *buf, long size, struct oops_log_msg *msg)
         int i;
 
         msg->length = 0;
+        msg->arena.blocks = NULL;
 
         line_end = memchr(buf, '\n', (size_t)size);
         if (line_end == NULL) {
@@ -281,41 +510,35 @@ bool handle_entire_oops(char *buf, long size, struct oops_log_msg *msg)
 
         *line_end = '\0';
 
-        for (i = 0; i < oops_patterns_cnt; i++) {
-                pattern = &oops_patterns_arr[i];
-                if (pattern_matches(buf, line_end, pattern)) {
-                        break;
-                }
-        }
-        if (i == oops_patterns_cnt) {
+        i = match_pattern(buf, line_end);
+        if (i == -1) {
                 /* Nothin matched! */
                 return false;
         }
+        pattern = &oops_patterns_arr[i];
 
         msg->pattern = pattern;
         msg->length = 0;
-        msg->lines[msg->length] = strdup(buf);
-        if (msg->lines[msg->length] == NULL) {
-                exit(EXIT_FAILURE);
-        }
-
+        msg->lines[msg->length] = buf;
+        msg->line_lengths[msg->length] = (size_t)(line_end - buf);
         msg->length++;
 
         size = size - (line_end - buf + 1);
         buf = line_end + 1;
 
-        while (size > 0) {
+        while (size > 0 && msg->length < MAX_LINES) {
                 line_end = memchr(buf, '\n', (size_t)size);
                 if (line_end == NULL) {
-                        line_end = buf + size;
+                        /* No room for the terminator, the last line is copied */
+                        msg->lines[msg->length] = oops_arena_strndup(&msg->arena, buf, (size_t)size);
+                        msg->line_lengths[msg->length] = (size_t)size;
+                        msg->length++;
+                        break;
                 }
 
                 *line_end = '\0';
-                msg->lines[msg->length] = strndup(buf, (size_t)(line_end - buf + 1));
-                if (msg->lines[msg->length] == NULL) {
-                        exit(EXIT_FAILURE);
-                }
-
+                msg->lines[msg->length] = buf;
+                msg->line_lengths[msg->length] = (size_t)(line_end - buf);
                 msg->length++;
                 size -= (line_end - buf + 1);
                 buf = line_end + 1;
@@ -325,9 +548,7 @@ bool handle_entire_oops(char *buf, long size, struct oops_log_msg *msg)
 
 void oops_msg_cleanup(struct oops_log_msg *msg)
 {
-        for (int i = 0; i < msg->length; i++) {
-                free(msg->lines[i]);
-        }
+        oops_arena_free(&msg->arena);
         msg->length = 0;
 }
 
@@ -340,62 +561,61 @@ static oops_handler_t oops_handler;
 void oops_parser_init(oops_handler_t handler)
 {
         oops_handler = handler;
-        init_pattern_regex();
+        init_pattern_matcher();
 }
 
 static void handle_msg_end(void)
 {
-        for (int i = 0; i < oops_msg.length; i++) {
-                free(oops_msg.lines[i]);
-        }
+        oops_arena_reset(&oops_msg.arena);
         oops_msg.length = 0;
 }
 
 void oops_parser_cleanup()
 {
-        handle_msg_end();
-        free_pattern_regex();
+        oops_msg_cleanup(&oops_msg);
+        free_pattern_matcher();
 }
 
 void parse_single_line(char *line, size_t size)
 {
         char *start;
-        char *line_end;
-        bool end_found = false;
 
-        line_end = line + size;
         start = skip_log_level(line);
         start = skip_timestamp(start);
         start = skip_space(start);
 
-        struct oops_pattern *pattern;
+        parse_single_message(start, size - (size_t)(start - line));
+}
+
+void parse_single_message(char *msg, size_t size)
+{
+        char *start = msg;
+        char *line_end = msg + size;
+        bool end_found = false;
+
         if (oops_msg.length == 0) {
-                for (int i = 0; i < oops_patterns_cnt; i++) {
-                        pattern = &oops_patterns_arr[i];
-                        if (!pattern_matches(start, line_end, pattern)) {
-                                continue;
-                        }
+                int i = match_pattern(start, line_end);
+
+                if (i != -1) {
                         telem_log(LOG_DEBUG, "Oops start has been  detected\n");
 
-                        oops_msg.pattern = pattern;
-                        oops_msg.lines[oops_msg.length] = strndup(start, (size_t)(line_end - start));
-                        if (oops_msg.lines[oops_msg.length] == NULL) {
-                                //telem_perror("Failed to copy string");
-                                exit(EXIT_FAILURE);
-                                return;
-                        } else {
-                                oops_msg.length++;
-                        }
+                        oops_msg.pattern = &oops_patterns_arr[i];
+                        oops_msg.lines[oops_msg.length] = oops_arena_strndup(&oops_msg.arena, start,
+                                                                             (size_t)(line_end - start));
+                        oops_msg.line_lengths[oops_msg.length] = (size_t)(line_end - start);
+                        oops_msg.length++;
                         in_stack_dump = false;
-                        break;
                 }
         } else {
+                size_t len;
+                int marks = find_oops_marks(start, line_end, &len);
+
                 // If in the middle of oops
                 if (oops_msg.length >= MAX_LINES) {
                         end_found = true;
                         // } else if (oops_msg.end_line && strstr(start, oops_msg.end_line)) {
                         //        end_found = false;
-                } else if (strstr(start, "[ end trace")) {
+                } else if (marks & OOPS_MARK_END_TRACE) {
                         end_found = true;
                 } else if (!in_stack_dump) {
                         // This line indicates the beginning of a stack trace;
@@ -408,16 +628,14 @@ void parse_single_line(char *line, size_t size)
                         // for a single leading space character to indicate a
                         // stack frame line.
                         if (!(starts_with(start, line_end, " ")) ||
-                            (strlen(start) < 8) ||
-                            (strstr(start, "Code:") != NULL) ||
-                            (strstr(start, "Instruction Dump::") != NULL)) {
+                            (len < 8) || (marks & OOPS_MARK_CODE)) {
                                 in_stack_dump = false;
                                 end_found = true;
                         }
                 }
 
                 /* if a new oops starts, this one has ended */
-                if (strstr(start, "WARNING:") != NULL || strstr(start, "Unable to handle") != NULL) {
+                if (marks & OOPS_MARK_NEW_OOPS) {
                         if (!oops_msg.pattern->is_regex || !str_starts_with_casei(oops_msg.pattern->begin_line, "^ALSA")) {
                                 end_found = true;
                         }
@@ -427,13 +645,9 @@ void parse_single_line(char *line, size_t size)
                         oops_handler(&oops_msg);
                         handle_msg_end();
                 } else {
-                        oops_msg.lines[oops_msg.length] = strndup(start, (size_t)(line_end - start));
-                        if (oops_msg.lines[oops_msg.length] == NULL) {
-                                telem_perror("Failed to copy string");
-                                return;
-                        } else {
-                                oops_msg.length++;
-                        }
+                        oops_msg.lines[oops_msg.length] = oops_arena_strndup(&oops_msg.arena, start, len);
+                        oops_msg.line_lengths[oops_msg.length] = len;
+                        oops_msg.length++;
                 }
         }
 }
@@ -446,7 +660,8 @@ struct stack_frame {
         struct stack_frame *next;
 };
 
-static void stack_frame_append(struct stack_frame **head, struct stack_frame **tail, char *start)
+static void stack_frame_append(struct oops_arena *arena, struct stack_frame **head,
+                               struct stack_frame **tail, char *start)
 {
         /*
          * Format is:
@@ -489,11 +704,8 @@ static void stack_frame_append(struct stack_frame **head, struct stack_frame **t
                 start = skip_spaces(start);
         }
 
-        frame = malloc(sizeof(struct stack_frame));
-        if (!frame) {
-                exit(EXIT_FAILURE);
-        }
-
+        frame = oops_arena_alloc(arena, sizeof(struct stack_frame));
+        frame->function = NULL;
         frame->next = *head;
         *head = frame;
 
@@ -528,10 +740,7 @@ static void stack_frame_append(struct stack_frame **head, struct stack_frame **t
 
         offset_ptr = strchr(start, '+');
         end = offset_ptr ? offset_ptr : (start + strlen(start));
-        frame->function = strndup(start, (size_t)(end - start));
-        if (!frame->function) {
-                exit(EXIT_FAILURE);
-        }
+        frame->function = oops_arena_strndup(arena, start, (size_t)(end - start));
 
         start = end;
 
@@ -545,38 +754,27 @@ static void stack_frame_append(struct stack_frame **head, struct stack_frame **t
         frame->module = "kernel";
 }
 
-static void stack_frame_free(struct stack_frame **head)
-{
-        struct stack_frame *frame;
-
-        while (*head != NULL) {
-                frame = (*head)->next;
-                free(*head);
-                *head = frame;
-        }
-}
-
 /*
  * Function parses lines of the format :
  * CPU: 2 PID: 6429 Comm: insmod Tainted: P           OE  3.19.0-18-generic #18-Ubuntu$
  * CPU: 2 PID: 0 Comm: swapper/2 Not tainted  3.10.4-100.fc18.x86_64 #1
  * CPU: 3 PID: 0 Comm: swapper/3 Not tainted 4.0.5-300.fc22.x86_64 #1
  */
-static void parse_kernel_cpu_line(char *line, char **kernel_version, char **tainted)
+static void parse_kernel_cpu_line(struct oops_arena *arena, char *line,
+                                  char **kernel_version, char **tainted)
 {
         char *end = NULL;
 
         end = strstr(line, " Not tainted ");
         if (end) {
-                *tainted = strdup("Not tainted");
+                *tainted = "Not tainted";
                 line = end + strlen(" Not tainted");
         } else {
                 end = strstr(line, "Tainted: ");
                 if (end) {
-                        *tainted = strndup(end + strlen("Tainted: "), NUM_TAINTED_FLAGS);
-                        if (*tainted == NULL) {
-                                exit(EXIT_FAILURE);
-                        }
+                        *tainted = oops_arena_strndup(arena, end + strlen("Tainted: "),
+                                                      strnlen(end + strlen("Tainted: "),
+                                                              NUM_TAINTED_FLAGS));
 
                         line = end + strlen("Tainted: ") + 1;
                 }
@@ -593,7 +791,7 @@ static void parse_kernel_cpu_line(char *line, char **kernel_version, char **tain
         }
 
         if (end >= line) {
-                *kernel_version = strdup(end + 1);
+                *kernel_version = end + 1;
         }
 }
 
@@ -635,7 +833,7 @@ static struct reg_s *reg_head = NULL;
  *
  */
 
-static void parse_registers(char *line)
+static void parse_registers(struct oops_arena *arena, char *line)
 {
         uint64_t value;
         struct reg_s *reg_entry = NULL;
@@ -730,10 +928,7 @@ static void parse_registers(char *line)
                         continue;
                 }
 
-                reg_entry = malloc(sizeof(struct reg_s));
-                if (!reg_entry) {
-                        exit(EXIT_FAILURE);
-                }
+                reg_entry = oops_arena_alloc(arena, sizeof(struct reg_s));
                 reg_entry->reg_name = (char *)registers[i];
                 reg_entry->reg_value = value;
 
@@ -764,11 +959,8 @@ static void append_registers_to_bt(nc_string **backtrace)
                 reg_entry = reg_entry->next;
         }
 
-        while (reg_head != NULL) {
-                reg_entry = reg_head->next;
-                free(reg_head);
-                reg_head = reg_entry;
-        }
+        /* The entries are in the arena of the message */
+        reg_head = NULL;
 }
 
 static nc_string *parse_backtrace(struct oops_log_msg *msg)
@@ -776,6 +968,7 @@ static nc_string *parse_backtrace(struct oops_log_msg *msg)
         struct stack_frame *head = NULL, *tail = NULL, *elem = NULL;
         //int in_stack_dump = 0;
         char *line = NULL;
+        size_t len;
         nc_string *backtrace = NULL;
         int frame_counter = 1;
         char *modules = NULL, *kernel_version = NULL, *tainted = NULL;
@@ -786,14 +979,15 @@ static nc_string *parse_backtrace(struct oops_log_msg *msg)
         for (int i = msg->length - 1; i > 0; i--) {
                 /* Check if this line is part of a stack trace */
                 line = msg->lines[i];
+                len = msg->line_lengths[i];
 
-                if (in_trace && starts_with(line, line + strlen(line), " ")) {
-                        stack_frame_append(&head, &tail, line);
+                if (in_trace && starts_with(line, line + len, " ")) {
+                        stack_frame_append(&msg->arena, &head, &tail, line);
                         continue;
                 }
 
                 // We've reached the end of the stack trace
-                if (starts_with(line, line + strlen(line), "Call Trace:")) {
+                if (starts_with(line, line + len, "Call Trace:")) {
                         in_trace = false;
                 }
 
@@ -808,21 +1002,19 @@ static nc_string *parse_backtrace(struct oops_log_msg *msg)
 
                 if (str_starts_with_casei(line, "CPU: ") ||
                     str_starts_with_casei(line, "PID: ")) {
-                        parse_kernel_cpu_line(line, &kernel_version, &tainted);
+                        parse_kernel_cpu_line(&msg->arena, line, &kernel_version, &tainted);
                         continue;
                 }
-                parse_registers(line);
+                parse_registers(&msg->arena, line);
         }
 
         backtrace = nc_string_dup("");
         if (kernel_version) {
                 nc_string_append_printf(backtrace, "Kernel Version : %s\n", kernel_version);
-                free(kernel_version);
         }
 
         if (tainted) {
                 nc_string_append_printf(backtrace, "Tainted : %s\n", tainted);
-                free(tainted);
         }
 
         if (modules) {
@@ -843,7 +1035,6 @@ static nc_string *parse_backtrace(struct oops_log_msg *msg)
                                         elem->module);
         }
 
-        stack_frame_free(&head);
         return backtrace;
 }
 
@@ -852,6 +1043,7 @@ nc_string *parse_payload(struct oops_log_msg *msg)
         nc_string *payload, *backtrace;
 
         payload = nc_string_dup("Crash Report:\n");
+        nc_string_reserve(payload, MAX_PAYLOAD_LENGTH);
         nc_string_append_printf(payload, "Reason: %s\n", msg->lines[0]);
         backtrace = parse_backtrace(msg);
         nc_string_cat(payload, backtrace->str);
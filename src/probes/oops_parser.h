@@ -30,17 +30,35 @@ struct oops_pattern {
         const char *classification;
         int severity;
         bool is_regex;
+        /* for a regex, text every matching line contains, ignoring case */
+        const char *literal;
         regex_t regex;
 };
 
+/* Size of the blocks of an oops arena */
+#define OOPS_ARENA_BLOCK 8192
+
+struct oops_arena_block;
+
+/*
+ * Memory of an oops message and of its parsing, allocated by bumping a
+ * pointer and released at once when the message is done with.
+ */
+struct oops_arena {
+        struct oops_arena_block *blocks;
+};
+
 /*
  * This struct holds the lines of an oops messsage once the start has been
- * detected.
+ * detected. The lines are null terminated views, over the buffer given to
+ * handle_entire_oops, or copied to the arena by the line by line parser.
  */
 struct oops_log_msg {
         char *lines[MAX_LINES];
+        size_t line_lengths[MAX_LINES];
         int length;
         struct oops_pattern *pattern;
+        struct oops_arena arena;
 };
 
 /* Callback function to  be passed when the oops parser is invoked async */
@@ -62,6 +80,12 @@ void oops_parser_init(oops_handler_t handler);
  */
 void parse_single_line(char *line, size_t size);
 
+/*
+ * Handle the message of a single line of the oops msg, without the log
+ * level and timestamp prefix of the line, as read from /dev/kmsg.
+ */
+void parse_single_message(char *msg, size_t size);
+
 /* Parses a payload from an oops msg*/
 nc_string *parse_payload(struct oops_log_msg *msg);
 
@@ -70,7 +94,7 @@ nc_string *parse_payload(struct oops_log_msg *msg);
  */
 bool handle_entire_oops(char *buf, long size, struct oops_log_msg *msg);
 
-/* Frees up the oops log lines from the oops struct */
+/* Frees up the oops log lines, and the arena, of the oops struct */
 void oops_msg_cleanup(struct oops_log_msg *msg);
 
 /* vi: set ts=8 sw=8 sts=4 et tw=80 cino=(0: */
@@ -0,0 +1,71 @@
+/*
+ * This program is part of the Clear Linux Project
+ *
+ * Copyright 2019 Intel Corporation
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms and conditions of the GNU Lesser General Public License, as
+ * published by the Free Software Foundation; either version 2.1 of the License,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU Lesser General Public License for more
+ * details.
+ */
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+
+#include "log.h"
+#include "telemetry.h"
+#include "probe_record.h"
+
+static struct telem_ref *probe_record = NULL;
+
+int probe_send_record(uint32_t severity, char *classification,
+                      uint32_t payload_version, char *payload)
+{
+        int ret;
+
+        if (probe_record) {
+                ret = tm_reset_record(probe_record, severity, classification,
+                                      payload_version);
+                if (ret < 0) {
+                        probe_record_release();
+                }
+        }
+        if (!probe_record) {
+                ret = tm_create_record(&probe_record, severity, classification,
+                                       payload_version);
+                if (ret < 0) {
+                        probe_record = NULL;
+                }
+        }
+        if (ret < 0) {
+                telem_log(LOG_ERR, "Failed to create record: %s\n",
+                          strerror(-ret));
+                return ret;
+        }
+
+        if ((ret = tm_set_payload(probe_record, payload)) < 0) {
+                telem_log(LOG_ERR, "Failed to set payload: %s\n", strerror(-ret));
+                return ret;
+        }
+
+        if ((ret = tm_send_record(probe_record)) < 0) {
+                telem_log(LOG_ERR, "Failed to send record: %s\n", strerror(-ret));
+                return ret;
+        }
+
+        return 0;
+}
+
+void probe_record_release(void)
+{
+        tm_free_record(probe_record);
+        probe_record = NULL;
+}
+
+/* vi: set ts=8 sw=8 sts=4 et tw=80 cino=(0: */
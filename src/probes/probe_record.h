@@ -0,0 +1,48 @@
+/*
+ * This program is part of the Clear Linux Project
+ *
+ * Copyright 2019 Intel Corporation
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms and conditions of the GNU Lesser General Public License, as
+ * published by the Free Software Foundation; either version 2.1 of the License,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU Lesser General Public License for more
+ * details.
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+/*
+ * Record sending shared by the probes. The record of a probe is created
+ * once and reset with tm_reset_record() for each new one, so a probe that
+ * keeps running sends records without collecting the static headers or
+ * allocating the record again. Not thread safe, records are sent from one
+ * thread of a probe.
+ */
+
+/**
+ * Sends a record to telemprobd
+ *
+ * @param severity Severity of the record, as for tm_create_record()
+ * @param classification Classification of the record
+ * @param payload_version Payload format version
+ * @param payload The payload
+ *
+ * @return 0 on success, or a negative errno-style value on error, which is
+ *     logged
+ */
+int probe_send_record(uint32_t severity, char *classification,
+                      uint32_t payload_version, char *payload);
+
+/**
+ * Releases the record kept by probe_send_record()
+ */
+void probe_record_release(void);
+
+/* vi: set ts=8 sw=8 sts=4 et tw=80 cino=(0: */
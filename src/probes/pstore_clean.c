@@ -15,9 +15,11 @@
  */
 
 #define _GNU_SOURCE
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <sys/sendfile.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <errno.h>
@@ -27,6 +29,7 @@
 #include <fcntl.h>
 #include <string.h>
 
+#include "config.h"
 #include "log.h"
 
 /* Location where the pstore files are copied */
@@ -37,11 +40,56 @@ const char *MOUNT = "/dev/pstore";
 
 const size_t BUFFER_SIZE = 4096;
 
-int copy_file(char *src_file, char *dest_file)
+/*
+ * Copies what is left of src_fd to dest_fd, in the kernel when the file
+ * systems allow it
+ *
+ * @return 0 on success, or -1 with errno set
+ */
+static int copy_fd(int src_fd, int dest_fd)
 {
-        int src_fd = -1, dest_fd = -1;
         char buffer[BUFFER_SIZE];
         ssize_t bytes_read, bytes_written;
+
+#ifdef HAVE_COPY_FILE_RANGE
+        while ((bytes_written = copy_file_range(src_fd, NULL, dest_fd, NULL, SSIZE_MAX, 0)) > 0) {
+        }
+        if (bytes_written == 0) {
+                return 0;
+        }
+        if (errno != EXDEV && errno != ENOSYS && errno != EINVAL && errno != EOPNOTSUPP) {
+                return -1;
+        }
+#endif
+
+        // Across file systems, or from a file without copy_file_range
+        while ((bytes_written = sendfile(dest_fd, src_fd, NULL, SSIZE_MAX)) > 0) {
+        }
+        if (bytes_written == 0) {
+                return 0;
+        }
+        if (errno != EINVAL && errno != ENOSYS) {
+                return -1;
+        }
+
+        do {
+                bytes_read = read(src_fd, buffer, BUFFER_SIZE);
+                if (bytes_read == -1) {
+                        return -1;
+                }
+
+                bytes_written = write(dest_fd, buffer, (size_t)bytes_read);
+                if (bytes_written == -1) {
+                        return -1;
+                }
+        } while (bytes_read > 0 && bytes_written > 0);
+
+        return 0;
+}
+
+int copy_file(char *src_file, char *dest_file)
+{
+        int src_fd = -1, dest_fd = -1;
         int ret = -1;
 
         src_fd = open(src_file, O_RDONLY);
@@ -58,22 +106,11 @@ int copy_file(char *src_file, char *dest_file)
                 goto end;
         }
 
-        do {
-                memset(buffer, 0, BUFFER_SIZE);
-                bytes_read = read(src_fd, buffer, BUFFER_SIZE);
-                if (bytes_read == -1) {
-                        telem_log(LOG_ERR, "Failed to read file %s:%s\n",
-                                  src_file, strerror(errno));
-                        goto end;
-                }
-
-                bytes_written = write(dest_fd, buffer, (size_t)bytes_read);
-                if (bytes_written == -1) {
-                        telem_log(LOG_ERR, "Failed to write file %s:%s\n",
-                                  dest_file, strerror(errno));
-                        goto end;
-                }
-        } while (bytes_read > 0 && bytes_written > 0);
+        if (copy_fd(src_fd, dest_fd) != 0) {
+                telem_log(LOG_ERR, "Failed to copy file %s to %s:%s\n",
+                          src_file, dest_file, strerror(errno));
+                goto end;
+        }
 
         if (chmod(dest_file, 0444) < 0) {
                 telem_log(LOG_ERR, "Failed changing permissions for file %s: %s\n",
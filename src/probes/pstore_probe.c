@@ -21,44 +21,20 @@
 #include <assert.h>
 #include <unistd.h>
 #include <inttypes.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include "log.h"
 #include "telemetry.h"
 #include "oops_parser.h"
+#include "probe_record.h"
 #include "nica/hashmap.h"
 
 char *pstore_dump_path = PSTOREDIR;
 
 static uint32_t version = 1;
 
-static bool send_data(char *backtrace, char *class, uint32_t severity)
-{
-        struct telem_ref *handle = NULL;
-        int ret;
-
-        if ((ret = tm_create_record(&handle, severity, class, version)) < 0) {
-                telem_log(LOG_ERR, "Failed to create record: %s",
-                          strerror(-ret));
-                return false;
-        }
-
-        if ((ret = tm_set_payload(handle, backtrace)) < 0) {
-                telem_log(LOG_ERR, "Failed to set payload: %s", strerror(-ret));
-                tm_free_record(handle);
-                return false;
-        }
-
-        if ((ret = tm_send_record(handle)) < 0) {
-                telem_log(LOG_ERR, "Failed to send record: %s", strerror(-ret));
-                tm_free_record(handle);
-                return false;
-        }
-
-        tm_free_record(handle);
-
-        return true;
-}
-
 void handle_complete_oops_message(struct oops_log_msg *msg)
 {
         nc_string *payload;
@@ -71,108 +47,186 @@ void handle_complete_oops_message(struct oops_log_msg *msg)
         payload = parse_payload(msg);
 
         telem_debug("DEBUG: Payload Parsed :%s\n", payload->str);
-        send_data(payload->str, (char *)msg->pattern->classification, (uint32_t)msg->pattern->severity);
+        probe_send_record((uint32_t)msg->pattern->severity,
+                          (char *)msg->pattern->classification, version,
+                          payload->str);
         nc_string_free(payload);
 }
 
-void handle_crash_dump(char *dump, size_t size)
+/* Partial line at the end of a part, completed by the next part */
+struct line_carry {
+        char *buf;
+        size_t len;
+        size_t alloc;
+};
+
+static bool carry_append(struct line_carry *carry, const char *data, size_t size)
+{
+        if (carry->len + size + 1 > carry->alloc) {
+                size_t alloc = carry->alloc ? carry->alloc : 256;
+                char *buf;
+
+                while (carry->len + size + 1 > alloc) {
+                        alloc *= 2;
+                }
+                buf = realloc(carry->buf, alloc);
+                if (!buf) {
+                        telem_log(LOG_ERR, "Call to realloc failed");
+                        return false;
+                }
+                carry->buf = buf;
+                carry->alloc = alloc;
+        }
+        memcpy(carry->buf + carry->len, data, size);
+        carry->len += size;
+        carry->buf[carry->len] = '\0';
+
+        return true;
+}
+
+/*
+ * Feeds the lines of a part of the crash dump to the oops parser. The lines
+ * are terminated in place, only a line spanning two parts is copied.
+ */
+static void feed_crash_dump(struct line_carry *carry, char *dump, size_t size)
 {
         char *lnend;
-        long sz = (long)size;
 
-        oops_parser_init(handle_complete_oops_message);
-        while (sz > 0) {
-                lnend = memchr(dump, '\n', (size_t)sz);
-                if (lnend != NULL) {
+        while (size > 0) {
+                lnend = memchr(dump, '\n', size);
+                if (lnend == NULL) {
+                        carry_append(carry, dump, size);
+                        return;
+                }
+
+                if (carry->len > 0) {
+                        if (carry_append(carry, dump, (size_t)(lnend - dump))) {
+                                parse_single_line(carry->buf, carry->len);
+                        }
+                        carry->len = 0;
+                } else {
                         *lnend = '\0';
                         parse_single_line(dump, (size_t)(lnend - dump));
-                        lnend++;
-                        sz -= (lnend - dump);
-                        dump = lnend;
                 }
+                lnend++;
+                size -= (size_t)(lnend - dump);
+                dump = lnend;
+        }
+}
+
+struct chunk_list {
+        char *contents;
+        int count;
+        int part;
+        size_t size;
+        void *map;
+        size_t map_size;
+        struct chunk_list *next;
+};
+
+/*
+ * Parses the parts of a crash dump in order, the kernel numbering the parts
+ * from the end of the log.
+ */
+void handle_crash_dump(struct chunk_list **parts, int max_part)
+{
+        struct line_carry carry = { NULL, 0, 0 };
+
+        oops_parser_init(handle_complete_oops_message);
+        for (int part = max_part; part >= 0; part--) {
+                feed_crash_dump(&carry, parts[part]->contents, parts[part]->size);
+        }
+        if (carry.len > 0) {
+                parse_single_line(carry.buf, carry.len);
         }
         oops_parser_cleanup();
+        free(carry.buf);
 
         return;
 }
 
-char *read_contents(char *filename, size_t *bytes)
+/*
+ * Maps a dump file copied from pstore, and skips its header line. The map is
+ * private, lines being terminated in place by the parser.
+ */
+static bool map_contents(char *filename, struct chunk_list *elem)
 {
         char *dump_file = NULL;
-        FILE *fp = NULL;
-        char *contents = NULL;
-        long sz = 0;
-        size_t size, bytes_read;
+        struct stat st;
         char *hdr_end;
         size_t hdr_len;
+        bool ret = false;
+        int fd = -1;
+
+        elem->contents = NULL;
+        elem->size = 0;
+        elem->map = NULL;
+        elem->map_size = 0;
 
         if (asprintf(&dump_file, "%s/%s", pstore_dump_path, filename) < 0) {
-                goto end;
+                return false;
         }
 
-        fp = fopen(dump_file, "r");
-        if (fp == NULL) {
+        fd = open(dump_file, O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
                 telem_log(LOG_ERR, "Failed to open pstore dump file %s:%s\n", dump_file, strerror(errno));
                 goto end;
         }
 
-        if (fseek(fp, 0, SEEK_END) < 0) {
-                telem_log(LOG_ERR, "Fseek failed for file %s:%s\n", dump_file, strerror(errno));
+        if (fstat(fd, &st) < 0) {
+                telem_log(LOG_ERR, "Failed to stat file %s:%s\n", dump_file, strerror(errno));
                 goto end;
         }
-
-        sz = ftell(fp);
-        if (sz == -1L) {
-                telem_perror("ftell failed");
-                size = 0;
-                goto end;
-        }
-        size = (size_t)sz;
-
-        if (fseek(fp, 0, SEEK_SET) < 0) {
-                telem_log(LOG_ERR, "Fseek failed for file %s:%s\n", dump_file, strerror(errno));
+        if (st.st_size == 0) {
+                ret = true;
                 goto end;
         }
 
-        contents = malloc(size);
-        if (!contents) {
-                telem_log(LOG_ERR, "Call to malloc failed");
+        elem->map = mmap(NULL, (size_t)st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+        if (elem->map == MAP_FAILED) {
+                telem_log(LOG_ERR, "Failed to map file %s:%s\n", dump_file, strerror(errno));
+                elem->map = NULL;
                 goto end;
         }
-        memset(contents, 0, size);
-
-        bytes_read = fread(contents, sizeof(char), size, fp);
+        elem->map_size = (size_t)st.st_size;
+        elem->contents = elem->map;
+        elem->size = elem->map_size;
 
-        if (bytes_read < size) {
-                telem_log(LOG_ERR, "Error while reading file %s:%s\n", dump_file, strerror(errno));
-                free(contents);
-                contents = NULL;
-                goto end;
-        }
-
-        hdr_end = memchr(contents, '\n', size);
+        hdr_end = memchr(elem->contents, '\n', elem->size);
         if (hdr_end) {
-                //*hdr_end = '\0';
                 // TODO: Check for valid header in the format Oops#1 Part4
-                hdr_len = (size_t)(hdr_end + 1 - contents);
-                memmove(contents, hdr_end + 1, size - hdr_len);
-                size -= hdr_len;
+                hdr_len = (size_t)(hdr_end + 1 - elem->contents);
+                elem->contents += hdr_len;
+                elem->size -= hdr_len;
         } else {
                 // TODO: Handle this case
         }
-
-        *bytes = size;
+        ret = true;
 end:
-        //Delete to file to recover space
+        //Delete to file to recover space, the map stays valid
         if (unlink(dump_file) == -1) {
                 telem_log(LOG_ERR, "Failed to unlink file %s: %s\n", dump_file, strerror(errno));
         }
-        if (fp) {
-                fclose(fp);
+        if (fd >= 0) {
+                close(fd);
         }
 
         free(dump_file);
-        return contents;
+        return ret;
+}
+
+static void free_chunks(struct chunk_list *head)
+{
+        struct chunk_list *next;
+
+        while (head) {
+                next = head->next;
+                if (head->map) {
+                        munmap(head->map, head->map_size);
+                }
+                free(head);
+                head = next;
+        }
 }
 
 /*
@@ -187,14 +241,6 @@ void parse_id(uint64_t id, int *count, int *part)
         *part = (int)(id % 100);
 }
 
-struct chunk_list {
-        char *contents;
-        int count;
-        int part;
-        size_t size;
-        struct chunk_list *next;
-};
-
 int main(int argc, char **argv)
 {
         DIR *pstore_dir;
@@ -203,8 +249,6 @@ int main(int argc, char **argv)
         NcHashmapIter iter;
         void *key, *value;
         int max_part;
-        size_t totalsize = 0;
-        char *crash_dump = NULL;
 
         /*
          * Hash table used to store chunks belonging to a oops counter
@@ -242,8 +286,7 @@ int main(int argc, char **argv)
 
                 elem->part = part - 1;
                 elem->count = count - 1;
-                elem->size = 0;
-                elem->contents = read_contents(entry->d_name, &(elem->size));
+                map_contents(entry->d_name, elem);
                 elem->next = NULL;
 
                 void *head = nc_hashmap_get(hash, NC_HASH_KEY(elem->count));
@@ -263,13 +306,11 @@ int main(int argc, char **argv)
                 head = (struct chunk_list *)value;
                 elem = head;
                 max_part = -1;
-                totalsize = 0;
 
                 while (elem) {
                         if (elem->part > max_part) {
                                 max_part = elem->part;
                         }
-                        totalsize += elem->size;
                         elem = elem->next;
                 }
 
@@ -301,26 +342,10 @@ int main(int argc, char **argv)
                         }
                 }
 
-                if (part < (max_part + 1)) {
-                        free(parts);
-                        continue;
-                }
-
-                /* Combine all the fragments to get a contiguous log message */
-                crash_dump = malloc(totalsize);
-                if (crash_dump == NULL) {
-                        exit(EXIT_FAILURE);
+                if (part == (max_part + 1)) {
+                        handle_crash_dump(parts, max_part);
                 }
-
-                size_t offset = 0;
-                for (int part = max_part; part >= 0; part--) {
-                        elem = parts[part];
-                        memcpy(crash_dump + offset, elem->contents, elem->size);
-                        offset += elem->size;
-                }
-
-                handle_crash_dump(crash_dump, totalsize);
-                free(crash_dump);
+                free_chunks(head);
                 free(parts);
         }
         return 0;
@@ -32,11 +32,16 @@
 #include <pwd.h>
 #include <grp.h>
 #include <getopt.h>
+#include <poll.h>
 
 #include "log.h"
 #include "telemetry.h"
 
 #define PYTHON_TELEMETRY_DIR "/var/lib/telemetry/python"
+/* Records sent over the session at once */
+#define PYTHON_BATCH_MAX 32
+/* Seconds without new files after which the resident probe exits */
+#define PYTHON_IDLE_TIMEOUT 60
 
 /* We expect something like: 1.python-exception.3.N2Qy24 */
 static bool validate_file_name(const char *filename, uint32_t *severity,
@@ -131,8 +136,39 @@ error_end:
         return NULL;
 }
 
-static void send_data(char *contents, uint32_t severity, char *class,
-                      uint32_t version)
+struct record_batch {
+        struct telem_session *session;
+        struct telem_ref *refs[PYTHON_BATCH_MAX];
+        size_t count;
+};
+
+/* Send the staged records over the session, opened on first use */
+static void flush_batch(struct record_batch *batch)
+{
+        int ret;
+
+        if (batch->count == 0) {
+                return;
+        }
+
+        if (!batch->session && (ret = tm_open_session(&batch->session)) < 0) {
+                telem_log(LOG_ERR, "Failed to open session: %s\n",
+                          strerror(-ret));
+                batch->session = NULL;
+        } else if ((ret = tm_send_records(batch->session, batch->refs,
+                                          batch->count)) < 0) {
+                telem_log(LOG_ERR, "Failed to send records: %s\n",
+                          strerror(-ret));
+        }
+
+        for (size_t i = 0; i < batch->count; i++) {
+                tm_free_record(batch->refs[i]);
+        }
+        batch->count = 0;
+}
+
+static void stage_data(struct record_batch *batch, char *contents,
+                       uint32_t severity, char *class, uint32_t version)
 {
         struct telem_ref *handle = NULL;
         int ret;
@@ -150,16 +186,14 @@ static void send_data(char *contents, uint32_t severity, char *class,
                 return;
         }
 
-        if ((ret = tm_send_record(handle)) < 0) {
-                telem_log(LOG_ERR, "Failed to send record: %s\n",
-                          strerror(-ret));
+        batch->refs[batch->count++] = handle;
+        if (batch->count == PYTHON_BATCH_MAX) {
+                flush_batch(batch);
         }
-
-        tm_free_record(handle);
 }
 
-/* Send a valid file to the backend. */
-static void deliver_payload(const char *filename)
+/* Stage a valid file for the backend. */
+static void deliver_payload(struct record_batch *batch, const char *filename)
 {
         uint32_t severity;
         uint32_t version;
@@ -168,7 +202,7 @@ static void deliver_payload(const char *filename)
 
         if (validate_file_name(filename, &severity, &class, &version)) {
                 if ((contents = read_file_into_buffer(filename)) != NULL) {
-                        send_data(contents, severity, class, version);
+                        stage_data(batch, contents, severity, class, version);
                         free(contents);
                 }
 
@@ -182,6 +216,115 @@ static void deliver_payload(const char *filename)
         }
 }
 
+/* Stage all the files in the directory, returns the number of files */
+static int drain_directory(struct record_batch *batch)
+{
+        DIR *dir;
+        struct dirent *entry;
+        int files = 0;
+
+        dir = opendir(PYTHON_TELEMETRY_DIR);
+        if (!dir) {
+                telem_perror(PYTHON_TELEMETRY_DIR);
+                return 0;
+        }
+
+        while ((entry = readdir(dir)) != NULL) {
+                if (entry->d_name[0] == '.') {
+                        continue;
+                }
+                deliver_payload(batch, entry->d_name);
+                files++;
+        }
+
+        closedir(dir);
+        return files;
+}
+
+/*
+ * Stay resident, staging the files as they are written to the directory,
+ * until no file was written for idle_timeout seconds (never for 0).
+ */
+static int watch_directory(struct record_batch *batch, int idle_timeout)
+{
+        char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+        const struct inotify_event *event;
+        struct pollfd pfd;
+        ssize_t len;
+        bool rescan;
+        int fd, ret;
+
+        fd = inotify_init1(IN_CLOEXEC | IN_NONBLOCK);
+        if (fd < 0) {
+                telem_perror("Failed to initialize inotify");
+                return -1;
+        }
+        if (inotify_add_watch(fd, PYTHON_TELEMETRY_DIR, IN_CLOSE_WRITE | IN_MOVED_TO) < 0) {
+                telem_perror("Failed to watch " PYTHON_TELEMETRY_DIR);
+                close(fd);
+                return -1;
+        }
+
+        /* Files written before the watch was added */
+        drain_directory(batch);
+        flush_batch(batch);
+
+        pfd.fd = fd;
+        pfd.events = POLLIN;
+        while (true) {
+                ret = poll(&pfd, 1, idle_timeout > 0 ? idle_timeout * 1000 : -1);
+                if (ret < 0) {
+                        if (errno == EINTR) {
+                                continue;
+                        }
+                        telem_perror("Failed to poll inotify");
+                        break;
+                }
+                if (ret == 0) {
+                        /* Do not leave behind files of missed events */
+                        if (drain_directory(batch) == 0) {
+                                break;
+                        }
+                        flush_batch(batch);
+                        continue;
+                }
+
+                rescan = false;
+                while ((len = read(fd, buf, sizeof(buf))) > 0) {
+                        for (char *ptr = buf; ptr < buf + len;
+                             ptr += sizeof(struct inotify_event) + event->len) {
+                                event = (const struct inotify_event *)ptr;
+
+                                if (event->mask & IN_Q_OVERFLOW) {
+                                        rescan = true;
+                                        continue;
+                                }
+                                if (event->len == 0 || event->name[0] == '.') {
+                                        continue;
+                                }
+                                /* Already staged by a rescan */
+                                if (access(event->name, F_OK) != 0) {
+                                        continue;
+                                }
+                                deliver_payload(batch, event->name);
+                        }
+                }
+                if (len < 0 && errno != EAGAIN) {
+                        telem_perror("Failed to read inotify events");
+                        break;
+                }
+
+                if (rescan) {
+                        drain_directory(batch);
+                }
+                flush_batch(batch);
+        }
+
+        flush_batch(batch);
+        close(fd);
+        return 0;
+}
+
 static void drop_privs(void)
 {
         uid_t euid;
@@ -226,26 +369,35 @@ static void print_usage(char *prog)
         printf("%s: Usage\n", prog);
         printf("  -f,  --config_file    Specify a configuration file other than default\n");
         printf("  -h,  --help           Display this help message\n");
+        printf("  -r,  --resident       Keep watching the directory for new files\n");
+        printf("  -t,  --idle-timeout   Seconds without new files before a resident\n"
+               "                        probe exits, 0 for never (default: %d)\n",
+               PYTHON_IDLE_TIMEOUT);
         printf("  -V,  --version        Print the program version\n");
 }
 
 int main(int argc, char **argv)
 {
-        DIR *dir;
-        struct dirent *entry;
+        struct record_batch batch = { NULL, { NULL }, 0 };
+        bool resident = false;
+        int idle_timeout = PYTHON_IDLE_TIMEOUT;
+        int ret = 0;
+        char *endptr;
         int c;
         int opt_index = 0;
 
         struct option opts[] = {
                 { "config_file", 1, NULL, 'f' },
                 { "help", 0, NULL, 'h' },
+                { "resident", 0, NULL, 'r' },
+                { "idle-timeout", 1, NULL, 't' },
                 { "version", 0, NULL, 'V' },
                 { NULL, 0, NULL, 0 }
         };
 
         drop_privs();
 
-        while ((c = getopt_long(argc, argv, "f:hV", opts, &opt_index)) != -1) {
+        while ((c = getopt_long(argc, argv, "f:hrt:V", opts, &opt_index)) != -1) {
                 switch (c) {
                         case 'f':
                                 if (tm_set_config_file(optarg) != 0) {
@@ -257,6 +409,18 @@ int main(int argc, char **argv)
                         case 'h':
                                 print_usage(argv[0]);
                                 exit(EXIT_SUCCESS);
+                        case 'r':
+                                resident = true;
+                                break;
+                        case 't':
+                                errno = 0;
+                                idle_timeout = (int)strtol(optarg, &endptr, 10);
+                                if (errno || *endptr != '\0' || idle_timeout < 0) {
+                                        telem_log(LOG_ERR, "Invalid idle timeout: %s\n",
+                                                  optarg);
+                                        exit(EXIT_FAILURE);
+                                }
+                                break;
                         case 'V':
                                 printf(PACKAGE_VERSION "\n");
                                 exit(EXIT_SUCCESS);
@@ -270,24 +434,14 @@ int main(int argc, char **argv)
                 exit(EXIT_FAILURE);
         }
 
-        /* Process all existing files */
-        dir = opendir(PYTHON_TELEMETRY_DIR);
-        if (!dir) {
-                perror(PYTHON_TELEMETRY_DIR);
-                exit(EXIT_FAILURE);
+        if (resident) {
+                ret = watch_directory(&batch, idle_timeout);
+        } else {
+                /* Process all existing files */
+                drain_directory(&batch);
+                flush_batch(&batch);
         }
 
-        while (true) {
-                entry = readdir(dir);
-                if (!entry) {
-                        break;
-                }
-                if (entry->d_name[0] == '.') {
-                        continue;
-                }
-                deliver_payload(entry->d_name);
-        }
-
-        closedir(dir);
-        exit(EXIT_SUCCESS);
+        tm_close_session(batch.session);
+        exit(ret == 0 ? EXIT_SUCCESS : EXIT_FAILURE);
 }
@@ -0,0 +1,333 @@
+/*
+ * This program is part of the Clear Linux Project
+ *
+ * Copyright 2019 Intel Corporation
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms and conditions of the GNU Lesser General Public License, as
+ * published by the Free Software Foundation; either version 2.1 of the License,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU Lesser General Public License for more
+ * details.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "common.h"
+#include "record_bench.h"
+#include "telemetry.h"
+
+struct bench_worker {
+        pthread_t thread;
+        const struct bench_options *opts;
+        unsigned int total_weight;
+        uint64_t count;
+        /* seconds between two sends of the worker, 0 for no limit */
+        double interval;
+        unsigned int seed;
+        char *payload;
+        /* results */
+        uint64_t sent;
+        uint64_t failed;
+        uint64_t bytes;
+        uint64_t latency[BENCH_BUCKETS];
+        uint64_t errors[BENCH_ERRNO_MAX + 1];
+};
+
+static uint64_t now_ns(void)
+{
+        struct timespec ts;
+
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+
+        return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+static void sleep_until_ns(uint64_t deadline)
+{
+        struct timespec ts;
+
+        ts.tv_sec = (time_t)(deadline / 1000000000ULL);
+        ts.tv_nsec = (long)(deadline % 1000000000ULL);
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR) {
+                continue;
+        }
+}
+
+static int latency_bucket(uint64_t ns)
+{
+        uint64_t us = ns / 1000;
+        int bucket = 0;
+
+        while (us > 0 && bucket < BENCH_BUCKETS - 1) {
+                us >>= 1;
+                bucket++;
+        }
+
+        return bucket;
+}
+
+static char *pick_class(struct bench_worker *w)
+{
+        const struct bench_options *opts = w->opts;
+        unsigned int n = (unsigned int)rand_r(&w->seed) % w->total_weight;
+
+        for (int i = 0; i < opts->class_count; i++) {
+                if (n < opts->classes[i].weight) {
+                        return opts->classes[i].classification;
+                }
+                n -= opts->classes[i].weight;
+        }
+
+        return opts->classes[opts->class_count - 1].classification;
+}
+
+static int send_one(struct bench_worker *w, struct telem_ref **ref,
+                    size_t *size)
+{
+        const struct bench_options *opts = w->opts;
+        char *class = pick_class(w);
+        char saved = '\0';
+        int ret;
+
+        if (*ref) {
+                ret = tm_reset_record(*ref, opts->severity, class,
+                                      opts->payload_version);
+                if (ret < 0) {
+                        tm_free_record(*ref);
+                        *ref = NULL;
+                }
+        }
+        if (!*ref) {
+                ret = tm_create_record(ref, opts->severity, class,
+                                       opts->payload_version);
+                if (ret < 0) {
+                        *ref = NULL;
+                        return ret;
+                }
+        }
+
+        if (opts->payload) {
+                ret = tm_set_payload(*ref, (char *)opts->payload);
+                *size = strlen(opts->payload);
+        } else {
+                *size = opts->payload_min;
+                if (opts->payload_max > opts->payload_min) {
+                        *size += (size_t)rand_r(&w->seed) %
+                                 (opts->payload_max - opts->payload_min + 1);
+                }
+                saved = w->payload[*size];
+                w->payload[*size] = '\0';
+                ret = tm_set_payload(*ref, w->payload);
+                w->payload[*size] = saved;
+        }
+        if (ret < 0) {
+                return ret;
+        }
+
+        return tm_send_record(*ref);
+}
+
+static void *bench_worker(void *arg)
+{
+        struct bench_worker *w = arg;
+        struct telem_ref *ref = NULL;
+        uint64_t start = now_ns();
+
+        for (uint64_t i = 0; i < w->count; i++) {
+                uint64_t begin;
+                size_t size = 0;
+                int ret;
+
+                if (w->interval > 0) {
+                        sleep_until_ns(start + (uint64_t)((double)i * w->interval * 1e9));
+                }
+
+                begin = now_ns();
+                ret = send_one(w, &ref, &size);
+                w->latency[latency_bucket(now_ns() - begin)]++;
+
+                if (ret < 0) {
+                        int err = -ret;
+
+                        w->failed++;
+                        w->errors[err > 0 && err < BENCH_ERRNO_MAX ? err : BENCH_ERRNO_MAX]++;
+                        continue;
+                }
+                w->sent++;
+                w->bytes += size;
+        }
+
+        if (ref) {
+                tm_free_record(ref);
+        }
+
+        return NULL;
+}
+
+/* Upper bound of the bucket holding the given fraction of the sends, in us */
+static uint64_t latency_percentile(const uint64_t *latency, uint64_t total,
+                                   double fraction)
+{
+        uint64_t rank = (uint64_t)((double)total * fraction);
+        uint64_t seen = 0;
+
+        for (int i = 0; i < BENCH_BUCKETS; i++) {
+                seen += latency[i];
+                if (seen > rank) {
+                        return (uint64_t)1 << i;
+                }
+        }
+
+        return (uint64_t)1 << (BENCH_BUCKETS - 1);
+}
+
+static void print_report(FILE *out, struct bench_worker *total, double elapsed)
+{
+        uint64_t sends = total->sent + total->failed;
+
+        fprintf(out, "Records: %" PRIu64 " sent, %" PRIu64 " failed in %.3f s\n",
+                total->sent, total->failed, elapsed);
+        fprintf(out, "Throughput: %.1f records/s, %.1f KiB/s of payload\n",
+                elapsed > 0 ? (double)total->sent / elapsed : 0.0,
+                elapsed > 0 ? (double)total->bytes / 1024.0 / elapsed : 0.0);
+
+        if (sends == 0) {
+                return;
+        }
+        fprintf(out, "Latency: p50 < %" PRIu64 " us, p90 < %" PRIu64
+                " us, p99 < %" PRIu64 " us\n",
+                latency_percentile(total->latency, sends, 0.50),
+                latency_percentile(total->latency, sends, 0.90),
+                latency_percentile(total->latency, sends, 0.99));
+        for (int i = 0; i < BENCH_BUCKETS; i++) {
+                if (total->latency[i] == 0) {
+                        continue;
+                }
+                fprintf(out, "  %10" PRIu64 " - %10" PRIu64 " us: %" PRIu64 "\n",
+                        i == 0 ? (uint64_t)0 : (uint64_t)1 << (i - 1),
+                        (uint64_t)1 << i,
+                        total->latency[i]);
+        }
+
+        if (total->failed == 0) {
+                return;
+        }
+        fprintf(out, "Failures:\n");
+        for (int i = 1; i < BENCH_ERRNO_MAX; i++) {
+                if (total->errors[i] > 0) {
+                        fprintf(out, "  errno %d (%s): %" PRIu64 "\n", i,
+                                strerror(i), total->errors[i]);
+                }
+        }
+        if (total->errors[0] + total->errors[BENCH_ERRNO_MAX] > 0) {
+                fprintf(out, "  other: %" PRIu64 "\n",
+                        total->errors[0] + total->errors[BENCH_ERRNO_MAX]);
+        }
+}
+
+int bench_run(const struct bench_options *opts, FILE *out)
+{
+        struct bench_worker *workers;
+        struct bench_worker total;
+        unsigned int total_weight = 0;
+        unsigned int seed = (unsigned int)now_ns() ^ (unsigned int)getpid();
+        uint64_t start;
+        double elapsed;
+        int started = 0;
+        int ret = 0;
+
+        if (opts->threads < 1 || opts->threads > BENCH_THREADS_MAX ||
+            opts->class_count < 1 || opts->payload_min > opts->payload_max ||
+            opts->payload_max >= MAX_PAYLOAD_LENGTH) {
+                return -EINVAL;
+        }
+        for (int i = 0; i < opts->class_count; i++) {
+                total_weight += opts->classes[i].weight;
+        }
+        if (total_weight == 0) {
+                return -EINVAL;
+        }
+
+        workers = calloc((size_t)opts->threads, sizeof(struct bench_worker));
+        if (!workers) {
+                return -ENOMEM;
+        }
+
+        for (int i = 0; i < opts->threads; i++) {
+                struct bench_worker *w = &workers[i];
+
+                w->opts = opts;
+                w->total_weight = total_weight;
+                w->count = opts->count / (uint64_t)opts->threads +
+                           ((uint64_t)i < opts->count % (uint64_t)opts->threads);
+                w->interval = opts->rate > 0 ? (double)opts->threads / opts->rate : 0;
+                w->seed = seed + (unsigned int)i;
+                if (!opts->payload) {
+                        /* Printable lines, cut to the size of each record */
+                        w->payload = malloc(opts->payload_max + 1);
+                        if (!w->payload) {
+                                ret = -ENOMEM;
+                                goto out;
+                        }
+                        for (size_t j = 0; j < opts->payload_max; j++) {
+                                w->payload[j] = j % 64 == 63 ? '\n' : (char)('a' + j % 26);
+                        }
+                        w->payload[opts->payload_max] = '\0';
+                }
+        }
+
+        start = now_ns();
+        for (started = 0; started < opts->threads; started++) {
+                ret = pthread_create(&workers[started].thread, NULL,
+                                     bench_worker, &workers[started]);
+                if (ret != 0) {
+                        ret = -ret;
+                        break;
+                }
+        }
+        for (int i = 0; i < started; i++) {
+                pthread_join(workers[i].thread, NULL);
+        }
+        elapsed = (double)(now_ns() - start) / 1e9;
+        if (ret < 0) {
+                goto out;
+        }
+
+        memset(&total, 0, sizeof(total));
+        for (int i = 0; i < opts->threads; i++) {
+                struct bench_worker *w = &workers[i];
+
+                total.sent += w->sent;
+                total.failed += w->failed;
+                total.bytes += w->bytes;
+                for (int b = 0; b < BENCH_BUCKETS; b++) {
+                        total.latency[b] += w->latency[b];
+                }
+                for (int e = 0; e <= BENCH_ERRNO_MAX; e++) {
+                        total.errors[e] += w->errors[e];
+                }
+        }
+        print_report(out, &total, elapsed);
+        ret = total.failed > 0 ? 1 : 0;
+out:
+        for (int i = 0; i < opts->threads; i++) {
+                free(workers[i].payload);
+        }
+        free(workers);
+
+        return ret;
+}
+
+/* vi: set ts=8 sw=8 sts=4 et tw=80 cino=(0: */
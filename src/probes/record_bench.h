@@ -0,0 +1,69 @@
+/*
+ * This program is part of the Clear Linux Project
+ *
+ * Copyright 2019 Intel Corporation
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms and conditions of the GNU Lesser General Public License, as
+ * published by the Free Software Foundation; either version 2.1 of the License,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU Lesser General Public License for more
+ * details.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+/*
+ * Benchmark mode of telem-record-gen: records are sent to telemprobd by a
+ * number of threads, at a target rate, with payload sizes and
+ * classifications drawn at random. The report gives the throughput, a
+ * histogram of the latency of tm_send_record() and the failures by errno.
+ */
+
+/* Latency buckets, in powers of two of microseconds */
+#define BENCH_BUCKETS 32
+/* Errno values counted separately, the others are counted together */
+#define BENCH_ERRNO_MAX 256
+#define BENCH_THREADS_MAX 256
+
+struct bench_class {
+        char *classification;
+        unsigned int weight;
+};
+
+struct bench_options {
+        /* records to send, over all threads */
+        uint64_t count;
+        /* records per second over all threads, 0 for no limit */
+        double rate;
+        int threads;
+        /* payload sizes, drawn uniformly in [payload_min, payload_max] */
+        size_t payload_min;
+        size_t payload_max;
+        /* fixed payload, sent instead of generated ones if not NULL */
+        const char *payload;
+        uint32_t severity;
+        uint32_t payload_version;
+        struct bench_class *classes;
+        int class_count;
+};
+
+/**
+ * Runs the benchmark and writes its report
+ *
+ * @param opts The benchmark parameters
+ * @param out Stream the report is written to
+ *
+ * @return 0 if all records were sent, 1 if some failed, or a negative
+ *     errno-style value if the benchmark could not be run
+ */
+int bench_run(const struct bench_options *opts, FILE *out);
+
+/* vi: set ts=8 sw=8 sts=4 et tw=80 cino=(0: */
@@ -0,0 +1,322 @@
+/*
+ * This program is part of the Clear Linux Project
+ *
+ * Copyright 2019 Intel Corporation
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms and conditions of the GNU Lesser General Public License, as
+ * published by the Free Software Foundation; either version 2.1 of the License,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU Lesser General Public License for more
+ * details.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "symcache.h"
+
+static const char symcache_magic[8] = "TMSYMC";
+
+static unsigned int symcache_hash(const uint8_t *build_id, size_t build_id_len,
+                                  uint64_t offset)
+{
+        /* FNV-1a over the build id, then the offset */
+        uint64_t hash = 14695981039346656037ULL;
+
+        for (size_t i = 0; i < build_id_len; i++) {
+                hash = (hash ^ build_id[i]) * 1099511628211ULL;
+        }
+        for (int i = 0; i < 8; i++) {
+                hash = (hash ^ ((offset >> (i * 8)) & 0xff)) * 1099511628211ULL;
+        }
+
+        return (unsigned int)(hash ^ (hash >> 32));
+}
+
+static int entry_bucket(struct symcache *cache, struct symcache_entry *entry)
+{
+        return (int)(symcache_hash(entry->build_id, entry->build_id_len,
+                                   entry->offset) % (unsigned int)cache->bucket_count);
+}
+
+static void link_entry(struct symcache *cache, int i)
+{
+        int bucket = entry_bucket(cache, &cache->entries[i]);
+
+        cache->entries[i].next = cache->buckets[bucket];
+        cache->buckets[bucket] = i;
+}
+
+static void unlink_entry(struct symcache *cache, int i)
+{
+        int *link = &cache->buckets[entry_bucket(cache, &cache->entries[i])];
+
+        while (*link != -1) {
+                if (*link == i) {
+                        *link = cache->entries[i].next;
+                        return;
+                }
+                link = &cache->entries[*link].next;
+        }
+}
+
+static int set_entry(struct symcache *cache, int i, const uint8_t *build_id,
+                     size_t build_id_len, uint64_t offset, const char *function,
+                     size_t function_len, const char *source, size_t source_len,
+                     int line)
+{
+        struct symcache_entry *entry = &cache->entries[i];
+        char *function_copy, *source_copy;
+
+        function_copy = strndup(function, function_len);
+        source_copy = strndup(source, source_len);
+        if (!function_copy || !source_copy) {
+                free(function_copy);
+                free(source_copy);
+                return -ENOMEM;
+        }
+
+        memcpy(entry->build_id, build_id, build_id_len);
+        entry->build_id_len = (uint8_t)build_id_len;
+        entry->offset = offset;
+        entry->function = function_copy;
+        entry->source = source_copy;
+        entry->line = line;
+        link_entry(cache, i);
+
+        return 0;
+}
+
+/* Reads the entries of the cache file, keeping those read before an error */
+static void read_entries(struct symcache *cache, FILE *file, uint32_t count)
+{
+        struct symcache_file_entry fentry;
+        uint8_t build_id[SYMCACHE_BUILD_ID_MAX];
+        char function[SYMCACHE_NAME_MAX];
+        char source[SYMCACHE_NAME_MAX];
+
+        for (uint32_t n = 0; n < count && cache->count < cache->max_entries; n++) {
+                if (fread(&fentry, sizeof(fentry), 1, file) != 1 ||
+                    fentry.build_id_len == 0 ||
+                    fentry.build_id_len > SYMCACHE_BUILD_ID_MAX ||
+                    fentry.function_len > SYMCACHE_NAME_MAX ||
+                    fentry.source_len > SYMCACHE_NAME_MAX) {
+                        return;
+                }
+                if (fread(build_id, 1, fentry.build_id_len, file) != fentry.build_id_len ||
+                    fread(function, 1, fentry.function_len, file) != fentry.function_len ||
+                    fread(source, 1, fentry.source_len, file) != fentry.source_len) {
+                        return;
+                }
+                if (symcache_lookup(cache, build_id, fentry.build_id_len, fentry.offset)) {
+                        continue;
+                }
+
+                if (set_entry(cache, cache->count, build_id, fentry.build_id_len,
+                              fentry.offset, function, fentry.function_len,
+                              source, fentry.source_len, fentry.line) < 0) {
+                        return;
+                }
+                cache->entries[cache->count].used = fentry.used;
+                cache->count++;
+        }
+}
+
+int symcache_load(struct symcache *cache, const char *path, int max_entries)
+{
+        struct symcache_file_header header;
+        FILE *file;
+
+        memset(cache, 0, sizeof(struct symcache));
+        cache->max_entries = max_entries;
+        cache->bucket_count = max_entries * 2;
+        cache->entries = calloc((size_t)max_entries, sizeof(struct symcache_entry));
+        cache->buckets = malloc((size_t)cache->bucket_count * sizeof(int));
+        if (!cache->entries || !cache->buckets) {
+                symcache_free(cache);
+                return -ENOMEM;
+        }
+        for (int i = 0; i < cache->bucket_count; i++) {
+                cache->buckets[i] = -1;
+        }
+
+        file = fopen(path, "r");
+        if (!file) {
+                return 0;
+        }
+        if (fread(&header, sizeof(header), 1, file) == 1 &&
+            memcmp(header.magic, symcache_magic, sizeof(symcache_magic)) == 0 &&
+            header.version == SYMCACHE_VERSION) {
+                cache->clock = header.clock;
+                read_entries(cache, file, header.count);
+        }
+        fclose(file);
+
+        /* Lookups of the load are not uses */
+        cache->dirty = false;
+
+        return 0;
+}
+
+const struct symcache_entry *symcache_lookup(struct symcache *cache,
+                                             const uint8_t *build_id,
+                                             size_t build_id_len,
+                                             uint64_t offset)
+{
+        unsigned int hash;
+        int i;
+
+        if (build_id_len == 0 || build_id_len > SYMCACHE_BUILD_ID_MAX) {
+                return NULL;
+        }
+
+        hash = symcache_hash(build_id, build_id_len, offset);
+        for (i = cache->buckets[hash % (unsigned int)cache->bucket_count]; i != -1;
+             i = cache->entries[i].next) {
+                struct symcache_entry *entry = &cache->entries[i];
+
+                if (entry->offset == offset && entry->build_id_len == build_id_len &&
+                    memcmp(entry->build_id, build_id, build_id_len) == 0) {
+                        entry->used = ++cache->clock;
+                        cache->dirty = true;
+                        return entry;
+                }
+        }
+
+        return NULL;
+}
+
+int symcache_insert(struct symcache *cache, const uint8_t *build_id,
+                    size_t build_id_len, uint64_t offset,
+                    const char *function, const char *source, int line)
+{
+        size_t function_len = strlen(function);
+        size_t source_len = strlen(source);
+        int i;
+
+        if (build_id_len == 0 || build_id_len > SYMCACHE_BUILD_ID_MAX ||
+            function_len > SYMCACHE_NAME_MAX || source_len > SYMCACHE_NAME_MAX) {
+                return 0;
+        }
+        if (symcache_lookup(cache, build_id, build_id_len, offset)) {
+                return 0;
+        }
+
+        if (cache->count < cache->max_entries) {
+                i = cache->count++;
+        } else {
+                i = 0;
+                for (int j = 1; j < cache->count; j++) {
+                        if (cache->entries[j].used < cache->entries[i].used) {
+                                i = j;
+                        }
+                }
+                unlink_entry(cache, i);
+                free(cache->entries[i].function);
+                free(cache->entries[i].source);
+        }
+
+        if (set_entry(cache, i, build_id, build_id_len, offset, function,
+                      function_len, source, source_len, line) < 0) {
+                /* Move the last entry to the free slot */
+                cache->count--;
+                if (i != cache->count) {
+                        unlink_entry(cache, cache->count);
+                        cache->entries[i] = cache->entries[cache->count];
+                        link_entry(cache, i);
+                }
+                return -ENOMEM;
+        }
+        cache->entries[i].used = ++cache->clock;
+        cache->dirty = true;
+
+        return 0;
+}
+
+int symcache_save(struct symcache *cache, const char *path)
+{
+        struct symcache_file_header header;
+        char tmp_file[PATH_MAX];
+        FILE *file;
+        int ret = 0;
+
+        if (!cache->dirty) {
+                return 0;
+        }
+        if (snprintf(tmp_file, sizeof(tmp_file), "%s.tmp", path) >= (int)sizeof(tmp_file)) {
+                return -ENAMETOOLONG;
+        }
+
+        file = fopen(tmp_file, "w");
+        if (!file) {
+                return -errno;
+        }
+
+        memset(&header, 0, sizeof(header));
+        memcpy(header.magic, symcache_magic, sizeof(symcache_magic));
+        header.version = SYMCACHE_VERSION;
+        header.count = (uint32_t)cache->count;
+        header.clock = cache->clock;
+        if (fwrite(&header, sizeof(header), 1, file) != 1) {
+                ret = -EIO;
+        }
+
+        for (int i = 0; i < cache->count && ret == 0; i++) {
+                struct symcache_entry *entry = &cache->entries[i];
+                struct symcache_file_entry fentry;
+
+                memset(&fentry, 0, sizeof(fentry));
+                fentry.offset = entry->offset;
+                fentry.used = entry->used;
+                fentry.line = entry->line;
+                fentry.function_len = (uint16_t)strlen(entry->function);
+                fentry.source_len = (uint16_t)strlen(entry->source);
+                fentry.build_id_len = entry->build_id_len;
+                if (fwrite(&fentry, sizeof(fentry), 1, file) != 1 ||
+                    fwrite(entry->build_id, 1, entry->build_id_len, file) != entry->build_id_len ||
+                    fwrite(entry->function, 1, fentry.function_len, file) != fentry.function_len ||
+                    fwrite(entry->source, 1, fentry.source_len, file) != fentry.source_len) {
+                        ret = -EIO;
+                }
+        }
+
+        if (fclose(file) != 0 && ret == 0) {
+                ret = -EIO;
+        }
+        if (ret == 0 && rename(tmp_file, path) != 0) {
+                ret = -errno;
+        }
+        if (ret < 0) {
+                unlink(tmp_file);
+                return ret;
+        }
+        cache->dirty = false;
+
+        return 0;
+}
+
+void symcache_free(struct symcache *cache)
+{
+        if (cache->entries) {
+                for (int i = 0; i < cache->count; i++) {
+                        free(cache->entries[i].function);
+                        free(cache->entries[i].source);
+                }
+        }
+        free(cache->entries);
+        free(cache->buckets);
+        cache->entries = NULL;
+        cache->buckets = NULL;
+        cache->count = 0;
+}
+
+/* vi: set ts=8 sw=8 sts=4 et tw=80 cino=(0: */
@@ -0,0 +1,142 @@
+/*
+ * This program is part of the Clear Linux Project
+ *
+ * Copyright 2019 Intel Corporation
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms and conditions of the GNU Lesser General Public License, as
+ * published by the Free Software Foundation; either version 2.1 of the License,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU Lesser General Public License for more
+ * details.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Frames symbolized by crashprobe, keyed by the build id of their module and
+ * the offset of their program counter in it, so that the crashes of the same
+ * binaries skip loading the DWARF data of their modules. The cache is loaded
+ * from a file at start, and written back through a temporary file when
+ * frames were added. Once it holds max_entries frames, the least recently
+ * used one is evicted for each new one.
+ */
+
+#define SYMCACHE_FILE LOCALSTATEDIR "/lib/telemetry/crashprobe.symcache"
+#define SYMCACHE_VERSION 1
+#define SYMCACHE_ENTRIES_MAX 4096
+#define SYMCACHE_BUILD_ID_MAX 64
+/* Longest function or source file name cached */
+#define SYMCACHE_NAME_MAX 4095
+
+struct symcache_file_header {
+        char magic[8];
+        uint32_t version;
+        uint32_t count;
+        uint64_t clock;
+};
+
+/* Followed by the build id, the function and the source file name */
+struct symcache_file_entry {
+        uint64_t offset;
+        uint64_t used;
+        int32_t line;
+        uint16_t function_len;
+        uint16_t source_len;
+        uint8_t build_id_len;
+        uint8_t pad[7];
+};
+
+struct symcache_entry {
+        uint8_t build_id[SYMCACHE_BUILD_ID_MAX];
+        uint8_t build_id_len;
+        uint64_t offset;
+        /* clock of the cache when the frame was last looked up */
+        uint64_t used;
+        char *function;
+        char *source;
+        int line;
+        /* next entry in the same bucket, or -1 */
+        int next;
+};
+
+struct symcache {
+        struct symcache_entry *entries;
+        int count;
+        int max_entries;
+        int *buckets;
+        int bucket_count;
+        uint64_t clock;
+        bool dirty;
+};
+
+/**
+ * Loads the cache from a file. A missing or damaged file gives an empty
+ * cache.
+ *
+ * @param cache The cache
+ * @param path The cache file
+ * @param max_entries Frames kept in the cache, at least 1
+ *
+ * @return 0 on success, or -ENOMEM
+ */
+int symcache_load(struct symcache *cache, const char *path, int max_entries);
+
+/**
+ * Looks a frame up, and makes it the most recently used
+ *
+ * @param cache The cache
+ * @param build_id Build id of the module of the frame
+ * @param build_id_len Size of build_id in bytes
+ * @param offset Offset of the program counter in the module
+ *
+ * @return the frame, or NULL if it is not cached
+ */
+const struct symcache_entry *symcache_lookup(struct symcache *cache,
+                                             const uint8_t *build_id,
+                                             size_t build_id_len,
+                                             uint64_t offset);
+
+/**
+ * Adds a frame, evicting the least recently used one if the cache is full.
+ * Frames of which the build id or the names are too long are not cached.
+ *
+ * @param cache The cache
+ * @param build_id Build id of the module of the frame
+ * @param build_id_len Size of build_id in bytes
+ * @param offset Offset of the program counter in the module
+ * @param function Name of the function
+ * @param source Name of the source file
+ * @param line Line in the source file
+ *
+ * @return 0 on success, or -ENOMEM
+ */
+int symcache_insert(struct symcache *cache, const uint8_t *build_id,
+                    size_t build_id_len, uint64_t offset,
+                    const char *function, const char *source, int line);
+
+/**
+ * Writes the cache back to its file if frames were added or looked up
+ *
+ * @param cache The cache
+ * @param path The cache file
+ *
+ * @return 0 on success, or a negative errno-style value
+ */
+int symcache_save(struct symcache *cache, const char *path);
+
+/**
+ * Releases the cache
+ *
+ * @param cache The cache
+ */
+void symcache_free(struct symcache *cache);
+
+/* vi: set ts=8 sw=8 sts=4 et tw=80 cino=(0: */
@@ -30,8 +30,12 @@
 #include "config.h"
 #include "log.h"
 #include "common.h"
+#include "record_bench.h"
 #include "telemetry.h"
 
+/* Payload size of the benchmark records when none is given */
+#define BENCH_PAYLOAD_SIZE 1024
+
 static uint32_t severity = 1;
 static char *opt_class = NULL;
 static char *opt_payload = NULL;
@@ -40,6 +44,13 @@ static char *opt_payload_file = NULL;
 static char *opt_event_id = NULL;
 static bool opt_echo = false;
 static bool opt_nopost = false;
+static uint64_t opt_bench = 0;
+static double opt_rate = 0;
+static int opt_threads = 1;
+static size_t opt_payload_min = BENCH_PAYLOAD_SIZE;
+static size_t opt_payload_max = BENCH_PAYLOAD_SIZE;
+static struct bench_class *opt_classes = NULL;
+static int opt_class_count = 0;
 
 static const struct option prog_opts[] = {
         { "help", no_argument, 0, 'h' },
@@ -53,6 +64,11 @@ static const struct option prog_opts[] = {
         { "record-version", required_argument, 0, 'R' },
         { "event-id", required_argument, 0, 'e' },
         { "config-file", required_argument, 0, 'f' },
+        { "bench", required_argument, 0, 'b' },
+        { "rate", required_argument, 0, 'r' },
+        { "threads", required_argument, 0, 'j' },
+        { "payload-size", required_argument, 0, 'z' },
+        { "class-mix", required_argument, 0, 'm' },
         { 0, 0, 0, 0 }
 };
 
@@ -76,6 +92,95 @@ static void print_help(void)
         printf("  -n, --no-post         Do not post record just print\n");
         printf("  -f, --config_file     Specify a configuration file other than default\n");
         printf("\n");
+        printf("Benchmark Options:\n");
+        printf("  -b, --bench           Send this many records and report the throughput\n");
+        printf("  -r, --rate            Records per second over all threads (default no limit)\n");
+        printf("  -j, --threads         Threads sending records (default 1)\n");
+        printf("  -z, --payload-size    Payload size, or range min-max, in bytes (default 1024)\n");
+        printf("  -m, --class-mix       Classifications sent, as class[:weight],... (default --class)\n");
+        printf("\n");
+}
+
+static bool parse_count(const char *arg, unsigned long long max,
+                        unsigned long long *value)
+{
+        char *endptr = NULL;
+
+        errno = 0;
+        *value = strtoull(arg, &endptr, 10);
+        if (errno != 0 || endptr == arg || *endptr != '\0' || *value > max ||
+            arg[0] == '-') {
+                return false;
+        }
+
+        return true;
+}
+
+/* Parses "size" or "min-max" */
+static bool parse_payload_size(const char *arg)
+{
+        unsigned long long min, max;
+        char *copy, *dash;
+        bool ret = false;
+
+        if ((copy = strdup(arg)) == NULL) {
+                return false;
+        }
+        if ((dash = strchr(copy, '-')) != NULL) {
+                *dash = '\0';
+        }
+        if (parse_count(copy, MAX_PAYLOAD_LENGTH - 1, &min) &&
+            parse_count(dash ? dash + 1 : copy, MAX_PAYLOAD_LENGTH - 1, &max) &&
+            min <= max) {
+                opt_payload_min = (size_t)min;
+                opt_payload_max = (size_t)max;
+                ret = true;
+        }
+        free(copy);
+
+        return ret;
+}
+
+/* Parses "class[:weight],...", a weight of 1 by default */
+static bool parse_class_mix(const char *arg)
+{
+        char *copy, *entry, *saveptr = NULL;
+        bool ret = true;
+
+        if ((copy = strdup(arg)) == NULL) {
+                return false;
+        }
+        for (entry = strtok_r(copy, ",", &saveptr); entry && ret;
+             entry = strtok_r(NULL, ",", &saveptr)) {
+                struct bench_class *classes;
+                unsigned long long weight = 1;
+                char *colon = strrchr(entry, ':');
+
+                if (colon) {
+                        *colon = '\0';
+                        if (!parse_count(colon + 1, 1000000, &weight)) {
+                                ret = false;
+                                break;
+                        }
+                }
+                classes = realloc(opt_classes, (size_t)(opt_class_count + 1) *
+                                  sizeof(struct bench_class));
+                if (!classes) {
+                        ret = false;
+                        break;
+                }
+                opt_classes = classes;
+                opt_classes[opt_class_count].classification = strdup(entry);
+                opt_classes[opt_class_count].weight = (unsigned int)weight;
+                if (!opt_classes[opt_class_count].classification) {
+                        ret = false;
+                        break;
+                }
+                opt_class_count++;
+        }
+        free(copy);
+
+        return ret;
 }
 
 static bool parse_options(int argc, char **argv)
@@ -85,7 +190,7 @@ static bool parse_options(int argc, char **argv)
         long unsigned int tmp = 0;
 
         int opt;
-        while ((opt = getopt_long(argc, argv, "hc:Vs:c:p:P:R:e:onf:", prog_opts, NULL)) != -1) {
+        while ((opt = getopt_long(argc, argv, "hc:Vs:c:p:P:R:e:onf:b:r:j:z:m:", prog_opts, NULL)) != -1) {
                 switch (opt) {
                         case 'h':
                                 print_help();
@@ -164,6 +269,50 @@ static bool parse_options(int argc, char **argv)
                                     exit(EXIT_FAILURE);
                                 }
                                 break;
+                        case 'b': {
+                                unsigned long long count;
+
+                                if (!parse_count(optarg, UINT64_MAX, &count) || count == 0) {
+                                        telem_log(LOG_ERR, "Invalid record count. Must be a positive integer\n");
+                                        goto fail;
+                                }
+                                opt_bench = (uint64_t)count;
+                                break;
+                        }
+                        case 'r':
+                                errno = 0;
+                                opt_rate = strtod(optarg, &endptr);
+                                if (errno != 0 || endptr == optarg || *endptr != '\0' ||
+                                    opt_rate < 0) {
+                                        telem_log(LOG_ERR, "Invalid rate. Must be a positive number\n");
+                                        goto fail;
+                                }
+                                break;
+                        case 'j': {
+                                unsigned long long threads;
+
+                                if (!parse_count(optarg, BENCH_THREADS_MAX, &threads) ||
+                                    threads == 0) {
+                                        telem_log(LOG_ERR, "Invalid thread count. Must be 1-%d\n",
+                                                  BENCH_THREADS_MAX);
+                                        goto fail;
+                                }
+                                opt_threads = (int)threads;
+                                break;
+                        }
+                        case 'z':
+                                if (!parse_payload_size(optarg)) {
+                                        telem_log(LOG_ERR, "Invalid payload size. Must be a size or"
+                                                  " a range min-max below %d\n", MAX_PAYLOAD_LENGTH);
+                                        goto fail;
+                                }
+                                break;
+                        case 'm':
+                                if (!parse_class_mix(optarg)) {
+                                        telem_log(LOG_ERR, "Invalid classification mix\n");
+                                        goto fail;
+                                }
+                                break;
                 }
         }
 
@@ -172,37 +321,29 @@ fail:
         return ret;
 }
 
-static bool validate_opts(void)
+static bool validate_class(const char *class)
 {
         size_t i, len;
         int x, slashes = 0;
-        const char alphab[] = EVENT_ID_ALPHAB;
-        bool ret = false;
 
-        /* classification */
-        if (opt_class == NULL) {
-                fprintf(stderr, "Error: Classification required. See --help.\n");
-                return ret;
-        }
-
-        len = strlen(opt_class);
+        len = strlen(class);
 
         if ((len == 0) || (len > MAX_CLASS_LENGTH)) {
                 fprintf(stderr, "Error: Valid size for classification "
                         "is 1-%d chars\n", MAX_CLASS_LENGTH);
-                return ret;
+                return false;
         }
 
         for (int c = 0; c < len; c++) {
-                if (isascii(opt_class[c]) == 0) {
+                if (isascii(class[c]) == 0) {
                         fprintf(stderr, "Error: Non-ascii characters detected "
                                 "in classification - aborting\n");
-                        return ret;
+                        return false;
                 }
         }
 
         for (i = 0, x = 0; i <= (len - 1); i++, x++) {
-                if (opt_class[i] == '/') {
+                if (class[i] == '/') {
                         slashes++;
                         x = 0;
                 } else {
@@ -210,7 +351,7 @@ static bool validate_opts(void)
                                 fprintf(stderr, "Error: Classification strings"
                                         " between slashes should have at most"
                                         " %d chars\n", MAX_SUBCAT_LENGTH);
-                                return ret;
+                                return false;
                         }
                 }
         }
@@ -218,9 +359,32 @@ static bool validate_opts(void)
         if (slashes != 2) {
                 fprintf(stderr, "Error: Classification needs to be in "
                         "most/to/least specific format, 2 \'/\' required.\n");
+                return false;
+        }
+
+        return true;
+}
+
+static bool validate_opts(void)
+{
+        const char alphab[] = EVENT_ID_ALPHAB;
+        bool ret = false;
+
+        /* classification */
+        if (opt_class == NULL && (opt_bench == 0 || opt_class_count == 0)) {
+                fprintf(stderr, "Error: Classification required. See --help.\n");
                 return ret;
         }
 
+        if (opt_class && !validate_class(opt_class)) {
+                return ret;
+        }
+
+        for (int i = 0; i < opt_class_count; i++) {
+                if (!validate_class(opt_classes[i].classification)) {
+                        return ret;
+                }
+        }
 
         /* Severity */
         if ((severity) < 1 || (severity > 4)) {
@@ -397,6 +561,35 @@ static int print_record(char *payload)
         return ret;
 }
 
+static int run_bench(char *payload)
+{
+        struct bench_class single = { opt_class, 1 };
+        struct bench_options opts = {
+                .count = opt_bench,
+                .rate = opt_rate,
+                .threads = opt_threads,
+                .payload_min = opt_payload_min,
+                .payload_max = opt_payload_max,
+                .payload = payload,
+                .severity = severity,
+                .payload_version = payload_version,
+                .classes = opt_class_count > 0 ? opt_classes : &single,
+                .class_count = opt_class_count > 0 ? opt_class_count : 1,
+        };
+        int ret;
+
+        ret = bench_run(&opts, stdout);
+        if (ret == -EINVAL) {
+                fprintf(stderr, "Error: Invalid benchmark options, the weights"
+                        " of the classifications cannot all be 0\n");
+        } else if (ret < 0) {
+                fprintf(stderr, "Error: Cannot run the benchmark: %s\n",
+                        strerror(-ret));
+        }
+
+        return ret;
+}
+
 int main(int argc, char **argv)
 {
         int ret = EXIT_FAILURE;
@@ -410,6 +603,17 @@ int main(int argc, char **argv)
                 goto fail;
         }
 
+        if (opt_bench > 0) {
+                /* The records are generated unless a payload is given */
+                if ((opt_payload || opt_payload_file) && !get_payload(&payload)) {
+                        goto fail;
+                }
+                if (run_bench(payload) == 0) {
+                        ret = EXIT_SUCCESS;
+                }
+                goto fail;
+        }
+
         if (!get_payload(&payload)) {
                 goto fail;
         }
@@ -428,6 +632,10 @@ fail:
         free(opt_payload);
         free(opt_event_id);
         free(payload);
+        for (int i = 0; i < opt_class_count; i++) {
+                free(opt_classes[i].classification);
+        }
+        free(opt_classes);
 
         return ret;
 }
@@ -0,0 +1,455 @@
+/*
+ * This program is part of the Clear Linux Project
+ *
+ * Copyright 2019 Intel Corporation
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms and conditions of the GNU Lesser General Public License, as
+ * published by the Free Software Foundation; either version 2.1 of the License,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU Lesser General Public License for more
+ * details.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <unistd.h>
+
+#include "recordio.h"
+#include "log.h"
+
+#ifdef HAVE_IO_URING
+#include <liburing.h>
+
+/* Files read ahead at most */
+#define RECORD_IO_SLOTS (TM_RECORD_IO_AHEAD * 2)
+
+/* Operations, in the low byte of the user data, the slot is above */
+enum record_io_op {
+        RECORD_IO_OPEN = 0,
+        RECORD_IO_STATX,
+        RECORD_IO_READ,
+        RECORD_IO_UNLINK
+};
+
+/* A record file read ahead */
+struct record_io_slot {
+        /* NULL if the slot is free */
+        char *path;
+        int fd;
+        int error;
+        /* operations submitted that did not complete */
+        int pending;
+        bool read;
+        struct statx stx;
+        char *data;
+        size_t size;
+};
+
+static struct io_uring ring;
+static bool ring_ready = false;
+static unsigned int ring_depth;
+static unsigned int inflight;
+static struct record_io_slot slots[RECORD_IO_SLOTS];
+
+/* Paths of the removals queued, kept until they are submitted */
+static char **unlink_paths = NULL;
+static int unlink_count = 0;
+static int unlink_alloc = 0;
+
+static void submit_queued(void)
+{
+        int ret = io_uring_submit(&ring);
+
+        if (ret < 0) {
+                telem_log(LOG_ERR, "Unable to submit record I/O: %s\n", strerror(-ret));
+                return;
+        }
+        /* The kernel has its own copy of the paths once submitted */
+        for (int i = 0; i < unlink_count; i++) {
+                free(unlink_paths[i]);
+        }
+        unlink_count = 0;
+}
+
+static void release_slot(struct record_io_slot *slot)
+{
+        if (slot->fd >= 0) {
+                close(slot->fd);
+        }
+        free(slot->data);
+        free(slot->path);
+        memset(slot, 0, sizeof(*slot));
+        slot->fd = -1;
+}
+
+static struct io_uring_sqe *get_sqe(void)
+{
+        struct io_uring_sqe *sqe = io_uring_get_sqe(&ring);
+
+        if (!sqe) {
+                submit_queued();
+                sqe = io_uring_get_sqe(&ring);
+        }
+
+        return sqe;
+}
+
+/* Reads the file once it is open and its size is known. Large files are
+ * left to read_record(), which may stream their payload. */
+static void start_read(struct record_io_slot *slot, unsigned int index)
+{
+        struct io_uring_sqe *sqe;
+
+        if (slot->stx.stx_size > TM_STREAM_RECORD_SIZE || !(sqe = get_sqe())) {
+                slot->error = -EFBIG;
+                return;
+        }
+
+        slot->size = (size_t)slot->stx.stx_size;
+        slot->data = malloc(slot->size + 1);
+        if (!slot->data) {
+                telem_log(LOG_ERR, "Unable to allocate memory, exiting\n");
+                exit(EXIT_FAILURE);
+        }
+        io_uring_prep_read(sqe, slot->fd, slot->data, (unsigned int)slot->size, 0);
+        io_uring_sqe_set_data64(sqe, ((uint64_t)index << 8) | RECORD_IO_READ);
+        slot->pending++;
+        slot->read = true;
+        inflight++;
+}
+
+static void complete(struct io_uring_cqe *cqe)
+{
+        uint64_t data = io_uring_cqe_get_data64(cqe);
+        unsigned int index = (unsigned int)(data >> 8);
+        struct record_io_slot *slot = &slots[index];
+        int res = cqe->res;
+
+        inflight--;
+        switch (data & 0xff) {
+        case RECORD_IO_UNLINK:
+                if (res < 0 && res != -ENOENT) {
+                        telem_log(LOG_WARNING, "Unable to remove record file: %s\n",
+                                  strerror(-res));
+                }
+                return;
+        case RECORD_IO_OPEN:
+                if (res < 0) {
+                        slot->error = res;
+                } else {
+                        slot->fd = res;
+                }
+                break;
+        case RECORD_IO_STATX:
+                if (res < 0) {
+                        slot->error = res;
+                }
+                break;
+        case RECORD_IO_READ:
+                if (res < 0) {
+                        slot->error = res;
+                } else if ((size_t)res != slot->size) {
+                        /* Changed since, read it again */
+                        slot->error = -EAGAIN;
+                } else {
+                        slot->data[slot->size] = '\0';
+                }
+                break;
+        }
+
+        slot->pending--;
+        if (slot->pending == 0 && !slot->read && slot->error == 0) {
+                start_read(slot, index);
+        }
+}
+
+static void reap(void)
+{
+        struct io_uring_cqe *cqe;
+
+        while (io_uring_peek_cqe(&ring, &cqe) == 0) {
+                complete(cqe);
+                io_uring_cqe_seen(&ring, cqe);
+        }
+}
+
+static bool wait_one(void)
+{
+        struct io_uring_cqe *cqe;
+        int ret;
+
+        submit_queued();
+        ret = io_uring_wait_cqe(&ring, &cqe);
+        if (ret < 0) {
+                if (ret == -EINTR) {
+                        return true;
+                }
+                telem_log(LOG_ERR, "Unable to wait for record I/O: %s\n", strerror(-ret));
+                return false;
+        }
+        complete(cqe);
+        io_uring_cqe_seen(&ring, cqe);
+
+        return true;
+}
+
+static struct record_io_slot *find_slot(const char *path)
+{
+        for (int i = 0; i < RECORD_IO_SLOTS; i++) {
+                if (slots[i].path && strcmp(slots[i].path, path) == 0) {
+                        return &slots[i];
+                }
+        }
+
+        return NULL;
+}
+
+/* Takes a file read ahead, or returns false to read it the usual way */
+static bool take_slot(struct record_io_slot *slot, struct staged_record *record,
+                      struct stat *st, bool *parsed)
+{
+        while (slot->pending > 0) {
+                if (!wait_one()) {
+                        return false;
+                }
+        }
+        if (slot->error < 0 || !slot->read) {
+                release_slot(slot);
+                return false;
+        }
+
+        if (st) {
+                memset(st, 0, sizeof(*st));
+                st->st_mode = slot->stx.stx_mode;
+                st->st_uid = slot->stx.stx_uid;
+                st->st_gid = slot->stx.stx_gid;
+                st->st_nlink = slot->stx.stx_nlink;
+                st->st_size = (off_t)slot->stx.stx_size;
+                st->st_blocks = (blkcnt_t)slot->stx.stx_blocks;
+                st->st_mtim.tv_sec = slot->stx.stx_mtime.tv_sec;
+                st->st_mtim.tv_nsec = slot->stx.stx_mtime.tv_nsec;
+                st->st_ctim.tv_sec = slot->stx.stx_ctime.tv_sec;
+                st->st_ctim.tv_nsec = slot->stx.stx_ctime.tv_nsec;
+        }
+
+        record->data = slot->data;
+        record->streamed = false;
+        slot->data = NULL;
+        *parsed = parse_record(record->data, slot->size, record);
+        if (!*parsed) {
+                free_record(record);
+        }
+        release_slot(slot);
+
+        return true;
+}
+#endif
+
+int record_io_init(unsigned int depth)
+{
+#ifdef HAVE_IO_URING
+        static const int ops[] = { IORING_OP_OPENAT, IORING_OP_STATX,
+                                   IORING_OP_READ, IORING_OP_UNLINKAT };
+        struct io_uring_probe *probe;
+        int ret;
+
+        if (ring_ready) {
+                return 0;
+        }
+        ret = io_uring_queue_init(depth, &ring, 0);
+        if (ret < 0) {
+                return ret;
+        }
+
+        probe = io_uring_get_probe_ring(&ring);
+        for (size_t i = 0; i < sizeof(ops) / sizeof(ops[0]); i++) {
+                if (!probe || !io_uring_opcode_supported(probe, ops[i])) {
+                        if (probe) {
+                                io_uring_free_probe(probe);
+                        }
+                        io_uring_queue_exit(&ring);
+                        return -EOPNOTSUPP;
+                }
+        }
+        io_uring_free_probe(probe);
+
+        for (int i = 0; i < RECORD_IO_SLOTS; i++) {
+                memset(&slots[i], 0, sizeof(slots[i]));
+                slots[i].fd = -1;
+        }
+        ring_depth = depth;
+        inflight = 0;
+        ring_ready = true;
+
+        return 0;
+#else
+        (void)depth;
+        return -ENOSYS;
+#endif
+}
+
+bool record_io_enabled(void)
+{
+#ifdef HAVE_IO_URING
+        return ring_ready;
+#else
+        return false;
+#endif
+}
+
+void record_io_prefetch(const char *path)
+{
+#ifdef HAVE_IO_URING
+        struct record_io_slot *slot = NULL;
+        struct io_uring_sqe *sqe;
+        unsigned int index;
+
+        if (!ring_ready || find_slot(path)) {
+                return;
+        }
+        for (index = 0; index < RECORD_IO_SLOTS; index++) {
+                if (!slots[index].path) {
+                        slot = &slots[index];
+                        break;
+                }
+        }
+        if (!slot) {
+                return;
+        }
+        if (io_uring_sq_space_left(&ring) < 2) {
+                submit_queued();
+                if (io_uring_sq_space_left(&ring) < 2) {
+                        return;
+                }
+        }
+
+        slot->path = strdup(path);
+        if (!slot->path) {
+                telem_log(LOG_ERR, "Unable to allocate memory, exiting\n");
+                exit(EXIT_FAILURE);
+        }
+        sqe = io_uring_get_sqe(&ring);
+        io_uring_prep_openat(sqe, AT_FDCWD, slot->path, O_RDONLY | O_CLOEXEC, 0);
+        io_uring_sqe_set_data64(sqe, ((uint64_t)index << 8) | RECORD_IO_OPEN);
+        sqe = io_uring_get_sqe(&ring);
+        io_uring_prep_statx(sqe, AT_FDCWD, slot->path, AT_STATX_SYNC_AS_STAT,
+                            STATX_BASIC_STATS, &slot->stx);
+        io_uring_sqe_set_data64(sqe, ((uint64_t)index << 8) | RECORD_IO_STATX);
+        slot->pending = 2;
+        inflight += 2;
+#else
+        (void)path;
+#endif
+}
+
+void record_io_submit(void)
+{
+#ifdef HAVE_IO_URING
+        if (ring_ready) {
+                submit_queued();
+                reap();
+        }
+#endif
+}
+
+bool record_io_read(char *path, struct staged_record *record, struct stat *st)
+{
+#ifdef HAVE_IO_URING
+        struct record_io_slot *slot;
+        bool parsed;
+
+        if (ring_ready && (slot = find_slot(path)) &&
+            take_slot(slot, record, st, &parsed)) {
+                return parsed;
+        }
+#endif
+        if (!read_record(path, record)) {
+                return false;
+        }
+        if (st && stat(path, st) != 0) {
+                telem_perror("Unable to stat record");
+                free_record(record);
+                return false;
+        }
+
+        return true;
+}
+
+void record_io_unlink(const char *path)
+{
+#ifdef HAVE_IO_URING
+        struct io_uring_sqe *sqe;
+
+        if (ring_ready) {
+                /* Keep the completions within reach of the ring */
+                while (inflight >= ring_depth && wait_one()) {
+                }
+                if (unlink_count == unlink_alloc) {
+                        int alloc = unlink_alloc ? unlink_alloc * 2 : 16;
+                        char **paths = realloc(unlink_paths, (size_t)alloc * sizeof(char *));
+
+                        if (!paths) {
+                                telem_log(LOG_ERR, "Unable to allocate memory, exiting\n");
+                                exit(EXIT_FAILURE);
+                        }
+                        unlink_paths = paths;
+                        unlink_alloc = alloc;
+                }
+                if ((sqe = get_sqe())) {
+                        if (!(unlink_paths[unlink_count] = strdup(path))) {
+                                telem_log(LOG_ERR, "Unable to allocate memory, exiting\n");
+                                exit(EXIT_FAILURE);
+                        }
+                        io_uring_prep_unlinkat(sqe, AT_FDCWD, unlink_paths[unlink_count], 0);
+                        io_uring_sqe_set_data64(sqe, RECORD_IO_UNLINK);
+                        unlink_count++;
+                        inflight++;
+                        return;
+                }
+        }
+#endif
+        unlink(path);
+}
+
+void record_io_drain(void)
+{
+#ifdef HAVE_IO_URING
+        if (!ring_ready) {
+                return;
+        }
+        while (inflight > 0 && wait_one()) {
+        }
+        for (int i = 0; i < RECORD_IO_SLOTS; i++) {
+                if (slots[i].path) {
+                        release_slot(&slots[i]);
+                }
+        }
+#endif
+}
+
+void record_io_close(void)
+{
+#ifdef HAVE_IO_URING
+        if (!ring_ready) {
+                return;
+        }
+        record_io_drain();
+        submit_queued();
+        io_uring_queue_exit(&ring);
+        free(unlink_paths);
+        unlink_paths = NULL;
+        unlink_alloc = 0;
+        ring_ready = false;
+#endif
+}
+
+/* vi: set ts=8 sw=8 sts=4 et tw=80 cino=(0: */
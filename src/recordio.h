@@ -0,0 +1,101 @@
+/*
+ * This program is part of the Clear Linux Project
+ *
+ * Copyright 2019 Intel Corporation
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms and conditions of the GNU Lesser General Public License, as
+ * published by the Free Software Foundation; either version 2.1 of the License,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU Lesser General Public License for more
+ * details.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <sys/stat.h>
+
+#include "iorecord.h"
+
+/*
+ * I/O of the record files of the spool. With the io_uring backend, built
+ * with --with-io-uring and enabled with io_uring_enabled, the spool passes
+ * read the files of the next TM_RECORD_IO_AHEAD records ahead: opening,
+ * stating and reading them is submitted at once and completes while the
+ * records before them are sent. Removals of the records sent are queued
+ * and submitted together. Without the backend, records are read when they
+ * are asked for and removed at once, as before.
+ */
+
+/* Submission queue entries of the ring */
+#define TM_RECORD_IO_DEPTH 128
+/* Records of which a spool pass reads the files ahead */
+#define TM_RECORD_IO_AHEAD 16
+
+/**
+ * Sets up the io_uring backend
+ *
+ * @param depth Submission queue entries of the ring
+ *
+ * @return 0 on success, -ENOSYS if telempostd was built without io_uring,
+ *     -EOPNOTSUPP if the kernel lacks the operations used, or another
+ *     negative errno-style value
+ */
+int record_io_init(unsigned int depth);
+
+/**
+ * Gets whether the io_uring backend is set up
+ *
+ * @return true if record files are read ahead and removed in batches
+ */
+bool record_io_enabled(void);
+
+/**
+ * Starts reading a record file ahead. Does nothing without the backend, or
+ * if twice TM_RECORD_IO_AHEAD files are being read ahead already. The
+ * operations are queued until record_io_submit().
+ *
+ * @param path Path of the record file
+ */
+void record_io_prefetch(const char *path);
+
+/**
+ * Submits the operations queued, and handles the ones completed
+ */
+void record_io_submit(void);
+
+/**
+ * Reads a record like read_record(), taking the file read ahead if it was,
+ * and waiting for it if it is still being read
+ *
+ * @param path Path of the record file
+ * @param record Set to the record read, to be released with free_record()
+ * @param st Set to the status of the file, or NULL
+ *
+ * @return true if the record was read and parsed
+ */
+bool record_io_read(char *path, struct staged_record *record, struct stat *st);
+
+/**
+ * Removes a record file, at once without the backend
+ *
+ * @param path Path of the record file
+ */
+void record_io_unlink(const char *path);
+
+/**
+ * Waits for the operations submitted, and drops the files read ahead that
+ * were not taken, which may change once a pass is over
+ */
+void record_io_drain(void);
+
+/**
+ * Drains and releases the backend, removals queued are done first
+ */
+void record_io_close(void);
+
+/* vi: set ts=8 sw=8 sts=4 et tw=80 cino=(0: */
@@ -0,0 +1,742 @@
+/*
+ * This program is part of the Clear Linux Project
+ *
+ * Copyright 2018 Intel Corporation
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms and conditions of the GNU Lesser General Public License, as
+ * published by the Free Software Foundation; either version 2.1 of the License,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU Lesser General Public License for more
+ * details.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <zlib.h>
+
+#include "recordpack.h"
+#include "log.h"
+
+#define PACK_MAGIC "TMRPACK"
+#define INDEX_MAGIC "TMRIDX"
+#define BLOB_MAGIC "TMRB"
+/* Attempts of a reader to open an index and its pack between compactions */
+#define PACK_OPEN_ATTEMPTS 3
+
+/* Hashes a body, FNV-1a */
+static uint64_t hash_body(const char *data, size_t size)
+{
+        uint64_t hash = 14695981039346656037ULL;
+
+        for (size_t i = 0; i < size; i++) {
+                hash ^= (unsigned char)data[i];
+                hash *= 1099511628211ULL;
+        }
+
+        return hash;
+}
+
+static void pack_name(char *name, size_t len, uint32_t generation)
+{
+        snprintf(name, len, RECORD_PACK_PREFIX "%08" PRIu32, generation);
+}
+
+static off_t slot_offset(uint32_t slot)
+{
+        return (off_t)sizeof(struct record_pack_header) +
+               (off_t)slot * (off_t)sizeof(struct record_pack_index_entry);
+}
+
+/* Copies a record id into the fixed width field of an entry, truncated to
+ * fit and NUL terminated */
+static void copy_record_id(char *dst, size_t size, const char *record_id)
+{
+        size_t len = strnlen(record_id, size - 1);
+
+        memcpy(dst, record_id, len);
+        dst[len] = '\0';
+}
+
+static off_t blob_bytes(struct record_pack_blob *blob)
+{
+        return (off_t)sizeof(struct record_pack_blob_header) + blob->stored;
+}
+
+static int write_header(int fd, const char *magic, uint32_t generation)
+{
+        struct record_pack_header header;
+
+        memset(&header, 0, sizeof(header));
+        strncpy(header.magic, magic, sizeof(header.magic));
+        header.version = RECORD_PACK_VERSION;
+        header.generation = generation;
+        if (pwrite(fd, &header, sizeof(header), 0) != sizeof(header)) {
+                return -EIO;
+        }
+
+        return 0;
+}
+
+static int read_header(int fd, const char *magic, uint32_t *generation)
+{
+        struct record_pack_header header;
+
+        if (pread(fd, &header, sizeof(header), 0) != sizeof(header) ||
+            strncmp(header.magic, magic, sizeof(header.magic)) != 0 ||
+            header.version != RECORD_PACK_VERSION) {
+                return -EINVAL;
+        }
+        *generation = header.generation;
+
+        return 0;
+}
+
+static int find_entry(struct record_pack *pack, const char *record_id)
+{
+        for (int i = 0; i < pack->count; i++) {
+                if (strcmp(pack->entries[i].record_id, record_id) == 0) {
+                        return i;
+                }
+        }
+
+        return -1;
+}
+
+static int find_blob(struct record_pack *pack, uint64_t offset)
+{
+        for (int i = 0; i < pack->blob_count; i++) {
+                if (pack->blobs[i].offset == offset) {
+                        return i;
+                }
+        }
+
+        return -1;
+}
+
+static int add_entry(struct record_pack *pack, const char *record_id,
+                     uint32_t slot, uint64_t offset)
+{
+        struct record_pack_entry *entry;
+
+        if (pack->count == pack->entries_alloc) {
+                int alloc = pack->entries_alloc ? pack->entries_alloc * 2 : 64;
+                void *entries = realloc(pack->entries, (size_t)alloc * sizeof(*entry));
+
+                if (!entries) {
+                        return -ENOMEM;
+                }
+                pack->entries = entries;
+                pack->entries_alloc = alloc;
+        }
+        entry = &pack->entries[pack->count++];
+        copy_record_id(entry->record_id, sizeof(entry->record_id), record_id);
+        entry->slot = slot;
+        entry->offset = offset;
+
+        return 0;
+}
+
+/* Takes a reference to the body at offset, reading its header if new */
+static int ref_blob(struct record_pack *pack, uint64_t offset)
+{
+        struct record_pack_blob_header header;
+        struct record_pack_blob *blob;
+        int i = find_blob(pack, offset);
+
+        if (i >= 0) {
+                pack->blobs[i].refs++;
+                return 0;
+        }
+
+        if (pread(pack->pack_fd, &header, sizeof(header), (off_t)offset) != sizeof(header) ||
+            memcmp(header.magic, BLOB_MAGIC, sizeof(header.magic)) != 0 ||
+            (off_t)(offset + sizeof(header) + header.stored) > pack->pack_size) {
+                return -EIO;
+        }
+        if (pack->blob_count == pack->blobs_alloc) {
+                int alloc = pack->blobs_alloc ? pack->blobs_alloc * 2 : 64;
+                void *blobs = realloc(pack->blobs, (size_t)alloc * sizeof(*blob));
+
+                if (!blobs) {
+                        return -ENOMEM;
+                }
+                pack->blobs = blobs;
+                pack->blobs_alloc = alloc;
+        }
+        blob = &pack->blobs[pack->blob_count++];
+        blob->offset = offset;
+        blob->hash = header.hash;
+        blob->size = header.size;
+        blob->stored = header.stored;
+        blob->refs = 1;
+        pack->live_size += blob_bytes(blob);
+
+        return 0;
+}
+
+static void unref_blob(struct record_pack *pack, uint64_t offset)
+{
+        int i = find_blob(pack, offset);
+
+        if (i < 0 || --pack->blobs[i].refs > 0) {
+                return;
+        }
+        pack->live_size -= blob_bytes(&pack->blobs[i]);
+        pack->blobs[i] = pack->blobs[--pack->blob_count];
+}
+
+/* Reads and checks the body at offset */
+static int read_blob(struct record_pack *pack, uint64_t offset, char **data,
+                     size_t *size)
+{
+        struct record_pack_blob_header header;
+        char *stored = NULL;
+        char *body = NULL;
+        uLongf len;
+
+        if (pread(pack->pack_fd, &header, sizeof(header), (off_t)offset) != sizeof(header) ||
+            memcmp(header.magic, BLOB_MAGIC, sizeof(header.magic)) != 0 ||
+            (off_t)(offset + sizeof(header) + header.stored) > pack->pack_size) {
+                return -EIO;
+        }
+
+        stored = malloc((size_t)header.stored + 1);
+        if (!stored) {
+                return -ENOMEM;
+        }
+        if (pread(pack->pack_fd, stored, header.stored,
+                  (off_t)(offset + sizeof(header))) != (ssize_t)header.stored) {
+                free(stored);
+                return -EIO;
+        }
+
+        if (header.flags & RECORD_PACK_DEFLATED) {
+                body = malloc((size_t)header.size + 1);
+                len = header.size;
+                if (!body) {
+                        free(stored);
+                        return -ENOMEM;
+                }
+                if (uncompress((Bytef *)body, &len, (Bytef *)stored,
+                               header.stored) != Z_OK || len != header.size) {
+                        free(stored);
+                        free(body);
+                        return -EIO;
+                }
+                free(stored);
+        } else if (header.stored == header.size) {
+                body = stored;
+        } else {
+                free(stored);
+                return -EIO;
+        }
+        body[header.size] = '\0';
+
+        if (hash_body(body, header.size) != header.hash) {
+                free(body);
+                return -EIO;
+        }
+        *data = body;
+        *size = header.size;
+
+        return 0;
+}
+
+/* Loads the live entries of the index, and the bodies they refer to */
+static int load_index(struct record_pack *pack)
+{
+        struct record_pack_index_entry *entries = NULL;
+        struct stat st;
+        size_t len;
+        uint32_t slots;
+
+        if (fstat(pack->index_fd, &st) == -1) {
+                return -errno;
+        }
+        slots = (uint32_t)((st.st_size - slot_offset(0)) /
+                           (off_t)sizeof(struct record_pack_index_entry));
+
+        /* An entry cut short by a crash is dropped */
+        if (pack->writable && st.st_size != slot_offset(slots) &&
+            ftruncate(pack->index_fd, slot_offset(slots)) == -1) {
+                return -errno;
+        }
+        pack->slots = slots;
+        if (slots == 0) {
+                return 0;
+        }
+
+        len = (size_t)slots * sizeof(*entries);
+        entries = malloc(len);
+        if (!entries) {
+                return -ENOMEM;
+        }
+        if (pread(pack->index_fd, entries, len, slot_offset(0)) != (ssize_t)len) {
+                free(entries);
+                return -EIO;
+        }
+
+        for (uint32_t i = 0; i < slots; i++) {
+                struct record_pack_index_entry *entry = &entries[i];
+                int ret;
+
+                if (!entry->live) {
+                        continue;
+                }
+                entry->record_id[sizeof(entry->record_id) - 1] = '\0';
+                if (entry->offset < sizeof(struct record_pack_header) ||
+                    (off_t)entry->offset >= pack->pack_size) {
+                        continue;
+                }
+                if (pack->writable && ref_blob(pack, entry->offset) < 0) {
+                        telem_log(LOG_WARNING, "Dropping damaged saved record %s\n",
+                                  entry->record_id);
+                        continue;
+                }
+                ret = add_entry(pack, entry->record_id, i, entry->offset);
+                if (ret < 0) {
+                        free(entries);
+                        return ret;
+                }
+        }
+        free(entries);
+
+        return 0;
+}
+
+/* Starts an empty index and pack, of the generation after the last one */
+static int reset_pack(struct record_pack *pack, uint32_t generation)
+{
+        char name[32];
+
+        if (pack->pack_fd >= 0) {
+                close(pack->pack_fd);
+        }
+        pack_name(name, sizeof(name), generation);
+        pack->pack_fd = openat(pack->dirfd, name, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC,
+                               0644);
+        if (pack->pack_fd < 0) {
+                return -errno;
+        }
+        if (write_header(pack->pack_fd, PACK_MAGIC, generation) < 0 ||
+            ftruncate(pack->index_fd, 0) == -1 ||
+            write_header(pack->index_fd, INDEX_MAGIC, generation) < 0) {
+                return -EIO;
+        }
+        pack->generation = generation;
+        pack->pack_size = (off_t)sizeof(struct record_pack_header);
+
+        return 0;
+}
+
+static int open_files(struct record_pack *pack)
+{
+        uint32_t generation = 0;
+        uint32_t pack_generation = 0;
+        char name[32];
+        int ret;
+
+        pack->index_fd = openat(pack->dirfd, RECORD_PACK_INDEX,
+                                pack->writable ? O_RDWR | O_CREAT | O_CLOEXEC :
+                                O_RDONLY | O_CLOEXEC, 0644);
+        if (pack->index_fd < 0) {
+                return -errno;
+        }
+
+        ret = read_header(pack->index_fd, INDEX_MAGIC, &generation);
+        if (ret == 0) {
+                pack_name(name, sizeof(name), generation);
+                pack->pack_fd = openat(pack->dirfd, name, pack->writable ?
+                                       O_RDWR | O_CLOEXEC : O_RDONLY | O_CLOEXEC);
+                if (pack->pack_fd < 0) {
+                        ret = -errno;
+                } else {
+                        ret = read_header(pack->pack_fd, PACK_MAGIC, &pack_generation);
+                        if (ret == 0 && pack_generation != generation) {
+                                ret = -EINVAL;
+                        }
+                }
+        }
+
+        if (ret < 0) {
+                if (!pack->writable) {
+                        return ret;
+                }
+                telem_log(LOG_INFO, "Starting a new pack of saved records\n");
+                return reset_pack(pack, generation + 1);
+        }
+        pack->generation = generation;
+        pack->pack_size = lseek(pack->pack_fd, 0, SEEK_END);
+        if (pack->pack_size < 0) {
+                return -errno;
+        }
+
+        return 0;
+}
+
+int record_pack_open(struct record_pack *pack, int dirfd, bool writable,
+                     bool deflate)
+{
+        int ret;
+
+        memset(pack, 0, sizeof(*pack));
+        pack->dirfd = dirfd;
+        pack->writable = writable;
+        pack->deflate = deflate;
+
+        for (int i = 0; i < PACK_OPEN_ATTEMPTS; i++) {
+                pack->pack_fd = -1;
+                pack->index_fd = -1;
+                ret = open_files(pack);
+                /* The pack was compacted between opening the index and it */
+                if (ret != -ENOENT || writable || pack->index_fd < 0) {
+                        break;
+                }
+                close(pack->index_fd);
+        }
+        if (ret == 0) {
+                ret = load_index(pack);
+        }
+        if (ret < 0) {
+                record_pack_close(pack);
+        }
+
+        return ret;
+}
+
+/* Stores a body, deflated if asked and smaller */
+static int append_blob(struct record_pack *pack, const char *data, size_t size,
+                       uint64_t hash, uint64_t *offset)
+{
+        struct record_pack_blob_header header;
+        struct iovec iov[2];
+        char *deflated = NULL;
+        uLongf len;
+        ssize_t total;
+        int ret;
+
+        if (size > UINT32_MAX) {
+                return -EINVAL;
+        }
+
+        memset(&header, 0, sizeof(header));
+        memcpy(header.magic, BLOB_MAGIC, sizeof(header.magic));
+        header.size = (uint32_t)size;
+        header.stored = (uint32_t)size;
+        header.hash = hash;
+        iov[1].iov_base = (void *)data;
+
+        if (pack->deflate) {
+                len = compressBound((uLong)size);
+                deflated = malloc(len);
+                if (deflated && compress2((Bytef *)deflated, &len, (const Bytef *)data,
+                                          (uLong)size, Z_DEFAULT_COMPRESSION) == Z_OK &&
+                    len < size) {
+                        header.flags |= RECORD_PACK_DEFLATED;
+                        header.stored = (uint32_t)len;
+                        iov[1].iov_base = deflated;
+                }
+        }
+        iov[0].iov_base = &header;
+        iov[0].iov_len = sizeof(header);
+        iov[1].iov_len = header.stored;
+
+        total = (ssize_t)(sizeof(header) + header.stored);
+        if (pwritev(pack->pack_fd, iov, 2, pack->pack_size) != total) {
+                /* Nothing refers to a partial body, it is cut off */
+                if (ftruncate(pack->pack_fd, pack->pack_size) == -1) {
+                        telem_perror("Error truncating pack of saved records");
+                }
+                free(deflated);
+                return -EIO;
+        }
+        free(deflated);
+
+        *offset = (uint64_t)pack->pack_size;
+        pack->pack_size += total;
+
+        ret = ref_blob(pack, *offset);
+
+        return ret;
+}
+
+/* Finds a body identical to data */
+static bool find_duplicate(struct record_pack *pack, const char *data,
+                           size_t size, uint64_t hash, uint64_t *offset)
+{
+        for (int i = 0; i < pack->blob_count; i++) {
+                struct record_pack_blob *blob = &pack->blobs[i];
+                char *body = NULL;
+                size_t len = 0;
+                bool same;
+
+                if (blob->hash != hash || blob->size != size) {
+                        continue;
+                }
+                if (read_blob(pack, blob->offset, &body, &len) < 0) {
+                        continue;
+                }
+                same = memcmp(body, data, size) == 0;
+                free(body);
+                if (same) {
+                        *offset = blob->offset;
+                        return true;
+                }
+        }
+
+        return false;
+}
+
+int record_pack_put(struct record_pack *pack, const char *record_id,
+                    const char *data, size_t size)
+{
+        struct record_pack_index_entry entry;
+        uint64_t hash = hash_body(data, size);
+        uint64_t offset = 0;
+        int ret;
+
+        if (!pack->writable || strlen(record_id) >= sizeof(entry.record_id)) {
+                return -EINVAL;
+        }
+        if (find_entry(pack, record_id) >= 0) {
+                record_pack_remove(pack, record_id);
+        }
+
+        if (find_duplicate(pack, data, size, hash, &offset)) {
+                pack->blobs[find_blob(pack, offset)].refs++;
+        } else {
+                ret = append_blob(pack, data, size, hash, &offset);
+                if (ret < 0) {
+                        return ret;
+                }
+        }
+
+        memset(&entry, 0, sizeof(entry));
+        copy_record_id(entry.record_id, sizeof(entry.record_id), record_id);
+        entry.live = 1;
+        entry.offset = offset;
+        if (pwrite(pack->index_fd, &entry, sizeof(entry), slot_offset(pack->slots)) !=
+            sizeof(entry)) {
+                unref_blob(pack, offset);
+                return -EIO;
+        }
+
+        ret = add_entry(pack, record_id, pack->slots, offset);
+        pack->slots++;
+        if (ret < 0) {
+                unref_blob(pack, offset);
+        }
+
+        return ret;
+}
+
+int record_pack_get(struct record_pack *pack, const char *record_id,
+                    char **data, size_t *size)
+{
+        int i = find_entry(pack, record_id);
+
+        if (i < 0) {
+                return -ENOENT;
+        }
+
+        return read_blob(pack, pack->entries[i].offset, data, size);
+}
+
+int record_pack_remove(struct record_pack *pack, const char *record_id)
+{
+        uint8_t dead = 0;
+        int i = find_entry(pack, record_id);
+
+        if (i < 0) {
+                return -ENOENT;
+        }
+        if (pwrite(pack->index_fd, &dead, sizeof(dead),
+                   slot_offset(pack->entries[i].slot) +
+                   (off_t)offsetof(struct record_pack_index_entry, live)) != sizeof(dead)) {
+                return -EIO;
+        }
+        unref_blob(pack, pack->entries[i].offset);
+        pack->entries[i] = pack->entries[--pack->count];
+
+        return 0;
+}
+
+/* Copies the live bodies to a new pack, setting their new offsets */
+static int copy_blobs(struct record_pack *pack, int fd, uint64_t *offsets)
+{
+        off_t size = (off_t)sizeof(struct record_pack_header);
+        char *buff = NULL;
+        size_t alloc = 0;
+
+        for (int i = 0; i < pack->blob_count; i++) {
+                size_t len = (size_t)blob_bytes(&pack->blobs[i]);
+
+                if (len > alloc) {
+                        char *larger = realloc(buff, len);
+
+                        if (!larger) {
+                                free(buff);
+                                return -ENOMEM;
+                        }
+                        buff = larger;
+                        alloc = len;
+                }
+                if (pread(pack->pack_fd, buff, len, (off_t)pack->blobs[i].offset) !=
+                    (ssize_t)len ||
+                    pwrite(fd, buff, len, size) != (ssize_t)len) {
+                        free(buff);
+                        return -EIO;
+                }
+                offsets[i] = (uint64_t)size;
+                size += (off_t)len;
+        }
+        free(buff);
+
+        return 0;
+}
+
+/* Writes the index of the live entries, with the new offsets */
+static int write_index(struct record_pack *pack, int fd, uint32_t generation,
+                       uint64_t *offsets)
+{
+        struct record_pack_index_entry entry;
+
+        if (write_header(fd, INDEX_MAGIC, generation) < 0) {
+                return -EIO;
+        }
+        for (int i = 0; i < pack->count; i++) {
+                memset(&entry, 0, sizeof(entry));
+                copy_record_id(entry.record_id, sizeof(entry.record_id),
+                               pack->entries[i].record_id);
+                entry.live = 1;
+                entry.offset = offsets[find_blob(pack, pack->entries[i].offset)];
+                if (pwrite(fd, &entry, sizeof(entry), slot_offset((uint32_t)i)) !=
+                    sizeof(entry)) {
+                        return -EIO;
+                }
+        }
+
+        return 0;
+}
+
+int record_pack_compact(struct record_pack *pack)
+{
+        char name[32];
+        char old_name[32];
+        uint32_t generation = pack->generation + 1;
+        uint64_t *offsets = NULL;
+        off_t dead;
+        off_t live;
+        int pack_fd = -1;
+        int index_fd = -1;
+        int ret = -EIO;
+
+        dead = pack->pack_size - (off_t)sizeof(struct record_pack_header) - pack->live_size +
+               (off_t)(pack->slots - (uint32_t)pack->count) *
+               (off_t)sizeof(struct record_pack_index_entry);
+        live = pack->live_size +
+               (off_t)pack->count * (off_t)sizeof(struct record_pack_index_entry);
+        if (!pack->writable || dead < RECORD_PACK_COMPACT_MIN || dead <= live) {
+                return 0;
+        }
+
+        offsets = calloc((size_t)pack->blob_count + 1, sizeof(uint64_t));
+        if (!offsets) {
+                return -ENOMEM;
+        }
+
+        pack_name(name, sizeof(name), generation);
+        pack_fd = openat(pack->dirfd, name, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        index_fd = openat(pack->dirfd, RECORD_PACK_INDEX ".tmp",
+                          O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (pack_fd < 0 || index_fd < 0) {
+                ret = -errno;
+                goto fail;
+        }
+        if (write_header(pack_fd, PACK_MAGIC, generation) < 0) {
+                goto fail;
+        }
+        ret = copy_blobs(pack, pack_fd, offsets);
+        if (ret < 0) {
+                goto fail;
+        }
+        ret = write_index(pack, index_fd, generation, offsets);
+        if (ret < 0) {
+                goto fail;
+        }
+
+        /* The new pack is complete on disk before the index names it */
+        if (fdatasync(pack_fd) == -1 || fdatasync(index_fd) == -1 ||
+            renameat(pack->dirfd, RECORD_PACK_INDEX ".tmp", pack->dirfd,
+                     RECORD_PACK_INDEX) == -1) {
+                ret = -errno;
+                goto fail;
+        }
+
+        pack_name(old_name, sizeof(old_name), pack->generation);
+        if (unlinkat(pack->dirfd, old_name, 0) == -1) {
+                telem_perror("Error deleting compacted pack of saved records");
+        }
+        close(pack->pack_fd);
+        close(pack->index_fd);
+        pack->pack_fd = pack_fd;
+        pack->index_fd = index_fd;
+        pack->generation = generation;
+        pack->pack_size = lseek(pack_fd, 0, SEEK_END);
+        pack->slots = (uint32_t)pack->count;
+        for (int i = 0; i < pack->count; i++) {
+                pack->entries[i].offset = offsets[find_blob(pack, pack->entries[i].offset)];
+                pack->entries[i].slot = (uint32_t)i;
+        }
+        for (int i = 0; i < pack->blob_count; i++) {
+                pack->blobs[i].offset = offsets[i];
+        }
+        free(offsets);
+
+        return 1;
+
+fail:
+        if (pack_fd >= 0) {
+                close(pack_fd);
+                unlinkat(pack->dirfd, name, 0);
+        }
+        if (index_fd >= 0) {
+                close(index_fd);
+                unlinkat(pack->dirfd, RECORD_PACK_INDEX ".tmp", 0);
+        }
+        free(offsets);
+
+        return ret < 0 ? ret : -EIO;
+}
+
+void record_pack_close(struct record_pack *pack)
+{
+        if (pack->pack_fd >= 0) {
+                close(pack->pack_fd);
+                pack->pack_fd = -1;
+        }
+        if (pack->index_fd >= 0) {
+                close(pack->index_fd);
+                pack->index_fd = -1;
+        }
+        free(pack->entries);
+        free(pack->blobs);
+        pack->entries = NULL;
+        pack->blobs = NULL;
+        pack->count = 0;
+        pack->blob_count = 0;
+}
+
+/* vi: set ts=8 sw=8 sts=4 et tw=80 cino=(0: */
@@ -0,0 +1,178 @@
+/*
+ * This program is part of the Clear Linux Project
+ *
+ * Copyright 2018 Intel Corporation
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms and conditions of the GNU Lesser General Public License, as
+ * published by the Free Software Foundation; either version 2.1 of the License,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU Lesser General Public License for more
+ * details.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/*
+ * Local copies of records, packed in the retention directory instead of one
+ * file each:
+ *
+ * - pack-<generation>: the bodies, appended one after the other, each with
+ *   a header holding its size and content hash. Identical bodies are stored
+ *   once, and bodies are deflated when asked and when it makes them smaller.
+ * - records.idx: the record ids, each with the offset of its body in the
+ *   pack of the generation named in its header. Removing a record clears
+ *   the live flag of its entry in place.
+ *
+ * Once removed records take more space than the live ones, the live bodies
+ * are copied to the pack of the next generation and a new index is renamed
+ * over the old one, so that readers see either generation as a whole.
+ */
+
+#define RECORD_PACK_INDEX "records.idx"
+#define RECORD_PACK_PREFIX "pack-"
+#define RECORD_PACK_VERSION 1
+/* Dead bytes below which the pack is not compacted */
+#define RECORD_PACK_COMPACT_MIN (64 * 1024)
+
+struct record_pack_header {
+        char magic[8];
+        uint32_t version;
+        uint32_t generation;
+};
+
+/* Precedes every body in the pack */
+struct record_pack_blob_header {
+        char magic[4];
+        uint32_t flags;
+        /* size of the body, and of the bytes stored for it */
+        uint32_t size;
+        uint32_t stored;
+        uint64_t hash;
+};
+
+#define RECORD_PACK_DEFLATED 0x1
+
+struct record_pack_index_entry {
+        char record_id[33];
+        uint8_t live;
+        char pad[6];
+        uint64_t offset;
+};
+
+/* A record in the pack, in memory */
+struct record_pack_entry {
+        char record_id[33];
+        /* position of its index entry, and offset of its body */
+        uint32_t slot;
+        uint64_t offset;
+};
+
+/* A body in the pack, in memory, only tracked by writers */
+struct record_pack_blob {
+        uint64_t offset;
+        uint64_t hash;
+        uint32_t size;
+        uint32_t stored;
+        int refs;
+};
+
+struct record_pack {
+        int dirfd;
+        bool writable;
+        bool deflate;
+        uint32_t generation;
+        int pack_fd;
+        int index_fd;
+        off_t pack_size;
+        /* entries in the index file, live or not */
+        uint32_t slots;
+        struct record_pack_entry *entries;
+        int count;
+        int entries_alloc;
+        struct record_pack_blob *blobs;
+        int blob_count;
+        int blobs_alloc;
+        /* bytes of the live bodies in the pack, headers included */
+        off_t live_size;
+};
+
+/**
+ * Opens the pack of a retention directory. A reader fails if there is no
+ * pack, a writer creates it, or starts a new one if it is unusable.
+ *
+ * @param pack The pack
+ * @param dirfd Retention directory, kept open by the caller
+ * @param writable true to add and remove records
+ * @param deflate true to deflate the bodies added
+ *
+ * @return 0 on success, or a negative errno-style value
+ */
+int record_pack_open(struct record_pack *pack, int dirfd, bool writable,
+                     bool deflate);
+
+/**
+ * Adds the copy of a record, replacing any previous copy
+ *
+ * @param pack The pack, writable
+ * @param record_id Unique identifier of the record
+ * @param data The body
+ * @param size Size of data in bytes
+ *
+ * @return 0 on success, or a negative errno-style value
+ */
+int record_pack_put(struct record_pack *pack, const char *record_id,
+                    const char *data, size_t size);
+
+/**
+ * Reads the copy of a record
+ *
+ * @param pack The pack
+ * @param record_id Unique identifier of the record
+ * @param data Set to the body, null terminated, to be freed by the caller
+ * @param size Set to the size of the body in bytes
+ *
+ * @return 0 on success, -ENOENT if the record is not in the pack, -EIO if
+ *     its body is damaged, or -ENOMEM
+ */
+int record_pack_get(struct record_pack *pack, const char *record_id,
+                    char **data, size_t *size);
+
+/**
+ * Removes the copy of a record. The space is reclaimed by
+ * record_pack_compact.
+ *
+ * @param pack The pack, writable
+ * @param record_id Unique identifier of the record
+ *
+ * @return 0 on success, -ENOENT if the record is not in the pack, or -EIO
+ */
+int record_pack_remove(struct record_pack *pack, const char *record_id);
+
+/**
+ * Copies the live records to the pack of the next generation, if removed
+ * records take more space than them and at least RECORD_PACK_COMPACT_MIN
+ *
+ * @param pack The pack, writable
+ *
+ * @return 1 if the pack was compacted, 0 if not needed, or a negative
+ *     errno-style value
+ */
+int record_pack_compact(struct record_pack *pack);
+
+/**
+ * Releases the pack
+ *
+ * @param pack The pack
+ */
+void record_pack_close(struct record_pack *pack);
+
+/* vi: set ts=8 sw=8 sts=4 et tw=80 cino=(0: */
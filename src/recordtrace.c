@@ -0,0 +1,259 @@
+/*
+ * This program is part of the Clear Linux Project
+ *
+ * Copyright 2019 Intel Corporation
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms and conditions of the GNU Lesser General Public License, as
+ * published by the Free Software Foundation; either version 2.1 of the License,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU Lesser General Public License for more
+ * details.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "common.h"
+#include "log.h"
+#include "metrics.h"
+#include "recordtrace.h"
+
+/* 16 digits hold times until the year 2286 */
+#define TRACE_TIME_MAX 9999999999999999ULL
+
+static const char *stage_names[TRACE_STAGES] = {
+        "send", "received", "staged", "picked", "spooled", "retried"
+};
+
+uint64_t trace_clock(void)
+{
+        struct timespec now;
+
+        clock_gettime(CLOCK_REALTIME, &now);
+
+        return (uint64_t)now.tv_sec * 1000000 + (uint64_t)now.tv_nsec / 1000;
+}
+
+void trace_stamp(struct record_trace *trace, enum trace_stage stage, uint64_t time)
+{
+        if (trace->times[stage] == 0) {
+                trace->times[stage] = time;
+        }
+}
+
+void trace_format(const struct record_trace *trace, char *line)
+{
+        char buf[TRACE_LINE_LENGTH + 1];
+        char *pos = buf;
+
+        memcpy(pos, TRACE_PREFIX, TRACE_PREFIX_LENGTH);
+        pos += TRACE_PREFIX_LENGTH;
+        for (int i = 0; i < TRACE_STAGES; i++) {
+                uint64_t time = trace->times[i];
+
+                pos += sprintf(pos, " %016" PRIu64, time > TRACE_TIME_MAX ? 0 : time);
+        }
+        sprintf(pos, " %08" PRIu32, trace->retries > 99999999 ? 99999999 : trace->retries);
+
+        /* Without the null byte, the line is followed by a newline */
+        memcpy(line, buf, TRACE_LINE_LENGTH);
+}
+
+/* Parses the digits of a field of a TRACE line */
+static bool parse_field(const char *pos, size_t digits, uint64_t *value)
+{
+        uint64_t v = 0;
+
+        if (*pos++ != ' ') {
+                return false;
+        }
+        for (size_t i = 0; i < digits; i++) {
+                if (pos[i] < '0' || pos[i] > '9') {
+                        return false;
+                }
+                v = v * 10 + (uint64_t)(pos[i] - '0');
+        }
+        *value = v;
+
+        return true;
+}
+
+bool trace_parse_line(const char *line, size_t len, struct record_trace *trace)
+{
+        const char *pos = line + TRACE_PREFIX_LENGTH;
+        uint64_t retries;
+
+        if (len != TRACE_LINE_LENGTH ||
+            memcmp(line, TRACE_PREFIX, TRACE_PREFIX_LENGTH) != 0) {
+                return false;
+        }
+        for (int i = 0; i < TRACE_STAGES; i++, pos += 17) {
+                if (!parse_field(pos, 16, &trace->times[i])) {
+                        return false;
+                }
+        }
+        if (!parse_field(pos, 8, &retries)) {
+                return false;
+        }
+        trace->retries = (uint32_t)retries;
+        trace->present = true;
+
+        return true;
+}
+
+bool trace_find(const char *data, size_t size, struct record_trace *trace)
+{
+        const char *pos = data;
+        const char *end = data + size;
+
+        memset(trace, 0, sizeof(struct record_trace));
+
+        /* After the configuration file and binary payload lines */
+        if (size >= CFG_PREFIX_LENGTH && memcmp(pos, CFG_PREFIX, CFG_PREFIX_LENGTH) == 0) {
+                pos = memchr(pos, '\n', size);
+                if (!pos) {
+                        return false;
+                }
+                pos++;
+        }
+        if ((size_t)(end - pos) > RAW_PREFIX_LENGTH &&
+            memcmp(pos, RAW_PREFIX "\n", RAW_PREFIX_LENGTH + 1) == 0) {
+                pos += RAW_PREFIX_LENGTH + 1;
+        }
+
+        if ((size_t)(end - pos) <= TRACE_LINE_LENGTH || pos[TRACE_LINE_LENGTH] != '\n' ||
+            !trace_parse_line(pos, TRACE_LINE_LENGTH, trace)) {
+                trace->present = false;
+                return false;
+        }
+        trace->offset = (size_t)(pos - data);
+
+        return true;
+}
+
+void trace_stamp_data(char *data, size_t size, enum trace_stage stage, uint64_t time)
+{
+        struct record_trace trace;
+
+        if (trace_find(data, size, &trace)) {
+                trace_stamp(&trace, stage, time);
+                trace_format(&trace, data + trace.offset);
+        }
+}
+
+int trace_save(const struct record_trace *trace, const char *path)
+{
+        char line[TRACE_LINE_LENGTH];
+        struct timespec times[2];
+        struct stat buf;
+        ssize_t len;
+        int ret = 0;
+        int fd;
+
+        fd = open(path, O_WRONLY | O_CLOEXEC);
+        if (fd < 0) {
+                return -errno;
+        }
+        if (fstat(fd, &buf) != 0) {
+                ret = -errno;
+                goto out;
+        }
+        trace_format(trace, line);
+        len = pwrite(fd, line, sizeof(line), (off_t)trace->offset);
+        if (len != (ssize_t)sizeof(line)) {
+                ret = len < 0 ? -errno : -EIO;
+        }
+
+        /* Record expiry and the spool order are based on the mtime */
+        times[0] = buf.st_atim;
+        times[1] = buf.st_mtim;
+        if (futimens(fd, times) != 0 && ret == 0) {
+                ret = -errno;
+        }
+out:
+        close(fd);
+
+        return ret;
+}
+
+void trace_retry(struct record_trace *trace, const char *path)
+{
+        int ret;
+
+        if (!trace->present) {
+                return;
+        }
+        trace->retries++;
+        trace->times[TRACE_RETRIED] = trace_clock();
+
+        /* Kept for the next retry if this one fails */
+        if ((ret = trace_save(trace, path)) < 0) {
+                telem_log(LOG_WARNING, "Unable to update the trace of %s: %s\n", path,
+                          strerror(-ret));
+        }
+}
+
+/* Adds the time between two stages, if the record went through both */
+static void observe_stage(enum metric_histogram histogram, uint64_t from, uint64_t to)
+{
+        /* The clock may have been set back in between */
+        if (from != 0 && to >= from) {
+                metrics_observe(histogram, (to - from) * 1000);
+        }
+}
+
+void trace_delivered(const struct record_trace *trace)
+{
+        const uint64_t *times = trace->times;
+        uint64_t delivered = trace_clock();
+        uint64_t first = 0;
+
+        if (!trace->present) {
+                return;
+        }
+        for (int i = TRACE_SEND; i <= TRACE_STAGED && first == 0; i++) {
+                first = times[i];
+        }
+
+        observe_stage(METRIC_POSTD_TRACE_PROBE_TIME, times[TRACE_SEND],
+                      times[TRACE_RECEIVED]);
+        observe_stage(METRIC_POSTD_TRACE_PROBD_TIME, times[TRACE_RECEIVED],
+                      times[TRACE_STAGED]);
+        observe_stage(METRIC_POSTD_TRACE_STAGING_TIME, times[TRACE_STAGED],
+                      times[TRACE_PICKED]);
+        observe_stage(METRIC_POSTD_TRACE_POSTD_TIME, times[TRACE_PICKED],
+                      times[TRACE_SPOOLED] ? times[TRACE_SPOOLED] : delivered);
+        observe_stage(METRIC_POSTD_TRACE_SPOOL_TIME, times[TRACE_SPOOLED], delivered);
+        observe_stage(METRIC_POSTD_TRACE_TOTAL_TIME, first, delivered);
+        metrics_count(METRIC_POSTD_TRACE_RETRIES, trace->retries);
+}
+
+void trace_header(const struct record_trace *trace, char *buf, size_t size)
+{
+        size_t len;
+
+        len = (size_t)snprintf(buf, size, "%s:", TRACE_HEADER_NAME);
+        for (int i = 0; i < TRACE_STAGES && len < size; i++) {
+                if (trace->times[i] != 0) {
+                        len += (size_t)snprintf(buf + len, size - len, " %s=%" PRIu64 ";",
+                                                stage_names[i], trace->times[i]);
+                }
+        }
+        if (len < size) {
+                snprintf(buf + len, size - len, " retries=%" PRIu32 "; posted=%" PRIu64,
+                         trace->retries, trace_clock());
+        }
+}
+
+/* vi: set ts=8 sw=8 sts=4 et tw=80 cino=(0: */
@@ -0,0 +1,165 @@
+/*
+ * This program is part of the Clear Linux Project
+ *
+ * Copyright 2019 Intel Corporation
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms and conditions of the GNU Lesser General Public License, as
+ * published by the Free Software Foundation; either version 2.1 of the License,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU Lesser General Public License for more
+ * details.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Record traces: with record_tracing enabled, the times at which a record
+ * went through each stage on its way to the server. telemprobd writes them
+ * in a TRACE line of the staged record, after the optional CFG and RAW
+ * lines, and telempostd adds its own. The line has a fixed length, so it is
+ * updated in place in records kept in the spool. Times are in microseconds
+ * since the epoch, 0 for the stages a record did not go through. The stages
+ * of a record are added to the metrics histograms once it is delivered.
+ */
+
+#define TRACE_PREFIX        "TRACE:"
+#define TRACE_PREFIX_LENGTH 6
+
+/* Sent with the records posted alone with record_trace_header enabled */
+#define TRACE_HEADER_NAME "X-Telemetry-Trace"
+
+enum trace_stage {
+        /* sent by the probe */
+        TRACE_SEND = 0,
+        /* started being received by telemprobd */
+        TRACE_RECEIVED,
+        /* written to the staging area by telemprobd */
+        TRACE_STAGED,
+        /* picked up by telempostd */
+        TRACE_PICKED,
+        /* first kept in the spool */
+        TRACE_SPOOLED,
+        /* last read from the spool to be sent again */
+        TRACE_RETRIED,
+        TRACE_STAGES
+};
+
+/* A space and 16 digits per time, then a space and 8 digits of retries */
+#define TRACE_LINE_LENGTH (TRACE_PREFIX_LENGTH + TRACE_STAGES * 17 + 9)
+
+/* Largest value of the trace header, with its name */
+#define TRACE_HEADER_SIZE (sizeof(TRACE_HEADER_NAME) + (TRACE_STAGES + 2) * 32)
+
+struct record_trace {
+        /* the record has a TRACE line, at offset in the staged record */
+        bool present;
+        size_t offset;
+        uint64_t times[TRACE_STAGES];
+        uint32_t retries;
+};
+
+/**
+ * Gets the time stages are traced with
+ *
+ * @return the real time clock, in microseconds since the epoch
+ */
+uint64_t trace_clock(void);
+
+/**
+ * Sets the time of a stage, unless the record already went through it
+ *
+ * @param trace The trace
+ * @param stage The stage
+ * @param time Time of the stage, see trace_clock()
+ */
+void trace_stamp(struct record_trace *trace, enum trace_stage stage, uint64_t time);
+
+/**
+ * Formats the TRACE line of a trace, without a newline
+ *
+ * @param trace The trace
+ * @param line Set to the TRACE_LINE_LENGTH characters of the line, not null
+ *     terminated
+ */
+void trace_format(const struct record_trace *trace, char *line);
+
+/**
+ * Parses a TRACE line
+ *
+ * @param line The line, starting with TRACE_PREFIX
+ * @param len Length of the line, without its newline
+ * @param trace Set to the trace, of which the offset is left unchanged
+ *
+ * @return true if the line is a valid TRACE line, false otherwise
+ */
+bool trace_parse_line(const char *line, size_t len, struct record_trace *trace);
+
+/**
+ * Finds and parses the TRACE line of a record in the staged record layout
+ *
+ * @param data The record data
+ * @param size Size of the data
+ * @param trace Set to the trace, not present if the record has none
+ *
+ * @return true if the record has a TRACE line
+ */
+bool trace_find(const char *data, size_t size, struct record_trace *trace);
+
+/**
+ * Sets the time of a stage in the TRACE line of a record in the staged
+ * record layout, if it has one, unless the record already went through it
+ *
+ * @param data The record data, modified in place
+ * @param size Size of the data
+ * @param stage The stage
+ * @param time Time of the stage
+ */
+void trace_stamp_data(char *data, size_t size, enum trace_stage stage, uint64_t time);
+
+/**
+ * Writes the TRACE line of a trace in place in a record file, keeping the
+ * modification time of the file
+ *
+ * @param trace The trace, of the record read from the file
+ * @param path The record file
+ *
+ * @return 0 on success, or a negative errno value
+ */
+int trace_save(const struct record_trace *trace, const char *path);
+
+/**
+ * Counts an attempt to send a spooled record again, and saves it in its
+ * record file
+ *
+ * @param trace The trace of the record, left alone if not present
+ * @param path The record file
+ */
+void trace_retry(struct record_trace *trace, const char *path);
+
+/**
+ * Adds the time a record spent in each stage to the metrics histograms, once
+ * it is delivered to the server
+ *
+ * @param trace The trace of the record, left alone if not present
+ */
+void trace_delivered(const struct record_trace *trace);
+
+/**
+ * Formats the HTTP header carrying a trace, with the times of the stages the
+ * record went through and the time it is posted
+ *
+ * @param trace The trace
+ * @param buf Set to the header, null terminated
+ * @param size Size of buf, at least TRACE_HEADER_SIZE
+ */
+void trace_header(const struct record_trace *trace, char *buf, size_t size);
+
+/* vi: set ts=8 sw=8 sts=4 et tw=80 cino=(0: */
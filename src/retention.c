@@ -21,21 +21,124 @@
 #include <unistd.h>
 #include <string.h>
 #include <errno.h>
+#include <fcntl.h>
 
 #include "log.h"
 #include "common.h"
+#include "recordpack.h"
+#include "retention.h"
+
+/* The pack of the daemon, with the retention directory */
+static struct record_pack retention_pack;
+static int retention_dir = -1;
+static bool retention_packed = false;
+
+int retention_init(bool deflate)
+{
+        int ret;
+
+        retention_dir = open(RECORD_RETENTION_DIR, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (retention_dir == -1) {
+                ret = -errno;
+                telem_perror("Error opening saved records directory");
+                return ret;
+        }
+        ret = record_pack_open(&retention_pack, retention_dir, true, deflate);
+        if (ret < 0) {
+                telem_log(LOG_WARNING, "Saving records one file each, no pack: %s\n",
+                          strerror(-ret));
+                return ret;
+        }
+        retention_packed = true;
+
+        return 0;
+}
+
+void retention_close(void)
+{
+        if (retention_packed) {
+                record_pack_close(&retention_pack);
+                retention_packed = false;
+        }
+        if (retention_dir >= 0) {
+                close(retention_dir);
+                retention_dir = -1;
+        }
+}
+
+/* Saves a record in a file of its own, without a pack */
+static int save_record_file(const char *record_id, const char *body, size_t size)
+{
+        int ret = 0;
+        char *record_path = NULL;
+        FILE *record_file = NULL;
+
+        ret = asprintf(&record_path, "%s/%s", RECORD_RETENTION_DIR, record_id);
+        if (ret == -1) {
+                telem_log(LOG_ERR, "Failed to allocate memory for record full path, aborting\n");
+                return -ENOMEM;
+        }
+
+        record_file = fopen(record_path, "w");
+        free(record_path);
+        if (!record_file) {
+                telem_perror("Error opening local record copy temp file");
+                return -errno;
+        }
+
+        // Save body
+        fwrite(body, 1, size, record_file);
+        fputc('\n', record_file);
+        fclose(record_file);
+
+        return 0;
+}
+
+int save_record_copy(const char *record_id, const char *body, size_t size)
+{
+        int ret;
+
+        if (!retention_packed) {
+                return save_record_file(record_id, body, size);
+        }
+
+        ret = record_pack_put(&retention_pack, record_id, body, size);
+        if (ret < 0) {
+                telem_log(LOG_ERR, "Error saving record %s: %s\n", record_id,
+                          strerror(-ret));
+        }
+
+        return ret;
+}
+
+/* Reclaims the space of removed records once it is worth it */
+static void compact_pack(void)
+{
+        int ret = record_pack_compact(&retention_pack);
+
+        if (ret < 0) {
+                telem_log(LOG_WARNING, "Error compacting saved records: %s\n",
+                          strerror(-ret));
+        }
+}
 
 int delete_record_by_id(char *record_id)
 {
         int ret = 0;
         char *record_path = NULL;
 
+        if (retention_packed && record_pack_remove(&retention_pack, record_id) == 0) {
+                compact_pack();
+                return 0;
+        }
+
+        /* Saved before records were packed */
         ret = asprintf(&record_path, "%s/%s", RECORD_RETENTION_DIR, record_id);
         if (ret == -1) {
                 return 1;
         }
         ret = unlink(record_path);
-        if (ret == -1) {
+        if (ret == -1 && errno != ENOENT) {
                 telem_perror("Error deleting saved record");
         }
         free(record_path);
@@ -43,4 +146,35 @@ int delete_record_by_id(char *record_id)
         return 0;
 }
 
+int delete_records_by_id(char **record_ids, int count)
+{
+        int dirfd = retention_dir;
+
+        if (dirfd == -1) {
+                dirfd = open(RECORD_RETENTION_DIR, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+                if (dirfd == -1) {
+                        telem_perror("Error opening saved records directory");
+                        return 1;
+                }
+        }
+        for (int i = 0; i < count; i++) {
+                if (retention_packed &&
+                    record_pack_remove(&retention_pack, record_ids[i]) == 0) {
+                        continue;
+                }
+                /* Saved before records were packed */
+                if (unlinkat(dirfd, record_ids[i], 0) == -1 && errno != ENOENT) {
+                        telem_perror("Error deleting saved record");
+                }
+        }
+        if (dirfd != retention_dir) {
+                close(dirfd);
+        }
+        if (retention_packed) {
+                compact_pack();
+        }
+
+        return 0;
+}
+
 /* vi: set ts=8 sw=8 sts=4 et tw=80 cino=(0: */
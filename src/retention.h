@@ -16,6 +16,41 @@
 
 #define _GNU_SOURCE
 
+#include <stdbool.h>
+#include <stddef.h>
+
+/*
+ * Local copies of records, kept in a pack in RECORD_RETENTION_DIR, see
+ * recordpack.h. Without a usable pack, records are saved one file each, as
+ * they were before packs.
+ */
+
+/**
+ * Opens the pack of saved records
+ *
+ * @param deflate true to deflate the records saved
+ *
+ * @return 0 on success, or a negative errno-style value, records are then
+ *     saved one file each
+ */
+int retention_init(bool deflate);
+
+/**
+ * Closes the pack of saved records
+ */
+void retention_close(void);
+
+/**
+ * Saves a copy of a record
+ *
+ * @param record_id Unique identifier of the record
+ * @param body Body of the record
+ * @param size Size of the body in bytes
+ *
+ * @return 0 on success, or a negative errno-style value
+ */
+int save_record_copy(const char *record_id, const char *body, size_t size);
+
 /**
  * Delete record identified by record unique id
  *
@@ -24,4 +59,14 @@
  */
 int delete_record_by_id(char *record_id);
 
+/**
+ * Delete records identified by record unique ids, looking up the
+ * directory of the records once
+ *
+ * @param record_ids Unique identifiers of entries
+ * @param count Number of identifiers
+ *
+ */
+int delete_records_by_id(char **record_ids, int count);
+
 /* vi: set ts=8 sw=8 sts=4 et tw=80 cino=(0: */
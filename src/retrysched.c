@@ -0,0 +1,183 @@
+/*
+ * This program is part of the Clear Linux Project
+ *
+ * Copyright 2018 Intel Corporation
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms and conditions of the GNU Lesser General Public License, as
+ * published by the Free Software Foundation; either version 2.1 of the License,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU Lesser General Public License for more
+ * details.
+ */
+
+#include <stdlib.h>
+
+#include "retrysched.h"
+#include "common.h"
+#include "log.h"
+
+void retry_sched_init(struct retry_sched *sched, unsigned int seed,
+                      int drain_min, int drain_max)
+{
+        sched->state = RETRY_CLOSED;
+        sched->failures = 0;
+        sched->retry_at = 0;
+        sched->probing = false;
+        sched->drain_limit = TM_SPOOL_MAX_SEND_RECORDS;
+        retry_sched_set_drain_bounds(sched, drain_min, drain_max);
+        sched->draining = false;
+        sched->ramp_interval = TM_RETRY_RAMP_INTERVAL;
+        sched->seed = seed;
+}
+
+void retry_sched_set_drain_bounds(struct retry_sched *sched, int drain_min,
+                                  int drain_max)
+{
+        sched->drain_min = drain_min;
+        sched->drain_max = drain_max;
+        if (sched->drain_limit < drain_min) {
+                sched->drain_limit = drain_min;
+        } else if (sched->drain_limit > drain_max) {
+                sched->drain_limit = drain_max;
+        }
+}
+
+/* Picks a delay between half of delay and delay */
+static int jitter(struct retry_sched *sched, int delay)
+{
+        return delay / 2 + rand_r(&sched->seed) % (delay / 2 + 1);
+}
+
+/* Lets the probe through once the delay of an open breaker elapsed */
+static void update_state(struct retry_sched *sched, time_t now)
+{
+        if (sched->state == RETRY_OPEN && now >= sched->retry_at) {
+                sched->state = RETRY_HALF_OPEN;
+                sched->probing = false;
+        }
+}
+
+bool retry_sched_allow(struct retry_sched *sched, time_t now)
+{
+        update_state(sched, now);
+
+        if (sched->state == RETRY_CLOSED) {
+                return true;
+        }
+        if (sched->state == RETRY_HALF_OPEN && !sched->probing) {
+                telem_log(LOG_INFO, "Probing the server with one record\n");
+                sched->probing = true;
+                return true;
+        }
+
+        return false;
+}
+
+int retry_sched_pass_limit(struct retry_sched *sched, time_t now)
+{
+        if (sched->state != RETRY_CLOSED) {
+                return retry_sched_allow(sched, now) ? 1 : 0;
+        }
+
+        return sched->drain_limit;
+}
+
+void retry_sched_cancel(struct retry_sched *sched)
+{
+        if (sched->state == RETRY_HALF_OPEN) {
+                sched->probing = false;
+        }
+}
+
+time_t retry_sched_next_pass(struct retry_sched *sched, time_t last_pass,
+                             int interval, bool backlog)
+{
+        if (!backlog) {
+                return last_pass + interval;
+        }
+        if (sched->state == RETRY_OPEN) {
+                return sched->retry_at;
+        }
+        if (sched->state == RETRY_HALF_OPEN) {
+                /* The probe is sent as soon as possible */
+                return sched->probing ? last_pass + interval : last_pass;
+        }
+        if (sched->draining) {
+                return last_pass + sched->ramp_interval;
+        }
+
+        return last_pass + interval;
+}
+
+void retry_sched_pass_done(struct retry_sched *sched, int limit, int sent,
+                           int64_t elapsed)
+{
+        if (sched->state != RETRY_CLOSED) {
+                /* Failed, or the probe, which the breaker already handled */
+                sched->draining = false;
+                return;
+        }
+
+        if (sent > 0 && elapsed / sent > TM_RETRY_SLOW_POST) {
+                sched->drain_limit /= 2;
+                if (sched->drain_limit < sched->drain_min) {
+                        sched->drain_limit = sched->drain_min;
+                }
+                telem_log(LOG_INFO, "Slow server, spool passes send up to %d"
+                          " records\n", sched->drain_limit);
+        } else if (sent >= limit && sched->drain_limit < sched->drain_max) {
+                sched->drain_limit *= 2;
+                if (sched->drain_limit > sched->drain_max) {
+                        sched->drain_limit = sched->drain_max;
+                }
+        }
+        sched->draining = sent >= limit;
+}
+
+void retry_sched_success(struct retry_sched *sched)
+{
+        if (sched->state == RETRY_OPEN) {
+                /* Sent before the breaker opened, the next probe decides */
+                return;
+        }
+        if (sched->state == RETRY_HALF_OPEN) {
+                telem_log(LOG_INFO, "Server reachable again, resuming delivery\n");
+                sched->state = RETRY_CLOSED;
+                sched->failures = 0;
+                sched->probing = false;
+                sched->drain_limit = sched->drain_min;
+                sched->draining = true;
+                sched->ramp_interval = jitter(sched, TM_RETRY_RAMP_INTERVAL);
+        }
+}
+
+void retry_sched_failure(struct retry_sched *sched, time_t now)
+{
+        int delay = TM_RETRY_BASE_DELAY;
+
+        if (sched->state == RETRY_OPEN) {
+                /* Started before the breaker opened, not another attempt */
+                return;
+        }
+
+        sched->failures++;
+        for (int i = 1; i < sched->failures && delay < TM_RETRY_MAX_DELAY; i++) {
+                delay *= 2;
+        }
+        if (delay > TM_RETRY_MAX_DELAY) {
+                delay = TM_RETRY_MAX_DELAY;
+        }
+        delay = jitter(sched, delay);
+
+        sched->state = RETRY_OPEN;
+        sched->probing = false;
+        sched->retry_at = now + delay;
+        telem_log(LOG_INFO, "Record delivery failed, will retry in %d seconds\n",
+                  delay);
+}
+
+/* vi: set ts=8 sw=8 sts=4 et tw=80 cino=(0: */
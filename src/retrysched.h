@@ -0,0 +1,167 @@
+/*
+ * This program is part of the Clear Linux Project
+ *
+ * Copyright 2018 Intel Corporation
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms and conditions of the GNU Lesser General Public License, as
+ * published by the Free Software Foundation; either version 2.1 of the License,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU Lesser General Public License for more
+ * details.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+
+/*
+ * When telempostd talks to the server, with a circuit breaker:
+ *
+ * - closed: records are sent. Spool passes send up to drain_limit records.
+ * - open: a POST failed, records go to the spool without being sent until
+ *   retry_at. The delay doubles with every failed attempt, from
+ *   TM_RETRY_BASE_DELAY up to TM_RETRY_MAX_DELAY, and is jittered so that a
+ *   fleet of clients does not retry in lockstep once the server recovers.
+ * - half open: the delay elapsed, a single record is sent to probe the
+ *   server. The breaker closes with the smallest drain limit if the probe
+ *   is sent, and opens again otherwise.
+ *
+ * The drain limit adapts to the server, between spool_drain_min_records and
+ * spool_drain_max_records: it doubles after a pass that sent all of it, and
+ * is halved after a pass of which the POSTs took more than
+ * TM_RETRY_SLOW_POST milliseconds on average. While a pass sent all of its
+ * limit and records are left in the spool, the next pass runs
+ * TM_RETRY_RAMP_INTERVAL seconds later, jittered when the breaker closes,
+ * instead of after spool_process_time.
+ */
+
+#define TM_RETRY_BASE_DELAY 5
+#define TM_RETRY_MAX_DELAY TM_SPOOL_RUN_MAX
+#define TM_RETRY_RAMP_INTERVAL 10
+#define TM_RETRY_SLOW_POST 2000
+
+enum retry_state {
+        RETRY_CLOSED = 0,
+        RETRY_OPEN,
+        RETRY_HALF_OPEN
+};
+
+struct retry_sched {
+        enum retry_state state;
+        /* failed attempts since the breaker last closed */
+        int failures;
+        /* when an open breaker lets a probe through */
+        time_t retry_at;
+        /* the probe of a half open breaker is being sent */
+        bool probing;
+        /* records a spool pass sends while the breaker is closed */
+        int drain_limit;
+        int drain_min;
+        int drain_max;
+        /* the last pass sent its whole limit, the spool is being drained */
+        bool draining;
+        /* seconds between spool passes while draining */
+        int ramp_interval;
+        unsigned int seed;
+};
+
+/**
+ * Initializes a closed breaker, with a drain limit of
+ * TM_SPOOL_MAX_SEND_RECORDS within the bounds
+ *
+ * @param sched The scheduler
+ * @param seed Seed of the jitter
+ * @param drain_min Smallest drain limit
+ * @param drain_max Largest drain limit, at least drain_min
+ */
+void retry_sched_init(struct retry_sched *sched, unsigned int seed,
+                      int drain_min, int drain_max);
+
+/**
+ * Changes the bounds of the drain limit, the limit itself is kept if
+ * within the new bounds
+ *
+ * @param sched The scheduler
+ * @param drain_min Smallest drain limit
+ * @param drain_max Largest drain limit, at least drain_min
+ */
+void retry_sched_set_drain_bounds(struct retry_sched *sched, int drain_min,
+                                  int drain_max);
+
+/**
+ * Checks whether a record may be sent now. With a half open breaker, the
+ * first record asking is the probe.
+ *
+ * @param sched The scheduler
+ * @param now Current time
+ *
+ * @return true if the record can be sent, false to spool it
+ */
+bool retry_sched_allow(struct retry_sched *sched, time_t now);
+
+/**
+ * Gets the number of records or batches a spool pass may send now. With a
+ * half open breaker, the pass sends the probe.
+ *
+ * @param sched The scheduler
+ * @param now Current time
+ *
+ * @return the limit, 0 if the pass should not send anything
+ */
+int retry_sched_pass_limit(struct retry_sched *sched, time_t now);
+
+/**
+ * Gives back the probe of a half open breaker, for a record that was let
+ * through but not sent after all
+ *
+ * @param sched The scheduler
+ */
+void retry_sched_cancel(struct retry_sched *sched);
+
+/**
+ * Gets when the next spool pass should run. Without records in the spool,
+ * an open breaker is probed by the next record received instead.
+ *
+ * @param sched The scheduler
+ * @param last_pass When the last spool pass ran
+ * @param interval Seconds between spool passes, spool_process_time
+ * @param backlog true if records are left in the spool
+ *
+ * @return the time of the next pass
+ */
+time_t retry_sched_next_pass(struct retry_sched *sched, time_t last_pass,
+                             int interval, bool backlog);
+
+/**
+ * Adapts the drain limit after a spool pass
+ *
+ * @param sched The scheduler
+ * @param limit Limit the pass was started with
+ * @param sent Records or batches the pass sent
+ * @param elapsed Milliseconds the pass took
+ */
+void retry_sched_pass_done(struct retry_sched *sched, int limit, int sent,
+                           int64_t elapsed);
+
+/**
+ * Records a record sent
+ *
+ * @param sched The scheduler
+ */
+void retry_sched_success(struct retry_sched *sched);
+
+/**
+ * Records a failed POST, which opens the breaker unless it is already open
+ *
+ * @param sched The scheduler
+ * @param now Current time
+ */
+void retry_sched_failure(struct retry_sched *sched, time_t now);
+
+/* vi: set ts=8 sw=8 sts=4 et tw=80 cino=(0: */
@@ -0,0 +1,397 @@
+/*
+ * This program is part of the Clear Linux Project
+ *
+ * Copyright 2018 Intel Corporation
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms and conditions of the GNU Lesser General Public License, as
+ * published by the Free Software Foundation; either version 2.1 of the License,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU Lesser General Public License for more
+ * details.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include "config.h"
+#ifdef HAVE_SYS_EVENTFD_H
+#include <sys/eventfd.h>
+#endif
+#include "ringbuf.h"
+#include "configuration.h"
+#include "log.h"
+
+#define RING_ROUND_UP(n) (((n) + RING_ALIGN - 1) & ~((size_t)RING_ALIGN - 1))
+
+void ring_init(struct tm_ring *ring)
+{
+        ring->header = NULL;
+        ring->data = NULL;
+        ring->map_size = 0;
+        ring->memfd = -1;
+        ring->eventfd = -1;
+}
+
+static int ring_mmap(struct tm_ring *ring, size_t map_size)
+{
+        void *map;
+
+        map = mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                   ring->memfd, 0);
+        if (map == MAP_FAILED) {
+                return -errno;
+        }
+
+        ring->header = (struct ring_header *)map;
+        ring->data = (char *)map + sizeof(struct ring_header);
+        ring->map_size = map_size;
+
+        return 0;
+}
+
+int ring_create(struct tm_ring *ring, size_t capacity)
+{
+#if defined(HAVE_MEMFD_CREATE) && defined(HAVE_SYS_EVENTFD_H)
+        size_t map_size;
+        int ret;
+
+        capacity = RING_ROUND_UP(capacity);
+        map_size = sizeof(struct ring_header) + capacity;
+
+        ring->memfd = memfd_create("telemetry-ring", MFD_CLOEXEC);
+        if (ring->memfd < 0) {
+                ret = -errno;
+                goto fail;
+        }
+        if (ftruncate(ring->memfd, (off_t)map_size) != 0) {
+                ret = -errno;
+                goto fail;
+        }
+        if ((ret = ring_mmap(ring, map_size)) < 0) {
+                goto fail;
+        }
+
+        ring->eventfd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+        if (ring->eventfd < 0) {
+                ret = -errno;
+                goto fail;
+        }
+
+        ring->header->capacity = capacity;
+        ring->header->head = 0;
+        ring->header->tail = 0;
+        __atomic_store_n(&ring->header->magic, RING_MAGIC, __ATOMIC_RELEASE);
+
+        return 0;
+fail:
+        ring_destroy(ring);
+        return ret;
+#else
+        return -ENOSYS;
+#endif
+}
+
+int ring_map(struct tm_ring *ring, int memfd, int eventfd)
+{
+        struct ring_header header;
+        struct stat sb;
+        int ret;
+
+        if (fstat(memfd, &sb) != 0) {
+                return -errno;
+        }
+        if ((size_t)sb.st_size < sizeof(header) ||
+            pread(memfd, &header, sizeof(header), 0) != sizeof(header)) {
+                return -EINVAL;
+        }
+        if (header.magic != RING_MAGIC || header.capacity % RING_ALIGN != 0 ||
+            header.capacity > (uint64_t)sb.st_size - sizeof(header)) {
+                return -EINVAL;
+        }
+
+        ring->memfd = memfd;
+        if ((ret = ring_mmap(ring, sizeof(header) + header.capacity)) < 0) {
+                ring->memfd = -1;
+                return ret;
+        }
+        ring->eventfd = eventfd;
+
+        return 0;
+}
+
+void ring_destroy(struct tm_ring *ring)
+{
+        if (ring->header) {
+                munmap(ring->header, ring->map_size);
+        }
+        if (ring->memfd >= 0) {
+                close(ring->memfd);
+        }
+        if (ring->eventfd >= 0) {
+                close(ring->eventfd);
+        }
+        ring_init(ring);
+}
+
+int ring_push(struct tm_ring *ring, const char *data, size_t size)
+{
+        struct ring_header *header = ring->header;
+        uint64_t capacity = header->capacity;
+        uint64_t head, tail, pos, to_end, needed;
+        size_t total = RING_ROUND_UP(sizeof(struct ring_entry) + size);
+        struct ring_entry *entry;
+        uint64_t one = 1;
+
+        if (total > capacity / 2) {
+                return -EMSGSIZE;
+        }
+
+        head = header->head;
+        tail = __atomic_load_n(&header->tail, __ATOMIC_ACQUIRE);
+        pos = head % capacity;
+        to_end = capacity - pos;
+
+        /* A record is never split, skip to the start of the ring instead */
+        needed = (to_end < total) ? to_end + total : total;
+        if (head - tail > capacity - needed) {
+                return -ENOBUFS;
+        }
+
+        if (to_end < total) {
+                entry = (struct ring_entry *)(ring->data + pos);
+                entry->size = 0;
+                entry->flags = RING_ENTRY_WRAP;
+                entry->timestamp = 0;
+                head += to_end;
+                pos = 0;
+        }
+
+        entry = (struct ring_entry *)(ring->data + pos);
+        entry->size = (uint32_t)size;
+        entry->flags = 0;
+        entry->timestamp = (int64_t)time(NULL);
+        memcpy(ring->data + pos + sizeof(*entry), data, size);
+
+        /* Publish the record only once it is complete */
+        __atomic_store_n(&header->head, head + total, __ATOMIC_RELEASE);
+
+        if (ring->eventfd >= 0 && write(ring->eventfd, &one, sizeof(one)) < 0 &&
+            errno != EAGAIN) {
+                telem_perror("Unable to notify record ring consumer");
+        }
+
+        return 0;
+}
+
+int ring_drain(struct tm_ring *ring, ring_record_fn fn, void *arg)
+{
+        struct ring_header *header = ring->header;
+        uint64_t capacity = header->capacity;
+        uint64_t head, tail;
+        uint64_t count;
+        int records = 0;
+
+        /* Clear the notifications, the ring itself tells what is left */
+        if (ring->eventfd >= 0 && read(ring->eventfd, &count, sizeof(count)) < 0 &&
+            errno != EAGAIN) {
+                telem_perror("Unable to read record ring notification");
+        }
+
+        tail = header->tail;
+        head = __atomic_load_n(&header->head, __ATOMIC_ACQUIRE);
+
+        while (tail != head) {
+                uint64_t pos = tail % capacity;
+                struct ring_entry entry;
+                char *data;
+
+                memcpy(&entry, ring->data + pos, sizeof(entry));
+                if (entry.flags & RING_ENTRY_WRAP) {
+                        tail += capacity - pos;
+                        continue;
+                }
+
+                if (entry.size > capacity - pos - sizeof(entry) ||
+                    head - tail < sizeof(entry) + entry.size) {
+                        telem_log(LOG_ERR, "Corrupted record ring, dropping %" PRIu64
+                                  " bytes\n", head - tail);
+                        tail = head;
+                        break;
+                }
+
+                data = malloc(entry.size + 1);
+                if (!data) {
+                        telem_log(LOG_ERR, "Unable to allocate memory, exiting\n");
+                        exit(EXIT_FAILURE);
+                }
+                memcpy(data, ring->data + pos + sizeof(entry), entry.size);
+                data[entry.size] = '\0';
+
+                /* Give the space back before the record is processed */
+                tail += RING_ROUND_UP(sizeof(entry) + entry.size);
+                __atomic_store_n(&header->tail, tail, __ATOMIC_RELEASE);
+
+                fn(data, entry.size, (time_t)entry.timestamp, arg);
+                free(data);
+                records++;
+
+                if (tail == head) {
+                        head = __atomic_load_n(&header->head, __ATOMIC_ACQUIRE);
+                }
+        }
+        __atomic_store_n(&header->tail, tail, __ATOMIC_RELEASE);
+
+        return records;
+}
+
+char *ring_socket_path(void)
+{
+        char *path = NULL;
+
+        if (asprintf(&path, "%s%s", socket_path_config(), RING_SOCKET_SUFFIX) < 0) {
+                return NULL;
+        }
+
+        return path;
+}
+
+int ring_send_fds(int sockfd, struct tm_ring *ring)
+{
+        struct msghdr msg = { 0 };
+        struct cmsghdr *cmsg;
+        union {
+                char buf[CMSG_SPACE(2 * sizeof(int))];
+                struct cmsghdr align;
+        } control;
+        int fds[2] = { ring->memfd, ring->eventfd };
+        char byte = 0;
+        struct iovec iov = { .iov_base = &byte, .iov_len = 1 };
+
+        memset(&control, 0, sizeof(control));
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control.buf;
+        msg.msg_controllen = sizeof(control.buf);
+
+        cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+        memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+        if (sendmsg(sockfd, &msg, MSG_NOSIGNAL) != 1) {
+                return -errno;
+        }
+
+        return 0;
+}
+
+static int ring_recv_fds(int sockfd, int fds[2])
+{
+        struct msghdr msg = { 0 };
+        struct cmsghdr *cmsg;
+        union {
+                char buf[CMSG_SPACE(2 * sizeof(int))];
+                struct cmsghdr align;
+        } control;
+        char byte;
+        struct iovec iov = { .iov_base = &byte, .iov_len = 1 };
+        ssize_t len;
+
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control.buf;
+        msg.msg_controllen = sizeof(control.buf);
+
+        len = recvmsg(sockfd, &msg, MSG_CMSG_CLOEXEC);
+        if (len < 0) {
+                return -errno;
+        }
+
+        cmsg = CMSG_FIRSTHDR(&msg);
+        if (len != 1 || !cmsg || cmsg->cmsg_level != SOL_SOCKET ||
+            cmsg->cmsg_type != SCM_RIGHTS ||
+            cmsg->cmsg_len != CMSG_LEN(2 * sizeof(int))) {
+                if (cmsg && cmsg->cmsg_type == SCM_RIGHTS) {
+                        size_t n = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+
+                        for (size_t i = 0; i < n; i++) {
+                                close(((int *)CMSG_DATA(cmsg))[i]);
+                        }
+                }
+                return -EPROTO;
+        }
+        memcpy(fds, CMSG_DATA(cmsg), 2 * sizeof(int));
+
+        return 0;
+}
+
+int ring_connect(struct tm_ring *ring)
+{
+        struct sockaddr_un addr;
+        struct ucred cred;
+        socklen_t len = sizeof(cred);
+        char *path = NULL;
+        int fds[2];
+        int sockfd;
+        int ret;
+
+        path = ring_socket_path();
+        if (!path) {
+                return -ENOMEM;
+        }
+
+        sockfd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (sockfd < 0) {
+                ret = -errno;
+                goto out;
+        }
+
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+
+        if (connect(sockfd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+                ret = -errno;
+                goto fail;
+        }
+
+        /* Only take a ring from a daemon running as the same user */
+        if (getsockopt(sockfd, SOL_SOCKET, SO_PEERCRED, &cred, &len) != 0 ||
+            cred.uid != getuid()) {
+                ret = -EPERM;
+                goto fail;
+        }
+
+        if ((ret = ring_recv_fds(sockfd, fds)) < 0) {
+                goto fail;
+        }
+        if ((ret = ring_map(ring, fds[0], fds[1])) < 0) {
+                close(fds[0]);
+                close(fds[1]);
+                goto fail;
+        }
+
+        ret = sockfd;
+        goto out;
+fail:
+        close(sockfd);
+out:
+        free(path);
+        return ret;
+}
+
+/* vi: set ts=8 sw=8 sts=4 et tw=80 cino=(0: */
@@ -0,0 +1,172 @@
+/*
+ * This program is part of the Clear Linux Project
+ *
+ * Copyright 2018 Intel Corporation
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms and conditions of the GNU Lesser General Public License, as
+ * published by the Free Software Foundation; either version 2.1 of the License,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU Lesser General Public License for more
+ * details.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <time.h>
+
+/*
+ * Record ring: a single producer, single consumer ring of staged records in
+ * a memfd shared by telemprobd (producer) and telempostd (consumer).
+ * telempostd creates the ring and an eventfd, and hands both to telemprobd
+ * over a unix socket at ring_socket_path(). telemprobd writes the eventfd
+ * after each record it pushes. Each record in the ring is framed as:
+ *
+ * <struct ring_entry>
+ * <record data>       : the same layout as a per-file staged record
+ * <padding>           : up to RING_ALIGN bytes
+ *
+ * An entry with RING_ENTRY_WRAP set fills the space up to the end of the
+ * ring, and the next entry starts at offset 0.
+ */
+
+#define RING_MAGIC 0x474e5254   /* "TRNG" */
+#define RING_ALIGN 16
+#define RING_ENTRY_WRAP 0x1
+
+/* Suffix added to socket_path for the socket the ring is handed over */
+#define RING_SOCKET_SUFFIX ".ring"
+
+/* Cache line aligned, so the producer and consumer do not share a line */
+struct ring_header {
+        uint32_t magic;
+        uint32_t reserved;
+        /* size of the data area, a multiple of RING_ALIGN */
+        uint64_t capacity;
+        /* bytes ever written, only stored by the producer */
+        uint64_t head __attribute__((aligned(64)));
+        /* bytes ever read, only stored by the consumer */
+        uint64_t tail __attribute__((aligned(64)));
+} __attribute__((aligned(64)));
+
+struct ring_entry {
+        /* size of the record data that follows */
+        uint32_t size;
+        uint32_t flags;
+        /* time the record was staged */
+        int64_t timestamp;
+};
+
+struct tm_ring {
+        struct ring_header *header;
+        char *data;
+        size_t map_size;
+        int memfd;
+        int eventfd;
+};
+
+/**
+ * Callback for records read from the ring
+ *
+ * @param data Record data, null terminated
+ * @param size Size of data, not including the null byte
+ * @param timestamp Time the record was staged
+ * @param arg Argument passed to ring_drain
+ */
+typedef void (*ring_record_fn)(char *data, size_t size, time_t timestamp,
+                               void *arg);
+
+/**
+ * Initializes a ring that is not mapped, so ring_destroy() can be called on
+ * it at any time
+ *
+ * @param ring The ring
+ */
+void ring_init(struct tm_ring *ring);
+
+/**
+ * Creates a new ring and its eventfd
+ *
+ * @param ring The ring, initialized with ring_init()
+ * @param capacity Size of the data area in bytes
+ *
+ * @return 0 on success, or a negative errno-style value on error
+ */
+int ring_create(struct tm_ring *ring, size_t capacity);
+
+/**
+ * Maps a ring created by another process
+ *
+ * @param ring The ring, initialized with ring_init()
+ * @param memfd Memory file of the ring, owned by the ring on success
+ * @param eventfd Eventfd of the ring, owned by the ring on success
+ *
+ * @return 0 on success, or a negative errno-style value on error
+ */
+int ring_map(struct tm_ring *ring, int memfd, int eventfd);
+
+/**
+ * Unmaps the ring and closes its file descriptors
+ *
+ * @param ring The ring
+ */
+void ring_destroy(struct tm_ring *ring);
+
+/**
+ * Pushes a record and notifies the consumer
+ *
+ * @param ring The ring
+ * @param data Record data
+ * @param size Size of data
+ *
+ * @return 0 on success, -ENOBUFS if the ring is full, or -EMSGSIZE if the
+ *     record can never fit
+ */
+int ring_push(struct tm_ring *ring, const char *data, size_t size);
+
+/**
+ * Reads all records in the ring, and calls fn for each of them. The space of
+ * a record is released before fn is called.
+ *
+ * @param ring The ring
+ * @param fn Function called for each record
+ * @param arg Argument passed to fn
+ *
+ * @return the number of records read
+ */
+int ring_drain(struct tm_ring *ring, ring_record_fn fn, void *arg);
+
+/**
+ * Gets the path of the socket the ring is handed over
+ *
+ * @return a newly allocated path, or NULL if out of memory
+ */
+char *ring_socket_path(void);
+
+/**
+ * Sends the ring file descriptors over a connected unix socket
+ *
+ * @param sockfd The socket
+ * @param ring The ring
+ *
+ * @return 0 on success, or a negative errno-style value on error
+ */
+int ring_send_fds(int sockfd, struct tm_ring *ring);
+
+/**
+ * Connects to the ring socket and maps the ring received on it
+ *
+ * @param ring The ring, initialized with ring_init()
+ *
+ * @return the connected socket on success, which is closed by the peer when
+ *     it drops the ring, or a negative errno-style value on error
+ */
+int ring_connect(struct tm_ring *ring);
+
+/* vi: set ts=8 sw=8 sts=4 et tw=80 cino=(0: */
@@ -0,0 +1,214 @@
+/*
+ * This program is part of the Clear Linux Project
+ *
+ * Copyright 2019 Intel Corporation
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms and conditions of the GNU Lesser General Public License, as
+ * published by the Free Software Foundation; either version 2.1 of the License,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU Lesser General Public License for more
+ * details.
+ */
+
+#define _GNU_SOURCE
+#include <ctype.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "common.h"
+#include "configuration.h"
+#include "log.h"
+#include "sampling.h"
+
+/* Rates parsed from the class_sample_rates value they were parsed from, which
+ * changes when the configuration is reloaded */
+static char *parsed_spec = NULL;
+static NcHashmap *rates = NULL;
+static pthread_mutex_t rates_lock = PTHREAD_MUTEX_INITIALIZER;
+
+void *class_prefix_get(NcHashmap *map, const char *classification, size_t len)
+{
+        char key[MAX_CLASS_LENGTH + 1];
+        void *value = NULL;
+
+        /* The classification itself, then its prefixes from the longest */
+        if (len <= MAX_CLASS_LENGTH) {
+                memcpy(key, classification, len);
+                key[len] = '\0';
+                value = nc_hashmap_get(map, key);
+        } else {
+                len = MAX_CLASS_LENGTH;
+                memcpy(key, classification, len);
+                key[len] = '\0';
+        }
+        while (!value && len > 0) {
+                while (len > 0 && key[len - 1] != '/') {
+                        len--;
+                }
+                if (len > 1) {
+                        key[--len] = '\0';
+                        value = nc_hashmap_get(map, key);
+                } else {
+                        len = 0;
+                }
+        }
+
+        return value;
+}
+
+/* Parses a prefix:N entry, invalid entries are left out */
+static void add_rate(NcHashmap *map, char *entry)
+{
+        char *rate;
+        char *end = NULL;
+        char *key;
+        long n;
+        size_t len;
+
+        while (isspace(*entry)) {
+                entry++;
+        }
+        len = strlen(entry);
+        while (len > 0 && isspace(entry[len - 1])) {
+                entry[--len] = '\0';
+        }
+        if (len == 0) {
+                return;
+        }
+
+        rate = strchr(entry, ':');
+        if (!rate || rate == entry) {
+                telem_log(LOG_WARNING, "Invalid class_sample_rates entry: %s\n", entry);
+                return;
+        }
+        *rate++ = '\0';
+        errno = 0;
+        n = strtol(rate, &end, 10);
+        if (errno != 0 || end == rate || *end != '\0' || n <= 0 || n > INT32_MAX) {
+                telem_log(LOG_WARNING, "Invalid class_sample_rates entry: %s\n", entry);
+                return;
+        }
+
+        len = strlen(entry);
+        while (len > 1 && entry[len - 1] == '/') {
+                entry[--len] = '\0';
+        }
+        if (len > MAX_CLASS_LENGTH || n == 1) {
+                return;
+        }
+        key = strdup(entry);
+        if (!key || !nc_hashmap_put(map, key, NC_HASH_VALUE(n))) {
+                free(key);
+        }
+}
+
+/* Parses the rates again if class_sample_rates changed, under rates_lock */
+static void update_rates(void)
+{
+        const char *spec = class_sample_rates_config();
+        char *list, *entry, *saveptr = NULL;
+
+        if (parsed_spec && strcmp(parsed_spec, spec) == 0) {
+                return;
+        }
+        free(parsed_spec);
+        parsed_spec = strdup(spec);
+        if (rates) {
+                nc_hashmap_free(rates);
+                rates = NULL;
+        }
+        if (!parsed_spec || spec[0] == '\0') {
+                return;
+        }
+
+        list = strdup(spec);
+        rates = nc_hashmap_new_full(nc_string_hash, nc_string_compare, free, NULL);
+        if (!list || !rates) {
+                free(list);
+                return;
+        }
+        for (entry = strtok_r(list, ",", &saveptr); entry;
+             entry = strtok_r(NULL, ",", &saveptr)) {
+                add_rate(rates, entry);
+        }
+        free(list);
+}
+
+/* Gets the value of a header line, without copying it */
+static const char *header_value(const char *header, size_t *len)
+{
+        const char *value = header ? strchr(header, ':') : NULL;
+
+        if (!value) {
+                *len = 0;
+                return "";
+        }
+        value++;
+        while (*value == ' ') {
+                value++;
+        }
+        *len = strcspn(value, "\r\n");
+
+        return value;
+}
+
+long record_sample_rate(char *const headers[])
+{
+        const char *classification;
+        size_t len;
+        long rate = 1;
+
+        classification = header_value(headers[TM_CLASSIFICATION], &len);
+
+        pthread_mutex_lock(&rates_lock);
+        update_rates();
+        if (rates) {
+                void *value = class_prefix_get(rates, classification, len);
+
+                if (value) {
+                        rate = (long)NC_UNHASH_VALUE(value);
+                }
+        }
+        pthread_mutex_unlock(&rates_lock);
+
+        return rate;
+}
+
+/* FNV-1a, continued from hash */
+static uint64_t hash_bytes(uint64_t hash, const char *data, size_t len)
+{
+        for (size_t i = 0; i < len; i++) {
+                hash ^= (unsigned char)data[i];
+                hash *= 1099511628211ULL;
+        }
+
+        return hash;
+}
+
+bool record_sampled_out(char *const headers[])
+{
+        long rate = record_sample_rate(headers);
+        uint64_t hash = 14695981039346656037ULL;
+        const char *value;
+        size_t len;
+
+        if (rate <= 1) {
+                return false;
+        }
+
+        value = header_value(headers[TM_EVENT_ID], &len);
+        hash = hash_bytes(hash, value, len);
+        value = header_value(headers[TM_TIMESTAMP], &len);
+        hash = hash_bytes(hash, value, len);
+
+        return hash % (uint64_t)rate != 0;
+}
+
+/* vi: set ts=8 sw=8 sts=4 et tw=80 cino=(0: */
@@ -0,0 +1,72 @@
+/*
+ * This program is part of the Clear Linux Project
+ *
+ * Copyright 2019 Intel Corporation
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms and conditions of the GNU Lesser General Public License, as
+ * published by the Free Software Foundation; either version 2.1 of the License,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU Lesser General Public License for more
+ * details.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "nica/hashmap.h"
+
+/*
+ * Sampling of classifications, from class_sample_rates: one record in N of
+ * the classifications starting with a prefix is kept, the longest matching
+ * prefix applies as for class_rate_limits. libtelemetry drops the other
+ * records before connecting to telemprobd, and telempostd drops those that
+ * were created elsewhere, such as the heartbeat of telemprobd.
+ *
+ * Whether a record is kept only depends on its event_id and
+ * creation_timestamp headers, so each stage keeps the same records and a
+ * record is not sampled again on its way. The records sent carry their
+ * sample rate in a SAMPLE_RATE_HEADER, for the server to weigh them by.
+ */
+#define SAMPLE_RATE_HEADER "X-Telemetry-Sample-Rate"
+
+/**
+ * Gets the value of the entry of the longest prefix of a classification in
+ * a map keyed by classification prefixes, compared component by component:
+ * org.clearlinux/journal applies to org.clearlinux/journal/error, but not
+ * to org.clearlinux/journalx/error
+ *
+ * @param map The map, with prefixes without a trailing slash
+ * @param classification The classification
+ * @param len Length of classification
+ *
+ * @return the value, or NULL if no prefix matches
+ */
+void *class_prefix_get(NcHashmap *map, const char *classification, size_t len);
+
+/**
+ * Gets the sample rate of a record from the configuration
+ *
+ * @param headers The NUM_HEADERS header lines of the record, terminated by
+ *     a newline or a null byte
+ *
+ * @return N if one record in N of its classification is kept, 1 if all are
+ */
+long record_sample_rate(char *const headers[]);
+
+/**
+ * Checks whether a record is left out by sampling
+ *
+ * @param headers The NUM_HEADERS header lines of the record, terminated by
+ *     a newline or a null byte
+ *
+ * @return true if the record is dropped
+ */
+bool record_sampled_out(char *const headers[]);
+
+/* vi: set ts=8 sw=8 sts=4 et tw=80 cino=(0: */
@@ -22,20 +22,29 @@
 #include <dirent.h>
 #include <unistd.h>
 #include <sys/stat.h>
+#include <fcntl.h>
 #include <limits.h>
 #include <stdbool.h>
 #include <errno.h>
 
 #include "spool.h"
+#include "iorecord.h"
+#include "recordio.h"
+#include "recordtrace.h"
 #include "telempostdaemon.h"
 #include "log.h"
 #include "configuration.h"
 #include "util.h"
 #include "common.h"
+#include "nica/hashmap.h"
+
+/* Bytes read from a spooled record to find its priority, without the body */
+#define SPOOL_HEADERS_READ 4096
 
 int directory_filter(const struct dirent *entry)
 {
-        if ((strcmp(entry->d_name, ".") == 0) || (strcmp(entry->d_name, "..") == 0)) {
+        /* Skips . and .., and the staging log and shard directories */
+        if (entry->d_name[0] == '.') {
                 return 0;
         } else {
                 return 1;
@@ -72,293 +81,774 @@ bool is_spool_valid()
         return true;
 }
 
-long get_spool_dir_size()
+void spool_index_init(struct spool_index *index)
 {
-        long dir_size = get_directory_size(spool_dir_config());
-        if (dir_size == -ENOMEM) {
-                exit(EXIT_FAILURE);
+        memset(index, 0, sizeof(struct spool_index));
+}
+
+static bool spool_entry_before(struct spool_entry *a, struct spool_entry *b)
+{
+        time_t a_time = a->mtime - (time_t)a->priority * TM_PRIORITY_AGING;
+        time_t b_time = b->mtime - (time_t)b->priority * TM_PRIORITY_AGING;
+
+        if (a_time != b_time) {
+                return a_time < b_time;
         }
-        return dir_size;
+        return a->seq < b->seq;
 }
 
-void spool_records_loop(long *current_spool_size)
+void spool_index_push(struct spool_index *index, struct spool_entry *entry)
 {
-        const char *spool_dir_path;
-        int numentries;
-        struct dirent **namelist;
-        int records_processed = 0;
-        int records_sent = 0;
+        struct spool_entry *entries;
+        size_t i;
 
-        spool_dir_path = spool_dir_config();
-        numentries = scandir(spool_dir_path, &namelist, directory_filter, NULL);
+        if (index->count == index->alloc) {
+                size_t n = index->alloc ? index->alloc * 2 : 64;
 
-        if (numentries == 0) {
-                telem_log(LOG_DEBUG, "No entries in spool\n");
-                return;
-        } else if (numentries < 0) {
-                telem_perror("Error while scanning spool");
-                return;
+                entries = realloc(index->entries, n * sizeof(struct spool_entry));
+                if (!entries) {
+                        telem_log(LOG_ERR, "Unable to allocate memory, exiting\n");
+                        exit(EXIT_FAILURE);
+                }
+                index->entries = entries;
+                index->alloc = n;
+        }
+        entries = index->entries;
+
+        /* Sift up from the last slot */
+        i = index->count++;
+        while (i > 0 && spool_entry_before(entry, &entries[(i - 1) / 2])) {
+                entries[i] = entries[(i - 1) / 2];
+                i = (i - 1) / 2;
         }
+        entries[i] = *entry;
+}
 
-        qsort_r(namelist, (size_t)numentries, sizeof(struct dirent *),
-                spool_record_compare, (void *)spool_dir_path);
+void spool_index_add(struct spool_index *index, const char *path, time_t mtime,
+                     long disk_size, int priority)
+{
+        struct spool_entry entry;
+        const char *name = strrchr(path, '/');
 
-        for (int i = 0; i < numentries; i++) {
-                telem_log(LOG_DEBUG, "Processing spool record: %s\n",
-                          namelist[i]->d_name);
-                process_spooled_record(spool_dir_path, namelist[i]->d_name,
-                                       &records_processed, &records_sent, current_spool_size);
+        entry.name = strdup(name ? name + 1 : path);
+        if (!entry.name) {
+                telem_log(LOG_ERR, "Unable to allocate memory, exiting\n");
+                exit(EXIT_FAILURE);
+        }
+        entry.mtime = mtime;
+        entry.disk_size = disk_size;
+        entry.priority = priority;
+        entry.seq = index->seq++;
+        spool_index_push(index, &entry);
+}
 
-                /* If the first send attempt fails, we assume that future send
-                 * attempts may also fail, so abort early.
-                 */
-                if (records_sent == 0) {
-                        break;
-                }
+bool spool_index_pop(struct spool_index *index, struct spool_entry *entry)
+{
+        struct spool_entry *entries = index->entries;
+        struct spool_entry last;
+        size_t i = 0;
+
+        if (index->count == 0) {
+                return false;
+        }
+        *entry = entries[0];
+        last = entries[--index->count];
 
-                if (records_processed == TM_SPOOL_MAX_PROCESS_RECORDS) {
+        /* Sift the last entry down from the root */
+        while (2 * i + 1 < index->count) {
+                size_t child = 2 * i + 1;
+
+                if (child + 1 < index->count &&
+                    spool_entry_before(&entries[child + 1], &entries[child])) {
+                        child++;
+                }
+                if (!spool_entry_before(&entries[child], &last)) {
                         break;
                 }
+                entries[i] = entries[child];
+                i = child;
+        }
+        entries[i] = last;
+
+        return true;
+}
+
+void spool_index_free(struct spool_index *index)
+{
+        for (size_t i = 0; i < index->count; i++) {
+                free(index->entries[i].name);
+        }
+        free(index->entries);
+        spool_index_init(index);
+}
+
+long spool_index_disk_size(const struct spool_index *index)
+{
+        long size = 0;
+
+        for (size_t i = 0; i < index->count; i++) {
+                size += index->entries[i].disk_size;
+        }
+
+        return size;
+}
+
+/* Reads the priority class of a spooled record from its headers */
+static int spool_file_priority(const char *record_name)
+{
+        char buf[SPOOL_HEADERS_READ];
+        ssize_t len;
+        int fd;
+
+        fd = open(record_name, O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+                return 0;
+        }
+        len = read(fd, buf, sizeof(buf));
+        close(fd);
+
+        return len > 0 ? record_data_priority(buf, (size_t)len) : 0;
+}
+
+int spool_index_rebuild(struct spool_index *index, const char *spool_dir)
+{
+        struct dirent **namelist;
+        int numentries;
+        int ret = 0;
+
+        spool_index_free(index);
+
+        numentries = scandir(spool_dir, &namelist, directory_filter, NULL);
+        if (numentries < 0) {
+                return -errno;
         }
 
         for (int i = 0; i < numentries; i++) {
+                struct stat buf;
+                char *record_name;
+
+                if (asprintf(&record_name, "%s/%s", spool_dir, namelist[i]->d_name) == -1) {
+                        telem_log(LOG_ERR, "Unable to allocate memory for"
+                                  " record name in spool, exiting\n");
+                        exit(EXIT_FAILURE);
+                }
+                if (stat(record_name, &buf) == 0 && S_ISREG(buf.st_mode)) {
+                        if (buf.st_uid != getuid()) {
+                                /* Not ours, it would never be sent */
+                                unlink(record_name);
+                        } else {
+                                spool_index_add(index, namelist[i]->d_name,
+                                                buf.st_mtime, buf.st_blocks * 512,
+                                                spool_file_priority(record_name));
+                                ret++;
+                        }
+                }
+                free(record_name);
                 free(namelist[i]);
         }
         free(namelist);
+
+        return ret;
 }
 
-void process_spooled_record(const char *spool_dir, char *name,
-                            int *records_processed, int *records_sent,
-                            long *current_spool_size)
+int spool_index_reconcile(struct spool_index *index, struct spool_index *added,
+                          const char *spool_dir)
 {
-        char *record_name;
-        int ret;
-        struct stat buf;
-        time_t current_time = time(NULL);
-        bool post_succeeded = true;
+        struct spool_index kept;
+        struct dirent **namelist;
+        NcHashmap *names;
+        bool *found;
+        int numentries;
+        int ret = 0;
 
-        if (!strcmp(name, ".") || !strcmp(name, "..")) {
-                return;
+        numentries = scandir(spool_dir, &namelist, directory_filter, NULL);
+        if (numentries < 0) {
+                return -errno;
         }
-
-        ret = asprintf(&record_name, "%s/%s", spool_dir, name);
-        if (ret == -1) {
-                telem_log(LOG_ERR, "Unable to allocate memory for"
-                          " record name in spool, exiting\n");
+        names = nc_hashmap_new(nc_string_hash, nc_string_compare);
+        found = calloc(index->count + 1, sizeof(bool));
+        if (!names || !found) {
+                telem_log(LOG_ERR, "Unable to allocate memory, exiting\n");
                 exit(EXIT_FAILURE);
         }
+        for (size_t i = 0; i < index->count; i++) {
+                nc_hashmap_put(names, index->entries[i].name, NC_HASH_VALUE(i + 1));
+        }
 
-        (*records_processed)++;
-        ret = stat(record_name, &buf);
-        if (ret == -1) {
-                telem_perror("Unable to stat record in spool");
+        spool_index_init(&kept);
+        kept.seq = index->seq;
+        for (int i = 0; i < numentries; i++) {
+                size_t n = NC_UNHASH_VALUE(nc_hashmap_get(names, namelist[i]->d_name));
+                struct stat buf;
+                char *record_name;
+
+                /* Indexed files keep their entry, with its order */
+                if (n > 0) {
+                        found[n - 1] = true;
+                        spool_index_push(&kept, &index->entries[n - 1]);
+                        free(namelist[i]);
+                        continue;
+                }
+
+                if (asprintf(&record_name, "%s/%s", spool_dir, namelist[i]->d_name) == -1) {
+                        telem_log(LOG_ERR, "Unable to allocate memory for"
+                                  " record name in spool, exiting\n");
+                        exit(EXIT_FAILURE);
+                }
+                if (stat(record_name, &buf) == 0 && S_ISREG(buf.st_mode)) {
+                        if (buf.st_uid != getuid()) {
+                                unlink(record_name);
+                        } else {
+                                spool_index_add(added, namelist[i]->d_name,
+                                                buf.st_mtime, buf.st_blocks * 512,
+                                                spool_file_priority(record_name));
+                                ret++;
+                        }
+                }
                 free(record_name);
-                return;
+                free(namelist[i]);
+        }
+        free(namelist);
+
+        /* The files that are gone are dropped */
+        for (size_t i = 0; i < index->count; i++) {
+                if (!found[i]) {
+                        free(index->entries[i].name);
+                }
+        }
+        free(index->entries);
+        *index = kept;
+        nc_hashmap_free(names);
+        free(found);
+
+        return ret;
+}
+
+/* A spooled record sent in a batch */
+struct spool_batch_post {
+        char *record_name;
+        struct spool_entry entry;
+        struct spool_usage *usage;
+        /* where the record is put back if it was not sent */
+        struct spool_index *kept;
+        struct record_trace trace;
+};
+
+static void spool_batch_post_done(bool sent, void *arg)
+{
+        struct spool_batch_post *post = (struct spool_batch_post *)arg;
+
+        if (sent) {
+                record_io_unlink(post->record_name);
+                telem_log(LOG_DEBUG, "Spool record %s transmitted\n",
+                          post->record_name);
+                trace_delivered(&post->trace);
+                spool_usage_remove(post->usage, post->entry.disk_size);
+                free(post->entry.name);
+        } else {
+                spool_index_push(post->kept, &post->entry);
+        }
+
+        free(post->record_name);
+        free(post);
+}
+
+/**
+ * Builds the path of a spooled record
+ *
+ * @return the path, exits if out of memory
+ */
+static char *spool_record_path(const char *name)
+{
+        char *record_name;
+
+        if (asprintf(&record_name, "%s/%s", spool_dir_config(), name) == -1) {
+                telem_log(LOG_ERR, "Unable to allocate memory for"
+                          " record name in spool, exiting\n");
+                exit(EXIT_FAILURE);
         }
 
-        /*
-         * If file is a regular file , if uid is diff than process uid
-         * or if mtime is greater than record expiry delete the file
-         */
+        return record_name;
+}
 
+/**
+ * Checks that a spooled record can still be sent, and removes it otherwise.
+ * The record was checked to be a regular file of ours when it was indexed.
+ *
+ * @param record_name Path of the spooled record
+ * @param entry The record in the spool index
+ *
+ * @return true if the record can be sent
+ */
+static bool spool_record_valid(const char *record_name, struct spool_entry *entry,
+                               struct spool_usage *usage)
+{
         if (record_expiry_config() == -1) {
                 telem_log(LOG_ERR, "Invalid record expiry value\n");
                 exit(EXIT_FAILURE);
         }
-        if (!S_ISREG(buf.st_mode) ||
-            (current_time - buf.st_mtime > (record_expiry_config() * 60)) ||
-            (buf.st_uid  != getuid())) {
-                unlink(record_name);
-        } else if (post_succeeded && *records_sent <= TM_SPOOL_MAX_SEND_RECORDS) {
-                transmit_spooled_record(record_name, &post_succeeded, buf.st_size);
+        if (time(NULL) - entry->mtime > (record_expiry_config() * 60)) {
+                record_io_unlink(record_name);
+                spool_usage_remove(usage, entry->disk_size);
+                return false;
+        }
 
-                if (!post_succeeded) {
-                        telem_log(LOG_DEBUG, "Unable to connect to the server\n");
-                } else {
-                        telem_log(LOG_DEBUG, "Spool record %s transmitted\n",
-                                  record_name);
-                        (*records_sent)++;
+        return true;
+}
 
-                        /* if spooled record is sent, deduct from tm_spool_dir_size */
-                        if (*current_spool_size > 0) {
-                                *current_spool_size -= (buf.st_blocks * 512);
-                        }
-                        /*
-                         * If getting the directory size failed earlier due to
-                         * EMFILE/ENFILE, try to calculate again.
-                         * EMFILE - too many file descriptors in use by process
-                         * ENFILE - too many files are open in the system
-                         */
-                        if (*current_spool_size < 0) {
-                                *current_spool_size = get_spool_dir_size();
-                        }
+bool spool_ahead_pop(struct spool_ahead *ahead, struct spool_index *index,
+                     struct spool_entry *entry)
+{
+        if (!record_io_enabled()) {
+                return spool_index_pop(index, entry);
+        }
+
+        while (ahead->count < TM_RECORD_IO_AHEAD) {
+                struct spool_entry *next = &ahead->entries[(ahead->head + ahead->count) %
+                                                           TM_RECORD_IO_AHEAD];
+                char *record_name;
+
+                if (!spool_index_pop(index, next)) {
+                        break;
                 }
+                record_name = spool_record_path(next->name);
+                record_io_prefetch(record_name);
+                free(record_name);
+                ahead->count++;
         }
-        free(record_name);
+        /* Read while the records before are sent */
+        record_io_submit();
+
+        if (ahead->count == 0) {
+                return false;
+        }
+        *entry = ahead->entries[ahead->head];
+        ahead->head = (ahead->head + 1) % TM_RECORD_IO_AHEAD;
+        ahead->count--;
+
+        return true;
 }
 
-void transmit_spooled_record(char *record_path, bool *post_succeeded, long size)
+void spool_ahead_done(struct spool_ahead *ahead, struct spool_index *index)
 {
-        FILE *fp = NULL;
-        char *headers[NUM_HEADERS];
-        char *payload = NULL;
-        int num_headers = 0, k;
-#if (LINE_MAX > PATH_MAX)
-        char line[LINE_MAX+1] = { 0 };
-#else
-        char line[PATH_MAX+1] = { 0 };
-#endif
-        long offset;
-        char *cfg_file = NULL;
-        uint32_t cfg_prefix = 0;
-
-        fp = fopen(record_path, "r");
-        if (fp == NULL) {
-                telem_log(LOG_ERR, "Unable to open file %s in spool\n", record_path);
-                return;
+        while (ahead->count > 0) {
+                spool_index_push(index, &ahead->entries[ahead->head]);
+                ahead->head = (ahead->head + 1) % TM_RECORD_IO_AHEAD;
+                ahead->count--;
         }
+        record_io_drain();
+}
+
+/* Puts back the records a pass kept into the spool index */
+static void spool_index_merge(struct spool_index *index, struct spool_index *kept)
+{
+        struct spool_entry entry;
 
-        // First line optionally contains configuration file path
-        if (fread(&cfg_prefix, CFG_PREFIX_LENGTH, 1, fp) != 1) {
-                telem_log(LOG_ERR, "Error while parsing spooled record configuration info.\n");
-                goto read_error;
+        while (spool_index_pop(kept, &entry)) {
+                spool_index_push(index, &entry);
         }
+        spool_index_free(kept);
+}
 
-        if (cfg_prefix == CFG_PREFIX_32BIT) {
-                size_t pathlen;
-                char *nl;
+/* Gets the current monotonic time in milliseconds */
+static int64_t spool_clock(void)
+{
+        struct timespec now;
 
-                if (!fgets(line, sizeof(line), fp)) {
-                        telem_log(LOG_ERR, "Error while parsing record file\n");
-                        goto read_error;
-                }
+        clock_gettime(CLOCK_MONOTONIC, &now);
 
-                if ((nl = strchr(line, '\n')) != NULL) {
-                        *nl = '\0';
-                }
+        return (int64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
 
-                pathlen = strlen(line);
-                cfg_file = malloc(pathlen + 1);
-                if (cfg_file == NULL) {
-                        telem_log(LOG_ERR, "Could not allocate memory for config file path\n");
-                        goto read_error;
-                }
-                strcpy (cfg_file, line);
-                telem_debug("DEBUG: cfg_file: %s\n", cfg_file);
-        } else {
-                cfg_file = NULL;
-                rewind(fp);
+/* Gets the number of records a pass sending max_sent records processes */
+static int spool_process_limit(int max_sent)
+{
+        return max_sent + TM_SPOOL_MAX_PROCESS_RECORDS - TM_SPOOL_MAX_SEND_RECORDS;
+}
+
+/* Sends a batch of spooled records, and reports the outcome */
+static bool spool_batch_send(struct post_batch *batch, struct retry_sched *sched)
+{
+        if (post_batch_ptr(batch) == 0) {
+                retry_sched_failure(sched, time(NULL));
+                return false;
         }
+        retry_sched_success(sched);
+
+        return true;
+}
+
+/**
+ * Sends the spooled records several per POST. A pass sends at most max_sent
+ * batches, and stops at the first batch of which no record was accepted.
+ * The probe of a half open breaker is a batch of one record.
+ */
+static void spool_records_batch_loop(struct spool_index *index,
+                                     struct retry_sched *sched, int max_sent,
+                                     struct spool_usage *usage)
+{
+        struct post_batch batch;
+        struct spool_ahead ahead = { 0 };
+        struct spool_index kept;
+        struct spool_entry entry;
+        int64_t started = spool_clock();
+        int batches_sent = 0;
+        bool failed = false;
+
+        post_batch_init(&batch, max_sent == 1 ? 1 : batch_post_max_records_config(),
+                        (size_t)batch_post_max_size_config() * 1024,
+                        batch_post_max_time_config());
+        spool_index_init(&kept);
+
+        while (!failed && batches_sent < max_sent &&
+               spool_ahead_pop(&ahead, index, &entry)) {
+                struct staged_record record = { 0 };
+                struct spool_batch_post *post;
+                char *record_name;
+                int ret;
+
+                telem_log(LOG_DEBUG, "Processing spool record: %s\n", entry.name);
+                record_name = spool_record_path(entry.name);
+                if (!spool_record_valid(record_name, &entry, usage) ||
+                    !record_io_read(record_name, &record, NULL)) {
+                        free(entry.name);
+                        free(record_name);
+                        continue;
+                }
 
-        for (num_headers = 0; num_headers < NUM_HEADERS; num_headers++) {
-                const char *header_name = get_header_name(num_headers);
-                if (!fgets(line, sizeof(line), fp)) {
-                        telem_log(LOG_ERR, "Error while parsing record file\n");
-                        goto read_error;
+                post = malloc(sizeof(struct spool_batch_post));
+                if (!post) {
+                        telem_log(LOG_ERR, "Unable to allocate memory, exiting\n");
+                        exit(EXIT_FAILURE);
                 }
-                //Get rid of trailing newline
-                strtok(line, "\n");
-                if (get_header(line, header_name, &headers[num_headers])) {
+                post->record_name = record_name;
+                post->entry = entry;
+                post->usage = usage;
+                post->kept = &kept;
+                trace_retry(&record.trace, record_name);
+                post->trace = record.trace;
+
+                /* Records with another configuration or a streamed payload
+                 * are sent alone */
+                if (record.streamed ||
+                    (record.cfg_file && strcmp(record.cfg_file, get_config_file()) != 0)) {
+                        bool sent = post_record_http(&record);
+                        failed = !sent;
+                        batches_sent++;
+                        if (sent) {
+                                retry_sched_success(sched);
+                        } else {
+                                retry_sched_failure(sched, time(NULL));
+                        }
+                        spool_batch_post_done(sent, post);
+                        free_record(&record);
                         continue;
-                } else {
-                        telem_log(LOG_ERR, "transmit_spooled_record: Incorrect"
-                                  " headers in record\n");
-                        goto read_error;
                 }
-        }
 
-        offset = ftell(fp);
+                ret = post_batch_add(&batch, &record, spool_batch_post_done, post);
+                if (ret == -ENOSPC) {
+                        failed = !spool_batch_send(&batch, sched);
+                        batches_sent++;
+                        ret = post_batch_add(&batch, &record, spool_batch_post_done, post);
+                }
+                if (ret < 0) {
+                        telem_log(LOG_ERR, "Unable to allocate memory, exiting\n");
+                        exit(EXIT_FAILURE);
+                }
+                free_record(&record);
+
+                if (!failed && post_batch_full(&batch)) {
+                        failed = !spool_batch_send(&batch, sched);
+                        batches_sent++;
+                }
+        }
 
-        if (offset == -1) {
-                telem_perror("Failed to get file offset of record payload");
-                goto read_error;
+        if (failed) {
+                telem_log(LOG_DEBUG, "Unable to connect to the server\n");
+                /* Keep the records of the batch for the next pass */
+                post_batch_complete(&batch, false, NULL, 0);
+        } else if (batch.count > 0) {
+                spool_batch_send(&batch, sched);
+                batches_sent++;
+        } else if (batches_sent == 0) {
+                /* Only expired records, the probe was not sent */
+                retry_sched_cancel(sched);
         }
+        retry_sched_pass_done(sched, max_sent, batches_sent,
+                              spool_clock() - started);
+        post_batch_free(&batch);
+        spool_ahead_done(&ahead, index);
+        spool_index_merge(index, &kept);
+}
 
-        size = size - offset + 1;
-        payload = malloc((size_t)size);
+void spool_records_loop(struct spool_index *index, struct retry_sched *sched,
+                        struct spool_usage *usage)
+{
+        struct spool_ahead ahead = { 0 };
+        struct spool_index kept;
+        struct spool_entry entry;
+        int records_processed = 0;
+        int records_sent = 0;
+        int64_t started;
+        int max_sent;
 
-        if (!payload) {
-                telem_log(LOG_ERR, "Could not allocate memory for payload\n");
-                goto read_error;
+        if (index->count == 0) {
+                telem_log(LOG_DEBUG, "No entries in spool\n");
+                return;
         }
-        memset(payload, 0, (size_t)size);
 
-        //read rest of file
-        size_t newlen = fread(payload, sizeof(char), (size_t)size, fp);
-        if (newlen == 0) {
-                telem_perror("Error reading spool file");
-                goto read_error;
+        max_sent = retry_sched_pass_limit(sched, time(NULL));
+        if (max_sent == 0) {
+                telem_log(LOG_DEBUG, "Server unreachable, not processing spool\n");
+                return;
         }
 
-        *post_succeeded = post_record_http(headers, payload, cfg_file);
-        if (*post_succeeded) {
-                unlink(record_path);
+        if (batch_post_enabled_config()) {
+                spool_records_batch_loop(index, sched, max_sent, usage);
+                return;
         }
-read_error:
-        if (payload) {
-                free(payload);
+
+        started = spool_clock();
+        spool_index_init(&kept);
+        while (records_sent < max_sent && spool_ahead_pop(&ahead, index, &entry)) {
+                int sent = records_sent;
+
+                telem_log(LOG_DEBUG, "Processing spool record: %s\n", entry.name);
+
+                /* If a send attempt fails, we assume that future send
+                 * attempts may also fail, so abort early.
+                 */
+                if (!process_spooled_record(&kept, &entry, &records_processed,
+                                            &records_sent, max_sent, usage)) {
+                        retry_sched_failure(sched, time(NULL));
+                        break;
+                }
+                if (records_sent > sent) {
+                        retry_sched_success(sched);
+                }
+
+                if (records_processed == spool_process_limit(max_sent)) {
+                        break;
+                }
         }
+        if (records_processed > 0 && records_sent == 0) {
+                /* Only expired records, the probe was not sent */
+                retry_sched_cancel(sched);
+        }
+        retry_sched_pass_done(sched, max_sent, records_sent,
+                              spool_clock() - started);
+        spool_ahead_done(&ahead, index);
+        spool_index_merge(index, &kept);
+}
+
+bool process_spooled_record(struct spool_index *index, struct spool_entry *entry,
+                            int *records_processed, int *records_sent,
+                            int max_sent, struct spool_usage *usage)
+{
+        char *record_name = spool_record_path(entry->name);
+        bool post_succeeded = true;
+
+        (*records_processed)++;
 
-        if (fp) {
-                fclose(fp);
+        /* If mtime is greater than record expiry delete the file */
+        if (!spool_record_valid(record_name, entry, usage)) {
+                free(entry->name);
+        } else if (*records_sent < max_sent) {
+                transmit_spooled_record(record_name, &post_succeeded, entry->disk_size);
+
+                if (!post_succeeded) {
+                        telem_log(LOG_DEBUG, "Unable to connect to the server\n");
+                        spool_index_push(index, entry);
+                } else {
+                        telem_log(LOG_DEBUG, "Spool record %s transmitted\n",
+                                  record_name);
+                        (*records_sent)++;
+                        spool_usage_remove(usage, entry->disk_size);
+                        free(entry->name);
+                }
+        } else {
+                spool_index_push(index, entry);
         }
+        free(record_name);
+
+        return post_succeeded;
+}
 
-        for (k = 0; k < num_headers; k++) {
-                free(headers[k]);
+void transmit_spooled_record(char *record_path, bool *post_succeeded, long size)
+{
+        struct staged_record record = { 0 };
+
+        if (!record_io_read(record_path, &record, NULL)) {
+                telem_log(LOG_ERR, "transmit_spooled_record: Unable to read"
+                          " record %s\n", record_path);
+                return;
         }
 
-        if (cfg_file) {
-                free(cfg_file);
+        trace_retry(&record.trace, record_path);
+        *post_succeeded = post_record_http(&record);
+        if (*post_succeeded) {
+                record_io_unlink(record_path);
+                trace_delivered(&record.trace);
         }
+
+        free_record(&record);
 }
 
-int spool_record_compare(const void *entrya, const void *entryb, void *path)
+/* A spooled record being sent as part of a spool pass */
+struct spool_post {
+        struct spool_run *run;
+        char *record_name;
+        struct spool_entry entry;
+        struct record_trace trace;
+};
+
+static void spool_run_feed(struct spool_run *run);
+
+void spool_run_init(struct spool_run *run, struct post_multi *posts,
+                    struct spool_index *index, struct retry_sched *sched,
+                    struct spool_usage *usage)
 {
-        int ret;
-        struct stat statentrya, statentryb;
-        char *patha, *pathb;
+        memset(run, 0, sizeof(struct spool_run));
+        run->posts = posts;
+        run->index = index;
+        run->sched = sched;
+        run->usage = usage;
+}
 
-        const struct dirent **direntrya = (const struct dirent **)entrya;
-        const struct dirent **direntryb = (const struct dirent **)entryb;
+static void spool_post_done(bool sent, void *arg)
+{
+        struct spool_post *post = (struct spool_post *)arg;
+        struct spool_run *run = post->run;
+
+        run->pending--;
+        if (!sent) {
+                telem_log(LOG_DEBUG, "Unable to connect to the server\n");
+                /* Assume that the next records will fail too */
+                run->stopped = true;
+                retry_sched_failure(run->sched, time(NULL));
+                spool_index_push(run->index, &post->entry);
+        } else {
+                record_io_unlink(post->record_name);
+                telem_log(LOG_DEBUG, "Spool record %s transmitted\n",
+                          post->record_name);
+                run->sent++;
+                retry_sched_success(run->sched);
+                trace_delivered(&post->trace);
+                spool_usage_remove(run->usage, post->entry.disk_size);
+                free(post->entry.name);
+        }
 
-        const char *dirpath = (const char *)path;
-        ret = asprintf(&patha, "%s/%s", dirpath, (*direntrya)->d_name);
-        if (ret == -1) {
-                telem_log(LOG_ERR, "Unable to allocate memory while sorting, exiting\n");
-                exit(EXIT_FAILURE);
+        free(post->record_name);
+        free(post);
+
+        spool_run_feed(run);
+}
+
+static void spool_run_send(struct spool_run *run, struct spool_entry *entry)
+{
+        struct staged_record record = { 0 };
+        struct spool_post *post;
+        char *record_name = spool_record_path(entry->name);
+
+        run->processed++;
+        if (!spool_record_valid(record_name, entry, run->usage)) {
+                goto out;
         }
 
-        ret = stat(patha, &statentrya);
-        if (ret == -1) {
-                telem_log(LOG_ERR, "Unable to stat %s: %s\n", patha, strerror(errno));
-                free(patha);
-                return 0;
+        if (!record_io_read(record_name, &record, NULL)) {
+                telem_log(LOG_ERR, "spool_run_send: Unable to read"
+                          " record %s\n", record_name);
+                goto out;
         }
 
-        ret = asprintf(&pathb, "%s/%s", dirpath, (*direntryb)->d_name);
-        if (ret == -1) {
-                telem_log(LOG_ERR, "Unable to allocate memory while sorting, exiting\n");
+        post = malloc(sizeof(struct spool_post));
+        if (!post) {
+                telem_log(LOG_ERR, "Unable to allocate memory, exiting\n");
                 exit(EXIT_FAILURE);
         }
+        post->run = run;
+        post->record_name = record_name;
+        post->entry = *entry;
+        trace_retry(&record.trace, record_name);
+        post->trace = record.trace;
+
+        /* The transfer completes in spool_post_done() */
+        run->pending++;
+        if (!post_record_async(run->posts, &record, record_name, spool_post_done,
+                               post)) {
+                run->pending--;
+                run->stopped = true;
+                spool_index_push(run->index, entry);
+                free(post);
+                free_record(&record);
+                free(record_name);
+                return;
+        }
+        free_record(&record);
+        return;
+out:
+        free(entry->name);
+        free(record_name);
+}
 
-        ret = stat(pathb, &statentryb);
-        if (ret == -1) {
-                telem_log(LOG_ERR, "Unable to stat %s: %s\n", patha, strerror(errno));
-                free(pathb);
-                return 0;
+static void spool_run_feed(struct spool_run *run)
+{
+        struct spool_entry entry;
+
+        while (run->running && !run->stopped &&
+               run->processed < spool_process_limit(run->limit) &&
+               run->sent + run->pending < run->limit &&
+               !post_multi_full(run->posts) &&
+               spool_index_pop(run->index, &entry)) {
+                telem_log(LOG_DEBUG, "Processing spool record: %s\n", entry.name);
+                spool_run_send(run, &entry);
         }
 
-        free(patha);
-        free(pathb);
+        if (run->running && run->pending == 0 &&
+            (run->stopped || run->index->count == 0 ||
+             run->processed >= spool_process_limit(run->limit) ||
+             run->sent >= run->limit)) {
+                run->running = false;
+                if (run->sent == 0) {
+                        /* Nothing sent, give back the probe if not failed */
+                        retry_sched_cancel(run->sched);
+                }
+                retry_sched_pass_done(run->sched, run->limit, run->sent,
+                                      spool_clock() - run->started);
+        }
+}
 
-        if (statentrya.st_mtime < statentryb.st_mtime) {
-                return -1;
-        } else if (statentrya.st_mtime > statentryb.st_mtime) {
-                return 1;
+void spool_run_start(struct spool_run *run)
+{
+        if (run->running) {
+                telem_log(LOG_DEBUG, "Previous spool pass still running\n");
+                return;
         }
 
-        return 0;
+        if (run->index->count == 0) {
+                telem_log(LOG_DEBUG, "No entries in spool\n");
+                return;
+        }
+
+        run->limit = retry_sched_pass_limit(run->sched, time(NULL));
+        if (run->limit == 0) {
+                telem_log(LOG_DEBUG, "Server unreachable, not processing spool\n");
+                return;
+        }
 
+        run->running = true;
+        run->started = spool_clock();
+        run->processed = 0;
+        run->sent = 0;
+        run->pending = 0;
+        run->stopped = false;
+        spool_run_feed(run);
+}
+
+void spool_run_stop(struct spool_run *run)
+{
+        run->stopped = true;
+        spool_run_feed(run);
 }
 
 /* vi: set ts=8 sw=8 sts=4 et tw=80 cino=(0: */
@@ -16,50 +16,242 @@
 
 #pragma once
 
+#include <stdbool.h>
+#include <stdint.h>
+#include <dirent.h>
+#include <time.h>
+
+#include "postmulti.h"
+#include "recordio.h"
+#include "retrysched.h"
+#include "spoolusage.h"
+
+/* A record file in the spool directory */
+struct spool_entry {
+        /* file name in the spool directory */
+        char *name;
+        time_t mtime;
+        long disk_size;
+        /* delivery priority class, see record_priority() */
+        int priority;
+        /* order the record was indexed in, to keep records with the same
+         * mtime in order */
+        uint64_t seq;
+};
+
+/*
+ * The records kept in the spool directory, in a min-heap ordered by
+ * modification time, less TM_PRIORITY_AGING seconds per priority class so
+ * that important records are sent first without starving the others. It is
+ * built from the directory once at startup, reading the headers, and
+ * records are added as they are spooled. Passes over the spool take the
+ * records they process out of it and put back the ones that stay, so the
+ * directory is neither scanned nor sorted again.
+ */
+struct spool_index {
+        struct spool_entry *entries;
+        size_t count;
+        size_t alloc;
+        uint64_t seq;
+};
+
+/*
+ * Records a pass took out of an index ahead of the one it processes, of
+ * which the files are read ahead with the io_uring backend, see recordio.h
+ */
+struct spool_ahead {
+        struct spool_entry entries[TM_RECORD_IO_AHEAD];
+        int head;
+        int count;
+};
+
+/*
+ * A pass over the spool whose records are sent concurrently with the curl
+ * multi interface. Records are sent as transfer slots free up, and the pass
+ * stops at the first failed POST, like spool_records_loop().
+ */
+struct spool_run {
+        bool running;
+        int processed;
+        int sent;
+        int pending;
+        /* records the pass may send, from the retry scheduler */
+        int limit;
+        /* monotonic time in milliseconds the pass started at */
+        int64_t started;
+        bool stopped;
+        struct spool_usage *usage;
+        struct post_multi *posts;
+        struct spool_index *index;
+        struct retry_sched *sched;
+};
+
 /**
- * Run the spool record loop periodically
+ * Initializes an empty spool index
+ *
+ * @param index The index
  */
-void spool_records_loop(long *current_spool_size);
+void spool_index_init(struct spool_index *index);
 
 /**
- * Process the spooled record
+ * Replaces the content of an index by the records in a spool directory
  *
+ * @param index The index
  * @param spool_dir Path of the spool directory
- * @param name File name of the spooled record
- * @param records_processed Number of records processed till now
- * @param records_sent Number of records sent to the backend
+ *
+ * @return the number of records indexed, or a negative errno-style value
  */
-void process_spooled_record(const char *spool_dir, char *name,
-                            int *records_processed, int *records_sent,
-                            long *current_spool_size);
+int spool_index_rebuild(struct spool_index *index, const char *spool_dir);
 
 /**
- * Send the spooled record to the backend
+ * Checks an index restored from a previous run against a spool directory
+ * that changed since: the records of which the file is gone are dropped,
+ * and the record files the index does not have are added to another index
  *
- * @param record_path Path of the spooled record
- * @param post_succeeded bool indicating if the previous post was successful
- * @param sz Size of the file in bytes
+ * @param index The restored index
+ * @param added Index the record files not in index are added to
+ * @param spool_dir Path of the spool directory
+ *
+ * @return the number of records added, or a negative errno-style value
  */
-void transmit_spooled_record(char *record_path, bool *post_succeeded, long sz);
+int spool_index_reconcile(struct spool_index *index, struct spool_index *added,
+                          const char *spool_dir);
+
+/**
+ * Adds a record file kept in the spool directory. Exits if out of memory.
+ *
+ * @param index The index
+ * @param path Path of the record file, only its file name is kept
+ * @param mtime Modification time of the file
+ * @param disk_size Space the file takes on disk
+ * @param priority Delivery priority class of the record
+ */
+void spool_index_add(struct spool_index *index, const char *path, time_t mtime,
+                     long disk_size, int priority);
+
+/**
+ * Takes the oldest record out of an index
+ *
+ * @param index The index
+ * @param entry Set to the record, its name now belongs to the caller
+ *
+ * @return false if the index is empty
+ */
+bool spool_index_pop(struct spool_index *index, struct spool_entry *entry);
+
+/**
+ * Puts back a record taken out with spool_index_pop(), in the same order.
+ * Exits if out of memory.
+ *
+ * @param index The index
+ * @param entry The record, its name now belongs to the index
+ */
+void spool_index_push(struct spool_index *index, struct spool_entry *entry);
+
+/**
+ * Takes the next record of a pass out of an index. With the io_uring
+ * backend, the records after it are taken out too, up to
+ * TM_RECORD_IO_AHEAD, and their files read ahead.
+ *
+ * @param ahead Records taken ahead, zeroed before the pass
+ * @param index The index
+ * @param entry Set to the record, its name now belongs to the caller
+ *
+ * @return false if there are no more records
+ */
+bool spool_ahead_pop(struct spool_ahead *ahead, struct spool_index *index,
+                     struct spool_entry *entry);
+
+/**
+ * Puts back the records taken ahead that a pass did not get to, and drops
+ * the files read ahead
+ *
+ * @param ahead Records taken ahead
+ * @param index The index they were taken out of
+ */
+void spool_ahead_done(struct spool_ahead *ahead, struct spool_index *index);
 
 /**
- * Comparison function used for qsort
+ * Gets the space the records of an index take on disk
  *
- * @param entrya Pointer to the spool record file
- * @param entryb Pointer to the spool record file
- * @path path The path to the spool directory
+ * @param index The index
  *
- * @return Returns the value of the comparison
+ * @return the sum of their disk sizes
  */
-int spool_record_compare(const void *entrya, const void *entryb, void *path);
+long spool_index_disk_size(const struct spool_index *index);
 
 /**
- * Calculates the spool directory size.
+ * Releases the records of an index
  *
- * @return size of the spool directory on disk.
- *         may return a negative value in case of error.
+ * @param index The index
  */
-long get_spool_dir_size(void);
+void spool_index_free(struct spool_index *index);
+
+/**
+ * Run the spool record loop periodically. With batch_post_enabled, the
+ * records are sent several per POST. The pass sends as many records, or
+ * batches, as the retry scheduler allows, and reports the outcome of each
+ * POST to it.
+ *
+ * @param index Records in the spool
+ * @param sched The retry scheduler
+ * @param usage Space taken by the spool, updated as records are removed
+ */
+void spool_records_loop(struct spool_index *index, struct retry_sched *sched,
+                        struct spool_usage *usage);
+
+/**
+ * Initializes a spool pass that is not running
+ *
+ * @param run The spool pass
+ * @param posts Transfer engine the records are sent with
+ * @param index Records in the spool
+ * @param sched The retry scheduler
+ * @param usage Space taken by the spool, updated as records are removed
+ */
+void spool_run_init(struct spool_run *run, struct post_multi *posts,
+                    struct spool_index *index, struct retry_sched *sched,
+                    struct spool_usage *usage);
+
+/**
+ * Starts sending the spooled records, unless a pass is already running
+ *
+ * @param run The spool pass
+ */
+void spool_run_start(struct spool_run *run);
+
+/**
+ * Stops sending more records. Records being sent complete as usual.
+ *
+ * @param run The spool pass
+ */
+void spool_run_stop(struct spool_run *run);
+
+/**
+ * Process the spooled record
+ *
+ * @param index Index the record is put back in if it stays in the spool
+ * @param entry The record, taken out of the index
+ * @param records_processed Number of records processed till now
+ * @param records_sent Number of records sent to the backend
+ * @param max_sent Number of records the pass may send
+ * @param usage Space taken by the spool, updated if the record is removed
+ *
+ * @return false if the record could not be sent
+ */
+bool process_spooled_record(struct spool_index *index, struct spool_entry *entry,
+                            int *records_processed, int *records_sent,
+                            int max_sent, struct spool_usage *usage);
+
+/**
+ * Send the spooled record to the backend
+ *
+ * @param record_path Path of the spooled record
+ * @param post_succeeded bool indicating if the previous post was successful
+ * @param sz Size of the file in bytes
+ */
+void transmit_spooled_record(char *record_path, bool *post_succeeded, long sz);
+
 
 /**
  * Checks is the spool dir is valid and is writable
@@ -0,0 +1,132 @@
+/*
+ * This program is part of the Clear Linux Project
+ *
+ * Copyright 2019 Intel Corporation
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms and conditions of the GNU Lesser General Public License, as
+ * published by the Free Software Foundation; either version 2.1 of the License,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU Lesser General Public License for more
+ * details.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "log.h"
+#include "spoolusage.h"
+
+void spool_usage_init(struct spool_usage *usage, long bytes)
+{
+        memset(usage, 0, sizeof(struct spool_usage));
+        usage->bytes = bytes;
+        usage->scan_time = time(NULL);
+}
+
+void spool_usage_add(struct spool_usage *usage, long disk_size)
+{
+        usage->bytes += disk_size;
+        usage->changes++;
+}
+
+void spool_usage_remove(struct spool_usage *usage, long disk_size)
+{
+        usage->changes++;
+        if (disk_size > usage->bytes) {
+                /* Records were not all counted, the directory tells */
+                usage->bytes = 0;
+                usage->scan_wanted = true;
+                return;
+        }
+        usage->bytes -= disk_size;
+}
+
+void spool_usage_request_scan(struct spool_usage *usage)
+{
+        usage->scan_wanted = true;
+}
+
+static void stop_scan(struct spool_usage *usage)
+{
+        if (usage->scan) {
+                closedir(usage->scan);
+                usage->scan = NULL;
+        }
+}
+
+bool spool_usage_scan_step(struct spool_usage *usage, const char *spool_dir)
+{
+        struct dirent *de = NULL;
+        int err;
+
+        if (!usage->scan) {
+                if (!usage->scan_wanted &&
+                    difftime(time(NULL), usage->scan_time) < TM_SPOOL_USAGE_SCAN_TIME) {
+                        return false;
+                }
+                usage->scan = opendir(spool_dir);
+                if (!usage->scan) {
+                        telem_perror("Error opening spool dir");
+                        usage->scan_time = time(NULL);
+                        usage->scan_wanted = false;
+                        return false;
+                }
+                usage->scanned = 0;
+                usage->scan_changes = usage->changes;
+        }
+
+        for (int i = 0; i < TM_SPOOL_USAGE_SCAN_STEP; i++) {
+                struct stat buf;
+
+                errno = 0;
+                de = readdir(usage->scan);
+                if (!de) {
+                        break;
+                }
+                if (de->d_name[0] == '.') {
+                        continue;
+                }
+                if (fstatat(dirfd(usage->scan), de->d_name, &buf,
+                            AT_SYMLINK_NOFOLLOW) == 0 && S_ISREG(buf.st_mode)) {
+                        usage->scanned += buf.st_blocks * 512;
+                }
+        }
+        if (de) {
+                return false;
+        }
+
+        err = errno;
+        stop_scan(usage);
+        if (err != 0) {
+                telem_log(LOG_ERR, "Error while scanning spool: %s\n", strerror(err));
+                return false;
+        }
+        /* Records added or removed meanwhile may or may not be counted */
+        if (usage->changes != usage->scan_changes) {
+                return false;
+        }
+        if (usage->scanned != usage->bytes) {
+                telem_log(LOG_INFO, "Spool usage corrected from %ld to %ld bytes\n",
+                          usage->bytes, usage->scanned);
+                usage->bytes = usage->scanned;
+        }
+        usage->scan_time = time(NULL);
+        usage->scan_wanted = false;
+
+        return true;
+}
+
+void spool_usage_free(struct spool_usage *usage)
+{
+        stop_scan(usage);
+}
+
+/* vi: set ts=8 sw=8 sts=4 et tw=80 cino=(0: */
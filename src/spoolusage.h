@@ -0,0 +1,100 @@
+/*
+ * This program is part of the Clear Linux Project
+ *
+ * Copyright 2019 Intel Corporation
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms and conditions of the GNU Lesser General Public License, as
+ * published by the Free Software Foundation; either version 2.1 of the License,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU Lesser General Public License for more
+ * details.
+ */
+
+#pragma once
+
+#include <dirent.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+
+/*
+ * Space the records take in the spool directory, in bytes of disk blocks.
+ * Every record added to or removed from the spool goes through
+ * spool_usage_add() and spool_usage_remove(), and the value is kept across
+ * runs in the warm state of telempostd. It is checked against the
+ * directory by a scan done in steps of TM_SPOOL_USAGE_SCAN_STEP files while
+ * the daemon is idle: every TM_SPOOL_USAGE_SCAN_TIME seconds, and as soon
+ * as a removal would make it negative. The result of a scan is only used
+ * if no record was added or removed while it ran.
+ */
+#define TM_SPOOL_USAGE_SCAN_STEP 64
+#define TM_SPOOL_USAGE_SCAN_TIME (6 * 60 * 60)
+
+struct spool_usage {
+        long bytes;
+        /* count of additions and removals */
+        uint64_t changes;
+        /* scan in progress, NULL if none */
+        DIR *scan;
+        long scanned;
+        uint64_t scan_changes;
+        /* when the last scan completed, and whether one is due */
+        time_t scan_time;
+        bool scan_wanted;
+};
+
+/**
+ * Initializes the usage of a spool
+ *
+ * @param usage The spool usage
+ * @param bytes Space the records take, see spool_index_disk_size()
+ */
+void spool_usage_init(struct spool_usage *usage, long bytes);
+
+/**
+ * Counts a record file added to the spool
+ *
+ * @param usage The spool usage
+ * @param disk_size Space the file takes on disk
+ */
+void spool_usage_add(struct spool_usage *usage, long disk_size);
+
+/**
+ * Counts a record file removed from the spool. A scan is requested if the
+ * usage would become negative.
+ *
+ * @param usage The spool usage
+ * @param disk_size Space the file took on disk
+ */
+void spool_usage_remove(struct spool_usage *usage, long disk_size);
+
+/**
+ * Requests a scan of the spool directory, run by spool_usage_scan_step()
+ *
+ * @param usage The spool usage
+ */
+void spool_usage_request_scan(struct spool_usage *usage);
+
+/**
+ * Runs a step of the scan of the spool directory, starting one if due.
+ * To be called while the daemon is idle.
+ *
+ * @param usage The spool usage
+ * @param spool_dir Path of the spool directory
+ *
+ * @return true if a scan completed and its result was used
+ */
+bool spool_usage_scan_step(struct spool_usage *usage, const char *spool_dir);
+
+/**
+ * Stops a scan in progress
+ *
+ * @param usage The spool usage
+ */
+void spool_usage_free(struct spool_usage *usage);
+
+/* vi: set ts=8 sw=8 sts=4 et tw=80 cino=(0: */
@@ -0,0 +1,186 @@
+/*
+ * This program is part of the Clear Linux Project
+ *
+ * Copyright 2019 Intel Corporation
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms and conditions of the GNU Lesser General Public License, as
+ * published by the Free Software Foundation; either version 2.1 of the License,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU Lesser General Public License for more
+ * details.
+ */
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "stagepool.h"
+#include "log.h"
+
+static struct stage_job *job_at(struct stage_pool *pool, unsigned int n)
+{
+        return &pool->jobs[n % STAGE_POOL_JOBS];
+}
+
+static void load_job(struct stage_job *job)
+{
+        job->loaded = read_record(job->path, &job->record);
+        if (job->loaded && stat(job->path, &job->st) == -1) {
+                free_record(&job->record);
+                job->loaded = false;
+        }
+}
+
+static void *run_worker(void *arg)
+{
+        struct stage_pool *pool = arg;
+
+        pthread_mutex_lock(&pool->lock);
+        while (!pool->stopping) {
+                struct stage_job *job;
+
+                if (pool->next == pool->tail) {
+                        pthread_cond_wait(&pool->queued, &pool->lock);
+                        continue;
+                }
+                job = job_at(pool, pool->next++);
+                pthread_mutex_unlock(&pool->lock);
+
+                load_job(job);
+
+                pthread_mutex_lock(&pool->lock);
+                job->done = true;
+                pthread_cond_broadcast(&pool->loaded);
+        }
+        pthread_mutex_unlock(&pool->lock);
+
+        return NULL;
+}
+
+int stage_pool_start(struct stage_pool *pool, int nworkers)
+{
+        int ret = 0;
+
+        memset(pool, 0, sizeof(*pool));
+        if (nworkers <= 0) {
+                return 0;
+        }
+
+        pool->threads = calloc((size_t)nworkers, sizeof(pthread_t));
+        if (!pool->threads) {
+                telem_log(LOG_ERR, "Unable to allocate memory, exiting\n");
+                exit(EXIT_FAILURE);
+        }
+        pthread_mutex_init(&pool->lock, NULL);
+        pthread_cond_init(&pool->queued, NULL);
+        pthread_cond_init(&pool->loaded, NULL);
+
+        for (int i = 0; i < nworkers; i++) {
+                ret = pthread_create(&pool->threads[i], NULL, run_worker, pool);
+                if (ret != 0) {
+                        break;
+                }
+                pool->nworkers++;
+        }
+        if (pool->nworkers == 0) {
+                stage_pool_stop(pool);
+                return -ret;
+        }
+
+        return 0;
+}
+
+bool stage_pool_enabled(const struct stage_pool *pool)
+{
+        return pool->threads != NULL;
+}
+
+bool stage_pool_full(const struct stage_pool *pool)
+{
+        return pool->tail - pool->head == STAGE_POOL_JOBS;
+}
+
+bool stage_pool_queued(const struct stage_pool *pool, const char *path)
+{
+        /* Only the thread queuing files moves head and tail, and sets paths */
+        for (unsigned int n = pool->head; n != pool->tail; n++) {
+                if (strcmp(pool->jobs[n % STAGE_POOL_JOBS].path, path) == 0) {
+                        return true;
+                }
+        }
+
+        return false;
+}
+
+void stage_pool_queue(struct stage_pool *pool, char *path, bool is_retry)
+{
+        struct stage_job *job;
+
+        pthread_mutex_lock(&pool->lock);
+        job = job_at(pool, pool->tail);
+        memset(job, 0, sizeof(*job));
+        job->path = path;
+        job->is_retry = is_retry;
+        pool->tail++;
+        pthread_cond_signal(&pool->queued);
+        pthread_mutex_unlock(&pool->lock);
+}
+
+bool stage_pool_take(struct stage_pool *pool, struct stage_job *job)
+{
+        struct stage_job *first;
+
+        if (pool->head == pool->tail) {
+                return false;
+        }
+
+        pthread_mutex_lock(&pool->lock);
+        first = job_at(pool, pool->head);
+        while (!first->done) {
+                pthread_cond_wait(&pool->loaded, &pool->lock);
+        }
+        *job = *first;
+        memset(first, 0, sizeof(*first));
+        pool->head++;
+        pthread_mutex_unlock(&pool->lock);
+
+        return true;
+}
+
+void stage_pool_stop(struct stage_pool *pool)
+{
+        if (!pool->threads) {
+                return;
+        }
+
+        /* A worker finishes the file it is reading first */
+        pthread_mutex_lock(&pool->lock);
+        pool->stopping = true;
+        pthread_cond_broadcast(&pool->queued);
+        pthread_mutex_unlock(&pool->lock);
+        for (int i = 0; i < pool->nworkers; i++) {
+                pthread_join(pool->threads[i], NULL);
+        }
+
+        for (; pool->head != pool->tail; pool->head++) {
+                struct stage_job *job = job_at(pool, pool->head);
+
+                if (job->loaded) {
+                        free_record(&job->record);
+                }
+                free(job->path);
+        }
+        pthread_cond_destroy(&pool->loaded);
+        pthread_cond_destroy(&pool->queued);
+        pthread_mutex_destroy(&pool->lock);
+        free(pool->threads);
+        pool->threads = NULL;
+        pool->nworkers = 0;
+}
+
+/* vi: set ts=8 sw=8 sts=4 et tw=80 cino=(0: */
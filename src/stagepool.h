@@ -0,0 +1,119 @@
+/*
+ * This program is part of the Clear Linux Project
+ *
+ * Copyright 2019 Intel Corporation
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms and conditions of the GNU Lesser General Public License, as
+ * published by the Free Software Foundation; either version 2.1 of the License,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU Lesser General Public License for more
+ * details.
+ */
+
+#pragma once
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <sys/stat.h>
+
+#include "iorecord.h"
+
+/*
+ * Worker threads reading and parsing staged record files for telempostd.
+ * The thread owning the daemon queues the files and takes their records
+ * back in the same order, so the journal, the rate limits and the POSTs
+ * keep a single writer while a backlog is read on several cores.
+ */
+
+/* Record files queued at most, read or not */
+#define STAGE_POOL_JOBS 64
+
+/* A record file queued to the workers */
+struct stage_job {
+        char *path;
+        bool is_retry;
+        /* set once a worker is done with the file */
+        bool done;
+        /* false if the file could not be read */
+        bool loaded;
+        struct staged_record record;
+        struct stat st;
+};
+
+struct stage_pool {
+        /* NULL if records are read by the thread processing them */
+        pthread_t *threads;
+        int nworkers;
+        pthread_mutex_t lock;
+        /* signaled once a job is queued, or the pool stops */
+        pthread_cond_t queued;
+        /* signaled once a worker is done with a job */
+        pthread_cond_t loaded;
+        /* jobs are taken back from head, read from next, queued at tail */
+        struct stage_job jobs[STAGE_POOL_JOBS];
+        unsigned int head;
+        unsigned int next;
+        unsigned int tail;
+        bool stopping;
+};
+
+/**
+ * Starts the worker threads of a pool
+ *
+ * @param pool The pool
+ * @param nworkers Number of workers, 0 to leave the pool disabled
+ *
+ * @return 0 on success, or a negative errno if no worker could be started,
+ *     in which case the pool is disabled
+ */
+int stage_pool_start(struct stage_pool *pool, int nworkers);
+
+/**
+ * @return true if the pool has workers
+ */
+bool stage_pool_enabled(const struct stage_pool *pool);
+
+/**
+ * @return true if no more files can be queued until a record is taken back
+ */
+bool stage_pool_full(const struct stage_pool *pool);
+
+/**
+ * @return true if a file is queued and its record not taken back yet
+ */
+bool stage_pool_queued(const struct stage_pool *pool, const char *path);
+
+/**
+ * Queues a record file to be read by the workers. The pool must not be
+ * full.
+ *
+ * @param pool The pool
+ * @param path Path of the file, now owned by the pool
+ * @param is_retry true if the record was spooled before
+ */
+void stage_pool_queue(struct stage_pool *pool, char *path, bool is_retry);
+
+/**
+ * Takes back the record of the file queued first, waiting for a worker to
+ * be done with it
+ *
+ * @param pool The pool
+ * @param job Set to the job, of which the path and record now belong to
+ *     the caller
+ *
+ * @return false if no file is queued
+ */
+bool stage_pool_take(struct stage_pool *pool, struct stage_job *job);
+
+/**
+ * Stops the workers, the files queued and not taken back are dropped
+ *
+ * @param pool The pool
+ */
+void stage_pool_stop(struct stage_pool *pool);
+
+/* vi: set ts=8 sw=8 sts=4 et tw=80 cino=(0: */
@@ -0,0 +1,627 @@
+/*
+ * This program is part of the Clear Linux Project
+ *
+ * Copyright 2018 Intel Corporation
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms and conditions of the GNU Lesser General Public License, as
+ * published by the Free Software Foundation; either version 2.1 of the License,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU Lesser General Public License for more
+ * details.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <pthread.h>
+
+#include "staginglog.h"
+#include "configuration.h"
+#include "common.h"
+#include "metrics.h"
+#include "log.h"
+
+/* Records larger than this are taken as a corrupted frame */
+#define STAGING_LOG_MAX_RECORD (1024 * 1024)
+
+/* Segment being written by telemprobd, shared by its worker threads */
+static pthread_mutex_t log_lock = PTHREAD_MUTEX_INITIALIZER;
+static int log_fd = -1;
+static uint64_t log_seq = 0;
+static size_t log_size = 0;
+
+/* Position of telempostd in the log */
+static bool cursor_loaded = false;
+static uint64_t cursor_seq = 0;
+static uint64_t cursor_offset = 0;
+/* The cursor is in corrupted bytes of its segment, already reported */
+static bool cursor_skipping = false;
+/* Drains in a row that failed to read the segment of the cursor */
+static unsigned int cursor_failures = 0;
+
+char *staging_log_dir(void)
+{
+        char *dir = NULL;
+
+        if (asprintf(&dir, "%s/%s", spool_dir_config(), STAGING_LOG_DIR) < 0) {
+                return NULL;
+        }
+
+        return dir;
+}
+
+static char *segment_path(const char *dir, uint64_t seq)
+{
+        char *path = NULL;
+
+        if (asprintf(&path, "%s/%s%016" PRIx64, dir,
+                     STAGING_LOG_SEGMENT_PREFIX, seq) < 0) {
+                telem_log(LOG_ERR, "Unable to allocate memory, exiting\n");
+                exit(EXIT_FAILURE);
+        }
+
+        return path;
+}
+
+static int segment_filter(const struct dirent *entry)
+{
+        return strncmp(entry->d_name, STAGING_LOG_SEGMENT_PREFIX,
+                       strlen(STAGING_LOG_SEGMENT_PREFIX)) == 0;
+}
+
+/**
+ * Lists the segments in the staging log directory, oldest first.
+ *
+ * @param dir The staging log directory
+ * @param seqs Set to a newly allocated array of segment sequence numbers
+ *
+ * @return the number of segments, or a negative errno-style value on error
+ */
+static int list_segments(const char *dir, uint64_t **seqs)
+{
+        struct dirent **namelist;
+        int numentries;
+        int count = 0;
+
+        numentries = scandir(dir, &namelist, segment_filter, alphasort);
+        if (numentries < 0) {
+                return -errno;
+        }
+
+        *seqs = calloc((size_t)numentries + 1, sizeof(uint64_t));
+        if (!*seqs) {
+                telem_log(LOG_ERR, "Unable to allocate memory, exiting\n");
+                exit(EXIT_FAILURE);
+        }
+
+        for (int i = 0; i < numentries; i++) {
+                char *end = NULL;
+                const char *hex = namelist[i]->d_name +
+                                  strlen(STAGING_LOG_SEGMENT_PREFIX);
+                uint64_t seq;
+
+                errno = 0;
+                seq = strtoull(hex, &end, 16);
+                if (errno == 0 && end != hex && *end == '\0') {
+                        (*seqs)[count++] = seq;
+                }
+                free(namelist[i]);
+        }
+        free(namelist);
+
+        return count;
+}
+
+static void close_segment(void)
+{
+        if (log_fd >= 0) {
+                close(log_fd);
+                log_fd = -1;
+        }
+}
+
+static int open_next_segment(void)
+{
+        char *dir = NULL;
+        char *path = NULL;
+        uint64_t *seqs = NULL;
+        int count;
+        int ret = 0;
+
+        close_segment();
+
+        dir = staging_log_dir();
+        if (!dir) {
+                return -ENOMEM;
+        }
+
+        if (mkdir(dir, S_IRWXU) != 0 && errno != EEXIST) {
+                ret = -errno;
+                telem_perror("Unable to create staging log directory");
+                goto out;
+        }
+
+        /* Never append to a segment left by a previous run, its last record
+         * may be torn */
+        count = list_segments(dir, &seqs);
+        if (count < 0) {
+                ret = count;
+                goto out;
+        }
+        if (count > 0 && seqs[count - 1] > log_seq) {
+                log_seq = seqs[count - 1];
+        }
+        log_seq++;
+
+        path = segment_path(dir, log_seq);
+        log_fd = open(path, O_WRONLY | O_CREAT | O_EXCL | O_APPEND | O_CLOEXEC,
+                      S_IRUSR | S_IWUSR);
+        if (log_fd < 0) {
+                ret = -errno;
+                telem_perror("Unable to create staging log segment");
+                goto out;
+        }
+        log_size = 0;
+        telem_debug("DEBUG: New staging log segment: %s\n", path);
+
+out:
+        free(seqs);
+        free(path);
+        free(dir);
+        return ret;
+}
+
+int staging_log_append(const char *data, size_t size)
+{
+        struct staging_log_frame frame;
+        uint32_t commit = STAGING_LOG_COMMIT;
+        struct iovec iov[3];
+        size_t total = sizeof(frame) + size + sizeof(commit);
+        size_t max_size = (size_t)staging_segment_size_config() * 1024;
+        ssize_t len;
+        int ret;
+
+        if (size > STAGING_LOG_MAX_RECORD) {
+                return -EINVAL;
+        }
+
+        pthread_mutex_lock(&log_lock);
+        if (log_fd < 0 || (log_size > 0 && log_size + total > max_size)) {
+                if ((ret = open_next_segment()) < 0) {
+                        goto out;
+                }
+        }
+
+        frame.magic = STAGING_LOG_MAGIC;
+        frame.size = (uint32_t)size;
+        frame.timestamp = (int64_t)time(NULL);
+
+        iov[0].iov_base = &frame;
+        iov[0].iov_len = sizeof(frame);
+        iov[1].iov_base = (void *)data;
+        iov[1].iov_len = size;
+        iov[2].iov_base = &commit;
+        iov[2].iov_len = sizeof(commit);
+
+        /* Write the record and its commit marker at once, so the reader
+         * never sees a committed record that is not complete */
+        len = writev(log_fd, iov, 3);
+        if (len < 0 || (size_t)len != total) {
+                ret = (len < 0) ? -errno : -EIO;
+                telem_log(LOG_ERR, "Unable to append to staging log: %s\n",
+                          strerror(-ret));
+                /* Leave the torn record behind in a sealed segment */
+                close_segment();
+                goto out;
+        }
+        log_size += total;
+        ret = 0;
+out:
+        pthread_mutex_unlock(&log_lock);
+        return ret;
+}
+
+void staging_log_close(void)
+{
+        pthread_mutex_lock(&log_lock);
+        close_segment();
+        pthread_mutex_unlock(&log_lock);
+}
+
+static void read_cursor(const char *dir, uint64_t *seq, uint64_t *offset,
+                        unsigned int *failures)
+{
+        char *path = NULL;
+        FILE *fp;
+
+        *seq = 0;
+        *offset = 0;
+        *failures = 0;
+
+        if (asprintf(&path, "%s/%s", dir, STAGING_LOG_CURSOR) < 0) {
+                telem_log(LOG_ERR, "Unable to allocate memory, exiting\n");
+                exit(EXIT_FAILURE);
+        }
+
+        fp = fopen(path, "r");
+        if (fp) {
+                /* The failure count is missing from older cursors */
+                if (fscanf(fp, "%" SCNx64 " %" SCNu64 " %u", seq, offset,
+                           failures) < 2) {
+                        telem_log(LOG_ERR, "Invalid staging log cursor, starting"
+                                  " from the oldest segment\n");
+                        *seq = 0;
+                        *offset = 0;
+                        *failures = 0;
+                }
+                fclose(fp);
+        }
+        free(path);
+}
+
+static void load_cursor(const char *dir)
+{
+        cursor_loaded = true;
+        read_cursor(dir, &cursor_seq, &cursor_offset, &cursor_failures);
+}
+
+static void save_cursor(const char *dir)
+{
+        char *path = NULL;
+        char *tmp = NULL;
+        FILE *fp;
+
+        if (asprintf(&path, "%s/%s", dir, STAGING_LOG_CURSOR) < 0 ||
+            asprintf(&tmp, "%s/%s.tmp", dir, STAGING_LOG_CURSOR) < 0) {
+                telem_log(LOG_ERR, "Unable to allocate memory, exiting\n");
+                exit(EXIT_FAILURE);
+        }
+
+        fp = fopen(tmp, "w");
+        if (!fp) {
+                telem_perror("Unable to save staging log cursor");
+                goto out;
+        }
+        fprintf(fp, "%" PRIx64 " %" PRIu64 " %u\n", cursor_seq, cursor_offset,
+                cursor_failures);
+        if (fclose(fp) != 0 || rename(tmp, path) != 0) {
+                telem_perror("Unable to save staging log cursor");
+                unlink(tmp);
+        }
+
+out:
+        free(tmp);
+        free(path);
+}
+
+/* What read_frame() found at an offset of a segment */
+enum frame_state {
+        FRAME_COMMITTED = 0,
+        /* not fully written yet */
+        FRAME_PARTIAL,
+        FRAME_CORRUPT,
+        FRAME_ERROR
+};
+
+/* How far read_segment() read a segment */
+enum segment_state {
+        /* up to a record not fully written yet */
+        SEGMENT_PENDING = 0,
+        /* up to its end */
+        SEGMENT_COMPLETE,
+        /* not at all or only in part, to be read again */
+        SEGMENT_FAILED
+};
+
+static enum frame_state read_frame(int fd, uint64_t offset, uint64_t size,
+                                   struct staging_log_frame *frame)
+{
+        uint32_t commit;
+        uint64_t next;
+
+        if (offset + sizeof(*frame) > size) {
+                return FRAME_PARTIAL;
+        }
+        if (pread(fd, frame, sizeof(*frame), (off_t)offset) != sizeof(*frame)) {
+                return FRAME_ERROR;
+        }
+        if (frame->magic != STAGING_LOG_MAGIC || frame->size > STAGING_LOG_MAX_RECORD) {
+                return FRAME_CORRUPT;
+        }
+
+        next = offset + sizeof(*frame) + frame->size + sizeof(commit);
+        if (next > size) {
+                return FRAME_PARTIAL;
+        }
+        if (pread(fd, &commit, sizeof(commit), (off_t)(next - sizeof(commit))) !=
+            sizeof(commit)) {
+                return FRAME_ERROR;
+        }
+
+        return (commit == STAGING_LOG_COMMIT) ? FRAME_COMMITTED : FRAME_CORRUPT;
+}
+
+/**
+ * Finds where the next frame may start after a corrupted one
+ *
+ * @param fd The segment
+ * @param offset Offset to search from
+ * @param size Size of the segment
+ *
+ * @return the offset of the next STAGING_LOG_MAGIC, or if there is none, of
+ *     the last bytes of the segment a magic being written may start at
+ */
+static uint64_t find_frame(int fd, uint64_t offset, uint64_t size)
+{
+        uint32_t magic = STAGING_LOG_MAGIC;
+        char buf[4096];
+
+        while (offset + sizeof(magic) <= size) {
+                size_t want = (size - offset < sizeof(buf)) ? (size_t)(size - offset) :
+                              sizeof(buf);
+                ssize_t len = pread(fd, buf, want, (off_t)offset);
+                char *found;
+
+                if (len < (ssize_t)sizeof(magic)) {
+                        break;
+                }
+                found = memmem(buf, (size_t)len, &magic, sizeof(magic));
+                if (found) {
+                        return offset + (uint64_t)(found - buf);
+                }
+                offset += (uint64_t)len - (sizeof(magic) - 1);
+        }
+
+        return offset;
+}
+
+/**
+ * Reads the committed records of a segment, starting at *offset. A
+ * corrupted frame is reported once, and skipped by searching for the next
+ * frame.
+ *
+ * @param path Path of the segment
+ * @param offset Offset to start from, updated past the records read
+ * @param fn Function called for each record
+ * @param arg Argument passed to fn
+ * @param skipping Whether *offset is in corrupted bytes already reported,
+ *     updated
+ * @param state Set to how far the segment was read
+ *
+ * @return the number of records read
+ */
+static int read_segment(const char *path, uint64_t *offset,
+                        staging_log_record_fn fn, void *arg, bool *skipping,
+                        enum segment_state *state)
+{
+        struct staging_log_frame frame;
+        struct stat sb;
+        uint64_t size;
+        char *data;
+        int count = 0;
+        int fd;
+
+        *state = SEGMENT_PENDING;
+
+        fd = open(path, O_RDONLY | O_CLOEXEC);
+        if (fd < 0 && errno == ENOENT) {
+                /* Read and removed meanwhile */
+                *state = SEGMENT_COMPLETE;
+                return 0;
+        } else if (fd < 0 || fstat(fd, &sb) != 0) {
+                telem_perror("Unable to open staging log segment");
+                if (fd >= 0) {
+                        close(fd);
+                }
+                *state = SEGMENT_FAILED;
+                return 0;
+        }
+        size = (uint64_t)sb.st_size;
+
+        while (*offset < size) {
+                enum frame_state found = read_frame(fd, *offset, size, &frame);
+
+                if (found == FRAME_PARTIAL) {
+                        break;
+                } else if (found == FRAME_ERROR) {
+                        telem_perror("Unable to read staging log segment");
+                        *state = SEGMENT_FAILED;
+                        goto done;
+                } else if (found == FRAME_CORRUPT) {
+                        if (!*skipping) {
+                                telem_log(LOG_ERR, "Corrupted record in %s at %" PRIu64
+                                          ", skipping to the next record\n", path, *offset);
+                                metrics_count(METRIC_POSTD_STAGING_CORRUPT, 1);
+                                *skipping = true;
+                        }
+                        *offset = find_frame(fd, *offset + 1, size);
+                        continue;
+                }
+
+                data = malloc(frame.size + 1);
+                if (!data) {
+                        telem_log(LOG_ERR, "Unable to allocate memory, exiting\n");
+                        exit(EXIT_FAILURE);
+                }
+                if (pread(fd, data, frame.size, (off_t)(*offset + sizeof(frame))) !=
+                    (ssize_t)frame.size) {
+                        telem_perror("Unable to read staging log segment");
+                        free(data);
+                        *state = SEGMENT_FAILED;
+                        goto done;
+                }
+                data[frame.size] = '\0';
+
+                *offset += sizeof(frame) + frame.size + sizeof(uint32_t);
+                *skipping = false;
+                fn(data, frame.size, (time_t)frame.timestamp, arg);
+                free(data);
+                count++;
+        }
+
+        if (*offset == size) {
+                *state = SEGMENT_COMPLETE;
+        }
+done:
+        close(fd);
+        return count;
+}
+
+/* Renames a segment that cannot be read, so that it is not read again and
+ * stays around to be looked at */
+static void set_aside_segment(const char *path)
+{
+        char *failed = NULL;
+
+        if (asprintf(&failed, "%s%s", path, STAGING_LOG_FAILED_SUFFIX) < 0) {
+                telem_log(LOG_ERR, "Unable to allocate memory, exiting\n");
+                exit(EXIT_FAILURE);
+        }
+
+        telem_log(LOG_ERR, "Unable to read staging log segment %s in %u drains,"
+                  " renamed to %s\n", path, cursor_failures, failed);
+        metrics_count(METRIC_POSTD_STAGING_FAILED, 1);
+        if (rename(path, failed) != 0) {
+                telem_perror("Unable to rename staging log segment");
+                /* Removed by the next drain, it is behind the cursor */
+        }
+        free(failed);
+}
+
+int staging_log_drain(staging_log_record_fn fn, void *arg)
+{
+        char *dir = NULL;
+        char *path = NULL;
+        uint64_t *seqs = NULL;
+        uint64_t start_seq, start_offset;
+        unsigned int start_failures;
+        enum segment_state state;
+        int count;
+        int processed = 0;
+
+        dir = staging_log_dir();
+        if (!dir) {
+                return -ENOMEM;
+        }
+
+        count = list_segments(dir, &seqs);
+        if (count < 0) {
+                free(dir);
+                /* Staging log never used */
+                return (count == -ENOENT) ? 0 : count;
+        }
+
+        if (!cursor_loaded) {
+                load_cursor(dir);
+        }
+        start_seq = cursor_seq;
+        start_offset = cursor_offset;
+        start_failures = cursor_failures;
+
+        for (int i = 0; i < count; i++) {
+                bool sealed = (i < count - 1);
+
+                path = segment_path(dir, seqs[i]);
+
+                if (seqs[i] < cursor_seq) {
+                        /* Read before, but not removed yet */
+                        unlink(path);
+                        free(path);
+                        continue;
+                } else if (seqs[i] > cursor_seq) {
+                        cursor_seq = seqs[i];
+                        cursor_offset = 0;
+                        cursor_skipping = false;
+                        cursor_failures = 0;
+                }
+
+                processed += read_segment(path, &cursor_offset, fn, arg,
+                                          &cursor_skipping, &state);
+
+                if (!sealed) {
+                        /* Still being written, wait for more records */
+                        free(path);
+                        break;
+                } else if (state == SEGMENT_FAILED &&
+                           ++cursor_failures < STAGING_LOG_MAX_FAILURES) {
+                        /* Kept with the cursor in it, read again next time */
+                        free(path);
+                        break;
+                }
+
+                if (state == SEGMENT_FAILED) {
+                        set_aside_segment(path);
+                } else {
+                        if (state == SEGMENT_PENDING && !cursor_skipping) {
+                                /* Left by a write that failed, never completed */
+                                telem_log(LOG_ERR, "Torn record at the end of"
+                                          " staging log segment %s\n", path);
+                                metrics_count(METRIC_POSTD_STAGING_CORRUPT, 1);
+                        }
+                        unlink(path);
+                }
+                free(path);
+                cursor_seq = seqs[i] + 1;
+                cursor_offset = 0;
+                cursor_skipping = false;
+                cursor_failures = 0;
+        }
+
+        if (cursor_seq != start_seq || cursor_offset != start_offset ||
+            cursor_failures != start_failures) {
+                save_cursor(dir);
+        }
+
+        free(seqs);
+        free(dir);
+
+        return processed;
+}
+
+int staging_log_read(const char *dir, staging_log_record_fn fn, void *arg)
+{
+        uint64_t *seqs = NULL;
+        uint64_t seq, offset;
+        unsigned int failures;
+        int count;
+        int processed = 0;
+
+        count = list_segments(dir, &seqs);
+        if (count < 0) {
+                return (count == -ENOENT) ? 0 : count;
+        }
+
+        read_cursor(dir, &seq, &offset, &failures);
+        for (int i = 0; i < count; i++) {
+                char *path;
+                uint64_t start = (seqs[i] == seq) ? offset : 0;
+                bool skipping = false;
+                enum segment_state state;
+
+                if (seqs[i] < seq) {
+                        /* Read by telempostd already */
+                        continue;
+                }
+                path = segment_path(dir, seqs[i]);
+                processed += read_segment(path, &start, fn, arg, &skipping, &state);
+                free(path);
+        }
+
+        free(seqs);
+
+        return processed;
+}
+
+/* vi: set ts=8 sw=8 sts=4 et tw=80 cino=(0: */
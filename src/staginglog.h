@@ -0,0 +1,120 @@
+/*
+ * This program is part of the Clear Linux Project
+ *
+ * Copyright 2018 Intel Corporation
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms and conditions of the GNU Lesser General Public License, as
+ * published by the Free Software Foundation; either version 2.1 of the License,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU Lesser General Public License for more
+ * details.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <time.h>
+
+/*
+ * Staging log: instead of one file per record, telemprobd appends records to
+ * segment files in STAGING_LOG_DIR under the spool directory, and telempostd
+ * tails them. Each record in a segment is framed as:
+ *
+ * <struct staging_log_frame>
+ * <record data>              : the same layout as a per-file staged record
+ * <uint32_t commit marker>   : STAGING_LOG_COMMIT, written with the record
+ *
+ * A record is only read once its commit marker is there. The writer only
+ * appends to the newest segment, so a segment with a newer one after it is
+ * sealed and can be removed once read.
+ */
+
+#define STAGING_LOG_DIR ".staging"
+#define STAGING_LOG_SEGMENT_PREFIX "segment."
+#define STAGING_LOG_CURSOR "cursor"
+/* A sealed segment that cannot be read in this many drains is renamed with
+ * this suffix, and the drain goes on with the next one */
+#define STAGING_LOG_MAX_FAILURES 10
+#define STAGING_LOG_FAILED_SUFFIX ".failed"
+
+#define STAGING_LOG_MAGIC  0x4c53544d   /* "MTSL" */
+#define STAGING_LOG_COMMIT 0x434d5443   /* "CTMC" */
+
+struct staging_log_frame {
+        uint32_t magic;
+        /* size of the record data that follows */
+        uint32_t size;
+        /* time the record was staged */
+        int64_t timestamp;
+};
+
+/**
+ * Callback for records read from the staging log
+ *
+ * @param data Record data, null terminated
+ * @param size Size of data, not including the null byte
+ * @param timestamp Time the record was staged
+ * @param arg Argument passed to staging_log_drain
+ */
+typedef void (*staging_log_record_fn)(char *data, size_t size,
+                                      time_t timestamp, void *arg);
+
+/**
+ * Gets the path of the staging log directory
+ *
+ * @return a newly allocated path, or NULL if out of memory
+ */
+char *staging_log_dir(void);
+
+/**
+ * Appends a record to the current segment, starting a new segment if it
+ * would grow past the configured segment size
+ *
+ * @param data Record data
+ * @param size Size of data
+ *
+ * @return 0 on success, or a negative errno-style value on error
+ */
+int staging_log_append(const char *data, size_t size);
+
+/**
+ * Closes the segment being written
+ */
+void staging_log_close(void);
+
+/**
+ * Reads all committed records past the saved cursor, calls fn for each of
+ * them, and removes segments that were fully read and are sealed. The
+ * cursor is saved in the staging log directory, so records are not read
+ * again after a restart. A sealed segment that fails to be read is kept and
+ * read again by the next drains, up to STAGING_LOG_MAX_FAILURES times.
+ *
+ * @param fn Function called for each record
+ * @param arg Argument passed to fn
+ *
+ * @return the number of records read, or a negative errno-style value on
+ *     error
+ */
+int staging_log_drain(staging_log_record_fn fn, void *arg);
+
+/**
+ * Reads the committed records of a staging log past its saved cursor,
+ * without moving the cursor or removing segments, for tools looking at the
+ * log while telempostd may be draining it
+ *
+ * @param dir The staging log directory
+ * @param fn Function called for each record
+ * @param arg Argument passed to fn
+ *
+ * @return the number of records read, or a negative errno-style value on
+ *     error
+ */
+int staging_log_read(const char *dir, staging_log_record_fn fn, void *arg);
+
+/* vi: set ts=8 sw=8 sts=4 et tw=80 cino=(0: */
@@ -30,6 +30,11 @@
 #include <grp.h>
 #include <errno.h>
 
+#include "archive.h"
+#include "common.h"
+#include "configuration.h"
+#include "metrics.h"
+
 #define TELEM_DIR       "/etc/telemetrics"
 #define TM_OPT_OUT      TELEM_DIR"/opt-out"
 
@@ -68,6 +73,9 @@ static int telemctl_is_active(void);
 static int telemctl_opt_out(void);
 static int telemctl_opt_in(void);
 static int telemctl_journal(char *);
+static int telemctl_stats(char *);
+static int telemctl_export(char *);
+static int telemctl_import(char *);
 
 struct telemcmd {
         char *cmd;
@@ -85,7 +93,10 @@ static struct telemcmd commands[] = {
         {"is-active", {.f1=telemctl_is_active},"Checks if telemprobd and telempostd are active" },
         {"opt-in",    {.f1=telemctl_opt_in},   "Opts in to telemetry, and starts telemetry services" },
         {"opt-out",   {.f1=telemctl_opt_out},  "Opts out of telemetry, and stops telemetry services" },
-        {"journal",   {.f2=telemctl_journal},  "Prints telemetry journal contents. Use -h argument with\n            command for more options"}
+        {"journal",   {.f2=telemctl_journal},  "Prints telemetry journal contents. Use -h argument with\n            command for more options"},
+        {"stats",     {.f2=telemctl_stats},    "Prints the metrics of telemprobd and telempostd. Use\n            --prometheus for the Prometheus text format"},
+        {"export",    {.f2=telemctl_export},   "Writes the records not sent yet, the journal and the\n            retained records to an archive, <path> argument required"},
+        {"import",    {.f2=telemctl_import},   "Stages the records of an archive written by export to\n            be sent, without its journal and retained records,\n            <path> argument required"}
 };
 
 static int syscmd(char *cmd, char *buff, int bufflen)
@@ -441,7 +452,8 @@ static int telemctl_opt_in(void)
 static int journal_cmd(char *cmd)
 {
         int status;
-        char buff[256];
+        size_t len;
+        char buff[64 * 1024];
 #ifdef DEBUG
         printf("[debug] [%s] %s\n", __func__, cmd);
 #endif
@@ -451,8 +463,8 @@ static int journal_cmd(char *cmd)
                 return -1;
         }
 
-        while (fgets(buff, sizeof(buff), fp) != NULL) {
-                printf("%s", buff);
+        while ((len = fread(buff, 1, sizeof(buff), fp)) > 0) {
+                fwrite(buff, 1, len, stdout);
         }
 
         status = pclose(fp);
@@ -491,6 +503,86 @@ static int telemctl_journal(char * x)
         return 1;
 }
 
+static int telemctl_stats(char *option)
+{
+        static const char *daemons[] = { "telemprobd", "telempostd" };
+        bool prometheus = false;
+        int found = 0;
+
+        if (option) {
+                if (strcmp(option, "--prometheus") != 0) {
+                        fprintf(stderr, "Unknown option for stats: %s\n", option);
+                        return 2;
+                }
+                prometheus = true;
+        }
+
+        for (size_t i = 0; i < ARRAY_SIZE(daemons); i++) {
+                const struct metrics_page *page;
+                char *path = NULL;
+                int ret;
+
+                if (asprintf(&path, "%s/%s%s", METRICS_DIR, daemons[i],
+                             METRICS_SUFFIX) < 0) {
+                        perror("asprintf");
+                        return 1;
+                }
+                ret = metrics_map(path, &page);
+                free(path);
+                if (ret < 0) {
+                        /* Daemons remove their page when they exit */
+                        if (!prometheus) {
+                                printf("%s: no metrics (%s)\n", daemons[i],
+                                       ret == -ENOENT ? "not running" : strerror(-ret));
+                        }
+                        continue;
+                }
+                metrics_print(stdout, page, prometheus);
+                metrics_unmap(page);
+                found++;
+        }
+
+        return found > 0 ? 0 : 1;
+}
+
+static int telemctl_export(char *path)
+{
+        struct archive_sources sources = {
+                .spool_dir = spool_dir_config(),
+                .journal_file = JOURNAL_PATH,
+                .retention_dir = RECORD_RETENTION_DIR,
+        };
+        int ret;
+
+        ret = archive_export(path, &sources, archive_threads());
+        if (ret < 0) {
+                fprintf(stderr, "Failed to export to %s: %s\n", path, strerror(-ret));
+                return 1;
+        }
+        printf("Exported %d files and records to %s\n", ret, path);
+
+        return 0;
+}
+
+static int telemctl_import(char *path)
+{
+        int kept = 0;
+        int ret;
+
+        ret = archive_import(path, spool_dir_config(), archive_threads(), &kept);
+        if (ret < 0) {
+                fprintf(stderr, "Failed to import %s: %s\n", path, strerror(-ret));
+                return 1;
+        }
+        printf("Staged %d records from %s\n", ret, path);
+        if (kept > 0) {
+                printf("Left %d journal and retained record files in the archive,"
+                       " they are not imported\n", kept);
+        }
+
+        return 0;
+}
+
 static void print_usage(char *str)
 {
         printf("%s - Control actions for telemetry services\n\n", str);
@@ -516,10 +608,29 @@ int main(int argc, char **argv)
 
         for (i = 0; i < sizeof(commands)/sizeof(commands[0]); i++) {
                 if (strcmp(commands[i].cmd, argv[1]) == 0) {
+                        /* The metrics pages can be read by anyone */
+                        if (strcmp(argv[1], "stats") == 0) {
+                                if (argc > 3) {
+                                        print_usage(argv[0]);
+                                        exit(2);
+                                }
+                                ret = commands[i].f.f2(argc == 3 ? argv[2] : NULL);
+                                break;
+                        }
                         if (!is_root) {
                                 fprintf(stderr, "Must be root to run this command. Exiting...\n");
                                 exit(1);
                         }
+                        /* Archives are named on the command line */
+                        if (strcmp(argv[1], "export") == 0 ||
+                            strcmp(argv[1], "import") == 0) {
+                                if (argc != 3) {
+                                        print_usage(argv[0]);
+                                        exit(2);
+                                }
+                                ret = commands[i].f.f2(argv[2]);
+                                break;
+                        }
                         /* Special treatment for "journal", it can have cmd line arguments */
                         if (strcmp(argv[1],"journal") != 0) {
                                 if (argc != 2) {
@@ -26,17 +26,48 @@
 #include <string.h>
 #include <fcntl.h>
 #include <time.h>
-#include <malloc.h>
 #include <sys/uio.h>
+#include <pthread.h>
 
+#include "config.h"
+#ifdef HAVE_SYS_EPOLL_H
+#include <sys/epoll.h>
+#endif
 #include "iorecord.h"
+#include "telemetry.h"
+#include "staginglog.h"
 #include "telemdaemon.h"
 #include "common.h"
 #include "util.h"
 #include "log.h"
 #include "configuration.h"
+#include "metrics.h"
+#include "recordtrace.h"
+#include "membudget.h"
+
+/* A record body, raw bodies are staged as their exact bytes */
+struct body_view {
+        const char *data;
+        size_t len;
+        bool raw;
+        /* stages the record went through so far, staged with record_tracing
+         * enabled, or NULL */
+        struct record_trace *trace;
+};
 
 static void process_record(TelemDaemon *daemon, client *cl);
+static bool start_stream_record(TelemDaemon *daemon, client *cl);
+static bool finish_stream_record(client *cl);
+
+/* Held for reading while a record is processed, so SIGHUP does not reload
+ * the configuration under a worker thread */
+static pthread_rwlock_t config_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+/* Record ring shared with telempostd, used by all worker threads */
+static pthread_mutex_t ring_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct tm_ring record_ring = { NULL, NULL, 0, -1, -1 };
+static int ring_conn = -1;
+static time_t ring_retry_time = 0;
 
 void initialize_probe_daemon(TelemDaemon *daemon)
 {
@@ -45,7 +76,11 @@ void initialize_probe_daemon(TelemDaemon *daemon)
         daemon->nfds = 0;
         daemon->pollfds = NULL;
         daemon->client_head = head;
+        daemon->epfd = -1;
         daemon->machine_id_override = NULL;
+        daemon->recv_pool_count = 0;
+        daemon->shard = -1;
+        daemon->seqpacket = false;
 }
 
 client *add_client(client_list_head *client_head, int fd)
@@ -55,8 +90,15 @@ client *add_client(client_list_head *client_head, int fd)
         cl = (client *)malloc(sizeof(client));
         if (cl) {
                 cl->fd = fd;
+                cl->state = CLIENT_READ_SIZE;
+                cl->record_size = 0;
                 cl->offset = 0;
+                cl->size = 0;
                 cl->buf = NULL;
+                cl->stream_left = 0;
+                cl->stream = NULL;
+                cl->stream_path = NULL;
+                cl->stream_dest = NULL;
 
                 LIST_INSERT_HEAD(client_head, cl, client_ptrs);
         }
@@ -70,6 +112,13 @@ void remove_client(client_list_head *client_head, client *cl)
         if (cl->buf) {
                 free(cl->buf);
         }
+        if (cl->stream) {
+                /* Hung up in the middle of a large record */
+                fclose(cl->stream);
+                unlink(cl->stream_path);
+        }
+        free(cl->stream_path);
+        free(cl->stream_dest);
         if (cl->fd >= 0) {
                 close(cl->fd);
         }
@@ -83,119 +132,320 @@ bool is_client_list_empty(client_list_head *client_head)
 }
 
 
-static void terminate_client(TelemDaemon *daemon, client *cl, nfds_t index)
-{
-        /* Remove fd from the pollfds array */
-        del_pollfd(daemon, index);
-
-        telem_log(LOG_INFO, "Removing client: %d\n", cl->fd);
-
-        /* Remove client from the client list */
-        remove_client(&(daemon->client_head), cl);
-}
-
 /*
  See "tm_send_record" for record retails.
 
  recv buffer layout:
          * <uint32_t record_size>    : so recv knows how much to read
          * <custom cfg file field>   : optional, variable size (string)
+         * <RAW prefix>              : optional, for binary payloads
          * <uint32_t header_size>
          * <headers + Payload>
          * <null-byte>
 
- The routine handle_client only cares about "record_size".
+ The routine handle_client only cares about "record_size". Over a
+ SOCK_SEQPACKET socket, the size field and the body are received at once,
+ a record up to MAX_RECORD_SIZE being a single message.
  However, we need to validate if the record_size is reasonable. We assume the
  worst case scenario would be a record with max cfg file field. There is no
  exact way to determine header_size, so we assume each line at most 80 chars.
- 
+
+ Records with a binary payload may be larger, by up to raw_payload_max_size.
+ Only the beginning of those, with the headers, is read into a receive
+ buffer. The rest of their payload is written to disk as it is received.
 */
 
-#define MAX_RECORD_SIZE (2*sizeof(uint32_t) + CFG_PREFIX_LENGTH + PATH_MAX + \
-        MAX_PAYLOAD_LENGTH + NUM_HEADERS*80)
-bool handle_client(TelemDaemon *daemon, nfds_t index, client *cl)
+/* Receive buffers fit the largest record body, plus a terminating null byte
+ * in case the client did not send one */
+#define RECV_BUF_SIZE (MAX_RECORD_SIZE - RECORD_SIZE_LEN + 1)
+
+/* Gets the size of the largest record a client may send */
+static size_t max_record_size(void)
 {
-        /* For now  read data from fd */
-        ssize_t len;
-        size_t buf_size;
-        bool processed = false;
-        uint32_t record_size;
+        size_t size;
 
-        if (cl->buf != NULL) {
-                free(cl->buf);
-                cl->buf = NULL;
+        pthread_rwlock_rdlock(&config_lock);
+        size = MAX_RECORD_SIZE + raw_payload_max_size_config();
+        pthread_rwlock_unlock(&config_lock);
+
+        return size;
+}
+
+static uint8_t *get_recv_buf(TelemDaemon *daemon)
+{
+        uint8_t *buf;
+
+        if (daemon->recv_pool_count > 0) {
+                return daemon->recv_pool[--daemon->recv_pool_count];
         }
 
-        malloc_trim(0);
-        len = recv(cl->fd, &record_size, RECORD_SIZE_LEN, MSG_PEEK | MSG_DONTWAIT);
-        if (len < 0) {
-                telem_log(LOG_ERR, "Failed to talk to client %d: %s\n", cl->fd,
-                          strerror(errno));
-                goto end_client;
-        } else if (len == 0) {
-                /* Connection closed by client, most likely */
-                telem_log(LOG_INFO, "No data to receive from client %d\n",
-                          cl->fd);
-                goto end_client;
+        buf = malloc(RECV_BUF_SIZE);
+        if (!buf) {
+                telem_log(LOG_ERR, "Unable to allocate memory, exiting\n");
+                exit(EXIT_FAILURE);
         }
 
-        /* Read the record size first */
-        len = recv(cl->fd, &record_size, RECORD_SIZE_LEN, 0);
-        if (len < 0) {
-                telem_log(LOG_ERR, "Failed to receive data from client"
-                                  " %d: %s\n", cl->fd, strerror(errno));
-                goto end_client;
-        } else if (len == 0) {
-                telem_log(LOG_DEBUG, "End of transmission for client"
-                          " %d\n", cl->fd);
-                goto end_client;
+        return buf;
+}
+
+static void put_recv_buf(TelemDaemon *daemon, uint8_t *buf)
+{
+        if (daemon->recv_pool_count < TM_RECV_POOL_SIZE) {
+                daemon->recv_pool[daemon->recv_pool_count++] = buf;
+        } else {
+                free(buf);
         }
+}
 
-        /* Now that we know the record size, allocate a new buffer
-         * for the record body. We don't need to record size itself in the body.
-         */
+void trim_probe_daemon(TelemDaemon *daemon)
+{
+        while (daemon->recv_pool_count > 0) {
+                free(daemon->recv_pool[--daemon->recv_pool_count]);
+        }
+        mem_budget_check(true);
+}
 
-        if (record_size <= RECORD_SIZE_LEN || record_size > MAX_RECORD_SIZE) {
-                telem_log(LOG_ERR, "Record size %u greater tham maximum allowed %lu."
-                                    "Recored ignored\n", record_size,
-                                    MAX_RECORD_SIZE);
-                goto end_client;      
+/* Records read from one client per wakeup, so that a client streaming many
+ * records does not starve the others */
+#define TM_CLIENT_RECORD_BUDGET 32
+
+/**
+ * Ask to be woken again for a client that was left with data to read.
+ * Poll is level-triggered and reports the client again on its own; an
+ * edge-triggered epoll registration has to be re-armed.
+ */
+static void rearm_client(TelemDaemon *daemon, client *cl)
+{
+#ifdef HAVE_SYS_EPOLL_H
+        struct epoll_event ev;
+
+        if (daemon->epfd < 0) {
+                return;
         }
 
-        buf_size = record_size - RECORD_SIZE_LEN;
-        cl->buf = calloc(1, buf_size);
-        if (!cl->buf) {
-                telem_log(LOG_ERR, "Unable to allocate memory, exiting\n");
-                exit(EXIT_FAILURE);
+        memset(&ev, 0, sizeof(ev));
+        ev.events = EPOLLIN | EPOLLRDHUP | EPOLLET;
+        ev.data.ptr = cl;
+        if (epoll_ctl(daemon->epfd, EPOLL_CTL_MOD, cl->fd, &ev) < 0) {
+                telem_perror("Failed to re-arm client");
+        }
+#endif
+}
+
+static void terminate_client(TelemDaemon *daemon, client *cl, nfds_t index)
+{
+        /* Remove fd from the pollfds array. With epoll, closing the fd
+         * removes it from the epoll set. */
+        if (daemon->epfd < 0) {
+                del_pollfd(daemon, index);
         }
-        cl->size = buf_size;
-        cl->offset = 0;
 
-        /* Read the actual record*/
-        do {
-                malloc_trim(0);
-                len = recv(cl->fd, cl->buf + cl->offset, cl->size - cl->offset, 0);
+        telem_log(LOG_INFO, "Removing client: %d\n", cl->fd);
+
+        if (cl->buf) {
+                put_recv_buf(daemon, cl->buf);
+                cl->buf = NULL;
+        }
+
+        /* Remove client from the client list */
+        remove_client(&(daemon->client_head), cl);
+}
+
+/* Receives from a client. A message of a SOCK_SEQPACKET socket must fit,
+ * what did not would be lost. */
+static ssize_t recv_client(client *cl, struct iovec *iov, int iovcnt)
+{
+        struct msghdr msg;
+        ssize_t len;
+
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = (size_t)iovcnt;
+        len = recvmsg(cl->fd, &msg, MSG_DONTWAIT);
+        if (len > 0 && (msg.msg_flags & MSG_TRUNC)) {
+                errno = EMSGSIZE;
+                return -1;
+        }
+
+        return len;
+}
+
+bool handle_client(TelemDaemon *daemon, nfds_t index, client *cl)
+{
+        struct iovec iov[2];
+        ssize_t len;
+        bool received = false;
+        bool processed = false;
+        int budget = TM_CLIENT_RECORD_BUDGET;
+
+        /* Read whatever the socket has buffered, without blocking. A record
+         * may arrive over several wakeups, so the client keeps its place in
+         * the record between calls. A client may also stream several
+         * records over one connection (see tm_send_records).
+         */
+        while (budget > 0) {
+                if (cl->state == CLIENT_READ_SIZE && daemon->seqpacket) {
+                        /* The size field and the body in a single message */
+                        if (!cl->buf) {
+                                cl->buf = get_recv_buf(daemon);
+                        }
+                        iov[0].iov_base = &cl->record_size;
+                        iov[0].iov_len = RECORD_SIZE_LEN;
+                        iov[1].iov_base = cl->buf;
+                        iov[1].iov_len = RECV_BUF_SIZE - 1;
+                        len = recv_client(cl, iov, 2);
+                } else if (cl->state == CLIENT_READ_SIZE) {
+                        iov[0].iov_base = (uint8_t *)&cl->record_size + cl->offset;
+                        iov[0].iov_len = RECORD_SIZE_LEN - cl->offset;
+                        len = recv_client(cl, iov, 1);
+                } else if (cl->state == CLIENT_STREAM_BODY) {
+                        iov[0].iov_base = cl->buf;
+                        iov[0].iov_len = cl->stream_left < RECV_BUF_SIZE ?
+                                         cl->stream_left : RECV_BUF_SIZE;
+                        len = recv_client(cl, iov, 1);
+                } else {
+                        iov[0].iov_base = cl->buf + cl->offset;
+                        iov[0].iov_len = cl->size - cl->offset;
+                        len = recv_client(cl, iov, 1);
+                }
+
                 if (len < 0) {
+                        if (errno == EINTR) {
+                                continue;
+                        }
+                        /* With poll, the client was readable, so having
+                         * nothing to read is an error. Edge-triggered
+                         * epoll may report a client whose data was already
+                         * drained on a previous wakeup. */
+                        if ((received || daemon->epfd >= 0) &&
+                            (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                                /* Nothing more for now, wait for the rest */
+                                telem_debug("DEBUG: Client %d drained\n", cl->fd);
+                                if (cl->state == CLIENT_READ_SIZE && cl->buf) {
+                                        put_recv_buf(daemon, cl->buf);
+                                        cl->buf = NULL;
+                                }
+                                return processed;
+                        }
                         telem_log(LOG_ERR, "Failed to receive data from client"
                                   " %d: %s\n", cl->fd, strerror(errno));
                         goto end_client;
                 } else if (len == 0) {
-                        telem_log(LOG_DEBUG, "End of transmission for client"
-                                  " %d\n", cl->fd);
+                        if (cl->state != CLIENT_READ_SIZE || cl->offset > 0) {
+                                telem_log(LOG_ERR, "Client %d hung up in the middle"
+                                          " of a record\n", cl->fd);
+                        } else {
+                                /* Connection closed by client, most likely */
+                                telem_log(LOG_INFO, "No data to receive from client %d\n",
+                                          cl->fd);
+                        }
                         goto end_client;
                 }
 
+                received = true;
+                metrics_count(METRIC_PROBD_BYTES_RECEIVED, (uint64_t)len);
+                if (cl->state == CLIENT_READ_SIZE && cl->offset == 0) {
+                        cl->received_time = trace_clock();
+                }
+
+                if (cl->state == CLIENT_STREAM_BODY) {
+                        /* The null byte ending the record is not staged */
+                        size_t size = (size_t)len - ((size_t)len == cl->stream_left);
+
+                        cl->stream_left -= (size_t)len;
+                        if (fwrite(cl->buf, 1, size, cl->stream) != size) {
+                                telem_perror("Error writing large record");
+                                goto end_client;
+                        }
+                        if (cl->stream_left > 0) {
+                                continue;
+                        }
+                        if (!finish_stream_record(cl)) {
+                                goto end_client;
+                        }
+                        put_recv_buf(daemon, cl->buf);
+                        cl->buf = NULL;
+                        cl->offset = 0;
+                        cl->state = CLIENT_READ_SIZE;
+                        processed = true;
+                        budget--;
+                        telem_debug("DEBUG: Large record staged for client %d\n", cl->fd);
+                        continue;
+                }
+
                 cl->offset += (size_t)len;
 
-                if (cl->offset == cl->size) {
+                if (cl->state == CLIENT_READ_SIZE) {
+                        size_t body_received;
+
+                        if (cl->offset < RECORD_SIZE_LEN && daemon->seqpacket) {
+                                telem_log(LOG_ERR, "Message of client %d shorter than"
+                                          " a record size\n", cl->fd);
+                                goto end_client;
+                        } else if (cl->offset < RECORD_SIZE_LEN) {
+                                continue;
+                        }
+                        body_received = cl->offset - RECORD_SIZE_LEN;
+
+                        /* Now that we know the record size, get a buffer for
+                         * the record body. We don't need to record size itself
+                         * in the body.
+                         */
+                        if (cl->record_size <= RECORD_SIZE_LEN ||
+                            cl->record_size > max_record_size()) {
+                                telem_log(LOG_ERR, "Record size %u greater tham maximum allowed %zu."
+                                          "Recored ignored\n", cl->record_size,
+                                          max_record_size());
+                                metrics_count(METRIC_PROBD_RECORDS_REJECTED, 1);
+                                goto end_client;
+                        }
+
+                        if (!cl->buf) {
+                                cl->buf = get_recv_buf(daemon);
+                        }
+                        cl->size = cl->record_size - RECORD_SIZE_LEN;
+                        cl->stream_left = 0;
+                        if (cl->size > RECV_BUF_SIZE - 1) {
+                                /* Only the beginning of the record is kept */
+                                cl->stream_left = cl->size - (RECV_BUF_SIZE - 1);
+                                cl->size = RECV_BUF_SIZE - 1;
+                        }
+                        if (body_received > cl->size) {
+                                telem_log(LOG_ERR, "Message of client %d longer than"
+                                          " its record\n", cl->fd);
+                                metrics_count(METRIC_PROBD_RECORDS_REJECTED, 1);
+                                goto end_client;
+                        }
+                        /* Received already with the seqpacket transport */
+                        cl->offset = body_received;
+                        cl->state = CLIENT_READ_BODY;
+                }
+
+                if (cl->offset < cl->size) {
+                        continue;
+                } else if (cl->stream_left > 0) {
+                        cl->buf[cl->size] = '\0';
+                        if (!start_stream_record(daemon, cl)) {
+                                goto end_client;
+                        }
+                        cl->offset = 0;
+                        cl->state = CLIENT_STREAM_BODY;
+                } else {
+                        cl->buf[cl->size] = '\0';
                         process_record(daemon, cl);
-                        free(cl->buf);
+                        put_recv_buf(daemon, cl->buf);
                         cl->buf = NULL;
+                        cl->offset = 0;
+                        cl->state = CLIENT_READ_SIZE;
                         processed = true;
+                        budget--;
                         telem_debug("DEBUG: Record processed for client %d\n", cl->fd);
-                        break;
                 }
-        } while (len > 0);
+        }
+
+        /* Out of budget, come back to this client after the others */
+        rearm_client(daemon, cl);
+        return processed;
 
 end_client:
         telem_log(LOG_DEBUG, "Processed client %d: %s\n", cl->fd, processed ? "true" : "false");
@@ -249,10 +499,10 @@ char *read_machine_id_override()
         return machine_override;
 }
 
-static void machine_id_replace(char **machine_header, char *machine_id_override)
+static void machine_id_replace(struct header_view *machine_header, char *buf,
+                               size_t buf_size, char *machine_id_override)
 {
         char machine_id[33] = { 0 };
-        char *old_header;
         int ret;
 
         if (machine_id_override) {
@@ -264,23 +514,61 @@ static void machine_id_replace(char **machine_header, char *machine_id_override)
                 }
         }
 
-        old_header = *machine_header;
-        ret = asprintf(machine_header, "%s: %s", TM_MACHINE_ID_STR, machine_id);
-
-        if (ret == -1) {
+        ret = snprintf(buf, buf_size, "%s: %s", TM_MACHINE_ID_STR, machine_id);
+        if (ret < 0 || (size_t)ret >= buf_size) {
                 telem_log(LOG_ERR, "Failed to write machine id header\n");
                 exit(EXIT_FAILURE);
         }
-        free(old_header);
+
+        machine_header->data = buf;
+        machine_header->len = (size_t)ret;
 }
 
-static void stage_record(char *filepath, char *headers[], char *body, char *cfg_file)
+static void write_staged_record(FILE *fp, struct header_view headers[],
+                                const struct body_view *body, char *cfg_file)
+{
+        // write cfg info if exists
+        if (cfg_file != NULL) {
+                fprintf(fp, "%s%s\n", CFG_PREFIX, cfg_file);
+        }
+
+        // mark binary payloads
+        if (body->raw) {
+                fprintf(fp, "%s\n", RAW_PREFIX);
+        }
+
+        // then the stages of a traced record, up to now
+        if (body->trace && record_tracing_config()) {
+                char line[TRACE_LINE_LENGTH];
+
+                body->trace->times[TRACE_STAGED] = trace_clock();
+                trace_format(body->trace, line);
+                fprintf(fp, "%.*s\n", TRACE_LINE_LENGTH, line);
+        }
+
+        // write headers
+        for (int i = 0; i < NUM_HEADERS; i++) {
+                fprintf(fp, "%.*s\n", (int)headers[i].len, headers[i].data);
+        }
+
+        // write body, binary payloads as they are
+        if (body->raw) {
+                fwrite(body->data, 1, body->len, fp);
+        } else {
+                fprintf(fp, "%.*s\n", (int)body->len, body->data);
+        }
+}
+
+static bool stage_record(char *filepath, struct header_view headers[],
+                         const struct body_view *body, char *cfg_file)
 {
         int tmpfd;
         FILE *tmpfile = NULL;
 
         telem_debug("DEBUG: filepath:%s\n", filepath);
-        telem_debug("DEBUG: body:%s\n", body);
+        if (!body->raw) {
+                telem_debug("DEBUG: body:%.*s\n", (int)body->len, body->data);
+        }
         telem_debug("DEBUG: cfg:%s\n", cfg_file);
 
         if (filepath == NULL) {
@@ -291,7 +579,7 @@ static void stage_record(char *filepath, char *headers[], char *body, char *cfg_
         tmpfd = mkstemp(filepath);
         if (tmpfd < 0) {
                 telem_perror("Error opening staging file");
-                goto clean_exit;
+                return false;
         }
 
         // access the opened file as a stream
@@ -302,101 +590,504 @@ static void stage_record(char *filepath, char *headers[], char *body, char *cfg_
                 if (unlink(filepath)) {
                         telem_perror("Error deleting temp stage file");
                 }
-                goto clean_exit;
+                return false;
         }
 
-        // write cfg info if exists
-        if (cfg_file != NULL) {
-                fprintf(tmpfile, "%s%s\n", CFG_PREFIX, cfg_file);
+        write_staged_record(tmpfile, headers, body, cfg_file);
+        fflush(tmpfile);
+        fclose(tmpfile);
+
+        return true;
+}
+
+static char *staging_shard_dir(int shard)
+{
+        char *dir = NULL;
+
+        if (asprintf(&dir, "%s/%s%d", spool_dir_config(), TM_STAGING_SHARD_PREFIX,
+                     shard) == -1) {
+                telem_log(LOG_ERR, "Failed to allocate memory for staging shard path, aborting\n");
+                exit(EXIT_FAILURE);
         }
 
-        // write headers
-        for (int i = 0; i < NUM_HEADERS; i++) {
-                fprintf(tmpfile, "%s\n", headers[i]);
+        return dir;
+}
+
+int create_staging_shard(int shard)
+{
+        char *dir = staging_shard_dir(shard);
+        int ret = 0;
+
+        if (mkdir(dir, S_IRWXU) != 0 && errno != EEXIST) {
+                ret = -errno;
+                telem_perror("Unable to create staging shard directory");
         }
+        free(dir);
 
-        // write body
-        fprintf(tmpfile, "%s\n", body);
-        fflush(tmpfile);
-        fclose(tmpfile);
+        return ret;
+}
 
-clean_exit:
+/* Stages the record in the shard of a worker thread, and moves it into the
+ * spool dir once complete, so worker threads do not create files in the same
+ * directory */
+static void stage_record_shard(int shard, struct header_view headers[],
+                               const struct body_view *body, char *cfg_file)
+{
+        char *dir = staging_shard_dir(shard);
+        char *tmppath = NULL;
+        char *recordpath = NULL;
 
-        return;
+        do {
+                free(tmppath);
+                free(recordpath);
+                recordpath = NULL;
+
+                if (asprintf(&tmppath, "%s/XXXXXX", dir) == -1) {
+                        telem_log(LOG_ERR, "Failed to allocate memory for record name in staging shard, aborting\n");
+                        exit(EXIT_FAILURE);
+                }
+                if (!stage_record(tmppath, headers, body, cfg_file)) {
+                        goto out;
+                }
+
+                if (asprintf(&recordpath, "%s/%s", spool_dir_config(),
+                             tmppath + strlen(dir) + 1) == -1) {
+                        telem_log(LOG_ERR, "Failed to allocate memory for record name in staging folder, aborting\n");
+                        exit(EXIT_FAILURE);
+                }
+
+                /* Name taken by a record of another shard, stage it again */
+                if (access(recordpath, F_OK) == 0) {
+                        unlink(tmppath);
+                        continue;
+                }
+                break;
+        } while (1);
+
+        if (rename(tmppath, recordpath) != 0) {
+                telem_perror("Error moving record from staging shard");
+                unlink(tmppath);
+        }
+
+out:
+        free(recordpath);
+        free(tmppath);
+        free(dir);
 }
 
-static void process_record(TelemDaemon *daemon, client *cl)
+bool reload_probe_config(void)
+{
+        bool ret;
+
+        pthread_rwlock_wrlock(&config_lock);
+        ret = reload_config();
+        pthread_rwlock_unlock(&config_lock);
+
+        return ret;
+}
+
+static char *format_staged_record(struct header_view headers[],
+                                  const struct body_view *body, char *cfg_file,
+                                  size_t *size)
+{
+        char *data = NULL;
+        FILE *fp;
+
+        fp = open_memstream(&data, size);
+        if (!fp) {
+                telem_log(LOG_ERR, "Unable to allocate memory, exiting\n");
+                exit(EXIT_FAILURE);
+        }
+
+        write_staged_record(fp, headers, body, cfg_file);
+        if (fclose(fp) != 0) {
+                telem_log(LOG_ERR, "Unable to allocate memory, exiting\n");
+                exit(EXIT_FAILURE);
+        }
+
+        return data;
+}
+
+static void stage_record_log(struct header_view headers[], const struct body_view *body,
+                             char *cfg_file)
+{
+        char *data = NULL;
+        size_t size = 0;
+
+        data = format_staged_record(headers, body, cfg_file, &size);
+        if (staging_log_append(data, size) < 0) {
+                telem_log(LOG_ERR, "Failed to stage record, dropping it\n");
+        }
+        free(data);
+}
+
+static void drop_record_ring(void)
+{
+        if (ring_conn >= 0) {
+                close(ring_conn);
+                ring_conn = -1;
+        }
+        ring_destroy(&record_ring);
+}
+
+void close_record_ring(void)
+{
+        pthread_mutex_lock(&ring_lock);
+        drop_record_ring();
+        pthread_mutex_unlock(&ring_lock);
+}
+
+/* Called with ring_lock held */
+static bool record_ring_ready(void)
+{
+        struct pollfd pfd;
+        time_t now;
+        int ret;
+
+        if (ring_conn >= 0) {
+                /* telempostd closes the connection when it drops the ring */
+                pfd.fd = ring_conn;
+                pfd.events = POLLIN;
+                pfd.revents = 0;
+                if (poll(&pfd, 1, 0) == 0) {
+                        return true;
+                }
+                telem_log(LOG_INFO, "Record ring closed, staging records on disk\n");
+                drop_record_ring();
+        }
+
+        now = time(NULL);
+        if (now < ring_retry_time) {
+                return false;
+        }
+        ring_retry_time = now + TM_RING_RETRY_INTERVAL;
+
+        ret = ring_connect(&record_ring);
+        if (ret < 0) {
+                telem_debug("DEBUG: Record ring not available: %s\n", strerror(-ret));
+                return false;
+        }
+        ring_conn = ret;
+        telem_log(LOG_INFO, "Handing records to telempostd through the record ring\n");
+
+        return true;
+}
+
+static bool stage_record_ring(struct header_view headers[], const struct body_view *body,
+                              char *cfg_file)
+{
+        char *data = NULL;
+        size_t size = 0;
+        bool ready;
+        int ret = -ENOTCONN;
+
+        pthread_mutex_lock(&ring_lock);
+        ready = record_ring_ready();
+        pthread_mutex_unlock(&ring_lock);
+        if (!ready) {
+                return false;
+        }
+
+        data = format_staged_record(headers, body, cfg_file, &size);
+
+        pthread_mutex_lock(&ring_lock);
+        /* Another thread may have dropped the ring in between */
+        if (record_ring.header) {
+                ret = ring_push(&record_ring, data, size);
+        }
+        pthread_mutex_unlock(&ring_lock);
+        free(data);
+
+        if (ret < 0) {
+                /* telempostd is backed up, fall back to the disk */
+                telem_debug("DEBUG: Record not pushed to ring: %s\n", strerror(-ret));
+                return false;
+        }
+
+        return true;
+}
+
+/* Stages a record wherever the configuration has records go */
+static void stage_record_views(TelemDaemon *daemon, struct header_view headers[],
+                               const struct body_view *body, char *cfg_file)
+{
+        char *recordpath = NULL;
+        uint64_t start = metrics_clock();
+        int ret;
+
+        pthread_rwlock_rdlock(&config_lock);
+
+        /* Hand the record to telempostd without going through the disk */
+        if (ring_buffer_enabled_config() && stage_record_ring(headers, body, cfg_file)) {
+                goto end;
+        }
+
+        /* Save record to stage */
+        if (staging_log_enabled_config()) {
+                stage_record_log(headers, body, cfg_file);
+                goto end;
+        }
+
+        if (daemon->shard >= 0) {
+                stage_record_shard(daemon->shard, headers, body, cfg_file);
+                goto end;
+        }
+
+        ret = asprintf(&recordpath, "%s/XXXXXX", spool_dir_config());
+        if (ret == -1) {
+                telem_log(LOG_ERR, "Failed to allocate memory for record name in staging folder, aborting\n");
+                exit(EXIT_FAILURE);
+        }
+
+        stage_record(recordpath, headers, body, cfg_file);
+        free(recordpath);
+end:
+        pthread_rwlock_unlock(&config_lock);
+        metrics_observe(METRIC_PROBD_STAGE_TIME, metrics_clock() - start);
+}
+
+void stage_local_record(TelemDaemon *daemon, struct telem_ref *t_ref)
+{
+        struct header_view headers[NUM_HEADERS];
+        char machine_header[sizeof(TM_MACHINE_ID_STR) + 40];
+        struct record_trace trace = { 0 };
+        struct body_view body;
+
+        /* The headers of the library end with a newline, views do not */
+        for (int i = 0; i < NUM_HEADERS; i++) {
+                headers[i].data = t_ref->record->headers[i];
+                headers[i].len = strlen(headers[i].data);
+                if (headers[i].len > 0 && headers[i].data[headers[i].len - 1] == '\n') {
+                        headers[i].len--;
+                }
+        }
+        machine_id_replace(&headers[TM_MACHINE_ID], machine_header,
+                           sizeof(machine_header), daemon->machine_id_override);
+
+        body.data = t_ref->record->payload ? t_ref->record->payload : "";
+        body.len = t_ref->record->payload_size;
+        body.raw = t_ref->record->raw_payload;
+        body.trace = &trace;
+        trace.times[TRACE_RECEIVED] = trace_clock();
+        stage_record_views(daemon, headers, &body, NULL);
+}
+
+/**
+ * Parses the body buffer of a client, with the whole record or the beginning
+ * of a large record. The headers are used in place, except for the machine
+ * id header, which is written to machine_header. The times the record was
+ * sent, if the probe traced it, and received are set in trace.
+ *
+ * @return the offset of the payload in the buffer, or 0 if the record is
+ *     malformed
+ */
+static size_t parse_client_record(TelemDaemon *daemon, client *cl,
+                                  struct header_view headers[], char *machine_header,
+                                  size_t machine_header_size, char **cfg_file,
+                                  bool *raw, struct record_trace *trace)
 {
-        int i = 0;
-        int ret = 0;
-        char *headers[NUM_HEADERS];
-        char *tok = NULL;
         size_t header_size = 0;
-        size_t message_size = 0;
-        char *temp_headers = NULL;
         char *msg;
-        char *body;
-        char *recordpath = NULL;
-        char *cfg_file = NULL;;
         size_t cfg_info_size = 0;
         uint8_t *buf;
 
         buf = cl->buf;
+        *cfg_file = NULL;
+        *raw = false;
 
         /* Check for an optional CFG_PREFIX in the first 32 bits */
         if (*(uint32_t *)buf == CFG_PREFIX_32BIT) {
                 char *cfg  = (char *)cl->buf;
 
-                cfg_file = cfg + CFG_PREFIX_LENGTH;
-                cfg_info_size = CFG_PREFIX_LENGTH + strlen(cfg_file) + 1;
-                telem_debug("DEBUG: cfg_file: %s\n", cfg_file);
+                *cfg_file = cfg + CFG_PREFIX_LENGTH;
+                cfg_info_size = CFG_PREFIX_LENGTH + strlen(*cfg_file) + 1;
+                telem_debug("DEBUG: cfg_file: %s\n", *cfg_file);
+        }
+
+        /* Then for the RAW_PREFIX of binary payloads */
+        if (cfg_info_size + RAW_PREFIX_LENGTH <= cl->size &&
+            *(uint32_t *)(buf + cfg_info_size) == RAW_PREFIX_32BIT) {
+                *raw = true;
+                cfg_info_size += RAW_PREFIX_LENGTH;
+        }
+
+        /* And for the TRC_PREFIX of traced records */
+        memset(trace, 0, sizeof(struct record_trace));
+        trace->times[TRACE_RECEIVED] = cl->received_time;
+        if (cfg_info_size + TRC_PREFIX_LENGTH + sizeof(uint64_t) <= cl->size &&
+            *(uint32_t *)(buf + cfg_info_size) == TRC_PREFIX_32BIT) {
+                memcpy(&trace->times[TRACE_SEND], buf + cfg_info_size + TRC_PREFIX_LENGTH,
+                       sizeof(uint64_t));
+                cfg_info_size += TRC_PREFIX_LENGTH + sizeof(uint64_t);
         }
 
         buf += cfg_info_size;
         header_size = *(uint32_t *)buf;
-        message_size = cl->size - (cfg_info_size + header_size);
+        if (cfg_info_size + sizeof(uint32_t) + header_size > cl->size) {
+                telem_log(LOG_ERR, "process_record: Incorrect header size in record\n");
+                return 0;
+        }
         telem_debug("DEBUG: cl->size: %zu\n", cl->size);
         telem_debug("DEBUG: header_size: %zu\n", header_size);
-        telem_debug("DEBUG: message_size: %zu\n", message_size);
+        telem_debug("DEBUG: message_size: %zu\n", cl->size - (cfg_info_size + header_size));
         telem_debug("DEBUG: cfg_info_size: %zu\n", cfg_info_size);
-        assert(message_size > 0);      //TODO:Check for min and max limits
         msg = (char *)buf + sizeof(uint32_t);
 
-        /* Copying the headers as strtok modifies the orginal buffer */
-        temp_headers = strndup(msg, header_size);
-        tok = strtok(temp_headers, "\n");
+        /* Headers are used in place, they are only copied when staged */
+        if (parse_header_views(msg, header_size, headers) == 0) {
+                telem_log(LOG_ERR, "process_record: Incorrect headers in record\n");
+                return 0;
+        }
+        machine_id_replace(&headers[TM_MACHINE_ID], machine_header,
+                           machine_header_size, daemon->machine_id_override);
 
-        for (i = 0; i < NUM_HEADERS; i++) {
-                const char *header_name = get_header_name(i);
+        return (size_t)((uint8_t *)msg + header_size - cl->buf);
+}
 
-                if (get_header(tok, header_name, &headers[i])) {
-                        if (strcmp(header_name, TM_MACHINE_ID_STR) == 0) {
-                                machine_id_replace(&headers[i], daemon->machine_id_override);
-                        }
+static void process_record(TelemDaemon *daemon, client *cl)
+{
+        struct header_view headers[NUM_HEADERS];
+        char machine_header[sizeof(TM_MACHINE_ID_STR) + 40];
+        struct record_trace trace;
+        struct body_view body;
+        char *cfg_file;
+        size_t offset;
+
+        offset = parse_client_record(daemon, cl, headers, machine_header,
+                                     sizeof(machine_header), &cfg_file, &body.raw,
+                                     &trace);
+        if (offset == 0) {
+                metrics_count(METRIC_PROBD_RECORDS_REJECTED, 1);
+                return;
+        }
 
-                        tok = strtok(NULL, "\n");
-                } else {
-                        telem_log(LOG_ERR, "process_record: Incorrect headers in record\n");
-                        goto end;
-                }
+        /* The payload is sent with a null byte, text payloads end at the
+         * first one */
+        body.data = (char *)cl->buf + offset;
+        if (body.raw) {
+                body.len = cl->size > offset ? cl->size - offset - 1 : 0;
+        } else {
+                body.len = strnlen(body.data, cl->size - offset);
         }
-        /* TODO : check if the body is within the limits. */
-        body = msg + header_size;
+        body.trace = &trace;
 
-        /* Save record to stage */
-        ret = asprintf(&recordpath, "%s/XXXXXX", spool_dir_config());
-        if (ret == -1) {
-                telem_log(LOG_ERR, "Failed to allocate memory for record name in staging folder, aborting\n");
+        stage_record_views(daemon, headers, &body, cfg_file);
+        metrics_count(METRIC_PROBD_RECORDS_RECEIVED, 1);
+}
+
+/**
+ * Starts staging a record too large for the body buffer, of which the
+ * buffer holds the beginning. The record is written to a file in the
+ * stream directory, and moved into the spool directory once complete.
+ * Records staged this way do not go through the staging log or the record
+ * ring.
+ *
+ * @return true if the rest of the record can be received, false to drop the
+ *     client
+ */
+static bool start_stream_record(TelemDaemon *daemon, client *cl)
+{
+        struct header_view headers[NUM_HEADERS];
+        char machine_header[sizeof(TM_MACHINE_ID_STR) + 40];
+        struct record_trace trace;
+        struct body_view body;
+        char *cfg_file;
+        char *dir = NULL;
+        size_t offset;
+        int fd = -1;
+        bool ret = false;
+
+        offset = parse_client_record(daemon, cl, headers, machine_header,
+                                     sizeof(machine_header), &cfg_file, &body.raw,
+                                     &trace);
+        if (offset == 0) {
+                metrics_count(METRIC_PROBD_RECORDS_REJECTED, 1);
+                return false;
+        }
+        if (!body.raw) {
+                telem_log(LOG_ERR, "Record size %u greater tham maximum allowed %lu."
+                          "Recored ignored\n", cl->record_size, MAX_RECORD_SIZE);
+                metrics_count(METRIC_PROBD_RECORDS_REJECTED, 1);
+                return false;
+        }
+        body.data = (char *)cl->buf + offset;
+        body.len = cl->size - offset;
+        body.trace = &trace;
+
+        pthread_rwlock_rdlock(&config_lock);
+
+        if (asprintf(&dir, "%s/%s", spool_dir_config(), TM_STAGING_STREAM_DIR) == -1) {
+                telem_log(LOG_ERR, "Failed to allocate memory for stream path, aborting\n");
                 exit(EXIT_FAILURE);
         }
+        if (mkdir(dir, S_IRWXU) != 0 && errno != EEXIST) {
+                telem_perror("Unable to create stream directory");
+                goto out;
+        }
 
-        stage_record(recordpath, headers, body, cfg_file);
-        free(recordpath);
-end:
-        free(temp_headers);
-        for (int k = 0; k < i; k++)
-                free(headers[k]);
-        return;
+        /* The name must not be taken in the spool directory either */
+        do {
+                if (fd >= 0) {
+                        close(fd);
+                        unlink(cl->stream_path);
+                }
+                free(cl->stream_path);
+                free(cl->stream_dest);
+                cl->stream_dest = NULL;
+
+                if (asprintf(&cl->stream_path, "%s/XXXXXX", dir) == -1) {
+                        telem_log(LOG_ERR, "Failed to allocate memory for stream path, aborting\n");
+                        exit(EXIT_FAILURE);
+                }
+                fd = mkstemp(cl->stream_path);
+                if (fd < 0) {
+                        telem_perror("Error opening stream file");
+                        goto out;
+                }
+                if (asprintf(&cl->stream_dest, "%s/%s", spool_dir_config(),
+                             cl->stream_path + strlen(dir) + 1) == -1) {
+                        telem_log(LOG_ERR, "Failed to allocate memory for record name in staging folder, aborting\n");
+                        exit(EXIT_FAILURE);
+                }
+        } while (access(cl->stream_dest, F_OK) == 0);
+
+        cl->stream = fdopen(fd, "w");
+        if (!cl->stream) {
+                telem_perror("Error opening stream file");
+                close(fd);
+                unlink(cl->stream_path);
+                goto out;
+        }
+        write_staged_record(cl->stream, headers, &body, cfg_file);
+        ret = true;
+out:
+        pthread_rwlock_unlock(&config_lock);
+        free(dir);
+
+        return ret;
+}
+
+/* Moves a large record into the spool directory once it is received */
+static bool finish_stream_record(client *cl)
+{
+        FILE *stream = cl->stream;
+
+        cl->stream = NULL;
+        if (fclose(stream) != 0) {
+                telem_perror("Error writing large record");
+                unlink(cl->stream_path);
+                return false;
+        }
+
+        if (rename(cl->stream_path, cl->stream_dest) != 0) {
+                telem_perror("Error moving large record into the spool");
+                unlink(cl->stream_path);
+                return true;
+        }
+        metrics_count(METRIC_PROBD_RECORDS_RECEIVED, 1);
+        metrics_count(METRIC_PROBD_RECORDS_STREAMED, 1);
+
+        return true;
 }
 
 void add_pollfd(TelemDaemon *daemon, int fd, short events)
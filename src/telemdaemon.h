@@ -19,9 +19,15 @@
 #define __STDC_FORMAT_MACROS    /* for PRIu64 */
 
 #include <poll.h>
+#include <stdio.h>
 #include <sys/queue.h>
 #include <stdbool.h>
 #include <inttypes.h>
+#include <time.h>
+
+#include "ringbuf.h"
+
+struct telem_ref;
 
 #define TM_MACHINE_ID_EXPIRY (3 /*d*/ * 24 /*h*/ * 60 /*m*/ * 60 /*s*/)
 
@@ -35,11 +41,47 @@
 
 #define TM_RECORD_COUNTER (1)
 
+/* Staging shard directories of worker threads, under the spool directory */
+#define TM_STAGING_SHARD_PREFIX ".shard."
+
+/* Directory under the spool directory where records too large for a
+ * receive buffer are written as they are received */
+#define TM_STAGING_STREAM_DIR ".stream"
+
+/* Seconds between attempts to get the record ring from telempostd */
+#define TM_RING_RETRY_INTERVAL 5
+
+/* Number of receive buffers kept around for reuse between records */
+#define TM_RECV_POOL_SIZE 8
+
+/* Where a client is in receiving the current record */
+enum client_state {
+        CLIENT_READ_SIZE = 0,
+        CLIENT_READ_BODY,
+        /* the body of a large record is written to a file as it arrives */
+        CLIENT_STREAM_BODY
+};
+
 typedef struct client {
         int fd;
+        enum client_state state;
+        /* size of the record being received, including the size field */
+        uint32_t record_size;
+        /* record body, only allocated in CLIENT_READ_BODY */
         uint8_t *buf;
+        /* bytes received of the size field or the body */
         size_t offset;
         size_t size;
+        /* bytes of a large record left once the body buffer is full, and
+         * the file they are written to in CLIENT_STREAM_BODY, renamed to
+         * stream_dest once complete */
+        size_t stream_left;
+        FILE *stream;
+        char *stream_path;
+        char *stream_dest;
+        /* time the first bytes of the record were received, see
+         * trace_clock() */
+        uint64_t received_time;
         LIST_ENTRY(client) client_ptrs;
 } client;
 
@@ -54,7 +96,17 @@ typedef struct TelemDaemon {
         size_t current_alloc;
         /* client list head */
         client_list_head client_head;
+        /* epoll fd when the epoll backend is used, -1 with poll */
+        int epfd;
         char *machine_id_override;
+        /* receive buffers released by clients */
+        uint8_t *recv_pool[TM_RECV_POOL_SIZE];
+        size_t recv_pool_count;
+        /* staging shard of a worker thread, -1 to stage in the spool dir */
+        int shard;
+        /* clients are connected over a SOCK_SEQPACKET socket, and send each
+         * record as one message, see TM_PACKET_SIZE */
+        bool seqpacket;
 } TelemDaemon;
 
 /**
@@ -84,14 +136,63 @@ void add_pollfd(TelemDaemon *daemon, int fd, short events);
 void del_pollfd(TelemDaemon *daemon, nfds_t i);
 
 /**
- * Handle data received on a client connection
+ * Release the pooled receive buffers and return free memory to the system.
+ * Meant to be called when the daemon is idle.
+ *
+ * @param daemon The pointer to the daemon
+ *
+ */
+void trim_probe_daemon(TelemDaemon *daemon);
+
+/**
+ * Drop the record ring shared with telempostd, records are staged on disk
+ * until it is received again.
+ *
+ */
+void close_record_ring(void);
+
+/**
+ * Reload the configuration file. Waits for records being processed by
+ * worker threads, which read the configuration while staging.
+ *
+ * @return true if the configuration was reloaded, false if the one in use
+ *     was kept
+ */
+bool reload_probe_config(void);
+
+/**
+ * Stage a record created in the daemon with tm_create_record(), the same way
+ * as the records received from clients, with the machine id header of the
+ * daemon.
+ *
+ * @param daemon The pointer to the daemon
+ * @param t_ref The record, with a payload
+ *
+ */
+void stage_local_record(TelemDaemon *daemon, struct telem_ref *t_ref);
+
+/**
+ * Create the staging shard directory of a worker thread. Records staged in
+ * a shard are moved into the spool directory once complete.
+ *
+ * @param shard The shard number
+ *
+ * @return 0 on success, or a negative errno-style value on error
+ */
+int create_staging_shard(int shard);
+
+/**
+ * Handle data received on a client connection. Reads whatever the
+ * connection has buffered without blocking, and processes every record
+ * that is complete. A partially received record is resumed on the next
+ * call. The client is removed once it hangs up or sends malformed data.
  *
  * @param daemon The pointer to the daemon
  * @param ind The index of the client's file desciptor in the
- *    pollfd array
+ *    pollfd array, unused with the epoll backend
  * @param cl Pointer to the client structure in the client list
  *
- * @return true on success, false on failure
+ * @return true if at least one record was processed, false otherwise
  */
 bool handle_client(TelemDaemon *daemon, nfds_t ind, client *cl);
 
@@ -26,16 +26,21 @@
 #include <unistd.h>
 #include <errno.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <sys/un.h>
+#include <poll.h>
 #include <limits.h>
 #include <inttypes.h>
-#include <ctype.h>
+#include <pthread.h>
 
 #include "util.h"
 #include "common.h"
 #include "configuration.h"
 #include "telemetry.h"
 #include "log.h"
+#include "recordtrace.h"
+#include "sampling.h"
+#include "validate.h"
 
 /**
  * Return a file descriptor to either site's version file
@@ -774,6 +779,208 @@ static int set_payload_format_header(struct telem_ref *t_ref, uint32_t payload_v
         return status;
 }
 
+/*
+ * Headers whose values do not change while a probe is running are computed
+ * once and copied into subsequent records. The OS build and system name come
+ * from os-release and change after an update, so the cache is dropped when the
+ * mtime of either os-release file changes. The files are only checked every
+ * TM_HEADER_CACHE_CHECK seconds.
+ */
+#define TM_HEADER_CACHE_CHECK 60
+
+struct header_cache {
+        char *headers[NUM_HEADERS];
+        time_t last_check;
+        time_t site_mtime;
+        time_t dist_mtime;
+        /* incremented each time the cache is dropped */
+        unsigned generation;
+};
+
+static struct header_cache header_cache = { { NULL }, 0, 0, 0, 0 };
+static pthread_mutex_t header_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static time_t file_mtime(const char *path)
+{
+        struct stat sb;
+
+        if (stat(path, &sb) != 0) {
+                return 0;
+        }
+
+        return sb.st_mtime;
+}
+
+/**
+ * Drops the cached headers if os-release has changed since they were
+ * computed. Must be called with header_cache_lock held.
+ */
+static void header_cache_validate(void)
+{
+        time_t now = time(NULL);
+        time_t site_mtime, dist_mtime;
+
+        if (header_cache.last_check != 0 &&
+            now - header_cache.last_check < TM_HEADER_CACHE_CHECK) {
+                return;
+        }
+        header_cache.last_check = now;
+
+        site_mtime = file_mtime(TM_SITE_VERSION_FILE);
+        dist_mtime = file_mtime(TM_DIST_VERSION_FILE);
+
+        if (site_mtime == header_cache.site_mtime &&
+            dist_mtime == header_cache.dist_mtime) {
+                return;
+        }
+
+        for (int i = 0; i < NUM_HEADERS; i++) {
+                free(header_cache.headers[i]);
+                header_cache.headers[i] = NULL;
+        }
+        header_cache.site_mtime = site_mtime;
+        header_cache.dist_mtime = dist_mtime;
+        header_cache.generation++;
+}
+
+/* Gets the generation of the cached headers, after validating them */
+static unsigned header_cache_generation(void)
+{
+        unsigned generation;
+
+        pthread_mutex_lock(&header_cache_lock);
+        header_cache_validate();
+        generation = header_cache.generation;
+        pthread_mutex_unlock(&header_cache_lock);
+
+        return generation;
+}
+
+/**
+ * Sets a header that does not change between records, either from the
+ * cache, or by calling set_func and caching its result.
+ *
+ * @param t_ref Telemetry Record reference obtained from tm_create_record.
+ * @param index Index of the header to set.
+ * @param set_func The set_*_header function that computes the header.
+ *
+ * @return 0 if successful, or a negative errno-style value if not.
+ *
+ */
+static int set_cached_header(struct telem_ref *t_ref, int index,
+                             int (*set_func)(struct telem_ref *))
+{
+        char *header = NULL;
+        int ret;
+
+        pthread_mutex_lock(&header_cache_lock);
+        header_cache_validate();
+        if (header_cache.headers[index] != NULL) {
+                header = strdup(header_cache.headers[index]);
+                pthread_mutex_unlock(&header_cache_lock);
+
+                if (!header) {
+                        telem_log(LOG_CRIT, "CRIT: Out of memory\n");
+                        return -ENOMEM;
+                }
+                t_ref->record->headers[index] = header;
+                t_ref->record->header_size += strlen(header);
+                return 0;
+        }
+        pthread_mutex_unlock(&header_cache_lock);
+
+        if ((ret = set_func(t_ref)) < 0) {
+                return ret;
+        }
+
+        /* A failure to cache is not an error; the header is set */
+        pthread_mutex_lock(&header_cache_lock);
+        if (header_cache.headers[index] == NULL) {
+                header_cache.headers[index] = strdup(t_ref->record->headers[index]);
+        }
+        pthread_mutex_unlock(&header_cache_lock);
+
+        return 0;
+}
+
+/* The headers set with set_cached_header() */
+static const struct {
+        int index;
+        int (*set_func)(struct telem_ref *);
+} cached_headers[] = {
+        { TM_ARCH, set_arch_header },
+        { TM_HOST_TYPE, set_host_type_header },
+        { TM_SYSTEM_BUILD, set_system_build_header },
+        { TM_KERNEL_VERSION, set_kernel_version_header },
+        { TM_SYSTEM_NAME, set_system_name_header },
+        { TM_BOARD_NAME, set_board_name_header },
+        { TM_CPU_MODEL, set_cpu_model_header },
+        { TM_BIOS_VERSION, set_bios_version_header }
+};
+
+/**
+ * Rewrites a header of a record in place, growing it only if the new value
+ * does not fit.
+ *
+ * @param record The record
+ * @param index Index of the header to set.
+ * @param prefix The name of the header.
+ * @param value The value of the header.
+ *
+ * @return 0 if successful, or -ENOMEM.
+ *
+ */
+static int reset_header(struct telem_record *record, int index,
+                        const char *prefix, const char *value)
+{
+        size_t old_len = strlen(record->headers[index]);
+        size_t len = strlen(prefix) + strlen(value) + 3;
+        size_t alloc = record->header_alloc[index];
+
+        if (alloc == 0) {
+                alloc = old_len + 1;
+        }
+        if (len + 1 > alloc) {
+                char *header = realloc(record->headers[index], len + 1);
+
+                if (!header) {
+                        telem_log(LOG_CRIT, "CRIT: Out of memory\n");
+                        return -ENOMEM;
+                }
+                record->headers[index] = header;
+                alloc = len + 1;
+        }
+        record->header_alloc[index] = alloc;
+
+        snprintf(record->headers[index], alloc, "%s: %s\n", prefix, value);
+        record->header_size = record->header_size - old_len + len;
+
+        return 0;
+}
+
+/* Like get_random_id(), into a buffer of EVENT_ID_LEN + 1 bytes */
+static int read_random_id(char *buf)
+{
+        uint64_t random_id[2] = { 0 };
+        ssize_t len;
+        int frandom;
+
+        frandom = open("/dev/urandom", O_RDONLY | O_CLOEXEC);
+        if (frandom < 0) {
+                return -errno;
+        }
+        len = read(frandom, &random_id, sizeof(random_id));
+        close(frandom);
+        if (len != sizeof(random_id)) {
+                return -EIO;
+        }
+
+        snprintf(buf, EVENT_ID_LEN + 1, "%.16" PRIx64 "%.16" PRIx64,
+                 random_id[0], random_id[1]);
+
+        return 0;
+}
+
 int tm_set_config_file(const char *c_file)
 {
         return set_config_file(c_file);
@@ -839,25 +1046,25 @@ int allocate_header(struct telem_ref *t_ref, uint32_t severity,
 
         i++;
 
-        if ((ret = set_arch_header(t_ref)) < 0) {
+        if ((ret = set_cached_header(t_ref, TM_ARCH, set_arch_header)) < 0) {
                 goto free_and_fail;
         }
 
         i++;
 
-        if ((ret = set_host_type_header(t_ref)) < 0) {
+        if ((ret = set_cached_header(t_ref, TM_HOST_TYPE, set_host_type_header)) < 0) {
                 goto free_and_fail;
         }
 
         i++;
 
-        if ((ret = set_system_build_header(t_ref)) < 0) {
+        if ((ret = set_cached_header(t_ref, TM_SYSTEM_BUILD, set_system_build_header)) < 0) {
                 goto free_and_fail;
         }
 
         i++;
 
-        if ((ret = set_kernel_version_header(t_ref)) < 0) {
+        if ((ret = set_cached_header(t_ref, TM_KERNEL_VERSION, set_kernel_version_header)) < 0) {
                 goto free_and_fail;
         }
 
@@ -869,25 +1076,25 @@ int allocate_header(struct telem_ref *t_ref, uint32_t severity,
 
         i++;
 
-        if ((ret = set_system_name_header(t_ref)) < 0) {
+        if ((ret = set_cached_header(t_ref, TM_SYSTEM_NAME, set_system_name_header)) < 0) {
                 goto free_and_fail;
         }
 
         i++;
 
-        if ((ret = set_board_name_header(t_ref)) < 0) {
+        if ((ret = set_cached_header(t_ref, TM_BOARD_NAME, set_board_name_header)) < 0) {
                 goto free_and_fail;
         }
 
         i++;
 
-        if ((ret = set_cpu_model_header(t_ref)) < 0) {
+        if ((ret = set_cached_header(t_ref, TM_CPU_MODEL, set_cpu_model_header)) < 0) {
                 goto free_and_fail;
         }
 
         i++;
 
-        if ((ret = set_bios_version_header(t_ref)) < 0) {
+        if ((ret = set_cached_header(t_ref, TM_BIOS_VERSION, set_bios_version_header)) < 0) {
                 goto free_and_fail;
         }
 
@@ -909,6 +1116,42 @@ free_and_fail:
 
 }
 
+/* Drops the payload, keeping its buffer for the next one */
+static void clear_payload(struct telem_record *record)
+{
+        if (record->payload) {
+                record->payload[0] = '\0';
+        }
+        record->payload_size = 0;
+        record->raw_payload = false;
+        if (record->payload_fd >= 0) {
+                close(record->payload_fd);
+                record->payload_fd = -1;
+        }
+        record->payload_offset = 0;
+}
+
+/* Makes room for a payload of size bytes and its null byte. The buffer of a
+ * reset record is reused when the payload fits. */
+static int reserve_payload(struct telem_record *record, size_t size)
+{
+        char *buf;
+
+        if (record->payload_alloc > size) {
+                return 0;
+        }
+
+        buf = realloc(record->payload, size + 1);
+        if (!buf) {
+                telem_log(LOG_CRIT, "CRIT: Out of memory\n");
+                return -ENOMEM;
+        }
+        record->payload = buf;
+        record->payload_alloc = size + 1;
+
+        return 0;
+}
+
 int tm_create_record(struct telem_ref **t_ref, uint32_t severity,
                      char *classification, uint32_t payload_version)
 {
@@ -929,12 +1172,18 @@ int tm_create_record(struct telem_ref **t_ref, uint32_t severity,
 
         // Need to initialize header size, since it is only incremented elsewhere
         (*t_ref)->record->header_size = 0;
+        memset((*t_ref)->record->header_alloc, 0, sizeof((*t_ref)->record->header_alloc));
+        (*t_ref)->record->payload_alloc = 0;
+        (*t_ref)->record->header_generation = header_cache_generation();
 
         /* tm_set_payload() may not be called (e.g. in our test suite); in this
          * case, initialize the payload member to NULL so that we can properly
          * detect a non-NULL value in tm_free_record().
          */
         (*t_ref)->record->payload = NULL;
+        (*t_ref)->record->raw_payload = false;
+        (*t_ref)->record->payload_fd = -1;
+        (*t_ref)->record->payload_offset = 0;
 
         /* Set up the headers */
         if ((ret = allocate_header(*t_ref, severity, classification, payload_version)) < 0) {
@@ -945,30 +1194,80 @@ int tm_create_record(struct telem_ref **t_ref, uint32_t severity,
         return ret;
 }
 
-/**
- * Validate's a payload is printable ascii, including whitespace.
- *
- * @param payload The payload to be verified.
- * @param len Length of the payload.
- *
- * @return 0 if successful, or -EINVAL.
- *
- */
-
-int payload_is_ascii(char *payload, size_t len)
+int tm_reset_record(struct telem_ref *t_ref, uint32_t severity,
+                    char *classification, uint32_t payload_version)
 {
-        int i = 0;
-        int ret = 0;
+        struct telem_record *record;
+        char value[EVENT_ID_LEN + 1];
+        unsigned generation;
+        int ret;
 
-        for (i = 0; i < len; i++) {
-                if (!isprint(payload[i]) &&
-                    !isspace(payload[i])) {
-                        ret = -EINVAL;
-                        break;
+        if (t_ref == NULL || t_ref->record == NULL) {
+                return -EINVAL;
+        }
+        record = t_ref->record;
+
+        if (validate_classification(classification) == 1) {
+                return -EINVAL;
+        }
+
+        /* clamp severity to 1-4, as set_severity_header() does */
+        if (severity > 4) {
+                severity = 4;
+        }
+        if (severity < 1) {
+                severity = 1;
+        }
+
+        if ((ret = reset_header(record, TM_CLASSIFICATION, TM_CLASSIFICATION_STR,
+                                classification)) < 0) {
+                return ret;
+        }
+
+        snprintf(value, sizeof(value), "%" PRIu32, severity);
+        if ((ret = reset_header(record, TM_SEVERITY, TM_SEVERITY_STR, value)) < 0) {
+                return ret;
+        }
+
+        snprintf(value, sizeof(value), "%zd", time(NULL));
+        if ((ret = reset_header(record, TM_TIMESTAMP, TM_TIMESTAMP_STR, value)) < 0) {
+                return ret;
+        }
+
+        snprintf(value, sizeof(value), "%" PRIu32, payload_version);
+        if ((ret = reset_header(record, TM_PAYLOAD_VERSION, TM_PAYLOAD_VERSION_STR,
+                                value)) < 0) {
+                return ret;
+        }
+
+        if ((ret = read_random_id(value)) < 0 ||
+            (ret = reset_header(record, TM_EVENT_ID, TM_EVENT_ID_STR, value)) < 0) {
+                return ret;
+        }
+
+        /* The static headers are only collected again after an update */
+        generation = header_cache_generation();
+        if (generation != record->header_generation) {
+                record->header_generation = generation;
+                for (size_t i = 0; i < sizeof(cached_headers) / sizeof(cached_headers[0]); i++) {
+                        int index = cached_headers[i].index;
+
+                        record->header_size -= strlen(record->headers[index]);
+                        free(record->headers[index]);
+                        record->headers[index] = NULL;
+                        record->header_alloc[index] = 0;
+                        if ((ret = set_cached_header(t_ref, index,
+                                                     cached_headers[i].set_func)) < 0) {
+                                /* Leave a header tm_free_record() can free */
+                                record->headers[index] = strdup("");
+                                return ret;
+                        }
                 }
         }
 
-        return ret;
+        clear_payload(record);
+
+        return 0;
 }
 
 // TODO: Consider simply setting a pointer to point to data provide in payload instead of copying it?
@@ -987,49 +1286,131 @@ int tm_set_payload(struct telem_ref *t_ref, char *payload)
                 return -EINVAL;
         }
 
-        t_ref->record->payload = strdup(payload);
-
-        if (!t_ref->record->payload) {
-                telem_log(LOG_CRIT, "CRIT: Out of memory\n");
-                return -ENOMEM;
+        if ((ret = reserve_payload(t_ref->record, payload_len)) < 0) {
+                return ret;
         }
+        clear_payload(t_ref->record);
+        memcpy(t_ref->record->payload, payload, payload_len + 1);
 
         t_ref->record->payload_size = payload_len;
 
         return ret;
 }
 
-/**
- * Checks for id to have length = 32 characters
- * and hexadecimal characters only.
- *
- * @param id A pointer to string to be checked
- *
- * @return 0 on success, 1 on failure
- *
- */
-static int validate_event_id(char *id)
+int tm_set_payload_binary(struct telem_ref *t_ref, const void *payload, size_t size)
 {
-        int rc = 0;
-        const char alphab[] = EVENT_ID_ALPHAB;
+        int ret;
 
-        // make sure is not null
-        if (!id) {
-                return 1;
+        if (t_ref == NULL || t_ref->record == NULL || (payload == NULL && size > 0)) {
+                return -EINVAL;
         }
 
-        // 32 - 32 = 0
-        if ((rc = (int)(strlen(id) - EVENT_ID_LEN)) != 0) {
-                return 1;
+        if (size > raw_payload_max_size_config()) {
+                return -EINVAL;
         }
 
-        // verify alphabet
-        // strspn checks for characters in alphab
-        if (strspn(id, alphab) != EVENT_ID_LEN) {
-                return 1;
+        if ((ret = reserve_payload(t_ref->record, size)) < 0) {
+                return ret;
         }
+        clear_payload(t_ref->record);
+        if (size > 0) {
+                memcpy(t_ref->record->payload, payload, size);
+        }
+        t_ref->record->payload[size] = '\0';
 
-        return rc;
+        t_ref->record->payload_size = size;
+        t_ref->record->raw_payload = true;
+
+        return 0;
+}
+
+/* Reads a payload from a pipe or socket up to its end, at most max bytes */
+static int read_payload_stream(struct telem_record *record, int fd, size_t max)
+{
+        size_t size = 0;
+        ssize_t len;
+        int ret;
+
+        for (;;) {
+                /* Room for one byte more than max tells larger payloads */
+                if (!record->payload || record->payload_alloc - 1 == size) {
+                        size_t grow = size < 4096 ? 4096 : size * 2;
+
+                        if ((ret = reserve_payload(record, grow > max + 1 ? max + 1 : grow)) < 0) {
+                                return ret;
+                        }
+                }
+
+                len = read(fd, record->payload + size, record->payload_alloc - 1 - size);
+                if (len < 0 && errno == EINTR) {
+                        continue;
+                } else if (len < 0) {
+                        ret = -errno;
+                        telem_perror("Error reading payload");
+                        return ret;
+                } else if (len == 0) {
+                        break;
+                }
+
+                size += (size_t)len;
+                if (size > max) {
+                        return -EINVAL;
+                }
+        }
+
+        record->payload[size] = '\0';
+        record->payload_size = size;
+
+        return 0;
+}
+
+int tm_set_payload_fd(struct telem_ref *t_ref, int fd)
+{
+        struct telem_record *record;
+        size_t max = raw_payload_max_size_config();
+        struct stat st;
+        off_t offset;
+        int ret;
+
+        if (t_ref == NULL || t_ref->record == NULL || fd < 0) {
+                return -EINVAL;
+        }
+        record = t_ref->record;
+
+        if (fstat(fd, &st) != 0) {
+                return -errno;
+        }
+
+        clear_payload(record);
+
+        /* Anything but a file is read right away */
+        if (!S_ISREG(st.st_mode)) {
+                if ((ret = read_payload_stream(record, fd, max)) < 0) {
+                        clear_payload(record);
+                        return ret;
+                }
+                record->raw_payload = true;
+                return 0;
+        }
+
+        /* Files are read in chunks as the record is sent */
+        offset = lseek(fd, 0, SEEK_CUR);
+        if (offset < 0) {
+                return -errno;
+        }
+        if (offset > st.st_size || (size_t)(st.st_size - offset) > max) {
+                return -EINVAL;
+        }
+        record->payload_fd = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+        if (record->payload_fd < 0) {
+                record->payload_fd = -1;
+                return -errno;
+        }
+        record->payload_offset = offset;
+        record->payload_size = (size_t)(st.st_size - offset);
+        record->raw_payload = true;
+
+        return 0;
 }
 
 int tm_set_event_id(struct telem_ref *t_ref, char *event_id)
@@ -1040,6 +1421,7 @@ int tm_set_event_id(struct telem_ref *t_ref, char *event_id)
                 if (t_ref && t_ref->record) {
                         // free default id before overriding
                         free(t_ref->record->headers[TM_EVENT_ID]);
+                        t_ref->record->header_alloc[TM_EVENT_ID] = 0;
                         // set new event_id
                         if (asprintf(&(t_ref->record->headers[TM_EVENT_ID]),
                                      "%s: %s\n", TM_EVENT_ID_STR, event_id) > 0) {
@@ -1051,45 +1433,191 @@ int tm_set_event_id(struct telem_ref *t_ref, char *event_id)
         return rc;
 }
 
+/*
+ * A record on the wire: the size fields, the optional CFG prefix and file
+ * name, the RAW prefix of binary payloads, the TRC prefix and send time of
+ * traced records, one buffer per header, and the payload with its null
+ * byte. A payload read from a file is not in the buffers, it is sent after
+ * them, followed by the null byte.
+ */
+#define TM_FRAME_IOV_MAX (NUM_HEADERS + 8)
+
+/* Size of the chunks a payload read from a file is sent in */
+#define TM_PAYLOAD_CHUNK_SIZE (64 * 1024)
+
+struct tm_frame {
+        uint32_t record_size;
+        uint32_t header_size;
+        /* with record_tracing enabled, see TRC_PREFIX */
+        uint64_t send_time;
+        struct iovec iov[TM_FRAME_IOV_MAX];
+        int iovcnt;
+        /* payload file of the record, or -1 */
+        int payload_fd;
+        off_t payload_offset;
+        size_t payload_size;
+};
+
+/**
+ * Milliseconds left until deadline, or -1 if there is no deadline.
+ *
+ * @param deadline Absolute CLOCK_MONOTONIC time, or NULL for no deadline.
+ *
+ * @return The time left in milliseconds, 0 if the deadline has passed.
+ *
+ */
+static int tm_time_left(const struct timespec *deadline)
+{
+        struct timespec now;
+        int64_t left;
+
+        if (deadline == NULL) {
+                return -1;
+        }
+
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        left = (int64_t)(deadline->tv_sec - now.tv_sec) * 1000 +
+               (deadline->tv_nsec - now.tv_nsec) / 1000000;
+
+        return (left < 0) ? 0 : (int)left;
+}
+
 /**
- * Write nbytes from buf to fd. Used to send records to telemprobd.
+ * Write a frame to fd. Used to send records to telemprobd. When the
+ * socket buffer is full, wait for telemprobd to drain it for up to
+ * socket_write_timeout milliseconds.
  *
  * @param fd Socket fd obtained from tm_get_socket.
- * @param buf Data to be written to the socket.
- * @param nbytes Number of bytes to write out of buf.
+ * @param iov Buffers to be written to the socket. Modified on partial writes.
+ * @param iovcnt Number of buffers in iov.
  *
  * @return 0 if successful, or a negative errno-style value if not.
  *
  */
-static int tm_write_socket(int fd, char *buf, size_t nbytes)
+static int tm_write_socket(int fd, struct iovec *iov, int iovcnt)
 {
-        size_t nbytes_out = 0;
-        int k = 0;
+        struct msghdr msg;
+        struct pollfd pfd;
+        struct timespec deadline;
+        struct timespec *dl = NULL;
+        int timeout;
         int ret = 0;
 
-        while (nbytes_out != nbytes) {
+        timeout = socket_write_timeout_config();
+        if (timeout >= 0) {
+                clock_gettime(CLOCK_MONOTONIC, &deadline);
+                deadline.tv_sec += timeout / 1000;
+                deadline.tv_nsec += (long)(timeout % 1000) * 1000000;
+                if (deadline.tv_nsec >= 1000000000) {
+                        deadline.tv_sec++;
+                        deadline.tv_nsec -= 1000000000;
+                }
+                dl = &deadline;
+        }
+
+        memset(&msg, 0, sizeof(msg));
+        pfd.fd = fd;
+        pfd.events = POLLOUT;
+
+        while (iovcnt > 0) {
                 ssize_t b;
-                b = write(fd, buf + nbytes_out, nbytes - nbytes_out);
 
-                if (b == -1 && errno != EAGAIN) {
-                        ret = -errno;
-                        telem_perror("Error writing to daemon socket");
-                        return ret;
+                msg.msg_iov = iov;
+                msg.msg_iovlen = (size_t)iovcnt;
+                b = sendmsg(fd, &msg, MSG_NOSIGNAL);
+
+                if (b == -1 && errno == EINTR) {
+                        continue;
                 } else if (b == -1 &&
                            (errno == EAGAIN || errno == EWOULDBLOCK)) {
-                        if (++k > 100) {
+                        timeout = tm_time_left(dl);
+                        if (timeout == 0) {
+                                telem_log(LOG_ERR, "Timed out writing to daemon socket\n");
+                                return -ETIMEDOUT;
+                        }
+                        ret = poll(&pfd, 1, timeout);
+                        if (ret == -1 && errno != EINTR) {
                                 ret = -errno;
+                                telem_perror("Error waiting for daemon socket");
                                 return ret;
                         }
-                } else {
-                        nbytes_out += (size_t)b;
-                        k = 0;
+                        ret = 0;
+                        continue;
+                } else if (b == -1) {
+                        ret = -errno;
+                        telem_perror("Error writing to daemon socket");
+                        return ret;
+                }
+
+                /* Skip what was written, including partially written buffers */
+                while (iovcnt > 0 && (size_t)b >= iov->iov_len) {
+                        b -= (ssize_t)iov->iov_len;
+                        iov++;
+                        iovcnt--;
+                }
+                if (iovcnt > 0) {
+                        iov->iov_base = (char *)iov->iov_base + b;
+                        iov->iov_len -= (size_t)b;
                 }
         }
 
         return ret;
 }
 
+/**
+ * Whether records are sent over a SOCK_SEQPACKET socket, as messages of at
+ * most TM_PACKET_SIZE bytes.
+ *
+ * @return true with socket_transport=seqpacket
+ *
+ */
+static bool tm_packet_socket(void)
+{
+        return strcmp(socket_transport_config(), "seqpacket") == 0;
+}
+
+/* Messages of a record larger than TM_PACKET_SIZE, filled before they are
+ * written so that telemprobd reads them at the boundaries it expects */
+struct tm_packets {
+        int fd;
+        char *buf;
+        size_t len;
+        /* size of the message being filled */
+        size_t limit;
+};
+
+static int tm_packets_flush(struct tm_packets *p)
+{
+        struct iovec iov;
+
+        iov.iov_base = p->buf;
+        iov.iov_len = p->len;
+        p->len = 0;
+        p->limit = TM_PACKET_NEXT_SIZE;
+
+        return tm_write_socket(p->fd, &iov, 1);
+}
+
+static int tm_packets_add(struct tm_packets *p, const void *data, size_t size)
+{
+        const char *bytes = data;
+
+        while (size > 0) {
+                size_t len = p->limit - p->len < size ? p->limit - p->len : size;
+                int ret;
+
+                memcpy(p->buf + p->len, bytes, len);
+                p->len += len;
+                bytes += len;
+                size -= len;
+                if (p->len == p->limit && (ret = tm_packets_flush(p)) < 0) {
+                        return ret;
+                }
+        }
+
+        return 0;
+}
+
 /**
  * Obtain a file descriptor for a unix domain socket.
  * Connect to the socket in a non-blocking fashion.
@@ -1109,7 +1637,7 @@ static int tm_get_socket(void)
         socklen_t lon = 0;
         int valopt = 0;
 
-        sfd = socket(AF_UNIX, SOCK_STREAM, 0);
+        sfd = socket(AF_UNIX, tm_packet_socket() ? SOCK_SEQPACKET : SOCK_STREAM, 0);
 
         if (sfd == -1) {
                 ret = -errno;
@@ -1199,33 +1727,21 @@ out1:
         return ret;
 }
 
-int tm_send_record(struct telem_ref *t_ref)
+/**
+ * Describe a record in the frame format expected by the daemon. The frame
+ * points at the record's headers and payload, so the record must outlive it.
+ *
+ * @param t_ref The handle returned by tm_create_record()
+ * @param frame The frame to fill in
+ *
+ */
+static void tm_build_frame(struct telem_ref *t_ref, struct tm_frame *frame)
 {
         int i;
-        size_t record_size = 0;
         size_t total_size = 0;
-        int sfd;
-        char *data = NULL;
-        size_t offset = 0;
-        int ret = 0;
-        int k = 0;
-        struct stat unused;
         size_t cfg_file_name_size = 0;
         const char *cfg_file_name = NULL;
-
-        k = stat(TM_OPT_OUT_FILE, &unused);
-        if (k == 0) {
-                // Bail early if opt-out is enabled
-                return -ECONNREFUSED;
-        }
-
-        sfd = tm_get_socket();
-
-        if (sfd < 0) {
-                telem_log(LOG_ERR, "Failed to get socket fd: %s\n",
-                          strerror(-sfd));
-                return sfd;
-        }
+        struct iovec *iov = frame->iov;
 
         total_size = t_ref->record->header_size + t_ref->record->payload_size;
 
@@ -1244,6 +1760,17 @@ int tm_send_record(struct telem_ref *t_ref)
                 total_size += (cfg_file_name_size + CFG_PREFIX_LENGTH);
         }
 
+        /* Binary payloads are marked, telemprobd stages them as they are */
+        if (t_ref->record->raw_payload) {
+                total_size += RAW_PREFIX_LENGTH;
+        }
+
+        /* Traced records carry the time they are sent */
+        frame->send_time = record_tracing_config() ? trace_clock() : 0;
+        if (frame->send_time != 0) {
+                total_size += TRC_PREFIX_LENGTH + sizeof(uint64_t);
+        }
+
         if (cfg_file_name != NULL) {
                 telem_debug("DEBUG: CFG field size : %zu\n", cfg_file_name_size + CFG_PREFIX_LENGTH);
                 telem_debug("DEBUG: CFG file name : %s\n", cfg_file_name);
@@ -1255,58 +1782,694 @@ int tm_send_record(struct telem_ref *t_ref)
         telem_debug("DEBUG: Total size : %zu\n", total_size);
 
         /*
-         * Allocating buffer for what we intend to send.  Buffer layout is:
+         * Frame layout is:
          * <uint32_t record_size>     : so recv knows how much to read
          * <custom cfg file field>    : optional
+         * <RAW prefix>               : optional, for binary payloads
+         * <TRC prefix + uint64_t>    : optional, time the record is sent
          * <uint32_t header_size>
          * <headers + Payload>
          * <null-byte>
-         * The additional char at the end ensures null termination
+         * The payload is sent with its terminating null byte.
          */
-        record_size = (2 * sizeof(uint32_t)) + total_size + 1;
+        frame->record_size = (uint32_t)((2 * sizeof(uint32_t)) + total_size + 1);
+        frame->header_size = (uint32_t)t_ref->record->header_size;
 
-        data = calloc(sizeof(char), record_size);
-        if (!data) {
-                telem_log(LOG_CRIT, "CRIT: Out of memory\n");
-                close(sfd);
-                return -ENOMEM;
+        iov->iov_base = &frame->record_size;
+        iov->iov_len = sizeof(uint32_t);
+        iov++;
+
+        if (cfg_file_name != NULL) {
+                iov->iov_base = CFG_PREFIX;
+                iov->iov_len = CFG_PREFIX_LENGTH;
+                iov++;
+                iov->iov_base = (char *)cfg_file_name;
+                iov->iov_len = cfg_file_name_size;
+                iov++;
         }
 
-        memcpy(data, &record_size, sizeof(uint32_t));
-        offset += sizeof(uint32_t);
+        if (t_ref->record->raw_payload) {
+                iov->iov_base = RAW_PREFIX;
+                iov->iov_len = RAW_PREFIX_LENGTH;
+                iov++;
+        }
 
-        if (cfg_file_name != NULL) {
-                memcpy(data + offset, CFG_PREFIX, CFG_PREFIX_LENGTH);
-                offset += CFG_PREFIX_LENGTH;
-                memcpy(data + offset, cfg_file_name, cfg_file_name_size);
-                offset += cfg_file_name_size;
+        if (frame->send_time != 0) {
+                iov->iov_base = TRC_PREFIX;
+                iov->iov_len = TRC_PREFIX_LENGTH;
+                iov++;
+                iov->iov_base = &frame->send_time;
+                iov->iov_len = sizeof(uint64_t);
+                iov++;
         }
 
-        memcpy(data + offset, &t_ref->record->header_size, sizeof(uint32_t));
-        offset += sizeof(uint32_t);
+        iov->iov_base = &frame->header_size;
+        iov->iov_len = sizeof(uint32_t);
+        iov++;
 
-        size_t len = 0;
         for (i = 0; i < NUM_HEADERS; i++) {
-                len = strlen(t_ref->record->headers[i]);
-                memcpy(data + offset, t_ref->record->headers[i], len);
+                iov->iov_base = t_ref->record->headers[i];
+                iov->iov_len = strlen(t_ref->record->headers[i]);
+                telem_debug("DEBUG: Header to be sent : %s", t_ref->record->headers[i]);
+                iov++;
+        }
+
+        frame->payload_fd = t_ref->record->payload_fd;
+        frame->payload_offset = t_ref->record->payload_offset;
+        frame->payload_size = t_ref->record->payload_size;
+        if (frame->payload_fd >= 0) {
+                /* Sent by tm_write_frame() */
+                frame->iovcnt = (int)(iov - frame->iov);
+                return;
+        }
+
+        if (t_ref->record->payload != NULL) {
+                iov->iov_base = t_ref->record->payload;
+                iov->iov_len = t_ref->record->payload_size + 1;
+                if (!t_ref->record->raw_payload) {
+                        telem_debug("DEBUG: Payload to be sent :\n\n%s\n",
+                                    t_ref->record->payload);
+                }
+        } else {
+                iov->iov_base = "";
+                iov->iov_len = 1;
+        }
+        iov++;
+
+        frame->iovcnt = (int)(iov - frame->iov);
+}
+
+/**
+ * Read part of the payload file of a frame.
+ *
+ * @param frame The frame, with a payload file
+ * @param buf Where to read the payload
+ * @param size Number of bytes to read
+ * @param offset Offset of the bytes in the payload file
+ *
+ * @return 0 if successful, -EIO if the file was truncated after the payload
+ *     was set, or another negative errno-style value.
+ *
+ */
+static int tm_read_payload(const struct tm_frame *frame, char *buf, size_t size,
+                           off_t offset)
+{
+        while (size > 0) {
+                ssize_t len = pread(frame->payload_fd, buf, size, offset);
+
+                if (len < 0 && errno == EINTR) {
+                        continue;
+                } else if (len < 0) {
+                        int ret = -errno;
+
+                        telem_perror("Error reading payload file");
+                        return ret;
+                } else if (len == 0) {
+                        telem_log(LOG_ERR, "Payload file truncated while sending\n");
+                        return -EIO;
+                }
+                buf += len;
+                size -= (size_t)len;
                 offset += len;
         }
 
-        memcpy(data + offset, t_ref->record->payload, t_ref->record->payload_size);
+        return 0;
+}
+
+/**
+ * Write a record larger than TM_PACKET_SIZE, or with a payload file, to a
+ * SOCK_SEQPACKET socket.
+ *
+ * @param fd Socket fd obtained from tm_get_socket.
+ * @param iov Buffers of the record.
+ * @param iovcnt Number of buffers in iov.
+ * @param frame The frame of the record if its payload is read from a file
+ *     after iov, or NULL.
+ *
+ * @return 0 if successful, or a negative errno-style value if not.
+ *
+ */
+static int tm_write_packets(int fd, const struct iovec *iov, int iovcnt,
+                            const struct tm_frame *frame)
+{
+        struct tm_packets p = { fd, NULL, 0, TM_PACKET_SIZE };
+        char *chunk = NULL;
+        int ret = 0;
+
+        p.buf = malloc(TM_PACKET_SIZE);
+        if (frame) {
+                chunk = malloc(TM_PAYLOAD_CHUNK_SIZE);
+        }
+        if (!p.buf || (frame && !chunk)) {
+                telem_log(LOG_CRIT, "CRIT: Out of memory\n");
+                free(p.buf);
+                free(chunk);
+                return -ENOMEM;
+        }
+
+        for (int i = 0; i < iovcnt && ret == 0; i++) {
+                ret = tm_packets_add(&p, iov[i].iov_base, iov[i].iov_len);
+        }
+
+        if (frame) {
+                size_t left = frame->payload_size;
+                off_t offset = frame->payload_offset;
+
+                while (left > 0 && ret == 0) {
+                        size_t size = left < TM_PAYLOAD_CHUNK_SIZE ? left : TM_PAYLOAD_CHUNK_SIZE;
+
+                        if ((ret = tm_read_payload(frame, chunk, size, offset)) == 0) {
+                                ret = tm_packets_add(&p, chunk, size);
+                        }
+                        left -= size;
+                        offset += (off_t)size;
+                }
+                if (ret == 0) {
+                        ret = tm_packets_add(&p, "", 1);
+                }
+        }
+
+        if (ret == 0 && p.len > 0) {
+                ret = tm_packets_flush(&p);
+        }
+        free(chunk);
+        free(p.buf);
+
+        return ret;
+}
+
+/**
+ * Write a frame built by tm_build_frame() to fd, and its payload file in
+ * chunks of TM_PAYLOAD_CHUNK_SIZE if there is one. The connection must be
+ * closed after an error, which may leave a record partially written.
+ *
+ * @param fd Socket fd obtained from tm_get_socket.
+ * @param frame The frame.
+ *
+ * @return 0 if successful, or a negative errno-style value if not.
+ *
+ */
+static int tm_write_frame(int fd, struct tm_frame *frame)
+{
+        struct iovec iov;
+        char *chunk;
+        size_t left = frame->payload_size;
+        off_t offset = frame->payload_offset;
+        int ret;
+
+        /* Other records are a single message */
+        if (tm_packet_socket() &&
+            (frame->payload_fd >= 0 || frame->record_size > TM_PACKET_SIZE)) {
+                return tm_write_packets(fd, frame->iov, frame->iovcnt,
+                                        frame->payload_fd >= 0 ? frame : NULL);
+        }
+
+        ret = tm_write_socket(fd, frame->iov, frame->iovcnt);
+        if (ret < 0 || frame->payload_fd < 0) {
+                return ret;
+        }
+
+        chunk = malloc(left < TM_PAYLOAD_CHUNK_SIZE ? left + 1 : TM_PAYLOAD_CHUNK_SIZE);
+        if (!chunk) {
+                telem_log(LOG_CRIT, "CRIT: Out of memory\n");
+                return -ENOMEM;
+        }
+
+        while (left > 0 && ret == 0) {
+                size_t size = left < TM_PAYLOAD_CHUNK_SIZE ? left : TM_PAYLOAD_CHUNK_SIZE;
+
+                if ((ret = tm_read_payload(frame, chunk, size, offset)) == 0) {
+                        iov.iov_base = chunk;
+                        iov.iov_len = size;
+                        ret = tm_write_socket(fd, &iov, 1);
+                }
+                left -= size;
+                offset += (off_t)size;
+        }
+        free(chunk);
+
+        if (ret == 0) {
+                iov.iov_base = "";
+                iov.iov_len = 1;
+                ret = tm_write_socket(fd, &iov, 1);
+        }
+
+        return ret;
+}
+
+int tm_send_record(struct telem_ref *t_ref)
+{
+        int sfd;
+        struct tm_frame frame;
+        int ret = 0;
+        int k = 0;
+        struct stat unused;
 
-        telem_debug("DEBUG: Data to be sent :\n\n%s\n", data + 2 * sizeof(uint32_t));
-        if ((ret = tm_write_socket(sfd, data, record_size)) == 0) {
+        k = stat(TM_OPT_OUT_FILE, &unused);
+        if (k == 0) {
+                // Bail early if opt-out is enabled
+                return -ECONNREFUSED;
+        }
+
+        /* Sampled out records are never sent, and count as sent */
+        if (record_sampled_out(t_ref->record->headers)) {
+                telem_debug("DEBUG: Record sampled out\n");
+                return 0;
+        }
+
+        sfd = tm_get_socket();
+
+        if (sfd < 0) {
+                telem_log(LOG_ERR, "Failed to get socket fd: %s\n",
+                          strerror(-sfd));
+                return sfd;
+        }
+
+        tm_build_frame(t_ref, &frame);
+
+        if ((ret = tm_write_frame(sfd, &frame)) == 0) {
                 telem_log(LOG_INFO, "INFO: Successfully sent record over the socket\n");
         } else {
                 telem_log(LOG_ERR, "Error while writing data to socket\n");
         }
 
         close(sfd);
-        free(data);
 
         return ret;
 }
 
+/*
+ * Records sent with tm_send_record_async() are copied into a bounded queue,
+ * and written to telemprobd by a sender thread started on first use. The
+ * thread keeps its connection open between records.
+ */
+#define TM_ASYNC_QUEUE_DEFAULT 64
+
+struct async_record {
+        struct async_record *next;
+        size_t size;
+        char data[];
+};
+
+struct async_queue {
+        struct async_record *head;
+        struct async_record *tail;
+        size_t count;
+        size_t max_records;
+        enum tm_async_policy policy;
+        /* a record was taken off the queue and is being written */
+        bool sending;
+        /* process the sender thread runs in, 0 if not started */
+        pid_t pid;
+        /* records that could not be written since the last tm_flush() */
+        size_t lost;
+        /* error of the last of them */
+        int error;
+};
+
+static struct async_queue async_queue = {
+        NULL, NULL, 0, TM_ASYNC_QUEUE_DEFAULT, TM_ASYNC_DROP_OLDEST, false, 0, 0, 0
+};
+static pthread_mutex_t async_queue_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t async_queued = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t async_drained = PTHREAD_COND_INITIALIZER;
+/* fork handlers are registered when the sender thread is first started */
+static bool async_atfork_registered = false;
+
+/**
+ * Removes the oldest record from the queue. Must be called with
+ * async_queue_lock held.
+ *
+ * @return the record, or NULL if the queue is empty
+ */
+static struct async_record *async_queue_pop(void)
+{
+        struct async_record *rec = async_queue.head;
+
+        if (rec) {
+                async_queue.head = rec->next;
+                if (!async_queue.head) {
+                        async_queue.tail = NULL;
+                }
+                async_queue.count--;
+        }
+
+        return rec;
+}
+
+static void *async_sender(void *arg)
+{
+        struct async_record *rec;
+        struct iovec iov;
+        int sfd = -1;
+        int ret;
+
+        (void)arg;
+
+        pthread_mutex_lock(&async_queue_lock);
+        while (true) {
+                while (!(rec = async_queue_pop())) {
+                        async_queue.sending = false;
+                        pthread_cond_broadcast(&async_drained);
+                        pthread_cond_wait(&async_queued, &async_queue_lock);
+                }
+                async_queue.sending = true;
+                pthread_mutex_unlock(&async_queue_lock);
+
+                if (sfd < 0) {
+                        sfd = tm_get_socket();
+                }
+                if (sfd < 0) {
+                        telem_log(LOG_ERR, "Failed to get socket fd: %s\n",
+                                  strerror(-sfd));
+                        ret = sfd;
+                } else {
+                        iov.iov_base = rec->data;
+                        iov.iov_len = rec->size;
+                        ret = tm_packet_socket() && rec->size > TM_PACKET_SIZE ?
+                              tm_write_packets(sfd, &iov, 1, NULL) :
+                              tm_write_socket(sfd, &iov, 1);
+                        if (ret < 0) {
+                                telem_log(LOG_ERR, "Error while writing data to socket\n");
+                                close(sfd);
+                                sfd = -1;
+                        }
+                }
+                free(rec);
+
+                pthread_mutex_lock(&async_queue_lock);
+                if (ret < 0) {
+                        async_queue.lost++;
+                        async_queue.error = ret;
+                }
+        }
+
+        return NULL;
+}
+
+/* The queue is held across fork(), so that the child gets it in a
+ * consistent state */
+static void async_atfork_prepare(void)
+{
+        pthread_mutex_lock(&async_queue_lock);
+}
+
+static void async_atfork_parent(void)
+{
+        pthread_mutex_unlock(&async_queue_lock);
+}
+
+/* Only the thread that forked runs in the child: the sender thread is gone,
+ * and the lock and conditions are reset, as the sender may have been
+ * waiting on them. The records queued are left to the parent to send. */
+static void async_atfork_child(void)
+{
+        struct async_record *rec;
+
+        pthread_mutex_init(&async_queue_lock, NULL);
+        pthread_cond_init(&async_queued, NULL);
+        pthread_cond_init(&async_drained, NULL);
+        while ((rec = async_queue_pop()) != NULL) {
+                free(rec);
+        }
+        async_queue.sending = false;
+        async_queue.pid = 0;
+        async_queue.lost = 0;
+        async_queue.error = 0;
+}
+
+/**
+ * Starts the sender thread if it is not running in this process. Records
+ * inherited from a parent process are dropped, the parent sends them. Must
+ * be called with async_queue_lock held.
+ *
+ * @return 0 if successful, or a negative errno-style value if not.
+ */
+static int async_sender_start(void)
+{
+        struct async_record *rec;
+        pthread_attr_t attr;
+        pthread_t thread;
+        pid_t pid = getpid();
+        int ret;
+
+        if (async_queue.pid == pid) {
+                return 0;
+        }
+        if (!async_atfork_registered) {
+                ret = pthread_atfork(async_atfork_prepare, async_atfork_parent,
+                                     async_atfork_child);
+                if (ret != 0) {
+                        return -ret;
+                }
+                async_atfork_registered = true;
+        }
+
+        while ((rec = async_queue_pop()) != NULL) {
+                free(rec);
+        }
+        async_queue.sending = false;
+        async_queue.lost = 0;
+        async_queue.error = 0;
+
+        pthread_attr_init(&attr);
+        pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+        ret = pthread_create(&thread, &attr, async_sender, NULL);
+        pthread_attr_destroy(&attr);
+        if (ret != 0) {
+                telem_log(LOG_ERR, "Failed to start sender thread: %s\n",
+                          strerror(ret));
+                return -ret;
+        }
+        async_queue.pid = pid;
+
+        return 0;
+}
+
+int tm_set_async_queue(size_t max_records, enum tm_async_policy policy)
+{
+        if (max_records == 0 ||
+            (policy != TM_ASYNC_DROP_OLDEST && policy != TM_ASYNC_DROP_NEWEST)) {
+                return -EINVAL;
+        }
+
+        pthread_mutex_lock(&async_queue_lock);
+        async_queue.max_records = max_records;
+        async_queue.policy = policy;
+        pthread_mutex_unlock(&async_queue_lock);
+
+        return 0;
+}
+
+int tm_send_record_async(struct telem_ref *t_ref)
+{
+        struct async_record *rec, *dropped = NULL;
+        struct tm_frame frame;
+        struct stat unused;
+        size_t offset = 0;
+        int ret;
+
+        if (t_ref == NULL) {
+                return -EINVAL;
+        }
+
+        if (stat(TM_OPT_OUT_FILE, &unused) == 0) {
+                // Bail early if opt-out is enabled
+                return -ECONNREFUSED;
+        }
+
+        if (record_sampled_out(t_ref->record->headers)) {
+                telem_debug("DEBUG: Record sampled out\n");
+                return 0;
+        }
+
+        /* Copy the frame, so the caller can free the record right away */
+        tm_build_frame(t_ref, &frame);
+        rec = malloc(sizeof(struct async_record) + frame.record_size);
+        if (!rec) {
+                return -ENOMEM;
+        }
+        for (int i = 0; i < frame.iovcnt; i++) {
+                memcpy(rec->data + offset, frame.iov[i].iov_base,
+                       frame.iov[i].iov_len);
+                offset += frame.iov[i].iov_len;
+        }
+        if (frame.payload_fd >= 0) {
+                ret = tm_read_payload(&frame, rec->data + offset, frame.payload_size,
+                                      frame.payload_offset);
+                if (ret < 0) {
+                        free(rec);
+                        return ret;
+                }
+                offset += frame.payload_size;
+                rec->data[offset++] = '\0';
+        }
+        rec->size = offset;
+        rec->next = NULL;
+
+        pthread_mutex_lock(&async_queue_lock);
+        if ((ret = async_sender_start()) < 0) {
+                pthread_mutex_unlock(&async_queue_lock);
+                free(rec);
+                return ret;
+        }
+
+        if (async_queue.count >= async_queue.max_records) {
+                if (async_queue.policy == TM_ASYNC_DROP_NEWEST) {
+                        pthread_mutex_unlock(&async_queue_lock);
+                        telem_log(LOG_WARNING, "Send queue full, dropping record\n");
+                        free(rec);
+                        return -ENOBUFS;
+                }
+                dropped = async_queue_pop();
+        }
+
+        if (async_queue.tail) {
+                async_queue.tail->next = rec;
+        } else {
+                async_queue.head = rec;
+        }
+        async_queue.tail = rec;
+        async_queue.count++;
+        pthread_cond_signal(&async_queued);
+        pthread_mutex_unlock(&async_queue_lock);
+
+        if (dropped) {
+                telem_log(LOG_WARNING, "Send queue full, dropping oldest record\n");
+                free(dropped);
+        }
+
+        return 0;
+}
+
+int tm_flush(int timeout)
+{
+        struct timespec deadline;
+        int ret = 0;
+
+        if (timeout >= 0) {
+                clock_gettime(CLOCK_REALTIME, &deadline);
+                deadline.tv_sec += timeout / 1000;
+                deadline.tv_nsec += (long)(timeout % 1000) * 1000000;
+                if (deadline.tv_nsec >= 1000000000) {
+                        deadline.tv_sec++;
+                        deadline.tv_nsec -= 1000000000;
+                }
+        }
+
+        pthread_mutex_lock(&async_queue_lock);
+        if (async_queue.pid != getpid()) {
+                /* Nothing was queued in this process */
+                pthread_mutex_unlock(&async_queue_lock);
+                return 0;
+        }
+        while (async_queue.count > 0 || async_queue.sending) {
+                if (timeout < 0) {
+                        pthread_cond_wait(&async_drained, &async_queue_lock);
+                } else if (pthread_cond_timedwait(&async_drained, &async_queue_lock,
+                                                  &deadline) == ETIMEDOUT) {
+                        ret = -ETIMEDOUT;
+                        break;
+                }
+        }
+        /* Records are lost once, the next call reports the later losses */
+        if (ret == 0 && async_queue.lost > 0) {
+                telem_log(LOG_ERR, "%zu queued records could not be sent: %s\n",
+                          async_queue.lost, strerror(-async_queue.error));
+                ret = async_queue.error;
+        }
+        async_queue.lost = 0;
+        async_queue.error = 0;
+        pthread_mutex_unlock(&async_queue_lock);
+
+        return ret;
+}
+
+int tm_open_session(struct telem_session **session)
+{
+        struct stat unused;
+        int sfd;
+
+        if (session == NULL) {
+                return -EINVAL;
+        }
+
+        if (stat(TM_OPT_OUT_FILE, &unused) == 0) {
+                // Bail early if opt-out is enabled
+                return -ECONNREFUSED;
+        }
+
+        sfd = tm_get_socket();
+        if (sfd < 0) {
+                telem_log(LOG_ERR, "Failed to get socket fd: %s\n",
+                          strerror(-sfd));
+                return sfd;
+        }
+
+        *session = calloc(1, sizeof(struct telem_session));
+        if (!*session) {
+                close(sfd);
+                return -ENOMEM;
+        }
+        (*session)->sfd = sfd;
+
+        return 0;
+}
+
+int tm_send_records(struct telem_session *session, struct telem_ref **t_refs,
+                    size_t count)
+{
+        struct tm_frame frame;
+        size_t i;
+        int ret = 0;
+
+        if (session == NULL || (t_refs == NULL && count > 0)) {
+                return -EINVAL;
+        }
+
+        /* The connection is dropped after a write error, so reconnect once
+         * before giving up on the batch. */
+        if (session->sfd < 0) {
+                session->sfd = tm_get_socket();
+                if (session->sfd < 0) {
+                        ret = session->sfd;
+                        telem_log(LOG_ERR, "Failed to get socket fd: %s\n",
+                                  strerror(-ret));
+                        return ret;
+                }
+        }
+
+        for (i = 0; i < count; i++) {
+                tm_build_frame(t_refs[i], &frame);
+
+                ret = tm_write_frame(session->sfd, &frame);
+
+                if (ret < 0) {
+                        telem_log(LOG_ERR, "Error while writing data to socket\n");
+                        close(session->sfd);
+                        session->sfd = -1;
+                        return ret;
+                }
+        }
+
+        telem_log(LOG_INFO, "INFO: Successfully sent %zu records over the socket\n",
+                  count);
+
+        return 0;
+}
+
+void tm_close_session(struct telem_session *session)
+{
+        if (session == NULL) {
+                return;
+        }
+
+        if (session->sfd >= 0) {
+                close(session->sfd);
+        }
+        free(session);
+}
+
 void tm_free_record(struct telem_ref *t_ref)
 {
 
@@ -1327,6 +2490,9 @@ void tm_free_record(struct telem_ref *t_ref)
         if (t_ref->record->payload) {
                 free(t_ref->record->payload);
         }
+        if (t_ref->record->payload_fd >= 0) {
+                close(t_ref->record->payload_fd);
+        }
 
         free(t_ref->record);
         free(t_ref);
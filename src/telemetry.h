@@ -50,11 +50,14 @@
 
 #include <stdint.h>
 #include <stdbool.h>
+#include <stddef.h>
 
 struct telem_ref {
         struct telem_record *record;
 };
 
+struct telem_session;
+
 /**
  * Set the configuration file name to use
  *
@@ -88,6 +91,25 @@ int tm_set_config_file(const char *c_file);
 int tm_create_record(struct telem_ref **t_ref, uint32_t severity,
                      char *classification, uint32_t payload_version);
 
+/**
+ * Reset a record for reuse as a new record, as if it was freed and created
+ * again with tm_create_record(). The headers that do not change between
+ * records are kept, the payload is cleared and its buffer kept for the next
+ * call to tm_set_payload(), so that a record reused for each new one is not
+ * allocated again once its buffers are large enough.
+ *
+ * @param t_ref The handle returned by tm_create_record(). It must not be
+ *     waiting to be sent by tm_send_record_async().
+ * @param severity Severity field value, as for tm_create_record()
+ * @param classification Classification field value, as for tm_create_record()
+ * @param payload_version Payload format version, as for tm_create_record()
+ *
+ * @return 0 on success, or a negative errno-style value on error, in which
+ *     case the record may only be freed
+ */
+int tm_reset_record(struct telem_ref *t_ref, uint32_t severity,
+                    char *classification, uint32_t payload_version);
+
 /**
  * Sets the event_id to a user defined id
  *
@@ -112,14 +134,126 @@ int tm_set_event_id(struct telem_ref *t_ref, char *event_id);
 int tm_set_payload(struct telem_ref *t_ref, char *payload);
 
 /**
- * Send a record to the telemetrics daemon for delivery
+ * Set a binary payload of a telemetrics record. The payload is copied, and
+ * sent as its exact bytes, which need not be text. It may be larger than
+ * the text payloads of tm_set_payload(), up to raw_payload_max_size KiB.
+ *
+ * @param t_ref The handle returned by tm_create_record()
+ * @param payload The payload
+ * @param size Size of the payload in bytes
+ *
+ * @return 0 on success, or a negative errno-style value on error
+ */
+int tm_set_payload_binary(struct telem_ref *t_ref, const void *payload, size_t size);
+
+/**
+ * Set a binary payload of a telemetrics record read from a file descriptor,
+ * from its current offset to its end, up to raw_payload_max_size KiB. A
+ * regular file is not read until the record is sent, then in chunks, so the
+ * payload is never held in memory as a whole; the file offset of fd is left
+ * unchanged, and the record keeps its own descriptor, so fd may be closed.
+ * Other descriptors, such as pipes, are read to their end right away.
  *
  * @param t_ref The handle returned by tm_create_record()
+ * @param fd The file descriptor
  *
  * @return 0 on success, or a negative errno-style value on error
  */
+int tm_set_payload_fd(struct telem_ref *t_ref, int fd);
+
+/**
+ * Send a record to the telemetrics daemon for delivery. Records left out by
+ * the class_sample_rates of the configuration are not sent.
+ *
+ * @param t_ref The handle returned by tm_create_record()
+ *
+ * @return 0 on success, or if the record is sampled out, or a negative
+ *     errno-style value on error
+ */
 int tm_send_record(struct telem_ref *t_ref);
 
+/**
+ * What tm_send_record_async() does when the send queue is full
+ */
+enum tm_async_policy {
+        /* drop the oldest queued record to make room */
+        TM_ASYNC_DROP_OLDEST,
+        /* keep the queue, and fail to queue the new record */
+        TM_ASYNC_DROP_NEWEST,
+};
+
+/**
+ * Set the size of the queue used by tm_send_record_async(), and what to do
+ * when it is full. The default is 64 records, dropping the oldest.
+ *
+ * @param max_records Maximum number of records waiting to be sent
+ * @param policy What to do with a record sent when the queue is full
+ *
+ * @return 0 on success, or a negative errno-style value on error
+ */
+int tm_set_async_queue(size_t max_records, enum tm_async_policy policy);
+
+/**
+ * Queue a record for delivery to the telemetrics daemon without waiting for
+ * it to be written. The record is copied, so it may be freed as soon as the
+ * call returns. Records are written in order by a background thread; write
+ * errors are logged, the record is dropped and tm_flush() reports it.
+ *
+ * @param t_ref The handle returned by tm_create_record()
+ *
+ * @return 0 on success, -ENOBUFS if the queue is full and the policy is
+ *     TM_ASYNC_DROP_NEWEST, or another negative errno-style value on error
+ */
+int tm_send_record_async(struct telem_ref *t_ref);
+
+/**
+ * Wait for the records queued by tm_send_record_async() to be written. A
+ * probe should call it before it exits.
+ *
+ * @param timeout Maximum time to wait in milliseconds, or -1 to wait until
+ *     the queue is empty
+ *
+ * @return 0 once all queued records were written or dropped, -ETIMEDOUT if
+ *     some are still queued; they stay queued, or the negative errno-style
+ *     value of the last failure if records queued since the previous call
+ *     could not be written, for instance because telemprobd was not
+ *     listening
+ */
+int tm_flush(int timeout);
+
+/**
+ * Open a connection to the telemetrics daemon that can be reused to send
+ * many records
+ *
+ * @param session A pointer to a telem_session struct pointer declared by the
+ *     caller. The struct is initialized if the function returns success.
+ *
+ * @return 0 on success, or a negative errno-style value on error
+ */
+int tm_open_session(struct telem_session **session);
+
+/**
+ * Send a batch of records over an open session
+ *
+ * @param session The handle returned by tm_open_session()
+ * @param t_refs An array of handles returned by tm_create_record()
+ * @param count The number of handles in t_refs
+ *
+ * @return 0 on success, or a negative errno-style value on error. On a write
+ *     error the connection is dropped and the next call reconnects; records
+ *     in the batch may have been partially delivered.
+ */
+int tm_send_records(struct telem_session *session, struct telem_ref **t_refs,
+                    size_t count);
+
+/**
+ * Close a session and release its resources
+ *
+ * @param session The handle returned by tm_open_session()
+ *
+ */
+void tm_close_session(struct telem_session *session);
+
 /**
  * Release the memory allocated to a telemetrics record.
  *
@@ -21,9 +21,12 @@
 #include <assert.h>
 #include <signal.h>
 #include <dirent.h>
-#include <malloc.h>
 #include <stdbool.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 #include <curl/curl.h>
 #include <sys/signalfd.h>
 
@@ -31,21 +34,18 @@
 #include "util.h"
 #include "spool.h"
 #include "iorecord.h"
+#include "recordio.h"
 #include "retention.h"
+#include "staginglog.h"
+#include "ringbuf.h"
+#include "compress.h"
+#include "metrics.h"
+#include "recordtrace.h"
+#include "poststate.h"
+#include "membudget.h"
+#include "sampling.h"
 #include "telempostdaemon.h"
 
-/* spool window check */
-static bool inside_direct_spool_window(TelemPostDaemon *daemon, time_t current_time)
-{
-        return (current_time < daemon->bypass_http_post_ts + NETWORK_BYPASS_DURATION) ? true : false;
-}
-
-/* set http bypass */
-static void start_network_bypass(TelemPostDaemon *daemon)
-{
-        daemon->bypass_http_post_ts = time(NULL);
-}
-
 /* burst limit check  */
 bool burst_limit_enabled(int64_t burst_limit)
 {
@@ -158,50 +158,313 @@ static void initialize_signals(TelemPostDaemon *daemon)
         set_pollfd(daemon, sigfd, signlfd, POLLIN);
 }
 
-static void initialize_rate_limit(TelemPostDaemon *daemon)
+static void configure_rate_limit(TelemPostDaemon *daemon)
 {
-        for (int i = 0; i < TM_RATE_LIMIT_SLOTS; i++) {
-                daemon->record_burst_array[i] = 0;
-                daemon->byte_burst_array[i] = 0;
-        }
+        int ret;
+
         daemon->rate_limit_enabled = rate_limit_enabled_config();
         daemon->record_burst_limit = record_burst_limit_config();
         daemon->record_window_length = record_window_length_config();
         daemon->byte_burst_limit = byte_burst_limit_config();
         daemon->byte_window_length = byte_window_length_config();
         daemon->rate_limit_strategy = rate_limit_strategy_config();
+
+        /* Classifications are limited unless all rate limiting is disabled */
+        ret = class_limits_init(&daemon->class_limits, daemon->rate_limit_enabled ?
+                                class_rate_limits_config() : NULL);
+        if (ret == -ENOMEM) {
+                telem_log(LOG_ERR, "Unable to allocate memory, exiting\n");
+                exit(EXIT_FAILURE);
+        } else if (ret < 0) {
+                telem_log(LOG_ERR, "Invalid class_rate_limits value, ignoring it\n");
+        }
+}
+
+static void configure_aggregation(TelemPostDaemon *daemon)
+{
+        int ret = aggregator_init(&daemon->aggregator, class_aggregation_config());
+
+        if (ret == -ENOMEM) {
+                telem_log(LOG_ERR, "Unable to allocate memory, exiting\n");
+                exit(EXIT_FAILURE);
+        } else if (ret < 0) {
+                telem_log(LOG_ERR, "Invalid class_aggregation value, ignoring it\n");
+        }
+}
+
+static void initialize_rate_limit(TelemPostDaemon *daemon)
+{
+        for (int i = 0; i < TM_RATE_LIMIT_SLOTS; i++) {
+                daemon->record_burst_array[i] = 0;
+                daemon->byte_burst_array[i] = 0;
+        }
+        configure_rate_limit(daemon);
+}
+
+static void initialize_record_ring(TelemPostDaemon *daemon)
+{
+        struct sockaddr_un addr;
+        char *path = NULL;
+        int ret;
+
+        ring_init(&daemon->ring);
+        daemon->ring_sock = -1;
+        daemon->ring_client = -1;
+        daemon->pollfds[ringsockfd].fd = -1;
+        daemon->pollfds[ringfd].fd = -1;
+
+        if (!ring_buffer_enabled_config()) {
+                return;
+        }
+
+        ret = ring_create(&daemon->ring, (size_t)ring_buffer_size_config() * 1024);
+        if (ret < 0) {
+                telem_log(LOG_ERR, "Unable to create record ring, staging"
+                          " records on disk: %s\n", strerror(-ret));
+                return;
+        }
+
+        path = ring_socket_path();
+        if (!path) {
+                telem_log(LOG_ERR, "Unable to allocate memory, exiting\n");
+                exit(EXIT_FAILURE);
+        }
+
+        daemon->ring_sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (daemon->ring_sock < 0) {
+                telem_perror("Failed to open record ring socket");
+                goto fail;
+        }
+
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+
+        /* Left behind by a previous run */
+        unlink(path);
+        if (bind(daemon->ring_sock, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+            listen(daemon->ring_sock, SOMAXCONN) != 0) {
+                telem_perror("Failed to listen on record ring socket");
+                goto fail;
+        }
+
+        set_pollfd(daemon, daemon->ring_sock, ringsockfd, POLLIN);
+        set_pollfd(daemon, daemon->ring.eventfd, ringfd, POLLIN);
+        free(path);
+        return;
+fail:
+        if (daemon->ring_sock >= 0) {
+                close(daemon->ring_sock);
+                daemon->ring_sock = -1;
+        }
+        ring_destroy(&daemon->ring);
+        free(path);
 }
 
 static void initialize_record_delivery(TelemPostDaemon *daemon)
 {
         daemon->record_retention_enabled = record_retention_enabled_config();
+        if (daemon->record_retention_enabled) {
+                retention_init(compressed_retention_config());
+        }
         daemon->record_server_delivery_enabled = record_server_delivery_enabled_config();
+
+        /* Register record retention delete action as a callback to prune entry */
+        if (daemon->record_journal != NULL) {
+                daemon->record_journal->prune_entry_callback =
+                        daemon->record_retention_enabled ? &delete_record_by_id : NULL;
+                daemon->record_journal->prune_batch_callback =
+                        daemon->record_retention_enabled ? &delete_records_by_id : NULL;
+        }
+}
+
+static void configure_journal_sync(TelemPostDaemon *daemon)
+{
+        const char *sync = journal_sync_config();
+
+        if (daemon->record_journal == NULL) {
+                return;
+        }
+        set_journal_sync(daemon->record_journal,
+                         strcmp(sync, "entry") == 0 ? JOURNAL_SYNC_ENTRY :
+                         strcmp(sync, "group") == 0 ? JOURNAL_SYNC_GROUP :
+                         JOURNAL_SYNC_NONE,
+                         journal_group_entries_config(),
+                         journal_group_time_config());
+}
+
+static void initialize_config_watch(TelemPostDaemon *daemon)
+{
+        int ret = config_watch_init(&daemon->config_watch);
+
+        if (ret < 0) {
+                telem_log(LOG_WARNING, "Not watching the configuration files: %s\n",
+                          strerror(-ret));
+        }
+        if (daemon->config_watch.fd >= 0) {
+                set_pollfd(daemon, daemon->config_watch.fd, configfd, POLLIN);
+        } else {
+                daemon->pollfds[configfd].fd = -1;
+        }
+}
+
+static void initialize_destinations(TelemPostDaemon *daemon)
+{
+        int ret;
+
+        memset(&daemon->destinations, 0, sizeof(daemon->destinations));
+        if (!daemon->is_spool_valid) {
+                return;
+        }
+        ret = destinations_init(&daemon->destinations, destinations_config(),
+                                spool_dir_config());
+        if (ret < 0) {
+                telem_log(LOG_ERR, "Invalid destinations, records are only"
+                          " sent to the server: %s\n", strerror(-ret));
+        } else if (ret > 0) {
+                telem_log(LOG_INFO, "Records are also sent to %d destinations\n", ret);
+        }
+}
+
+static void initialize_record_io(void)
+{
+        int ret;
+
+        if (!io_uring_enabled_config()) {
+                return;
+        }
+        ret = record_io_init(TM_RECORD_IO_DEPTH);
+        if (ret < 0) {
+                telem_log(LOG_WARNING, "Not using io_uring for record files: %s\n",
+                          strerror(-ret));
+        }
+}
+
+static void initialize_stage_pool(TelemPostDaemon *daemon)
+{
+        int nworkers = post_worker_threads_config();
+        int ret = stage_pool_start(&daemon->stage_pool, nworkers);
+
+        if (ret < 0) {
+                telem_log(LOG_WARNING, "Unable to start worker threads, staged"
+                          " records are read here: %s\n", strerror(-ret));
+        } else if (nworkers > 0) {
+                telem_log(LOG_INFO, "Started %d worker threads\n",
+                          daemon->stage_pool.nworkers);
+        }
 }
 
 void initialize_post_daemon(TelemPostDaemon *daemon)
 {
         assert(daemon);
 
-        daemon->bypass_http_post_ts = 0;
+        retry_sched_init(&daemon->retry_sched, (unsigned int)time(NULL) ^
+                         (unsigned int)getpid(), spool_drain_min_records_config(),
+                         spool_drain_max_records_config());
         daemon->is_spool_valid = is_spool_valid();
+        spool_index_init(&daemon->spool_index);
+        spool_index_init(&daemon->unindexed);
         daemon->record_journal = open_journal(JOURNAL_PATH);
+        configure_journal_sync(daemon);
+        initialize_record_io();
+        initialize_stage_pool(daemon);
         daemon->fd = inotify_init();
         if (daemon->fd < 0) {
                 telem_perror("Error initializing inotify");
                 exit(EXIT_FAILURE);
         }
-        daemon->wd = inotify_add_watch(daemon->fd, spool_dir_config(), IN_CLOSE_WRITE);
+        daemon->wd = inotify_add_watch(daemon->fd, spool_dir_config(),
+                                       IN_CLOSE_WRITE | IN_MOVED_TO);
+
+        /* Tail the staging log, appends to a segment show up as IN_MODIFY */
+        daemon->log_wd = -1;
+        if (staging_log_enabled_config()) {
+                char *log_dir = staging_log_dir();
+
+                if (!log_dir) {
+                        telem_log(LOG_ERR, "Unable to allocate memory, exiting\n");
+                        exit(EXIT_FAILURE);
+                }
+                if (mkdir(log_dir, S_IRWXU) != 0 && errno != EEXIST) {
+                        telem_perror("Unable to create staging log directory");
+                } else {
+                        daemon->log_wd = inotify_add_watch(daemon->fd, log_dir,
+                                                           IN_MODIFY | IN_CLOSE_WRITE);
+                        if (daemon->log_wd < 0) {
+                                telem_perror("Error watching staging log");
+                        }
+                }
+                free(log_dir);
+        }
 
         initialize_signals(daemon);
         set_pollfd(daemon, daemon->fd, watchfd, POLLIN);
+        initialize_config_watch(daemon);
 
         initialize_rate_limit(daemon);
+        configure_aggregation(daemon);
         initialize_record_delivery(daemon);
-        /* Register record retention delete action as a callback to prune entry */
-        if (daemon->record_journal != NULL && daemon->record_retention_enabled) {
-                daemon->record_journal->prune_entry_callback = &delete_record_by_id;
+        initialize_record_ring(daemon);
+        post_multi_init(&daemon->posts, max_inflight_posts_config());
+        spool_run_init(&daemon->spool_run, &daemon->posts, &daemon->spool_index,
+                       &daemon->retry_sched, &daemon->spool_usage);
+        post_batch_init(&daemon->batch, batch_post_max_records_config(),
+                        (size_t)batch_post_max_size_config() * 1024,
+                        batch_post_max_time_config());
+        daemon->batching = false;
+        memset(daemon->drain_queues, 0, sizeof(daemon->drain_queues));
+        daemon->drain_queued = 0;
+        spool_usage_init(&daemon->spool_usage, 0);
+
+        /* After exiting for recycling, the spool is not scanned again */
+        daemon->warm_start = daemon->is_spool_valid && daemon->state_file &&
+                             post_state_load(daemon, daemon->state_file,
+                                             spool_dir_config());
+        if (daemon->is_spool_valid && !daemon->warm_start) {
+                int ret = spool_index_rebuild(&daemon->spool_index, spool_dir_config());
+
+                if (ret < 0) {
+                        telem_log(LOG_ERR, "Error while scanning spool: %s\n",
+                                  strerror(-ret));
+                }
+                /* Each file was just looked at, no other walk is needed */
+                spool_usage_init(&daemon->spool_usage,
+                                 spool_index_disk_size(&daemon->spool_index));
+        }
+        initialize_destinations(daemon);
+}
+
+/* Processes a record once its aggregation window is over, see aggregate_fn */
+static void process_aggregate(char *data, size_t size, time_t staged_time, void *arg);
+
+bool reload_post_daemon(TelemPostDaemon *daemon)
+{
+        assert(daemon);
+
+        if (!reload_config()) {
+                return false;
         }
-        daemon->current_spool_size = 0;
+
+        /* The counts of the burst windows are kept, the token buckets of
+         * the classifications start full again */
+        class_limits_free(&daemon->class_limits);
+        configure_rate_limit(daemon);
+        retention_close();
+        initialize_record_delivery(daemon);
+        configure_journal_sync(daemon);
+        retry_sched_set_drain_bounds(&daemon->retry_sched,
+                                     spool_drain_min_records_config(),
+                                     spool_drain_max_records_config());
+        mem_budget_set_limit(memory_budget_config());
+        destinations_free(&daemon->destinations);
+        initialize_destinations(daemon);
+        /* The records held are processed with the windows they were held for */
+        aggregator_flush(&daemon->aggregator, time(NULL), true, process_aggregate, daemon);
+        aggregator_free(&daemon->aggregator);
+        configure_aggregation(daemon);
+
+        telem_log(LOG_INFO, "Configuration reloaded\n");
+        return true;
 }
 
 size_t write_callback(char *ptr, size_t size, size_t nmemb, void *userdata)
@@ -210,36 +473,28 @@ size_t write_callback(char *ptr, size_t size, size_t nmemb, void *userdata)
         return size * nmemb;
 }
 
-bool post_record_http(char *headers[], char *body, char *cfg)
+/*
+ * With http_keepalive, the easy handle and the connections it caches are
+ * kept between POSTs, so a backlog of records is sent over one connection
+ * without a new TCP and TLS handshake each time.
+ */
+static CURL *post_handle = NULL;
+
+/**
+ * Gets a curl handle for a POST, reusing the kept handle if there is one
+ *
+ * @return the handle, exits if out of memory
+ */
+static CURL *get_post_handle(void)
 {
         CURL *curl;
-        int res = 0;
-        char *content = "Content-Type: application/text";
-        struct curl_slist *custom_headers = NULL;
-        char errorbuf[CURL_ERROR_SIZE];
-        long http_response = 0;
-        const char *cert_file = get_cainfo_config();
-        const char *tid_header = get_tidheader_config();
-        const char *saved_config_file = NULL;
-
-        if (cfg != NULL) {
-                saved_config_file = get_config_file();
-                if (set_config_file(cfg) != 0) {
-                       telem_log(LOG_ERR, "set-config_file(): Failed to set %s\n", cfg);
-                       // If we fail to load the specified config file, do not send the
-                       // record out. We don't want to send the record out with different
-                       // settings than explicitly requested.
-                       // However, report success so the record gets deleted.
-                       res = 0;
-                       goto Done;
-                }
-                reload_config();
-                telem_debug("DEBUG: override server_addr:%s\n", server_addr_config());
-        }
-
-        // Initialize the libcurl global environment once per POST. This lets us
-        // clean up the environment after each POST so that when the daemon is
-        // sitting idle, it will be consuming as little memory as possible.
+
+        if (post_handle) {
+                /* Options are cleared, live connections and caches are kept */
+                curl_easy_reset(post_handle);
+                return post_handle;
+        }
+
         curl_global_init(CURL_GLOBAL_ALL);
 
         curl = curl_easy_init();
@@ -249,12 +504,51 @@ bool post_record_http(char *headers[], char *body, char *cfg)
                 exit(EXIT_FAILURE);
                 /* TODO: check if memory needs to be released */
         }
+        if (http_keepalive_config()) {
+                post_handle = curl;
+        }
 
-        // Errors for any curl_easy_* functions will store nice error messages
-        // in errorbuf, so send log messages with errorbuf contents
-        curl_easy_setopt(curl, CURLOPT_ERRORBUFFER, errorbuf);
+        return curl;
+}
+
+/**
+ * Releases a handle obtained from get_post_handle() unless it is kept
+ */
+static void put_post_handle(CURL *curl)
+{
+        if (curl != post_handle) {
+                curl_easy_cleanup(curl);
+                curl_global_cleanup();
+        }
+}
+
+/**
+ * Closes the kept connection to the server, so the daemon uses as little
+ * memory as possible while it is idle
+ */
+static void close_post_handle(void)
+{
+        if (post_handle) {
+                curl_easy_cleanup(post_handle);
+                post_handle = NULL;
+                curl_global_cleanup();
+        }
+}
 
-        curl_easy_setopt(curl, CURLOPT_URL, server_addr_config());
+/**
+ * Sets the options of a POST to the server shared by single records and
+ * batches
+ *
+ * @param curl The easy handle
+ * @param config The configuration the POST is sent with
+ * @param async true if the handle is run with the curl multi interface
+ */
+static void set_server_options(CURL *curl, const struct configuration *config,
+                               bool async)
+{
+        const char *cert_file = config->strValues[CONF_CAINFO];
+
+        curl_easy_setopt(curl, CURLOPT_URL, config->strValues[CONF_SERVER_ADDR]);
         curl_easy_setopt(curl, CURLOPT_CONNECTTIMEOUT, 5L);
         curl_easy_setopt(curl, CURLOPT_TIMEOUT, 10L);
         curl_easy_setopt(curl, CURLOPT_POST, 1);
@@ -264,17 +558,17 @@ bool post_record_http(char *headers[], char *body, char *cfg)
 
         curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, write_callback);
 
-        for (int i = 0; i < NUM_HEADERS; i++) {
-                custom_headers = curl_slist_append(custom_headers, headers[i]);
-        }
-        custom_headers = curl_slist_append(custom_headers, tid_header);
-        // This should be set by probes/libtelemetry in the future
-        custom_headers = curl_slist_append(custom_headers, content);
-
-        curl_easy_setopt(curl, CURLOPT_HTTPHEADER, custom_headers);
-        curl_easy_setopt(curl, CURLOPT_POSTFIELDS, body);
-        curl_easy_setopt(curl, CURLOPT_POSTFIELDSIZE, strlen(body));
         curl_easy_setopt(curl, CURLOPT_USE_SSL, CURLUSESSL_TRY);
+        /* Connections are kept by the kept handle or the multi handle */
+        if (async || curl == post_handle) {
+                curl_easy_setopt(curl, CURLOPT_TCP_KEEPALIVE, 1L);
+        }
+#if LIBCURL_VERSION_NUM >= 0x072f00
+        if (config->boolValues[CONF_HTTP2_ENABLED]) {
+                curl_easy_setopt(curl, CURLOPT_HTTP_VERSION,
+                                 (long)CURL_HTTP_VERSION_2TLS);
+        }
+#endif
 
         if (strlen(cert_file) > 0) {
                 if (access(cert_file, F_OK) != -1) {
@@ -282,188 +576,780 @@ bool post_record_http(char *headers[], char *body, char *cfg)
                         telem_log(LOG_INFO, "cafile was set to %s\n", cert_file);
                 }
         }
+}
 
-        telem_log(LOG_DEBUG, "Executing curl operation...\n");
-        errorbuf[0] = 0;
-        res = curl_easy_perform(curl);
-        curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &http_response);
-
-        if (res) {
-                size_t len = strlen(errorbuf);
-                if (len) {
-                        telem_log(LOG_DEBUG, "Failed sending record: %s%s", errorbuf,
-                                  ((errorbuf[len - 1] != '\n') ? "\n" : ""));
-                } else {
-                        telem_log(LOG_DEBUG, "Failed sending record: %s\n",
-                                  curl_easy_strerror(res));
-                }
-        } else if (http_response != 201 && http_response != 200) {
-                /*  201 means the record was  successfully created
-                 *  200 is a generic "ok".
-                 */
-                telem_log(LOG_ERR, "Encountered error %ld on the server\n",
-                          http_response);
-                // We treat HTTP error codes the same as libcurl errors
-                res = 1;
-        } else {
-                telem_log(LOG_INFO, "Record sent successfully\n");
+/**
+ * Sets the body of a POST, compressed if compressed_uploads is enabled
+ *
+ * @param curl The easy handle
+ * @param config The configuration the POST is sent with
+ * @param body The body
+ * @param size Size of body in bytes
+ * @param compressed true if body is already compressed
+ * @param async true if the handle outlives body, which is then copied
+ *
+ * @return true if the body is sent with the gzip content encoding
+ */
+static bool set_post_body(CURL *curl, const struct configuration *config,
+                          char *body, size_t size, bool compressed, bool async)
+{
+        char *gz = NULL;
+        size_t gz_size;
+
+        if (!compressed && config->boolValues[CONF_COMPRESSED_UPLOADS]) {
+                if (gzip_compress(body, size, &gz, &gz_size) == 0) {
+                        curl_easy_setopt(curl, CURLOPT_POSTFIELDSIZE, (long)gz_size);
+                        curl_easy_setopt(curl, CURLOPT_COPYPOSTFIELDS, gz);
+                        free(gz);
+                        return true;
+                }
+                telem_log(LOG_WARNING, "Unable to compress record, sending it as is\n");
         }
 
-        curl_slist_free_all(custom_headers);
-        curl_easy_cleanup(curl);
-
-        curl_global_cleanup();
-
-Done:
-        if (saved_config_file != NULL) {
-                if (set_config_file(saved_config_file) != 0) {
-                        telem_log(LOG_ERR, "set-config_file(): Failed to set %s",
-                                  saved_config_file);
-                        res = 1;
-                }
-                reload_config();
-                telem_debug("DEBUG: restored server_addr:%s\n", server_addr_config());
+        curl_easy_setopt(curl, CURLOPT_POSTFIELDSIZE, (long)size);
+        if (async) {
+                curl_easy_setopt(curl, CURLOPT_COPYPOSTFIELDS, body);
+        } else {
+                curl_easy_setopt(curl, CURLOPT_POSTFIELDS, body);
         }
 
-        return res ? false : true;
+        return compressed;
 }
 
-static void save_local_copy(TelemPostDaemon *daemon, char *body)
+/* Position in the payload file of a streamed record being sent */
+struct post_stream {
+        int fd;
+        off_t begin;
+        off_t offset;
+        off_t end;
+};
+
+static size_t read_stream_callback(char *buffer, size_t size, size_t nitems,
+                                   void *userdata)
 {
-        int ret = 0;
-        char *tmpbuf = NULL;
-        FILE *tmpfile = NULL;
+        struct post_stream *stream = (struct post_stream *)userdata;
+        size_t want = size * nitems;
+        ssize_t len;
 
-        if (daemon == NULL || daemon->record_journal == NULL ||
-            daemon->record_journal->latest_record_id == NULL) {
-                return;
+        if (stream->offset >= stream->end) {
+                return 0;
         }
-
-        ret = asprintf(&tmpbuf, "%s/%s", RECORD_RETENTION_DIR,
-                       daemon->record_journal->latest_record_id);
-        if (ret == -1) {
-                telem_log(LOG_ERR, "Failed to allocate memory for record full path, aborting\n");
-                return;
+        if ((off_t)want > stream->end - stream->offset) {
+                want = (size_t)(stream->end - stream->offset);
         }
 
-        tmpfile = fopen(tmpbuf, "w");
-        if (!tmpfile) {
-                telem_perror("Error opening local record copy temp file");
-                goto save_err;
+        do {
+                len = pread(stream->fd, buffer, want, stream->offset);
+        } while (len < 0 && errno == EINTR);
+        if (len <= 0) {
+                telem_log(LOG_ERR, "Unable to read streamed record payload\n");
+                return CURL_READFUNC_ABORT;
         }
+        stream->offset += len;
 
-        // Save body
-        fprintf(tmpfile, "%s\n", body);
-        fclose(tmpfile);
-
-save_err:
-        free(tmpbuf);
-        return;
+        return (size_t)len;
 }
 
-static void save_entry_to_journal(TelemPostDaemon *daemon, time_t t_stamp, char *headers[])
+static int seek_stream_callback(void *userdata, curl_off_t offset, int origin)
 {
-        char *classification_value = NULL;
-        char *event_id_value = NULL;
+        struct post_stream *stream = (struct post_stream *)userdata;
 
-        if (get_header_value(headers[TM_CLASSIFICATION], &classification_value) &&
-            get_header_value(headers[TM_EVENT_ID], &event_id_value)) {
-                if (new_journal_entry(daemon->record_journal, classification_value, t_stamp, event_id_value) != 0) {
-                        telem_log(LOG_INFO, "new_journal_entry in process_record: failed saving record entry\n");
-                }
+        if (origin != SEEK_SET || offset < 0 || offset > stream->end - stream->begin) {
+                return CURL_SEEKFUNC_CANTSEEK;
         }
-        free(classification_value);
-        free(event_id_value);
+        stream->offset = stream->begin + (off_t)offset;
+
+        return CURL_SEEKFUNC_OK;
 }
 
-/* Check window length conf values */
-static bool windows_length_value_check(TelemPostDaemon *daemon)
+/**
+ * Sets the body of a POST to the payload of a streamed record, read from its
+ * file as it is sent. Such uploads may take longer than the timeout of other
+ * POSTs, they are only aborted if they stall.
+ *
+ * @param curl The easy handle
+ * @param record The record, with a streamed payload
+ * @param stream Position in the payload, which must outlive the POST
+ */
+static void set_post_stream(CURL *curl, struct staged_record *record,
+                            struct post_stream *stream)
 {
-        if (daemon->record_window_length == -1 ||
-            daemon->byte_window_length == -1) {
-                telem_log(LOG_ERR, "Invalid value for window length\n");
-                return false;
-        }
-
-        return true;
+        stream->fd = record->body_fd;
+        stream->begin = record->body_offset;
+        stream->offset = record->body_offset;
+        stream->end = record->body_offset + (off_t)record->body_size;
+
+        curl_easy_setopt(curl, CURLOPT_READFUNCTION, read_stream_callback);
+        curl_easy_setopt(curl, CURLOPT_READDATA, stream);
+        curl_easy_setopt(curl, CURLOPT_SEEKFUNCTION, seek_stream_callback);
+        curl_easy_setopt(curl, CURLOPT_SEEKDATA, stream);
+        curl_easy_setopt(curl, CURLOPT_POSTFIELDSIZE_LARGE, (curl_off_t)record->body_size);
+        curl_easy_setopt(curl, CURLOPT_TIMEOUT, 0L);
+        curl_easy_setopt(curl, CURLOPT_LOW_SPEED_LIMIT, TM_STREAM_LOW_SPEED_LIMIT);
+        curl_easy_setopt(curl, CURLOPT_LOW_SPEED_TIME, TM_STREAM_LOW_SPEED_TIME);
 }
 
-/* Rate limiting checks */
-static void rate_limit_checks(TelemPostDaemon *daemon, bool *record_check_passed, bool *byte_check_passed)
+/**
+ * Sets the options of a POST of a record to the server
+ *
+ * @param curl The easy handle
+ * @param config The configuration the record is sent with
+ * @param record The record
+ * @param async true if the handle outlives the record, which is then copied
+ *
+ * @return the list of headers set on the handle, to be freed with it
+ */
+static struct curl_slist *set_post_options(CURL *curl,
+                                           const struct configuration *config,
+                                           struct staged_record *record,
+                                           bool async)
 {
-        time_t temp = time(NULL);
-        struct tm *tm_s = localtime(&temp);
-        int current_minute;
-        current_minute = tm_s->tm_min;
-        bool record_burst_enabled = burst_limit_enabled(daemon->record_burst_limit);
-        bool byte_burst_enabled =  burst_limit_enabled(daemon->byte_burst_limit);
+        char *content = record->raw ? "Content-Type: application/octet-stream" :
+                        "Content-Type: application/text";
+        struct curl_slist *custom_headers = NULL;
+        const char *tid_header = config->strValues[CONF_TIDHEADER];
+        long sample_rate;
 
-        /* Checks if entirety of rate limiting is enabled */
-        if (daemon->rate_limit_enabled) {
-                /* Checks whether record and byte bursts are enabled individually */
-                record_burst_enabled = burst_limit_enabled(daemon->record_burst_limit);
-                byte_burst_enabled = burst_limit_enabled(daemon->byte_burst_limit);
+        set_server_options(curl, config, async);
 
-                if (record_burst_enabled) {
-                        *record_check_passed = rate_limit_check(current_minute,
-                                                                daemon->record_burst_limit, daemon->record_window_length,
-                                                                daemon->record_burst_array, TM_RECORD_COUNTER);
-                }
-                if (byte_burst_enabled) {
-                        *byte_check_passed = rate_limit_check(current_minute,
-                                                              daemon->byte_burst_limit, daemon->byte_window_length,
-                                                              daemon->byte_burst_array, RECORD_SIZE_LEN);
-                }
-                /* If both record and byte burst disabled, rate limiting disabled */
-                if (!record_burst_enabled && !byte_burst_enabled) {
-                        daemon->rate_limit_enabled = false;
-                }
+        for (int i = 0; i < NUM_HEADERS; i++) {
+                custom_headers = curl_slist_append(custom_headers, record->headers[i]);
+        }
+        custom_headers = curl_slist_append(custom_headers, tid_header);
+        // This should be set by probes/libtelemetry in the future
+        custom_headers = curl_slist_append(custom_headers, content);
+        if (record->trace.present && record_trace_header_config()) {
+                char trace[TRACE_HEADER_SIZE];
+
+                trace_header(&record->trace, trace, sizeof(trace));
+                custom_headers = curl_slist_append(custom_headers, trace);
+        }
+        /* The server weighs sampled records by their rate */
+        if ((sample_rate = record_sample_rate(record->headers)) > 1) {
+                char header[64];
+
+                snprintf(header, sizeof(header), SAMPLE_RATE_HEADER ": %ld", sample_rate);
+                custom_headers = curl_slist_append(custom_headers, header);
         }
+        if (record->occurrences > 0) {
+                char header[96];
+
+                snprintf(header, sizeof(header), OCCURRENCES_HEADER ": %d",
+                         record->occurrences);
+                custom_headers = curl_slist_append(custom_headers, header);
+                snprintf(header, sizeof(header), OCCURRENCE_TIMES_HEADER ": %lld-%lld",
+                         (long long)record->first_staged, (long long)record->last_staged);
+                custom_headers = curl_slist_append(custom_headers, header);
+        }
+
+        /* The payload of a streamed record is set by post_record_http() */
+        if (!record->streamed &&
+            set_post_body(curl, config, record->body, record->body_size,
+                          record->compressed, async)) {
+                custom_headers = curl_slist_append(custom_headers, GZIP_CONTENT_ENCODING);
+        }
+        curl_easy_setopt(curl, CURLOPT_HTTPHEADER, custom_headers);
 
+        return custom_headers;
 }
 
-/* Wrapper for save local copy */
-static void apply_retention_policies(TelemPostDaemon *daemon, char *body)
+/**
+ * Gets the configuration a record is sent with, its own configuration file
+ * if it names one
+ *
+ * @param record The record
+ *
+ * @return the configuration, or NULL if the record's configuration file
+ *     could not be loaded
+ */
+static const struct configuration *record_config(struct staged_record *record)
 {
-        if (daemon->record_retention_enabled) {
-                save_local_copy(daemon, body);
+        const struct configuration *config;
+
+        if (record->cfg_file == NULL) {
+                return get_config();
+        }
+
+        config = get_cached_config(record->cfg_file);
+        if (config == NULL) {
+                telem_log(LOG_ERR, "Failed to load configuration file %s\n",
+                          record->cfg_file);
+                return NULL;
         }
+        telem_debug("DEBUG: override server_addr:%s\n",
+                    config->strValues[CONF_SERVER_ADDR]);
+
+        return config;
 }
 
-/* Deliver record to backend if rate limiting policies are met otherwise
- * spool record for future delivery */
-static bool deliver_record(TelemPostDaemon *daemon, char *headers[], char *body, char* cfg_file)
+bool post_record_http(struct staged_record *record)
 {
-
+        CURL *curl;
         bool ret = false;
-        int current_minute;
-        bool do_spool = false;
-        bool record_sent = false;
-        time_t temp = time(NULL);
+        struct curl_slist *custom_headers = NULL;
+        char errorbuf[CURL_ERROR_SIZE];
+        struct post_stream stream;
+        const struct configuration *config = record_config(record);
+
+        if (!config) {
+                // If we fail to load the specified config file, do not send the
+                // record out. We don't want to send the record out with different
+                // settings than explicitly requested.
+                // However, report success so the record gets deleted.
+                return true;
+        }
+
+        // Unless the handle is kept, initialize the libcurl global environment
+        // once per POST. This lets us clean up the environment after each POST
+        // so that when the daemon is sitting idle, it will be consuming as
+        // little memory as possible.
+        curl = get_post_handle();
+
+        // Errors for any curl_easy_* functions will store nice error messages
+        // in errorbuf, so send log messages with errorbuf contents
+        curl_easy_setopt(curl, CURLOPT_ERRORBUFFER, errorbuf);
+        custom_headers = set_post_options(curl, config, record, false);
+        if (record->streamed) {
+                set_post_stream(curl, record, &stream);
+        }
+
+        telem_log(LOG_DEBUG, "Executing curl operation...\n");
+        errorbuf[0] = 0;
+        ret = post_request_succeeded(curl, curl_easy_perform(curl), errorbuf);
+
+        curl_slist_free_all(custom_headers);
+        put_post_handle(curl);
+
+        return ret;
+}
+
+bool post_record_destination(struct staged_record *record,
+                             struct destination *dest)
+{
+        struct curl_slist *custom_headers = NULL;
+        char errorbuf[CURL_ERROR_SIZE];
+        struct post_stream stream;
+        bool ret;
+
+        /* Each destination keeps its handle, and its connection, until the
+         * daemon is idle */
+        if (dest->handle) {
+                curl_easy_reset(dest->handle);
+        } else {
+                curl_global_init(CURL_GLOBAL_ALL);
+                dest->handle = curl_easy_init();
+                if (!dest->handle) {
+                        telem_log(LOG_ERR, "curl_easy_init(): Unable to start libcurl"
+                                  " easy session, exiting\n");
+                        exit(EXIT_FAILURE);
+                }
+        }
+
+        curl_easy_setopt(dest->handle, CURLOPT_ERRORBUFFER, errorbuf);
+        custom_headers = set_post_options(dest->handle, get_config(), record, false);
+        curl_easy_setopt(dest->handle, CURLOPT_URL, dest->url);
+        curl_easy_setopt(dest->handle, CURLOPT_TCP_KEEPALIVE, 1L);
+        if (record->streamed) {
+                set_post_stream(dest->handle, record, &stream);
+        }
+
+        errorbuf[0] = 0;
+        ret = post_request_succeeded(dest->handle, curl_easy_perform(dest->handle),
+                                     errorbuf);
+
+        curl_slist_free_all(custom_headers);
+
+        return ret;
+}
+
+bool post_record_async(struct post_multi *pm, struct staged_record *record,
+                       const char *key, post_done_fn fn, void *arg)
+{
+        CURL *curl;
+        struct curl_slist *custom_headers = NULL;
+        const struct configuration *config = record_config(record);
+        bool ret;
+
+        if (!config) {
+                /* Same as a blocking POST, the record is deleted */
+                fn(true, arg);
+                return true;
+        }
+
+        /* Streamed payloads are read from their file during the POST */
+        if (record->streamed) {
+                fn(post_record_http(record), arg);
+                return true;
+        }
+
+        /* Held until the multi handle exists */
+        curl_global_init(CURL_GLOBAL_ALL);
+
+        curl = curl_easy_init();
+        if (!curl) {
+                telem_log(LOG_ERR, "curl_easy_init(): Unable to start libcurl"
+                          " easy session, exiting\n");
+                exit(EXIT_FAILURE);
+        }
+        custom_headers = set_post_options(curl, config, record, true);
+
+        telem_log(LOG_DEBUG, "Starting curl operation...\n");
+        ret = (post_multi_add(pm, curl, custom_headers, key, fn, arg) == 0);
+
+        curl_global_cleanup();
+
+        return ret;
+}
+
+/* Status lines the server answers a batch with */
+struct batch_response {
+        char *data;
+        size_t size;
+};
+
+/* Longer responses are not status lines for TM_BATCH_POST_MAX_RECORDS records */
+#define BATCH_RESPONSE_MAX (TM_BATCH_POST_MAX_RECORDS * 16)
+
+static size_t batch_response_callback(char *ptr, size_t size, size_t nmemb,
+                                      void *userdata)
+{
+        struct batch_response *response = (struct batch_response *)userdata;
+        size_t len = size * nmemb;
+        char *tmp;
+
+        if (response->size + len > BATCH_RESPONSE_MAX) {
+                telem_log(LOG_ERR, "Batch response too long, ignoring the rest\n");
+                return len;
+        }
+
+        tmp = realloc(response->data, response->size + len);
+        if (!tmp) {
+                telem_log(LOG_ERR, "Unable to allocate memory, exiting\n");
+                exit(EXIT_FAILURE);
+        }
+        memcpy(tmp + response->size, ptr, len);
+        response->data = tmp;
+        response->size += len;
+
+        return len;
+}
+
+int post_batch_http(struct post_batch *batch)
+{
+        CURL *curl;
+        bool accepted;
+        int sent;
+        struct curl_slist *custom_headers = NULL;
+        struct batch_response response = { 0 };
+        char errorbuf[CURL_ERROR_SIZE];
+        char *count_header = NULL;
+
+        if (batch->count == 0) {
+                return 0;
+        }
+
+        if (asprintf(&count_header, POST_BATCH_COUNT_HEADER ": %d", batch->count) == -1) {
+                telem_log(LOG_ERR, "Unable to allocate memory, exiting\n");
+                exit(EXIT_FAILURE);
+        }
+
+        curl = get_post_handle();
+        curl_easy_setopt(curl, CURLOPT_ERRORBUFFER, errorbuf);
+        set_server_options(curl, get_config(), false);
+        curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, batch_response_callback);
+        curl_easy_setopt(curl, CURLOPT_WRITEDATA, &response);
+
+        custom_headers = curl_slist_append(custom_headers, get_tidheader_config());
+        custom_headers = curl_slist_append(custom_headers, POST_BATCH_CONTENT_TYPE);
+        custom_headers = curl_slist_append(custom_headers, count_header);
+        if (set_post_body(curl, get_config(), batch->body, batch->size, false,
+                          false)) {
+                custom_headers = curl_slist_append(custom_headers, GZIP_CONTENT_ENCODING);
+        }
+        curl_easy_setopt(curl, CURLOPT_HTTPHEADER, custom_headers);
+
+        telem_log(LOG_DEBUG, "Executing batched curl operation, %d records...\n",
+                  batch->count);
+        errorbuf[0] = 0;
+        accepted = post_request_succeeded(curl, curl_easy_perform(curl), errorbuf);
+
+        curl_slist_free_all(custom_headers);
+        put_post_handle(curl);
+        free(count_header);
+
+        sent = post_batch_complete(batch, accepted, response.data, response.size);
+        free(response.data);
+
+        return sent;
+}
+
+static void save_local_copy(TelemPostDaemon *daemon, struct staged_record *record)
+{
+        if (daemon == NULL || daemon->record_journal == NULL ||
+            daemon->record_journal->latest_record_id == NULL) {
+                return;
+        }
+
+        /* Streamed payloads are too large to be kept with the others */
+        if (record->streamed) {
+                telem_log(LOG_INFO, "Not keeping a copy of record %s, its payload is"
+                          " too large\n", daemon->record_journal->latest_record_id);
+                return;
+        }
+
+        save_record_copy(daemon->record_journal->latest_record_id, record->body,
+                         record->body_size);
+}
+
+static void save_entry_to_journal(TelemPostDaemon *daemon, time_t t_stamp, char *headers[])
+{
+        char *classification_value = NULL;
+        char *event_id_value = NULL;
+        int count = daemon->record_journal ? daemon->record_journal->record_count : 0;
+        uint64_t start = metrics_clock();
+
+        if (get_header_value(headers[TM_CLASSIFICATION], &classification_value) &&
+            get_header_value(headers[TM_EVENT_ID], &event_id_value)) {
+                if (new_journal_entry(daemon->record_journal, classification_value, t_stamp, event_id_value) != 0) {
+                        telem_log(LOG_INFO, "new_journal_entry in process_record: failed saving record entry\n");
+                } else if (daemon->record_journal &&
+                           daemon->record_journal->record_count <= count) {
+                        /* The journal was pruned to fit the entry */
+                        metrics_observe(METRIC_POSTD_JOURNAL_PRUNE_TIME,
+                                        metrics_clock() - start);
+                        metrics_count(METRIC_POSTD_JOURNAL_PRUNED, (uint64_t)(count + 1 -
+                                      daemon->record_journal->record_count));
+                }
+        }
+        free(classification_value);
+        free(event_id_value);
+}
+
+/* Check window length conf values */
+static bool windows_length_value_check(TelemPostDaemon *daemon)
+{
+        if (daemon->record_window_length == -1 ||
+            daemon->byte_window_length == -1) {
+                telem_log(LOG_ERR, "Invalid value for window length\n");
+                return false;
+        }
+
+        return true;
+}
+
+/* Rate limiting checks */
+static void rate_limit_checks(TelemPostDaemon *daemon, bool *record_check_passed, bool *byte_check_passed)
+{
+        time_t temp = time(NULL);
+        struct tm *tm_s = localtime(&temp);
+        int current_minute;
+        current_minute = tm_s->tm_min;
+        bool record_burst_enabled = burst_limit_enabled(daemon->record_burst_limit);
+        bool byte_burst_enabled =  burst_limit_enabled(daemon->byte_burst_limit);
+
+        /* Checks if entirety of rate limiting is enabled */
+        if (daemon->rate_limit_enabled) {
+                /* Checks whether record and byte bursts are enabled individually */
+                record_burst_enabled = burst_limit_enabled(daemon->record_burst_limit);
+                byte_burst_enabled = burst_limit_enabled(daemon->byte_burst_limit);
+
+                if (record_burst_enabled) {
+                        *record_check_passed = rate_limit_check(current_minute,
+                                                                daemon->record_burst_limit, daemon->record_window_length,
+                                                                daemon->record_burst_array, TM_RECORD_COUNTER);
+                }
+                if (byte_burst_enabled) {
+                        *byte_check_passed = rate_limit_check(current_minute,
+                                                              daemon->byte_burst_limit, daemon->byte_window_length,
+                                                              daemon->byte_burst_array, RECORD_SIZE_LEN);
+                }
+                /* If both record and byte burst disabled, rate limiting disabled */
+                if (!record_burst_enabled && !byte_burst_enabled) {
+                        daemon->rate_limit_enabled = false;
+                }
+        }
+
+}
+
+/* Takes a token of the classification of a record, if it has a limit */
+static bool class_limit_check(TelemPostDaemon *daemon, struct staged_record *record)
+{
+        const char *classification = record->headers[TM_CLASSIFICATION];
+        const char *end;
+        struct timespec now;
+
+        if (!daemon->class_limits.buckets || !classification) {
+                return true;
+        }
+
+        /* The header value, without copying it */
+        classification = strchr(classification, ':');
+        if (!classification) {
+                return true;
+        }
+        classification++;
+        while (*classification == ' ') {
+                classification++;
+        }
+        end = classification + strcspn(classification, "\r\n");
+
+        clock_gettime(CLOCK_MONOTONIC, &now);
+
+        return class_limits_take(&daemon->class_limits, classification,
+                                 (size_t)(end - classification),
+                                 (int64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000);
+}
+
+/* Wrapper for save local copy */
+static void apply_retention_policies(TelemPostDaemon *daemon, struct staged_record *record)
+{
+        if (daemon->record_retention_enabled) {
+                save_local_copy(daemon, record);
+        }
+}
+
+/* Updates rate limiting arrays once a record was sent */
+static void rate_limit_record_sent(TelemPostDaemon *daemon, int current_minute)
+{
+        if (burst_limit_enabled(daemon->record_burst_limit)) {
+                rate_limit_update(current_minute, daemon->record_window_length,
+                                  daemon->record_burst_array, TM_RECORD_COUNTER);
+        }
+        if (burst_limit_enabled(daemon->byte_burst_limit)) {
+                rate_limit_update(current_minute, daemon->byte_window_length,
+                                  daemon->byte_burst_array, RECORD_SIZE_LEN);
+        }
+}
+
+static long spool_record_data(TelemPostDaemon *daemon, char *data, size_t size,
+                              time_t staged_time, struct record_trace *trace);
+
+/**
+ * Keeps a record file in the spool and adds it to the spool index. If
+ * compressed_spool is enabled, the file is first replaced by a copy with its
+ * payload compressed.
+ *
+ * @param daemon pointer to telemetry post daemon
+ * @param filename the record file
+ * @param record the record read from filename, or NULL to read it
+ * @param trace trace of the record, saved in the kept file if present
+ * @param staged_time time the record was staged
+ * @param disk_size space the record file takes in the spool directory
+ * @param priority delivery priority class of the record
+ */
+static void keep_record_file(TelemPostDaemon *daemon, char *filename,
+                             struct staged_record *record,
+                             struct record_trace *trace, time_t staged_time,
+                             long disk_size, int priority);
+
+/*
+ * A record sent with the curl multi interface or in a batch, and what to do
+ * with it once the POST completes
+ */
+struct staged_post {
+        TelemPostDaemon *daemon;
+        /* record file in the spool, removed once sent, or NULL */
+        char *filename;
+        /* raw record data, spooled if the POST fails, or NULL */
+        char *data;
+        size_t size;
+        time_t staged_time;
+        long disk_size;
+        int minute;
+        /* delivery priority class, see record_priority() */
+        int priority;
+        /* the record file was already kept in the spool before */
+        bool is_retry;
+        /* copy of the trace of the record */
+        struct record_trace trace;
+};
+
+static void free_staged_post(struct staged_post *post)
+{
+        free(post->filename);
+        free(post->data);
+        free(post);
+}
+
+static void staged_post_done(bool sent, void *arg)
+{
+        struct staged_post *post = (struct staged_post *)arg;
+        TelemPostDaemon *daemon = post->daemon;
+        bool remove = true;
+
+        if (sent) {
+                retry_sched_success(&daemon->retry_sched);
+                rate_limit_record_sent(daemon, post->minute);
+                trace_delivered(&post->trace);
+        } else {
+                retry_sched_failure(&daemon->retry_sched, time(NULL));
+                remove = !spool_strategy_selected(daemon);
+        }
+
+        if (post->filename && remove) {
+                record_io_unlink(post->filename);
+                spool_usage_remove(&daemon->spool_usage, post->disk_size);
+        } else if (post->filename && post->is_retry) {
+                /* Retries were compressed the first time they were kept */
+                spool_index_add(&daemon->spool_index, post->filename,
+                                post->staged_time, post->disk_size, post->priority);
+        } else if (post->filename) {
+                keep_record_file(daemon, post->filename, NULL, &post->trace,
+                                 post->staged_time, post->disk_size, post->priority);
+        } else if (post->data && !remove) {
+                spool_record_data(daemon, post->data, post->size, post->staged_time,
+                                  &post->trace);
+        }
+
+        free_staged_post(post);
+}
+
+/* Copies the source of a record for its completion callback */
+static struct staged_post *new_staged_post(struct staged_post *source,
+                                           int current_minute)
+{
+        struct staged_post *post;
+
+        post = malloc(sizeof(struct staged_post));
+        if (!post) {
+                telem_log(LOG_ERR, "Unable to allocate memory, exiting\n");
+                exit(EXIT_FAILURE);
+        }
+        *post = *source;
+        post->minute = current_minute;
+        if (source->filename && !(post->filename = strdup(source->filename))) {
+                telem_log(LOG_ERR, "Unable to allocate memory, exiting\n");
+                exit(EXIT_FAILURE);
+        }
+
+        return post;
+}
+
+/**
+ * Adds a record to the batch, sending the batch once it is full. The record
+ * is completed in staged_post_done() when the batch is sent, and source no
+ * longer owns its raw data.
+ */
+static void deliver_record_batch(TelemPostDaemon *daemon,
+                                 struct staged_record *record,
+                                 struct staged_post *source, int current_minute)
+{
+        struct staged_post *post = new_staged_post(source, current_minute);
+        int ret;
+
+        ret = post_batch_add(&daemon->batch, record, staged_post_done, post);
+        if (ret == -ENOSPC) {
+                post_batch_ptr(&daemon->batch);
+                ret = post_batch_add(&daemon->batch, record, staged_post_done, post);
+        }
+        if (ret < 0) {
+                telem_log(LOG_ERR, "Unable to allocate memory, exiting\n");
+                exit(EXIT_FAILURE);
+        }
+        source->data = NULL;
+
+        if (post_batch_full(&daemon->batch)) {
+                post_batch_ptr(&daemon->batch);
+        }
+}
+
+/**
+ * Starts the POST of a record with the curl multi interface
+ *
+ * @return true if the record is being sent, and source now belongs to the
+ *     transfer
+ */
+static bool deliver_record_async(TelemPostDaemon *daemon,
+                                 struct staged_record *record,
+                                 struct staged_post *source, int current_minute)
+{
+        struct staged_post *post = new_staged_post(source, current_minute);
+
+        if (!post_record_async(&daemon->posts, record, post->filename,
+                               staged_post_done, post)) {
+                post->data = NULL;
+                free_staged_post(post);
+                return false;
+        }
+        /* The raw data is now owned by the transfer */
+        source->data = NULL;
+
+        return true;
+}
+
+/* Deliver record to backend if rate limiting policies are met otherwise
+ * spool record for future delivery. With a source, the record may be sent
+ * with the curl multi interface or in a batch instead, and *pending is set. */
+static bool deliver_record(TelemPostDaemon *daemon, struct staged_record *record,
+                           struct staged_post *source, bool *pending)
+{
+
+        bool ret = false;
+        int current_minute;
+        bool do_spool = false;
+        bool record_sent = false;
+        time_t temp = time(NULL);
         struct tm *tm_s = localtime(&temp);
         current_minute = tm_s->tm_min;
         /* Checks flags */
         bool record_check_passed = true;
         bool byte_check_passed = true;
-        bool record_burst_enabled = burst_limit_enabled(daemon->record_burst_limit);
-        bool byte_burst_enabled =  burst_limit_enabled(daemon->byte_burst_limit);
+        bool class_check_passed = true;
 
         /* Perform record and byte rate limiting checks */
         rate_limit_checks(daemon, &record_check_passed, &byte_check_passed);
 
+        /* Then the limit of its classification, within the global limits */
+        if ((!daemon->rate_limit_enabled || (record_check_passed && byte_check_passed)) &&
+            !class_limit_check(daemon, record)) {
+                telem_log(LOG_DEBUG, "Classification rate limit reached\n");
+                class_check_passed = false;
+        }
+
         /* Sends record if rate limiting is disabled, or all checks passed */
-        if (!daemon->rate_limit_enabled || (record_check_passed && byte_check_passed)) {
+        if ((!daemon->rate_limit_enabled || (record_check_passed && byte_check_passed)) &&
+            class_check_passed) {
+                /* Records with another configuration or a streamed payload
+                 * are sent alone */
+                if (source && daemon->batching && !record->streamed &&
+                    (!record->cfg_file ||
+                     strcmp(record->cfg_file, get_config_file()) == 0)) {
+                        deliver_record_batch(daemon, record, source, current_minute);
+                        *pending = true;
+                        return false;
+                }
+                if (source && post_multi_enabled(&daemon->posts) &&
+                    deliver_record_async(daemon, record, source, current_minute)) {
+                        /* Completed in staged_post_done(), keep it until then */
+                        *pending = true;
+                        return false;
+                }
                 /* Send the record as https post */
-                record_sent = post_record_ptr(headers, body, cfg_file);
+                record_sent = post_record_ptr(record);
                 /**
                  * This is the only point where an error condition could be returned
                  * if the record was not sent
                  * */
                 ret = record_sent;
+                if (record_sent) {
+                        retry_sched_success(&daemon->retry_sched);
+                        trace_delivered(&record->trace);
+                } else {
+                        retry_sched_failure(&daemon->retry_sched, temp);
+                }
+        } else {
+                /* Rate limited, a probe let through was not sent */
+                retry_sched_cancel(&daemon->retry_sched);
         }
         // Get rate-limit strategy
         do_spool = spool_strategy_selected(daemon);
 
+        if (!record_sent && !(record_check_passed && byte_check_passed &&
+                              class_check_passed)) {
+                metrics_count(do_spool ? METRIC_POSTD_RATE_LIMIT_SPOOLED :
+                              METRIC_POSTD_RATE_LIMIT_DROPPED, 1);
+        }
+
         // Drop record
         if (!record_sent && !do_spool) {
                 // Not an error condition
@@ -471,71 +1357,61 @@ static bool deliver_record(TelemPostDaemon *daemon, char *headers[], char *body,
         }
         // Spool Record
         else if (!record_sent && do_spool) {
-                start_network_bypass(daemon);
-                telem_log(LOG_INFO, "process_record: initializing direct-spool window\n");
                 // False will keep record around
                 ret = false;
         } else {
-                /* Updates rate limiting arrays if record sent */
-                if (record_burst_enabled) {
-                        rate_limit_update(current_minute, daemon->record_window_length,
-                                          daemon->record_burst_array, TM_RECORD_COUNTER);
-                }
-                if (byte_burst_enabled) {
-                        rate_limit_update(current_minute, daemon->byte_window_length,
-                                          daemon->byte_burst_array, RECORD_SIZE_LEN);
-                }
+                rate_limit_record_sent(daemon, current_minute);
         }
 
         return ret;
 }
 
-bool process_staged_record(char *filename, bool is_retry, TelemPostDaemon *daemon)
+/**
+ * Applies the journal, retention, delivery and spool policies to a record.
+ *
+ * @param daemon pointer to telemetry post daemon
+ * @param record the record, with its non-default configuration file if any
+ * @param staged_time time the record was staged
+ * @param disk_size space the record takes in the spool directory
+ * @param is_retry true if the record has been previously processed
+ * @param source where the record comes from, to finish processing it once a
+ *     POST with the curl multi interface or a batch completes, or NULL
+ * @param pending set to true if the record is being sent that way
+ *
+ * @return true if the record can be removed, false to keep it in the spool
+ */
+static bool process_record_data(TelemPostDaemon *daemon, struct staged_record *record,
+                                time_t staged_time, long disk_size, bool is_retry,
+                                struct staged_post *source, bool *pending)
 {
-        int k;
         bool ret = false;
-        char *headers[NUM_HEADERS];
-        char *body = NULL;
-        struct stat buf = { 0 };
         time_t current_time = time(NULL);
         int64_t max_spool_size = 0;
-        char *cfg_file = NULL;
-
-        for (k = 0; k < NUM_HEADERS; k++) {
-                headers[k] = NULL;
-        }
-
-        /** Load record **/
-        if ((ret = read_record(filename, headers, &body, &cfg_file)) == false) {
-                telem_log(LOG_WARNING, "unable to read record\n");
-                ret = true; // Record corrupted? true will remove record
-                goto end_processing_file;
-        }
 
-        /** Get file information  **/
-        if (stat(filename, &buf) == -1) {
-                telem_perror("Processing staged file unable to stat record in spool");
-                ret = true; // true to remove it
-                goto end_processing_file;
+        /* New record files are in the spool directory, retries are
+         * already counted */
+        if (!is_retry) {
+                spool_usage_add(&daemon->spool_usage, disk_size);
         }
 
-        /** Update spool directory size **/
-        daemon->current_spool_size += (buf.st_blocks * 512);
-
         /** Check that record is not expired **/
-        if (!S_ISREG(buf.st_mode) ||
-            (current_time - buf.st_mtime > (record_expiry_config() * 60)) ||
-            (buf.st_uid  != getuid())) {
+        if (current_time - staged_time > (record_expiry_config() * 60)) {
                 ret = true; // Expired, true to remove it
-                goto end_processing_file;
+                goto end_processing;
+        }
+
+        /* Picked up now, unless this is a retry */
+        trace_stamp(&record->trace, TRACE_PICKED, trace_clock());
+        if (source) {
+                source->trace = record->trace;
         }
 
         /* Retries should not be recorded */
         if (is_retry == false) {
                 /** Journal entry **/
-                save_entry_to_journal(daemon, current_time, headers);
+                save_entry_to_journal(daemon, current_time, record->headers);
                 /** Record retention **/
-                apply_retention_policies(daemon, body);
+                apply_retention_policies(daemon, record);
         }
 
         /** Record delivery **/
@@ -543,16 +1419,21 @@ bool process_staged_record(char *filename, bool is_retry, TelemPostDaemon *daemo
                 telem_log(LOG_INFO, "record server delivery disabled\n");
                 // Not an error condition
                 ret = true;
-                goto end_processing_file;
+                goto end_processing;
         }
 
-        /** Spool policies **/
-        if (inside_direct_spool_window(daemon, time(NULL))) {
+        /** Spool policies, the server is not sent records while unreachable **/
+        if (!retry_sched_allow(&daemon->retry_sched, current_time)) {
+                if (!spool_strategy_selected(daemon)) {
+                        telem_log(LOG_INFO, "Server unreachable, dropping record\n");
+                        ret = true;
+                        goto end_processing;
+                }
                 telem_log(LOG_INFO, "process_record: delivering directly to spool\n");
                 /* Check spool max size conf */
                 max_spool_size = spool_max_size_config();
                 if (max_spool_size != -1 &&
-                    daemon->current_spool_size >= (max_spool_size * 1024)) {
+                    daemon->spool_usage.bytes >= (max_spool_size * 1024)) {
                         // Drop record
                         telem_log(LOG_INFO, "Spool dir full, dropping record\n");
                         ret = true;
@@ -560,7 +1441,7 @@ bool process_staged_record(char *filename, bool is_retry, TelemPostDaemon *daemo
                         // Keep record, non error condition
                         ret = false;
                 }
-                goto end_processing_file;
+                goto end_processing;
         }
 
         /** Check window_length **/
@@ -569,82 +1450,597 @@ bool process_staged_record(char *filename, bool is_retry, TelemPostDaemon *daemo
         }
 
         /** Deliver or spool **/
-        ret = deliver_record(daemon, headers, body, cfg_file);
+        ret = deliver_record(daemon, record, source, pending);
 
-end_processing_file:
+end_processing:
         /** Update spool size if record will be removed **/
         if (ret) {
-                daemon->current_spool_size -= (buf.st_blocks * 512);
+                spool_usage_remove(&daemon->spool_usage, disk_size);
         }
-        telem_log(LOG_DEBUG, "spool_size: %ld\n", daemon->current_spool_size);
-        free(body);
+        telem_log(LOG_DEBUG, "spool_size: %ld\n", daemon->spool_usage.bytes);
 
-        for (k = 0; k < NUM_HEADERS; k++) {
-                free(headers[k]);
+        return ret;
+}
+
+/**
+ * Processes a record read from a staged file
+ *
+ * @param daemon pointer to telemetry post daemon
+ * @param filename path of the file
+ * @param is_retry true if the record has been previously processed
+ * @param loaded false if the file could not be read
+ * @param loaded_record the record read, freed here
+ * @param loaded_buf file information of the file
+ *
+ * @return true if the file can be removed
+ */
+static bool process_loaded_record(TelemPostDaemon *daemon, char *filename,
+                                  bool is_retry, bool loaded,
+                                  struct staged_record *loaded_record,
+                                  struct stat *loaded_buf)
+{
+        bool ret = false;
+        bool pending = false;
+        struct staged_record record = *loaded_record;
+        struct stat buf = *loaded_buf;
+        struct staged_post source = { 0 };
+
+        if (!loaded) {
+                telem_log(LOG_WARNING, "unable to read record\n");
+                return true; // Record corrupted? true will remove record
+        }
+
+        if (!S_ISREG(buf.st_mode) || (buf.st_uid  != getuid())) {
+                ret = true; // Not ours, true to remove it
+                goto end_processing_file;
+        }
+
+        if (is_retry) {
+                trace_retry(&record.trace, filename);
+        } else if (record_sampled_out(record.headers)) {
+                telem_log(LOG_DEBUG, "Record %s sampled out\n", filename);
+                ret = true;
+                goto end_processing_file;
+        } else if (aggregator_add(&daemon->aggregator, &record, record.data,
+                                  (size_t)(record.body + record.body_size - record.data),
+                                  buf.st_mtime)) {
+                /* Held in memory, or counted */
+                ret = true;
+                goto end_processing_file;
         }
 
-        if (cfg_file != NULL) {
-                free(cfg_file);
+        source.daemon = daemon;
+        source.filename = filename;
+        source.staged_time = buf.st_mtime;
+        source.disk_size = buf.st_blocks * 512;
+        source.priority = record_priority(&record);
+
+        /* Each destination gets the record the first time it is seen */
+        if (daemon->destinations.count > 0 && !record.cfg_file &&
+            !(buf.st_mode & TM_FANNED_OUT_MODE)) {
+                destinations_fan_out_file(&daemon->destinations, filename, &buf,
+                                          source.priority);
+        }
+        source.is_retry = is_retry;
+        ret = process_record_data(daemon, &record, buf.st_mtime, buf.st_blocks * 512,
+                                  is_retry, &source, &pending);
+
+        /* Kept in the spool, retries were compressed the first time */
+        if (!ret && !pending && is_retry) {
+                spool_index_add(&daemon->spool_index, filename, buf.st_mtime,
+                                buf.st_blocks * 512, source.priority);
+        } else if (!ret && !pending) {
+                keep_record_file(daemon, filename, &record, &record.trace,
+                                 buf.st_mtime, buf.st_blocks * 512, source.priority);
         }
+
+end_processing_file:
+        free_record(&record);
         return ret;
 }
 
-static int directory_dot_filter(const struct dirent *entry)
+bool process_staged_record(char *filename, bool is_retry, TelemPostDaemon *daemon)
 {
-        if ((strcmp(entry->d_name, ".") == 0) || (strcmp(entry->d_name, "..") == 0)) {
-                return 0;
+        struct staged_record record = { 0 };
+        struct stat buf = { 0 };
+        bool loaded;
+
+        /* Already being sent, it is removed once that completes */
+        if (post_multi_pending(&daemon->posts, filename)) {
+                return false;
+        }
+
+        /** Load record and get file information **/
+        loaded = record_io_read(filename, &record, &buf);
+
+        return process_loaded_record(daemon, filename, is_retry, loaded, &record, &buf);
+}
+
+/* Processes the record the workers read first, and removes its file if it
+ * is done with. Returns false if no file is queued to them. */
+static bool process_next_staged_file(TelemPostDaemon *daemon)
+{
+        struct stage_job job;
+
+        if (!stage_pool_take(&daemon->stage_pool, &job)) {
+                return false;
+        }
+        /* Already being sent, it is removed once that completes */
+        if (post_multi_pending(&daemon->posts, job.path)) {
+                if (job.loaded) {
+                        free_record(&job.record);
+                }
+        } else if (process_loaded_record(daemon, job.path, job.is_retry, job.loaded,
+                                         &job.record, &job.st)) {
+                record_io_unlink(job.path);
+        }
+        free(job.path);
+
+        return true;
+}
+
+/**
+ * Processes a staged record file, and removes it if done with. With worker
+ * threads, the file is only queued to them, and the records they read are
+ * processed in order once the queue is full or by finish_staged_files().
+ *
+ * @param daemon pointer to telemetry post daemon
+ * @param path path of the file, now owned by this function
+ * @param is_retry true if the record has been previously processed
+ */
+static void process_staged_file(TelemPostDaemon *daemon, char *path, bool is_retry)
+{
+        if (!stage_pool_enabled(&daemon->stage_pool)) {
+                if (process_staged_record(path, is_retry, daemon)) {
+                        record_io_unlink(path);
+                }
+                free(path);
+                return;
+        }
+
+        /* A file read twice before being processed would be sent twice */
+        if (stage_pool_queued(&daemon->stage_pool, path)) {
+                free(path);
+                return;
+        }
+        if (stage_pool_full(&daemon->stage_pool)) {
+                process_next_staged_file(daemon);
+        }
+        stage_pool_queue(&daemon->stage_pool, path, is_retry);
+}
+
+/* Processes the records of the files queued to the workers */
+static void finish_staged_files(TelemPostDaemon *daemon)
+{
+        while (process_next_staged_file(daemon)) {
+        }
+}
+
+/**
+ * Moves a record read from the staging log or the record ring that has to be
+ * kept into the spool, as a regular record file. The file is written in the
+ * staging log directory and linked into the spool directory, so the file
+ * watcher does not pick it up as a new record. The trace of the record, if
+ * present, is updated in data.
+ */
+static long spool_record_data(TelemPostDaemon *daemon, char *data, size_t size,
+                              time_t staged_time, struct record_trace *trace)
+{
+        char *dir = NULL;
+        char *tmp = NULL;
+        char *dest = NULL;
+        char *compressed = NULL;
+        size_t compressed_size;
+        struct timespec times[2];
+        struct stat buf = { 0 };
+        int fd = -1;
+
+        if (trace && trace->present && trace->offset + TRACE_LINE_LENGTH <= size) {
+                trace_stamp(trace, TRACE_SPOOLED, trace_clock());
+                trace_format(trace, data + trace->offset);
+        }
+
+        /* Kept records take less space with their payload compressed */
+        if (compressed_spool_config() &&
+            compress_record(data, size, &compressed, &compressed_size) == 0) {
+                data = compressed;
+                size = compressed_size;
+        }
+
+        dir = staging_log_dir();
+        if (!dir) {
+                telem_log(LOG_ERR, "Failed to allocate memory for record path, aborting\n");
+                exit(EXIT_FAILURE);
+        }
+        if (mkdir(dir, S_IRWXU) != 0 && errno != EEXIST) {
+                telem_perror("Unable to create staging log directory");
+                goto out;
+        }
+
+        do {
+                if (fd >= 0) {
+                        /* Name already used in the spool, pick another */
+                        close(fd);
+                        unlink(tmp);
+                }
+                free(tmp);
+                free(dest);
+                dest = NULL;
+
+                if (asprintf(&tmp, "%s/XXXXXX", dir) == -1) {
+                        telem_log(LOG_ERR, "Failed to allocate memory for record path, aborting\n");
+                        exit(EXIT_FAILURE);
+                }
+                fd = mkstemp(tmp);
+                if (fd < 0) {
+                        telem_perror("Error opening spool file");
+                        goto out;
+                }
+                if (asprintf(&dest, "%s/%s", spool_dir_config(), tmp + strlen(dir) + 1) == -1) {
+                        telem_log(LOG_ERR, "Failed to allocate memory for record path, aborting\n");
+                        exit(EXIT_FAILURE);
+                }
+        } while (access(dest, F_OK) == 0);
+
+        if (write(fd, data, size) != (ssize_t)size) {
+                telem_perror("Error writing spool file");
+                goto out_unlink;
+        }
+
+        /* Keep the staging time, record expiry is based on it */
+        times[0].tv_sec = times[1].tv_sec = staged_time;
+        times[0].tv_nsec = times[1].tv_nsec = 0;
+        if (futimens(fd, times) != 0) {
+                telem_perror("Error setting spool file time");
+        }
+        /* Spooled records were fanned out already */
+        if (daemon->destinations.count > 0) {
+                fchmod(fd, S_IRUSR | S_IWUSR | TM_FANNED_OUT_MODE);
+        }
+        fstat(fd, &buf);
+
+        if (link(tmp, dest) != 0) {
+                telem_perror("Error moving record to spool");
+                buf.st_blocks = 0;
         } else {
-                return 1;
+                /* Headers are never compressed */
+                spool_index_add(&daemon->spool_index, dest, staged_time,
+                                buf.st_blocks * 512, record_data_priority(data, size));
+                spool_usage_add(&daemon->spool_usage, buf.st_blocks * 512);
+        }
+
+out_unlink:
+        unlink(tmp);
+out:
+        if (fd >= 0) {
+                close(fd);
         }
+        free(dest);
+        free(tmp);
+        free(dir);
+        free(compressed);
+
+        return buf.st_blocks * 512;
 }
 
-int staging_records_loop(TelemPostDaemon *daemon)
+static void keep_record_file(TelemPostDaemon *daemon, char *filename,
+                             struct staged_record *record,
+                             struct record_trace *trace, time_t staged_time,
+                             long disk_size, int priority)
+{
+        struct staged_record file_record = { 0 };
+        long new_size = 0;
+
+        if (compressed_spool_config() && !record &&
+            read_record(filename, &file_record)) {
+                record = &file_record;
+        }
+
+        /* The compressed copy is indexed once it is in the spool, binary
+         * payloads are kept as they are */
+        if (compressed_spool_config() && record && !record->compressed && !record->raw) {
+                unparse_record(record);
+                new_size = spool_record_data(daemon, record->data,
+                                             (size_t)(record->body + record->body_size -
+                                                      record->data), staged_time,
+                                             trace);
+        }
+        free_record(&file_record);
+
+        /* Keep the original if the copy could not be written */
+        if (new_size == 0) {
+                if (trace && trace->present) {
+                        trace_stamp(trace, TRACE_SPOOLED, trace_clock());
+                        trace_save(trace, filename);
+                }
+                spool_index_add(&daemon->spool_index, filename, staged_time,
+                                disk_size, priority);
+                return;
+        }
+        record_io_unlink(filename);
+        spool_usage_remove(&daemon->spool_usage, disk_size);
+}
+
+/**
+ * Processes a record read from the staging log or the record ring, or held
+ * for its aggregation window
+ *
+ * @param aggregate false if the record was held already
+ */
+static void process_record_memory(TelemPostDaemon *daemon, char *data, size_t size,
+                                  time_t staged_time, bool aggregate)
+{
+        struct staged_record record = { 0 };
+        struct staged_post source = { 0 };
+        bool pending = false;
+
+        source.daemon = daemon;
+        source.staged_time = staged_time;
+        if (post_multi_enabled(&daemon->posts) || daemon->batching) {
+                /* Parsing changes data, keep a copy to spool it if the POST fails */
+                source.data = malloc(size);
+                if (!source.data) {
+                        telem_log(LOG_ERR, "Unable to allocate memory, exiting\n");
+                        exit(EXIT_FAILURE);
+                }
+                memcpy(source.data, data, size);
+                source.size = size;
+        }
+
+        if (parse_record(data, size, &record) == false) {
+                telem_log(LOG_WARNING, "unable to read staged record\n");
+                goto out;
+        }
+        source.priority = record_priority(&record);
+        if (aggregate && record_sampled_out(record.headers)) {
+                telem_log(LOG_DEBUG, "Staged record sampled out\n");
+                goto out;
+        }
+        if (aggregate && aggregator_add(&daemon->aggregator, &record, data,
+                                        (size_t)(record.body + record.body_size - data),
+                                        staged_time)) {
+                goto out;
+        }
+
+        /* Written once for all of the destinations, before being sent */
+        if (daemon->destinations.count > 0 && !record.cfg_file) {
+                unparse_record(&record);
+                destinations_fan_out_data(&daemon->destinations, data, size,
+                                          staged_time, source.priority);
+                if (parse_record(data, size, &record) == false) {
+                        goto out;
+                }
+        }
+
+        /* The record takes no space in the spool unless it is kept */
+        if (process_record_data(daemon, &record, staged_time, 0, false, &source,
+                                &pending) == false &&
+            !pending) {
+                unparse_record(&record);
+                spool_record_data(daemon, data, size, staged_time, &record.trace);
+        }
+out:
+        free(source.data);
+}
+
+static void process_record_buffer(char *data, size_t size, time_t staged_time, void *arg)
+{
+        process_record_memory((TelemPostDaemon *)arg, data, size, staged_time, true);
+}
+
+static void process_aggregate(char *data, size_t size, time_t staged_time, void *arg)
+{
+        process_record_memory((TelemPostDaemon *)arg, data, size, staged_time, false);
+}
+
+/* Processes the queued records, from the highest priority class */
+static void process_record_queues(TelemPostDaemon *daemon)
+{
+        for (int i = TM_PRIORITY_CLASSES - 1; i >= 0; i--) {
+                struct record_queue *queue = &daemon->drain_queues[i];
+
+                for (size_t j = 0; j < queue->count; j++) {
+                        struct queued_record *queued = &queue->records[j];
+
+                        process_record_buffer(queued->data, queued->size,
+                                              queued->staged_time, daemon);
+                        free(queued->data);
+                }
+                queue->count = 0;
+        }
+        daemon->drain_queued = 0;
+}
+
+/* Queues a drained record by priority class, the data is copied */
+static void queue_record_buffer(char *data, size_t size, time_t staged_time, void *arg)
+{
+        TelemPostDaemon *daemon = (TelemPostDaemon *)arg;
+        struct record_queue *queue;
+        struct queued_record *queued;
+
+        queue = &daemon->drain_queues[record_data_priority(data, size)];
+        if (queue->count == queue->alloc) {
+                size_t n = queue->alloc ? queue->alloc * 2 : 16;
+
+                queued = realloc(queue->records, n * sizeof(struct queued_record));
+                if (!queued) {
+                        telem_log(LOG_ERR, "Unable to allocate memory, exiting\n");
+                        exit(EXIT_FAILURE);
+                }
+                queue->records = queued;
+                queue->alloc = n;
+        }
+        queued = &queue->records[queue->count];
+        queued->data = malloc(size + 1);
+        if (!queued->data) {
+                telem_log(LOG_ERR, "Unable to allocate memory, exiting\n");
+                exit(EXIT_FAILURE);
+        }
+        memcpy(queued->data, data, size + 1);
+        queued->size = size;
+        queued->staged_time = staged_time;
+        queue->count++;
+
+        if (++daemon->drain_queued >= TM_DRAIN_QUEUE_MAX) {
+                process_record_queues(daemon);
+        }
+}
+
+int drain_staging_log(TelemPostDaemon *daemon)
 {
         int ret;
-        int processed;
-        int numentries;
-        struct dirent **namelist;
 
-        numentries = scandir(spool_dir_config(), &namelist, directory_dot_filter, NULL);
-        processed = 0;
+        ret = staging_log_drain(queue_record_buffer, daemon);
+        if (ret < 0) {
+                telem_log(LOG_ERR, "Error while reading staging log: %s\n",
+                          strerror(-ret));
+        }
+        process_record_queues(daemon);
+
+        return ret;
+}
+
+int drain_record_ring(TelemPostDaemon *daemon)
+{
+        int ret;
+
+        if (!daemon->ring.header) {
+                return 0;
+        }
+
+        ret = ring_drain(&daemon->ring, queue_record_buffer, daemon);
+        process_record_queues(daemon);
+
+        return ret;
+}
+
+static void accept_ring_client(TelemPostDaemon *daemon)
+{
+        struct ucred cred;
+        socklen_t len = sizeof(cred);
+        int fd;
+        int ret;
+
+        fd = accept4(daemon->ring_sock, NULL, NULL, SOCK_CLOEXEC);
+        if (fd < 0) {
+                telem_perror("Failed to accept record ring client");
+                return;
+        }
+
+        if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) != 0 ||
+            cred.uid != getuid()) {
+                telem_log(LOG_WARNING, "Refusing record ring to another user\n");
+                close(fd);
+                return;
+        }
+
+        if ((ret = ring_send_fds(fd, &daemon->ring)) < 0) {
+                telem_log(LOG_ERR, "Failed to hand over record ring: %s\n",
+                          strerror(-ret));
+                close(fd);
+                return;
+        }
+
+        /* There is a single producer, telemprobd was restarted */
+        if (daemon->ring_client >= 0) {
+                close(daemon->ring_client);
+        }
+        daemon->ring_client = fd;
+        telem_log(LOG_INFO, "Record ring handed over to telemprobd\n");
+}
+
+int staging_records_loop(TelemPostDaemon *daemon)
+{
+        struct spool_ahead ahead = { 0 };
+        struct spool_index retries;
+        struct spool_entry entry;
+
+        /* Records are completed once their batch is sent */
+        daemon->batching = batch_post_enabled_config();
+
+        /* Records staged in the log while the daemon was not running */
+        drain_staging_log(daemon);
+
+        /* With a warm state only the records spooled meanwhile are new,
+         * the others wait for the retry scheduler */
+        if (daemon->warm_start) {
+                while (spool_index_pop(&daemon->unindexed, &entry)) {
+                        char *record_path;
+
+                        if (asprintf(&record_path, "%s/%s", spool_dir_config(),
+                                     entry.name) == -1) {
+                                telem_log(LOG_ERR, "Failed to allocate memory for staging record full path\n");
+                                exit(EXIT_FAILURE);
+                        }
+                        process_staged_file(daemon, record_path, false);
+                        free(entry.name);
+                }
+                finish_staged_files(daemon);
+                spool_index_free(&daemon->unindexed);
+                daemon->warm_start = false;
+                post_batch_ptr(&daemon->batch);
+                daemon->batching = false;
+                post_multi_wait_all(&daemon->posts);
+
+                return (int)daemon->spool_index.count;
+        }
 
-        if (numentries == 0) {
+        /* Every spooled record is retried, the ones kept are indexed again */
+        retries = daemon->spool_index;
+        spool_index_init(&daemon->spool_index);
+        daemon->spool_index.seq = retries.seq;
+
+        if (retries.count == 0) {
+                post_batch_ptr(&daemon->batch);
+                daemon->batching = false;
                 telem_log(LOG_DEBUG, "No entries in staging\n");
-                return numentries;
-        } else if (numentries < 0) {
-                telem_perror("Error while scanning staging");
-                return numentries;
+                spool_index_free(&retries);
+                return 0;
         }
 
-        for (int i = 0; i < numentries; i++) {
+        /* Read ahead by the workers if any, otherwise by the backend */
+        while (stage_pool_enabled(&daemon->stage_pool) ?
+               spool_index_pop(&retries, &entry) :
+               spool_ahead_pop(&ahead, &retries, &entry)) {
                 char *record_path;
-                telem_log(LOG_DEBUG, "Processing staged record: %s\n",
-                          namelist[i]->d_name);
-                ret = asprintf(&record_path, "%s/%s", spool_dir_config(), namelist[i]->d_name);
-                if (ret == -1) {
+
+                telem_log(LOG_DEBUG, "Processing staged record: %s\n", entry.name);
+                if (asprintf(&record_path, "%s/%s", spool_dir_config(), entry.name) == -1) {
                         telem_log(LOG_ERR, "Failed to allocate memory for staging record full path\n");
                         exit(EXIT_FAILURE);
                 }
-                if (process_staged_record(record_path, true, daemon)) {
-                        unlink(record_path);
-                        processed++;
-                }
-                free(record_path);
+                process_staged_file(daemon, record_path, true);
+                free(entry.name);
+        }
+        finish_staged_files(daemon);
+        spool_ahead_done(&ahead, &retries);
+        spool_index_free(&retries);
+
+        /* Records being sent are only removed once their POST completes */
+        if (daemon->batching || daemon->posts.count > 0) {
+                post_batch_ptr(&daemon->batch);
+                daemon->batching = false;
+                post_multi_wait_all(&daemon->posts);
         }
 
-        for (int i = 0; i < numentries; i++) {
-                free(namelist[i]);
+        return (int)daemon->spool_index.count;
+}
+
+/* Shortens a timeout in seconds to expire at due, if due is set */
+static int timeout_until(int timeout, time_t due)
+{
+        time_t now = time(NULL);
+
+        if (due > 0 && due - now < timeout) {
+                return due > now ? (int)(due - now) : 0;
         }
-        free(namelist);
 
-        return numentries - processed;
+        return timeout;
 }
 
 void run_daemon(TelemPostDaemon *daemon)
 {
         int ret;
-        /* retry_attempt of zero indicates we don't need to retry */
-        int retry_attempt = 0;
         int spool_process_time = spool_process_time_config();
         bool daemon_recycling_enabled = daemon_recycling_enabled_config();
         time_t last_spool_run_time = time(NULL);
@@ -655,24 +2051,44 @@ void run_daemon(TelemPostDaemon *daemon)
         assert(daemon->pollfds[signlfd].fd);
         assert(daemon->pollfds[watchfd].fd);
 
-        /* If we failed to send spooled records, indicate we need to retry */
-        if (daemon->bypass_http_post_ts != 0) {
-                retry_attempt = 1;
-        }
-
         while (1) {
-                int retry_delay = spool_process_time;
-                malloc_trim(0);
-
-                /* check if we need to retry sending spooled records */
-                if (retry_attempt > 0) {
-                        retry_delay = retry_attempt * retry_attempt;
-                        daemon->bypass_http_post_ts = 0;
-                        telem_log(LOG_INFO, "Record delivery failed will retry in %d seconds",
-                                  retry_delay);
+                time_t next_spool_run;
+                int timeout = 0;
+                int journal_timeout;
+                bool reload = false;
+
+                /* The retry scheduler decides when the spool is processed */
+                next_spool_run = retry_sched_next_pass(&daemon->retry_sched,
+                                                       last_spool_run_time,
+                                                       spool_process_time,
+                                                       daemon->spool_index.count > 0);
+                if (next_spool_run > time(NULL)) {
+                        timeout = (int)(next_spool_run - time(NULL));
+                }
+                /* Each destination has its own scheduler */
+                timeout = timeout_until(timeout,
+                                        destinations_next_pass(&daemon->destinations,
+                                                               spool_process_time));
+                /* Records held are processed once their window is over */
+                timeout = timeout_until(timeout, aggregator_next_due(&daemon->aggregator));
+                /* POSTs completing may close the breaker, check again soon */
+                if (daemon->posts.count > 0 && timeout > TM_RETRY_BASE_DELAY) {
+                        timeout = TM_RETRY_BASE_DELAY;
+                }
+                timeout *= 1000;
+                /* Journal entries waiting for their group to be synced */
+                journal_timeout = journal_commit_timeout(daemon->record_journal);
+                if (journal_timeout >= 0 && journal_timeout < timeout) {
+                        timeout = journal_timeout;
+                }
+                /* A scan of the spool goes on while nothing else happens */
+                if (daemon->spool_usage.scan && daemon->posts.count == 0) {
+                        timeout = 0;
                 }
 
-                ret = poll(daemon->pollfds, NFDS, retry_delay * 1000);
+                /* POSTs in flight make progress while waiting */
+                ret = post_multi_poll(&daemon->posts, daemon->pollfds, NFDS,
+                                      timeout);
                 if (ret == -1) {
                         telem_perror("Failed to poll daemon file descriptors");
                         break;
@@ -692,12 +2108,17 @@ void run_daemon(TelemPostDaemon *daemon)
                                         telem_log(LOG_INFO, "Received either a \
                                                                      SIGINT/SIGTERM signal\n");
                                         break;
+                                } else if (fdsi.ssi_signo == SIGHUP) {
+                                        reload = true;
                                 }
+                        } else if (daemon->pollfds[configfd].revents != 0) {
+                                reload = config_watch_read(&daemon->config_watch);
                         } else if (daemon->pollfds[watchfd].revents != 0) {
 
                                 int ret = 0;
                                 ssize_t i = 0;
                                 ssize_t length = 0;
+                                bool log_modified = false;
                                 char buffer[BUFFER_LEN];
 
                                 length = read(daemon->fd, buffer, BUFFER_LEN);
@@ -710,8 +2131,12 @@ void run_daemon(TelemPostDaemon *daemon)
                                 while (i < length) {
                                         struct inotify_event *event = (struct inotify_event *)&buffer[i];
 
-                                        if (event->len) {
-                                                if (event->mask & IN_CLOSE_WRITE && !(event->mask & IN_ISDIR)) {
+                                        if (event->wd == daemon->log_wd) {
+                                                /* Read the log once for all events */
+                                                log_modified = true;
+                                        } else if (event->len) {
+                                                if (event->mask & (IN_CLOSE_WRITE | IN_MOVED_TO) &&
+                                                    !(event->mask & IN_ISDIR)) {
                                                         char *record_name = NULL;
 
                                                         /* Retrieve foldername from watch id?  */
@@ -721,19 +2146,33 @@ void run_daemon(TelemPostDaemon *daemon)
                                                                 exit(EXIT_FAILURE);
                                                         }
                                                         /* Process inotify event */
-                                                        if (process_staged_record(record_name, false, daemon)) {
-                                                                unlink(record_name);
-                                                        }
-                                                        free(record_name);
+                                                        process_staged_file(daemon, record_name, false);
                                                         last_record_received = time(NULL);
                                                 }
                                         }
 
                                         i += (ssize_t)EVENT_SIZE + event->len;
                                 }
+                                /* The files of these events, read by the workers */
+                                finish_staged_files(daemon);
+
+                                if (log_modified && drain_staging_log(daemon) > 0) {
+                                        last_record_received = time(NULL);
+                                }
+                        } else if (daemon->pollfds[ringfd].revents != 0) {
+                                if (drain_record_ring(daemon) > 0) {
+                                        last_record_received = time(NULL);
+                                }
+                        } else if (daemon->pollfds[ringsockfd].revents != 0) {
+                                accept_ring_client(daemon);
                         }
                 } else {
                         time_t now = time(NULL);
+
+                        close_post_handle();
+                        destinations_close(&daemon->destinations);
+                        post_multi_cleanup(&daemon->posts);
+
                         /* time to recycle the daemon has elapsed*/
                         if (daemon_recycling_enabled &&
                             difftime(now, last_record_received) >= TM_DAEMON_EXIT_TIME) {
@@ -742,48 +2181,114 @@ void run_daemon(TelemPostDaemon *daemon)
                                 break;
                         }
 
-                        /* Check if this was a retry attempt */
-                        if (retry_attempt > 0) {
-                                /* Stop attempting retries if successful, increment counter if not */
-                                if (staging_records_loop(daemon) == 0) {
-                                        retry_attempt = 0;
+                        /* Check spool  */
+                        if (now >= next_spool_run) {
+                                if (post_multi_enabled(&daemon->posts) &&
+                                    !batch_post_enabled_config()) {
+                                        spool_run_start(&daemon->spool_run);
                                 } else {
-                                        retry_attempt++;
-                                }
-                                /* Give up if counter reaches MAX_RETRY_ATTEMPTS */
-                                if (retry_attempt == MAX_RETRY_ATTEMPTS) {
-                                        telem_log(LOG_ERR, "Record deliver failed after %d attempts",
-                                                  MAX_RETRY_ATTEMPTS);
-                                        retry_attempt = 0;
+                                        spool_records_loop(&daemon->spool_index,
+                                                           &daemon->retry_sched,
+                                                           &daemon->spool_usage);
                                 }
+                                last_spool_run_time = time(NULL);
                         }
 
-                        /* Check spool  */
-                        if (difftime(now, last_spool_run_time) >= spool_process_time) {
-                                spool_records_loop(&(daemon->current_spool_size));
-                                last_spool_run_time = time(NULL);
+                        /* The destinations due get their pass */
+                        destinations_run(&daemon->destinations, spool_process_time);
+
+                        /* Check the space the spool takes, a step at a time */
+                        if (daemon->is_spool_valid && daemon->posts.count == 0) {
+                                spool_usage_scan_step(&daemon->spool_usage,
+                                                      spool_dir_config());
                         }
                 }
 
-                /* Check journal records and prune if needed */
-                ret = prune_journal(daemon->record_journal, JOURNAL_TMPDIR);
-                if (ret != 0) {
-                        telem_log(LOG_WARNING, "Unable to prune journal\n");
+                if (reload && reload_post_daemon(daemon)) {
+                        spool_process_time = spool_process_time_config();
+                        daemon_recycling_enabled = daemon_recycling_enabled_config();
                 }
+
+                aggregator_flush(&daemon->aggregator, time(NULL), false,
+                                 process_aggregate, daemon);
+
+                /* Sync the journal entries of which the group is due */
+                commit_journal(daemon->record_journal, false);
+
+                /* Records removed by this iteration */
+                record_io_submit();
+
+                metrics_set(METRIC_POSTD_SPOOL_RECORDS, (int64_t)daemon->spool_index.count);
+                metrics_set(METRIC_POSTD_SPOOL_BYTES, daemon->spool_usage.bytes);
+
+                /* Memory is given back once idle, or above the budget */
+                mem_budget_check(ret == 0 && daemon->posts.count == 0);
         }
 }
 
 void close_daemon(TelemPostDaemon *daemon)
 {
+        if (daemon->ring_sock >= 0) {
+                char *path = ring_socket_path();
+
+                close(daemon->ring_sock);
+                if (path) {
+                        unlink(path);
+                        free(path);
+                }
+        }
+        /* Once telemprobd sees the socket closed it stops pushing */
+        if (daemon->ring_client >= 0) {
+                close(daemon->ring_client);
+        }
+        drain_record_ring(daemon);
+        ring_destroy(&daemon->ring);
+        aggregator_flush(&daemon->aggregator, time(NULL), true, process_aggregate, daemon);
+        aggregator_free(&daemon->aggregator);
+
+        stage_pool_stop(&daemon->stage_pool);
+
+        /* Let the POSTs in flight complete, failed records are spooled */
+        spool_run_stop(&daemon->spool_run);
+        post_multi_wait_all(&daemon->posts);
+        post_multi_cleanup(&daemon->posts);
+        post_batch_free(&daemon->batch);
+
+        /* The spool state must not list records removed meanwhile */
+        record_io_close();
+
+        /* Read back by the next run, the spool is final now */
+        if (daemon->state_file && daemon->is_spool_valid) {
+                int ret = post_state_save(daemon, daemon->state_file, spool_dir_config());
+
+                if (ret < 0) {
+                        telem_log(LOG_WARNING, "Unable to save the daemon state: %s\n",
+                                  strerror(-ret));
+                }
+        }
+        class_limits_free(&daemon->class_limits);
+        for (int i = 0; i < TM_PRIORITY_CLASSES; i++) {
+                free(daemon->drain_queues[i].records);
+        }
+        spool_index_free(&daemon->spool_index);
+        spool_index_free(&daemon->unindexed);
+        spool_usage_free(&daemon->spool_usage);
+        destinations_free(&daemon->destinations);
 
         if (daemon->fd) {
                 if (daemon->wd) {
                         inotify_rm_watch(daemon->fd, daemon->wd);
                 }
+                if (daemon->log_wd >= 0) {
+                        inotify_rm_watch(daemon->fd, daemon->log_wd);
+                }
                 close(daemon->fd);
         }
 
+        config_watch_close(&daemon->config_watch);
+        close_post_handle();
         close_journal(daemon->record_journal);
+        retention_close();
 }
 
 /* vi: set ts=8 sw=8 sts=4 et tw=80 cino=(0: */
@@ -16,11 +16,15 @@
 
 #define EVENT_SIZE sizeof(struct inotify_event)
 #define BUFFER_LEN 1024 * (EVENT_SIZE + 16)
-#define NFDS 2
+#define NFDS 5
 #define TM_RATE_LIMIT_SLOTS (1 /*h*/ * 60 /*m*/)
 #define TM_RECORD_COUNTER (1)
-#define MAX_RETRY_ATTEMPTS 8
-#define NETWORK_BYPASS_DURATION TM_DAEMON_EXIT_TIME
+#define TM_DRAIN_QUEUE_MAX 256
+
+/* Streamed uploads are aborted when slower than TM_STREAM_LOW_SPEED_LIMIT
+ * bytes per second for TM_STREAM_LOW_SPEED_TIME seconds */
+#define TM_STREAM_LOW_SPEED_LIMIT 1024L
+#define TM_STREAM_LOW_SPEED_TIME 30L
 
 #include <poll.h>
 #include <stdbool.h>
@@ -29,19 +33,48 @@
 #include "common.h"
 #include "journal/journal.h"
 #include "configuration.h"
+#include "ringbuf.h"
+#include "postmulti.h"
+#include "postbatch.h"
+#include "iorecord.h"
+#include "spool.h"
+#include "retrysched.h"
+#include "classlimit.h"
+#include "configwatch.h"
+#include "destination.h"
+#include "aggregate.h"
+#include "stagepool.h"
+
+enum fdindex {signlfd, watchfd, ringsockfd, ringfd, configfd};
+
+/* A record read from the staging log or the record ring */
+struct queued_record {
+        char *data;
+        size_t size;
+        time_t staged_time;
+};
 
-enum fdindex {signlfd, watchfd};
+/* The records of a priority class waiting to be processed, in order */
+struct record_queue {
+        struct queued_record *records;
+        size_t count;
+        size_t alloc;
+};
 
 typedef struct TelemPostDaemon {
         int fd;
         int wd;
+        /* watch on the staging log directory, -1 if not used */
+        int log_wd;
         int sfd;
         char event_buffer[BUFFER_LEN];
         struct pollfd pollfds[NFDS];
+        /* Reloads the configuration once one of its files is edited */
+        struct config_watch config_watch;
         /* Telemetry Journal*/
         TelemJournal *record_journal;
-        /* Time of last failed post */
-        time_t bypass_http_post_ts;
+        /* Retries and circuit breaker of the record delivery */
+        struct retry_sched retry_sched;
         /* Rate limit record and byte arrays */
         size_t record_burst_array[TM_RATE_LIMIT_SLOTS];
         size_t byte_burst_array[TM_RATE_LIMIT_SLOTS];
@@ -52,12 +85,42 @@ typedef struct TelemPostDaemon {
         int64_t byte_burst_limit;
         int byte_window_length;
         const char *rate_limit_strategy;
+        /* Token buckets of classifications, within the limits above */
+        struct class_limits class_limits;
         /* Spool configuration */
         bool is_spool_valid;
-        long current_spool_size;
+        struct spool_usage spool_usage;
+        struct spool_index spool_index;
+        /* Warm state read at startup and written at exit, NULL if not used */
+        const char *state_file;
+        /* the spool index was read from the warm state, and the records
+         * added to the spool since are processed as new records */
+        bool warm_start;
+        struct spool_index unindexed;
+        /* Servers records are also sent to, each with its own spool */
+        struct destinations destinations;
+        /* Records held for their aggregation window */
+        struct aggregator aggregator;
         /* Record local copy and delivery  */
         bool record_retention_enabled;
         bool record_server_delivery_enabled;
+        /* Shared memory record ring, not mapped if disabled */
+        struct tm_ring ring;
+        /* socket the ring is handed over, and telemprobd's connection */
+        int ring_sock;
+        int ring_client;
+        /* Concurrent POSTs, used if max_inflight_posts is above 1 */
+        struct post_multi posts;
+        struct spool_run spool_run;
+        /* Records retried by staging_records_loop(), if batch_post_enabled */
+        struct post_batch batch;
+        bool batching;
+        /* Threads reading staged record files, if post_worker_threads */
+        struct stage_pool stage_pool;
+        /* Records drained from the staging log or the record ring, processed
+         * by priority class every TM_DRAIN_QUEUE_MAX records */
+        struct record_queue drain_queues[TM_PRIORITY_CLASSES];
+        size_t drain_queued;
 } TelemPostDaemon;
 
 /**
@@ -74,6 +137,17 @@ void initialize_post_daemon(TelemPostDaemon *daemon);
  */
 void run_daemon(TelemPostDaemon *daemon);
 
+/**
+ * Reloads the configuration, and applies the settings that can change
+ * without a restart: rate limits, delivery and retention of records,
+ * journal syncing and spool drain bounds. The configuration in use is kept
+ * if the new one cannot be read.
+ *
+ * @param daemon a pointer to telemetry post daemon
+ * @return true if the configuration was reloaded
+ */
+bool reload_post_daemon(TelemPostDaemon *daemon);
+
 /**
  * Cleans up inotify descriptors
  *
@@ -91,6 +165,24 @@ void close_daemon(TelemPostDaemon *daemon);
  */
 bool process_staged_record(char *filename, bool is_retry, TelemPostDaemon *daemon);
 
+/**
+ * Processes the records appended to the staging log since it was last read,
+ * the records of higher priority classes first
+ *
+ * @param daemon a pointer to telemetry post daemon
+ * @return the number of records read, or a negative errno-style value
+ */
+int drain_staging_log(TelemPostDaemon *daemon);
+
+/**
+ * Processes the records pushed to the record ring by telemprobd, the records
+ * of higher priority classes first
+ *
+ * @param daemon a pointer to telemetry post daemon
+ * @return the number of records read
+ */
+int drain_record_ring(TelemPostDaemon *daemon);
+
 /**
  * Scans staging directory to process files that were
  * missed by file watcher
@@ -103,21 +195,61 @@ int staging_records_loop(TelemPostDaemon *daemon);
 /**
  * Posts a record to backend
  *
- * @param headers a pointer to an array with keys and values
- * @param body a pointer to the payload
- * @param cfg_file a pointer to a non-default configuration
- *        file to be used.
+ * @param record the record, with a pointer to a non-default
+ *        configuration file to be used if any.
  */
-bool post_record_http(char *headers[], char *body, char *cfg_file);
+bool post_record_http(struct staged_record *record);
+
+/**
+ * Posts a record to one of the destinations, over the connection it keeps
+ *
+ * @param record the record
+ * @param dest the destination
+ */
+bool post_record_destination(struct staged_record *record,
+                             struct destination *dest);
+
+/**
+ * Starts posting a record to backend with the curl multi interface
+ *
+ * @param pm the transfer engine
+ * @param record the record, with a pointer to a non-default
+ *        configuration file to be used if any.
+ * @param key name of the record being sent, or NULL
+ * @param fn function called once the POST completes, possibly before
+ *        this function returns
+ * @param arg argument passed to fn
+ *
+ * @return false if the POST could not be started, fn is not called then
+ */
+bool post_record_async(struct post_multi *pm, struct staged_record *record,
+                       const char *key, post_done_fn fn, void *arg);
+
+/**
+ * Posts a batch of records to backend, and completes them with the status
+ * the server answered for each
+ *
+ * @param batch the batch, emptied once sent
+ *
+ * @return the number of records the server accepted
+ */
+int post_batch_http(struct post_batch *batch);
 
 /**
  * Pointer to function to isolate backend call during
  * unit testing.
  *
- * @param headers pointer to array of keys
- * @param body a pinter to payload
+ * @param record pointer to the record
+ * */
+extern bool (*post_record_ptr)(struct staged_record *record);
+
+/**
+ * Pointer to function to isolate the backend call for batches during
+ * unit testing.
+ *
+ * @param batch the batch to send
  * */
-extern bool (*post_record_ptr)(char *headers[], char *body, char *cfg_file);
+extern int (*post_batch_ptr)(struct post_batch *batch);
 
 /** Helper functions **/
 /* rate limit check */
@@ -46,6 +46,30 @@ bool get_header(const char *haystack, const char *needle, char **line)
         return false;
 }
 
+size_t parse_header_views(const char *buf, size_t size, struct header_view headers[])
+{
+        const char *pos = buf;
+        const char *end = buf + size;
+
+        for (int i = 0; i < NUM_HEADERS; i++) {
+                const char *name = get_header_name(i);
+                size_t name_len = strlen(name);
+                const char *nl;
+
+                nl = memchr(pos, '\n', (size_t)(end - pos));
+                if (!nl || (size_t)(nl - pos) < name_len ||
+                    memcmp(pos, name, name_len) != 0) {
+                        return 0;
+                }
+
+                headers[i].data = pos;
+                headers[i].len = (size_t)(nl - pos);
+                pos = nl + 1;
+        }
+
+        return (size_t)(pos - buf);
+}
+
 bool get_header_value(const char *header, char **value)
 {
         char *sep = NULL;
@@ -159,50 +183,4 @@ int get_random_id(char **buff)
         return result;
 }
 
-/**
- * Validate classification value. A valid classification
- * is a string with 2 slashes, with max length of
- * MAX_CLASS_LENGTH and strings betweeb slashes should
- * have a max length of MAX_SUBCAT_LENGTH.
- *
- * @param classification A pointer to classification value
- *        to be validated.
- *
- * @return 0 on sucess and 1 on failure
- */
-int validate_classification(char *classification)
-{
-        size_t i, j;
-        int slashes = 0;
-        int x = 0;
-
-        if (classification == NULL) {
-                return 1;
-        }
-
-        j = strlen(classification);
-
-        if (j > MAX_CLASS_LENGTH) {
-                return 1;
-        }
-
-        for (i = 0, x = 0; i <= (j - 1); i++, x++) {
-                if (classification[i] == '/') {
-                        slashes++;
-                        x = 0;
-                } else {
-                        if (x > MAX_SUBCAT_LENGTH) {
-                                return 1;
-                        }
-                }
-        }
-
-        if (slashes != 2) {
-                telem_log(LOG_ERR, "Classification string should have two /s.\n");
-                return 1;
-        }
-
-        return 0;
-}
-
 /* vi: set ts=8 sw=8 sts=4 et tw=80 cino=(0: */
@@ -17,6 +17,13 @@
 #pragma once
 
 #include <stdbool.h>
+#include <stddef.h>
+
+/* Header line in a record buffer, without the newline and not null terminated */
+struct header_view {
+        const char *data;
+        size_t len;
+};
 
 /* Increase memory allocated */
 void *reallocate(void **addr, size_t *allocated, size_t requested);
@@ -24,6 +31,11 @@ void *reallocate(void **addr, size_t *allocated, size_t requested);
 /* Check if haystacks begins with needle and return a copy of haystack */
 bool get_header(const char *haystack, const char *needle, char **line);
 
+/* Parses the NUM_HEADERS newline terminated header lines at the start of buf,
+ * in get_header_name() order, without copying them. Returns the number of bytes
+ * taken by the headers, or 0 if a header is missing or out of order */
+size_t parse_header_views(const char *buf, size_t size, struct header_view headers[]);
+
 /* Get the value of a header */
 bool get_header_value(const char *header, char **value);
 
@@ -33,7 +45,4 @@ long get_directory_size(const char *sdir);
 /* Initialize buff and copy generated id */
 int get_random_id(char **buff);
 
-/* Validates classification value */
-int validate_classification(char *classification);
-
 /* vi: set ts=8 sw=8 sts=4 et tw=80 cino=(0: */
@@ -0,0 +1,367 @@
+/*
+ * This program is part of the Clear Linux Project
+ *
+ * Copyright 2019 Intel Corporation
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms and conditions of the GNU Lesser General Public License, as
+ * published by the Free Software Foundation; either version 2.1 of the License,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU Lesser General Public License for more
+ * details.
+ */
+
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "common.h"
+#include "log.h"
+#include "validate.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define VALIDATE_X86
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+#include <arm_neon.h>
+#define VALIDATE_NEON
+#endif
+
+/* Classes of bytes, as flags of char_class[] */
+#define CLASS_PAYLOAD 0x1
+#define CLASS_EVENT_ID 0x2
+
+/* Shorthands for the table below */
+#define P CLASS_PAYLOAD
+#define H (CLASS_PAYLOAD | CLASS_EVENT_ID)
+
+/*
+ * Payloads are printable ascii or whitespace as in the C locale: 0x20 to
+ * 0x7e, and \t \n \v \f \r. Event ids are lower case hexadecimal. Bytes
+ * from 0x80 are of no class.
+ */
+static const uint8_t char_class[256] = {
+        /* 0x00 */ 0, 0, 0, 0, 0, 0, 0, 0, 0, P, P, P, P, P, 0, 0,
+        /* 0x10 */ 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+        /* 0x20 */ P, P, P, P, P, P, P, P, P, P, P, P, P, P, P, P,
+        /* 0x30 */ H, H, H, H, H, H, H, H, H, H, P, P, P, P, P, P,
+        /* 0x40 */ P, P, P, P, P, P, P, P, P, P, P, P, P, P, P, P,
+        /* 0x50 */ P, P, P, P, P, P, P, P, P, P, P, P, P, P, P, P,
+        /* 0x60 */ P, H, H, H, H, H, H, P, P, P, P, P, P, P, P, P,
+        /* 0x70 */ P, P, P, P, P, P, P, P, P, P, P, P, P, P, P, 0,
+};
+
+#undef P
+#undef H
+
+/* Scans return the position of the first byte not of their class, or len */
+typedef size_t (*span_fn)(const uint8_t *p, size_t len);
+
+static size_t class_span(const uint8_t *p, size_t len, uint8_t class)
+{
+        size_t i;
+
+        for (i = 0; i < len; i++) {
+                if (!(char_class[p[i]] & class)) {
+                        break;
+                }
+        }
+
+        return i;
+}
+
+static size_t payload_span_scalar(const uint8_t *p, size_t len)
+{
+        return class_span(p, len, CLASS_PAYLOAD);
+}
+
+static size_t event_id_span_scalar(const uint8_t *p, size_t len)
+{
+        return class_span(p, len, CLASS_EVENT_ID);
+}
+
+#ifdef VALIDATE_X86
+
+/*
+ * Ranges are checked with signed compares, bytes above 0x7f are negative
+ * and below all the ranges. A block with an invalid byte has a zero bit in
+ * the mask of valid bytes, found with ctz.
+ */
+
+#define IN_RANGE_SSE2(v, lo, hi) \
+        _mm_and_si128(_mm_cmpgt_epi8(v, _mm_set1_epi8((char)((lo) - 1))), \
+                      _mm_cmplt_epi8(v, _mm_set1_epi8((char)((hi) + 1))))
+
+#define IN_RANGE_AVX2(v, lo, hi) \
+        _mm256_and_si256(_mm256_cmpgt_epi8(v, _mm256_set1_epi8((char)((lo) - 1))), \
+                         _mm256_cmpgt_epi8(_mm256_set1_epi8((char)((hi) + 1)), v))
+
+__attribute__((target("sse2")))
+static size_t payload_span_sse2(const uint8_t *p, size_t len)
+{
+        size_t done = 0;
+
+        for (; len - done >= 16; done += 16) {
+                __m128i v = _mm_loadu_si128((const __m128i *)(p + done));
+                __m128i valid = _mm_or_si128(IN_RANGE_SSE2(v, ' ', '~'),
+                                             IN_RANGE_SSE2(v, '\t', '\r'));
+                unsigned int invalid = ~(unsigned int)_mm_movemask_epi8(valid) & 0xffff;
+
+                if (invalid) {
+                        return done + (size_t)__builtin_ctz(invalid);
+                }
+        }
+
+        return done + payload_span_scalar(p + done, len - done);
+}
+
+__attribute__((target("sse2")))
+static size_t event_id_span_sse2(const uint8_t *p, size_t len)
+{
+        size_t done = 0;
+
+        for (; len - done >= 16; done += 16) {
+                __m128i v = _mm_loadu_si128((const __m128i *)(p + done));
+                __m128i valid = _mm_or_si128(IN_RANGE_SSE2(v, '0', '9'),
+                                             IN_RANGE_SSE2(v, 'a', 'f'));
+                unsigned int invalid = ~(unsigned int)_mm_movemask_epi8(valid) & 0xffff;
+
+                if (invalid) {
+                        return done + (size_t)__builtin_ctz(invalid);
+                }
+        }
+
+        return done + event_id_span_scalar(p + done, len - done);
+}
+
+__attribute__((target("avx2")))
+static size_t payload_span_avx2(const uint8_t *p, size_t len)
+{
+        size_t done = 0;
+
+        for (; len - done >= 32; done += 32) {
+                __m256i v = _mm256_loadu_si256((const __m256i *)(p + done));
+                __m256i valid = _mm256_or_si256(IN_RANGE_AVX2(v, ' ', '~'),
+                                                IN_RANGE_AVX2(v, '\t', '\r'));
+                unsigned int invalid = ~(unsigned int)_mm256_movemask_epi8(valid);
+
+                if (invalid) {
+                        return done + (size_t)__builtin_ctz(invalid);
+                }
+        }
+
+        return done + payload_span_sse2(p + done, len - done);
+}
+
+__attribute__((target("avx2")))
+static size_t event_id_span_avx2(const uint8_t *p, size_t len)
+{
+        size_t done = 0;
+
+        for (; len - done >= 32; done += 32) {
+                __m256i v = _mm256_loadu_si256((const __m256i *)(p + done));
+                __m256i valid = _mm256_or_si256(IN_RANGE_AVX2(v, '0', '9'),
+                                                IN_RANGE_AVX2(v, 'a', 'f'));
+                unsigned int invalid = ~(unsigned int)_mm256_movemask_epi8(valid);
+
+                if (invalid) {
+                        return done + (size_t)__builtin_ctz(invalid);
+                }
+        }
+
+        return done + event_id_span_sse2(p + done, len - done);
+}
+
+static bool have_sse2(void)
+{
+        __builtin_cpu_init();
+        return __builtin_cpu_supports("sse2");
+}
+
+static bool have_avx2(void)
+{
+        __builtin_cpu_init();
+        return __builtin_cpu_supports("avx2");
+}
+
+#endif
+
+#ifdef VALIDATE_NEON
+
+#define IN_RANGE_NEON(v, lo, hi) \
+        vandq_u8(vcgeq_u8(v, vdupq_n_u8(lo)), vcleq_u8(v, vdupq_n_u8(hi)))
+
+/* A block with an invalid byte is scanned again to find it */
+static size_t payload_span_neon(const uint8_t *p, size_t len)
+{
+        size_t done = 0;
+
+        for (; len - done >= 16; done += 16) {
+                uint8x16_t v = vld1q_u8(p + done);
+                uint8x16_t valid = vorrq_u8(IN_RANGE_NEON(v, ' ', '~'),
+                                            IN_RANGE_NEON(v, '\t', '\r'));
+
+                if (vminvq_u8(valid) == 0) {
+                        break;
+                }
+        }
+
+        return done + payload_span_scalar(p + done, len - done);
+}
+
+static size_t event_id_span_neon(const uint8_t *p, size_t len)
+{
+        size_t done = 0;
+
+        for (; len - done >= 16; done += 16) {
+                uint8x16_t v = vld1q_u8(p + done);
+                uint8x16_t valid = vorrq_u8(IN_RANGE_NEON(v, '0', '9'),
+                                            IN_RANGE_NEON(v, 'a', 'f'));
+
+                if (vminvq_u8(valid) == 0) {
+                        break;
+                }
+        }
+
+        return done + event_id_span_scalar(p + done, len - done);
+}
+
+#endif
+
+static bool always(void)
+{
+        return true;
+}
+
+struct validate_scan {
+        enum validate_impl id;
+        const char *name;
+        span_fn payload;
+        span_fn event_id;
+        bool (*supported)(void);
+};
+
+/* In order of preference */
+static const struct validate_scan scans[] = {
+#ifdef VALIDATE_X86
+        { VALIDATE_IMPL_AVX2, "avx2", payload_span_avx2, event_id_span_avx2, have_avx2 },
+        { VALIDATE_IMPL_SSE2, "sse2", payload_span_sse2, event_id_span_sse2, have_sse2 },
+#endif
+#ifdef VALIDATE_NEON
+        { VALIDATE_IMPL_NEON, "neon", payload_span_neon, event_id_span_neon, always },
+#endif
+        { VALIDATE_IMPL_SCALAR, "scalar", payload_span_scalar, event_id_span_scalar, always },
+};
+
+static const struct validate_scan *selected = NULL;
+
+static const struct validate_scan *find_scan(enum validate_impl id)
+{
+        for (size_t i = 0; i < sizeof(scans) / sizeof(scans[0]); i++) {
+                if ((id == VALIDATE_IMPL_AUTO || scans[i].id == id) &&
+                    scans[i].supported()) {
+                        return &scans[i];
+                }
+        }
+
+        return NULL;
+}
+
+static const struct validate_scan *get_scan(void)
+{
+        const struct validate_scan *scan = __atomic_load_n(&selected, __ATOMIC_ACQUIRE);
+
+        if (!scan) {
+                scan = find_scan(VALIDATE_IMPL_AUTO);
+                __atomic_store_n(&selected, scan, __ATOMIC_RELEASE);
+        }
+
+        return scan;
+}
+
+bool validate_use(enum validate_impl impl)
+{
+        const struct validate_scan *found = find_scan(impl);
+
+        if (!found) {
+                return false;
+        }
+        __atomic_store_n(&selected, found, __ATOMIC_RELEASE);
+
+        return true;
+}
+
+const char *validate_impl_name(void)
+{
+        return get_scan()->name;
+}
+
+int payload_is_ascii(const char *payload, size_t len)
+{
+        if (get_scan()->payload((const uint8_t *)payload, len) != len) {
+                return -EINVAL;
+        }
+
+        return 0;
+}
+
+size_t event_id_span(const char *id, size_t len)
+{
+        return get_scan()->event_id((const uint8_t *)id, len);
+}
+
+int validate_event_id(const char *id)
+{
+        if (id == NULL) {
+                return 1;
+        }
+
+        /* Not reading past the terminator of a shorter id */
+        if (strnlen(id, EVENT_ID_LEN + 1) != EVENT_ID_LEN) {
+                return 1;
+        }
+
+        if (event_id_span(id, EVENT_ID_LEN) != EVENT_ID_LEN) {
+                return 1;
+        }
+
+        return 0;
+}
+
+int validate_classification(const char *classification)
+{
+        const char *first, *second, *end;
+        size_t len;
+
+        if (classification == NULL) {
+                return 1;
+        }
+
+        len = strnlen(classification, MAX_CLASS_LENGTH + 1);
+        if (len > MAX_CLASS_LENGTH) {
+                return 1;
+        }
+        end = classification + len;
+
+        first = memchr(classification, '/', len);
+        second = first ? memchr(first + 1, '/', (size_t)(end - first - 1)) : NULL;
+        if (!second || memchr(second + 1, '/', (size_t)(end - second - 1))) {
+                telem_log(LOG_ERR, "Classification string should have two /s.\n");
+                return 1;
+        }
+
+        /* The first category has always been allowed one more character
+         * than the others */
+        if (first - classification > MAX_SUBCAT_LENGTH + 1 ||
+            second - first - 1 > MAX_SUBCAT_LENGTH ||
+            end - second - 1 > MAX_SUBCAT_LENGTH) {
+                return 1;
+        }
+
+        return 0;
+}
+
+/* vi: set ts=8 sw=8 sts=4 et tw=80 cino=(0: */
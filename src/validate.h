@@ -0,0 +1,97 @@
+/*
+ * This program is part of the Clear Linux Project
+ *
+ * Copyright 2019 Intel Corporation
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms and conditions of the GNU Lesser General Public License, as
+ * published by the Free Software Foundation; either version 2.1 of the License,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU Lesser General Public License for more
+ * details.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/*
+ * Validation of the values probes give records, shared by libtelemetry and
+ * the daemons. The byte scans use vector instructions when the CPU has them,
+ * picked on first use.
+ */
+
+enum validate_impl {
+        VALIDATE_IMPL_AUTO = 0,
+        VALIDATE_IMPL_SCALAR,
+        VALIDATE_IMPL_SSE2,
+        VALIDATE_IMPL_AVX2,
+        VALIDATE_IMPL_NEON
+};
+
+/**
+ * Validate's a payload is printable ascii, including whitespace.
+ *
+ * @param payload The payload to be verified.
+ * @param len Length of the payload.
+ *
+ * @return 0 if successful, or -EINVAL.
+ */
+int payload_is_ascii(const char *payload, size_t len);
+
+/**
+ * Gets the length of the prefix of an event id made of EVENT_ID_ALPHAB
+ * characters.
+ *
+ * @param id The event id
+ * @param len Length of the event id
+ *
+ * @return the position of the first invalid character, or len
+ */
+size_t event_id_span(const char *id, size_t len);
+
+/**
+ * Checks for id to have length = 32 characters
+ * and hexadecimal characters only.
+ *
+ * @param id A pointer to string to be checked
+ *
+ * @return 0 on success, 1 on failure
+ */
+int validate_event_id(const char *id);
+
+/**
+ * Validate classification value. A valid classification
+ * is a string with 2 slashes, with max length of
+ * MAX_CLASS_LENGTH and strings between slashes should
+ * have a max length of MAX_SUBCAT_LENGTH.
+ *
+ * @param classification A pointer to classification value
+ *        to be validated.
+ *
+ * @return 0 on sucess and 1 on failure
+ */
+int validate_classification(const char *classification);
+
+/**
+ * Selects the implementation of the byte scans, for tests and benchmarks
+ *
+ * @param impl The implementation, VALIDATE_IMPL_AUTO for the best one
+ *
+ * @return false if the implementation is not built for or not supported by
+ *     this CPU
+ */
+bool validate_use(enum validate_impl impl);
+
+/**
+ * Gets the name of the implementation in use
+ *
+ * @return "scalar", "sse2", "avx2" or "neon"
+ */
+const char *validate_impl_name(void);
+
+/* vi: set ts=8 sw=8 sts=4 et tw=80 cino=(0: */
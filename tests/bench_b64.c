@@ -0,0 +1,129 @@
+/*
+ * This program is part of the Clear Linux Project
+ *
+ * Copyright 2019 Intel Corporation
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms and conditions of the GNU Lesser General Public License, as
+ * published by the Free Software Foundation; either version 2.1 of the License,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU Lesser General Public License for more
+ * details.
+ */
+
+/* Microbenchmark of the base64 encoders on the files of
+ * tests/nc_b64enc_test_files and on a larger random buffer standing for a
+ * binary artifact. Prints one line per encoder and input: encoder, input,
+ * input bytes, and megabytes encoded per second. */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "nica/b64enc.h"
+
+/* Bytes encoded for each encoder and input, about */
+#define BYTES_PER_INPUT (64 * 1024 * 1024)
+#define RANDOM_LEN (1024 * 1024)
+
+static const char *files[] = { "fo", "foob", "foobar", "long_text" };
+
+static const NcB64Impl impls[] = {
+        NC_B64_IMPL_SCALAR, NC_B64_IMPL_SSSE3, NC_B64_IMPL_AVX2, NC_B64_IMPL_NEON
+};
+
+static double now(void)
+{
+        struct timespec ts;
+
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return (double)ts.tv_sec * 1e9 + (double)ts.tv_nsec;
+}
+
+static unsigned char *read_file(const char *dir, const char *name, size_t *len)
+{
+        unsigned char *buf = NULL;
+        char *path = NULL;
+        FILE *fh;
+        long size;
+
+        if (asprintf(&path, "%s/%s", dir, name) < 0) {
+                exit(EXIT_FAILURE);
+        }
+        fh = fopen(path, "rb");
+        if (!fh || fseek(fh, 0, SEEK_END) != 0 || (size = ftell(fh)) < 0) {
+                fprintf(stderr, "Cannot read %s\n", path);
+                exit(EXIT_FAILURE);
+        }
+        rewind(fh);
+        buf = malloc((size_t)size + 1);
+        if (!buf || fread(buf, 1, (size_t)size, fh) != (size_t)size) {
+                exit(EXIT_FAILURE);
+        }
+        fclose(fh);
+        free(path);
+
+        *len = (size_t)size;
+        return buf;
+}
+
+static void bench_input(const char *name, const unsigned char *in, size_t len)
+{
+        char *out = malloc(nc_b64enc_len(len) + 1);
+        size_t rounds = BYTES_PER_INPUT / len;
+        volatile size_t sink = 0;
+
+        if (!out) {
+                exit(EXIT_FAILURE);
+        }
+
+        for (size_t i = 0; i < sizeof(impls) / sizeof(impls[0]); i++) {
+                double start;
+
+                if (!nc_b64enc_use(impls[i])) {
+                        continue;
+                }
+                start = now();
+                for (size_t r = 0; r < rounds; r++) {
+                        sink += nc_b64enc(in, len, out);
+                }
+                printf("%s %s %zu %.1f\n", nc_b64enc_impl_name(), name, len,
+                       (double)(len * rounds) / 1e6 / ((now() - start) / 1e9));
+        }
+        nc_b64enc_use(NC_B64_IMPL_AUTO);
+
+        free(out);
+}
+
+int main(int argc, char **argv)
+{
+        const char *dir = argc > 1 ? argv[1] : TOPSRCDIR "/tests/nc_b64enc_test_files";
+        unsigned char *buf;
+        unsigned int seed = 1;
+        size_t len;
+
+        for (size_t i = 0; i < sizeof(files) / sizeof(files[0]); i++) {
+                buf = read_file(dir, files[i], &len);
+                bench_input(files[i], buf, len);
+                free(buf);
+        }
+
+        buf = malloc(RANDOM_LEN);
+        if (!buf) {
+                return EXIT_FAILURE;
+        }
+        for (size_t i = 0; i < RANDOM_LEN; i++) {
+                buf[i] = (unsigned char)rand_r(&seed);
+        }
+        bench_input("random", buf, RANDOM_LEN);
+        free(buf);
+
+        return 0;
+}
+
+/* vi: set ts=8 sw=8 sts=4 et tw=80 cino=(0: */
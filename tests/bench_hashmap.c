@@ -0,0 +1,168 @@
+/*
+ * This program is part of the Clear Linux Project
+ *
+ * Copyright 2019 Intel Corporation
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms and conditions of the GNU Lesser General Public License, as
+ * published by the Free Software Foundation; either version 2.1 of the License,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU Lesser General Public License for more
+ * details.
+ */
+
+/* Microbenchmark of NcHashmap on string keys, built against both
+ * implementations as bench_hashmap_chained and bench_hashmap_open. Prints
+ * one line per operation and map size: implementation, operation, number of
+ * keys, and nanoseconds per operation. */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "nica/hashmap.h"
+
+#ifndef HASHMAP_IMPL
+#define HASHMAP_IMPL "chained"
+#endif
+
+static const int sizes[] = { 100, 1000, 10000, 100000, 1000000 };
+
+static double now(void)
+{
+        struct timespec ts;
+
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return (double)ts.tv_sec * 1e9 + (double)ts.tv_nsec;
+}
+
+/* Keys in a shuffled order, the same for each run, so that neither map
+ * gains from consecutive keys having consecutive hashes */
+static char **make_keys(int n, const char *prefix)
+{
+        char **keys = malloc((size_t)n * sizeof(char *));
+        unsigned int seed = 1;
+
+        if (!keys) {
+                return NULL;
+        }
+        for (int i = 0; i < n; i++) {
+                if (asprintf(&keys[i], "%s/class/%d", prefix, i) < 0) {
+                        exit(EXIT_FAILURE);
+                }
+        }
+        for (int i = n - 1; i > 0; i--) {
+                int j = rand_r(&seed) % (i + 1);
+                char *key = keys[i];
+
+                keys[i] = keys[j];
+                keys[j] = key;
+        }
+        return keys;
+}
+
+static void free_keys(char **keys, int n)
+{
+        for (int i = 0; i < n; i++) {
+                free(keys[i]);
+        }
+        free(keys);
+}
+
+/* Operations timed for each map size, repeated up to about OPS_PER_SIZE */
+#define OPS_PER_SIZE 2000000
+
+enum { OP_INSERT, OP_LOOKUP_HIT, OP_LOOKUP_MISS, OP_ITERATE, OP_REMOVE, OP_COUNT };
+
+static const char *op_names[OP_COUNT] = {
+        "insert", "lookup_hit", "lookup_miss", "iterate", "remove"
+};
+
+static void bench_round(int n, char **keys, char **missing, double *elapsed)
+{
+        NcHashmap *map = nc_hashmap_new(nc_string_hash, nc_string_compare);
+        NcHashmapIter iter;
+        volatile unsigned long sink = 0;
+        void *value;
+        double start;
+
+        if (!map) {
+                exit(EXIT_FAILURE);
+        }
+
+        start = now();
+        for (int i = 0; i < n; i++) {
+                nc_hashmap_put(map, keys[i], NC_HASH_VALUE(i + 1));
+        }
+        elapsed[OP_INSERT] += now() - start;
+
+        start = now();
+        for (int i = 0; i < n; i++) {
+                sink += NC_UNHASH_VALUE(nc_hashmap_get(map, keys[(size_t)i * 7919 % (size_t)n]));
+        }
+        elapsed[OP_LOOKUP_HIT] += now() - start;
+
+        start = now();
+        for (int i = 0; i < n; i++) {
+                sink += nc_hashmap_contains(map, missing[i]);
+        }
+        elapsed[OP_LOOKUP_MISS] += now() - start;
+
+        start = now();
+        nc_hashmap_iter_init(map, &iter);
+        while (nc_hashmap_iter_next(&iter, NULL, &value)) {
+                sink += NC_UNHASH_VALUE(value);
+        }
+        elapsed[OP_ITERATE] += now() - start;
+
+        start = now();
+        for (int i = 0; i < n; i++) {
+                nc_hashmap_remove(map, keys[i]);
+        }
+        elapsed[OP_REMOVE] += now() - start;
+
+        nc_hashmap_free(map);
+}
+
+static void bench_size(int n)
+{
+        char **keys = make_keys(n, "hit");
+        char **missing = make_keys(n, "miss");
+        double elapsed[OP_COUNT] = { 0 };
+        int rounds = n < OPS_PER_SIZE ? OPS_PER_SIZE / n : 1;
+
+        if (!keys || !missing) {
+                exit(EXIT_FAILURE);
+        }
+
+        for (int r = 0; r < rounds; r++) {
+                bench_round(n, keys, missing, elapsed);
+        }
+        for (int op = 0; op < OP_COUNT; op++) {
+                printf("%s %s %d %.1f\n", HASHMAP_IMPL, op_names[op], n,
+                       elapsed[op] / ((double)n * rounds));
+        }
+
+        free_keys(keys, n);
+        free_keys(missing, n);
+}
+
+int main(int argc, char **argv)
+{
+        int max = argc > 1 ? atoi(argv[1]) : 1000000;
+
+        for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+                if (sizes[i] <= max) {
+                        bench_size(sizes[i]);
+                }
+        }
+
+        return 0;
+}
+
+/* vi: set ts=8 sw=8 sts=4 et tw=80 cino=(0: */
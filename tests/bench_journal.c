@@ -0,0 +1,189 @@
+/*
+ * This program is part of the Clear Linux Project
+ *
+ * Copyright 2019 Intel Corporation
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms and conditions of the GNU Lesser General Public License, as
+ * published by the Free Software Foundation; either version 2.1 of the License,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU Lesser General Public License for more
+ * details.
+ */
+
+/* Microbenchmark of the journal: adding entries with new_journal_entry(),
+ * pruning the oldest with prune_journal() and printing entries, all of them
+ * or filtered by class or event id, with print_journal(). The ring holds
+ * RECORD_LIMIT + DEVIATION entries, the journal sizes are numbers of entries
+ * up to that. Prints one line per operation and journal size: "journal",
+ * operation, number of entries, and nanoseconds per operation. */
+
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "journal/journal.h"
+
+static const int sizes[] = { DEVIATION, 2 * DEVIATION, RECORD_LIMIT + DEVIATION };
+
+/* Operations timed for each journal size */
+#define ENTRY_OPS 20000
+#define PRUNE_OPS 2000
+#define PRINT_OPS 2000
+
+static const char *classes[] = { "a/b/c", "a/b/d", "a/c/c", "x/y/z" };
+
+static char workdir[] = "/tmp/bench_journal.XXXXXX";
+static char *journal_file = NULL;
+static char *index_file = NULL;
+static int devnull = -1;
+
+static double now(void)
+{
+        struct timespec ts;
+
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return (double)ts.tv_sec * 1e9 + (double)ts.tv_nsec;
+}
+
+static void report(const char *op, int size, double elapsed, int ops)
+{
+        printf("journal %s %d %.1f\n", op, size, elapsed / ops);
+}
+
+/* Ten entries per event id, classes in turn */
+static void add_entry(TelemJournal *journal, int i)
+{
+        char event_id[] = "00007766547776eb7fc478eb0eb43e40";
+
+        snprintf(event_id + 28, 5, "%04x", (unsigned)(i / 10) & 0xffff);
+        if (new_journal_entry(journal, (char *)classes[i % 4], 1520054957 + i,
+                              event_id) != 0) {
+                fprintf(stderr, "Failed to add a journal entry\n");
+                exit(EXIT_FAILURE);
+        }
+}
+
+/* Opens an empty journal, holding size entries after filling it */
+static TelemJournal *new_journal(int size, bool fill)
+{
+        TelemJournal *journal = NULL;
+
+        unlink(journal_file);
+        unlink(index_file);
+        journal = open_journal(journal_file);
+        if (!journal) {
+                fprintf(stderr, "Failed to open %s\n", journal_file);
+                exit(EXIT_FAILURE);
+        }
+        journal->record_count_limit = RECORD_LIMIT + DEVIATION;
+        for (int i = 0; fill && i < size; i++) {
+                add_entry(journal, i);
+        }
+        return journal;
+}
+
+/* In steady state, pruned once every DEVIATION entries */
+static void bench_new_entry(int size)
+{
+        TelemJournal *journal = new_journal(size, false);
+        double start;
+
+        journal->record_count_limit = size;
+        start = now();
+        for (int i = 0; i < ENTRY_OPS; i++) {
+                add_entry(journal, i);
+        }
+        report("new_journal_entry", size, now() - start, ENTRY_OPS);
+        close_journal(journal);
+}
+
+/* Drops the DEVIATION oldest entries of a journal holding size entries */
+static void bench_prune(int size)
+{
+        TelemJournal *journal = new_journal(size, true);
+        double elapsed = 0, start;
+        int next = size;
+
+        for (int r = 0; r < PRUNE_OPS; r++) {
+                journal->record_count_limit = size - DEVIATION;
+                start = now();
+                prune_journal(journal, NULL);
+                elapsed += now() - start;
+
+                journal->record_count_limit = RECORD_LIMIT + DEVIATION;
+                for (int i = 0; i < DEVIATION; i++) {
+                        add_entry(journal, next++);
+                }
+        }
+        report("prune_journal", size, elapsed, PRUNE_OPS);
+        close_journal(journal);
+}
+
+static void bench_print(int size)
+{
+        TelemJournal *journal = new_journal(size, true);
+        char event_id[] = "00007766547776eb7fc478eb0eb43e40";
+        double elapsed[3] = { 0 }, start;
+        int saved = dup(STDOUT_FILENO);
+
+        snprintf(event_id + 28, 5, "%04x", (unsigned)(size / 20));
+        fflush(stdout);
+        dup2(devnull, STDOUT_FILENO);
+        for (int r = 0; r < PRINT_OPS; r++) {
+                start = now();
+                print_journal(journal, NULL, NULL, NULL, NULL, false);
+                elapsed[0] += now() - start;
+
+                start = now();
+                print_journal(journal, "a/b/c", NULL, NULL, NULL, false);
+                elapsed[1] += now() - start;
+
+                start = now();
+                print_journal(journal, NULL, NULL, event_id, NULL, false);
+                elapsed[2] += now() - start;
+        }
+        fflush(stdout);
+        dup2(saved, STDOUT_FILENO);
+        close(saved);
+
+        report("print_journal", size, elapsed[0], PRINT_OPS);
+        report("print_journal_class", size, elapsed[1], PRINT_OPS);
+        report("print_journal_event_id", size, elapsed[2], PRINT_OPS);
+        close_journal(journal);
+}
+
+int main(void)
+{
+        devnull = open("/dev/null", O_WRONLY | O_CLOEXEC);
+        if (devnull < 0 || !mkdtemp(workdir) ||
+            asprintf(&journal_file, "%s/journal", workdir) < 0 ||
+            asprintf(&index_file, "%s/journal.idx", workdir) < 0) {
+                perror("bench_journal");
+                return EXIT_FAILURE;
+        }
+
+        for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+                bench_new_entry(sizes[i]);
+                bench_prune(sizes[i]);
+                bench_print(sizes[i]);
+        }
+
+        unlink(journal_file);
+        unlink(index_file);
+        rmdir(workdir);
+        free(journal_file);
+        free(index_file);
+        close(devnull);
+
+        return 0;
+}
+
+/* vi: set ts=8 sw=8 sts=4 et tw=80 cino=(0: */
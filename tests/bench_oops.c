@@ -0,0 +1,161 @@
+/*
+ * This program is part of the Clear Linux Project
+ *
+ * Copyright 2019 Intel Corporation
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms and conditions of the GNU Lesser General Public License, as
+ * published by the Free Software Foundation; either version 2.1 of the License,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU Lesser General Public License for more
+ * details.
+ */
+
+/* Microbenchmark of the oops parser: parse_single_line() over the lines of
+ * each file of tests/oops_test_files, including the parsing of the payload of
+ * each oops detected with parse_payload(). Prints one line per file, and one
+ * for all of them: "oops", file name, number of lines, and nanoseconds per
+ * line. */
+
+#define _GNU_SOURCE
+#include <dirent.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "nica/nc-string.h"
+#include "src/probes/oops_parser.h"
+
+/* Lines parsed for each file, repeating its lines */
+#define LINES_PER_FILE 200000
+
+static unsigned long oopses = 0;
+
+static double now(void)
+{
+        struct timespec ts;
+
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return (double)ts.tv_sec * 1e9 + (double)ts.tv_nsec;
+}
+
+static void handle_oops(struct oops_log_msg *msg)
+{
+        nc_string *payload = parse_payload(msg);
+
+        if (payload) {
+                oopses++;
+                nc_string_free(payload);
+        }
+}
+
+/* Reads a file as NUL terminated lines, returns the number of lines */
+static size_t read_lines(const char *path, char **buf, char ***lines, size_t **sizes)
+{
+        FILE *fp = fopen(path, "r");
+        size_t len = 0, count = 0;
+        char *p = NULL;
+
+        if (!fp || getdelim(buf, &len, '\0', fp) < 0) {
+                fprintf(stderr, "Failed to read %s\n", path);
+                exit(EXIT_FAILURE);
+        }
+        fclose(fp);
+
+        for (p = *buf; *p; p++) {
+                count += *p == '\n';
+        }
+        *lines = calloc(count + 1, sizeof(char *));
+        *sizes = calloc(count + 1, sizeof(size_t));
+        if (!*lines || !*sizes) {
+                exit(EXIT_FAILURE);
+        }
+
+        count = 0;
+        for (p = *buf; *p; count++) {
+                char *eol = strchrnul(p, '\n');
+
+                (*lines)[count] = p;
+                (*sizes)[count] = (size_t)(eol - p);
+                p = *eol ? eol + 1 : eol;
+                *eol = '\0';
+        }
+        return count;
+}
+
+static double bench_file(const char *dir, const char *name, size_t *parsed)
+{
+        char *path = NULL, *buf = NULL;
+        char **lines = NULL;
+        size_t *sizes = NULL;
+        size_t count, total = 0;
+        double start, elapsed;
+
+        if (asprintf(&path, "%s/%s", dir, name) < 0) {
+                exit(EXIT_FAILURE);
+        }
+        count = read_lines(path, &buf, &lines, &sizes);
+
+        oops_parser_init(handle_oops);
+        start = now();
+        while (count > 0 && total < LINES_PER_FILE) {
+                for (size_t i = 0; i < count; i++) {
+                        parse_single_line(lines[i], sizes[i]);
+                }
+                total += count;
+        }
+        elapsed = now() - start;
+        oops_parser_cleanup();
+
+        if (total > 0) {
+                printf("oops %s %zu %.1f\n", name, count, elapsed / (double)total);
+        }
+        *parsed += total;
+
+        free(path);
+        free(buf);
+        free(lines);
+        free(sizes);
+        return elapsed;
+}
+
+static int is_oops_file(const struct dirent *entry)
+{
+        size_t len = strlen(entry->d_name);
+
+        return len > 4 && strcmp(entry->d_name + len - 4, ".txt") == 0;
+}
+
+int main(int argc, char **argv)
+{
+        const char *dir = argc > 1 ? argv[1] : TESTOOPSDIR;
+        struct dirent **entries = NULL;
+        double elapsed = 0;
+        size_t parsed = 0;
+        int n;
+
+        n = scandir(dir, &entries, is_oops_file, alphasort);
+        if (n < 0) {
+                perror(dir);
+                return EXIT_FAILURE;
+        }
+
+        for (int i = 0; i < n; i++) {
+                elapsed += bench_file(dir, entries[i]->d_name, &parsed);
+                free(entries[i]);
+        }
+        free(entries);
+
+        if (parsed > 0) {
+                printf("oops all %zu %.1f\n", parsed, elapsed / (double)parsed);
+        }
+        fprintf(stderr, "%lu oopses parsed\n", oopses);
+
+        return 0;
+}
+
+/* vi: set ts=8 sw=8 sts=4 et tw=80 cino=(0: */
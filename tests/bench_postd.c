@@ -0,0 +1,325 @@
+/*
+ * This program is part of the Clear Linux Project
+ *
+ * Copyright 2019 Intel Corporation
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms and conditions of the GNU Lesser General Public License, as
+ * published by the Free Software Foundation; either version 2.1 of the License,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU Lesser General Public License for more
+ * details.
+ */
+
+/* Microbenchmark of the spool path of telempostd: reading spooled records
+ * with read_record(), and sending them with transmit_spooled_record() to an
+ * HTTP server run by a thread of the benchmark, with and without
+ * http_keepalive. Prints one line per operation and record size: "postd",
+ * operation, record bytes, and nanoseconds per operation. */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <ftw.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+
+#include "common.h"
+#include "configuration.h"
+#include "iorecord.h"
+#include "spool.h"
+#include "telempostdaemon.h"
+
+bool (*post_record_ptr)(struct staged_record *) = post_record_http;
+int (*post_batch_ptr)(struct post_batch *) = post_batch_http;
+bool (*post_destination_ptr)(struct staged_record *, struct destination *) =
+        post_record_destination;
+
+/* Payload sizes of the records, the largest one streamed from its file */
+static const size_t payload_sizes[] = { 64, 8000, 256 * 1024 };
+
+#define READ_OPS 20000
+#define TRANSMIT_OPS 2000
+
+static const char headers[] =
+        "record_format_version: 4\nclassification: org.clearlinux/bench/postd\n"
+        "severity: 1\nmachine_id: 1234\ncreation_timestamp: 1418672344\n"
+        "arch: x86_64\nhost_type: bench\nbuild: 200\nkernel_version: 5.0\n"
+        "payload_format_version: 1\nsystem_name: clear-linux-os\n"
+        "board_name: bench\ncpu_model: bench\nbios_version: bench\n"
+        "event_id: 3a2d799826edc6266d72824d2aac6763\n";
+
+static char workdir[] = "/tmp/bench_postd.XXXXXX";
+static char *config_path = NULL;
+static int server_port = 0;
+
+static double now(void)
+{
+        struct timespec ts;
+
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return (double)ts.tv_sec * 1e9 + (double)ts.tv_nsec;
+}
+
+static void report(const char *op, size_t size, double elapsed, int ops)
+{
+        printf("postd %s %zu %.1f\n", op, size, elapsed / ops);
+}
+
+/* Records of the largest size have a raw payload, the others a text one */
+static char *make_record(size_t payload_size, size_t *size)
+{
+        bool raw = payload_size > MAX_PAYLOAD_LENGTH;
+        size_t header_size = strlen(headers);
+        size_t offset = 0;
+        char *data;
+
+        *size = (raw ? RAW_PREFIX_LENGTH + 1 : 0) + header_size + payload_size;
+        data = malloc(*size + 1);
+        if (!data) {
+                exit(EXIT_FAILURE);
+        }
+        if (raw) {
+                memcpy(data, RAW_PREFIX "\n", RAW_PREFIX_LENGTH + 1);
+                offset = RAW_PREFIX_LENGTH + 1;
+        }
+        memcpy(data + offset, headers, header_size);
+        offset += header_size;
+        for (size_t i = 0; i < payload_size; i++) {
+                data[offset + i] = i % 64 == 63 ? '\n' : (char)('a' + i % 26);
+        }
+        data[*size] = '\0';
+
+        return data;
+}
+
+static void write_file(const char *path, const char *data, size_t size)
+{
+        FILE *fp = fopen(path, "w");
+
+        if (!fp || fwrite(data, 1, size, fp) != size || fclose(fp) != 0) {
+                perror(path);
+                exit(EXIT_FAILURE);
+        }
+}
+
+static void write_config(bool keepalive)
+{
+        FILE *fp;
+
+        fp = fopen(config_path, "w");
+        if (!fp) {
+                perror(config_path);
+                exit(EXIT_FAILURE);
+        }
+        fprintf(fp, "[settings]\nserver=http://127.0.0.1:%d/\n"
+                "spool_dir=%s/spool\nrecord_retention_enabled=false\n"
+                "http_keepalive=%s\n", server_port, workdir,
+                keepalive ? "true" : "false");
+        fclose(fp);
+}
+
+static int remove_entry(const char *path, const struct stat *sb, int flag,
+                        struct FTW *ftw)
+{
+        return remove(path);
+}
+
+static ssize_t find_header_end(const char *buf, size_t len)
+{
+        const char *end = memmem(buf, len, "\r\n\r\n", 4);
+
+        return end ? end - buf + 4 : -1;
+}
+
+/* Answers each POST of a connection with 201, until the client hangs up */
+static void serve_connection(int cfd)
+{
+        static const char created[] = "HTTP/1.1 201 Created\r\nContent-Length: 0\r\n\r\n";
+        static const char proceed[] = "HTTP/1.1 100 Continue\r\n\r\n";
+        char buf[64 * 1024];
+        size_t len = 0;
+
+        for (;;) {
+                ssize_t header_end, n;
+                size_t body = 0, got;
+                char *field;
+
+                while ((header_end = find_header_end(buf, len)) < 0) {
+                        n = read(cfd, buf + len, sizeof(buf) - len - 1);
+                        if (n <= 0) {
+                                return;
+                        }
+                        len += (size_t)n;
+                }
+                buf[len] = '\0';
+                field = strcasestr(buf, "\r\nContent-Length:");
+                if (field && field < buf + header_end) {
+                        body = strtoul(field + strlen("\r\nContent-Length:"), NULL, 10);
+                }
+                field = strcasestr(buf, "\r\nExpect: 100-continue");
+                if (field && field < buf + header_end &&
+                    write(cfd, proceed, sizeof(proceed) - 1) < 0) {
+                        return;
+                }
+
+                /* Skip the body, keeping what follows it */
+                got = len - (size_t)header_end;
+                while (got < body) {
+                        n = read(cfd, buf, sizeof(buf));
+                        if (n <= 0) {
+                                return;
+                        }
+                        got += (size_t)n;
+                }
+                if (got > body) {
+                        memmove(buf, buf + len - (got - body), got - body);
+                }
+                len = got - body;
+                if (write(cfd, created, sizeof(created) - 1) < 0) {
+                        return;
+                }
+        }
+}
+
+static void *run_server(void *arg)
+{
+        int sfd = *(int *)arg;
+        int cfd;
+
+        while ((cfd = accept(sfd, NULL, NULL)) >= 0) {
+                serve_connection(cfd);
+                close(cfd);
+        }
+
+        return NULL;
+}
+
+static void bench_read(void)
+{
+        struct staged_record record;
+        char *path = NULL;
+
+        if (asprintf(&path, "%s/spool/read", workdir) < 0) {
+                exit(EXIT_FAILURE);
+        }
+
+        for (size_t s = 0; s < sizeof(payload_sizes) / sizeof(payload_sizes[0]); s++) {
+                size_t size;
+                char *data = make_record(payload_sizes[s], &size);
+                double start;
+
+                write_file(path, data, size);
+                start = now();
+                for (int i = 0; i < READ_OPS; i++) {
+                        memset(&record, 0, sizeof(record));
+                        if (!read_record(path, &record)) {
+                                fprintf(stderr, "read_record() failed\n");
+                                exit(EXIT_FAILURE);
+                        }
+                        free_record(&record);
+                }
+                report("read_record", size, now() - start, READ_OPS);
+                free(data);
+        }
+
+        unlink(path);
+        free(path);
+}
+
+static void bench_transmit(const char *op)
+{
+        char *path = NULL;
+
+        if (asprintf(&path, "%s/spool/transmit", workdir) < 0) {
+                exit(EXIT_FAILURE);
+        }
+
+        for (size_t s = 0; s < sizeof(payload_sizes) / sizeof(payload_sizes[0]); s++) {
+                size_t size;
+                char *data = make_record(payload_sizes[s], &size);
+                double elapsed = 0;
+
+                for (int i = 0; i < TRANSMIT_OPS; i++) {
+                        bool sent = false;
+                        double start;
+
+                        /* The record is removed once sent */
+                        write_file(path, data, size);
+                        start = now();
+                        transmit_spooled_record(path, &sent, (long)size);
+                        elapsed += now() - start;
+                        if (!sent) {
+                                fprintf(stderr, "transmit_spooled_record() failed\n");
+                                exit(EXIT_FAILURE);
+                        }
+                }
+                report(op, size, elapsed, TRANSMIT_OPS);
+                free(data);
+        }
+
+        free(path);
+}
+
+int main(void)
+{
+        struct sockaddr_in addr;
+        socklen_t addrlen = sizeof(addr);
+        char *spool = NULL;
+        pthread_t thread;
+        int sfd;
+
+        if (!mkdtemp(workdir) || asprintf(&spool, "%s/spool", workdir) < 0 ||
+            mkdir(spool, S_IRWXU) != 0 ||
+            asprintf(&config_path, "%s/bench.conf", workdir) < 0) {
+                perror("Cannot create the bench directory");
+                exit(EXIT_FAILURE);
+        }
+
+        sfd = socket(AF_INET, SOCK_STREAM, 0);
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        if (sfd < 0 || bind(sfd, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+            listen(sfd, SOMAXCONN) != 0 ||
+            getsockname(sfd, (struct sockaddr *)&addr, &addrlen) != 0) {
+                perror("Cannot listen on the bench server socket");
+                exit(EXIT_FAILURE);
+        }
+        server_port = ntohs(addr.sin_port);
+        if (pthread_create(&thread, NULL, run_server, &sfd) != 0) {
+                exit(EXIT_FAILURE);
+        }
+
+        write_config(false);
+        if (set_config_file(config_path) != 0) {
+                fprintf(stderr, "Cannot use %s\n", config_path);
+                exit(EXIT_FAILURE);
+        }
+
+        bench_read();
+        bench_transmit("transmit_spooled_record");
+        write_config(true);
+        reload_config();
+        bench_transmit("transmit_spooled_record_keepalive");
+
+        /* The kept connection ends with the process */
+        shutdown(sfd, SHUT_RDWR);
+        nftw(workdir, remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+        free(config_path);
+        free(spool);
+
+        return 0;
+}
+
+/* vi: set ts=8 sw=8 sts=4 et tw=80 cino=(0: */
@@ -0,0 +1,314 @@
+/*
+ * This program is part of the Clear Linux Project
+ *
+ * Copyright 2019 Intel Corporation
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms and conditions of the GNU Lesser General Public License, as
+ * published by the Free Software Foundation; either version 2.1 of the License,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU Lesser General Public License for more
+ * details.
+ */
+
+/* Microbenchmark of the path of a record from a probe to the staging log:
+ * creating records with tm_create_record() (allocate_header) and
+ * tm_reset_record(), sending them with tm_send_record() to a socket drained
+ * by a thread, and receiving them with handle_client(), which parses them
+ * with process_record() and appends them to the staging log. Prints one line
+ * per operation and payload size: "probd", operation, payload bytes, and
+ * nanoseconds per operation. */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include "configuration.h"
+#include "staginglog.h"
+#include "telemdaemon.h"
+#include "telemetry.h"
+
+/* Up to the largest text payload, MAX_PAYLOAD_LENGTH */
+static const size_t payload_sizes[] = { 64, 1024, 8000 };
+
+/* Operations timed for each payload size, and bytes staged at most */
+#define OPS_PER_SIZE 20000
+#define STAGED_BYTES_MAX (64 * 1024 * 1024)
+
+static const char headers[] =
+        "record_format_version: 4\nclassification: org.clearlinux/bench/probd\n"
+        "severity: 1\nmachine_id: 1234\ncreation_timestamp: 1418672344\n"
+        "arch: x86_64\nhost_type: bench\nbuild: 200\nkernel_version: 5.0\n"
+        "payload_format_version: 1\nsystem_name: clear-linux-os\n"
+        "board_name: bench\ncpu_model: bench\nbios_version: bench\n"
+        "event_id: 3a2d799826edc6266d72824d2aac6763\n";
+
+static char workdir[] = "/tmp/bench_probd.XXXXXX";
+
+static double now(void)
+{
+        struct timespec ts;
+
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return (double)ts.tv_sec * 1e9 + (double)ts.tv_nsec;
+}
+
+static void report(const char *op, size_t size, double elapsed, int ops)
+{
+        printf("probd %s %zu %.1f\n", op, size, elapsed / ops);
+}
+
+static char *make_payload(size_t size)
+{
+        char *payload = malloc(size + 1);
+
+        if (!payload) {
+                exit(EXIT_FAILURE);
+        }
+        for (size_t i = 0; i < size; i++) {
+                payload[i] = i % 64 == 63 ? '\n' : (char)('a' + i % 26);
+        }
+        payload[size] = '\0';
+
+        return payload;
+}
+
+static void write_config(void)
+{
+        char *path = NULL;
+        FILE *fp;
+
+        if (asprintf(&path, "%s/bench.conf", workdir) < 0) {
+                exit(EXIT_FAILURE);
+        }
+        fp = fopen(path, "w");
+        if (!fp) {
+                perror(path);
+                exit(EXIT_FAILURE);
+        }
+        fprintf(fp, "[settings]\nserver=http://127.0.0.1:1/\n"
+                "socket_path=%s/socket\nspool_dir=%s/spool\n"
+                "staging_log_enabled=true\nring_buffer_enabled=false\n"
+                "probe_worker_threads=0\n", workdir, workdir);
+        fclose(fp);
+
+        if (tm_set_config_file(path) != 0) {
+                fprintf(stderr, "Cannot use %s\n", path);
+                exit(EXIT_FAILURE);
+        }
+        free(path);
+}
+
+static int remove_entry(const char *path, const struct stat *sb, int flag,
+                        struct FTW *ftw)
+{
+        return remove(path);
+}
+
+static void bench_create(void)
+{
+        struct telem_ref *ref = NULL;
+        double start;
+
+        start = now();
+        for (int i = 0; i < OPS_PER_SIZE; i++) {
+                if (tm_create_record(&ref, 1, "org.clearlinux/bench/create", 1) < 0) {
+                        fprintf(stderr, "Cannot create records, opted out?\n");
+                        exit(EXIT_FAILURE);
+                }
+                tm_free_record(ref);
+        }
+        report("create_record", 0, now() - start, OPS_PER_SIZE);
+
+        if (tm_create_record(&ref, 1, "org.clearlinux/bench/create", 1) < 0) {
+                exit(EXIT_FAILURE);
+        }
+        start = now();
+        for (int i = 0; i < OPS_PER_SIZE; i++) {
+                tm_reset_record(ref, 2, "org.clearlinux/bench/reset", 1);
+        }
+        report("reset_record", 0, now() - start, OPS_PER_SIZE);
+        tm_free_record(ref);
+}
+
+/* Accepts connections until the listening socket is shut down, reading
+ * each to its end */
+static void *drain_socket(void *arg)
+{
+        int sfd = *(int *)arg;
+        char buf[64 * 1024];
+        int cfd;
+
+        while ((cfd = accept(sfd, NULL, NULL)) >= 0) {
+                while (read(cfd, buf, sizeof(buf)) > 0) {
+                        continue;
+                }
+                close(cfd);
+        }
+
+        return NULL;
+}
+
+static void bench_send(void)
+{
+        struct sockaddr_un addr;
+        struct telem_ref *ref = NULL;
+        pthread_t thread;
+        double start;
+        int sfd;
+
+        sfd = socket(AF_UNIX, SOCK_STREAM, 0);
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        strncpy(addr.sun_path, socket_path_config(), sizeof(addr.sun_path) - 1);
+        if (sfd < 0 || bind(sfd, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+            listen(sfd, SOMAXCONN) != 0) {
+                perror("Cannot listen on the bench socket");
+                exit(EXIT_FAILURE);
+        }
+        if (pthread_create(&thread, NULL, drain_socket, &sfd) != 0) {
+                exit(EXIT_FAILURE);
+        }
+
+        for (size_t s = 0; s < sizeof(payload_sizes) / sizeof(payload_sizes[0]); s++) {
+                char *payload = make_payload(payload_sizes[s]);
+
+                if (tm_create_record(&ref, 1, "org.clearlinux/bench/send", 1) < 0 ||
+                    tm_set_payload(ref, payload) < 0) {
+                        fprintf(stderr, "Cannot create the record to send\n");
+                        exit(EXIT_FAILURE);
+                }
+                start = now();
+                for (int i = 0; i < OPS_PER_SIZE; i++) {
+                        if (tm_send_record(ref) < 0) {
+                                fprintf(stderr, "tm_send_record() failed\n");
+                                exit(EXIT_FAILURE);
+                        }
+                }
+                report("send_record", payload_sizes[s], now() - start, OPS_PER_SIZE);
+                tm_free_record(ref);
+                free(payload);
+        }
+
+        shutdown(sfd, SHUT_RDWR);
+        pthread_join(thread, NULL);
+        close(sfd);
+        unlink(addr.sun_path);
+}
+
+/* Frames a record the way tm_send_record() does */
+static char *frame_record(const char *payload, size_t *size)
+{
+        uint32_t header_size = (uint32_t)strlen(headers);
+        size_t payload_size = strlen(payload) + 1;
+        uint32_t record_size;
+        char *data;
+
+        *size = 2 * sizeof(uint32_t) + header_size + payload_size;
+        record_size = (uint32_t)*size;
+        data = malloc(*size);
+        if (!data) {
+                exit(EXIT_FAILURE);
+        }
+        memcpy(data, &record_size, sizeof(uint32_t));
+        memcpy(data + sizeof(uint32_t), &header_size, sizeof(uint32_t));
+        memcpy(data + 2 * sizeof(uint32_t), headers, header_size);
+        memcpy(data + 2 * sizeof(uint32_t) + header_size, payload, payload_size);
+
+        return data;
+}
+
+static void discard_record(char *data, size_t size, time_t timestamp, void *arg)
+{
+}
+
+static void bench_handle_client(void)
+{
+        TelemDaemon daemon;
+        client *cl;
+        int sv[2];
+        int sndbuf = 1024 * 1024;
+
+        initialize_probe_daemon(&daemon);
+        if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) != 0 ||
+            fcntl(sv[0], F_SETFL, O_NONBLOCK) != 0) {
+                exit(EXIT_FAILURE);
+        }
+        setsockopt(sv[1], SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(sndbuf));
+        cl = add_client(&daemon.client_head, sv[0]);
+        add_pollfd(&daemon, sv[0], POLLIN | POLLPRI);
+
+        for (size_t s = 0; s < sizeof(payload_sizes) / sizeof(payload_sizes[0]); s++) {
+                char *payload = make_payload(payload_sizes[s]);
+                size_t size;
+                char *record = frame_record(payload, &size);
+                int ops = (int)(STAGED_BYTES_MAX / size);
+                double elapsed = 0;
+                double start;
+
+                if (ops > OPS_PER_SIZE) {
+                        ops = OPS_PER_SIZE;
+                }
+                for (int i = 0; i < ops; i++) {
+                        if (write(sv[1], record, size) != (ssize_t)size) {
+                                perror("Cannot write the record");
+                                exit(EXIT_FAILURE);
+                        }
+                        start = now();
+                        if (!handle_client(&daemon, 0, cl)) {
+                                fprintf(stderr, "handle_client() did not process the record\n");
+                                exit(EXIT_FAILURE);
+                        }
+                        elapsed += now() - start;
+                        /* Keep the staging log from growing */
+                        if (i % 1000 == 999) {
+                                staging_log_drain(discard_record, NULL);
+                        }
+                }
+                report("handle_client", payload_sizes[s], elapsed, ops);
+                staging_log_drain(discard_record, NULL);
+                free(record);
+                free(payload);
+        }
+
+        close(sv[1]);
+        remove_client(&daemon.client_head, cl);
+        staging_log_close();
+}
+
+int main(void)
+{
+        char *spool = NULL;
+
+        if (!mkdtemp(workdir) || asprintf(&spool, "%s/spool", workdir) < 0 ||
+            mkdir(spool, S_IRWXU) != 0) {
+                perror("Cannot create the bench directory");
+                exit(EXIT_FAILURE);
+        }
+        write_config();
+
+        bench_create();
+        bench_send();
+        bench_handle_client();
+
+        nftw(workdir, remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+        free(spool);
+
+        return 0;
+}
+
+/* vi: set ts=8 sw=8 sts=4 et tw=80 cino=(0: */
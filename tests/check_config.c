@@ -15,7 +15,14 @@
  */
 
 #include <check.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
 #include "configuration.h"
+#include "configwatch.h"
 
 START_TEST(check_read_config_for_invalid_file)
 {
@@ -134,6 +141,7 @@ START_TEST(check_config_initialised)
 
         ck_assert_str_eq(server_addr_config(), "http://127.0.0.1");
         ck_assert_str_eq(socket_path_config(), "/tmp/test_telem_socket");
+        ck_assert_int_eq(socket_write_timeout_config(), 500);
         ck_assert_str_eq(spool_dir_config(), "/tmp/spool");
         ck_assert_int_eq(record_expiry_config(), 1200);
         ck_assert_int_eq(spool_max_size_config(), 1024);
@@ -151,6 +159,191 @@ START_TEST(check_config_initialised)
 }
 END_TEST
 
+START_TEST(check_cached_config)
+{
+        char config_file[] = "/tmp/check_config.XXXXXX";
+        const struct configuration *config;
+        const struct configuration *again;
+        FILE *fp;
+        int fd;
+
+        fd = mkstemp(config_file);
+        ck_assert(fd >= 0);
+        fp = fdopen(fd, "w");
+        fprintf(fp, "[settings]\nserver=http://a/\n");
+        fclose(fp);
+
+        config = get_cached_config(config_file);
+        ck_assert(config != NULL);
+        ck_assert_str_eq(config->strValues[CONF_SERVER_ADDR], "http://a/");
+        ck_assert_str_eq(config->strValues[CONF_SPOOL_DIR], DEFAULT_SPOOL_DIR);
+
+        /* The file is only parsed again once it changes */
+        again = get_cached_config(config_file);
+        ck_assert(again == config);
+
+        fp = fopen(config_file, "w");
+        fprintf(fp, "[settings]\nserver=http://bb/\n");
+        fclose(fp);
+        config = get_cached_config(config_file);
+        ck_assert(config != NULL);
+        ck_assert_str_eq(config->strValues[CONF_SERVER_ADDR], "http://bb/");
+
+        unlink(config_file);
+        ck_assert(get_cached_config(config_file) == NULL);
+        ck_assert(get_cached_config("relative.conf") == NULL);
+}
+END_TEST
+
+START_TEST(check_config_snapshot)
+{
+        char config_file[] = "/tmp/check_config.XXXXXX";
+        char snapshot_file[] = "/tmp/check_config_snapshot.XXXXXX";
+        struct configuration snap = { { 0 } };
+        FILE *fp;
+        int fd;
+
+        fd = mkstemp(config_file);
+        ck_assert(fd >= 0);
+        fp = fdopen(fd, "w");
+        fprintf(fp, "[settings]\nserver=http://snap/\nrate_limit_strategy=DROP\n"
+                "record_expiry=42\nhttp2_enabled=true\n");
+        fclose(fp);
+        fd = mkstemp(snapshot_file);
+        ck_assert(fd >= 0);
+        close(fd);
+
+        set_config_file(config_file);
+        set_config_snapshot_file(snapshot_file);
+        reload_config();
+        ck_assert_int_eq(write_config_snapshot(), 0);
+
+        ck_assert(read_config_snapshot(config_file, &snap));
+        ck_assert_str_eq(snap.strValues[CONF_SERVER_ADDR], "http://snap/");
+        ck_assert_str_eq(snap.strValues[CONF_SPOOL_DIR], DEFAULT_SPOOL_DIR);
+        ck_assert_int_eq(snap.intValues[CONF_RECORD_EXPIRY], 42);
+        ck_assert(snap.boolValues[CONF_HTTP2_ENABLED]);
+        ck_assert(snap.boolValues[CONF_RATE_LIMIT_ENABLED] == DEFAULT_RATE_LIMIT_ENABLED);
+        munmap(snap.snapshot, snap.snapshot_size);
+
+        /* The getters do not modify the values, which may be read-only */
+        ck_assert_str_eq(rate_limit_strategy_config(), "drop");
+        ck_assert_str_eq(get_config()->strValues[CONF_RATE_LIMIT_STRATEGY], "DROP");
+
+        /* Only valid for the file it was written from, unmodified */
+        ck_assert(!read_config_snapshot(NULL, &snap));
+        ck_assert(!read_config_snapshot(ABSTOPSRCDIR "/src/data/example.conf", &snap));
+        fp = fopen(config_file, "a");
+        fprintf(fp, "spool_dir=/tmp/other\n");
+        fclose(fp);
+        ck_assert(!read_config_snapshot(config_file, &snap));
+
+        /* Truncated snapshots are ignored */
+        reload_config();
+        ck_assert_int_eq(write_config_snapshot(), 0);
+        ck_assert(read_config_snapshot(config_file, &snap));
+        munmap(snap.snapshot, snap.snapshot_size);
+        ck_assert_int_eq(truncate(snapshot_file, 100), 0);
+        ck_assert(!read_config_snapshot(config_file, &snap));
+
+        set_config_snapshot_file(NULL);
+        unlink(snapshot_file);
+        unlink(config_file);
+}
+END_TEST
+
+START_TEST(check_config_reload)
+{
+        char config_file[] = "/tmp/check_config.XXXXXX";
+        struct config_watch watch;
+        FILE *fp;
+        int fd;
+
+        fd = mkstemp(config_file);
+        ck_assert(fd >= 0);
+        fp = fdopen(fd, "w");
+        fprintf(fp, "[settings]\nserver=http://first/\n");
+        fclose(fp);
+
+        set_config_file(config_file);
+        ck_assert(reload_config());
+        ck_assert_str_eq(server_addr_config(), "http://first/");
+
+        ck_assert_int_eq(config_watch_init(&watch), 0);
+        ck_assert(watch.fd >= 0);
+        ck_assert(!config_watch_read(&watch));
+
+        fp = fopen(config_file, "w");
+        fprintf(fp, "[settings]\nserver=http://second/\n");
+        fclose(fp);
+        ck_assert(config_watch_read(&watch));
+        ck_assert(reload_config());
+        ck_assert_str_eq(server_addr_config(), "http://second/");
+
+        /* A configuration that cannot be read leaves the last one in use */
+        unlink(config_file);
+        ck_assert(config_watch_read(&watch));
+        ck_assert(!reload_config());
+        ck_assert_str_eq(server_addr_config(), "http://second/");
+
+        config_watch_close(&watch);
+        ck_assert_int_eq(watch.fd, -1);
+}
+END_TEST
+
+START_TEST(check_config_reload_readers)
+{
+        char config_file[] = "/tmp/check_config.XXXXXX";
+        int readers[CONFIG_READERS_MAX];
+        const char *first;
+        int reader;
+        FILE *fp;
+        int fd;
+
+        fd = mkstemp(config_file);
+        ck_assert(fd >= 0);
+        fp = fdopen(fd, "w");
+        fprintf(fp, "[settings]\nserver=http://first/\n");
+        fclose(fp);
+        set_config_file(config_file);
+        ck_assert(reload_config());
+
+        reader = config_reader_register();
+        ck_assert_int_ge(reader, 0);
+        first = server_addr_config();
+
+        /* The values a reader got stay valid until its next checkpoint */
+        for (int i = 0; i < 3; i++) {
+                fp = fopen(config_file, "w");
+                fprintf(fp, "[settings]\nserver=http://reload%d/\n", i);
+                fclose(fp);
+                ck_assert(reload_config());
+                ck_assert_str_eq(first, "http://first/");
+        }
+        ck_assert_str_eq(server_addr_config(), "http://reload2/");
+
+        /* Then they are freed by later reloads */
+        config_reader_checkpoint(reader);
+        ck_assert(reload_config());
+        config_reader_offline(reader);
+        ck_assert(reload_config());
+        ck_assert_str_eq(server_addr_config(), "http://reload2/");
+        config_reader_unregister(reader);
+
+        /* Readers are limited */
+        for (int i = 0; i < CONFIG_READERS_MAX; i++) {
+                readers[i] = config_reader_register();
+                ck_assert_int_ge(readers[i], 0);
+        }
+        ck_assert_int_eq(config_reader_register(), -ENOSPC);
+        for (int i = 0; i < CONFIG_READERS_MAX; i++) {
+                config_reader_unregister(readers[i]);
+        }
+
+        unlink(config_file);
+}
+END_TEST
+
 Suite *config_suite(void)
 {
         // A suite is comprised of test cases, defined below
@@ -164,6 +357,10 @@ Suite *config_suite(void)
         tcase_add_test(t, check_layered_config);
         tcase_add_test(t, check_read_valid_config_record_retention_delivery);
         tcase_add_test(t, check_config_initialised);
+        tcase_add_test(t, check_cached_config);
+        tcase_add_test(t, check_config_snapshot);
+        tcase_add_test(t, check_config_reload);
+        tcase_add_test(t, check_config_reload_readers);
 
         // add more TCases here
 
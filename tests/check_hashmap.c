@@ -0,0 +1,216 @@
+/*
+ * This program is part of the Clear Linux Project
+ *
+ * Copyright 2019 Intel Corporation
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms and conditions of the GNU Lesser General Public License, as
+ * published by the Free Software Foundation; either version 2.1 of the License,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU Lesser General Public License for more
+ * details.
+ */
+
+/* Built against both hashmap implementations, as check_hashmap and
+ * check_hashmap_open */
+
+#include <check.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "nica/hashmap.h"
+
+#define MANY_KEYS 100000
+
+static int freed_keys = 0;
+static int freed_values = 0;
+
+static void count_key_free(void *p)
+{
+        freed_keys++;
+        free(p);
+}
+
+static void count_value_free(void *p)
+{
+        freed_values++;
+        free(p);
+}
+
+START_TEST(hashmap_put_get)
+{
+        NcHashmap *map = nc_hashmap_new(nc_string_hash, nc_string_compare);
+
+        ck_assert_ptr_ne(map, NULL);
+        ck_assert(nc_hashmap_put(map, "one", NC_HASH_VALUE(1)));
+        ck_assert(nc_hashmap_put(map, "two", NC_HASH_VALUE(2)));
+        ck_assert_int_eq(nc_hashmap_size(map), 2);
+        ck_assert_int_eq(NC_UNHASH_VALUE(nc_hashmap_get(map, "one")), 1);
+        ck_assert_int_eq(NC_UNHASH_VALUE(nc_hashmap_get(map, "two")), 2);
+        ck_assert(!nc_hashmap_contains(map, "three"));
+
+        nc_hashmap_free(map);
+}
+END_TEST
+
+START_TEST(hashmap_replace_frees)
+{
+        NcHashmap *map = nc_hashmap_new_full(nc_string_hash, nc_string_compare,
+                                             count_key_free, count_value_free);
+
+        freed_keys = freed_values = 0;
+        ck_assert(nc_hashmap_put(map, strdup("key"), strdup("first")));
+        ck_assert(nc_hashmap_put(map, strdup("key"), strdup("second")));
+        ck_assert_int_eq(nc_hashmap_size(map), 1);
+        ck_assert_int_eq(freed_keys, 1);
+        ck_assert_int_eq(freed_values, 1);
+        ck_assert_str_eq(nc_hashmap_get(map, "key"), "second");
+
+        nc_hashmap_free(map);
+        ck_assert_int_eq(freed_keys, 2);
+        ck_assert_int_eq(freed_values, 2);
+}
+END_TEST
+
+START_TEST(hashmap_remove_steal)
+{
+        NcHashmap *map = nc_hashmap_new_full(nc_string_hash, nc_string_compare,
+                                             count_key_free, count_value_free);
+        char *key = strdup("stolen");
+        char *value = strdup("value");
+
+        freed_keys = freed_values = 0;
+        ck_assert(nc_hashmap_put(map, strdup("removed"), strdup("value")));
+        ck_assert(nc_hashmap_put(map, key, value));
+
+        ck_assert(nc_hashmap_remove(map, "removed"));
+        ck_assert_int_eq(freed_keys, 1);
+        ck_assert(!nc_hashmap_remove(map, "removed"));
+
+        ck_assert(nc_hashmap_steal(map, "stolen"));
+        ck_assert_int_eq(freed_keys, 1);
+        ck_assert_int_eq(nc_hashmap_size(map), 0);
+        ck_assert_ptr_eq(nc_hashmap_get(map, "stolen"), NULL);
+
+        nc_hashmap_free(map);
+        free(key);
+        free(value);
+}
+END_TEST
+
+START_TEST(hashmap_grow)
+{
+        NcHashmap *map = nc_hashmap_new(NULL, NULL);
+
+        for (unsigned i = 1; i <= MANY_KEYS; i++) {
+                ck_assert(nc_hashmap_put(map, NC_HASH_KEY(i), NC_HASH_VALUE(i * 2)));
+                /* Interleaved removals leave deleted slots behind */
+                if (i % 3 == 0) {
+                        ck_assert(nc_hashmap_remove(map, NC_HASH_KEY(i - 1)));
+                }
+        }
+        ck_assert_int_eq(nc_hashmap_size(map), MANY_KEYS - MANY_KEYS / 3);
+
+        for (unsigned i = 1; i <= MANY_KEYS; i++) {
+                void *value = nc_hashmap_get(map, NC_HASH_KEY(i));
+
+                if (i % 3 == 2 && i + 1 <= MANY_KEYS) {
+                        ck_assert_ptr_eq(value, NULL);
+                } else {
+                        ck_assert_int_eq(NC_UNHASH_VALUE(value), i * 2);
+                }
+        }
+
+        nc_hashmap_free(map);
+}
+END_TEST
+
+START_TEST(hashmap_iterate)
+{
+        NcHashmap *map = nc_hashmap_new(NULL, NULL);
+        NcHashmapIter iter;
+        unsigned long sum = 0, expected = 0;
+        void *key = NULL, *value = NULL;
+        int count = 0;
+
+        /* Stop at sizes at which a resize may be in progress */
+        for (unsigned i = 1; i <= 1000; i++) {
+                ck_assert(nc_hashmap_put(map, NC_HASH_KEY(i), NC_HASH_VALUE(i)));
+                expected += i;
+        }
+
+        nc_hashmap_iter_init(map, &iter);
+        while (nc_hashmap_iter_next(&iter, &key, &value)) {
+                ck_assert_ptr_eq(key, value);
+                sum += NC_UNHASH_VALUE(value);
+                count++;
+        }
+        ck_assert_int_eq(count, 1000);
+        ck_assert_int_eq(sum, expected);
+
+        nc_hashmap_free(map);
+}
+END_TEST
+
+START_TEST(hashmap_string_keys)
+{
+        NcHashmap *map = nc_hashmap_new_full(nc_string_hash, nc_string_compare,
+                                             free, NULL);
+        char key[32];
+
+        for (int i = 0; i < 5000; i++) {
+                snprintf(key, sizeof(key), "key-%d", i);
+                ck_assert(nc_hashmap_put(map, strdup(key), NC_HASH_VALUE(i + 1)));
+        }
+        for (int i = 0; i < 5000; i += 2) {
+                snprintf(key, sizeof(key), "key-%d", i);
+                ck_assert(nc_hashmap_remove(map, key));
+        }
+        ck_assert_int_eq(nc_hashmap_size(map), 2500);
+        for (int i = 0; i < 5000; i++) {
+                snprintf(key, sizeof(key), "key-%d", i);
+                ck_assert(nc_hashmap_contains(map, key) == (i % 2 == 1));
+        }
+
+        nc_hashmap_free(map);
+}
+END_TEST
+
+Suite *hashmap_suite(void)
+{
+        Suite *s = suite_create("hashmap");
+
+        TCase *t = tcase_create("hashmap");
+        tcase_add_test(t, hashmap_put_get);
+        tcase_add_test(t, hashmap_replace_frees);
+        tcase_add_test(t, hashmap_remove_steal);
+        tcase_add_test(t, hashmap_grow);
+        tcase_add_test(t, hashmap_iterate);
+        tcase_add_test(t, hashmap_string_keys);
+        suite_add_tcase(s, t);
+
+        return s;
+}
+
+int main(void)
+{
+        Suite *s;
+        SRunner *sr;
+
+        s = hashmap_suite();
+        sr = srunner_create(s);
+
+        srunner_set_log(sr, NULL);
+        srunner_set_tap(sr, "-");
+
+        srunner_run_all(sr, CK_SILENT);
+        srunner_free(sr);
+
+        return 0;
+}
+
+/* vi: set ts=8 sw=8 sts=4 et tw=80 cino=(0: */
@@ -17,25 +17,37 @@
 #include <check.h>
 #include <errno.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
 #include "common.h"
 #include "journal/journal.h"
+#include "recordpack.h"
 
 static char *journal_file = "journal.txt";
+static char *journal_index_file = "journal.txt.idx";
 static char *journal_print_file = "journal.print.txt";
+static char *journal_print_index_file = "journal.print.txt.idx";
 static struct TelemJournal *journal = NULL;
+static char *pack_dir = "records.pack.d";
 static char *eid = "00007766547776eb7fc478eb0eb43e43";
 static int K = 20;
 
 void teardown(void)
 {
         remove(journal_file);
+        remove(journal_index_file);
 }
 
 START_TEST(check_open_journal)
 {
         struct TelemJournal *j = open_journal(journal_file);
         ck_assert_ptr_nonnull(j);
-        ck_assert_ptr_nonnull(j->fptr);
+        ck_assert_ptr_nonnull(j->header);
+        ck_assert_int_eq(j->header->capacity, RECORD_LIMIT + DEVIATION);
         ck_assert_ptr_nonnull(j->boot_id);
         ck_assert_int_eq(j->record_count, 0);
         close_journal(j);
@@ -115,6 +127,15 @@ void new_entry_teardown(void)
                 journal = NULL;
         }
         remove(journal_file);
+        remove(journal_index_file);
+}
+
+/* Gets the boot id of the newest entry */
+static char *journal_slot_boot_id(struct TelemJournal *j)
+{
+        uint32_t newest = (j->header->head + j->header->count - 1) % j->header->capacity;
+
+        return j->entries[newest].boot_id;
 }
 
 void insert_n_records(int n, struct TelemJournal *j)
@@ -143,6 +164,441 @@ START_TEST(check_journal_file_prune)
 }
 END_TEST
 
+START_TEST(check_journal_ring_wrap)
+{
+        uint32_t capacity;
+        struct TelemJournal *j = open_journal(journal_file);
+
+        ck_assert_ptr_nonnull(j);
+        capacity = j->header->capacity;
+        // Without pruning, the oldest entries are overwritten a segment at a time
+        j->record_count_limit = (int)capacity;
+        insert_n_records((int)capacity + 10, j);
+        ck_assert_int_eq(j->record_count, capacity);
+        close_journal(j);
+
+        // Entries survive reopening, the oldest were overwritten
+        j = open_journal(journal_file);
+        ck_assert_ptr_nonnull(j);
+        ck_assert_int_eq(j->record_count, capacity);
+        ck_assert_int_eq(j->entries[j->header->head].timestamp, 1520054957 + 10);
+        close_journal(j);
+}
+END_TEST
+
+static int pruned_batches = 0;
+static int pruned_records = 0;
+
+static int count_pruned(char **record_ids, int count)
+{
+        pruned_batches++;
+        pruned_records += count;
+        ck_assert_int_eq(strlen(record_ids[count - 1]), 32);
+
+        return 0;
+}
+
+START_TEST(check_journal_watermark_prune)
+{
+        struct TelemJournal *j = open_journal(journal_file);
+
+        ck_assert_ptr_nonnull(j);
+        ck_assert_int_eq(prune_journal(j, NULL), 0);
+        j->prune_batch_callback = &count_pruned;
+        pruned_batches = 0;
+        pruned_records = 0;
+
+        // Entries are added up to the high watermark
+        insert_n_records(RECORD_LIMIT + DEVIATION - j->record_count, j);
+        ck_assert_int_eq(j->record_count, RECORD_LIMIT + DEVIATION);
+        ck_assert_int_eq(pruned_batches, 0);
+
+        // The next one prunes down to the limit, in a single batch
+        insert_n_records(1, j);
+        ck_assert_int_eq(j->record_count, RECORD_LIMIT + 1);
+        ck_assert_int_eq(pruned_batches, 1);
+        ck_assert_int_eq(pruned_records, DEVIATION);
+        close_journal(j);
+}
+END_TEST
+
+START_TEST(check_journal_text_convert)
+{
+        FILE *fptr = fopen(journal_file, "w");
+        struct TelemJournal *j = NULL;
+
+        ck_assert_ptr_nonnull(fptr);
+        fprintf(fptr, "a19a0d41ba16788881e274b19b8a1be4\0361520054957\036a/b/c\036%s"
+                "\03660c014cd-4693-40f1-b334-548cd932949b\n", eid);
+        fprintf(fptr, "b19a0d41ba16788881e274b19b8a1be4\0361520054958\036a/b/d\036%s"
+                "\03660c014cd-4693-40f1-b334-548cd932949b\n", eid);
+        fclose(fptr);
+
+        j = open_journal(journal_file);
+        ck_assert_ptr_nonnull(j);
+        ck_assert_int_eq(j->record_count, 2);
+        ck_assert_int_eq(print_journal(j, "a/b/d", NULL, eid, NULL, 0), 1);
+        ck_assert_int_eq(print_journal(j, NULL, "a19a0d41ba16788881e274b19b8a1be4",
+                                       NULL, NULL, 0), 1);
+        close_journal(j);
+}
+END_TEST
+
+START_TEST(check_journal_index_lookup)
+{
+        char *classes[] = { "a/b/c", "a/b/d", "a/c/c", "x/y/z" };
+        char event_id[] = "00007766547776eb7fc478eb0eb43e40";
+        char *record_id = NULL;
+        struct TelemJournal *j = NULL;
+        uint32_t capacity;
+
+        // From an empty journal, segments fill from the first slot
+        teardown();
+        j = open_journal(journal_file);
+        ck_assert_ptr_nonnull(j);
+        ck_assert_ptr_nonnull(j->index);
+        capacity = j->header->capacity;
+        j->record_count_limit = (int)capacity;
+
+        // Wrap the ring, 10 entries per event id, classes in turn
+        for (uint32_t i = 0; i < capacity + 20; i++) {
+                snprintf(event_id + 30, 3, "%02x", i / 10);
+                ck_assert_int_eq(new_journal_entry(j, classes[i % 4], 1520054957 + i,
+                                                   event_id), 0);
+        }
+        record_id = strdup(j->latest_record_id);
+
+        // The 20 oldest were overwritten, 150 entries of which 38, 38, 37 and 37 per class
+        ck_assert_int_eq(capacity, 150);
+        ck_assert_int_eq(print_journal(j, NULL, record_id, NULL, NULL, 0), 1);
+        ck_assert_int_eq(print_journal(j, NULL, NULL, event_id, NULL, 0), 10);
+        ck_assert_int_eq(print_journal(j, "x/y/z", NULL, NULL, NULL, 0), 37);
+        ck_assert_int_eq(print_journal(j, "a/b/*", NULL, NULL, NULL, 0), 76);
+        ck_assert_int_eq(print_journal(j, "a/*", NULL, NULL, NULL, 0), 113);
+        ck_assert_int_eq(print_journal(j, "a/b/*", NULL, event_id, NULL, 0), 6);
+        ck_assert_int_eq(print_journal(j, NULL, NULL, NULL, j->boot_id, 0), 150);
+        snprintf(event_id + 30, 3, "%02x", 0);
+        ck_assert_int_eq(print_journal(j, NULL, NULL, event_id, NULL, 0), 0);
+
+        // Pruned entries leave the index
+        j->record_count_limit = 10;
+        ck_assert_int_eq(prune_journal(j, NULL), 0);
+        ck_assert_int_eq(j->index->count, 10);
+        ck_assert_int_eq(print_journal(j, "x/y/z", NULL, NULL, NULL, 0), 2);
+
+        // A stale index is not used, and rebuilt by the next change
+        j->index->appended--;
+        ck_assert_int_eq(print_journal(j, NULL, record_id, NULL, NULL, 0), 1);
+        ck_assert_int_eq(new_journal_entry(j, "x/y/z", 1520054957, eid), 0);
+        ck_assert_int_eq(j->index->appended, j->header->appended);
+        ck_assert_int_eq(print_journal(j, "x/y/z", NULL, NULL, NULL, 0), 3);
+        close_journal(j);
+
+        // The index is kept with the journal
+        j = open_journal(journal_file);
+        ck_assert_ptr_nonnull(j);
+        ck_assert_int_eq(j->index->count, 11);
+        ck_assert_int_eq(print_journal(j, NULL, record_id, NULL, NULL, 0), 1);
+        close_journal(j);
+        free(record_id);
+}
+END_TEST
+
+START_TEST(check_journal_segments)
+{
+        struct TelemJournal *j = NULL;
+        struct JournalIndexHeader *index = NULL;
+        char *boot_id = NULL;
+        uint32_t capacity;
+
+        teardown();
+        j = open_journal(journal_file);
+        ck_assert_ptr_nonnull(j);
+        capacity = j->header->capacity;
+        j->record_count_limit = (int)capacity;
+        boot_id = j->boot_id;
+
+        // 25 entries, then 5 of another class after a reboot
+        insert_n_records(25, j);
+        j->boot_id = "60c014cd-4693-40f1-b334-548cd932949b";
+        for (int i = 0; i < 5; i++) {
+                ck_assert_int_eq(new_journal_entry(j, "a/b/c", 1520054957 + 25 + i, eid), 0);
+        }
+        ck_assert_int_eq(j->segments[0].entries, JOURNAL_SEGMENT_ENTRIES);
+        ck_assert_int_eq(j->segments[1].min_timestamp, 1520054957 + 10);
+        ck_assert_int_eq(j->segments[1].max_timestamp, 1520054957 + 19);
+        ck_assert_int_eq(j->segments[1].boot_ids, 1);
+        ck_assert_int_eq(j->segments[2].boot_ids, 2);
+
+        // Without the index, queries only scan the segments that may match
+        index = j->index;
+        j->index = NULL;
+        ck_assert_int_eq(print_journal(j, "a/b/c", NULL, NULL, NULL, 0), 5);
+        ck_assert_int_eq(print_journal(j, "a/*", NULL, NULL, NULL, 0), 5);
+        ck_assert_int_eq(print_journal(j, "t/t/*", NULL, NULL, NULL, 0), 25);
+        ck_assert_int_eq(print_journal(j, NULL, NULL, NULL, j->boot_id, 0), 5);
+        ck_assert_int_eq(print_journal(j, NULL, NULL, NULL, boot_id, 0), 25);
+        ck_assert_int_eq(print_journal(j, "x/y/z", NULL, NULL, NULL, 0), 0);
+        j->index = index;
+        j->boot_id = boot_id;
+
+        // Entering a full segment drops it whole
+        j->prune_batch_callback = &count_pruned;
+        pruned_batches = 0;
+        pruned_records = 0;
+        insert_n_records((int)capacity - 30, j);
+        ck_assert_int_eq(j->record_count, capacity);
+        insert_n_records(1, j);
+        ck_assert_int_eq(j->record_count, capacity - JOURNAL_SEGMENT_ENTRIES + 1);
+        ck_assert_int_eq(pruned_batches, 1);
+        ck_assert_int_eq(pruned_records, JOURNAL_SEGMENT_ENTRIES);
+        ck_assert_int_eq(j->segments[0].entries, 1);
+        close_journal(j);
+}
+END_TEST
+
+START_TEST(check_journal_upgrade)
+{
+        struct JournalHeader header;
+        struct JournalEntry entry;
+        struct TelemJournal *j = NULL;
+        FILE *fptr = NULL;
+
+        // A ring of the first version, wrapped, without footers
+        teardown();
+        memset(&header, 0, sizeof(header));
+        memcpy(header.magic, JOURNAL_MAGIC, sizeof(header.magic));
+        header.version = 1;
+        header.entry_size = sizeof(struct JournalEntry);
+        header.capacity = RECORD_LIMIT + DEVIATION;
+        header.head = header.capacity - 2;
+        header.count = 4;
+        fptr = fopen(journal_file, "w");
+        ck_assert_ptr_nonnull(fptr);
+        fwrite(&header, sizeof(header), 1, fptr);
+        for (uint32_t i = 0; i < header.capacity; i++) {
+                uint32_t n = (i + 2) % header.capacity;
+
+                memset(&entry, 0, sizeof(entry));
+                entry.timestamp = 1520054957 + n;
+                snprintf(entry.classification, sizeof(entry.classification), "a/b/c");
+                snprintf(entry.record_id, sizeof(entry.record_id), "%032x", n);
+                snprintf(entry.event_id, sizeof(entry.event_id), "%s", eid);
+                fwrite(&entry, sizeof(entry), 1, fptr);
+        }
+        fclose(fptr);
+
+        j = open_journal(journal_file);
+        ck_assert_ptr_nonnull(j);
+        ck_assert_int_eq(j->header->version, JOURNAL_VERSION);
+        ck_assert_int_eq(j->record_count, 4);
+        ck_assert_int_eq(j->entries[0].timestamp, 1520054957);
+        ck_assert_int_eq(j->segments[0].max_timestamp, 1520054957 + 3);
+        ck_assert_int_eq(print_journal_range(j, "a/b/c", NULL, NULL, NULL, 1520054957 + 2,
+                                             0, 0), 2);
+        close_journal(j);
+}
+END_TEST
+
+START_TEST(check_journal_time_range)
+{
+        struct TelemJournal *j = open_journal(journal_file);
+
+        ck_assert_ptr_nonnull(j);
+        insert_n_records(K, j);
+
+        ck_assert_int_eq(print_journal_range(j, NULL, NULL, NULL, NULL, 1520054957 + 5,
+                                             1520054957 + 9, 0), 5);
+        ck_assert_int_eq(print_journal_range(j, NULL, NULL, NULL, NULL, 1520054957 + 5,
+                                             0, 0), K - 5);
+        ck_assert_int_eq(print_journal_range(j, NULL, NULL, NULL, NULL, 0,
+                                             1520054957 + 9, 0), 10);
+        ck_assert_int_eq(print_journal_range(j, "t/t/*", NULL, NULL, NULL, 1520054957 + 15,
+                                             0, 0), K - 15);
+        ck_assert_int_eq(print_journal_range(j, NULL, NULL, NULL, NULL, 1520054957 + K,
+                                             0, 0), 0);
+        ck_assert_int_eq(print_journal_range(j, NULL, NULL, NULL, NULL, 1520054957 + 9,
+                                             1520054957 + 5, 0), 0);
+        close_journal(j);
+}
+END_TEST
+
+START_TEST(check_journal_group_commit)
+{
+        struct TelemJournal *j = open_journal(journal_file);
+        int timeout;
+
+        ck_assert_ptr_nonnull(j);
+        ck_assert_int_eq(journal_commit_timeout(j), -1);
+
+        // Groups are synced once complete
+        set_journal_sync(j, JOURNAL_SYNC_GROUP, 3, 60000);
+        insert_n_records(2, j);
+        ck_assert_int_eq(j->pending, 2);
+        timeout = journal_commit_timeout(j);
+        ck_assert(timeout > 0 && timeout <= 60000);
+        ck_assert_int_eq(commit_journal(j, false), 0);
+        ck_assert_int_eq(j->pending, 2);
+        insert_n_records(1, j);
+        ck_assert_int_eq(j->pending, 0);
+        ck_assert_int_eq(journal_commit_timeout(j), -1);
+
+        // Or when forced, or when the oldest entry has waited long enough
+        insert_n_records(1, j);
+        ck_assert_int_eq(commit_journal(j, true), 0);
+        ck_assert_int_eq(j->pending, 0);
+        set_journal_sync(j, JOURNAL_SYNC_GROUP, 3, 0);
+        insert_n_records(1, j);
+        ck_assert_int_eq(j->pending, 0);
+
+        // Entries are synced one by one, and keep the boot id read on open
+        set_journal_sync(j, JOURNAL_SYNC_ENTRY, 1, 0);
+        insert_n_records(1, j);
+        ck_assert_int_eq(j->pending, 0);
+        ck_assert_str_eq(journal_slot_boot_id(j), j->boot_id);
+        close_journal(j);
+}
+END_TEST
+
+static int open_pack_dir(void)
+{
+        mkdir(pack_dir, 0755);
+        return open(pack_dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+}
+
+static void pack_record_id(char *record_id, int i)
+{
+        snprintf(record_id, 33, "%032x", i);
+}
+
+START_TEST(check_record_pack_dedup)
+{
+        struct record_pack pack;
+        struct record_pack reader;
+        char record_id[33];
+        char *body = NULL;
+        size_t size = 0;
+        const char *heartbeat = "hello hello hello hello hello hello hello";
+        int dirfd = open_pack_dir();
+
+        ck_assert(dirfd >= 0);
+        ck_assert_int_eq(record_pack_open(&pack, dirfd, true, true), 0);
+
+        // Identical bodies are stored once
+        for (int i = 0; i < 3; i++) {
+                pack_record_id(record_id, i);
+                ck_assert_int_eq(record_pack_put(&pack, record_id, heartbeat,
+                                                 strlen(heartbeat)), 0);
+        }
+        pack_record_id(record_id, 3);
+        ck_assert_int_eq(record_pack_put(&pack, record_id, "other", 5), 0);
+        ck_assert_int_eq(pack.count, 4);
+        ck_assert_int_eq(pack.blob_count, 2);
+
+        // Readers find them, deflated or not
+        ck_assert_int_eq(record_pack_open(&reader, dirfd, false, false), 0);
+        ck_assert_int_eq(reader.count, 4);
+        pack_record_id(record_id, 1);
+        ck_assert_int_eq(record_pack_get(&reader, record_id, &body, &size), 0);
+        ck_assert_int_eq(size, strlen(heartbeat));
+        ck_assert_str_eq(body, heartbeat);
+        free(body);
+        pack_record_id(record_id, 3);
+        ck_assert_int_eq(record_pack_get(&reader, record_id, &body, &size), 0);
+        ck_assert_str_eq(body, "other");
+        free(body);
+        ck_assert_int_eq(record_pack_get(&reader, "missing", &body, &size), -ENOENT);
+        record_pack_close(&reader);
+
+        // Bodies are dropped with their last record
+        pack_record_id(record_id, 0);
+        ck_assert_int_eq(record_pack_remove(&pack, record_id), 0);
+        ck_assert_int_eq(record_pack_remove(&pack, record_id), -ENOENT);
+        ck_assert_int_eq(pack.blob_count, 2);
+        pack_record_id(record_id, 3);
+        ck_assert_int_eq(record_pack_remove(&pack, record_id), 0);
+        ck_assert_int_eq(pack.blob_count, 1);
+        record_pack_close(&pack);
+
+        // And removals are kept on disk
+        ck_assert_int_eq(record_pack_open(&pack, dirfd, true, true), 0);
+        ck_assert_int_eq(pack.count, 2);
+        ck_assert_int_eq(pack.blob_count, 1);
+        record_pack_close(&pack);
+        close(dirfd);
+}
+END_TEST
+
+START_TEST(check_record_pack_compact)
+{
+        struct record_pack pack;
+        char record_id[33];
+        char data[4096];
+        char *body = NULL;
+        size_t size = 0;
+        uint32_t generation;
+        int dirfd = open_pack_dir();
+
+        ck_assert(dirfd >= 0);
+        ck_assert_int_eq(record_pack_open(&pack, dirfd, true, false), 0);
+        generation = pack.generation;
+
+        for (int i = 0; i < 40; i++) {
+                memset(data, 'a' + i % 26, sizeof(data));
+                snprintf(data, sizeof(data), "%d", i);
+                pack_record_id(record_id, i);
+                ck_assert_int_eq(record_pack_put(&pack, record_id, data, sizeof(data)), 0);
+        }
+        ck_assert_int_eq(pack.blob_count, 40);
+
+        // Not worth it until removed records outweigh the live ones
+        for (int i = 0; i < 20; i++) {
+                pack_record_id(record_id, i);
+                ck_assert_int_eq(record_pack_remove(&pack, record_id), 0);
+        }
+        ck_assert_int_eq(record_pack_compact(&pack), 0);
+        for (int i = 20; i < 35; i++) {
+                pack_record_id(record_id, i);
+                ck_assert_int_eq(record_pack_remove(&pack, record_id), 0);
+        }
+        ck_assert_int_eq(record_pack_compact(&pack), 1);
+        ck_assert_int_eq(pack.generation, generation + 1);
+        ck_assert_int_eq(pack.slots, 5);
+        snprintf(data, sizeof(data), RECORD_PACK_PREFIX "%08u", generation);
+        ck_assert_int_eq(faccessat(dirfd, data, F_OK, 0), -1);
+        record_pack_close(&pack);
+
+        // The live records are in the pack of the new generation
+        ck_assert_int_eq(record_pack_open(&pack, dirfd, false, false), 0);
+        ck_assert_int_eq(pack.generation, generation + 1);
+        ck_assert_int_eq(pack.count, 5);
+        pack_record_id(record_id, 37);
+        ck_assert_int_eq(record_pack_get(&pack, record_id, &body, &size), 0);
+        ck_assert_int_eq(size, sizeof(data));
+        ck_assert_str_eq(body, "37");
+        ck_assert_int_eq(body[size - 1], 'a' + 37 % 26);
+        free(body);
+        record_pack_close(&pack);
+        close(dirfd);
+}
+END_TEST
+
+void pack_teardown(void)
+{
+        DIR *dir = opendir(pack_dir);
+        struct dirent *entry;
+
+        if (dir) {
+                while ((entry = readdir(dir)) != NULL) {
+                        if (entry->d_name[0] != '.') {
+                                unlinkat(dirfd(dir), entry->d_name, 0);
+                        }
+                }
+                closedir(dir);
+        }
+        rmdir(pack_dir);
+}
+
 void journal_entry_setup(void)
 {
         int result = 0;
@@ -195,6 +651,7 @@ void journal_entry_teardown(void)
 {
         close_journal(journal);
         remove(journal_print_file);
+        remove(journal_print_index_file);
 }
 
 Suite *config_suite(void)
@@ -221,6 +678,24 @@ Suite *config_suite(void)
         t = tcase_create("prunning journal");
         tcase_add_unchecked_fixture(t, NULL, teardown);
         tcase_add_test(t, check_journal_file_prune);
+        tcase_add_test(t, check_journal_ring_wrap);
+        tcase_add_test(t, check_journal_watermark_prune);
+        tcase_add_test(t, check_journal_text_convert);
+        tcase_add_test(t, check_journal_index_lookup);
+        tcase_add_test(t, check_journal_segments);
+        tcase_add_test(t, check_journal_upgrade);
+        suite_add_tcase(s, t);
+
+        t = tcase_create("journal time range");
+        tcase_add_unchecked_fixture(t, NULL, teardown);
+        tcase_add_test(t, check_journal_time_range);
+        tcase_add_test(t, check_journal_group_commit);
+        suite_add_tcase(s, t);
+
+        t = tcase_create("record pack");
+        tcase_add_checked_fixture(t, NULL, pack_teardown);
+        tcase_add_test(t, check_record_pack_dedup);
+        tcase_add_test(t, check_record_pack_compact);
         suite_add_tcase(s, t);
 
         t = tcase_create("print journal");
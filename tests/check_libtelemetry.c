@@ -17,11 +17,18 @@
 #define _GNU_SOURCE
 #include <check.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
 #include "common.h"
+#include "configuration.h"
 #include "telemetry.h"
+#include "validate.h"
 
 static struct telem_ref *ref = NULL;
 static char *original_event_id = NULL;
@@ -98,6 +105,71 @@ void create_teardown(void)
         }
 }
 
+START_TEST(record_create_cached_headers)
+{
+        struct telem_ref *second = NULL;
+        int static_headers[] = { TM_ARCH, TM_HOST_TYPE, TM_SYSTEM_BUILD,
+                                 TM_KERNEL_VERSION, TM_SYSTEM_NAME,
+                                 TM_BOARD_NAME, TM_CPU_MODEL, TM_BIOS_VERSION };
+
+        ck_assert_int_eq(tm_create_record(&second, 1, "t/t/t", 2000), 0);
+
+        for (size_t i = 0; i < sizeof(static_headers) / sizeof(int); i++) {
+                int h = static_headers[i];
+                ck_assert_str_eq(ref->record->headers[h],
+                                 second->record->headers[h]);
+                /* Each record owns its copy of the header */
+                ck_assert_ptr_ne(ref->record->headers[h],
+                                 second->record->headers[h]);
+        }
+        ck_assert_int_eq(ref->record->header_size,
+                         second->record->header_size);
+
+        tm_free_record(second);
+}
+END_TEST
+
+START_TEST(record_reset)
+{
+        struct telem_ref *reused = NULL;
+        char *event_id;
+        size_t size = 0;
+        char *result;
+
+        ck_assert_int_eq(tm_create_record(&reused, 1, "t/t/t", 2000), 0);
+        ck_assert_int_eq(tm_set_payload(reused, "first payload"), 0);
+        event_id = strdup(reused->record->headers[TM_EVENT_ID]);
+        ck_assert_ptr_ne(event_id, NULL);
+
+        ck_assert_int_eq(tm_reset_record(reused, 3, "a/longer/classification", 1), 0);
+        if (asprintf(&result, "%s: %s\n", TM_CLASSIFICATION_STR,
+                     "a/longer/classification") < 0) {
+                return;
+        }
+        ck_assert_str_eq(reused->record->headers[TM_CLASSIFICATION], result);
+        free(result);
+        if (asprintf(&result, "%s: %u\n", TM_SEVERITY_STR, 3) < 0) {
+                return;
+        }
+        ck_assert_str_eq(reused->record->headers[TM_SEVERITY], result);
+        free(result);
+        ck_assert_str_ne(reused->record->headers[TM_EVENT_ID], event_id);
+        free(event_id);
+
+        /* The payload is cleared, and the header size follows the headers */
+        ck_assert_int_eq(reused->record->payload_size, 0);
+        ck_assert_str_eq(reused->record->payload, "");
+        for (int i = 0; i < NUM_HEADERS; i++) {
+                size += strlen(reused->record->headers[i]);
+        }
+        ck_assert_int_eq(reused->record->header_size, size);
+
+        ck_assert_int_eq(tm_reset_record(reused, 1, "no-slashes", 1), -EINVAL);
+
+        tm_free_record(reused);
+}
+END_TEST
+
 START_TEST(record_create_invalid_class1)
 {
         int ret;
@@ -239,6 +311,318 @@ void event_id_teardown(void)
         free(original_event_id);
 }
 
+#define ASYNC_CONFIG ABSTOPSRCDIR "/src/data/example.conf"
+#define ASYNC_PAYLOAD "async payload"
+
+/* Listens on the socket of the test configuration. The test links its own
+ * copy of the configuration, which is pointed at the file the library uses. */
+static int listen_socket(struct sockaddr_un *addr)
+{
+        int sfd;
+
+        ck_assert_int_eq(tm_set_config_file(ASYNC_CONFIG), 0);
+        ck_assert_int_eq(set_config_file(ASYNC_CONFIG), 0);
+
+        sfd = socket(AF_UNIX, SOCK_STREAM, 0);
+        ck_assert(sfd >= 0);
+        memset(addr, 0, sizeof(*addr));
+        addr->sun_family = AF_UNIX;
+        strncpy(addr->sun_path, socket_path_config(), sizeof(addr->sun_path) - 1);
+        unlink(addr->sun_path);
+        ck_assert(bind(sfd, (struct sockaddr *)addr, sizeof(*addr)) == 0);
+        ck_assert(listen(sfd, 4) == 0);
+
+        return sfd;
+}
+
+static void read_exactly(int fd, char *buf, size_t size)
+{
+        while (size > 0) {
+                ssize_t n = read(fd, buf, size);
+
+                ck_assert(n > 0);
+                buf += n;
+                size -= (size_t)n;
+        }
+}
+
+/* Reads the next frame of a connection, which starts with its size */
+static size_t read_frame(int fd, char *buf, size_t size)
+{
+        uint32_t record_size;
+
+        read_exactly(fd, (char *)&record_size, sizeof(record_size));
+        ck_assert(record_size > sizeof(record_size) && record_size <= size);
+        memcpy(buf, &record_size, sizeof(record_size));
+        read_exactly(fd, buf + sizeof(record_size), record_size - sizeof(record_size));
+
+        return record_size;
+}
+
+/* Reads the frame tm_send_record() writes for t_ref, to compare the
+ * asynchronous frames with */
+static size_t read_sync_frame(int sfd, struct telem_ref *t_ref, char *buf, size_t size)
+{
+        size_t frame_size;
+        int cfd;
+
+        ck_assert_int_eq(tm_send_record(t_ref), 0);
+        cfd = accept(sfd, NULL, NULL);
+        ck_assert(cfd >= 0);
+        frame_size = read_frame(cfd, buf, size);
+        close(cfd);
+
+        /* The payload ends the frame, with its null byte */
+        ck_assert(frame_size > sizeof(ASYNC_PAYLOAD));
+        ck_assert(memcmp(buf + frame_size - sizeof(ASYNC_PAYLOAD), ASYNC_PAYLOAD,
+                         sizeof(ASYNC_PAYLOAD)) == 0);
+
+        return frame_size;
+}
+
+START_TEST(record_send_async_flush)
+{
+        struct sockaddr_un addr;
+        struct telem_ref *async_ref = NULL;
+        char expected[4096], frame[4096];
+        size_t expected_size;
+        int sfd, cfd;
+        int ret;
+
+        sfd = listen_socket(&addr);
+
+        ret = tm_create_record(&async_ref, 1, "t/t/t", 1);
+        ck_assert_msg(ret != -ECONNREFUSED,
+                      "Opt-out enabled. Opt in to run this test");
+        ck_assert_int_eq(tm_set_payload(async_ref, ASYNC_PAYLOAD), 0);
+        expected_size = read_sync_frame(sfd, async_ref, expected, sizeof(expected));
+
+        ck_assert_int_eq(tm_send_record_async(async_ref), 0);
+        /* The record was copied, and can be freed before it is sent */
+        tm_free_record(async_ref);
+        ck_assert_int_eq(tm_flush(5000), 0);
+
+        cfd = accept(sfd, NULL, NULL);
+        ck_assert(cfd >= 0);
+        ck_assert_int_eq(read_frame(cfd, frame, sizeof(frame)), expected_size);
+        ck_assert(memcmp(frame, expected, expected_size) == 0);
+
+        close(cfd);
+        close(sfd);
+        unlink(addr.sun_path);
+}
+END_TEST
+
+START_TEST(record_send_async_flush_lost)
+{
+        struct sockaddr_un addr;
+        struct telem_ref *async_ref = NULL;
+        int sfd;
+
+        /* Nobody listens on the socket */
+        sfd = listen_socket(&addr);
+        close(sfd);
+        unlink(addr.sun_path);
+
+        ck_assert_int_eq(tm_create_record(&async_ref, 1, "t/t/t", 1), 0);
+        ck_assert_int_eq(tm_set_payload(async_ref, ASYNC_PAYLOAD), 0);
+        ck_assert_int_eq(tm_send_record_async(async_ref), 0);
+        tm_free_record(async_ref);
+
+        ck_assert_int_lt(tm_flush(5000), 0);
+        /* The loss is reported once */
+        ck_assert_int_eq(tm_flush(5000), 0);
+}
+END_TEST
+
+START_TEST(record_send_async_after_fork)
+{
+        struct sockaddr_un addr;
+        struct telem_ref *async_ref = NULL;
+        char expected[4096], frame[4096];
+        size_t expected_size;
+        int status;
+        pid_t pid;
+        int sfd, cfd;
+
+        sfd = listen_socket(&addr);
+
+        ck_assert_int_eq(tm_create_record(&async_ref, 1, "t/t/t", 1), 0);
+        ck_assert_int_eq(tm_set_payload(async_ref, ASYNC_PAYLOAD), 0);
+        expected_size = read_sync_frame(sfd, async_ref, expected, sizeof(expected));
+        ck_assert_int_eq(tm_send_record_async(async_ref), 0);
+
+        /* The child starts a sender of its own instead of waiting on the
+         * parent's, which does not exist there */
+        pid = fork();
+        ck_assert(pid >= 0);
+        if (pid == 0) {
+                alarm(10);
+                if (tm_send_record_async(async_ref) != 0 || tm_flush(5000) != 0) {
+                        _exit(1);
+                }
+                _exit(0);
+        }
+        ck_assert(waitpid(pid, &status, 0) == pid);
+        ck_assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+        ck_assert_int_eq(tm_flush(5000), 0);
+
+        /* One record from each sender, the child does not send the record
+         * queued by the parent */
+        for (int i = 0; i < 2; i++) {
+                cfd = accept(sfd, NULL, NULL);
+                ck_assert(cfd >= 0);
+                ck_assert_int_eq(read_frame(cfd, frame, sizeof(frame)), expected_size);
+                ck_assert(memcmp(frame, expected, expected_size) == 0);
+                if (i == 0) {
+                        close(cfd);
+                }
+        }
+        /* Both were flushed, nothing follows */
+        ck_assert(fcntl(cfd, F_SETFL, O_NONBLOCK) == 0);
+        ck_assert(read(cfd, frame, 1) <= 0);
+        close(cfd);
+        ck_assert(fcntl(sfd, F_SETFL, O_NONBLOCK) == 0);
+        ck_assert(accept(sfd, NULL, NULL) < 0 && errno == EAGAIN);
+
+        tm_free_record(async_ref);
+        close(sfd);
+        unlink(addr.sun_path);
+}
+END_TEST
+
+START_TEST(record_async_queue_invalid)
+{
+        ck_assert_int_eq(tm_set_async_queue(0, TM_ASYNC_DROP_OLDEST), -EINVAL);
+        ck_assert_int_eq(tm_set_async_queue(8, (enum tm_async_policy)42), -EINVAL);
+        ck_assert_int_eq(tm_set_async_queue(8, TM_ASYNC_DROP_NEWEST), 0);
+}
+END_TEST
+
+START_TEST(record_set_payload_binary)
+{
+        static const char binary[] = { 'a', '\0', 'b', '\n', (char)0xff };
+        struct telem_ref *raw_ref = NULL;
+        char path[] = "/tmp/check_libtelemetry.XXXXXX";
+        char *big;
+        int fd;
+
+        ck_assert_int_eq(tm_set_config_file(ABSTOPSRCDIR "/src/data/example.conf"), 0);
+        ck_assert_int_eq(tm_create_record(&raw_ref, 1, "t/t/t", 1), 0);
+
+        ck_assert_int_eq(tm_set_payload_binary(raw_ref, binary, sizeof(binary)), 0);
+        ck_assert(raw_ref->record->raw_payload);
+        ck_assert_int_eq(raw_ref->record->payload_size, sizeof(binary));
+        ck_assert(memcmp(raw_ref->record->payload, binary, sizeof(binary)) == 0);
+
+        /* Larger than raw_payload_max_size */
+        big = calloc(1, raw_payload_max_size_config() + 1);
+        ck_assert_ptr_ne(big, NULL);
+        ck_assert_int_eq(tm_set_payload_binary(raw_ref, big,
+                                               raw_payload_max_size_config() + 1),
+                         -EINVAL);
+        free(big);
+
+        /* A regular file is sent from its current offset, without a copy */
+        fd = mkstemp(path);
+        ck_assert(fd >= 0);
+        unlink(path);
+        ck_assert(write(fd, "skip-streamed", 13) == 13);
+        ck_assert(lseek(fd, 5, SEEK_SET) == 5);
+        ck_assert_int_eq(tm_set_payload_fd(raw_ref, fd), 0);
+        close(fd);
+        ck_assert(raw_ref->record->raw_payload);
+        ck_assert(raw_ref->record->payload_fd >= 0);
+        ck_assert_int_eq(raw_ref->record->payload_offset, 5);
+        ck_assert_int_eq(raw_ref->record->payload_size, 8);
+
+        /* A text payload drops the file */
+        ck_assert_int_eq(tm_set_payload(raw_ref, "text"), 0);
+        ck_assert(!raw_ref->record->raw_payload);
+        ck_assert_int_eq(raw_ref->record->payload_fd, -1);
+
+        tm_free_record(raw_ref);
+}
+END_TEST
+
+static const char long_category[] =
+        "abcdefghijklmnopqrstuvwxyzabcdefghijklmnopqrstuvwxyz";
+
+START_TEST(validate_payload_all_impls)
+{
+        static const unsigned char invalid[] = { 0x00, 0x08, 0x0e, 0x1f, 0x7f, 0x80, 0xff };
+        static const size_t positions[] = { 0, 15, 16, 31, 32, 63, 998, 999 };
+        char payload[1000];
+
+        for (size_t i = 0; i < sizeof(payload); i++) {
+                payload[i] = i % 80 == 79 ? '\n' : (char)(' ' + i % 95);
+        }
+
+        for (int impl = VALIDATE_IMPL_SCALAR; impl <= VALIDATE_IMPL_NEON; impl++) {
+                if (!validate_use((enum validate_impl)impl)) {
+                        continue;
+                }
+                ck_assert_int_eq(payload_is_ascii(payload, sizeof(payload)), 0);
+                ck_assert_int_eq(payload_is_ascii("\t\v\f\r ~", 6), 0);
+
+                for (size_t p = 0; p < sizeof(positions) / sizeof(positions[0]); p++) {
+                        size_t at = positions[p];
+                        char saved = payload[at];
+
+                        for (size_t b = 0; b < sizeof(invalid); b++) {
+                                payload[at] = (char)invalid[b];
+                                ck_assert_int_eq(payload_is_ascii(payload, sizeof(payload)),
+                                                 -EINVAL);
+                                /* Bytes past the length are not looked at */
+                                ck_assert_int_eq(payload_is_ascii(payload, at), 0);
+                        }
+                        payload[at] = saved;
+                }
+
+                ck_assert_uint_eq(event_id_span("0123456789abcdef0123456789abcdef", 32), 32);
+                ck_assert_uint_eq(event_id_span("0123456789abcdef0123456789abcdeF", 32), 31);
+                ck_assert_uint_eq(event_id_span("0123456789abcdef/123456789abcdef", 32), 16);
+                ck_assert_uint_eq(event_id_span("g", 1), 0);
+                ck_assert_int_eq(validate_event_id("0123456789abcdef0123456789abcdef"), 0);
+                ck_assert_int_eq(validate_event_id("0123456789abcdef0123456789abcde:"), 1);
+                ck_assert_int_eq(validate_event_id("0123456789abcdef"), 1);
+        }
+
+        ck_assert(validate_use(VALIDATE_IMPL_AUTO));
+        ck_assert(!validate_use((enum validate_impl)42));
+}
+END_TEST
+
+/* Validates a classification of categories of the given lengths */
+static int validate_class_of(int first, int second, int third)
+{
+        char class[256];
+
+        snprintf(class, sizeof(class), "%.*s/%.*s/%.*s", first,
+                 long_category, second, long_category, third, long_category);
+
+        return validate_classification(class);
+}
+
+START_TEST(validate_classification_limits)
+{
+        ck_assert_int_eq(validate_classification("a/b/c"), 0);
+        ck_assert_int_eq(validate_classification("//"), 0);
+        ck_assert_int_eq(validate_classification(""), 1);
+        ck_assert_int_eq(validate_classification("a/b"), 1);
+        ck_assert_int_eq(validate_classification("a/b/c/"), 1);
+        ck_assert_int_eq(validate_classification(NULL), 1);
+
+        /* The first category may have one more character than the others */
+        ck_assert_int_eq(validate_class_of(41, 40, 39), 0);
+        ck_assert_int_eq(validate_class_of(42, 1, 1), 1);
+        ck_assert_int_eq(validate_class_of(1, 41, 1), 1);
+        ck_assert_int_eq(validate_class_of(1, 1, 41), 1);
+        /* MAX_CLASS_LENGTH + 1 characters */
+        ck_assert_int_eq(validate_class_of(41, 40, 40), 1);
+}
+END_TEST
+
 Suite *lib_suite(void)
 {
         Suite *s = suite_create("libtelemetry");
@@ -250,6 +634,9 @@ Suite *lib_suite(void)
         tcase_add_test(t, record_create_severity);
         tcase_add_test(t, record_create_classification);
         tcase_add_test(t, record_create_version);
+        tcase_add_test(t, record_create_cached_headers);
+        tcase_add_test(t, record_reset);
+        tcase_add_test(t, record_set_payload_binary);
         suite_add_tcase(s, t);
 
         t = tcase_create("invalid classification");
@@ -271,6 +658,18 @@ Suite *lib_suite(void)
         tcase_add_test(t, record_set_event_id_long);
         suite_add_tcase(s, t);
 
+        t = tcase_create("validation");
+        tcase_add_test(t, validate_payload_all_impls);
+        tcase_add_test(t, validate_classification_limits);
+        suite_add_tcase(s, t);
+
+        t = tcase_create("async send");
+        tcase_add_test(t, record_send_async_flush);
+        tcase_add_test(t, record_send_async_flush_lost);
+        tcase_add_test(t, record_send_async_after_fork);
+        tcase_add_test(t, record_async_queue_invalid);
+        suite_add_tcase(s, t);
+
         return s;
 }
 
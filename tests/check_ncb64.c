@@ -16,10 +16,26 @@
 
 #define OUT_MAX_LEN 100
 
+#include <fcntl.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
 #include <check.h>
 #include "nica/b64enc.h"
 
+#define RANDOM_LEN 10000
+
+static void fill_random(unsigned char *buf, size_t len)
+{
+        unsigned int seed = 1;
+
+        for (size_t i = 0; i < len; i++) {
+                buf[i] = (unsigned char)rand_r(&seed);
+        }
+}
+
 START_TEST(check_nc_b64_no_overflow)
 {
         size_t n = 2;
@@ -146,6 +162,134 @@ START_TEST(check_nc_b64_enc_n_filehandler_foobar)
 }
 END_TEST
 
+START_TEST(check_nc_b64_impls_match_scalar)
+{
+        NcB64Impl impls[] = { NC_B64_IMPL_SSSE3, NC_B64_IMPL_AVX2, NC_B64_IMPL_NEON };
+        size_t out_size = nc_b64enc_len(RANDOM_LEN) + 1;
+        unsigned char *in = malloc(RANDOM_LEN);
+        char *expected = malloc(out_size);
+        char *out = malloc(out_size);
+
+        fill_random(in, RANDOM_LEN);
+        for (size_t i = 0; i < sizeof(impls) / sizeof(impls[0]); i++) {
+                if (!nc_b64enc_use(impls[i])) {
+                        continue;
+                }
+                // Every tail length, and lengths around line ends
+                for (size_t len = 0; len <= RANDOM_LEN; len += len < 400 ? 1 : 997) {
+                        ck_assert(nc_b64enc_use(NC_B64_IMPL_SCALAR));
+                        ck_assert_uint_eq(nc_b64enc(in, len, expected), nc_b64enc_len(len));
+                        ck_assert(nc_b64enc_use(impls[i]));
+                        ck_assert_uint_eq(nc_b64enc(in, len, out), nc_b64enc_len(len));
+                        ck_assert_msg(strcmp(out, expected) == 0, "%s differs at length %zu",
+                                      nc_b64enc_impl_name(), len);
+                }
+        }
+        ck_assert(nc_b64enc_use(NC_B64_IMPL_AUTO));
+
+        free(in);
+        free(expected);
+        free(out);
+}
+END_TEST
+
+START_TEST(check_nc_b64_stream_chunks)
+{
+        size_t chunk_sizes[] = { 1, 2, 5, 57, 100, 4096 };
+        size_t out_size = nc_b64enc_len(RANDOM_LEN) + 1;
+        unsigned char *in = malloc(RANDOM_LEN);
+        char *expected = malloc(out_size);
+        char *out = malloc(out_size);
+        NcB64Encoder enc;
+
+        fill_random(in, RANDOM_LEN);
+        nc_b64enc(in, RANDOM_LEN - 1, expected);
+
+        for (size_t i = 0; i < sizeof(chunk_sizes) / sizeof(chunk_sizes[0]); i++) {
+                size_t used = 0;
+
+                nc_b64enc_init(&enc);
+                for (size_t pos = 0; pos < RANDOM_LEN - 1; pos += chunk_sizes[i]) {
+                        size_t len = RANDOM_LEN - 1 - pos;
+                        size_t n;
+
+                        if (len > chunk_sizes[i]) {
+                                len = chunk_sizes[i];
+                        }
+                        n = nc_b64enc_update_len(&enc, len);
+                        ck_assert_uint_eq(nc_b64enc_update(&enc, in + pos, len, out + used), n);
+                        used += n;
+                }
+                used += nc_b64enc_final(&enc, out + used);
+                ck_assert_uint_eq(used, nc_b64enc_len(RANDOM_LEN - 1));
+                ck_assert_str_eq(out, expected);
+        }
+
+        free(in);
+        free(expected);
+        free(out);
+}
+END_TEST
+
+START_TEST(check_nc_b64_enc_fd_exact_size)
+{
+        const char *filename = TOPSRCDIR "/tests/nc_b64enc_test_files/long_text";
+        struct stat st;
+        size_t n;
+        int fd;
+
+        ck_assert_int_eq(stat(filename, &st), 0);
+        n = nc_b64enc_len((size_t)st.st_size) + 1;
+        char out[n];
+        char expected[n];
+
+        ck_assert(nc_b64enc_filename(filename, expected, n));
+        ck_assert_uint_eq(strlen(expected), n - 1);
+
+        // The output and its NUL termination must fit, and just do
+        fd = open(filename, O_RDONLY);
+        ck_assert_int_ge(fd, 0);
+        ck_assert(!nc_b64enc_fd(fd, out, n - 1));
+        ck_assert_int_eq(lseek(fd, 0, SEEK_SET), 0);
+        ck_assert(nc_b64enc_fd(fd, out, n));
+        ck_assert_str_eq(out, expected);
+        close(fd);
+}
+END_TEST
+
+START_TEST(check_nc_b64_decode)
+{
+        size_t out_size = nc_b64enc_len(RANDOM_LEN) + 1;
+        unsigned char *in = malloc(RANDOM_LEN);
+        unsigned char *decoded = malloc(RANDOM_LEN);
+        char *out = malloc(out_size);
+
+        fill_random(in, RANDOM_LEN);
+        for (size_t len = 0; len < 200; len++) {
+                size_t n = nc_b64enc(in, len, out);
+
+                ck_assert_int_eq(nc_b64dec(out, n, decoded, RANDOM_LEN), (ssize_t)len);
+                ck_assert(memcmp(in, decoded, len) == 0);
+        }
+        ck_assert_int_eq(nc_b64dec(out, nc_b64enc(in, RANDOM_LEN, out),
+                                   decoded, RANDOM_LEN), RANDOM_LEN);
+        ck_assert(memcmp(in, decoded, RANDOM_LEN) == 0);
+        ck_assert_int_eq(nc_b64dec(out, strlen(out), decoded, RANDOM_LEN - 1), -1);
+
+        ck_assert_int_eq(nc_b64dec("Zm9vYmFy", 8, decoded, 6), 6);
+        ck_assert(memcmp(decoded, "foobar", 6) == 0);
+        ck_assert_int_eq(nc_b64dec("Zm8=", 4, decoded, 6), 2);
+        ck_assert_int_eq(nc_b64dec("Zm8", 3, decoded, 6), -1);
+        ck_assert_int_eq(nc_b64dec("Zm8=Zm8=", 8, decoded, 6), -1);
+        ck_assert_int_eq(nc_b64dec("Z===", 4, decoded, 6), -1);
+        ck_assert_int_eq(nc_b64dec("Zm9v!mFy", 8, decoded, 6), -1);
+
+        free(in);
+        free(decoded);
+        free(out);
+}
+END_TEST
+
 Suite *config_suite(void)
 {
         // A suite is comprised of test cases, defined below
@@ -160,6 +304,10 @@ Suite *config_suite(void)
         tcase_add_test(t, check_nc_b64_enc_n_file_foobar);
         tcase_add_test(t, check_nc_b64_enc_n_file_long_text);
         tcase_add_test(t, check_nc_b64_enc_n_filehandler_foobar);
+        tcase_add_test(t, check_nc_b64_impls_match_scalar);
+        tcase_add_test(t, check_nc_b64_stream_chunks);
+        tcase_add_test(t, check_nc_b64_enc_fd_exact_size);
+        tcase_add_test(t, check_nc_b64_decode);
 
         suite_add_tcase(s, t);
 
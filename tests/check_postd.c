@@ -20,19 +20,57 @@
 #include <stdlib.h>
 #include <sys/queue.h>
 #include <unistd.h>
+#include <dirent.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <inttypes.h>
+#include <sys/stat.h>
+#include <zlib.h>
 
 #include "configuration.h"
 #include "telempostdaemon.h"
+#include "staginglog.h"
+#include "ringbuf.h"
+#include "iorecord.h"
+#include "compress.h"
+#include "metrics.h"
+#include "recordtrace.h"
+#include "poststate.h"
+#include "membudget.h"
+#include "sampling.h"
+#include "archive.h"
+#include "recordpack.h"
+#include "recordio.h"
+#include "stagepool.h"
 #include "common.h"
 
 TelemPostDaemon tdaemon;
 
-bool dummy_post(char *headers[], char *body, char *cfg_file)
+bool dummy_post(struct staged_record *record)
 {
         return true;
 }
 
-bool (*post_record_ptr)(char *headers[], char *body, char *cfg_file) = dummy_post;
+bool (*post_record_ptr)(struct staged_record *record) = dummy_post;
+
+int dummy_post_batch(struct post_batch *batch)
+{
+        return post_batch_complete(batch, false, NULL, 0);
+}
+
+int (*post_batch_ptr)(struct post_batch *batch) = dummy_post_batch;
+
+/* Name of the destination dummy_post_destination() fails for, if any */
+static const char *failing_destination = NULL;
+
+bool dummy_post_destination(struct staged_record *record, struct destination *dest)
+{
+        return !failing_destination || strcmp(dest->name, failing_destination) != 0;
+}
+
+bool (*post_destination_ptr)(struct staged_record *record,
+                             struct destination *dest) = dummy_post_destination;
 
 void setup(void)
 {
@@ -106,6 +144,176 @@ START_TEST(check_process_record_with_incorrect_headers)
 }
 END_TEST
 
+START_TEST(check_read_record_headers_in_place)
+{
+        char *filename = ABSTOPSRCDIR "/tests/telempostd/correct_message";
+        struct staged_record record;
+        size_t size;
+
+        ck_assert(read_record(filename, &record));
+        ck_assert(record.cfg_file == NULL);
+        ck_assert_str_eq(record.headers[TM_CLASSIFICATION],
+                         "classification: crash/kernel/bug");
+        ck_assert_str_eq(record.headers[TM_EVENT_ID],
+                         "event_id: 3a2d799826edc6266d72824d2aac6763");
+        ck_assert(strncmp(record.body, "test message", 12) == 0);
+
+        /* Headers point into the record data */
+        ck_assert(record.headers[0] == record.data);
+        ck_assert(record.body > record.headers[NUM_HEADERS - 1]);
+
+        /* The newlines are back once the record is unparsed */
+        size = strlen(record.body) + (size_t)(record.body - record.data);
+        unparse_record(&record);
+        ck_assert(strlen(record.data) == size);
+        ck_assert(strncmp(record.data, "record_format_version: 1\n"
+                          "classification: crash/kernel/bug\n", 58) == 0);
+
+        free_record(&record);
+}
+END_TEST
+
+/* A binary payload large enough to be streamed, starting with the gzip magic */
+#define STREAMED_PAYLOAD_SIZE (TM_STREAM_RECORD_SIZE * 2)
+
+START_TEST(check_read_record_raw_payload)
+{
+        char *headers = "record_format_version: 1\nclassification: crash/kernel/bug\n"
+                        "severity: 1\nmachine_id: 1234\ncreation_timestamp: 1418672344\n"
+                        "arch: x86_64\nhost_type: macbookpro\nbuild: 200\n"
+                        "kernel_version: 3.15\npayload_format_version: 1\n"
+                        "system_name: clear-linux-os\nboard_name: Qemu|Intel\n"
+                        "cpu_model: Intel(R) Core(TM) i7-5650U CPU @ 2.20GHz\n"
+                        "bios_version: Qemu\nevent_id: 3a2d799826edc6266d72824d2aac6763\n";
+        const char *crash_head = RAW_PREFIX "\nclassification: a/crash/b\nseverity: 1\n";
+        char filename[] = "/tmp/check_raw_record.XXXXXX";
+        struct staged_record record = { 0 };
+        char *payload, *data, *out = NULL;
+        size_t out_size, size;
+        int fd;
+
+        payload = malloc(STREAMED_PAYLOAD_SIZE);
+        for (size_t i = 0; i < STREAMED_PAYLOAD_SIZE; i++) {
+                payload[i] = (char)(i * 13);
+        }
+        payload[0] = (char)0x1f;
+        payload[1] = (char)0x8b;
+
+        fd = mkstemp(filename);
+        ck_assert(fd >= 0);
+        ck_assert(write(fd, RAW_PREFIX "\n", RAW_PREFIX_LENGTH + 1) == RAW_PREFIX_LENGTH + 1);
+        ck_assert(write(fd, headers, strlen(headers)) == (ssize_t)strlen(headers));
+        ck_assert(write(fd, payload, STREAMED_PAYLOAD_SIZE) == STREAMED_PAYLOAD_SIZE);
+        close(fd);
+
+        /* The payload stays in the file */
+        ck_assert(read_record(filename, &record));
+        ck_assert(record.raw && record.streamed && !record.compressed);
+        ck_assert(record.body == NULL);
+        ck_assert(record.body_size == STREAMED_PAYLOAD_SIZE);
+        ck_assert_str_eq(record.headers[TM_CLASSIFICATION],
+                         "classification: crash/kernel/bug");
+        data = malloc(STREAMED_PAYLOAD_SIZE);
+        ck_assert(pread(record.body_fd, data, STREAMED_PAYLOAD_SIZE, record.body_offset) ==
+                  STREAMED_PAYLOAD_SIZE);
+        ck_assert(memcmp(data, payload, STREAMED_PAYLOAD_SIZE) == 0);
+        ck_assert(record_data_priority(crash_head, strlen(crash_head)) ==
+                  TM_PRIORITY_CLASSES - 1);
+        free_record(&record);
+        ck_assert(!record.streamed);
+
+        /* Small binary payloads are read, but never compressed in the spool */
+        size = (size_t)snprintf(data, STREAMED_PAYLOAD_SIZE, "%s\n%s", RAW_PREFIX, headers);
+        memcpy(data + size, payload, 100);
+        size += 100;
+        ck_assert(compress_record(data, size, &out, &out_size) == -EOPNOTSUPP);
+        ck_assert(parse_record(data, size, &record));
+        ck_assert(record.raw && !record.streamed && !record.compressed);
+        ck_assert(record.body_size == 100);
+        ck_assert(memcmp(record.body, payload, 100) == 0);
+
+        unlink(filename);
+        free(data);
+        free(payload);
+}
+END_TEST
+
+START_TEST(check_record_trace_in_place)
+{
+        char *headers = "record_format_version: 1\nclassification: org/trace/test\n"
+                        "severity: 1\nmachine_id: 1234\ncreation_timestamp: 1418672344\n"
+                        "arch: x86_64\nhost_type: macbookpro\nbuild: 200\n"
+                        "kernel_version: 3.15\npayload_format_version: 1\n"
+                        "system_name: clear-linux-os\nboard_name: Qemu|Intel\n"
+                        "cpu_model: Intel(R) Core(TM) i7-5650U CPU @ 2.20GHz\n"
+                        "bios_version: Qemu\nevent_id: 3a2d799826edc6266d72824d2aac6763\n";
+        char filename[] = "/tmp/check_trace_record.XXXXXX";
+        struct record_trace trace = { 0 };
+        struct staged_record record = { 0 };
+        char line[TRACE_LINE_LENGTH];
+        struct stat buf, buf2;
+        struct timespec times[2];
+        char *data, *out = NULL;
+        size_t out_size, size;
+        int fd;
+
+        trace.times[TRACE_SEND] = 1000001;
+        trace.times[TRACE_RECEIVED] = 1000002;
+        trace.times[TRACE_STAGED] = 1000003;
+        trace_format(&trace, line);
+
+        fd = mkstemp(filename);
+        ck_assert(fd >= 0);
+        ck_assert(write(fd, RAW_PREFIX "\n", RAW_PREFIX_LENGTH + 1) == RAW_PREFIX_LENGTH + 1);
+        ck_assert(write(fd, line, sizeof(line)) == sizeof(line));
+        ck_assert(write(fd, "\n", 1) == 1);
+        ck_assert(write(fd, headers, strlen(headers)) == (ssize_t)strlen(headers));
+        ck_assert(write(fd, "payload", 7) == 7);
+        times[0].tv_sec = times[1].tv_sec = 1418672344;
+        times[0].tv_nsec = times[1].tv_nsec = 0;
+        ck_assert(futimens(fd, times) == 0);
+        close(fd);
+
+        /* The TRACE line is not part of the record */
+        ck_assert(read_record(filename, &record));
+        ck_assert(record.trace.present);
+        ck_assert(record.trace.offset == RAW_PREFIX_LENGTH + 1);
+        ck_assert(record.trace.times[TRACE_STAGED] == 1000003);
+        ck_assert(record.trace.times[TRACE_PICKED] == 0);
+        ck_assert_str_eq(record.headers[TM_CLASSIFICATION],
+                         "classification: org/trace/test");
+        ck_assert(record.body_size == 7 && memcmp(record.body, "payload", 7) == 0);
+
+        /* Retries are counted in the record file */
+        trace_stamp(&record.trace, TRACE_STAGED, 2000000);
+        ck_assert(record.trace.times[TRACE_STAGED] == 1000003);
+        ck_assert(stat(filename, &buf) == 0);
+        trace_retry(&record.trace, filename);
+        free_record(&record);
+        ck_assert(stat(filename, &buf2) == 0);
+        ck_assert(buf.st_mtime == buf2.st_mtime);
+        ck_assert(read_record(filename, &record));
+        ck_assert(record.trace.retries == 1);
+        ck_assert(record.trace.times[TRACE_RETRIED] != 0);
+        ck_assert(record.trace.times[TRACE_SEND] == 1000001);
+        free_record(&record);
+
+        /* And found in the compressed copy of a spooled record */
+        size = (size_t)asprintf(&data, "%.*s\n%s%s", TRACE_LINE_LENGTH, line, headers,
+                                "payload");
+        trace_stamp_data(data, size, TRACE_SPOOLED, 1000005);
+        ck_assert(compress_record(data, size, &out, &out_size) == 0);
+        ck_assert(trace_find(out, out_size, &trace));
+        ck_assert(trace.offset == 0);
+        ck_assert(trace.times[TRACE_SPOOLED] == 1000005);
+        ck_assert(!trace_find(headers, strlen(headers), &trace));
+
+        unlink(filename);
+        free(data);
+        free(out);
+}
+END_TEST
+
 START_TEST(check_rate_limit_enabled_functions)
 {
         setup();
@@ -389,6 +597,1314 @@ START_TEST(check_strategy_if_record_sent)
 }
 END_TEST
 
+static void count_log_record(char *data, size_t size, time_t timestamp, void *arg)
+{
+        int *count = (int *)arg;
+
+        ck_assert(size == strlen(data));
+        ck_assert(data[0] == 'r');
+        (*count)++;
+}
+
+static int count_log_segments(void)
+{
+        char *dir = staging_log_dir();
+        struct dirent *entry;
+        DIR *d;
+        int count = 0;
+
+        d = opendir(dir);
+        ck_assert(d != NULL);
+        while ((entry = readdir(d)) != NULL) {
+                if (strncmp(entry->d_name, STAGING_LOG_SEGMENT_PREFIX,
+                            strlen(STAGING_LOG_SEGMENT_PREFIX)) == 0) {
+                        count++;
+                }
+        }
+        closedir(d);
+        free(dir);
+
+        return count;
+}
+
+START_TEST(check_staging_log_append_and_drain)
+{
+        char record[32 * 1024];
+        int count = 0;
+
+        set_config_file(ABSTOPSRCDIR "/src/data/example.conf");
+
+        /* Read what previous runs left behind */
+        ck_assert(staging_log_drain(count_log_record, &count) >= 0);
+
+        memset(record, 'r', sizeof(record) - 1);
+        record[sizeof(record) - 1] = '\0';
+
+        /* Enough records to fill more than one segment */
+        for (int i = 0; i < 40; i++) {
+                ck_assert(staging_log_append(record, sizeof(record) - 1) == 0);
+        }
+        staging_log_close();
+        ck_assert(count_log_segments() > 1);
+
+        count = 0;
+        ck_assert(staging_log_drain(count_log_record, &count) == 40);
+        ck_assert(count == 40);
+
+        /* Sealed segments are removed, only the last one is left */
+        ck_assert(count_log_segments() == 1);
+
+        /* The cursor keeps records from being read twice */
+        count = 0;
+        ck_assert(staging_log_drain(count_log_record, &count) == 0);
+        ck_assert(count == 0);
+}
+END_TEST
+
+/* Path of the newest segment of the staging log */
+static char *newest_log_segment(void)
+{
+        char *dir = staging_log_dir();
+        char newest[NAME_MAX + 1] = "";
+        char *path = NULL;
+        struct dirent *entry;
+        DIR *d;
+
+        d = opendir(dir);
+        ck_assert(d != NULL);
+        while ((entry = readdir(d)) != NULL) {
+                if (strncmp(entry->d_name, STAGING_LOG_SEGMENT_PREFIX,
+                            strlen(STAGING_LOG_SEGMENT_PREFIX)) == 0 &&
+                    strcmp(entry->d_name, newest) > 0) {
+                        strcpy(newest, entry->d_name);
+                }
+        }
+        closedir(d);
+        ck_assert(newest[0] != '\0');
+        ck_assert(asprintf(&path, "%s/%s", dir, newest) > 0);
+        free(dir);
+
+        return path;
+}
+
+START_TEST(check_staging_log_skips_corrupt_records)
+{
+        struct staging_log_frame frame = { STAGING_LOG_MAGIC, 6, 1000 };
+        uint32_t commit = STAGING_LOG_COMMIT;
+        char *path, *next;
+        struct stat sb;
+        uint64_t corrupt;
+        uint64_t seq;
+        int count = 0;
+        FILE *fp;
+        int fd;
+
+        set_config_file(ABSTOPSRCDIR "/src/data/example.conf");
+        ck_assert(staging_log_drain(count_log_record, &count) >= 0);
+        corrupt = metrics_counter_value(metrics_page(), METRIC_POSTD_STAGING_CORRUPT);
+
+        /* Garbage between the records of the segment being written */
+        ck_assert(staging_log_append("record", 6) == 0);
+        path = newest_log_segment();
+        fd = open(path, O_WRONLY | O_APPEND);
+        ck_assert(fd >= 0);
+        ck_assert(write(fd, "garbage", 7) == 7);
+        close(fd);
+        ck_assert(staging_log_append("record", 6) == 0);
+        ck_assert(staging_log_append("record", 6) == 0);
+
+        count = 0;
+        ck_assert_int_eq(staging_log_drain(count_log_record, &count), 3);
+        ck_assert_int_eq(metrics_counter_value(metrics_page(),
+                                               METRIC_POSTD_STAGING_CORRUPT), corrupt + 1);
+
+        /* Reported once, the records after it are read */
+        ck_assert(staging_log_append("record", 6) == 0);
+        count = 0;
+        ck_assert_int_eq(staging_log_drain(count_log_record, &count), 1);
+        ck_assert_int_eq(metrics_counter_value(metrics_page(),
+                                               METRIC_POSTD_STAGING_CORRUPT), corrupt + 1);
+
+        /* A sealed segment that cannot be opened is kept, and read later */
+        staging_log_close();
+        ck_assert(sscanf(strrchr(path, '.') + 1, "%" SCNx64, &seq) == 1);
+        next = strdup(path);
+        ck_assert(next != NULL);
+        snprintf(strrchr(next, '.') + 1, 17, "%016" PRIx64, seq + 1);
+        ck_assert(symlink(next, next) == 0);
+        ck_assert(staging_log_append("record", 6) == 0);
+        staging_log_close();
+
+        count = 0;
+        ck_assert_int_eq(staging_log_drain(count_log_record, &count), 0);
+        ck_assert(lstat(next, &sb) == 0);
+
+        unlink(next);
+        fp = fopen(next, "w");
+        ck_assert(fp != NULL);
+        fwrite(&frame, sizeof(frame), 1, fp);
+        fputs("record", fp);
+        fwrite(&commit, sizeof(commit), 1, fp);
+        fclose(fp);
+        count = 0;
+        ck_assert_int_eq(staging_log_drain(count_log_record, &count), 2);
+        ck_assert(access(next, F_OK) != 0);
+
+        free(next);
+        free(path);
+}
+END_TEST
+
+START_TEST(check_staging_log_sets_aside_unreadable_segments)
+{
+        char *path, *next, *failed = NULL;
+        struct stat sb;
+        uint64_t set_aside;
+        uint64_t seq;
+        int count = 0;
+
+        set_config_file(ABSTOPSRCDIR "/src/data/example.conf");
+        ck_assert(staging_log_drain(count_log_record, &count) >= 0);
+        set_aside = metrics_counter_value(metrics_page(), METRIC_POSTD_STAGING_FAILED);
+
+        /* A segment that cannot be opened between two others */
+        ck_assert(staging_log_append("record", 6) == 0);
+        staging_log_close();
+        path = newest_log_segment();
+        ck_assert(sscanf(strrchr(path, '.') + 1, "%" SCNx64, &seq) == 1);
+        next = strdup(path);
+        ck_assert(next != NULL);
+        snprintf(strrchr(next, '.') + 1, 17, "%016" PRIx64, seq + 1);
+        ck_assert(symlink(next, next) == 0);
+        ck_assert(asprintf(&failed, "%s%s", next, STAGING_LOG_FAILED_SUFFIX) > 0);
+        ck_assert(staging_log_append("record", 6) == 0);
+        staging_log_close();
+
+        /* It is read again by the next drains, the records after it wait */
+        count = 0;
+        ck_assert_int_eq(staging_log_drain(count_log_record, &count), 1);
+        for (int i = 1; i < STAGING_LOG_MAX_FAILURES - 1; i++) {
+                ck_assert_int_eq(staging_log_drain(count_log_record, &count), 0);
+                ck_assert(lstat(next, &sb) == 0);
+        }
+
+        /* Until it is set aside, and the drain goes on past it */
+        ck_assert_int_eq(staging_log_drain(count_log_record, &count), 1);
+        ck_assert(lstat(next, &sb) != 0);
+        ck_assert(lstat(failed, &sb) == 0 && S_ISLNK(sb.st_mode));
+        ck_assert_int_eq(metrics_counter_value(metrics_page(),
+                                               METRIC_POSTD_STAGING_FAILED), set_aside + 1);
+        ck_assert_int_eq(staging_log_drain(count_log_record, &count), 0);
+
+        unlink(failed);
+        free(failed);
+        free(next);
+        free(path);
+}
+END_TEST
+
+START_TEST(check_record_ring_push_and_drain)
+{
+        struct tm_ring ring;
+        char record[1000];
+        int count = 0;
+        int pushed = 0;
+
+        ring_init(&ring);
+        ck_assert(ring_create(&ring, 32 * 1024) == 0);
+
+        memset(record, 'r', sizeof(record) - 1);
+        record[sizeof(record) - 1] = '\0';
+
+        /* Fill the ring until it reports it is full */
+        while (ring_push(&ring, record, sizeof(record) - 1) == 0) {
+                pushed++;
+        }
+        ck_assert(pushed > 0);
+        ck_assert(ring_push(&ring, record, sizeof(record) - 1) == -ENOBUFS);
+
+        ck_assert(ring_drain(&ring, count_log_record, &count) == pushed);
+        ck_assert(count == pushed);
+
+        /* Records keep going through once the ring wraps around */
+        count = 0;
+        for (int i = 0; i < 3 * pushed; i++) {
+                ck_assert(ring_push(&ring, record, sizeof(record) - 1) == 0);
+                ck_assert(ring_drain(&ring, count_log_record, &count) == 1);
+        }
+        ck_assert(count == 3 * pushed);
+
+        /* A record that would take more than half of the ring is refused */
+        ck_assert(ring_push(&ring, record, 16 * 1024) == -EMSGSIZE);
+
+        ring_destroy(&ring);
+}
+END_TEST
+
+static void record_batch_status(bool sent, void *arg)
+{
+        *(int *)arg = sent ? 1 : 0;
+}
+
+START_TEST(check_post_batch_framing_and_status)
+{
+        struct post_batch batch;
+        char header_data[NUM_HEADERS][16];
+        struct staged_record records[3] = { { 0 } };
+        char *bodies[3] = { "hello", "hi", "bye" };
+        char *response = "201\n500\n";
+        int status[3] = { -1, -1, -1 };
+
+        for (int i = 0; i < NUM_HEADERS; i++) {
+                snprintf(header_data[i], sizeof(header_data[i]), "h%d: v%d", i, i);
+                for (int j = 0; j < 3; j++) {
+                        records[j].headers[i] = header_data[i];
+                }
+        }
+        for (int j = 0; j < 3; j++) {
+                records[j].body = bodies[j];
+                records[j].body_size = strlen(bodies[j]);
+        }
+
+        post_batch_init(&batch, 3, 64 * 1024, 60 * 1000);
+        ck_assert(post_batch_add(&batch, &records[0], record_batch_status, &status[0]) == 0);
+        ck_assert(post_batch_add(&batch, &records[1], record_batch_status, &status[1]) == 0);
+        ck_assert(!post_batch_full(&batch));
+        ck_assert(post_batch_add(&batch, &records[2], record_batch_status, &status[2]) == 0);
+        ck_assert(post_batch_full(&batch));
+
+        /* Each record is its headers, its payload length and its payload */
+        ck_assert(strncmp(batch.body, "h0: v0\nh1: v1\n", 14) == 0);
+        ck_assert(strstr(batch.body, "h14: v14\nContent-Length: 5\n\nhello\nh0: v0\n") != NULL);
+        ck_assert(strlen(batch.body) == batch.size);
+
+        /* The third record has no status line, it was not sent */
+        ck_assert(post_batch_complete(&batch, true, response, strlen(response)) == 1);
+        ck_assert(status[0] == 1);
+        ck_assert(status[1] == 0);
+        ck_assert(status[2] == 0);
+        ck_assert(batch.count == 0);
+        ck_assert(batch.size == 0);
+
+        /* A record always fits in an empty batch, but not after another one */
+        post_batch_free(&batch);
+        post_batch_init(&batch, 3, 64, 60 * 1000);
+        ck_assert(post_batch_add(&batch, &records[0], record_batch_status, &status[0]) == 0);
+        ck_assert(post_batch_add(&batch, &records[0], record_batch_status, &status[1]) == -ENOSPC);
+        ck_assert(post_batch_full(&batch));
+
+        /* Nothing is sent if the server refused the request */
+        status[0] = -1;
+        ck_assert(post_batch_complete(&batch, false, response, strlen(response)) == 0);
+        ck_assert(status[0] == 0);
+        post_batch_free(&batch);
+}
+END_TEST
+
+START_TEST(check_compress_record)
+{
+        char *filename = ABSTOPSRCDIR "/tests/telempostd/correct_message";
+        struct staged_record record;
+        struct staged_record compressed = { 0 };
+        char *out = NULL;
+        char *again = NULL;
+        size_t out_size, again_size, size, header_size;
+        char payload[64];
+        z_stream stream;
+
+        ck_assert(read_record(filename, &record));
+        header_size = (size_t)(record.body - record.data);
+        size = header_size + record.body_size;
+        unparse_record(&record);
+
+        ck_assert(compress_record(record.data, size, &out, &out_size) == 0);
+
+        /* The headers are kept as they are, the payload is gzip */
+        ck_assert(strncmp(out, record.data, header_size) == 0);
+        ck_assert(parse_record(out, out_size, &compressed));
+        ck_assert(compressed.compressed);
+        ck_assert_str_eq(compressed.headers[TM_CLASSIFICATION],
+                         "classification: crash/kernel/bug");
+
+        memset(&stream, 0, sizeof(stream));
+        ck_assert(inflateInit2(&stream, 15 + 16) == Z_OK);
+        stream.next_in = (Bytef *)compressed.body;
+        stream.avail_in = (uInt)compressed.body_size;
+        stream.next_out = (Bytef *)payload;
+        stream.avail_out = sizeof(payload);
+        ck_assert(inflate(&stream, Z_FINISH) == Z_STREAM_END);
+        ck_assert(stream.total_out == record.body_size);
+        ck_assert(strncmp(payload, record.body, record.body_size) == 0);
+        inflateEnd(&stream);
+
+        /* A compressed record is not compressed twice */
+        unparse_record(&compressed);
+        ck_assert(compress_record(out, out_size, &again, &again_size) == -EALREADY);
+        ck_assert(again == NULL);
+
+        free(out);
+        free_record(&record);
+}
+END_TEST
+
+START_TEST(check_spool_index_order)
+{
+        struct spool_index index;
+        struct spool_entry entry;
+        struct spool_entry first;
+        char dir[] = "/tmp/check_spool.XXXXXX";
+        char path[PATH_MAX];
+        FILE *fp;
+
+        spool_index_init(&index);
+        spool_index_add(&index, "/spool/c", 30, 4096, 0);
+        spool_index_add(&index, "/spool/a", 10, 4096, 0);
+        spool_index_add(&index, "/spool/b1", 20, 4096, 0);
+        spool_index_add(&index, "/spool/b2", 20, 4096, 0);
+        ck_assert(index.count == 4);
+
+        /* Oldest first, in the order they were added for the same time */
+        ck_assert(spool_index_pop(&index, &first));
+        ck_assert_str_eq(first.name, "a");
+        ck_assert(spool_index_pop(&index, &entry));
+        ck_assert_str_eq(entry.name, "b1");
+
+        /* Records put back keep their place */
+        spool_index_push(&index, &entry);
+        spool_index_push(&index, &first);
+        ck_assert(spool_index_pop(&index, &entry));
+        ck_assert_str_eq(entry.name, "a");
+        free(entry.name);
+        ck_assert(spool_index_pop(&index, &entry));
+        ck_assert_str_eq(entry.name, "b1");
+        free(entry.name);
+        ck_assert(spool_index_pop(&index, &entry));
+        ck_assert_str_eq(entry.name, "b2");
+        free(entry.name);
+        ck_assert(spool_index_pop(&index, &entry));
+        ck_assert_str_eq(entry.name, "c");
+        free(entry.name);
+        ck_assert(!spool_index_pop(&index, &entry));
+
+        /* Rebuilding indexes the records, not the hidden directories */
+        ck_assert(mkdtemp(dir) != NULL);
+        snprintf(path, sizeof(path), "%s/record", dir);
+        fp = fopen(path, "w");
+        ck_assert(fp != NULL);
+        fclose(fp);
+        snprintf(path, sizeof(path), "%s/.staging", dir);
+        ck_assert(mkdir(path, S_IRWXU) == 0);
+
+        spool_index_add(&index, "/spool/stale", 10, 4096, 0);
+        ck_assert(spool_index_rebuild(&index, dir) == 1);
+        ck_assert(spool_index_pop(&index, &entry));
+        ck_assert_str_eq(entry.name, "record");
+        free(entry.name);
+        spool_index_free(&index);
+
+        rmdir(path);
+        snprintf(path, sizeof(path), "%s/record", dir);
+        unlink(path);
+        rmdir(dir);
+}
+END_TEST
+
+/* Creates an empty record file in a spool directory */
+static void touch_record(const char *dir, const char *name)
+{
+        char path[PATH_MAX];
+        FILE *fp;
+
+        snprintf(path, sizeof(path), "%s/%s", dir, name);
+        fp = fopen(path, "w");
+        ck_assert(fp != NULL);
+        fclose(fp);
+}
+
+START_TEST(check_spool_usage)
+{
+        struct spool_usage usage;
+        char dir[] = "/tmp/check_usage_spool.XXXXXX";
+        char path[PATH_MAX];
+        char data[5000] = { 0 };
+        struct stat buf;
+        FILE *fp;
+
+        ck_assert(mkdtemp(dir) != NULL);
+        snprintf(path, sizeof(path), "%s/record", dir);
+        fp = fopen(path, "w");
+        ck_assert(fp != NULL);
+        ck_assert(fwrite(data, 1, sizeof(data), fp) == sizeof(data));
+        fclose(fp);
+        ck_assert(stat(path, &buf) == 0);
+        for (int i = 0; i < TM_SPOOL_USAGE_SCAN_STEP; i++) {
+                char name[16];
+
+                snprintf(name, sizeof(name), "empty%d", i);
+                touch_record(dir, name);
+        }
+
+        /* Not due, and counted as records come and go */
+        spool_usage_init(&usage, 0);
+        ck_assert(!spool_usage_scan_step(&usage, dir));
+        spool_usage_add(&usage, 8192);
+        spool_usage_remove(&usage, 4096);
+        ck_assert(usage.bytes == 4096);
+        ck_assert(!usage.scan_wanted);
+
+        /* Removing more than was counted asks the directory */
+        spool_usage_remove(&usage, 8192);
+        ck_assert(usage.bytes == 0);
+        ck_assert(usage.scan_wanted);
+
+        /* A record added during the scan makes it start over */
+        ck_assert(!spool_usage_scan_step(&usage, dir));
+        ck_assert_ptr_ne(usage.scan, NULL);
+        spool_usage_add(&usage, 0);
+        ck_assert(!spool_usage_scan_step(&usage, dir));
+        ck_assert_ptr_eq(usage.scan, NULL);
+        ck_assert(usage.scan_wanted);
+
+        while (!spool_usage_scan_step(&usage, dir)) {
+                ck_assert(usage.scan_wanted);
+        }
+        ck_assert(usage.bytes == buf.st_blocks * 512);
+        ck_assert(!usage.scan_wanted);
+        spool_usage_free(&usage);
+
+        for (int i = 0; i < TM_SPOOL_USAGE_SCAN_STEP; i++) {
+                snprintf(path, sizeof(path), "%s/empty%d", dir, i);
+                unlink(path);
+        }
+        snprintf(path, sizeof(path), "%s/record", dir);
+        unlink(path);
+        rmdir(dir);
+}
+END_TEST
+
+START_TEST(check_post_state_warm_start)
+{
+        static TelemPostDaemon daemon;
+        char dir[] = "/tmp/check_state_spool.XXXXXX";
+        char state[] = "/tmp/check_state.XXXXXX";
+        char path[PATH_MAX];
+        struct spool_entry entry;
+        time_t now = time(NULL);
+        struct tm tm;
+        int fd;
+
+        ck_assert(mkdtemp(dir) != NULL);
+        fd = mkstemp(state);
+        ck_assert(fd >= 0);
+        close(fd);
+        touch_record(dir, "a");
+        touch_record(dir, "b");
+        touch_record(dir, "c");
+
+        spool_index_init(&daemon.spool_index);
+        spool_index_init(&daemon.unindexed);
+        retry_sched_init(&daemon.retry_sched, 1, 1, 100);
+        ck_assert(spool_index_rebuild(&daemon.spool_index, dir) == 3);
+        localtime_r(&now, &tm);
+        daemon.record_burst_array[tm.tm_min] = 5;
+        retry_sched_failure(&daemon.retry_sched, now);
+        spool_usage_init(&daemon.spool_usage, 4096);
+        ck_assert(post_state_save(&daemon, state, dir) == 0);
+
+        /* The next run starts with the same state */
+        spool_index_free(&daemon.spool_index);
+        memset(daemon.record_burst_array, 0, sizeof(daemon.record_burst_array));
+        retry_sched_init(&daemon.retry_sched, 1, 1, 100);
+        spool_usage_init(&daemon.spool_usage, -1);
+        ck_assert(post_state_load(&daemon, state, dir));
+        ck_assert(access(state, F_OK) != 0);
+        ck_assert(daemon.spool_index.count == 3);
+        ck_assert(daemon.unindexed.count == 0);
+        ck_assert(daemon.spool_usage.bytes == 4096);
+        ck_assert(daemon.record_burst_array[tm.tm_min] == 5);
+        ck_assert(daemon.retry_sched.state == RETRY_OPEN);
+        ck_assert(daemon.retry_sched.failures == 1);
+
+        /* Records added to and removed from the spool meanwhile */
+        ck_assert(post_state_save(&daemon, state, dir) == 0);
+        snprintf(path, sizeof(path), "%s/a", dir);
+        unlink(path);
+        touch_record(dir, "d");
+        ck_assert(post_state_load(&daemon, state, dir));
+        ck_assert(daemon.spool_index.count == 2);
+        ck_assert(spool_index_pop(&daemon.spool_index, &entry));
+        ck_assert_str_eq(entry.name, "b");
+        free(entry.name);
+        ck_assert(daemon.unindexed.count == 1);
+        ck_assert_str_eq(daemon.unindexed.entries[0].name, "d");
+        /* Only the records still indexed are counted, all empty */
+        ck_assert(daemon.spool_usage.bytes == 0);
+
+        /* The state is read once, and never for another spool */
+        ck_assert(!post_state_load(&daemon, state, dir));
+        ck_assert(post_state_save(&daemon, state, dir) == 0);
+        ck_assert(!post_state_load(&daemon, state, "/tmp"));
+        ck_assert(daemon.spool_index.count == 1);
+
+        spool_index_free(&daemon.spool_index);
+        spool_index_free(&daemon.unindexed);
+        for (const char *name = "bcd"; *name; name++) {
+                snprintf(path, sizeof(path), "%s/%c", dir, *name);
+                unlink(path);
+        }
+        rmdir(dir);
+}
+END_TEST
+
+START_TEST(check_retry_sched_breaker)
+{
+        struct retry_sched sched;
+        time_t now = 1000;
+
+        retry_sched_init(&sched, 1, 1, 1000);
+        ck_assert(retry_sched_allow(&sched, now));
+        ck_assert(retry_sched_pass_limit(&sched, now) == TM_SPOOL_MAX_SEND_RECORDS);
+
+        /* A failure opens the breaker for half to all of the base delay */
+        retry_sched_failure(&sched, now);
+        ck_assert(sched.state == RETRY_OPEN);
+        ck_assert(sched.retry_at >= now + TM_RETRY_BASE_DELAY / 2);
+        ck_assert(sched.retry_at <= now + TM_RETRY_BASE_DELAY);
+        ck_assert(!retry_sched_allow(&sched, now));
+        ck_assert(retry_sched_pass_limit(&sched, now) == 0);
+        ck_assert(retry_sched_next_pass(&sched, now, 600, true) == sched.retry_at);
+
+        /* Failures of POSTs started earlier do not extend the delay */
+        retry_sched_failure(&sched, now + 1);
+        ck_assert(sched.failures == 1);
+
+        /* Once due, a single record probes the server */
+        now = sched.retry_at;
+        ck_assert(retry_sched_pass_limit(&sched, now) == 1);
+        ck_assert(sched.state == RETRY_HALF_OPEN);
+        ck_assert(!retry_sched_allow(&sched, now));
+
+        /* The delay doubles with every failed probe, up to the maximum */
+        for (int i = 2; i <= 10; i++) {
+                int delay = TM_RETRY_BASE_DELAY << (i - 1);
+
+                if (delay > TM_RETRY_MAX_DELAY) {
+                        delay = TM_RETRY_MAX_DELAY;
+                }
+                retry_sched_failure(&sched, now);
+                ck_assert(sched.failures == i);
+                ck_assert(sched.retry_at >= now + delay / 2);
+                ck_assert(sched.retry_at <= now + delay);
+                now = sched.retry_at;
+                ck_assert(retry_sched_allow(&sched, now));
+        }
+
+        /* A probe let through but not sent can be sent by another record */
+        retry_sched_cancel(&sched);
+        ck_assert(retry_sched_allow(&sched, now));
+
+        /* The probe closes the breaker, and the drain limit ramps up */
+        retry_sched_success(&sched);
+        ck_assert(sched.state == RETRY_CLOSED);
+        ck_assert(sched.failures == 0);
+        ck_assert(retry_sched_pass_limit(&sched, now) == 1);
+        ck_assert(retry_sched_next_pass(&sched, now, 600, true) ==
+                  now + sched.ramp_interval);
+        ck_assert(sched.ramp_interval <= TM_RETRY_RAMP_INTERVAL);
+        ck_assert(retry_sched_next_pass(&sched, now, 600, false) == now + 600);
+
+        /* Passes that send their whole limit double it, up to the maximum */
+        for (int limit = 1; limit < 1000; limit *= 2) {
+                ck_assert(retry_sched_pass_limit(&sched, now) == limit);
+                retry_sched_pass_done(&sched, limit, limit, 10 * limit);
+        }
+        ck_assert(retry_sched_pass_limit(&sched, now) == 1000);
+        retry_sched_pass_done(&sched, 1000, 1000, 1000);
+        ck_assert(retry_sched_pass_limit(&sched, now) == 1000);
+        ck_assert(retry_sched_next_pass(&sched, now, 600, true) ==
+                  now + sched.ramp_interval);
+
+        /* Slow POSTs halve it, down to the minimum */
+        retry_sched_pass_done(&sched, 1000, 10, 10 * (TM_RETRY_SLOW_POST + 1));
+        ck_assert(retry_sched_pass_limit(&sched, now) == 500);
+        for (int i = 0; i < 20; i++) {
+                retry_sched_pass_done(&sched, 500, 1, TM_RETRY_SLOW_POST + 1);
+        }
+        ck_assert(retry_sched_pass_limit(&sched, now) == 1);
+
+        /* A pass that emptied the spool keeps the limit and the interval */
+        retry_sched_pass_done(&sched, 1, 0, 0);
+        ck_assert(retry_sched_pass_limit(&sched, now) == 1);
+        ck_assert(retry_sched_next_pass(&sched, now, 600, true) == now + 600);
+
+        /* The initial limit is within the bounds */
+        retry_sched_init(&sched, 1, 100, 200);
+        ck_assert(retry_sched_pass_limit(&sched, now) == 100);
+        retry_sched_init(&sched, 1, 1, 20);
+        ck_assert(retry_sched_pass_limit(&sched, now) == 20);
+}
+END_TEST
+
+START_TEST(check_class_limits_buckets)
+{
+        struct class_limits limits;
+        const char *journal = "org.clearlinux/journal/error";
+        const char *crash = "org.clearlinux/crash/clr";
+        const char *other = "org.clearlinux/journalx/error";
+
+        ck_assert(class_limits_init(&limits, "") == 0);
+        ck_assert(class_limits_take(&limits, journal, strlen(journal), 0));
+        ck_assert(class_limits_init(&limits, "org.clearlinux/journal") == -EINVAL);
+        ck_assert(class_limits_init(&limits, "org.clearlinux:0") == -EINVAL);
+        ck_assert(class_limits_init(&limits, "org.clearlinux:1:x") == -EINVAL);
+
+        ck_assert(class_limits_init(&limits, " org.clearlinux/journal/:60:2 ,"
+                                    "org.clearlinux:1") == 2);
+
+        /* The longest prefix applies, up to its burst */
+        ck_assert(class_limits_take(&limits, journal, strlen(journal), 1000));
+        ck_assert(class_limits_take(&limits, journal, strlen(journal), 1000));
+        ck_assert(!class_limits_take(&limits, journal, strlen(journal), 1000));
+        ck_assert(class_limits_take(&limits, crash, strlen(crash), 1000));
+        ck_assert(!class_limits_take(&limits, crash, strlen(crash), 1000));
+        ck_assert(!class_limits_take(&limits, other, strlen(other), 1000));
+
+        /* Prefixes match whole components only */
+        ck_assert(class_limits_take(&limits, "org.clearlinuxx/a/b", 19, 1000));
+
+        /* Buckets refill at their rate, 60 records per minute here */
+        ck_assert(!class_limits_take(&limits, journal, strlen(journal), 1500));
+        ck_assert(class_limits_take(&limits, journal, strlen(journal), 2000));
+        ck_assert(!class_limits_take(&limits, journal, strlen(journal), 2000));
+        ck_assert(class_limits_take(&limits, journal, strlen(journal), 60000));
+        ck_assert(class_limits_take(&limits, journal, strlen(journal), 60000));
+        ck_assert(!class_limits_take(&limits, journal, strlen(journal), 60000));
+        ck_assert(class_limits_take(&limits, crash, strlen(crash), 61000));
+
+        class_limits_free(&limits);
+        ck_assert(limits.buckets == NULL);
+}
+END_TEST
+
+START_TEST(check_record_priority_order)
+{
+        char heartbeat[] = "record_format_version: 4\n"
+                           "classification: org.clearlinux/hello/world\n"
+                           "severity: 1\n";
+        char warning[] = "classification: org.clearlinux/journal/error\n"
+                         "severity: 3\n";
+        char crash[] = "classification: org.clearlinux/crash/clr\n"
+                       "severity: 2\n";
+        char crashx[] = "classification: org.clearlinux/crashx/clr\n"
+                        "severity: 9\n";
+        struct staged_record record = { 0 };
+        struct spool_index index;
+        struct spool_entry entry;
+
+        ck_assert(record_data_priority(heartbeat, strlen(heartbeat)) == 0);
+        ck_assert(record_data_priority(warning, strlen(warning)) == 2);
+        ck_assert(record_data_priority(crash, strlen(crash)) == TM_PRIORITY_CLASSES - 1);
+        ck_assert(record_data_priority(crashx, strlen(crashx)) == 0);
+        ck_assert(record_data_priority("hello", 5) == 0);
+
+        ck_assert(read_record(ABSTOPSRCDIR "/tests/telempostd/correct_message",
+                              &record));
+        ck_assert(record_priority(&record) == record_data_priority(record.data,
+                                                                   strlen(record.data)));
+        free_record(&record);
+
+        /* Higher classes first, unless the other records waited longer */
+        spool_index_init(&index);
+        spool_index_add(&index, "/spool/old", 1000, 4096, 0);
+        spool_index_add(&index, "/spool/low", 5000, 4096, 0);
+        spool_index_add(&index, "/spool/high", 5000 + TM_PRIORITY_AGING, 4096, 3);
+        ck_assert(spool_index_pop(&index, &entry));
+        ck_assert_str_eq(entry.name, "old");
+        free(entry.name);
+        ck_assert(spool_index_pop(&index, &entry));
+        ck_assert_str_eq(entry.name, "high");
+        free(entry.name);
+        ck_assert(spool_index_pop(&index, &entry));
+        ck_assert_str_eq(entry.name, "low");
+        free(entry.name);
+        spool_index_free(&index);
+}
+END_TEST
+
+START_TEST(check_metrics_page)
+{
+        char path[] = "/tmp/check_postd.metrics";
+        const struct metrics_page *page;
+        uint64_t buckets[METRICS_BUCKETS];
+        uint64_t sum_us;
+        char *text = NULL;
+        size_t size = 0;
+        FILE *out;
+
+        ck_assert_int_eq(metrics_open(path, "telempostd"), 0);
+        metrics_count(METRIC_POSTD_POSTS_SENT, 2);
+        metrics_count(METRIC_POSTD_HTTP_4XX, 1);
+        metrics_set(METRIC_POSTD_SPOOL_RECORDS, 7);
+        /* 0.5 us, 3 us and 100 ms */
+        metrics_observe(METRIC_POSTD_POST_TIME, 500);
+        metrics_observe(METRIC_POSTD_POST_TIME, 3000);
+        metrics_observe(METRIC_POSTD_POST_TIME, 100000000);
+
+        /* Read back as telemctl stats does */
+        ck_assert_int_eq(metrics_map(path, &page), 0);
+        ck_assert_str_eq(page->name, "telempostd");
+        ck_assert_int_eq(metrics_counter_value(page, METRIC_POSTD_POSTS_SENT), 2);
+        ck_assert_int_eq(metrics_counter_value(page, METRIC_POSTD_POSTS_FAILED), 0);
+        ck_assert_int_eq(metrics_histogram_value(page, METRIC_POSTD_POST_TIME,
+                                                 buckets, &sum_us), 3);
+        ck_assert_int_eq(buckets[0], 1);
+        ck_assert_int_eq(buckets[2], 1);
+        ck_assert_int_eq(buckets[17], 1);
+        ck_assert_int_eq(sum_us, 100003);
+
+        out = open_memstream(&text, &size);
+        ck_assert_ptr_ne(out, NULL);
+        metrics_print(out, page, true);
+        fclose(out);
+        ck_assert_ptr_ne(strstr(text, "telemetrics_posts_total{daemon=\"telempostd\","
+                                "result=\"sent\"} 2\n"), NULL);
+        ck_assert_ptr_ne(strstr(text, "telemetrics_http_responses_total{daemon=\"telempostd\","
+                                "code=\"4xx\"} 1\n"), NULL);
+        ck_assert_ptr_ne(strstr(text, "telemetrics_spool_records{daemon=\"telempostd\"} 7\n"),
+                         NULL);
+        ck_assert_ptr_ne(strstr(text, "telemetrics_post_seconds_bucket{daemon=\"telempostd\","
+                                "le=\"4e-06\"} 2\n"), NULL);
+        ck_assert_ptr_ne(strstr(text, "telemetrics_post_seconds_count{daemon=\"telempostd\"} 3\n"),
+                         NULL);
+        /* One HELP line per metric, and none of telemprobd */
+        ck_assert_ptr_eq(strstr(strstr(text, "# HELP telemetrics_posts_total") + 1,
+                                "# HELP telemetrics_posts_total"), NULL);
+        ck_assert_ptr_eq(strstr(text, "records_received_total"), NULL);
+        free(text);
+        metrics_unmap(page);
+
+        /* The page is removed, and metrics go to the private page again */
+        metrics_close();
+        ck_assert(access(path, F_OK) != 0);
+        ck_assert_int_eq(metrics_counter_value(metrics_page(), METRIC_POSTD_POSTS_SENT), 0);
+        ck_assert_int_eq(metrics_map(path, &page), -ENOENT);
+}
+END_TEST
+
+START_TEST(check_memory_budget)
+{
+        const struct metrics_page *page = metrics_page();
+        uint64_t trims = metrics_counter_value(page, METRIC_POSTD_MEMORY_TRIMS);
+
+        ck_assert_uint_gt(mem_budget_rss(), 0);
+
+        /* Busy under no budget, sampled but not trimmed */
+        mem_budget_init(0, METRIC_POSTD_RSS_BYTES, METRIC_POSTD_HEAP_BYTES,
+                        METRIC_POSTD_MEMORY_TRIMS);
+        ck_assert(!mem_budget_check(false));
+        ck_assert_int_gt(page->gauges[METRIC_POSTD_RSS_BYTES], 0);
+
+        /* Idle after some activity, then idle again */
+        ck_assert(mem_budget_check(true));
+        ck_assert(!mem_budget_check(true));
+        ck_assert_int_eq(metrics_counter_value(page, METRIC_POSTD_MEMORY_TRIMS),
+                         trims + 1);
+
+        /* Above the budget, trimmed while busy */
+        mem_budget_init(1, METRIC_POSTD_RSS_BYTES, METRIC_POSTD_HEAP_BYTES,
+                        METRIC_POSTD_MEMORY_TRIMS);
+        ck_assert(mem_budget_check(false));
+        ck_assert_int_eq(metrics_counter_value(page, METRIC_POSTD_MEMORY_TRIMS),
+                         trims + 2);
+}
+END_TEST
+
+START_TEST(check_destinations)
+{
+        char *headers = "record_format_version: 1\nclassification: org/test/fanout\n"
+                        "severity: 1\nmachine_id: 1234\ncreation_timestamp: 1418672344\n"
+                        "arch: x86_64\nhost_type: macbookpro\nbuild: 200\n"
+                        "kernel_version: 3.15\npayload_format_version: 1\n"
+                        "system_name: clear-linux-os\nboard_name: Qemu|Intel\n"
+                        "cpu_model: Intel(R) Core(TM) i7-5650U CPU @ 2.20GHz\n"
+                        "bios_version: Qemu\nevent_id: 3a2d799826edc6266d72824d2aac6763\n"
+                        "payload\n";
+        struct destinations dests;
+        char dir[] = "/tmp/check_destinations.XXXXXX";
+        char path[PATH_MAX], link_a[PATH_MAX], link_b[PATH_MAX];
+        struct stat buf;
+        FILE *fp;
+
+        ck_assert(mkdtemp(dir) != NULL);
+
+        /* Invalid lists */
+        ck_assert_int_eq(destinations_init(&dests, "a", dir), -EINVAL);
+        ck_assert_int_eq(destinations_init(&dests, "a=", dir), -EINVAL);
+        ck_assert_int_eq(destinations_init(&dests, "a b=http://x", dir), -EINVAL);
+        ck_assert_int_eq(destinations_init(&dests, "a:0=http://x", dir), -EINVAL);
+        ck_assert_int_eq(destinations_init(&dests, "a=http://x,a=http://y", dir), -EINVAL);
+        ck_assert_int_eq(destinations_init(&dests, "", dir), 0);
+
+        ck_assert_int_eq(destinations_init(&dests, "archive=http://archive/v2/collector,"
+                                           " lab:60=http://lab/v2/collector", dir), 2);
+        ck_assert_str_eq(dests.list[1].url, "http://lab/v2/collector");
+        ck_assert(dests.list[1].rate == 60.0);
+        ck_assert_int_eq(destinations_next_pass(&dests, 900), 0);
+
+        /* Linked into both destinations, and marked */
+        snprintf(path, sizeof(path), "%s/record", dir);
+        fp = fopen(path, "w");
+        ck_assert(fp != NULL);
+        fputs(headers, fp);
+        fclose(fp);
+        ck_assert(stat(path, &buf) == 0);
+        ck_assert_int_eq(destinations_fan_out_file(&dests, path, &buf, 0), 2);
+        snprintf(link_a, sizeof(link_a), "%s/%s/archive/record", dir, DESTINATIONS_DIR);
+        snprintf(link_b, sizeof(link_b), "%s/%s/lab/record", dir, DESTINATIONS_DIR);
+        ck_assert(stat(path, &buf) == 0);
+        ck_assert(buf.st_mode & TM_FANNED_OUT_MODE);
+        ck_assert_int_eq(buf.st_nlink, 3);
+        ck_assert(destinations_next_pass(&dests, 900) <= time(NULL));
+
+        /* Each destination lets go of the record once sent there */
+        failing_destination = "lab";
+        ck_assert_int_eq(destinations_run(&dests, 900), 1);
+        failing_destination = NULL;
+        ck_assert(access(link_a, F_OK) != 0);
+        ck_assert(access(link_b, F_OK) == 0);
+        ck_assert_int_eq(dests.list[1].index.count, 1);
+        ck_assert(destinations_next_pass(&dests, 900) > time(NULL));
+        destinations_free(&dests);
+
+        /* The records of destinations no longer listed are removed */
+        ck_assert_int_eq(destinations_init(&dests, "archive=http://archive/v2/collector",
+                                           dir), 1);
+        ck_assert(access(link_b, F_OK) != 0);
+        destinations_free(&dests);
+
+        unlink(path);
+        snprintf(path, sizeof(path), "%s/%s/archive", dir, DESTINATIONS_DIR);
+        rmdir(path);
+        snprintf(path, sizeof(path), "%s/%s", dir, DESTINATIONS_DIR);
+        rmdir(path);
+        rmdir(dir);
+}
+END_TEST
+
+START_TEST(check_record_sampling)
+{
+        char config_file[] = "/tmp/check_sampling.conf.XXXXXX";
+        char *headers[NUM_HEADERS] = { NULL };
+        char classification[] = "classification: org.clearlinux/hello/world";
+        char crash[] = "classification: org.clearlinux/crash/clr";
+        char timestamp[] = "creation_timestamp: 1418672344";
+        char event_id[64], line[64];
+        int kept = 0;
+        bool out;
+        FILE *fp;
+        int fd;
+
+        fd = mkstemp(config_file);
+        ck_assert(fd >= 0);
+        fp = fdopen(fd, "w");
+        fprintf(fp, "[settings]\nclass_sample_rates=org.clearlinux/hello/:4, bad,"
+                "org.clearlinux/crash:0\n");
+        fclose(fp);
+        set_config_file(config_file);
+        ck_assert(reload_config());
+
+        for (int i = 0; i < NUM_HEADERS; i++) {
+                headers[i] = "";
+        }
+        headers[TM_CLASSIFICATION] = crash;
+        headers[TM_TIMESTAMP] = timestamp;
+        headers[TM_EVENT_ID] = event_id;
+        ck_assert_int_eq(record_sample_rate(headers), 1);
+
+        /* About one in four is kept, on the event id and timestamp only */
+        headers[TM_CLASSIFICATION] = classification;
+        ck_assert_int_eq(record_sample_rate(headers), 4);
+        for (int i = 0; i < 1000; i++) {
+                snprintf(event_id, sizeof(event_id), "event_id: %032x", i * 7919);
+                snprintf(line, sizeof(line), "%s\n", event_id);
+                out = record_sampled_out(headers);
+                /* libtelemetry has the header lines with their newline */
+                headers[TM_EVENT_ID] = line;
+                ck_assert(record_sampled_out(headers) == out);
+                headers[TM_EVENT_ID] = event_id;
+                if (!out) {
+                        kept++;
+                }
+        }
+        ck_assert_int_gt(kept, 150);
+        ck_assert_int_lt(kept, 350);
+
+        unlink(config_file);
+        set_config_file(ABSTOPSRCDIR "/src/data/example.conf");
+        ck_assert(reload_config());
+        ck_assert_int_eq(record_sample_rate(headers), 1);
+        ck_assert(!record_sampled_out(headers));
+}
+END_TEST
+
+/* Records processed by aggregator_flush() in check_aggregation */
+static int aggregated_count = 0;
+static int aggregated_occurrences = 0;
+static time_t aggregated_first = 0;
+static time_t aggregated_last = 0;
+
+static void collect_aggregate(char *data, size_t size, time_t staged_time, void *arg)
+{
+        struct staged_record record = { 0 };
+
+        ck_assert(parse_record(data, size, &record));
+        ck_assert_str_eq(record.body, (char *)arg);
+        aggregated_count++;
+        if (record.occurrences > 0) {
+                aggregated_occurrences = record.occurrences;
+                aggregated_first = record.first_staged;
+                aggregated_last = record.last_staged;
+                ck_assert_int_eq(staged_time, record.first_staged);
+        }
+}
+
+/* Parses a copy of a record of a classification and payload */
+static char *aggregated_record(const char *classification, const char *payload,
+                               struct staged_record *record)
+{
+        char *data;
+
+        ck_assert(asprintf(&data, "record_format_version: 1\nclassification: %s\n"
+                           "severity: 1\nmachine_id: 1234\ncreation_timestamp: 1418672344\n"
+                           "arch: x86_64\nhost_type: macbookpro\nbuild: 200\n"
+                           "kernel_version: 3.15\npayload_format_version: 1\n"
+                           "system_name: clear-linux-os\nboard_name: Qemu|Intel\n"
+                           "cpu_model: Intel(R) Core(TM) i7-5650U CPU @ 2.20GHz\n"
+                           "bios_version: Qemu\nevent_id: 3a2d799826edc6266d72824d2aac6763\n"
+                           "%s", classification, payload) > 0);
+        ck_assert(parse_record(data, strlen(data), record));
+
+        return data;
+}
+
+/* Size of a record parsed by aggregated_record() */
+static size_t aggregated_size(struct staged_record *record, const char *data)
+{
+        return (size_t)(record->body + record->body_size - data);
+}
+
+START_TEST(check_aggregation)
+{
+        struct aggregator agg;
+        struct staged_record record = { 0 };
+        char *data;
+
+        ck_assert_int_eq(aggregator_init(&agg, ""), 0);
+        ck_assert_int_eq(aggregator_init(&agg, "org.test/storm"), -EINVAL);
+        ck_assert_int_eq(aggregator_init(&agg, "org.test/storm:0"), -EINVAL);
+        ck_assert_int_eq(aggregator_init(&agg, "org.test/storm:3601"), -EINVAL);
+        ck_assert_int_eq(aggregator_init(&agg, "org.test/storm/:60"), 1);
+        ck_assert_int_eq(aggregator_next_due(&agg), 0);
+
+        /* Other classifications are not held */
+        data = aggregated_record("org.test/calm/a", "same", &record);
+        ck_assert(!aggregator_add(&agg, &record, data, aggregated_size(&record, data), 100));
+        free(data);
+
+        /* Repeats are counted, other payloads held on their own */
+        for (int i = 0; i < 3; i++) {
+                data = aggregated_record("org.test/storm/a", "same", &record);
+                ck_assert(aggregator_add(&agg, &record, data, aggregated_size(&record, data), 100 + i));
+                free(data);
+        }
+        data = aggregated_record("org.test/storm/a", "other", &record);
+        ck_assert(aggregator_add(&agg, &record, data, aggregated_size(&record, data), 200));
+        free(data);
+        ck_assert(aggregator_next_due(&agg) > time(NULL));
+
+        ck_assert_int_eq(aggregator_flush(&agg, time(NULL), false, collect_aggregate,
+                                          "same"), 0);
+        aggregator_free(&agg);
+
+        /* Processed once their window is over */
+
+        ck_assert_int_eq(aggregator_init(&agg, "org.test/storm:60"), 1);
+        for (int i = 0; i < 4; i++) {
+                data = aggregated_record("org.test/storm/a", "same", &record);
+                ck_assert(aggregator_add(&agg, &record, data, aggregated_size(&record, data), 100 + i));
+                free(data);
+        }
+        ck_assert_int_eq(aggregator_flush(&agg, time(NULL) + 60, false, collect_aggregate,
+                                          "same"), 1);
+        ck_assert_int_eq(aggregated_count, 1);
+        ck_assert_int_eq(aggregated_occurrences, 4);
+        ck_assert_int_eq(aggregated_first, 100);
+        ck_assert_int_eq(aggregated_last, 103);
+        ck_assert_int_eq(aggregator_next_due(&agg), 0);
+
+        /* A record held alone is processed as it was */
+        aggregated_occurrences = 0;
+        data = aggregated_record("org.test/storm/a", "same", &record);
+        ck_assert(aggregator_add(&agg, &record, data, aggregated_size(&record, data), 300));
+        free(data);
+        ck_assert_int_eq(aggregator_flush(&agg, time(NULL), true, collect_aggregate,
+                                          "same"), 1);
+        ck_assert_int_eq(aggregated_count, 2);
+        ck_assert_int_eq(aggregated_occurrences, 0);
+        aggregator_free(&agg);
+}
+END_TEST
+
+/* Writes a file in dir, for check_archive_export_import */
+static void write_test_file(const char *dir, const char *name, const char *data)
+{
+        char path[PATH_MAX];
+        FILE *fp;
+
+        snprintf(path, sizeof(path), "%s/%s", dir, name);
+        fp = fopen(path, "w");
+        ck_assert(fp != NULL);
+        fputs(data, fp);
+        fclose(fp);
+}
+
+static int count_staged_files(const char *dir, const char *data)
+{
+        struct dirent *entry;
+        int count = 0;
+        DIR *d = opendir(dir);
+
+        ck_assert(d != NULL);
+        while ((entry = readdir(d)) != NULL) {
+                char path[PATH_MAX];
+                char buf[64] = { 0 };
+                FILE *fp;
+
+                if (entry->d_name[0] == '.') {
+                        continue;
+                }
+                snprintf(path, sizeof(path), "%s/%s", dir, entry->d_name);
+                fp = fopen(path, "r");
+                ck_assert(fp != NULL);
+                ck_assert(fread(buf, 1, sizeof(buf) - 1, fp) > 0);
+                fclose(fp);
+                ck_assert_str_eq(buf, data);
+                unlink(path);
+                count++;
+        }
+        closedir(d);
+
+        return count;
+}
+
+START_TEST(check_archive_export_import)
+{
+        char dir[] = "/tmp/check_archive.XXXXXX";
+        char relay[] = "/tmp/check_archive_relay.XXXXXX";
+        char spool[PATH_MAX], staging[PATH_MAX], retention[PATH_MAX];
+        char journal[PATH_MAX], archive[PATH_MAX], path[PATH_MAX];
+        struct archive_sources sources = { spool, journal, retention };
+        struct staging_log_frame frame = { STAGING_LOG_MAGIC, 6, 1000 };
+        uint32_t commit = STAGING_LOG_COMMIT;
+        struct archive_entry *entries = NULL;
+        int counts[ARCHIVE_TYPES] = { 0 };
+        int kept = 0;
+        struct stat buf;
+        FILE *fp;
+        int fd;
+
+        ck_assert(mkdtemp(dir) != NULL);
+        ck_assert(mkdtemp(relay) != NULL);
+        snprintf(spool, sizeof(spool), "%s/spool", dir);
+        snprintf(staging, sizeof(staging), "%s/%s", spool, STAGING_LOG_DIR);
+        snprintf(retention, sizeof(retention), "%s/records", dir);
+        snprintf(journal, sizeof(journal), "%s/journal", dir);
+        snprintf(archive, sizeof(archive), "%s/export.tmarch", dir);
+        ck_assert(mkdir(spool, S_IRWXU) == 0);
+        ck_assert(mkdir(staging, S_IRWXU) == 0);
+        ck_assert(mkdir(retention, S_IRWXU) == 0);
+
+        /* Two spooled records and one in the staging log */
+        write_test_file(spool, "rec1", "record");
+        write_test_file(spool, "rec2", "record");
+        snprintf(path, sizeof(path), "%s/%s%016x", staging, STAGING_LOG_SEGMENT_PREFIX, 1);
+        fp = fopen(path, "w");
+        ck_assert(fp != NULL);
+        fwrite(&frame, sizeof(frame), 1, fp);
+        fputs("record", fp);
+        fwrite(&commit, sizeof(commit), 1, fp);
+        fclose(fp);
+        write_test_file(dir, "journal", "journal entries");
+        write_test_file(retention, RECORD_PACK_INDEX, "index");
+
+        /* Compressed on several threads */
+        ck_assert_int_eq(archive_export(archive, &sources, 4), 5);
+        fd = open(archive, O_RDONLY);
+        ck_assert(fd >= 0);
+        ck_assert_int_eq(archive_read_index(fd, &entries), 5);
+        for (int i = 0; i < 5; i++) {
+                counts[entries[i].type]++;
+        }
+        ck_assert_int_eq(counts[ARCHIVE_RECORD], 3);
+        ck_assert_int_eq(counts[ARCHIVE_JOURNAL], 1);
+        ck_assert_int_eq(counts[ARCHIVE_RETAINED], 1);
+        free(entries);
+        close(fd);
+
+        /* Only the records are staged on the relay */
+        ck_assert_int_eq(archive_import(archive, relay, 3, &kept), 3);
+        ck_assert_int_eq(kept, 2);
+        ck_assert_int_eq(count_staged_files(relay, "record"), 3);
+        snprintf(path, sizeof(path), "%s/%s", relay, ARCHIVE_IMPORT_DIR);
+        ck_assert(rmdir(path) == 0);
+
+        /* An archive cut short is not read */
+        ck_assert(stat(archive, &buf) == 0);
+        ck_assert(truncate(archive, buf.st_size - 1) == 0);
+        ck_assert_int_eq(archive_import(archive, relay, 1, &kept), -EIO);
+        write_test_file(dir, "export.tmarch", "not an archive");
+        ck_assert_int_eq(archive_import(archive, relay, 1, &kept), -EINVAL);
+
+        unlink(archive);
+        snprintf(path, sizeof(path), "%s/%s%016x", staging, STAGING_LOG_SEGMENT_PREFIX, 1);
+        unlink(path);
+        rmdir(staging);
+        count_staged_files(spool, "record");
+        rmdir(spool);
+        snprintf(path, sizeof(path), "%s/%s", retention, RECORD_PACK_INDEX);
+        unlink(path);
+        rmdir(retention);
+        unlink(journal);
+        rmdir(dir);
+        rmdir(relay);
+}
+END_TEST
+
+START_TEST(check_record_io_read_and_unlink)
+{
+        char *filename = ABSTOPSRCDIR "/tests/telempostd/correct_message";
+        char dir[] = "/tmp/check_record_io.XXXXXX";
+        char path[3][PATH_MAX];
+        struct staged_record record;
+        struct stat expected, buf;
+        int ret;
+
+        ck_assert(mkdtemp(dir) != NULL);
+        ck_assert(stat(filename, &expected) == 0);
+        ck_assert(read_record(filename, &record));
+        unparse_record(&record);
+        for (int i = 0; i < 3; i++) {
+                snprintf(path[i], sizeof(path[i]), "%s/rec%d", dir, i);
+                write_test_file(dir, strrchr(path[i], '/') + 1, record.data);
+        }
+        free_record(&record);
+
+        /* Without the backend the same calls are synchronous */
+        ret = record_io_init(TM_RECORD_IO_DEPTH);
+        ck_assert(ret == 0 || ret == -ENOSYS || ret == -EOPNOTSUPP || ret == -EPERM);
+        ck_assert(record_io_enabled() == (ret == 0));
+
+        for (int i = 0; i < 3; i++) {
+                record_io_prefetch(path[i]);
+        }
+        record_io_submit();
+        for (int i = 0; i < 3; i++) {
+                ck_assert(record_io_read(path[i], &record, &buf));
+                ck_assert(S_ISREG(buf.st_mode));
+                ck_assert_int_eq(buf.st_size, expected.st_size);
+                ck_assert_str_eq(record.headers[TM_CLASSIFICATION],
+                                 "classification: crash/kernel/bug");
+                free_record(&record);
+                record_io_unlink(path[i]);
+        }
+
+        record_io_drain();
+        for (int i = 0; i < 3; i++) {
+                ck_assert(access(path[i], F_OK) != 0);
+        }
+
+        /* A record removed is not read */
+        record_io_prefetch(path[0]);
+        record_io_submit();
+        ck_assert(!record_io_read(path[0], &record, NULL));
+        record_io_drain();
+        record_io_close();
+        ck_assert(!record_io_enabled());
+        ck_assert(rmdir(dir) == 0);
+}
+END_TEST
+
+START_TEST(check_stage_pool_order)
+{
+        char *filename = ABSTOPSRCDIR "/tests/telempostd/correct_message";
+        char dir[] = "/tmp/check_stage_pool.XXXXXX";
+        struct stage_pool pool;
+        struct stage_job job;
+        struct staged_record record;
+        char path[PATH_MAX];
+        int n = STAGE_POOL_JOBS;
+
+        ck_assert(mkdtemp(dir) != NULL);
+        ck_assert(read_record(filename, &record));
+        unparse_record(&record);
+        for (int i = 0; i < n; i++) {
+                char name[16];
+
+                /* Every fourth file is missing */
+                if (i % 4 == 3) {
+                        continue;
+                }
+                snprintf(name, sizeof(name), "rec%d", i);
+                write_test_file(dir, name, record.data);
+        }
+        free_record(&record);
+
+        /* Without workers nothing is queued */
+        ck_assert_int_eq(stage_pool_start(&pool, 0), 0);
+        ck_assert(!stage_pool_enabled(&pool));
+        ck_assert(!stage_pool_take(&pool, &job));
+
+        ck_assert_int_eq(stage_pool_start(&pool, 4), 0);
+        ck_assert(stage_pool_enabled(&pool));
+        for (int i = 0; i < n; i++) {
+                char *queued;
+
+                ck_assert(!stage_pool_full(&pool));
+                ck_assert(asprintf(&queued, "%s/rec%d", dir, i) > 0);
+                stage_pool_queue(&pool, queued, i % 2 == 0);
+        }
+        ck_assert(stage_pool_full(&pool));
+        snprintf(path, sizeof(path), "%s/rec1", dir);
+        ck_assert(stage_pool_queued(&pool, path));
+
+        /* Taken back in the order queued */
+        for (int i = 0; i < n; i++) {
+                ck_assert(stage_pool_take(&pool, &job));
+                snprintf(path, sizeof(path), "%s/rec%d", dir, i);
+                ck_assert_str_eq(job.path, path);
+                ck_assert(job.is_retry == (i % 2 == 0));
+                ck_assert(job.loaded == (i % 4 != 3));
+                if (job.loaded) {
+                        ck_assert(S_ISREG(job.st.st_mode));
+                        ck_assert_str_eq(job.record.headers[TM_CLASSIFICATION],
+                                         "classification: crash/kernel/bug");
+                        free_record(&job.record);
+                        unlink(job.path);
+                }
+                free(job.path);
+        }
+        ck_assert(!stage_pool_take(&pool, &job));
+        snprintf(path, sizeof(path), "%s/rec1", dir);
+        ck_assert(!stage_pool_queued(&pool, path));
+
+        /* Files queued when stopping are dropped */
+        stage_pool_queue(&pool, strdup(path), false);
+        stage_pool_stop(&pool);
+        ck_assert(!stage_pool_enabled(&pool));
+        ck_assert(rmdir(dir) == 0);
+}
+END_TEST
+
 Suite *config_suite(void)
 {
         // A suite is comprised of test cases, defined below
@@ -401,6 +1917,9 @@ Suite *config_suite(void)
         tcase_add_test(t, check_handle_client_with_incorrect_data);
         tcase_add_test(t, check_process_record_with_correct_size_and_data);
         tcase_add_test(t, check_process_record_with_incorrect_headers);
+        tcase_add_test(t, check_read_record_headers_in_place);
+        tcase_add_test(t, check_read_record_raw_payload);
+        tcase_add_test(t, check_record_trace_in_place);
         tcase_add_test(t, check_rate_limit_enabled_functions);
         tcase_add_test(t, check_rate_limit_records_that_pass);
         tcase_add_test(t, check_rate_limit_records_that_do_not_pass);
@@ -411,6 +1930,26 @@ Suite *config_suite(void)
         tcase_add_test(t, check_strategy_spool_option);
         tcase_add_test(t, check_strategy_drop_option);
         tcase_add_test(t, check_strategy_if_record_sent);
+        tcase_add_test(t, check_staging_log_append_and_drain);
+        tcase_add_test(t, check_staging_log_skips_corrupt_records);
+        tcase_add_test(t, check_staging_log_sets_aside_unreadable_segments);
+        tcase_add_test(t, check_record_ring_push_and_drain);
+        tcase_add_test(t, check_post_batch_framing_and_status);
+        tcase_add_test(t, check_compress_record);
+        tcase_add_test(t, check_spool_index_order);
+        tcase_add_test(t, check_spool_usage);
+        tcase_add_test(t, check_post_state_warm_start);
+        tcase_add_test(t, check_retry_sched_breaker);
+        tcase_add_test(t, check_class_limits_buckets);
+        tcase_add_test(t, check_record_priority_order);
+        tcase_add_test(t, check_metrics_page);
+        tcase_add_test(t, check_memory_budget);
+        tcase_add_test(t, check_destinations);
+        tcase_add_test(t, check_record_sampling);
+        tcase_add_test(t, check_aggregation);
+        tcase_add_test(t, check_archive_export_import);
+        tcase_add_test(t, check_record_io_read_and_unlink);
+        tcase_add_test(t, check_stage_pool_order);
 
         suite_add_tcase(s, t);
 
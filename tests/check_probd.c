@@ -15,14 +15,22 @@
  */
 
 #include <check.h>
+#include <errno.h>
 #include <sys/socket.h>
 #include <sys/fcntl.h>
 #include <stdlib.h>
+#include <sys/epoll.h>
 #include <sys/queue.h>
 #include <unistd.h>
+#include <dirent.h>
+#include <limits.h>
+#include <stdio.h>
 
 #include "configuration.h"
 #include "telemdaemon.h"
+#include "telemetry.h"
+#include "heartbeat.h"
+#include "metrics.h"
 #include "common.h"
 
 TelemDaemon tdaemon;
@@ -53,6 +61,31 @@ char *get_serialized_record(char *headers, char *post_body, size_t *record_size)
         return data;
 }
 
+/* Frame a record the way tm_send_record() does */
+char *get_framed_record(char *headers, char *post_body, size_t *record_size)
+{
+        size_t headersize, payloadsize, offset;
+        char *data;
+
+        offset = 0;
+        headersize = strlen(headers);
+        payloadsize = strlen(post_body);
+
+        *record_size = 2 * sizeof(uint32_t) + headersize + payloadsize + 1;
+        data = calloc(1, *record_size);
+        memcpy(data, record_size, sizeof(uint32_t));
+        offset += sizeof(uint32_t);
+
+        memcpy(data + offset, &headersize, sizeof(uint32_t));
+        offset += sizeof(uint32_t);
+
+        memcpy(data + offset, headers, headersize);
+        offset += headersize;
+
+        memcpy(data + offset, post_body, payloadsize);
+        return data;
+}
+
 void setup(void)
 {
         char *config_file = ABSTOPSRCDIR "/src/data/example.conf";
@@ -151,6 +184,21 @@ void set_up_socket_pair(int *client, int *server)
         *server = sv[1];
 }
 
+void set_up_seqpacket_pair(int *client, int *server)
+{
+        int sv[2];
+        int ret;
+
+        ret = socketpair(AF_UNIX, SOCK_SEQPACKET, 0, sv);
+        ck_assert_msg(ret == 0, "Failed to create seqpacket socket pair\n");
+        ck_assert_msg((fcntl(sv[0], F_SETFL, O_NONBLOCK) == 0),
+                      "Failed to set socket to non-blocking\n");
+        ck_assert_msg((fcntl(sv[1], F_SETFL, O_NONBLOCK) == 0),
+                      "Failed to set socket to non-blocking\n");
+        *client = sv[0];
+        *server = sv[1];
+}
+
 START_TEST(check_handle_client_with_no_data)
 {
         setup();
@@ -191,12 +239,13 @@ START_TEST(check_handle_client_with_incorrect_data)
 
         ssize_t ret = write(server_fd, buf, 2);
         ck_assert(ret == 2);
+        /* A partial size is kept until the client hangs up */
+        close(server_fd);
 
         processed = handle_client(&tdaemon, 0, cl);
         ck_assert(processed == false);
         ck_assert_msg(is_client_list_empty(&(tdaemon.client_head)), "Failed to remove client with no data\n");
         ck_assert_msg(tdaemon.nfds == 0, "Failed to remove poll fd for client with n data\n");
-        close(server_fd);
 }
 END_TEST
 
@@ -222,12 +271,13 @@ START_TEST(check_handle_client_with_incorrect_size)
         memcpy(buf + RECORD_SIZE_LEN, data, sizeof(uint32_t));
         ssize_t ret = write(server_fd, buf, 2);
         ck_assert(ret == 2);
+        /* A partial size is kept until the client hangs up */
+        close(server_fd);
 
         processed = handle_client(&tdaemon, 0, cl);
         ck_assert(processed == false);
         ck_assert_msg(is_client_list_empty(&(tdaemon.client_head)), "Failed to remove client with no data\n");
         ck_assert_msg(tdaemon.nfds == 0, "Failed to remove poll fd for client with n data\n");
-        close(server_fd);
 }
 END_TEST
 
@@ -303,6 +353,101 @@ START_TEST(check_process_record_with_correct_size_and_data)
 }
 END_TEST
 
+static int count_dir_entries(const char *path)
+{
+        struct dirent *entry;
+        DIR *dir;
+        int count = 0;
+
+        dir = opendir(path);
+        ck_assert_msg(dir != NULL, "Failed to open %s", path);
+        while ((entry = readdir(dir)) != NULL) {
+                if (entry->d_name[0] != '.') {
+                        count++;
+                }
+        }
+        closedir(dir);
+
+        return count;
+}
+
+START_TEST(check_process_record_in_staging_shard)
+{
+        setup();
+
+        client *cl;
+        int server_fd, client_fd;
+        int spooled;
+        char *record;
+        size_t record_size;
+        char *headers = "record_format_version: 1\nclassification: crash/kernel/bug\nseverity: 0\n"
+                        "machine_id: 1234\ncreation_timestamp: 1418672344\narch:x86_64\n"
+                        "host_type: macbookpro\nbuild: 200\nkernel_version: 3.15\n"
+                        "payload_format_version: 1\n"
+                        "system_name: clear-linux-os\n"
+                        "board_name: Qemu|Intel\n"
+                        "cpu_model: Intel(R) Core(TM) i7-5650U CPU @ 2.20GHz\n"
+                        "bios_version: Qemu\n"
+                        "event_id: 3a2d799826edc6266d72824d2aac6763\n";
+        char *post_body = "test message";
+
+        ck_assert(create_staging_shard(0) == 0);
+        tdaemon.shard = 0;
+        spooled = count_dir_entries("/tmp/spool");
+
+        set_up_socket_pair(&client_fd, &server_fd);
+        cl = add_client(&(tdaemon.client_head), client_fd);
+        ck_assert_msg(cl != NULL, "failed to malloc client");
+        add_pollfd(&tdaemon, client_fd, POLLIN | POLLPRI);
+
+        record = get_serialized_record(headers, post_body, &record_size);
+        ssize_t ret = write(server_fd, record, record_size);
+        ck_assert(ret == record_size);
+
+        ck_assert(handle_client(&tdaemon, 0, cl) == true);
+        ck_assert_msg(count_dir_entries("/tmp/spool/" TM_STAGING_SHARD_PREFIX "0") == 0,
+                      "Record left in the staging shard\n");
+        ck_assert_msg(count_dir_entries("/tmp/spool") == spooled + 1,
+                      "Record not moved from the staging shard\n");
+        close(server_fd);
+        free(record);
+}
+END_TEST
+
+START_TEST(check_stage_heartbeat_record)
+{
+        setup();
+
+        struct telem_record record;
+        struct telem_ref ref = { &record };
+        char *headers[NUM_HEADERS] = {
+                "record_format_version: 4\n", "classification: " HEARTBEAT_CLASSIFICATION "\n",
+                "severity: 1\n", "machine_id: 1234\n", "creation_timestamp: 1418672344\n",
+                "arch: x86_64\n", "host_type: macbookpro\n", "build: 200\n",
+                "kernel_version: 3.15\n", "payload_format_version: 1\n",
+                "system_name: clear-linux-os\n", "board_name: Qemu|Intel\n",
+                "cpu_model: Intel(R) Core(TM) i7-5650U CPU @ 2.20GHz\n",
+                "bios_version: Qemu\n", "event_id: 3a2d799826edc6266d72824d2aac6763\n"
+        };
+        unsigned options;
+        int spooled;
+
+        options = parse_heartbeat_options(" Uptime,bogus, locale ");
+        ck_assert_uint_eq(options, HEARTBEAT_UPTIME | HEARTBEAT_LOCALE);
+
+        memcpy(record.headers, headers, sizeof(headers));
+        record.payload = create_heartbeat_payload(options, "en_US.UTF-8");
+        ck_assert_ptr_ne(record.payload, NULL);
+        ck_assert(strncmp(record.payload, "hello\nLC_ALL: en_US.UTF-8\nuptime: ", 34) == 0);
+
+        spooled = count_dir_entries("/tmp/spool");
+        stage_local_record(&tdaemon, &ref);
+        ck_assert_msg(count_dir_entries("/tmp/spool") == spooled + 1,
+                      "Heartbeat record not staged\n");
+        free(record.payload);
+}
+END_TEST
+
 START_TEST(check_process_record_with_incorrect_headers)
 {
         setup();
@@ -335,6 +480,402 @@ START_TEST(check_process_record_with_incorrect_headers)
 }
 END_TEST
 
+START_TEST(check_handle_client_with_multiple_records)
+{
+        setup();
+
+        client *cl;
+        int server_fd, client_fd;
+        bool processed;
+        char *record;
+        size_t record_size;
+        char *headers = "record_format_version: 1\nclassification: crash/kernel/bug\nseverity: 0\n"
+                        "machine_id: 1234\ncreation_timestamp: 1418672344\narch:x86_64\n"
+                        "host_type: macbookpro\nbuild: 200\nkernel_version: 3.15\n"
+                        "payload_format_version: 1\n"
+                        "system_name: clear-linux-os\n"
+                        "board_name: Qemu|Intel\n"
+                        "cpu_model: Intel(R) Core(TM) i7-5650U CPU @ 2.20GHz\n"
+                        "bios_version: Qemu\n"
+                        "event_id: 3a2d799826edc6266d72824d2aac6763\n";
+        char *post_body = "test message";
+
+        set_up_socket_pair(&client_fd, &server_fd);
+        cl = add_client(&(tdaemon.client_head), client_fd);
+        ck_assert_msg(cl != NULL, "failed to malloc client");
+        add_pollfd(&tdaemon, client_fd, POLLIN | POLLPRI);
+
+        record = get_framed_record(headers, post_body, &record_size);
+        ssize_t ret = write(server_fd, record, record_size);
+        ck_assert(ret == record_size);
+        ret = write(server_fd, record, record_size);
+        ck_assert(ret == record_size);
+
+        /* Both records are consumed, and the connection is kept open */
+        processed = handle_client(&tdaemon, 0, cl);
+        ck_assert(processed == true);
+        ck_assert_msg(!is_client_list_empty(&(tdaemon.client_head)), "Client removed while connection is open\n");
+        ck_assert_msg(tdaemon.nfds == 1, "Poll fd removed while connection is open\n");
+        ck_assert_msg(cl->buf == NULL, "Receive buffer not released after processing\n");
+
+        /* Client hangs up */
+        close(server_fd);
+        processed = handle_client(&tdaemon, 0, cl);
+        ck_assert(processed == false);
+        ck_assert_msg(is_client_list_empty(&(tdaemon.client_head)), "Failed to remove client after hang up\n");
+        ck_assert_msg(tdaemon.nfds == 0, "Failed to remove poll fd for client after hang up\n");
+        free(record);
+}
+END_TEST
+
+START_TEST(check_handle_client_with_partial_record)
+{
+        setup();
+
+        client *cl;
+        int server_fd, client_fd;
+        bool processed;
+        char *record;
+        size_t record_size;
+        size_t split;
+        char *headers = "record_format_version: 1\nclassification: crash/kernel/bug\nseverity: 0\n"
+                        "machine_id: 1234\ncreation_timestamp: 1418672344\narch:x86_64\n"
+                        "host_type: macbookpro\nbuild: 200\nkernel_version: 3.15\n"
+                        "payload_format_version: 1\n"
+                        "system_name: clear-linux-os\n"
+                        "board_name: Qemu|Intel\n"
+                        "cpu_model: Intel(R) Core(TM) i7-5650U CPU @ 2.20GHz\n"
+                        "bios_version: Qemu\n"
+                        "event_id: 3a2d799826edc6266d72824d2aac6763\n";
+        char *post_body = "test message";
+
+        set_up_socket_pair(&client_fd, &server_fd);
+        cl = add_client(&(tdaemon.client_head), client_fd);
+        ck_assert_msg(cl != NULL, "failed to malloc client");
+        add_pollfd(&tdaemon, client_fd, POLLIN | POLLPRI);
+
+        record = get_framed_record(headers, post_body, &record_size);
+
+        /* Half of the size field */
+        ssize_t ret = write(server_fd, record, 2);
+        ck_assert(ret == 2);
+        processed = handle_client(&tdaemon, 0, cl);
+        ck_assert(processed == false);
+        ck_assert_msg(tdaemon.nfds == 1, "Poll fd removed while record is incomplete\n");
+        ck_assert(cl->state == CLIENT_READ_SIZE);
+
+        /* The rest of the size field and part of the body */
+        split = record_size / 2;
+        ret = write(server_fd, record + 2, split - 2);
+        ck_assert(ret == split - 2);
+        processed = handle_client(&tdaemon, 0, cl);
+        ck_assert(processed == false);
+        ck_assert_msg(tdaemon.nfds == 1, "Poll fd removed while record is incomplete\n");
+        ck_assert(cl->state == CLIENT_READ_BODY);
+        ck_assert(cl->offset == split - RECORD_SIZE_LEN);
+
+        /* The rest of the body completes the record */
+        ret = write(server_fd, record + split, record_size - split);
+        ck_assert(ret == record_size - split);
+        processed = handle_client(&tdaemon, 0, cl);
+        ck_assert(processed == true);
+        ck_assert_msg(tdaemon.nfds == 1, "Poll fd removed while connection is open\n");
+        ck_assert(cl->state == CLIENT_READ_SIZE);
+        ck_assert(cl->buf == NULL);
+        ck_assert_msg(tdaemon.recv_pool_count == 1, "Receive buffer not returned to the pool\n");
+
+        close(server_fd);
+        processed = handle_client(&tdaemon, 0, cl);
+        ck_assert(processed == false);
+        ck_assert_msg(is_client_list_empty(&(tdaemon.client_head)), "Failed to remove client after hang up\n");
+
+        trim_probe_daemon(&tdaemon);
+        ck_assert(tdaemon.recv_pool_count == 0);
+        free(record);
+}
+END_TEST
+
+/* A binary payload too large for a receive buffer, with null bytes */
+#define LARGE_PAYLOAD_SIZE (256 * 1024)
+
+/* Reads the spooled record with the given event id, and removes it */
+static char *take_spooled_record(const char *event_id, size_t *size)
+{
+        struct dirent *entry;
+        char *found = NULL;
+        DIR *dir;
+
+        dir = opendir("/tmp/spool");
+        ck_assert(dir != NULL);
+        while (!found && (entry = readdir(dir)) != NULL) {
+                char path[PATH_MAX];
+                char *data;
+                FILE *fp;
+                long len;
+
+                snprintf(path, sizeof(path), "/tmp/spool/%s", entry->d_name);
+                if (entry->d_name[0] == '.' || !(fp = fopen(path, "r"))) {
+                        continue;
+                }
+                fseek(fp, 0, SEEK_END);
+                len = ftell(fp);
+                rewind(fp);
+                data = malloc((size_t)len + 1);
+                ck_assert(fread(data, 1, (size_t)len, fp) == (size_t)len);
+                data[len] = '\0';
+                fclose(fp);
+                if (strstr(data, event_id)) {
+                        found = data;
+                        *size = (size_t)len;
+                        unlink(path);
+                } else {
+                        free(data);
+                }
+        }
+        closedir(dir);
+
+        return found;
+}
+
+START_TEST(check_handle_client_with_large_raw_record)
+{
+        setup();
+
+        client *cl;
+        int server_fd, client_fd;
+        bool processed = false;
+        char *record;
+        char *spooled;
+        size_t spooled_size;
+        size_t record_size, offset = 0;
+        uint32_t size_field;
+        char *headers = "record_format_version: 1\nclassification: crash/kernel/bug\nseverity: 0\n"
+                        "machine_id: 1234\ncreation_timestamp: 1418672344\narch:x86_64\n"
+                        "host_type: macbookpro\nbuild: 200\nkernel_version: 3.15\n"
+                        "payload_format_version: 1\n"
+                        "system_name: clear-linux-os\n"
+                        "board_name: Qemu|Intel\n"
+                        "cpu_model: Intel(R) Core(TM) i7-5650U CPU @ 2.20GHz\n"
+                        "bios_version: Qemu\n"
+                        "event_id: 5a1e0f5a1e0f5a1e0f5a1e0f5a1e0f5a\n";
+        size_t headersize = strlen(headers);
+        char *payload;
+
+        set_up_socket_pair(&client_fd, &server_fd);
+        fcntl(server_fd, F_SETFL, O_NONBLOCK);
+        cl = add_client(&(tdaemon.client_head), client_fd);
+        ck_assert_msg(cl != NULL, "failed to malloc client");
+        add_pollfd(&tdaemon, client_fd, POLLIN | POLLPRI);
+
+        /* Framed as tm_send_record() frames a tm_set_payload_binary() payload */
+        record_size = 3 * sizeof(uint32_t) + headersize + LARGE_PAYLOAD_SIZE + 1;
+        record = calloc(1, record_size);
+        size_field = (uint32_t)record_size;
+        memcpy(record, &size_field, sizeof(uint32_t));
+        memcpy(record + 4, RAW_PREFIX, RAW_PREFIX_LENGTH);
+        size_field = (uint32_t)headersize;
+        memcpy(record + 8, &size_field, sizeof(uint32_t));
+        memcpy(record + 12, headers, headersize);
+        payload = record + 12 + headersize;
+        for (size_t i = 0; i < LARGE_PAYLOAD_SIZE; i++) {
+                payload[i] = (char)(i * 7);
+        }
+
+        /* Sent in as many pieces as the socket takes */
+        while (offset < record_size) {
+                ssize_t ret = write(server_fd, record + offset, record_size - offset);
+
+                ck_assert(ret > 0);
+                offset += (size_t)ret;
+                if (handle_client(&tdaemon, 0, cl)) {
+                        processed = true;
+                }
+                ck_assert_msg(!is_client_list_empty(&(tdaemon.client_head)),
+                              "Client removed while sending a large record\n");
+        }
+        ck_assert(processed == true);
+        ck_assert(cl->state == CLIENT_READ_SIZE);
+        ck_assert(cl->stream == NULL);
+        ck_assert_msg(count_dir_entries("/tmp/spool/" TM_STAGING_STREAM_DIR) == 0,
+                      "Record left in the stream directory\n");
+        ck_assert_int_eq(metrics_counter_value(metrics_page(),
+                                               METRIC_PROBD_RECORDS_STREAMED), 1);
+        ck_assert(metrics_counter_value(metrics_page(), METRIC_PROBD_BYTES_RECEIVED) >
+                  LARGE_PAYLOAD_SIZE);
+
+        /* Staged with a RAW line, the payload as it was sent */
+        spooled = take_spooled_record("5a1e0f5a1e0f5a1e0f5a1e0f5a1e0f5a", &spooled_size);
+        ck_assert_msg(spooled != NULL, "Large record not spooled\n");
+        ck_assert(strncmp(spooled, RAW_PREFIX "\n", RAW_PREFIX_LENGTH + 1) == 0);
+        ck_assert(spooled_size > LARGE_PAYLOAD_SIZE);
+        ck_assert(memcmp(spooled + spooled_size - LARGE_PAYLOAD_SIZE, payload,
+                         LARGE_PAYLOAD_SIZE) == 0);
+
+        close(server_fd);
+        handle_client(&tdaemon, 0, cl);
+        ck_assert(is_client_list_empty(&(tdaemon.client_head)));
+        free(spooled);
+        free(record);
+}
+END_TEST
+
+START_TEST(check_handle_client_seqpacket_records)
+{
+        setup();
+
+        client *cl;
+        int server_fd, client_fd;
+        char *record;
+        size_t record_size;
+        char *headers = "record_format_version: 1\nclassification: org.clearlinux/hello/world\n"
+                        "severity: 1\nmachine_id: 1234\ncreation_timestamp: 1418672344\n"
+                        "arch: x86_64\nhost_type: macbookpro\nbuild: 200\nkernel_version: 3.15\n"
+                        "payload_format_version: 1\n"
+                        "system_name: clear-linux-os\n"
+                        "board_name: Qemu|Intel\n"
+                        "cpu_model: Intel(R) Core(TM) i7-5650U CPU @ 2.20GHz\n"
+                        "bios_version: Qemu\n"
+                        "event_id: 5eb0a5eb0a5eb0a5eb0a5eb0a5eb0a5e\n";
+        char *post_body = "hello";
+
+        set_up_seqpacket_pair(&client_fd, &server_fd);
+        tdaemon.seqpacket = true;
+        cl = add_client(&(tdaemon.client_head), client_fd);
+        ck_assert_msg(cl != NULL, "failed to malloc client");
+        add_pollfd(&tdaemon, client_fd, POLLIN | POLLPRI);
+
+        /* Two records, one message each, read in a single call */
+        record = get_framed_record(headers, post_body, &record_size);
+        ck_assert(write(server_fd, record, record_size) == (ssize_t)record_size);
+        ck_assert(write(server_fd, record, record_size) == (ssize_t)record_size);
+        ck_assert(handle_client(&tdaemon, 0, cl) == true);
+        ck_assert(cl->state == CLIENT_READ_SIZE);
+        ck_assert(cl->offset == 0);
+        ck_assert(cl->buf == NULL);
+        ck_assert_int_eq(metrics_counter_value(metrics_page(),
+                                               METRIC_PROBD_RECORDS_RECEIVED), 2);
+
+        /* A message longer than the record it frames is rejected */
+        record = realloc(record, record_size + 8);
+        ck_assert(record != NULL);
+        memset(record + record_size, 'x', 8);
+        ck_assert(write(server_fd, record, record_size + 8) == (ssize_t)(record_size + 8));
+        handle_client(&tdaemon, 0, cl);
+        ck_assert(is_client_list_empty(&(tdaemon.client_head)));
+
+        tdaemon.seqpacket = false;
+        close(server_fd);
+        free(record);
+}
+END_TEST
+
+START_TEST(check_handle_client_seqpacket_large_raw_record)
+{
+        setup();
+
+        client *cl;
+        int server_fd, client_fd;
+        bool processed = false;
+        char *record;
+        char *spooled;
+        size_t spooled_size;
+        size_t record_size, offset = 0;
+        uint32_t size_field;
+        char *headers = "record_format_version: 1\nclassification: crash/kernel/bug\nseverity: 0\n"
+                        "machine_id: 1234\ncreation_timestamp: 1418672344\narch:x86_64\n"
+                        "host_type: macbookpro\nbuild: 200\nkernel_version: 3.15\n"
+                        "payload_format_version: 1\n"
+                        "system_name: clear-linux-os\n"
+                        "board_name: Qemu|Intel\n"
+                        "cpu_model: Intel(R) Core(TM) i7-5650U CPU @ 2.20GHz\n"
+                        "bios_version: Qemu\n"
+                        "event_id: 5eb0a5eb0a5eb0a5eb0a5eb0a5eb0a5f\n";
+        size_t headersize = strlen(headers);
+        char *payload;
+
+        set_up_seqpacket_pair(&client_fd, &server_fd);
+        tdaemon.seqpacket = true;
+        cl = add_client(&(tdaemon.client_head), client_fd);
+        ck_assert_msg(cl != NULL, "failed to malloc client");
+        add_pollfd(&tdaemon, client_fd, POLLIN | POLLPRI);
+
+        record_size = 3 * sizeof(uint32_t) + headersize + LARGE_PAYLOAD_SIZE + 1;
+        record = calloc(1, record_size);
+        size_field = (uint32_t)record_size;
+        memcpy(record, &size_field, sizeof(uint32_t));
+        memcpy(record + 4, RAW_PREFIX, RAW_PREFIX_LENGTH);
+        size_field = (uint32_t)headersize;
+        memcpy(record + 8, &size_field, sizeof(uint32_t));
+        memcpy(record + 12, headers, headersize);
+        payload = record + 12 + headersize;
+        for (size_t i = 0; i < LARGE_PAYLOAD_SIZE; i++) {
+                payload[i] = (char)(i * 11);
+        }
+
+        /* Split as tm_write_packets() splits it */
+        while (offset < record_size) {
+                size_t limit = offset == 0 ? TM_PACKET_SIZE : TM_PACKET_NEXT_SIZE;
+                size_t len = record_size - offset < limit ? record_size - offset : limit;
+                ssize_t ret = write(server_fd, record + offset, len);
+
+                if (ret < 0 && errno == EAGAIN) {
+                        ck_assert(handle_client(&tdaemon, 0, cl) == false);
+                        continue;
+                }
+                ck_assert(ret == (ssize_t)len);
+                offset += len;
+        }
+        processed = handle_client(&tdaemon, 0, cl);
+        ck_assert(processed == true);
+        ck_assert(cl->state == CLIENT_READ_SIZE);
+        ck_assert(cl->stream == NULL);
+        ck_assert_int_eq(metrics_counter_value(metrics_page(),
+                                               METRIC_PROBD_RECORDS_STREAMED), 1);
+
+        spooled = take_spooled_record("5eb0a5eb0a5eb0a5eb0a5eb0a5eb0a5f", &spooled_size);
+        ck_assert_msg(spooled != NULL, "Large record not spooled\n");
+        ck_assert(spooled_size > LARGE_PAYLOAD_SIZE);
+        ck_assert(memcmp(spooled + spooled_size - LARGE_PAYLOAD_SIZE, payload,
+                         LARGE_PAYLOAD_SIZE) == 0);
+
+        close(server_fd);
+        handle_client(&tdaemon, 0, cl);
+        ck_assert(is_client_list_empty(&(tdaemon.client_head)));
+        tdaemon.seqpacket = false;
+        free(spooled);
+        free(record);
+}
+END_TEST
+
+START_TEST(check_handle_client_epoll_without_data)
+{
+        setup();
+
+        client *cl;
+        int server_fd;
+        int client_fd;
+        bool processed;
+
+        /* Edge-triggered wakeups may find the data already consumed */
+        tdaemon.epfd = epoll_create1(0);
+        ck_assert(tdaemon.epfd >= 0);
+
+        set_up_socket_pair(&client_fd, &server_fd);
+        cl = add_client(&(tdaemon.client_head), client_fd);
+        ck_assert_msg(cl != NULL, "failed to malloc client");
+
+        processed = handle_client(&tdaemon, 0, cl);
+        ck_assert(processed == false);
+        ck_assert_msg(!is_client_list_empty(&(tdaemon.client_head)), "Client removed on a spurious wakeup\n");
+
+        close(server_fd);
+        processed = handle_client(&tdaemon, 0, cl);
+        ck_assert(processed == false);
+        ck_assert_msg(is_client_list_empty(&(tdaemon.client_head)), "Failed to remove client after hang up\n");
+        close(tdaemon.epfd);
+}
+END_TEST
+
 Suite *config_suite(void)
 {
         // A suite is comprised of test cases, defined below
@@ -350,7 +891,15 @@ Suite *config_suite(void)
         tcase_add_test(t, check_handle_client_with_incorrect_size);
         tcase_add_test(t, check_handle_client_with_correct_size);
         tcase_add_test(t, check_process_record_with_correct_size_and_data);
+        tcase_add_test(t, check_process_record_in_staging_shard);
+        tcase_add_test(t, check_stage_heartbeat_record);
         tcase_add_test(t, check_process_record_with_incorrect_headers);
+        tcase_add_test(t, check_handle_client_with_multiple_records);
+        tcase_add_test(t, check_handle_client_with_partial_record);
+        tcase_add_test(t, check_handle_client_with_large_raw_record);
+        tcase_add_test(t, check_handle_client_seqpacket_records);
+        tcase_add_test(t, check_handle_client_seqpacket_large_raw_record);
+        tcase_add_test(t, check_handle_client_epoll_without_data);
 
         suite_add_tcase(s, t);
 
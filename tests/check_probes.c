@@ -22,12 +22,16 @@
 #include <errno.h>
 #include <stdbool.h>
 #include <string.h>
+#include <inttypes.h>
 
 #include "nica/nc-string.h"
 #include "log.h"
 #include "read_oopsfile.h"
 #include "src/probes/klog_scanner.h"
 #include "src/probes/oops_parser.h"
+#include "src/probes/symcache.h"
+#include "src/probes/dedup.h"
+#include "src/probes/journal_cursor.h"
 
 static char reason[1024];
 static nc_string *pl;
@@ -652,6 +656,434 @@ START_TEST(bug_kernel_handle_payload_new_format)
 }
 END_TEST
 
+/* Feeds an oops file to the /dev/kmsg reader, one record per line */
+static void setup_kmsg_payload(char *oopsfile, struct kmsg_state *state)
+{
+        char record[KMSG_RECORD_MAX + 1];
+        char *line = NULL;
+        size_t len = 0;
+        uint64_t seq = 1;
+        FILE *file;
+
+        oops_parser_cleanup();
+        oops_parser_init(callback_func);
+        pl = NULL;
+
+        file = fopen(oopsfile, "r");
+        ck_assert_ptr_nonnull(file);
+        while (getline(&line, &len, file) != -1) {
+                char *msg = strchr(line, ']');
+                int n;
+
+                // <level>[timestamp] message, to level,seq,timestamp,flags;message
+                msg = msg ? msg + 1 : line;
+                if (*msg == ' ') {
+                        msg++;
+                }
+                n = snprintf(record, sizeof(record), "%d,%" PRIu64 ",1000,-;%s SUBSYSTEM=x\n",
+                             line[0] == '<' ? atoi(line + 1) : 6, seq++, msg);
+                ck_assert(n > 0 && n < (int)sizeof(record));
+                ck_assert_int_eq(kmsg_process_record(state, record, (size_t)n), 0);
+        }
+        free(line);
+        fclose(file);
+}
+
+START_TEST(kmsg_watchdog_payload)
+{
+        struct kmsg_state state;
+        char record[] = "4,3,1000,-;WARNING: at net/sched/sch_generic.c:255\n";
+
+        ck_assert_int_eq(kmsg_state_init(&state, "kmsg.seq"), 0);
+        setup_kmsg_payload(TESTOOPSDIR "/watchdog.txt", &state);
+
+        // The same oops as from the kernel ring buffer
+        ck_assert_ptr_nonnull(pl);
+        ck_assert_str_eq(reason, "WARNING: at net/sched/sch_generic.c:255 dev_watchdog+0x238/0x250");
+        ck_assert(strstr(pl->str, "Kernel Version : 3.10.4-100.fc18.x86_64"));
+        ck_assert(strstr(pl->str, "#1 dump_stack"));
+        ck_assert(strstr(pl->str, "#2 warn_slowpath_common"));
+        nc_string_free(pl);
+
+        // Records handled before a restart are skipped
+        state.resume = true;
+        state.resume_seq = 5;
+        ck_assert_int_eq(kmsg_process_record(&state, record, strlen(record)), 1);
+        ck_assert_int_eq(kmsg_process_record(&state, "no header", 9), -1);
+}
+END_TEST
+
+START_TEST(kmsg_seq_resume)
+{
+        struct kmsg_state state;
+
+        unlink("kmsg.seq");
+        ck_assert_int_eq(kmsg_state_init(&state, "kmsg.seq"), 0);
+        ck_assert(!state.resume);
+        state.seq = 42;
+        ck_assert_int_eq(kmsg_save_seq(&state), 0);
+
+        // Resumed during the same boot only
+        ck_assert_int_eq(kmsg_state_init(&state, "kmsg.seq"), 0);
+        ck_assert(state.resume);
+        ck_assert(state.resume_seq == 42);
+        state.boot_id[0] = state.boot_id[0] == '0' ? '1' : '0';
+        ck_assert_int_eq(kmsg_save_seq(&state), 0);
+        ck_assert_int_eq(kmsg_state_init(&state, "kmsg.seq"), 0);
+        ck_assert(!state.resume);
+        unlink("kmsg.seq");
+}
+END_TEST
+
+static void write_cursor_file(const char *path, const char *data, size_t size)
+{
+        FILE *file = fopen(path, "w");
+
+        ck_assert_ptr_nonnull(file);
+        ck_assert(fwrite(data, 1, size, file) == size);
+        fclose(file);
+}
+
+START_TEST(journal_cursor_save_load)
+{
+        const char *path = "journalprobe.cursor";
+        const char *first = "s=739ad463348b4ceca5a9e69c95a3c93f;i=4ece7;b=6c7c6013a8b34d8e;"
+                            "m=19237d2d;t=5f1c0e1c1a0c4;x=d1b3796325fdfd4";
+        const char *second = "s=739ad463348b4ceca5a9e69c95a3c93f;i=4ece8;b=6c7c6013a8b34d8e;"
+                             "m=19237d3a;t=5f1c0e1c1a0d1;x=d1b3796325fdfd5";
+        char *cursor;
+
+        // Nothing saved yet
+        unlink(path);
+        ck_assert_ptr_null(journal_cursor_load(path));
+
+        // A restart resumes from the cursor of the last batch sent
+        ck_assert_int_eq(journal_cursor_save(path, first), 0);
+        ck_assert_int_eq(journal_cursor_save(path, second), 0);
+        cursor = journal_cursor_load(path);
+        ck_assert_ptr_nonnull(cursor);
+        ck_assert_str_eq(cursor, second);
+        free(cursor);
+        ck_assert_int_eq(access("journalprobe.cursor.tmp", F_OK), -1);
+
+        // Nor is a cursor saved that would not load back
+        ck_assert_int_eq(journal_cursor_save(path, ""), -EINVAL);
+        ck_assert_int_eq(journal_cursor_save(path, "s=1; i=2"), -EINVAL);
+        cursor = journal_cursor_load(path);
+        ck_assert_str_eq(cursor, second);
+        free(cursor);
+
+        // Corrupted files are ignored: empty, torn, binary, or extra lines
+        write_cursor_file(path, "", 0);
+        ck_assert_ptr_null(journal_cursor_load(path));
+        write_cursor_file(path, "\n", 1);
+        ck_assert_ptr_null(journal_cursor_load(path));
+        write_cursor_file(path, first, 20);
+        ck_assert_ptr_null(journal_cursor_load(path));
+        write_cursor_file(path, "s=1\0;i=2\n", 9);
+        ck_assert_ptr_null(journal_cursor_load(path));
+        write_cursor_file(path, "s=1;i=2\ns=1;i=3\n", 16);
+        ck_assert_ptr_null(journal_cursor_load(path));
+
+        // And replaced by the next cursor saved
+        ck_assert_int_eq(journal_cursor_save(path, first), 0);
+        cursor = journal_cursor_load(path);
+        ck_assert_str_eq(cursor, first);
+        free(cursor);
+        unlink(path);
+}
+END_TEST
+
+START_TEST(oops_pattern_priority)
+{
+        struct {
+                const char *line;
+                const char *classification;
+        } cases[] = {
+                { "BUG: unable to handle kernel NULL pointer dereference\n",
+                  "org.clearlinux/kernel/bug" },
+                { "irq 16: nobody cared (try booting with the \"irqpoll\" option)\n",
+                  "crash/kernel/warning" },
+                { "alsa hda: BUG? (stream not running)\n", "crash/kernel/bug" },
+                { "ACPI Error: Method parse/execution failed\n",
+                  "org.clearlinux/kernel/warning" },
+                { "Kernel panic - not syncing: Fatal exception\n",
+                  "org.clearlinux/kernel/panic" },
+        };
+        struct oops_log_msg msg;
+        char buf[128];
+
+        oops_parser_cleanup();
+        oops_parser_init(callback_func);
+
+        for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+                snprintf(buf, sizeof(buf), "%s", cases[i].line);
+                ck_assert(handle_entire_oops(buf, (long)strlen(buf), &msg));
+                ck_assert_str_eq(msg.pattern->classification, cases[i].classification);
+                oops_msg_cleanup(&msg);
+        }
+
+        // The longest of the prefixes wins only when it comes first
+        snprintf(buf, sizeof(buf), "BUG: unable to handle kernel paging request\n");
+        ck_assert(handle_entire_oops(buf, (long)strlen(buf), &msg));
+        ck_assert_str_eq(msg.pattern->begin_line, "BUG: unable to handle kernel ");
+        oops_msg_cleanup(&msg);
+
+        snprintf(buf, sizeof(buf), "BUG unable to handle\n");
+        ck_assert(!handle_entire_oops(buf, (long)strlen(buf), &msg));
+        snprintf(buf, sizeof(buf), "ALSA hda: all good\n");
+        ck_assert(!handle_entire_oops(buf, (long)strlen(buf), &msg));
+}
+END_TEST
+
+/* Stack frame lines long enough that ARENA_FRAMES of them fill more than
+ * one block of the arena of an oops */
+#define ARENA_FRAMES 60
+#define ARENA_PADDING 160
+
+static char *arena_frame_line(int i)
+{
+        static char line[256];
+
+        snprintf(line, sizeof(line), " [<ffffffff81%06x>] arena_frame_%02d_%0*d+0x10/0x20",
+                 i, i, ARENA_PADDING, 0);
+        return line;
+}
+
+static int arena_calls;
+static int arena_length;
+static char *arena_first_line;
+static bool arena_lines_ok;
+
+static void arena_callback(struct oops_log_msg *msg)
+{
+        arena_calls++;
+        arena_length = msg->length;
+        arena_first_line = msg->lines[0];
+        arena_lines_ok = true;
+        for (int i = 0; i < msg->length; i++) {
+                if (strlen(msg->lines[i]) != msg->line_lengths[i]) {
+                        arena_lines_ok = false;
+                }
+        }
+        for (int i = 2; i < msg->length; i++) {
+                if (strcmp(msg->lines[i], arena_frame_line(i - 2)) != 0) {
+                        arena_lines_ok = false;
+                }
+        }
+        callback_func(msg);
+}
+
+static void arena_parse(const char *line)
+{
+        char buf[256];
+
+        snprintf(buf, sizeof(buf), "%s", line);
+        parse_single_message(buf, strlen(buf));
+}
+
+START_TEST(oops_arena_growth_and_reset)
+{
+        char name[64];
+        char *first;
+
+        oops_parser_cleanup();
+        oops_parser_init(arena_callback);
+        arena_calls = 0;
+        ck_assert(ARENA_FRAMES * strlen(arena_frame_line(0)) > OOPS_ARENA_BLOCK);
+
+        /* Lines copied past the first block are all kept */
+        arena_parse("WARNING: at kernel/arena.c:1 arena_test+0x1/0x2");
+        arena_parse("Call Trace:");
+        for (int i = 0; i < ARENA_FRAMES; i++) {
+                arena_parse(arena_frame_line(i));
+        }
+        arena_parse("---[ end trace 0000000000000000 ]---");
+        ck_assert_int_eq(arena_calls, 1);
+        ck_assert_int_eq(arena_length, ARENA_FRAMES + 2);
+        ck_assert(arena_lines_ok);
+        ck_assert_str_eq(reason, "WARNING: at kernel/arena.c:1 arena_test+0x1/0x2");
+        for (int i = 0; i < ARENA_FRAMES; i++) {
+                snprintf(name, sizeof(name), "arena_frame_%02d_", i);
+                ck_assert(strstr(pl->str, name));
+        }
+        nc_string_free(pl);
+
+        /* The next messages start over in the block kept by the reset */
+        arena_parse("WARNING: at kernel/arena.c:2 arena_test+0x1/0x2");
+        arena_parse("Call Trace:");
+        arena_parse(arena_frame_line(0));
+        arena_parse("---[ end trace 0000000000000000 ]---");
+        ck_assert_int_eq(arena_calls, 2);
+        ck_assert_int_eq(arena_length, 3);
+        ck_assert(arena_lines_ok);
+        ck_assert_str_eq(reason, "WARNING: at kernel/arena.c:2 arena_test+0x1/0x2");
+        ck_assert(strstr(pl->str, "arena_frame_00_"));
+        ck_assert(!strstr(pl->str, "arena_frame_01_"));
+        nc_string_free(pl);
+        first = arena_first_line;
+
+        arena_parse("WARNING: at kernel/arena.c:3 arena_test+0x1/0x2");
+        arena_parse("---[ end trace 0000000000000000 ]---");
+        ck_assert_int_eq(arena_calls, 3);
+        ck_assert_int_eq(arena_length, 1);
+        ck_assert_ptr_eq(arena_first_line, first);
+        ck_assert_str_eq(reason, "WARNING: at kernel/arena.c:3 arena_test+0x1/0x2");
+        nc_string_free(pl);
+
+        oops_parser_cleanup();
+}
+END_TEST
+
+START_TEST(oops_arena_large_entire_oops)
+{
+        struct oops_log_msg msg;
+        char name[64];
+        char *buf;
+        size_t size;
+        FILE *fp;
+
+        oops_parser_cleanup();
+        oops_parser_init(callback_func);
+
+        /* Parsed in the arena of the message, in more than one block; the
+         * last line has no newline and is copied there as well */
+        fp = open_memstream(&buf, &size);
+        ck_assert(fp != NULL);
+        fprintf(fp, "WARNING: at kernel/arena.c:4 arena_test+0x1/0x2\n");
+        fprintf(fp, "Call Trace:\n");
+        for (int i = 0; i < ARENA_FRAMES; i++) {
+                fprintf(fp, "%s%s", arena_frame_line(i), i < ARENA_FRAMES - 1 ? "\n" : "");
+        }
+        fclose(fp);
+        ck_assert(size > OOPS_ARENA_BLOCK);
+
+        ck_assert(handle_entire_oops(buf, (long)size, &msg));
+        ck_assert_int_eq(msg.length, ARENA_FRAMES + 2);
+        ck_assert_str_eq(msg.lines[ARENA_FRAMES + 1], arena_frame_line(ARENA_FRAMES - 1));
+        pl = parse_payload(&msg);
+        for (int i = 0; i < ARENA_FRAMES; i++) {
+                snprintf(name, sizeof(name), "#%d arena_frame_%02d_", i + 1, i);
+                ck_assert(strstr(pl->str, name));
+        }
+        nc_string_free(pl);
+        oops_msg_cleanup(&msg);
+        free(buf);
+}
+END_TEST
+
+START_TEST(symcache_lru)
+{
+        struct symcache cache;
+        const struct symcache_entry *entry;
+        uint8_t libc[20] = { 0xaa };
+        uint8_t app[20] = { 0xbb };
+
+        unlink("symcache.test");
+        ck_assert_int_eq(symcache_load(&cache, "symcache.test", 2), 0);
+        ck_assert_ptr_null(symcache_lookup(&cache, libc, sizeof(libc), 0x10));
+
+        ck_assert_int_eq(symcache_insert(&cache, libc, sizeof(libc), 0x10, "abort", "abort.c", 79), 0);
+        ck_assert_int_eq(symcache_insert(&cache, app, sizeof(app), 0x10, "main", "main.c", 12), 0);
+        ck_assert_int_eq(symcache_save(&cache, "symcache.test"), 0);
+        symcache_free(&cache);
+
+        // Resolved the same after a restart, keyed by build id and offset
+        ck_assert_int_eq(symcache_load(&cache, "symcache.test", 2), 0);
+        ck_assert_int_eq(cache.count, 2);
+        entry = symcache_lookup(&cache, libc, sizeof(libc), 0x10);
+        ck_assert_ptr_nonnull(entry);
+        ck_assert_str_eq(entry->function, "abort");
+        ck_assert_str_eq(entry->source, "abort.c");
+        ck_assert_int_eq(entry->line, 79);
+        ck_assert_ptr_null(symcache_lookup(&cache, libc, sizeof(libc), 0x11));
+
+        // main is the least recently used, and evicted when full
+        ck_assert_int_eq(symcache_insert(&cache, app, sizeof(app), 0x20, "run", "run.c", 3), 0);
+        ck_assert_int_eq(cache.count, 2);
+        ck_assert_ptr_null(symcache_lookup(&cache, app, sizeof(app), 0x10));
+        ck_assert_ptr_nonnull(symcache_lookup(&cache, app, sizeof(app), 0x20));
+        ck_assert_ptr_nonnull(symcache_lookup(&cache, libc, sizeof(libc), 0x10));
+        ck_assert_int_eq(symcache_save(&cache, "symcache.test"), 0);
+        symcache_free(&cache);
+
+        ck_assert_int_eq(symcache_load(&cache, "symcache.test", 2), 0);
+        ck_assert_ptr_nonnull(symcache_lookup(&cache, app, sizeof(app), 0x20));
+        symcache_free(&cache);
+        unlink("symcache.test");
+}
+END_TEST
+
+START_TEST(dedup_window)
+{
+        const char *crash = "Process: /usr/bin/app\nPID: 100\n\nBacktrace (TID 100):\n#0 abort()\n";
+        const char *again = "Process: /usr/bin/app\nPID: 215\n\nBacktrace (TID 216):\n#0 abort()\n";
+        const char *other = "Process: /usr/bin/app\nPID: 215\n\nBacktrace (TID 216):\n#0 exit()\n";
+        uint32_t occurrences;
+
+        unlink("dedup.test");
+
+        // Without a window, every crash is reported
+        ck_assert_int_eq(dedup_check("dedup.test", "a/b/c", crash, 0, 1000, &occurrences), 0);
+        ck_assert_int_eq(occurrences, 1);
+
+        ck_assert_int_eq(dedup_check("dedup.test", "a/b/c", crash, 60, 1000, &occurrences), 0);
+        ck_assert_int_eq(occurrences, 1);
+        // Same crash in another process, and in another class or backtrace
+        ck_assert_int_eq(dedup_check("dedup.test", "a/b/c", again, 60, 1010, &occurrences), 1);
+        ck_assert_int_eq(dedup_check("dedup.test", "a/b/c", again, 60, 1020, &occurrences), 1);
+        ck_assert_int_eq(dedup_check("dedup.test", "a/b/d", again, 60, 1020, &occurrences), 0);
+        ck_assert_int_eq(dedup_check("dedup.test", "a/b/c", other, 60, 1020, &occurrences), 0);
+
+        // The report after the window stands for the duplicates
+        ck_assert_int_eq(dedup_check("dedup.test", "a/b/c", crash, 60, 1060, &occurrences), 0);
+        ck_assert_int_eq(occurrences, 3);
+        ck_assert_int_eq(dedup_check("dedup.test", "a/b/c", crash, 60, 1070, &occurrences), 1);
+        unlink("dedup.test");
+}
+END_TEST
+
+START_TEST(nc_string_growth)
+{
+        nc_string *s = nc_string_dup("short");
+        char *inline_str;
+
+        ck_assert_ptr_nonnull(s);
+        inline_str = s->str;
+
+        // Appends that fit stay in the inline buffer
+        ck_assert_ptr_nonnull(nc_string_append_printf(s, " %d", 42));
+        ck_assert_str_eq(s->str, "short 42");
+        ck_assert_ptr_eq(s->str, inline_str);
+
+        // Then move to the heap, growing geometrically
+        for (int i = 0; i < 100; i++) {
+                ck_assert_ptr_nonnull(nc_string_append_printf(s, "%02d", i));
+        }
+        ck_assert_int_eq(s->len, 208);
+        ck_assert_ptr_ne(s->str, inline_str);
+        ck_assert_int_ge(s->cap, s->len + 1);
+        ck_assert(nc_string_has_suffix_const(s, "9899", 4));
+
+        // Text from the string itself may be prepended or appended
+        ck_assert(nc_string_prepend(s, s->str + s->len - 4));
+        ck_assert(nc_string_cat(s, s->str + s->len - 4));
+        ck_assert_int_eq(s->len, 216);
+        ck_assert(nc_string_has_prefix_const(s, "9899short 42", 12));
+        ck_assert(nc_string_has_suffix_const(s, "98999899", 8));
+        nc_string_free(s);
+
+        s = nc_string_dup("");
+        ck_assert(nc_string_reserve(s, 8192));
+        ck_assert_int_ge(s->cap, 8192);
+        inline_str = s->str;
+        ck_assert(nc_string_cat(s, "no realloc"));
+        ck_assert_ptr_eq(s->str, inline_str);
+        ck_assert_str_eq(s->str, "no realloc");
+        nc_string_free(s);
+}
+END_TEST
+
 Suite *config_suite(void)
 {
         // A suite is comprised of test cases, defined below
@@ -678,6 +1110,15 @@ Suite *config_suite(void)
         tcase_add_test(t, bad_page_map_payload);
         tcase_add_test(t, bug_kernel_handle_payload);
         tcase_add_test(t, bug_kernel_handle_payload_new_format);
+        tcase_add_test(t, kmsg_watchdog_payload);
+        tcase_add_test(t, kmsg_seq_resume);
+        tcase_add_test(t, journal_cursor_save_load);
+        tcase_add_test(t, oops_pattern_priority);
+        tcase_add_test(t, oops_arena_growth_and_reset);
+        tcase_add_test(t, oops_arena_large_entire_oops);
+        tcase_add_test(t, symcache_lru);
+        tcase_add_test(t, dedup_window);
+        tcase_add_test(t, nc_string_growth);
 
         //TODO fix
         //tcase_add_test(t, badness_payload);
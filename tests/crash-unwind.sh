@@ -0,0 +1,95 @@
+#!/bin/sh
+
+# This program is part of the Clear Linux Project
+#
+# Copyright 2019 Intel Corporation
+#
+# This program is free software; you can redistribute it and/or modify it under
+# the terms and conditions of the GNU Lesser General Public License, as
+# published by the Free Software Foundation; either version 2.1 of the License,
+# or (at your option) any later version.
+#
+# This program is distributed in the hope it will be useful, but WITHOUT ANY
+# WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+# A PARTICULAR PURPOSE. See the GNU Lesser General Public License for more
+# details.
+
+# Unwinds a multi-threaded core with crashprobe in one and in several worker
+# threads, and checks that every thread gets the same backtrace.
+
+. $srcdir/tests/taplib.sh
+
+crashprobe="$PWD/src/probes/crashprobe"
+helper="$PWD/tests/crash_threads"
+
+## BEGIN TESTS ##
+
+if [ "$(id -u)" = 0 ]; then
+  skip "crashprobe drops its privileges when run as root"
+  finish 0
+fi
+
+tmp=$(mktemp -d)
+trap 'rm -rf "$tmp"' EXIT
+
+# gcore dumps a running process whatever the core pattern is
+core=
+if command -v gcore >/dev/null 2>&1; then
+  "$helper" "$tmp/ready" &
+  pid=$!
+  n=0
+  while [ ! -f "$tmp/ready" ] && [ $n -lt 50 ]; do
+    sleep 0.1
+    n=$(expr $n + 1)
+  done
+  if gcore -o "$tmp/core" $pid >/dev/null 2>&1; then
+    core="$tmp/core.$pid"
+  fi
+  kill $pid
+  wait $pid 2>/dev/null
+elif [ "$(cat /proc/sys/kernel/core_pattern 2>/dev/null)" = "core" ]; then
+  (cd "$tmp" && ulimit -c unlimited && exec "$helper") >/dev/null 2>&1
+  core=$(ls "$tmp"/core* 2>/dev/null | head -n 1)
+fi
+
+if [ -z "$core" ] || [ ! -f "$core" ]; then
+  skip "cannot dump a core, needs gcore or a core pattern of \"core\""
+  finish 0
+fi
+pass "dumped a multi-threaded core"
+
+# The records go to a socket nobody listens on, -v still prints them
+sed "s|^socket_path=.*|socket_path=$tmp/socket|" \
+  $srcdir/src/data/example.conf > "$tmp/telemetrics.conf"
+
+# The backtraces of the payload, ordered by TID, the serial unwind follows the
+# order of the core
+unwind() {
+  "$crashprobe" -f "$tmp/telemetrics.conf" -c "$core" -p crash_threads \
+    -v -j $1 2>/dev/null |
+    awk '/^Backtrace \(TID /{ tid = $3 } NF && tid != "" { print tid " " $0 }' |
+    sort -s -n -k1,1 > "$tmp/bt.$1"
+}
+
+unwind 1
+threads=$(grep -c "Backtrace (TID" "$tmp/bt.1")
+if [ "$threads" -eq 5 ]; then
+  pass "serial unwind found the 5 threads"
+else
+  fail "serial unwind found $threads threads instead of 5"
+fi
+
+for jobs in 2 4 8; do
+  unwind $jobs
+  if cmp -s "$tmp/bt.1" "$tmp/bt.$jobs"; then
+    pass "$jobs workers give the serial backtraces"
+  else
+    fail "$jobs workers give other backtraces than the serial unwind"
+  fi
+done
+
+## END TESTS ##
+
+finish 0
+
+# vi: ts=8 sw=2 sts=2 et tw=80
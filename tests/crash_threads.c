@@ -0,0 +1,86 @@
+/*
+ * This program is part of the Clear Linux Project
+ *
+ * Copyright 2019 Intel Corporation
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms and conditions of the GNU Lesser General Public License, as
+ * published by the Free Software Foundation; either version 2.1 of the License,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU Lesser General Public License for more
+ * details.
+ */
+
+/*
+ * Parks THREADS threads at different call depths, so that each one has its
+ * own backtrace, for crash-unwind.sh. With a file argument the file is
+ * created and the process waits to be dumped, otherwise it aborts.
+ */
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#define THREADS 4
+
+static pthread_barrier_t parked;
+/* never set, the threads are parked until the process is killed */
+static volatile bool done = false;
+
+static void __attribute__((noinline)) park(int depth)
+{
+        volatile int frame = depth;
+
+        if (frame > 0) {
+                park(frame - 1);
+                // Not a tail call, every level keeps its frame
+                frame = 0;
+                return;
+        }
+        pthread_barrier_wait(&parked);
+        while (!done) {
+                pause();
+        }
+}
+
+static void *thread_run(void *arg)
+{
+        park((int)(long)arg);
+
+        return NULL;
+}
+
+int main(int argc, char **argv)
+{
+        pthread_t thread;
+        int fd;
+
+        pthread_barrier_init(&parked, NULL, THREADS + 1);
+        for (long i = 0; i < THREADS; i++) {
+                if (pthread_create(&thread, NULL, thread_run, (void *)(i + 1)) != 0) {
+                        return EXIT_FAILURE;
+                }
+        }
+        pthread_barrier_wait(&parked);
+
+        if (argc < 2) {
+                abort();
+        }
+        fd = open(argv[1], O_WRONLY | O_CREAT | O_EXCL, 0600);
+        if (fd < 0) {
+                return EXIT_FAILURE;
+        }
+        close(fd);
+        while (!done) {
+                pause();
+        }
+
+        return EXIT_SUCCESS;
+}
+
+/* vi: set ts=8 sw=8 sts=4 et tw=80 cino=(0: */
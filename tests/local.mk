@@ -8,19 +8,36 @@ tap_driver = env AM_TAP_AWK='$(AWK)' $(SHELL) \
 LOG_DRIVER = $(tap_driver)
 SH_LOG_DRIVER = $(tap_driver)
 
-TESTS = $(check_PROGRAMS) $(dist_check_SCRIPTS)
+TESTS = $(check_tests) $(dist_check_SCRIPTS)
 
-check_PROGRAMS = \
+check_tests = \
 	%D%/check_config \
 	%D%/check_probd \
 	%D%/check_postd \
 	%D%/check_probes \
 	%D%/check_ncb64  \
 	%D%/check_journal \
-	%D%/check_libtelemetry
+	%D%/check_libtelemetry \
+	%D%/check_hashmap \
+	%D%/check_hashmap_open
+
+# Programs the test scripts run
+check_PROGRAMS = \
+	$(check_tests) \
+	%D%/crash_threads
 
 dist_check_SCRIPTS = \
-	%D%/create-core.sh
+	%D%/create-core.sh \
+	%D%/crash-unwind.sh
+
+%C%_crash_threads_SOURCES = \
+	%D%/crash_threads.c
+
+%C%_crash_threads_CFLAGS = \
+	$(AM_CFLAGS)
+
+%C%_crash_threads_LDADD = \
+	@PTHREAD_LIBS@
 
 %C%_check_config_SOURCES = \
 	%D%/check_config.c
@@ -46,17 +63,28 @@ endif
 	src/telemdaemon.h \
 	src/iorecord.h \
 	src/iorecord.c \
+	src/staginglog.c \
+	src/staginglog.h \
+	src/ringbuf.c \
+	src/ringbuf.h \
 	src/journal/journal.c \
-	src/journal/journal.h
+	src/journal/journal.h \
+	src/recordpack.c \
+	src/recordpack.h \
+	src/heartbeat.c \
+	src/heartbeat.h
 
 %C%_check_probd_CFLAGS = \
 	$(AM_CFLAGS) \
 	@CHECK_CFLAGS@ \
-	@CURL_CFLAGS@
+	@CURL_CFLAGS@ \
+	@ZLIB_CFLAGS@
 %C%_check_probd_LDADD = \
 	@CHECK_LIBS@ \
 	@CURL_LIBS@ \
-	$(top_builddir)/src/libtelem-shared.la
+	@ZLIB_LIBS@ \
+	$(top_builddir)/src/libtelem-shared.la \
+	@PTHREAD_LIBS@
 
 if LOG_SYSTEMD
 if HAVE_SYSTEMD_JOURNAL
@@ -72,6 +100,36 @@ endif
 	src/spool.c \
 	src/iorecord.c \
 	src/retention.c \
+	src/recordpack.c \
+	src/recordpack.h \
+	src/staginglog.c \
+	src/staginglog.h \
+	src/ringbuf.c \
+	src/ringbuf.h \
+	src/postmulti.c \
+	src/postmulti.h \
+	src/postbatch.c \
+	src/postbatch.h \
+	src/compress.c \
+	src/compress.h \
+	src/retrysched.c \
+	src/retrysched.h \
+	src/classlimit.c \
+	src/classlimit.h \
+	src/poststate.c \
+	src/poststate.h \
+	src/spoolusage.c \
+	src/spoolusage.h \
+	src/destination.c \
+	src/destination.h \
+	src/aggregate.c \
+	src/aggregate.h \
+	src/archive.c \
+	src/archive.h \
+	src/recordio.c \
+	src/recordio.h \
+	src/stagepool.c \
+	src/stagepool.h \
         src/telempostdaemon.c \
         src/telempostdaemon.h \
         src/journal/journal.c \
@@ -86,11 +144,14 @@ EXTRA_DIST += \
 %C%_check_postd_CFLAGS = \
         $(AM_CFLAGS) \
         @CHECK_CFLAGS@ \
-        @CURL_CFLAGS@
+        @CURL_CFLAGS@ \
+        @ZLIB_CFLAGS@
 %C%_check_postd_LDADD = \
         @CHECK_LIBS@ \
         @CURL_LIBS@ \
-        $(top_builddir)/src/libtelem-shared.la
+        @ZLIB_LIBS@ \
+        $(top_builddir)/src/libtelem-shared.la \
+        @PTHREAD_LIBS@
 
 if LOG_SYSTEMD
 if HAVE_SYSTEMD_JOURNAL
@@ -101,6 +162,13 @@ if HAVE_SYSTEMD_JOURNAL
 endif
 endif
 
+if HAVE_IO_URING
+%C%_check_postd_CFLAGS += \
+        $(URING_CFLAGS)
+%C%_check_postd_LDADD += \
+        $(URING_LIBS)
+endif
+
 %C%_check_probes_SOURCES = \
         %D%/read_oopsfile.h \
         %D%/read_oopsfile.c \
@@ -108,8 +176,16 @@ endif
 	src/nica/nc-string.c \
 	src/probes/klog_scanner.c \
 	src/probes/klog_scanner.h \
+	src/probes/dedup.c \
+	src/probes/dedup.h \
+	src/probes/journal_cursor.c \
+	src/probes/journal_cursor.h \
 	src/probes/oops_parser.c \
-	src/probes/oops_parser.h 
+	src/probes/oops_parser.h \
+	src/probes/probe_record.c \
+	src/probes/probe_record.h \
+	src/probes/symcache.c \
+	src/probes/symcache.h
 
 EXTRA_DIST += \
 	%D%/oops_test_files/2or3_digit_loglevel.txt \
@@ -177,15 +253,23 @@ EXTRA_DIST += \
 %C%_check_journal_SOURCES = \
 	%D%/check_journal.c \
 	src/journal/journal.c \
+	src/recordpack.c \
+	src/recordpack.h \
 	src/util.h \
-	src/util.c
+	src/util.c \
+	src/common.h \
+	src/common.c \
+	src/validate.h \
+	src/validate.c
 
 %C%_check_journal_CFLAGS = \
 	$(AM_CFLAGS) \
-	@CHECK_CFLAGS@
+	@CHECK_CFLAGS@ \
+	@ZLIB_CFLAGS@
 
 %C%_check_journal_LDADD = \
-	@CHECK_LIBS@
+	@CHECK_LIBS@ \
+	@ZLIB_LIBS@
 
 if HAVE_SYSTEMD_JOURNAL
 if LOG_SYSTEMD
@@ -216,4 +300,210 @@ if LOG_SYSTEMD
 endif
 endif
 
+%C%_check_hashmap_SOURCES = \
+	%D%/check_hashmap.c \
+	src/nica/hashmap.c \
+	src/nica/hashmap.h
+
+%C%_check_hashmap_CFLAGS = \
+	$(AM_CFLAGS) \
+	@CHECK_CFLAGS@
+
+%C%_check_hashmap_LDADD = \
+	@CHECK_LIBS@
+
+%C%_check_hashmap_open_SOURCES = \
+	%D%/check_hashmap.c \
+	src/nica/hashmap-open.c \
+	src/nica/hashmap.h
+
+%C%_check_hashmap_open_CFLAGS = \
+	$(AM_CFLAGS) \
+	@CHECK_CFLAGS@
+
+%C%_check_hashmap_open_LDADD = \
+	@CHECK_LIBS@
+
+# Microbenchmarks, not run by "make check": "make bench" runs all of them,
+# "make bench-hashmap" and "make bench-b64" some. Each prints one line per
+# result, of space separated fields ending with nanoseconds per operation.
+EXTRA_PROGRAMS = \
+	%D%/bench_hashmap_chained \
+	%D%/bench_hashmap_open \
+	%D%/bench_b64 \
+	%D%/bench_probd \
+	%D%/bench_postd \
+	%D%/bench_journal \
+	%D%/bench_oops
+
+%C%_bench_hashmap_chained_SOURCES = \
+	%D%/bench_hashmap.c \
+	src/nica/hashmap.c \
+	src/nica/hashmap.h
+
+%C%_bench_hashmap_chained_CFLAGS = \
+	$(AM_CFLAGS) \
+	-DHASHMAP_IMPL='"chained"'
+
+%C%_bench_hashmap_open_SOURCES = \
+	%D%/bench_hashmap.c \
+	src/nica/hashmap-open.c \
+	src/nica/hashmap.h
+
+%C%_bench_hashmap_open_CFLAGS = \
+	$(AM_CFLAGS) \
+	-DHASHMAP_IMPL='"open"'
+
+%C%_bench_b64_SOURCES = \
+	%D%/bench_b64.c \
+	src/nica/b64enc.c \
+	src/nica/b64enc.h
+
+%C%_bench_b64_CFLAGS = \
+	$(AM_CFLAGS)
+
+%C%_bench_probd_SOURCES = \
+	%D%/bench_probd.c \
+	src/telemdaemon.c \
+	src/telemdaemon.h \
+	src/iorecord.h \
+	src/iorecord.c \
+	src/staginglog.c \
+	src/staginglog.h \
+	src/ringbuf.c \
+	src/ringbuf.h \
+	src/journal/journal.c \
+	src/journal/journal.h \
+	src/recordpack.c \
+	src/recordpack.h \
+	src/heartbeat.c \
+	src/heartbeat.h
+
+%C%_bench_probd_CFLAGS = \
+	$(AM_CFLAGS) \
+	@CURL_CFLAGS@ \
+	@ZLIB_CFLAGS@
+%C%_bench_probd_LDADD = \
+	@CURL_LIBS@ \
+	@ZLIB_LIBS@ \
+	$(top_builddir)/src/libtelemetry.la \
+	$(top_builddir)/src/libtelem-shared.la \
+	@PTHREAD_LIBS@
+
+%C%_bench_postd_SOURCES = \
+	%D%/bench_postd.c \
+	src/spool.c \
+	src/iorecord.c \
+	src/retention.c \
+	src/recordpack.c \
+	src/recordpack.h \
+	src/staginglog.c \
+	src/staginglog.h \
+	src/ringbuf.c \
+	src/ringbuf.h \
+	src/postmulti.c \
+	src/postmulti.h \
+	src/postbatch.c \
+	src/postbatch.h \
+	src/compress.c \
+	src/compress.h \
+	src/retrysched.c \
+	src/retrysched.h \
+	src/classlimit.c \
+	src/classlimit.h \
+	src/poststate.c \
+	src/poststate.h \
+	src/spoolusage.c \
+	src/spoolusage.h \
+	src/destination.c \
+	src/destination.h \
+	src/aggregate.c \
+	src/aggregate.h \
+	src/recordio.c \
+	src/recordio.h \
+	src/stagepool.c \
+	src/stagepool.h \
+	src/telempostdaemon.c \
+	src/telempostdaemon.h \
+	src/journal/journal.c \
+	src/journal/journal.h
+
+%C%_bench_postd_CFLAGS = \
+	$(AM_CFLAGS) \
+	@CURL_CFLAGS@ \
+	@ZLIB_CFLAGS@
+%C%_bench_postd_LDADD = \
+	@CURL_LIBS@ \
+	@ZLIB_LIBS@ \
+	$(top_builddir)/src/libtelem-shared.la \
+	@PTHREAD_LIBS@
+
+if HAVE_IO_URING
+%C%_bench_postd_CFLAGS += \
+	$(URING_CFLAGS)
+%C%_bench_postd_LDADD += \
+	$(URING_LIBS)
+endif
+
+%C%_bench_journal_SOURCES = \
+	%D%/bench_journal.c \
+	src/journal/journal.c \
+	src/journal/journal.h \
+	src/recordpack.c \
+	src/recordpack.h
+
+%C%_bench_journal_CFLAGS = \
+	$(AM_CFLAGS) \
+	@ZLIB_CFLAGS@
+%C%_bench_journal_LDADD = \
+	@ZLIB_LIBS@ \
+	$(top_builddir)/src/libtelem-shared.la
+
+%C%_bench_oops_SOURCES = \
+	%D%/bench_oops.c \
+	src/nica/nc-string.c \
+	src/probes/klog_scanner.c \
+	src/probes/klog_scanner.h \
+	src/probes/dedup.c \
+	src/probes/dedup.h \
+	src/probes/oops_parser.c \
+	src/probes/oops_parser.h \
+	src/probes/probe_record.c \
+	src/probes/probe_record.h \
+	src/probes/symcache.c \
+	src/probes/symcache.h
+
+%C%_bench_oops_CFLAGS = \
+	$(AM_CFLAGS)
+%C%_bench_oops_LDADD = \
+	$(top_builddir)/src/libtelemetry.la \
+	$(top_builddir)/src/libtelem-shared.la
+
+if LOG_SYSTEMD
+if HAVE_SYSTEMD_JOURNAL
+%C%_bench_probd_LDADD += $(SYSTEMD_JOURNAL_LIBS)
+%C%_bench_postd_LDADD += $(SYSTEMD_JOURNAL_LIBS)
+%C%_bench_journal_LDADD += $(SYSTEMD_JOURNAL_LIBS)
+%C%_bench_oops_LDADD += $(SYSTEMD_JOURNAL_LIBS)
+endif
+endif
+
+CLEANFILES = $(EXTRA_PROGRAMS)
+
+bench-hashmap: %D%/bench_hashmap_chained %D%/bench_hashmap_open
+	%D%/bench_hashmap_chained
+	%D%/bench_hashmap_open
+
+bench-b64: %D%/bench_b64
+	%D%/bench_b64
+
+bench: bench-hashmap bench-b64 %D%/bench_probd %D%/bench_postd %D%/bench_journal \
+		%D%/bench_oops
+	%D%/bench_probd
+	%D%/bench_postd
+	%D%/bench_journal
+	%D%/bench_oops
+
+.PHONY: bench bench-hashmap bench-b64
+
 # vim: filetype=automake tabstop=8 shiftwidth=8 noexpandtab